@@ -0,0 +1,262 @@
+/**
+ * @file batch.c
+ * @brief Runs several cmdfu actions on one connection to the client.
+ *
+ * The actions are read from a script with one action and its options per
+ * line, e.g.
+ *
+ *     client-info
+ *     update --image app.img --skip-if-identical
+ *     dump --image readback.img
+ *     verify --image app.img
+ *     change-mode
+ *
+ * The tool is set up and connected once with the tool options of the batch
+ * command line, and the client information is requested once for all
+ * actions instead of once per action. The actions run in script order and
+ * the batch stops at the first action that fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "mdfu/logging.h"
+#include "cmdfu.h"
+
+extern int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new_argv);
+
+/**
+ * @brief Action from the script.
+ */
+typedef struct {
+    int line_number;
+    action_t action;
+    /** @brief Copy of the line that the arguments point into. */
+    char *arguments;
+    /** @brief Argument vector of the action options, argv[0] is the action name. */
+    char **argv;
+    int argc;
+} batch_step_t;
+
+/**
+ * @brief Batch state.
+ */
+struct batch {
+    batch_step_t *steps;
+    int step_count;
+};
+
+static const struct {
+    const char *name;
+    action_t action;
+} batch_actions[] = {
+    {"client-info", ACTION_CLIENT_INFO},
+    {"update", ACTION_UPDATE},
+    {"dump", ACTION_DUMP},
+    {"verify", ACTION_VERIFY},
+    {"change-mode", ACTION_CHANGE_MODE}
+};
+
+/**
+ * @brief Parse a script line into a step.
+ *
+ * @return int 1 if a step was added, 0 for empty lines and -1 on error.
+ */
+static int parse_step(struct batch *batch, char *line, int line_number){
+    batch_step_t *step;
+    batch_step_t *steps;
+    char *comment = strchr(line, '#');
+    char *token;
+    char *save;
+    size_t length;
+    size_t i;
+
+    if(NULL != comment){
+        *comment = '\0';
+    }
+    length = strlen(line);
+    while(length > 0 && NULL != strchr(" \t\r\n", line[length - 1])){
+        line[--length] = '\0';
+    }
+    line += strspn(line, " \t");
+    if('\0' == *line){
+        return 0;
+    }
+    steps = realloc(batch->steps, (size_t) (batch->step_count + 1) * sizeof(batch_step_t));
+    if(NULL == steps){
+        return -1;
+    }
+    batch->steps = steps;
+    step = &steps[batch->step_count];
+    memset(step, 0, sizeof(*step));
+    step->line_number = line_number;
+    step->arguments = strdup(line);
+    // At most one argument per two characters plus NULL
+    step->argv = malloc((length / 2 + 2) * sizeof(char *));
+    batch->step_count += 1;
+    if(NULL == step->arguments || NULL == step->argv){
+        return -1;
+    }
+    for(token = strtok_r(step->arguments, " \t", &save); NULL != token; token = strtok_r(NULL, " \t", &save)){
+        step->argv[step->argc++] = token;
+    }
+    step->argv[step->argc] = NULL;
+    for(i = 0; i < sizeof(batch_actions) / sizeof(batch_actions[0]); i++){
+        if(0 == strcmp(step->argv[0], batch_actions[i].name)){
+            step->action = batch_actions[i].action;
+            return 1;
+        }
+    }
+    ERROR("Script line %d: \"%s\" is not an action that can run in a batch", line_number, step->argv[0]);
+    return -1;
+}
+
+/**
+ * @brief Read all steps from the script file, "-" reads the standard input.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int read_script(struct batch *batch, const char *path){
+    FILE *file = 0 == strcmp(path, "-") ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    int status = 0;
+
+    if(NULL == file){
+        ERROR("Opening script %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    while(getline(&line, &size, file) >= 0){
+        line_number += 1;
+        if(parse_step(batch, line, line_number) < 0){
+            status = -1;
+            break;
+        }
+    }
+    free(line);
+    if(stdin != file){
+        fclose(file);
+    }
+    if(0 == status && 0 == batch->step_count){
+        ERROR("Script %s does not contain any actions", path);
+        status = -1;
+    }
+    return status;
+}
+
+/**
+ * @brief Parse the options of a step into the global arguments.
+ *
+ * The options of the previous step are reset first. Tool options are not
+ * accepted, the tool is set up once by the batch.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int parse_step_arguments(batch_step_t *step){
+    char **tool_argv;
+    int tool_argc;
+    int status = 0;
+
+    args.image = NULL;
+    args.skip_if_identical = false;
+    args.frame_cache = NULL;
+    args.expect_sha256 = NULL;
+    if(ACTION_CLIENT_INFO == step->action || ACTION_CHANGE_MODE == step->action){
+        if(step->argc > 1){
+            ERROR("Script line %d: %s does not have options", step->line_number, step->argv[0]);
+            return -1;
+        }
+        return 0;
+    }
+    tool_argv = malloc((size_t) (step->argc + 1) * sizeof(char *));
+    if(NULL == tool_argv){
+        return -1;
+    }
+    if(parse_mdfu_update_arguments(step->argc, step->argv, &tool_argc, tool_argv) < 0){
+        status = -1;
+    } else if(tool_argc > 1){
+        ERROR("Script line %d: %s is not an option of %s, tool options belong on the batch command line",
+            step->line_number, tool_argv[1], step->argv[0]);
+        status = -1;
+    }
+    free(tool_argv);
+    return status;
+}
+
+/**
+ * @brief Run one step on the opened session.
+ *
+ * @return int Exit status of the action.
+ */
+static int run_step(batch_step_t *step, mdfu_session_t *session, transport_t *transport){
+    if(parse_step_arguments(step) < 0){
+        return -1;
+    }
+    INFO("Running %s from script line %d", step->argv[0], step->line_number);
+    switch(step->action){
+        case ACTION_CLIENT_INFO:
+            return session_client_info(session);
+        case ACTION_UPDATE:
+            return session_update(session, transport);
+        case ACTION_DUMP:
+            return session_dump(session);
+        case ACTION_VERIFY:
+            return session_verify(session);
+        case ACTION_CHANGE_MODE:
+            return session_change_mode(session);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief Free the batch state.
+ */
+static void free_batch(struct batch *batch){
+    for(int i = 0; i < batch->step_count; i++){
+        free(batch->steps[i].arguments);
+        free(batch->steps[i].argv);
+    }
+    free(batch->steps);
+}
+
+/**
+ * @brief Run the actions of a script on one connection to the client.
+ *
+ * The whole script is read before the client is connected, so that a script
+ * with an unknown action does not run any action.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The tool argument vector.
+ * @return Exit status of the first action that failed, 0 if all actions succeeded.
+ */
+int mdfu_batch(int argc, char **argv){
+    struct batch batch = {0};
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+    int status = 0;
+
+    if(read_script(&batch, args.script) < 0 ||
+        open_session(argc, argv, &session, &transport, &tool_conf) < 0){
+        free_batch(&batch);
+        return -1;
+    }
+    // Showing the client information requires asking the client
+    if(ACTION_CLIENT_INFO != batch.steps[0].action){
+        load_client_info(session);
+    }
+    for(int i = 0; 0 == status && i < batch.step_count; i++){
+        status = run_step(&batch.steps[i], session, transport);
+        if(0 != status){
+            ERROR("Batch stopped at script line %d", batch.steps[i].line_number);
+        }
+    }
+    store_client_info(session, status);
+    report_stats(session);
+    close_session(session, tool_conf);
+    free_batch(&batch);
+    return status;
+}
@@ -0,0 +1,426 @@
+/**
+ * @file bench_link.c
+ * @brief Measures the link to a MDFU client and recommends tool settings.
+ *
+ * The link is measured with commands that do not change the client: a number
+ * of GET_CLIENT_INFO round trips and optionally a dump of the first chunks
+ * of the client firmware, which is discarded. For tools with a configurable
+ * link speed, the serial and usb baud rate and the spidev clock speed, each
+ * candidate speed is measured on its own connection with the tool option
+ * replaced, and the fastest candidate without integrity errors and retries is
+ * recommended.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+#include "cmdfu.h"
+
+/**
+ * @def BENCH_MAX_CANDIDATES
+ * @brief Maximum number of link speeds that are measured.
+ */
+#define BENCH_MAX_CANDIDATES 32
+
+/**
+ * @brief Baud rates that are measured for the serial and usb tools, slowest first.
+ */
+static const long default_baudrates[] = {
+    115200, 230400, 460800, 921600, 1000000, 2000000, 3000000
+};
+
+/**
+ * @brief Clock speeds that are measured for the spidev tool, slowest first.
+ */
+static const long default_clock_speeds[] = {
+    1000000, 2000000, 4000000, 8000000, 10000000, 16000000
+};
+
+/**
+ * @brief Measurement of one link speed.
+ */
+typedef struct {
+    /** @brief Baud rate or clock speed, 0 if the tool options are used as given. */
+    long speed;
+    /** @brief All commands of the candidate were successful. */
+    bool success;
+    /** @brief Round trip time percentiles of GET_CLIENT_INFO in seconds. */
+    float rtt_p50;
+    float rtt_p90;
+    float rtt_p99;
+    float rtt_max;
+    /** @brief READ_CHUNK payload bytes per second, 0 if no chunks were dumped. */
+    double throughput;
+    /** @brief Responses that failed the integrity check and valid responses. */
+    uint64_t integrity_errors;
+    uint64_t frames_received;
+    /** @brief Retries of all causes and command attempts. */
+    uint32_t retries;
+    uint32_t attempts;
+    /** @brief Response polls where the client was still busy and all polls. */
+    uint64_t busy_polls;
+    uint64_t polls;
+    /** @brief Inter transaction delay in ns that the client requested. */
+    uint32_t inter_transaction_delay;
+} bench_result_t;
+
+/**
+ * @brief Image writer that discards the dumped chunks.
+ */
+static int discard_open(const char *fpath){
+    (void) fpath;
+    return 0;
+}
+
+static int discard_close(void){
+    return 0;
+}
+
+static ssize_t discard_write(void *data, size_t size){
+    (void) data;
+    return (ssize_t) size;
+}
+
+static image_writer_t discard_writer = {
+    .open = discard_open,
+    .close = discard_close,
+    .write = discard_write,
+    .reserve = NULL,
+    .commit = NULL
+};
+
+/**
+ * @brief Returns the tool option that sets the link speed.
+ *
+ * @return const char* Option name, NULL if the tool has no link speed option.
+ */
+static const char *speed_option(void){
+    switch(args.tool){
+#ifdef USE_TOOL_SERIAL
+        case TOOL_SERIAL:
+            return "--baudrate";
+#endif
+#ifdef USE_TOOL_USB
+        case TOOL_USB:
+            return "--baudrate";
+#endif
+#ifdef USE_TOOL_SPI
+        case TOOL_SPIDEV:
+            return "--clk-speed";
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief Sets the link speeds that are measured from --sweep or the tool defaults.
+ *
+ * @param option Tool option that sets the link speed, NULL if there is none.
+ * @param[out] speeds Link speeds.
+ * @return int Number of link speeds, -1 on error.
+ */
+static int get_candidates(const char *option, long *speeds){
+    const long *defaults = default_baudrates;
+    int count = (int) (sizeof(default_baudrates) / sizeof(default_baudrates[0]));
+    const char *next = args.bench_sweep;
+    char *end;
+
+    if(NULL == option){
+        if(NULL != args.bench_sweep){
+            ERROR("The %s tool has no baud rate or clock speed to sweep", tool_names[args.tool]);
+            return -1;
+        }
+        speeds[0] = 0;
+        return 1;
+    }
+    if(NULL == args.bench_sweep){
+        if(0 == strcmp(option, "--clk-speed")){
+            defaults = default_clock_speeds;
+            count = (int) (sizeof(default_clock_speeds) / sizeof(default_clock_speeds[0]));
+        }
+        memcpy(speeds, defaults, (size_t) count * sizeof(long));
+        return count;
+    }
+    count = 0;
+    while(true){
+        errno = 0;
+        speeds[count] = strtol(next, &end, 10);
+        if(end == next || 0 != errno || speeds[count] <= 0 || (',' != *end && '\0' != *end)){
+            ERROR("Invalid --sweep %s", args.bench_sweep);
+            return -1;
+        }
+        count++;
+        if('\0' == *end){
+            return count;
+        }
+        if(BENCH_MAX_CANDIDATES == count){
+            ERROR("--sweep has more than %d rates", BENCH_MAX_CANDIDATES);
+            return -1;
+        }
+        next = end + 1;
+    }
+}
+
+/**
+ * @brief Builds the tool arguments of a candidate.
+ *
+ * The link speed option of the given tool arguments is replaced with the
+ * speed of the candidate.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The tool argument vector, argv[0] is not a tool option.
+ * @param option Tool option that sets the link speed, NULL to keep the arguments.
+ * @param value Link speed option argument.
+ * @param[out] candidate_argv Argument vector of the candidate, with room for argc + 2 arguments.
+ * @return int Number of arguments of the candidate.
+ */
+static int build_tool_arguments(int argc, char **argv, const char *option, char *value, char **candidate_argv){
+    size_t length = (NULL == option) ? 0 : strlen(option);
+    int count = 0;
+
+    for(int i = 0; i < argc; i++){
+        if(i > 0 && NULL != option && 0 == strncmp(argv[i], option, length)){
+            if('\0' == argv[i][length]){
+                // Skip the option argument too
+                i++;
+                continue;
+            }
+            if('=' == argv[i][length]){
+                continue;
+            }
+        }
+        candidate_argv[count++] = argv[i];
+    }
+    if(NULL != option){
+        candidate_argv[count++] = (char *) option;
+        candidate_argv[count++] = value;
+    }
+    candidate_argv[count] = NULL;
+    return count;
+}
+
+static int compare_float(const void *a, const void *b){
+    float x = *(const float *) a;
+    float y = *(const float *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns a percentile of sorted samples with the nearest rank method.
+ *
+ * @param samples Sorted samples.
+ * @param count Number of samples, at least one.
+ * @param percent Percentile.
+ * @return float Percentile of the samples.
+ */
+static float percentile(const float *samples, int count, int percent){
+    int rank = (count * percent + 99) / 100;
+
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Measures the link with the tool options of one candidate.
+ *
+ * @param argc The number of tool arguments of the candidate.
+ * @param argv The tool argument vector of the candidate.
+ * @param rtts Buffer for args.bench_rounds round trip times.
+ * @param[out] result Measurement, success is false if a command failed.
+ */
+static void measure_candidate(int argc, char **argv, float *rtts, bench_result_t *result){
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+    client_info_t client_info;
+    mdfu_stats_t stats;
+    timeout_t start;
+    float elapsed;
+
+    if(open_session(argc, argv, &session, &transport, &tool_conf) < 0){
+        return;
+    }
+    // Configures the session for the client like any other action
+    if(mdfu_session_get_client_info(session, &client_info) < 0){
+        ERROR("Failed to get client info");
+        goto exit;
+    }
+    result->inter_transaction_delay = client_info.inter_transaction_delay;
+    for(int i = 0; i < args.bench_rounds; i++){
+        set_timeout(&start, 0);
+        if(mdfu_get_client_info(session, &client_info) < 0){
+            ERROR("Failed to get client info");
+            goto exit;
+        }
+        rtts[i] = timeout_elapsed(&start);
+    }
+    qsort(rtts, (size_t) args.bench_rounds, sizeof(float), compare_float);
+    result->rtt_p50 = percentile(rtts, args.bench_rounds, 50);
+    result->rtt_p90 = percentile(rtts, args.bench_rounds, 90);
+    result->rtt_p99 = percentile(rtts, args.bench_rounds, 99);
+    result->rtt_max = rtts[args.bench_rounds - 1];
+    if(args.bench_chunks > 0){
+        set_timeout(&start, 0);
+        if(mdfu_run_dump_chunks(session, &discard_writer, args.bench_chunks) < 0){
+            ERROR("Firmware dump failed");
+            goto exit;
+        }
+        elapsed = timeout_elapsed(&start);
+        mdfu_get_stats(session, &stats);
+        if(elapsed > 0){
+            result->throughput = (double) stats.cmd[READ_CHUNK].data_bytes / elapsed;
+        }
+    }
+    result->success = true;
+
+    exit:
+    mdfu_get_stats(session, &stats);
+    result->integrity_errors = stats.transport.integrity_errors;
+    result->frames_received = stats.transport.frames_received;
+    result->busy_polls = stats.transport.busy_polls;
+    result->polls = stats.transport.polls;
+    result->retries = stats.retries_timeout + stats.retries_integrity +
+        stats.retries_transport + stats.retries_resend;
+    for(int cause = 0; cause < MAX_CMD_NOT_EXECUTED_ERROR_CAUSE; cause++){
+        result->retries += stats.retries_not_executed[cause];
+    }
+    for(int cmd = 1; cmd < MAX_MDFU_CMD; cmd++){
+        result->attempts += stats.cmd[cmd].attempts;
+    }
+    report_stats(session);
+    close_session(session, tool_conf);
+}
+
+/**
+ * @brief Returns the share of a count in a total in percent.
+ */
+static double share(uint64_t count, uint64_t total){
+    return total > 0 ? 100.0 * (double) count / (double) total : 0.0;
+}
+
+/**
+ * @brief Prints the measurement of a candidate as table row.
+ *
+ * @param result Measurement.
+ */
+static void print_result(const bench_result_t *result){
+    char speed[24] = "as given";
+
+    if(result->speed > 0){
+        snprintf(speed, sizeof(speed), "%ld", result->speed);
+    }
+    if(!result->success){
+        printf("%-10s failed, integrity errors %" PRIu64 ", retries %" PRIu32 "\n",
+            speed, result->integrity_errors, result->retries);
+        return;
+    }
+    printf("%-10s %8.3f %8.3f %8.3f %8.3f %12.0f %10.2f %8.2f %8.2f\n", speed,
+        result->rtt_p50 * 1e3f, result->rtt_p90 * 1e3f, result->rtt_p99 * 1e3f, result->rtt_max * 1e3f,
+        result->throughput,
+        share(result->integrity_errors, result->integrity_errors + result->frames_received),
+        share(result->retries, result->attempts),
+        share(result->busy_polls, result->polls));
+}
+
+/**
+ * @brief Checks if a measurement is better than the best one so far.
+ *
+ * Candidates without integrity errors and retries are preferred, then the
+ * dump throughput decides, or the median round trip time when no chunks
+ * were dumped.
+ *
+ * @param result Measurement.
+ * @param best Best measurement so far, NULL if there is none.
+ * @return true if the measurement is better.
+ */
+static bool is_better(const bench_result_t *result, const bench_result_t *best){
+    bool clean = 0 == result->integrity_errors && 0 == result->retries;
+    bool best_clean;
+
+    if(!result->success){
+        return false;
+    }
+    if(NULL == best){
+        return true;
+    }
+    best_clean = 0 == best->integrity_errors && 0 == best->retries;
+    if(clean != best_clean){
+        return clean;
+    }
+    if(args.bench_chunks > 0){
+        return result->throughput > best->throughput;
+    }
+    return result->rtt_p50 < best->rtt_p50;
+}
+
+/**
+ * @brief Measures the link to the client for each candidate link speed and
+ * prints the best tool settings.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The tool argument vector, argv[0] is not a tool option.
+ * @return int 0 if at least one candidate worked, -1 otherwise.
+ */
+int mdfu_bench_link(int argc, char **argv){
+    const char *option = speed_option();
+    long speeds[BENCH_MAX_CANDIDATES];
+    bench_result_t results[BENCH_MAX_CANDIDATES];
+    const bench_result_t *best = NULL;
+    char **candidate_argv;
+    char value[16];
+    float *rtts;
+    int count;
+
+    count = get_candidates(option, speeds);
+    if(count < 0){
+        return -1;
+    }
+    candidate_argv = malloc((size_t) (argc + 3) * sizeof(char *));
+    rtts = malloc((size_t) args.bench_rounds * sizeof(float));
+    if(NULL == candidate_argv || NULL == rtts){
+        ERROR("Out of memory");
+        free(candidate_argv);
+        free(rtts);
+        return -1;
+    }
+    memset(results, 0, sizeof(results));
+    for(int i = 0; i < count; i++){
+        int candidate_argc;
+
+        snprintf(value, sizeof(value), "%ld", speeds[i]);
+        results[i].speed = speeds[i];
+        if(NULL != option){
+            INFO("Measuring %s %s", option, value);
+        }
+        candidate_argc = build_tool_arguments(argc, argv, option, value, candidate_argv);
+        measure_candidate(candidate_argc, candidate_argv, rtts, &results[i]);
+        if(is_better(&results[i], best)){
+            best = &results[i];
+        }
+    }
+    free(candidate_argv);
+    free(rtts);
+
+    printf("%-10s %8s %8s %8s %8s %12s %10s %8s %8s\n", NULL != option ? option + 2 : "options",
+        "p50 ms", "p90 ms", "p99 ms", "max ms", "bytes/s", "crc err %", "retry %", "busy %");
+    for(int i = 0; i < count; i++){
+        print_result(&results[i]);
+    }
+    if(NULL == best){
+        printf("No candidate worked\n");
+        return -1;
+    }
+    printf("Client inter transaction delay %.3f ms\n", (double) best->inter_transaction_delay * 1e-6);
+    if(0 != best->integrity_errors || 0 != best->retries){
+        WARN("All candidates had integrity errors or retries");
+    }
+    if(NULL != option){
+        printf("Recommended: %s %ld\n", option, best->speed);
+    }
+    return 0;
+}
@@ -9,18 +9,76 @@
 #include "mdfu/mdfu_config.h"
 #include "cmdfu.h"
 
-static const char *actions[] = {"update", "client-info", "tools-help", "change-mode", "dump", NULL};
+static const char *actions[] = {"update", "client-info", "tools-help", "change-mode", "dump", "verify", "fleet", "batch", "daemon", "bench-link", NULL};
 
-static const char *help_usage = "cmdfu [-h | --help] [-v <level> | --verbose <level>] [-V | --version] [-R | --release-info] [<action>]";
+static const char *help_usage = "cmdfu [-h | --help] [-v <level> | --verbose <level>] [-V | --version] [-R | --release-info] [--trace-file <file>] [--client-info-cache <file>] [--remote <socket> [--remote-device <name>] [--priority <n>]] [<action>]";
 static const char *help_update = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--config-file <file> | -c <file>] "
-    "update --tool <tool> --image <image> [<tools-args>...]";
+    "update --tool <tool> --image <image> [--skip-if-identical] [--stats] [--frame-cache <file>] [--expect-sha256 <digest>] [<tools-args>...]";
 static const char *help_client_info = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--config-file <file> | -c <file>] "
     "client-info --tool <tool> [<tools-args>...]";
 static const char *help_tools = "cmdfu [--help | -h] [--verbose <level> | -v <level>] tools-help";
 static const char *help_change_mode = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--config-file <file> | -c <file>] "
     "change-mode --tool <tool> [<tools-args>...]";
 static const char *help_dump = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--config-file <file> | -c <file>] "
-    "dump --tool <tool> --image <image> [<tools-args>...]";
+    "dump --tool <tool> --image <image> [--stats] [<tools-args>...]";
+static const char *help_verify = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--config-file <file> | -c <file>] "
+    "verify --tool <tool> --image <image> [<tools-args>...]";
+static const char *help_batch = "cmdfu [--help | -h] [--verbose <level> | -v <level>] "
+    "batch --tool <tool> --script <file> [--stats] [<tools-args>...]\n"
+    "\n"
+    "    --script <file>     One action with its options per line, without tool options, e.g.\n"
+    "                        client-info\n"
+    "                        update --image app.img --skip-if-identical\n"
+    "                        verify --image app.img\n"
+    "                        change-mode\n"
+    "                        The actions run in order on one connection to the client\n"
+    "                        and stop at the first action that fails\n"
+    "    --stats             Print transfer statistics of all actions as JSON at the end";
+static const char *help_fleet = "cmdfu [--help | -h] [--verbose <level> | -v <level>] "
+    "fleet --manifest <file> [--jobs <n>] [--limit <resource>=<count>]... [--retries <n>] [--log-dir <dir>]\n"
+    "\n"
+    "    --manifest <file>   One action with its options per line, e.g.\n"
+    "                        update --tool serial --port /dev/ttyACM0 --baudrate 115200 --image app.img\n"
+    "                        # starts a comment, --resource <name> adds a shared resource\n"
+    "                        for the target that is limited to one target at a time\n"
+    "    --jobs <n>          Maximum number of targets that run at the same time, default 4\n"
+    "    --limit <resource>=<count>\n"
+    "                        Number of targets that can use a resource at the same time.\n"
+    "                        Targets use serial:<port>, spi:<bus>, i2c:<adapter>, limited\n"
+    "                        to one, and network, not limited, e.g. network=8\n"
+    "    --retries <n>       Number of times a target that failed with an error is run\n"
+    "                        again, default 0\n"
+    "    --log-dir <dir>     Write the output of each target to <dir>/<line>.log";
+static const char *help_daemon = "cmdfu [--help | -h] [--verbose <level> | -v <level>] [--client-info-cache <file>] "
+    "daemon --socket <path> --devices <file>\n"
+    "cmdfud [--help | -h] [--verbose <level> | -v <level>] [--client-info-cache <file>] --socket <path> --devices <file>\n"
+    "\n"
+    "    --socket <path>     Unix socket where the jobs of cmdfu --remote are accepted\n"
+    "    --devices <file>    One device name with its tool options per line, e.g.\n"
+    "                        station1 --tool serial --port /dev/ttyACM0 --baudrate 115200\n"
+    "                        The tool of each device is connected on the first job and\n"
+    "                        stays connected for the next jobs\n"
+    "\n"
+    "    Submit jobs with cmdfu --remote <path> [--remote-device <name>] [--priority <n>]\n"
+    "    followed by an update, client-info, dump, verify or change-mode action without\n"
+    "    tool options. Each device runs one job at a time, higher priorities first";
+static const char *help_bench_link = "cmdfu [--help | -h] [--verbose <level> | -v <level>] "
+    "bench-link --tool <tool> [--rounds <n>] [--dump-chunks <n>] [--sweep <rate>[,<rate>]...] [--stats] [<tools-args>...]\n"
+    "\n"
+    "    --rounds <n>        Number of GET_CLIENT_INFO round trips for each candidate,\n"
+    "                        default 100\n"
+    "    --dump-chunks <n>   Also read the first <n> chunks of the client firmware to\n"
+    "                        measure the payload throughput, default 0. The client\n"
+    "                        firmware is not changed\n"
+    "    --sweep <rate>[,<rate>]...\n"
+    "                        Baud rates of the serial and usb tools or clock speeds\n"
+    "                        of the spidev tool that are tried in place of --baudrate\n"
+    "                        or --clk-speed, default is a list of common rates\n"
+    "    --stats             Print the transfer statistics of each candidate as JSON\n"
+    "\n"
+    "    Prints the round trip times, throughput, integrity error, retry and busy poll\n"
+    "    rates of each candidate and the tool options of the fastest candidate that\n"
+    "    had no errors";
 static const char *help_common =
     "Actions\n"
     "    <action>        Action to perform. Valid actions are:\n"
@@ -29,6 +87,17 @@ static const char *help_common =
     "    update:         Perform a firmware update\n"
     "    change-mode:    Change bootloader mode to application\n"
     "    dump:           Download firmware and save to image file\n"
+    "    verify:         Compare client firmware with image file, exits with\n"
+    "                    status 1 if they differ\n"
+    "    fleet:          Run the actions of a manifest for many targets in\n"
+    "                    parallel, see cmdfu fleet --help\n"
+    "    batch:          Run the actions of a script on one connection to the\n"
+    "                    client, see cmdfu batch --help\n"
+    "    daemon:         Keep the tools of devices connected and run the actions\n"
+    "                    that cmdfu --remote submits, see cmdfu daemon --help\n"
+    "    bench-link:     Measure the link to the client with safe commands and\n"
+    "                    recommend a baud rate or clock speed, see\n"
+    "                    cmdfu bench-link --help\n"
     "\n"
     "    -h, --help      Show this help message and exit\n"
     "\n"
@@ -43,10 +112,50 @@ static const char *help_common =
     "                    [debug, info, warning, error, critical].\n"
     "                    Default is info.\n"
     "\n"
+    "    --trace-file <file>\n"
+    "                    Record the transport frames in memory and write the\n"
+    "                    last frames to <file> at exit or on SIGUSR1\n"
+    "\n"
+    "    --client-info-cache <file>\n"
+    "                    Store the client information of each tool and port or\n"
+    "                    host in <file> and skip requesting it from known clients\n"
+    "\n"
+    "    --remote <socket>\n"
+    "                    Run the action on a device of the cmdfu daemon that\n"
+    "                    listens on <socket>, the tool options are set by the daemon\n"
+    "\n"
+    "    --remote-device <name>\n"
+    "                    Daemon device that runs the action, can be left out when\n"
+    "                    the daemon has only one device\n"
+    "\n"
+    "    --priority <n>  Queue priority of the remote action, higher priorities run\n"
+    "                    first, default 0\n"
+    "\n"
+    "    --stats         Print transfer statistics as JSON on the standard output\n"
+    "                    when an update or dump is done\n"
+    "\n"
+    "    --frame-cache <file>\n"
+    "                    Serial and network tools with serial framing send the\n"
+    "                    image chunks of an update from pre-built frames in\n"
+    "                    <file>, which is built on the first update of an image\n"
+    "\n"
+    "    --expect-sha256 <digest>\n"
+    "                    Check the SHA-256 of the image while it is sent and\n"
+    "                    fail the update before it is finished if it differs\n"
+    "\n"
     "Usage examples\n"
     "\n"
     "    Update firmware through serial port and with update_image.img\n"
-    "    cmdfu update --tool serial --image update_image.img --port COM11 --baudrate 115200\n";
+    "    cmdfu update --tool serial --image update_image.img --port COM11 --baudrate 115200\n"
+    "\n"
+    "    Update firmware only if the client does not have update_image.img already\n"
+    "    cmdfu update --tool serial --image update_image.img --skip-if-identical --port COM11 --baudrate 115200\n"
+    "\n"
+    "    Update firmware with an image that is read from the standard input\n"
+    "    xz -dc update_image.img.xz | cmdfu update --tool serial --image - --port /dev/ttyACM0 --baudrate 115200\n"
+    "\n"
+    "    Update firmware with a gzip, zstd or LZ4 compressed image that is decompressed while sending\n"
+    "    cmdfu update --tool serial --image update_image.img.gz --port /dev/ttyACM0 --baudrate 115200\n";
 
 
 
@@ -119,6 +228,16 @@ static void print_help_for_action(action_t action){
         printf("%s\n", help_change_mode);
     } else if(args.action == ACTION_DUMP){
         printf("%s\n", help_dump);
+    } else if(args.action == ACTION_VERIFY){
+        printf("%s\n", help_verify);
+    } else if(args.action == ACTION_FLEET){
+        printf("%s\n", help_fleet);
+    } else if(args.action == ACTION_BATCH){
+        printf("%s\n", help_batch);
+    } else if(args.action == ACTION_DAEMON){
+        printf("%s\n", help_daemon);
+    } else if(args.action == ACTION_BENCH_LINK){
+        printf("%s\n", help_bench_link);
     }
 
 }
@@ -194,8 +313,9 @@ static void handle_unrecognized_option(char **argv, int *action_argc, char **act
     action_argv[*action_argc] = argv[optind - 1];
     (*action_argc)++;
     // check if next item is an option or an option value
-    // if it is an option value add it to the tools arguments list
-    if (argv[optind] != NULL && argv[optind][0] != '-') {
+    // if it is an option value add it to the tools arguments list,
+    // a single dash is a value that selects the standard input
+    if (argv[optind] != NULL && (argv[optind][0] != '-' || argv[optind][1] == '\0')) {
         action_argv[*action_argc] = argv[optind];
         (*action_argc)++;
         // skip next argument in getopt_long
@@ -272,6 +392,11 @@ int parse_common_arguments(int argc, char **argv, int *action_argc, char **actio
         {"release", no_argument, 0, 'R'},
         {"help", no_argument, 0, 'h'},
         {"tool", required_argument, NULL, 't'},
+        {"trace-file", required_argument, NULL, 'T'},
+        {"client-info-cache", required_argument, NULL, 'I'},
+        {"remote", required_argument, NULL, 'X'},
+        {"remote-device", required_argument, NULL, 'D'},
+        {"priority", required_argument, NULL, 'P'},
         // last entry must be implemented with name as zero
         {0, 0, 0, 0}
     };
@@ -331,6 +456,21 @@ int parse_common_arguments(int argc, char **argv, int *action_argc, char **actio
                 _exit = true;
             }
             break;
+        case 'T':
+            args.trace_file = optarg;
+            break;
+        case 'I':
+            args.client_info_cache = optarg;
+            break;
+        case 'X':
+            args.remote = optarg;
+            break;
+        case 'D':
+            args.remote_device = optarg;
+            break;
+        case 'P':
+            args.priority = atoi(optarg);
+            break;
         case '?':
             // At this point usually an error message would have been printed
             // but we suppressed this by setting opterr to 0
@@ -378,6 +518,39 @@ int parse_common_arguments(int argc, char **argv, int *action_argc, char **actio
     return 0;
 }
 
+/**
+ * @brief Get the command line name of an action.
+ *
+ * @param action Action.
+ * @return const char* Action name, an empty string for ACTION_NONE.
+ */
+const char *action_name(action_t action){
+    if(action < ACTION_NONE){
+        return actions[action];
+    }
+    return "";
+}
+
+/**
+ * @brief Parse a SHA-256 digest in hexadecimal notation.
+ *
+ * @param hex String with 64 hexadecimal digits.
+ * @param digest Buffer for the 32 bytes of the digest.
+ * @return 0 for success, -1 for error
+ */
+static int parse_sha256(const char *hex, uint8_t *digest){
+    unsigned int byte;
+
+    if(64 != strlen(hex) || strspn(hex, "0123456789abcdefABCDEF") != 64){
+        return -1;
+    }
+    for(int i = 0; i < 32; i++){
+        sscanf(&hex[2 * i], "%2x", &byte);
+        digest[i] = (uint8_t) byte;
+    }
+    return 0;
+}
+
 /**
  * @brief Parse update action CLI options
  *
@@ -391,9 +564,14 @@ int parse_common_arguments(int argc, char **argv, int *action_argc, char **actio
  * @return 0 for success, -1 for error
  */
 int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new_argv){
+    static uint8_t expect_sha256[32];
     struct option long_options[] =
     {
         {"image", required_argument, NULL, 'i'},
+        {"skip-if-identical", no_argument, NULL, 'S'},
+        {"stats", no_argument, NULL, 's'},
+        {"frame-cache", required_argument, NULL, 'F'},
+        {"expect-sha256", required_argument, NULL, 'H'},
         // last entry must be implemented with name as zero
         {0, 0, 0, 0}
     };
@@ -434,6 +612,27 @@ int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new
                 args.image = optarg;
                 break;
 
+            case 'S':
+                args.skip_if_identical = true;
+                break;
+
+            case 's':
+                args.stats = true;
+                break;
+
+            case 'F':
+                args.frame_cache = optarg;
+                break;
+
+            case 'H':
+                if(parse_sha256(optarg, expect_sha256) < 0){
+                    printf("Invalid --expect-sha256 digest, expected 64 hexadecimal digits\n");
+                    error_exit = true;
+                } else {
+                    args.expect_sha256 = expect_sha256;
+                }
+                break;
+
             case '?':
                 // At this point usually an error message would have been printed
                 // but we suppressed this by setting opterr to 0
@@ -457,3 +656,168 @@ int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new
     }
     return error_exit ? -1 : 0;
 }
+
+/**
+ * @brief Parse batch action CLI options
+ *
+ * Parse batch action options and return unrecognized options, which are the
+ * tool options.
+ *
+ * @param argc Argument count for parsing
+ * @param argv Argument vector for parsing
+ * @param new_argc Pointer for storing the number of unrecognized options
+ * @param new_argv Pointer to array of pointers that will contain references to
+ *                 the unrecognized options
+ * @return 0 for success, -1 for error
+ */
+int parse_batch_arguments(int argc, char **argv, int *new_argc, char **new_argv){
+    struct option long_options[] =
+    {
+        {"script", required_argument, NULL, 'x'},
+        {"stats", no_argument, NULL, 's'},
+        // last entry must be implemented with name as zero
+        {0, 0, 0, 0}
+    };
+    int opt;
+    bool error_exit = false;
+    bool end_of_options = false;
+
+    optind = 0;
+    opterr = 0;
+    new_argv[0] = "batch args";
+    *new_argc = 1;
+
+    while (!error_exit && !end_of_options)
+    {
+        int option_index = 0;
+
+        opt = getopt_long(argc, argv, ":", long_options, &option_index);
+        if (opt == -1){
+            end_of_options = true;
+        }else{
+            switch(opt){
+            case 'x':
+                args.script = optarg;
+                break;
+
+            case 's':
+                args.stats = true;
+                break;
+
+            case '?':
+                handle_unrecognized_option(argv, new_argc, new_argv);
+                break;
+
+            default:
+                printf("Invalid argument\n");
+                error_exit = true;
+                break;
+            }
+        }
+    }
+    if(!error_exit && args.tool == TOOL_NONE){
+        printf("Missing required --tool option\n");
+        error_exit = true;
+    }
+    if(!error_exit && (NULL == args.script)){
+        printf("Missing required --script option\n");
+        error_exit = true;
+    }
+    return error_exit ? -1 : 0;
+}
+
+/**
+ * @brief Parse a positive count option argument.
+ *
+ * @param name Option name for the error message.
+ * @param value Option argument.
+ * @param[out] count Parsed count.
+ * @param allow_zero Accept 0 as count.
+ * @return 0 for success, -1 for error
+ */
+static int parse_count(const char *name, const char *value, int *count, bool allow_zero){
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if(end == value || '\0' != *end || number < (allow_zero ? 0 : 1) || number > 1000000){
+        printf("Invalid %s %s\n", name, value);
+        return -1;
+    }
+    *count = (int) number;
+    return 0;
+}
+
+/**
+ * @brief Parse bench-link action CLI options
+ *
+ * Parse bench-link action options and return unrecognized options, which are
+ * the tool options.
+ *
+ * @param argc Argument count for parsing
+ * @param argv Argument vector for parsing
+ * @param new_argc Pointer for storing the number of unrecognized options
+ * @param new_argv Pointer to array of pointers that will contain references to
+ *                 the unrecognized options
+ * @return 0 for success, -1 for error
+ */
+int parse_bench_link_arguments(int argc, char **argv, int *new_argc, char **new_argv){
+    struct option long_options[] =
+    {
+        {"rounds", required_argument, NULL, 'r'},
+        {"dump-chunks", required_argument, NULL, 'd'},
+        {"sweep", required_argument, NULL, 'w'},
+        {"stats", no_argument, NULL, 's'},
+        // last entry must be implemented with name as zero
+        {0, 0, 0, 0}
+    };
+    int opt;
+    bool error_exit = false;
+    bool end_of_options = false;
+
+    optind = 0;
+    opterr = 0;
+    new_argv[0] = "bench-link args";
+    *new_argc = 1;
+
+    while (!error_exit && !end_of_options)
+    {
+        int option_index = 0;
+
+        opt = getopt_long(argc, argv, ":", long_options, &option_index);
+        if (opt == -1){
+            end_of_options = true;
+        }else{
+            switch(opt){
+            case 'r':
+                error_exit = parse_count("--rounds", optarg, &args.bench_rounds, false) < 0;
+                break;
+
+            case 'd':
+                error_exit = parse_count("--dump-chunks", optarg, &args.bench_chunks, true) < 0;
+                break;
+
+            case 'w':
+                args.bench_sweep = optarg;
+                break;
+
+            case 's':
+                args.stats = true;
+                break;
+
+            case '?':
+                handle_unrecognized_option(argv, new_argc, new_argv);
+                break;
+
+            default:
+                printf("Invalid argument\n");
+                error_exit = true;
+                break;
+            }
+        }
+    }
+    if(!error_exit && args.tool == TOOL_NONE){
+        printf("Missing required --tool option\n");
+        error_exit = true;
+    }
+    return error_exit ? -1 : 0;
+}
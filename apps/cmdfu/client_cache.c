@@ -0,0 +1,182 @@
+/**
+ * @file client_cache.c
+ * @brief Stores the MDFU client information of known clients in a file.
+ *
+ * The file has one line per client with the key of the client, a tab and
+ * the fields of the client information:
+ *
+ *     <key>\t<major>.<minor>.<patch> <internal> <internal_present> <buffer_count>
+ *     <buffer_size> <inter_transaction_delay> <default_timeout> <cmd_timeouts>...
+ *
+ * The key is the tool with its options, e.g. "serial --port /dev/ttyACM0
+ * --baudrate 115200", so that each port or host has its own entry. The file
+ * is replaced as a whole when an entry changes, so readers never see a
+ * partly written file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "mdfu/logging.h"
+#include "cmdfu.h"
+
+/**
+ * @brief Formats the client information fields of a cache line.
+ *
+ * @param line Buffer for the fields.
+ * @param size Size of the buffer.
+ * @param info Client information.
+ */
+static void format_client_info(char *line, size_t size, const client_info_t *info){
+    int length = snprintf(line, size, "%u.%u.%u %u %u %u %u %lu %u",
+        info->version.major, info->version.minor, info->version.patch,
+        info->version.internal, info->version.internal_present ? 1U : 0U,
+        info->buffer_count, info->buffer_size,
+        (unsigned long) info->inter_transaction_delay, info->default_timeout);
+
+    for(int i = 0; i < MAX_MDFU_CMD && length > 0 && (size_t) length < size; i++){
+        length += snprintf(&line[length], size - (size_t) length, " %u", info->cmd_timeouts[i]);
+    }
+}
+
+/**
+ * @brief Parses the client information fields of a cache line.
+ *
+ * @param fields Fields after the key.
+ * @param info Pointer where the client information is stored.
+ * @return int 0 on success, -1 if the fields are invalid.
+ */
+static int parse_client_info(const char *fields, client_info_t *info){
+    unsigned int values[8];
+    unsigned long delay;
+    int length;
+
+    memset(info, 0, sizeof(*info));
+    if(9 != sscanf(fields, "%u.%u.%u %u %u %u %u %lu %u%n", &values[0], &values[1], &values[2],
+            &values[3], &values[4], &values[5], &values[6], &delay, &values[7], &length)){
+        return -1;
+    }
+    info->version.major = (uint8_t) values[0];
+    info->version.minor = (uint8_t) values[1];
+    info->version.patch = (uint8_t) values[2];
+    info->version.internal = (uint8_t) values[3];
+    info->version.internal_present = 0 != values[4];
+    info->buffer_count = (uint8_t) values[5];
+    info->buffer_size = (uint16_t) values[6];
+    info->inter_transaction_delay = (uint32_t) delay;
+    info->default_timeout = (uint16_t) values[7];
+    fields += length;
+    for(int i = 0; i < MAX_MDFU_CMD; i++){
+        if(1 != sscanf(fields, " %u%n", &values[0], &length)){
+            return -1;
+        }
+        info->cmd_timeouts[i] = (uint16_t) values[0];
+        fields += length;
+    }
+    return 0;
+}
+
+/**
+ * @brief Looks up the client information of a client in the cache file.
+ *
+ * @param path Path of the cache file.
+ * @param key Key of the client.
+ * @param info Pointer where the client information is stored.
+ * @return int 0 if the client was found, -1 otherwise.
+ */
+int client_cache_load(const char *path, const char *key, client_info_t *info){
+    FILE *file = fopen(path, "r");
+    char line[512];
+    size_t key_length = strlen(key);
+    int status = -1;
+
+    if(NULL == file){
+        return -1;
+    }
+    while(NULL != fgets(line, sizeof(line), file)){
+        if(0 == strncmp(line, key, key_length) && '\t' == line[key_length]){
+            status = parse_client_info(&line[key_length + 1], info);
+            break;
+        }
+    }
+    fclose(file);
+    return status;
+}
+
+/**
+ * @brief Stores or removes the client information of a client in the cache file.
+ *
+ * The entries of other clients are kept. The file is only written when the
+ * entry changes.
+ *
+ * @param path Path of the cache file.
+ * @param key Key of the client.
+ * @param info Client information, NULL removes the entry of the client.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int client_cache_store(const char *path, const char *key, const client_info_t *info){
+    char line[512];
+    char fields[256] = "";
+    char *tmp_path;
+    FILE *file;
+    FILE *tmp;
+    size_t key_length = strlen(key);
+    bool changed = NULL != info;
+    int status = 0;
+
+    if(NULL != info){
+        format_client_info(fields, sizeof(fields), info);
+    }
+    tmp_path = malloc(strlen(path) + 32);
+    if(NULL == tmp_path){
+        errno = ENOMEM;
+        return -1;
+    }
+#ifndef _WIN32
+    sprintf(tmp_path, "%s.tmp.%ld", path, (long) getpid());
+#else
+    sprintf(tmp_path, "%s.tmp", path);
+#endif
+    tmp = fopen(tmp_path, "w");
+    if(NULL == tmp){
+        free(tmp_path);
+        return -1;
+    }
+    file = fopen(path, "r");
+    while(NULL != file && NULL != fgets(line, sizeof(line), file)){
+        if(0 == strncmp(line, key, key_length) && '\t' == line[key_length]){
+            // Keep the entry if it did not change
+            changed = NULL == info || strcspn(&line[key_length + 1], "\n") != strlen(fields) ||
+                0 != strncmp(&line[key_length + 1], fields, strlen(fields));
+            if(NULL != info && !changed){
+                break;
+            }
+            continue;
+        }
+        fputs(line, tmp);
+    }
+    if(NULL != file){
+        fclose(file);
+    }
+    if(NULL != info && changed){
+        fprintf(tmp, "%s\t%s\n", key, fields);
+    }
+    if(0 != fclose(tmp)){
+        status = -1;
+    }
+    if(0 == status && changed){
+#ifdef _WIN32
+        remove(path);
+#endif
+        status = rename(tmp_path, path);
+    }
+    if(0 != status || !changed){
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    return status;
+}
@@ -2,7 +2,9 @@
 #define CMDFU_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "mdfu/tools/tools.h"
+#include "mdfu/mdfu.h"
 
 /**
  * @enum action_t
@@ -16,7 +18,12 @@ typedef enum {
   ACTION_TOOLS_HELP = 2,
   ACTION_CHANGE_MODE = 3,
   ACTION_DUMP = 4,
-  ACTION_NONE = 5
+  ACTION_VERIFY = 5,
+  ACTION_FLEET = 6,
+  ACTION_BATCH = 7,
+  ACTION_DAEMON = 8,
+  ACTION_BENCH_LINK = 9,
+  ACTION_NONE = 10
 } action_t;
 
 /**
@@ -26,6 +33,19 @@ typedef enum {
  * @tool: Enum to specify the tool type.
  * @action: Enum to specify the action to be performed.
  * @image: Pointer to a character array holding the update firmware image file name or path.
+ * @skip_if_identical: Boolean flag to skip the update if the client already has the image.
+ * @stats: Boolean flag to print transfer statistics as JSON when the action is done.
+ * @trace_file: Pointer to a character array holding the file name for the transport frame trace.
+ * @frame_cache: Pointer to a character array holding the file name of the serial frame cache.
+ * @expect_sha256: Pointer to the expected SHA-256 digest of the image, NULL if the image is not checked.
+ * @script: Pointer to a character array holding the file name of the batch script.
+ * @client_info_cache: Pointer to a character array holding the file name of the client information cache.
+ * @remote: Pointer to a character array holding the socket path of the daemon that runs the action, NULL to run it locally.
+ * @remote_device: Pointer to a character array holding the name of the daemon device that runs the action.
+ * @priority: Priority of the action in the queue of the daemon device.
+ * @bench_rounds: Number of GET_CLIENT_INFO round trips of each bench-link candidate.
+ * @bench_chunks: Number of chunks that bench-link dumps for each candidate, 0 for none.
+ * @bench_sweep: Pointer to a character array holding the comma separated baud rates or clock speeds that bench-link tries, NULL for the defaults of the tool.
  */
 struct args {
     bool help;
@@ -33,8 +53,43 @@ struct args {
     tool_type_t tool;
     action_t action;
     char * image;
+    bool skip_if_identical;
+    bool stats;
+    char * trace_file;
+    char * frame_cache;
+    uint8_t * expect_sha256;
+    char * script;
+    char * client_info_cache;
+    char * remote;
+    char * remote_device;
+    int priority;
+    int bench_rounds;
+    int bench_chunks;
+    char * bench_sweep;
 };
 
 extern struct args args;
 
+int run_action(int argc, char **argv);
+int mdfu_fleet(int argc, char **argv);
+int mdfu_batch(int argc, char **argv);
+int mdfu_daemon(int argc, char **argv);
+int remote_submit(int argc, char **argv);
+int mdfu_bench_link(int argc, char **argv);
+const char *action_name(action_t action);
+int open_session(int argc, char **argv, mdfu_session_t **session, transport_t **transport, void **tool_conf);
+void close_session(mdfu_session_t *session, void *tool_conf);
+int session_client_info(mdfu_session_t *session);
+int session_update(mdfu_session_t *session, transport_t *transport);
+int session_dump(mdfu_session_t *session);
+int session_verify(mdfu_session_t *session);
+int session_change_mode(mdfu_session_t *session);
+void report_stats(const mdfu_session_t *session);
+void load_client_info(mdfu_session_t *session);
+void store_client_info(const mdfu_session_t *session, int status);
+int client_cache_load(const char *path, const char *key, client_info_t *info);
+int client_cache_store(const char *path, const char *key, const client_info_t *info);
+int share_image(const char *path);
+void release_shared_images(void);
+
 #endif
\ No newline at end of file
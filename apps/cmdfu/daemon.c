@@ -0,0 +1,1254 @@
+/**
+ * @file daemon.c
+ * @brief Keeps the tools of devices connected and runs the jobs that
+ * cmdfu --remote submits.
+ *
+ * The devices are read from a file with a device name and the tool options
+ * per line, e.g.
+ *
+ *     station1 --tool serial --port /dev/ttyACM0 --baudrate 115200
+ *     station2 --tool spidev --dev /dev/spidev0.0 --clk-speed 1000000
+ *
+ * Each device is served by a worker process that is forked once. The worker
+ * sets up and connects the tool on the first job and keeps the session open
+ * for the next jobs, so a job does not pay for the process start, the tool
+ * setup and the client information request. The session is closed after a
+ * job that failed or changed the client mode, and opened again by the next
+ * job.
+ *
+ * Jobs are submitted over a Unix stream socket, one job per connection. The
+ * client sends the job together with its standard input, output and error,
+ * and the worker runs the action with them, so the output and the log of the
+ * job appear at the client and an image can be read from its standard input.
+ * The daemon reads the job as it arrives, so a slow client does not hold up
+ * the other connections and the workers. The exit status of the action is
+ * sent back when the job is done. Each device runs one job at a time, queued
+ * jobs run in the order of their priority and then in the order they arrived.
+ */
+#define _GNU_SOURCE // accept4, MSG_CMSG_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+#include "cmdfu.h"
+
+extern int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new_argv);
+
+/**
+ * @def DAEMON_MAX_JOB_SIZE
+ * @brief Maximum size of the device name, working directory and arguments of a job.
+ */
+#define DAEMON_MAX_JOB_SIZE (64 * 1024)
+
+/**
+ * @def DAEMON_JOB_FDS
+ * @brief Number of file descriptors sent with a job, the standard input,
+ * output and error of the client.
+ */
+#define DAEMON_JOB_FDS 3
+
+/**
+ * @def DAEMON_RECEIVE_TIMEOUT
+ * @brief Time in seconds a client has to send its job after connecting.
+ */
+#define DAEMON_RECEIVE_TIMEOUT 2
+
+/**
+ * @def DAEMON_SOCKET_UMASK
+ * @brief File mode bits cleared on the socket file, only the user and the
+ * group of the daemon can submit jobs.
+ */
+#define DAEMON_SOCKET_UMASK 0117
+
+/**
+ * @def DAEMON_MAX_INCOMING
+ * @brief Maximum number of connections whose job is being received, further
+ * connections wait in the listen backlog.
+ */
+#define DAEMON_MAX_INCOMING 32
+
+/**
+ * @brief Job header that precedes the job data on the connection.
+ *
+ * The job data are NUL terminated strings: device name, working directory,
+ * action name and the action options.
+ */
+typedef struct {
+    uint32_t size;
+    int32_t priority;
+} daemon_job_header_t;
+
+/**
+ * @brief Job that waits for its device.
+ */
+typedef struct daemon_job {
+    struct daemon_job *next;
+    /** @brief Connection to the client, the exit status is sent on it. */
+    int connection;
+    /** @brief Standard input, output and error of the client. */
+    int fds[DAEMON_JOB_FDS];
+    int priority;
+    size_t size;
+    char *data;
+    /** @brief Header of the job while it is received. */
+    daemon_job_header_t header;
+    /** @brief Number of header and data bytes received. */
+    size_t received;
+    /** @brief Time until the whole job must be received. */
+    timeout_t deadline;
+} daemon_job_t;
+
+/**
+ * @brief Device from the device file.
+ */
+typedef struct {
+    int line_number;
+    char *name;
+    /** @brief Copy of the line that the arguments point into. */
+    char *arguments;
+    /** @brief Tool argument vector without --tool, argv[0] is not a tool option. */
+    char **argv;
+    int argc;
+    tool_type_t tool;
+    pid_t pid;
+    /** @brief Daemon end of the socket pair to the worker, -1 if no worker runs. */
+    int control;
+    bool busy;
+    /** @brief Jobs sorted by priority, jobs with the same priority in arrival order. */
+    daemon_job_t *queue;
+} daemon_device_t;
+
+/**
+ * @brief Daemon state.
+ */
+struct daemon {
+    daemon_device_t *devices;
+    int device_count;
+    const char *socket_path;
+    int listener;
+    /** @brief Connections whose job is being received. */
+    daemon_job_t *incoming;
+    int incoming_count;
+};
+
+/**
+ * @brief Set by SIGINT and SIGTERM, the daemon stops when the running jobs are done.
+ */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_signal_handler(int sig){
+    (void) sig;
+    stop_requested = 1;
+}
+
+/**
+ * @brief Actions that can be submitted as jobs.
+ */
+static const struct {
+    const char *name;
+    action_t action;
+} daemon_actions[] = {
+    {"client-info", ACTION_CLIENT_INFO},
+    {"update", ACTION_UPDATE},
+    {"dump", ACTION_DUMP},
+    {"verify", ACTION_VERIFY},
+    {"change-mode", ACTION_CHANGE_MODE}
+};
+
+/**
+ * @brief Parse a device file line into a device.
+ *
+ * @return int 1 if a device was added, 0 for empty lines and -1 on error.
+ */
+static int parse_device(struct daemon *daemon, char *line, int line_number){
+    daemon_device_t *device;
+    daemon_device_t *devices;
+    char *comment = strchr(line, '#');
+    const char *tool = NULL;
+    char *token;
+    char *save;
+    size_t length;
+
+    if(NULL != comment){
+        *comment = '\0';
+    }
+    length = strlen(line);
+    while(length > 0 && NULL != strchr(" \t\r\n", line[length - 1])){
+        line[--length] = '\0';
+    }
+    line += strspn(line, " \t");
+    if('\0' == *line){
+        return 0;
+    }
+    devices = realloc(daemon->devices, (size_t) (daemon->device_count + 1) * sizeof(daemon_device_t));
+    if(NULL == devices){
+        return -1;
+    }
+    daemon->devices = devices;
+    device = &devices[daemon->device_count];
+    memset(device, 0, sizeof(*device));
+    device->line_number = line_number;
+    device->control = -1;
+    device->tool = TOOL_NONE;
+    device->arguments = strdup(line);
+    // At most one argument per two characters plus NULL
+    device->argv = malloc((length / 2 + 2) * sizeof(char *));
+    daemon->device_count += 1;
+    if(NULL == device->arguments || NULL == device->argv){
+        return -1;
+    }
+    device->name = strtok_r(device->arguments, " \t", &save);
+    device->argv[device->argc++] = "tool args";
+    for(token = strtok_r(NULL, " \t", &save); NULL != token; token = strtok_r(NULL, " \t", &save)){
+        if(0 == strcmp(token, "--tool")){
+            tool = strtok_r(NULL, " \t", &save);
+            continue;
+        }
+        device->argv[device->argc++] = token;
+    }
+    device->argv[device->argc] = NULL;
+    for(int i = 0; i < daemon->device_count - 1; i++){
+        if(0 == strcmp(daemon->devices[i].name, device->name)){
+            ERROR("Device file line %d: Device %s is already defined on line %d",
+                line_number, device->name, daemon->devices[i].line_number);
+            return -1;
+        }
+    }
+    for(const char **p = tool_names; NULL != tool && NULL != *p; p++){
+        if(0 == strcmp(tool, *p)){
+            device->tool = (tool_type_t) (p - tool_names);
+        }
+    }
+    if(TOOL_NONE == device->tool){
+        ERROR("Device file line %d: Missing or unknown --tool for device %s", line_number, device->name);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read all devices from the device file.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int read_devices(struct daemon *daemon, const char *path){
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    int status = 0;
+
+    if(NULL == file){
+        ERROR("Opening device file %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    while(getline(&line, &size, file) >= 0){
+        line_number += 1;
+        if(parse_device(daemon, line, line_number) < 0){
+            status = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    if(0 == status && 0 == daemon->device_count){
+        ERROR("Device file %s does not contain any devices", path);
+        status = -1;
+    }
+    return status;
+}
+
+/**
+ * @brief Close the file descriptors of a job and free it.
+ */
+static void free_job(daemon_job_t *job){
+    if(job->connection >= 0){
+        close(job->connection);
+    }
+    for(int i = 0; i < DAEMON_JOB_FDS; i++){
+        if(job->fds[i] >= 0){
+            close(job->fds[i]);
+        }
+    }
+    free(job->data);
+    free(job);
+}
+
+/**
+ * @brief Send the exit status of a job to the client and close the connection.
+ */
+static void finish_job(int connection, int status){
+    int32_t exit_status = status;
+
+    if(write(connection, &exit_status, sizeof(exit_status)) < 0){
+        DEBUG("Sending the job exit status failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Reject a job with an error message on the standard error of the client.
+ */
+static void reject_job(daemon_job_t *job, const char *format, const char *value){
+    dprintf(job->fds[2], "ERROR:");
+    dprintf(job->fds[2], format, value);
+    dprintf(job->fds[2], "\n");
+    finish_job(job->connection, -1);
+    free_job(job);
+}
+
+/**
+ * @brief Receive data and file descriptors on a socket.
+ *
+ * @param sock Socket.
+ * @param data Buffer for the data.
+ * @param size Size of the data.
+ * @param fds Buffer for the file descriptors, filled with -1 for descriptors
+ *            that were not received. NULL if none are expected.
+ * @param fd_count Number of file descriptors in fds.
+ * @return ssize_t Number of bytes received, 0 at the end of the stream, -1 on error.
+ */
+static ssize_t receive_with_fds(int sock, void *data, size_t size, int *fds, int fd_count){
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * (DAEMON_JOB_FDS + 1))];
+    } control;
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr *cmsg;
+    ssize_t received;
+
+    for(int i = 0; i < fd_count; i++){
+        fds[i] = -1;
+    }
+    do {
+        received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    } while(received < 0 && EINTR == errno && !stop_requested);
+    if(received < 0){
+        return -1;
+    }
+    for(cmsg = CMSG_FIRSTHDR(&message); NULL != cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)){
+        if(SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type){
+            int count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *received_fds = (int *) CMSG_DATA(cmsg);
+
+            for(int i = 0; i < count; i++){
+                if(i < fd_count){
+                    fds[i] = received_fds[i];
+                }else{
+                    close(received_fds[i]);
+                }
+            }
+        }
+    }
+    return received;
+}
+
+/**
+ * @brief Send data and file descriptors on a socket.
+ *
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int send_with_fds(int sock, const void *data, size_t size, const int *fds, int fd_count){
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * (DAEMON_JOB_FDS + 1))];
+    } control;
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = size};
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * (size_t) fd_count)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    ssize_t sent;
+
+    memset(control.buffer, 0, sizeof(control.buffer));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t) fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t) fd_count);
+    do {
+        sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+    } while(sent < 0 && EINTR == errno);
+    if(sent < 0){
+        return -1;
+    }
+    if((size_t) sent != size){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Split job data into its NUL terminated strings.
+ *
+ * @param data Job data.
+ * @param size Size of the job data, the last byte must be NUL.
+ * @param fields Array for the strings, must have room for size entries plus NULL.
+ * @return int Number of strings.
+ */
+static int split_job(char *data, size_t size, char **fields){
+    int count = 0;
+
+    for(size_t offset = 0; offset < size; offset += strlen(&data[offset]) + 1){
+        fields[count++] = &data[offset];
+    }
+    fields[count] = NULL;
+    return count;
+}
+
+/**
+ * @brief Find a device by name.
+ *
+ * An empty name selects the device if there is only one.
+ *
+ * @return daemon_device_t* Device, or NULL if there is no such device.
+ */
+static daemon_device_t *find_device(struct daemon *daemon, const char *name){
+    if('\0' == *name && 1 == daemon->device_count){
+        return &daemon->devices[0];
+    }
+    for(int i = 0; i < daemon->device_count; i++){
+        if(0 == strcmp(daemon->devices[i].name, name)){
+            return &daemon->devices[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Worker state of a device.
+ */
+struct worker {
+    daemon_device_t *device;
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+};
+
+/**
+ * @brief Close the session of the worker so that the next job opens it again.
+ */
+static void close_worker_session(struct worker *worker, int status){
+    if(NULL == worker->session){
+        return;
+    }
+    store_client_info(worker->session, status);
+    close_session(worker->session, worker->tool_conf);
+    worker->session = NULL;
+    worker->tool_conf = NULL;
+}
+
+/**
+ * @brief Parse the options of a job into the global arguments.
+ *
+ * The options of the previous job are reset first. Tool options are not
+ * accepted, the tool is set up by the device file.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int parse_job_arguments(action_t action, int argc, char **argv){
+    char **tool_argv;
+    int tool_argc;
+    int status = 0;
+
+    args.image = NULL;
+    args.skip_if_identical = false;
+    args.stats = false;
+    args.frame_cache = NULL;
+    args.expect_sha256 = NULL;
+    if(ACTION_CLIENT_INFO == action || ACTION_CHANGE_MODE == action){
+        if(argc > 1){
+            ERROR("%s does not have options", argv[0]);
+            return -1;
+        }
+        return 0;
+    }
+    tool_argv = malloc((size_t) (argc + 1) * sizeof(char *));
+    if(NULL == tool_argv){
+        return -1;
+    }
+    if(parse_mdfu_update_arguments(argc, argv, &tool_argc, tool_argv) < 0){
+        status = -1;
+    } else if(tool_argc > 1){
+        ERROR("%s is not an option of %s, tool options belong in the device file of the daemon",
+            tool_argv[1], argv[0]);
+        status = -1;
+    }
+    free(tool_argv);
+    return status;
+}
+
+/**
+ * @brief Run a job on the session of the worker.
+ *
+ * @param worker Worker state.
+ * @param argc Number of job arguments.
+ * @param argv Job arguments, argv[0] is the action name.
+ * @return int Exit status of the action.
+ */
+static int run_job(struct worker *worker, int argc, char **argv){
+    action_t action = ACTION_NONE;
+    int status;
+
+    for(size_t i = 0; i < sizeof(daemon_actions) / sizeof(daemon_actions[0]); i++){
+        if(0 == strcmp(argv[0], daemon_actions[i].name)){
+            action = daemon_actions[i].action;
+        }
+    }
+    if(ACTION_NONE == action){
+        ERROR("\"%s\" is not an action that can run as a daemon job", argv[0]);
+        return -1;
+    }
+    if(parse_job_arguments(action, argc, argv) < 0){
+        return -1;
+    }
+    if(NULL == worker->session){
+        if(open_session(worker->device->argc, worker->device->argv, &worker->session,
+            &worker->transport, &worker->tool_conf) < 0){
+            return -1;
+        }
+        // Showing the client information requires asking the client
+        if(ACTION_CLIENT_INFO != action){
+            load_client_info(worker->session);
+        }
+    }
+    switch(action){
+        case ACTION_CLIENT_INFO:
+            status = session_client_info(worker->session);
+            break;
+        case ACTION_UPDATE:
+            status = session_update(worker->session, worker->transport);
+            break;
+        case ACTION_DUMP:
+            status = session_dump(worker->session);
+            break;
+        case ACTION_VERIFY:
+            status = session_verify(worker->session);
+            break;
+        default:
+            status = session_change_mode(worker->session);
+            break;
+    }
+    report_stats(worker->session);
+    // The client is in an unknown state after an error and leaves the
+    // bootloader after a mode change
+    if(status < 0 || ACTION_CHANGE_MODE == action){
+        close_worker_session(worker, status);
+    }
+    return status;
+}
+
+/**
+ * @brief Run a job with the standard input, output and error of the client.
+ *
+ * @param worker Worker state.
+ * @param data Job data.
+ * @param size Size of the job data.
+ * @param fds Standard input, output and error of the client.
+ * @return int Exit status of the job.
+ */
+static int run_client_job(struct worker *worker, char *data, size_t size, const int *fds){
+    char **fields = malloc((size + 1) * sizeof(char *));
+    int saved[DAEMON_JOB_FDS];
+    char cwd[PATH_MAX];
+    int count;
+    int status = -1;
+
+    if(NULL == fields || NULL == getcwd(cwd, sizeof(cwd))){
+        free(fields);
+        return -1;
+    }
+    count = split_job(data, size, fields);
+    fflush(stdout);
+    fflush(stderr);
+    for(int i = 0; i < DAEMON_JOB_FDS; i++){
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+    }
+    clearerr(stdin);
+    if(count < 3){
+        ERROR("Invalid job");
+    } else if(chdir(fields[1]) < 0){
+        ERROR("Changing to the job directory %s failed: %s", fields[1], strerror(errno));
+    } else {
+        INFO("Running %s on device %s", fields[2], worker->device->name);
+        status = run_job(worker, count - 2, &fields[2]);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for(int i = 0; i < DAEMON_JOB_FDS; i++){
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    clearerr(stdin);
+    if(chdir(cwd) < 0){
+        WARN("Changing back to %s failed: %s", cwd, strerror(errno));
+    }
+    free(fields);
+    return status;
+}
+
+/**
+ * @brief Serve the jobs of a device until the daemon closes the control socket.
+ *
+ * Runs in the worker process. The daemon sends each job with the client
+ * connection and the standard input, output and error of the client, the
+ * worker sends the exit status to the client and to the daemon.
+ *
+ * @param device Device of the worker.
+ * @param control Worker end of the socket pair to the daemon.
+ * @return int Always 0.
+ */
+static int serve_device(daemon_device_t *device, int control){
+    struct worker worker = {.device = device};
+    char *data = malloc(DAEMON_MAX_JOB_SIZE + 1);
+    int fds[DAEMON_JOB_FDS + 1];
+    ssize_t size;
+
+    args.tool = device->tool;
+    while(NULL != data){
+        int32_t status;
+
+        size = receive_with_fds(control, data, DAEMON_MAX_JOB_SIZE, fds, DAEMON_JOB_FDS + 1);
+        if(size <= 0){
+            break;
+        }
+        data[size] = '\0';
+        status = run_client_job(&worker, data, (size_t) size, &fds[1]);
+        finish_job(fds[0], status);
+        for(int i = 0; i < DAEMON_JOB_FDS + 1; i++){
+            if(fds[i] >= 0){
+                close(fds[i]);
+            }
+        }
+        if(write(control, &status, sizeof(status)) < 0){
+            break;
+        }
+    }
+    close_worker_session(&worker, 0);
+    free(data);
+    return 0;
+}
+
+/**
+ * @brief Start the worker process of a device.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int start_worker(struct daemon *daemon, daemon_device_t *device){
+    int pair[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0){
+        ERROR("Creating the control socket of device %s failed: %s", device->name, strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if(pid < 0){
+        ERROR("Starting the worker of device %s failed: %s", device->name, strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if(0 == pid){
+        // The daemon stops the worker by closing the control socket when
+        // the running job is done
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        // Only the daemon holds the listener, the other workers and the queued jobs
+        close(pair[0]);
+        close(daemon->listener);
+        for(int i = 0; i < daemon->device_count; i++){
+            if(daemon->devices[i].control >= 0){
+                close(daemon->devices[i].control);
+            }
+            for(daemon_job_t *job = daemon->devices[i].queue; NULL != job; job = job->next){
+                close(job->connection);
+                for(int j = 0; j < DAEMON_JOB_FDS; j++){
+                    close(job->fds[j]);
+                }
+            }
+        }
+        for(daemon_job_t *job = daemon->incoming; NULL != job; job = job->next){
+            close(job->connection);
+            for(int j = 0; j < DAEMON_JOB_FDS; j++){
+                if(job->fds[j] >= 0){
+                    close(job->fds[j]);
+                }
+            }
+        }
+        exit(serve_device(device, pair[1]));
+    }
+    close(pair[1]);
+    DEBUG("Started worker %d for device %s", (int) pid, device->name);
+    device->pid = pid;
+    device->control = pair[0];
+    device->busy = false;
+    return 0;
+}
+
+/**
+ * @brief Stop the worker of a device after it finished its job.
+ */
+static void stop_worker(daemon_device_t *device){
+    int status;
+
+    if(device->control < 0){
+        return;
+    }
+    close(device->control);
+    device->control = -1;
+    while(waitpid(device->pid, &status, 0) < 0 && EINTR == errno){
+    }
+}
+
+/**
+ * @brief Accept a connection and start receiving its job.
+ *
+ * The connection is non-blocking and its job is read by receive_job whenever
+ * the connection is readable.
+ */
+static void accept_connection(struct daemon *daemon){
+    daemon_job_t *job;
+    int connection;
+
+    connection = accept4(daemon->listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(connection < 0){
+        if(EINTR != errno && EAGAIN != errno){
+            ERROR("Accepting a job failed: %s", strerror(errno));
+        }
+        return;
+    }
+    job = calloc(1, sizeof(daemon_job_t));
+    if(NULL == job){
+        close(connection);
+        return;
+    }
+    job->connection = connection;
+    for(int i = 0; i < DAEMON_JOB_FDS; i++){
+        job->fds[i] = -1;
+    }
+    set_timeout(&job->deadline, DAEMON_RECEIVE_TIMEOUT);
+    job->next = daemon->incoming;
+    daemon->incoming = job;
+    daemon->incoming_count += 1;
+}
+
+/**
+ * @brief Check if reading a non-blocking connection failed because no data is available.
+ */
+static bool would_block(ssize_t size){
+    return size < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno);
+}
+
+/**
+ * @brief Read the available part of a job from its connection.
+ *
+ * The standard input, output and error of the client arrive with the first
+ * byte of the header.
+ *
+ * @param job Job that is received.
+ * @return int 1 when the job was received, 0 when more data is expected and
+ *         -1 for an invalid job.
+ */
+static int receive_job(daemon_job_t *job){
+    const size_t header_size = sizeof(job->header);
+    ssize_t size;
+
+    while(job->received < header_size){
+        if(0 == job->received){
+            size = receive_with_fds(job->connection, &job->header, header_size, job->fds, DAEMON_JOB_FDS);
+        }else{
+            size = read(job->connection, (uint8_t *) &job->header + job->received, header_size - job->received);
+        }
+        if(would_block(size)){
+            return 0;
+        }
+        if(size <= 0){
+            WARN("Ignoring an invalid job");
+            return -1;
+        }
+        job->received += (size_t) size;
+    }
+    if(NULL == job->data){
+        if(job->header.size < 1 || job->header.size > DAEMON_MAX_JOB_SIZE){
+            WARN("Ignoring an invalid job");
+            return -1;
+        }
+        for(int i = 0; i < DAEMON_JOB_FDS; i++){
+            if(job->fds[i] < 0){
+                WARN("Ignoring a job without the standard input, output and error of the client");
+                return -1;
+            }
+        }
+        job->priority = job->header.priority;
+        job->size = job->header.size;
+        job->data = malloc(job->size);
+        if(NULL == job->data){
+            return -1;
+        }
+    }
+    while(job->received - header_size < job->size){
+        size_t offset = job->received - header_size;
+
+        size = read(job->connection, &job->data[offset], job->size - offset);
+        if(would_block(size)){
+            return 0;
+        }
+        if(size <= 0){
+            break;
+        }
+        job->received += (size_t) size;
+    }
+    if(job->received - header_size < job->size || '\0' != job->data[job->size - 1]){
+        WARN("Ignoring an incomplete job");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Queue a job behind the jobs with the same or a higher priority.
+ */
+static void queue_job(daemon_device_t *device, daemon_job_t *job){
+    daemon_job_t **position = &device->queue;
+
+    while(NULL != *position && (*position)->priority >= job->priority){
+        position = &(*position)->next;
+    }
+    job->next = *position;
+    *position = job;
+}
+
+/**
+ * @brief Check if the client of a queued job is still waiting.
+ *
+ * The client does not send anything after the job, so the connection is
+ * only readable when the client closed it.
+ */
+static bool client_waiting(const daemon_job_t *job){
+    struct pollfd fd = {.fd = job->connection, .events = POLLIN};
+
+    return 0 == poll(&fd, 1, 0);
+}
+
+/**
+ * @brief Hand the next queued job to the worker of an idle device.
+ */
+static void dispatch_job(daemon_device_t *device){
+    while(!device->busy && device->control >= 0 && NULL != device->queue){
+        daemon_job_t *job = device->queue;
+        int fds[DAEMON_JOB_FDS + 1] = {job->connection, job->fds[0], job->fds[1], job->fds[2]};
+
+        device->queue = job->next;
+        if(!client_waiting(job)){
+            DEBUG("Dropping a job for device %s, the client is gone", device->name);
+            free_job(job);
+            continue;
+        }
+        if(send_with_fds(device->control, job->data, job->size, fds, DAEMON_JOB_FDS + 1) < 0){
+            ERROR("Sending a job to the worker of device %s failed: %s", device->name, strerror(errno));
+            finish_job(job->connection, -1);
+        } else {
+            device->busy = true;
+        }
+        free_job(job);
+    }
+}
+
+/**
+ * @brief Queue a received job for its device.
+ */
+static void accept_job(struct daemon *daemon, daemon_job_t *job){
+    daemon_device_t *device;
+
+    device = find_device(daemon, job->data);
+    if(NULL == device){
+        reject_job(job, '\0' == *job->data ? "The daemon has more than one device, select one with --remote-device"
+            : "Unknown device %s", job->data);
+        return;
+    }
+    DEBUG("Queued a job with priority %d for device %s", job->priority, device->name);
+    queue_job(device, job);
+    dispatch_job(device);
+}
+
+/**
+ * @brief Receive the jobs of the connections that are readable or timed out.
+ *
+ * @param daemon Daemon state.
+ * @param fds Poll results of the incoming connections in list order.
+ */
+static void incoming_events(struct daemon *daemon, const struct pollfd *fds){
+    daemon_job_t **position = &daemon->incoming;
+    int status;
+
+    for(int i = 0; NULL != *position; i++){
+        daemon_job_t *job = *position;
+
+        status = 0;
+        if(0 != fds[i].revents){
+            status = receive_job(job);
+        }
+        if(0 == status && timeout_expired(&job->deadline)){
+            WARN("Ignoring a job that was not received within %d seconds", DAEMON_RECEIVE_TIMEOUT);
+            status = -1;
+        }
+        if(0 == status){
+            position = &job->next;
+            continue;
+        }
+        *position = job->next;
+        daemon->incoming_count -= 1;
+        job->next = NULL;
+        if(status < 0){
+            free_job(job);
+        }else{
+            accept_job(daemon, job);
+        }
+    }
+}
+
+/**
+ * @brief Get the poll timeout until the first incoming job must be received.
+ *
+ * @return int Timeout in milliseconds, -1 if no job is being received.
+ */
+static int incoming_timeout(struct daemon *daemon){
+    int timeout = -1;
+
+    for(daemon_job_t *job = daemon->incoming; NULL != job; job = job->next){
+        int remaining = timeout_remaining_ms(&job->deadline);
+
+        if(remaining < 0){
+            remaining = 0;
+        }
+        if(timeout < 0 || remaining < timeout){
+            timeout = remaining;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * @brief Handle the exit status of a job or the exit of a worker.
+ */
+static void worker_event(struct daemon *daemon, daemon_device_t *device){
+    int32_t status;
+    ssize_t size = read(device->control, &status, sizeof(status));
+
+    if(size < 0 && EINTR == errno){
+        return;
+    }
+    if(size == sizeof(status)){
+        DEBUG("Device %s finished a job with exit status %d", device->name, (int) status);
+        device->busy = false;
+        return;
+    }
+    // The client of a job that was running gets the end of the stream
+    WARN("The worker of device %s exited, restarting it", device->name);
+    stop_worker(device);
+    start_worker(daemon, device);
+}
+
+/**
+ * @brief Create the listening socket.
+ *
+ * A socket file that is left over from a daemon that did not stop cleanly is
+ * replaced, a socket of a daemon that is still running is not. Jobs run with
+ * the privileges of the daemon, so the socket file is created with mode 0660
+ * instead of the mode of the process umask.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int listen_socket(struct daemon *daemon){
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    mode_t saved_umask;
+    int status;
+
+    if(strlen(daemon->socket_path) >= sizeof(address.sun_path)){
+        ERROR("Socket path %s is too long", daemon->socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, daemon->socket_path);
+    daemon->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(daemon->listener < 0){
+        ERROR("Creating socket failed: %s", strerror(errno));
+        return -1;
+    }
+    saved_umask = umask(DAEMON_SOCKET_UMASK);
+    status = bind(daemon->listener, (struct sockaddr *) &address, sizeof(address));
+    if(status < 0 && EADDRINUSE == errno){
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if(probe >= 0 && connect(probe, (struct sockaddr *) &address, sizeof(address)) < 0 && ECONNREFUSED == errno){
+            unlink(daemon->socket_path);
+        }
+        if(probe >= 0){
+            close(probe);
+        }
+        status = bind(daemon->listener, (struct sockaddr *) &address, sizeof(address));
+    }
+    umask(saved_umask);
+    if(status < 0 || listen(daemon->listener, SOMAXCONN) < 0){
+        ERROR("Listening on %s failed: %s", daemon->socket_path, strerror(errno));
+        close(daemon->listener);
+        daemon->listener = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse the daemon action options.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int parse_daemon_arguments(struct daemon *daemon, int argc, char **argv){
+    static struct option long_options[] =
+    {
+        {"socket", required_argument, NULL, 's'},
+        {"devices", required_argument, NULL, 'd'},
+        {0, 0, 0, 0}
+    };
+    const char *devices = NULL;
+    int opt;
+
+    optind = 0;
+    opterr = 0;
+    while(-1 != (opt = getopt_long(argc, argv, ":", long_options, NULL))){
+        switch(opt){
+            case 's':
+                daemon->socket_path = optarg;
+                break;
+            case 'd':
+                devices = optarg;
+                break;
+            case ':':
+                ERROR("Option %s is missing its argument", argv[optind - 1]);
+                return -1;
+            default:
+                ERROR("Unrecognized option '%s'", argv[optind - 1]);
+                return -1;
+        }
+    }
+    if(NULL == daemon->socket_path){
+        ERROR("Missing required --socket option");
+        return -1;
+    }
+    if(NULL == devices){
+        ERROR("Missing required --devices option");
+        return -1;
+    }
+    return read_devices(daemon, devices);
+}
+
+/**
+ * @brief Free the daemon state.
+ */
+static void free_daemon(struct daemon *daemon){
+    while(NULL != daemon->incoming){
+        daemon_job_t *job = daemon->incoming;
+
+        daemon->incoming = job->next;
+        free_job(job);
+    }
+    for(int i = 0; i < daemon->device_count; i++){
+        while(NULL != daemon->devices[i].queue){
+            daemon_job_t *job = daemon->devices[i].queue;
+
+            daemon->devices[i].queue = job->next;
+            free_job(job);
+        }
+        free(daemon->devices[i].arguments);
+        free(daemon->devices[i].argv);
+    }
+    free(daemon->devices);
+}
+
+/**
+ * @brief Run the daemon until SIGINT or SIGTERM.
+ *
+ * @param argc The number of daemon arguments.
+ * @param argv The daemon argument vector.
+ * @return int 0 after a stop signal, -1 on error.
+ */
+int mdfu_daemon(int argc, char **argv){
+    struct daemon daemon = {.listener = -1};
+    struct sigaction action = {.sa_handler = stop_signal_handler};
+    struct pollfd *fds = NULL;
+    int status = 0;
+
+    if(parse_daemon_arguments(&daemon, argc, argv) < 0 || listen_socket(&daemon) < 0){
+        free_daemon(&daemon);
+        return -1;
+    }
+    // No SA_RESTART so that poll returns on a stop signal
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    for(int i = 0; 0 == status && i < daemon.device_count; i++){
+        status = start_worker(&daemon, &daemon.devices[i]);
+    }
+    fds = calloc((size_t) daemon.device_count + 1 + DAEMON_MAX_INCOMING, sizeof(struct pollfd));
+    if(NULL == fds){
+        status = -1;
+    }
+    if(0 == status){
+        INFO("Serving %d devices on %s", daemon.device_count, daemon.socket_path);
+    }
+    while(0 == status && !stop_requested){
+        struct pollfd *incoming = &fds[daemon.device_count + 1];
+        int incoming_count = 0;
+
+        // Further connections wait in the backlog while the most jobs are received
+        fds[0].fd = daemon.incoming_count < DAEMON_MAX_INCOMING ? daemon.listener : -1;
+        fds[0].events = POLLIN;
+        for(int i = 0; i < daemon.device_count; i++){
+            fds[i + 1].fd = daemon.devices[i].control;
+            fds[i + 1].events = POLLIN;
+        }
+        for(daemon_job_t *job = daemon.incoming; NULL != job; job = job->next){
+            incoming[incoming_count].fd = job->connection;
+            incoming[incoming_count].events = POLLIN;
+            incoming[incoming_count].revents = 0;
+            incoming_count += 1;
+        }
+        if(poll(fds, (nfds_t) (daemon.device_count + 1 + incoming_count), incoming_timeout(&daemon)) < 0){
+            if(EINTR != errno){
+                ERROR("Waiting for jobs failed: %s", strerror(errno));
+                status = -1;
+            }
+            continue;
+        }
+        for(int i = 0; i < daemon.device_count; i++){
+            if(0 != fds[i + 1].revents){
+                worker_event(&daemon, &daemon.devices[i]);
+                dispatch_job(&daemon.devices[i]);
+            }
+        }
+        incoming_events(&daemon, incoming);
+        if(0 != fds[0].revents){
+            accept_connection(&daemon);
+        }
+    }
+    INFO("Stopping, waiting for the running jobs");
+    close(daemon.listener);
+    unlink(daemon.socket_path);
+    for(int i = 0; i < daemon.device_count; i++){
+        stop_worker(&daemon.devices[i]);
+    }
+    free(fds);
+    free_daemon(&daemon);
+    return status;
+}
+
+/**
+ * @brief Submit the action of the command line as a job to a daemon.
+ *
+ * The working directory is sent with the job, so relative image paths are
+ * resolved like for a local action.
+ *
+ * @param argc The number of action arguments.
+ * @param argv The action argument vector, argv[0] is not an option.
+ * @return int Exit status of the job, -1 if it could not be run.
+ */
+int remote_submit(int argc, char **argv){
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int fds[DAEMON_JOB_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    const char *device = NULL == args.remote_device ? "" : args.remote_device;
+    const char *action = action_name(args.action);
+    daemon_job_header_t header = {.priority = args.priority};
+    char cwd[PATH_MAX];
+    char *data;
+    size_t size;
+    int32_t exit_status;
+    ssize_t received;
+    int sock;
+
+    if(TOOL_NONE != args.tool){
+        ERROR("The tool is set up by the daemon, --tool can not be used with --remote");
+        return -1;
+    }
+    if(NULL == getcwd(cwd, sizeof(cwd))){
+        ERROR("Getting the working directory failed: %s", strerror(errno));
+        return -1;
+    }
+    size = strlen(device) + strlen(cwd) + strlen(action) + 3;
+    for(int i = 1; i < argc; i++){
+        size += strlen(argv[i]) + 1;
+    }
+    if(size > DAEMON_MAX_JOB_SIZE){
+        ERROR("The job is too large");
+        return -1;
+    }
+    data = malloc(size);
+    if(NULL == data){
+        return -1;
+    }
+    header.size = (uint32_t) size;
+    size = 0;
+    size += (size_t) sprintf(&data[size], "%s", device) + 1;
+    size += (size_t) sprintf(&data[size], "%s", cwd) + 1;
+    size += (size_t) sprintf(&data[size], "%s", action) + 1;
+    for(int i = 1; i < argc; i++){
+        size += (size_t) sprintf(&data[size], "%s", argv[i]) + 1;
+    }
+    if(strlen(args.remote) >= sizeof(address.sun_path)){
+        ERROR("Socket path %s is too long", args.remote);
+        free(data);
+        return -1;
+    }
+    strcpy(address.sun_path, args.remote);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0){
+        ERROR("Connecting to the daemon on %s failed: %s", args.remote, strerror(errno));
+        if(sock >= 0){
+            close(sock);
+        }
+        free(data);
+        return -1;
+    }
+    if(send_with_fds(sock, &header, sizeof(header), fds, DAEMON_JOB_FDS) < 0 ||
+        send(sock, data, size, MSG_NOSIGNAL) != (ssize_t) size){
+        ERROR("Submitting the job failed: %s", strerror(errno));
+        close(sock);
+        free(data);
+        return -1;
+    }
+    free(data);
+    do {
+        received = read(sock, &exit_status, sizeof(exit_status));
+    } while(received < 0 && EINTR == errno);
+    close(sock);
+    if(received != sizeof(exit_status)){
+        ERROR("The daemon closed the connection before the job was done");
+        return -1;
+    }
+    return exit_status;
+}
@@ -0,0 +1,624 @@
+/**
+ * @file fleet.c
+ * @brief Runs cmdfu actions for many targets with bounded concurrency.
+ *
+ * The targets are read from a manifest with one cmdfu action per line, e.g.
+ *
+ *     update --tool serial --port /dev/ttyACM0 --baudrate 115200 --image app.img
+ *     update --tool spidev --dev /dev/spidev0.0 --image app.img --resource hub1
+ *
+ * Each target is run in a child process that is forked from this process, so
+ * the targets do not share any state and the tool and logging setup remains
+ * per target. The images of the targets are loaded once before the targets
+ * are started and the child processes read them from the memory they inherit,
+ * so an image from a pipe or the standard input can be used by all targets.
+ * A target starts only when all resources it uses are below their
+ * concurrency limit:
+ *
+ * - serial:<port> for the serial tool, limit 1.
+ * - spi:<bus> for the spidev tool, the device without the chip select, limit 1.
+ * - i2c:<adapter> for the i2cdev tool, limit 1.
+ * - network for the network tool, unlimited unless set with --limit.
+ * - Names given with --resource in the manifest line, limit 1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+#include "cmdfu.h"
+
+/**
+ * @def FLEET_MAX_RESOURCES
+ * @brief Maximum number of resources of one target.
+ */
+#define FLEET_MAX_RESOURCES 8
+
+/**
+ * @def FLEET_DEFAULT_JOBS
+ * @brief Default number of targets that run at the same time.
+ */
+#define FLEET_DEFAULT_JOBS 4
+
+/**
+ * @brief Shared resource with a concurrency limit.
+ */
+typedef struct {
+    char *name;
+    /** @brief Number of targets that can use the resource at once, -1 for no limit. */
+    int limit;
+    /** @brief Number of running targets that use the resource. */
+    int active;
+} fleet_resource_t;
+
+typedef enum {
+    TARGET_PENDING,
+    TARGET_RUNNING,
+    TARGET_DONE
+} target_state_t;
+
+/**
+ * @brief Target from the manifest.
+ */
+typedef struct {
+    int line_number;
+    /** @brief Manifest line without comment and trailing white space. */
+    char *line;
+    /** @brief Copy of the line that the arguments point into. */
+    char *arguments;
+    /** @brief Argument vector for run_action, argv[0] is the program name. */
+    char **argv;
+    int argc;
+    int resources[FLEET_MAX_RESOURCES];
+    int resource_count;
+    target_state_t state;
+    pid_t pid;
+    int attempts;
+    int exit_code;
+    timeout_t started;
+    float elapsed;
+} fleet_target_t;
+
+/**
+ * @brief Fleet state.
+ */
+struct fleet {
+    fleet_target_t *targets;
+    int target_count;
+    fleet_resource_t *resources;
+    int resource_count;
+    int jobs;
+    int retries;
+    const char *log_dir;
+};
+
+/**
+ * @brief Find a resource by name or add it.
+ *
+ * @param fleet Fleet state.
+ * @param name Resource name.
+ * @param limit Limit for a new resource.
+ * @return int Index of the resource, or -1 if memory allocation failed.
+ */
+static int get_resource(struct fleet *fleet, const char *name, int limit){
+    fleet_resource_t *resources;
+
+    for(int i = 0; i < fleet->resource_count; i++){
+        if(0 == strcmp(fleet->resources[i].name, name)){
+            return i;
+        }
+    }
+    resources = realloc(fleet->resources, (size_t) (fleet->resource_count + 1) * sizeof(fleet_resource_t));
+    if(NULL == resources){
+        return -1;
+    }
+    fleet->resources = resources;
+    resources[fleet->resource_count].name = strdup(name);
+    if(NULL == resources[fleet->resource_count].name){
+        return -1;
+    }
+    resources[fleet->resource_count].limit = limit;
+    resources[fleet->resource_count].active = 0;
+    return fleet->resource_count++;
+}
+
+/**
+ * @brief Add a resource to a target.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int add_target_resource(struct fleet *fleet, fleet_target_t *target, const char *name, int limit){
+    int resource;
+
+    if(target->resource_count >= FLEET_MAX_RESOURCES){
+        ERROR("Manifest line %d: Too many resources, at most %d are supported", target->line_number, FLEET_MAX_RESOURCES);
+        return -1;
+    }
+    resource = get_resource(fleet, name, limit);
+    if(resource < 0){
+        return -1;
+    }
+    for(int i = 0; i < target->resource_count; i++){
+        if(target->resources[i] == resource){
+            return 0;
+        }
+    }
+    target->resources[target->resource_count++] = resource;
+    return 0;
+}
+
+/**
+ * @brief Get the value of an option in an argument vector.
+ *
+ * @return const char* Option value, or NULL if the option is not present.
+ */
+static const char *get_option(int argc, char **argv, const char *option){
+    for(int i = 1; i + 1 < argc; i++){
+        if(0 == strcmp(argv[i], option)){
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add the resources that the tool of a target implies.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int add_tool_resources(struct fleet *fleet, fleet_target_t *target){
+    const char *tool = get_option(target->argc, target->argv, "--tool");
+    const char *device;
+    char name[256];
+
+    if(NULL == tool){
+        return 0;
+    }
+    if(0 == strcmp(tool, "network")){
+        return add_target_resource(fleet, target, "network", -1);
+    }
+    if(0 == strcmp(tool, "serial")){
+        device = get_option(target->argc, target->argv, "--port");
+        snprintf(name, sizeof(name), "serial:%s", NULL == device ? "" : device);
+        return add_target_resource(fleet, target, name, 1);
+    }
+    if(0 == strcmp(tool, "spidev")){
+        device = get_option(target->argc, target->argv, "--dev");
+        if(NULL == device){
+            device = "";
+        }
+        snprintf(name, sizeof(name), "spi:%s", device);
+        // All chip selects of a bus share it, /dev/spidev<bus>.<cs>
+        char *cs = strrchr(name, '.');
+        if(NULL != cs && NULL == strchr(cs, '/')){
+            *cs = '\0';
+        }
+        return add_target_resource(fleet, target, name, 1);
+    }
+    if(0 == strcmp(tool, "usb")){
+        const char *serial_number = get_option(target->argc, target->argv, "--serial-number");
+
+        device = get_option(target->argc, target->argv, "--device");
+        snprintf(name, sizeof(name), "usb:%s:%s", NULL == device ? "" : device,
+            NULL == serial_number ? "" : serial_number);
+        return add_target_resource(fleet, target, name, 1);
+    }
+    if(0 == strcmp(tool, "i2cdev")){
+        device = get_option(target->argc, target->argv, "--dev");
+        snprintf(name, sizeof(name), "i2c:%s", NULL == device ? "" : device);
+        return add_target_resource(fleet, target, name, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse a manifest line into a target.
+ *
+ * The line is split at white space. --resource options are removed from the
+ * argument vector and added to the target resources.
+ *
+ * @return int 1 if a target was added, 0 for empty lines and -1 on error.
+ */
+static int parse_target(struct fleet *fleet, char *line, int line_number){
+    fleet_target_t *target;
+    fleet_target_t *targets;
+    char *comment = strchr(line, '#');
+    char *token;
+    char *save;
+    size_t length;
+
+    if(NULL != comment){
+        *comment = '\0';
+    }
+    length = strlen(line);
+    while(length > 0 && NULL != strchr(" \t\r\n", line[length - 1])){
+        line[--length] = '\0';
+    }
+    line += strspn(line, " \t");
+    if('\0' == *line){
+        return 0;
+    }
+    targets = realloc(fleet->targets, (size_t) (fleet->target_count + 1) * sizeof(fleet_target_t));
+    if(NULL == targets){
+        return -1;
+    }
+    fleet->targets = targets;
+    target = &targets[fleet->target_count];
+    memset(target, 0, sizeof(*target));
+    target->line_number = line_number;
+    target->line = strdup(line);
+    target->arguments = strdup(line);
+    // At most one argument per two characters plus program name and NULL
+    target->argv = malloc((length / 2 + 3) * sizeof(char *));
+    fleet->target_count += 1;
+    if(NULL == target->line || NULL == target->arguments || NULL == target->argv){
+        return -1;
+    }
+    target->argv[target->argc++] = "cmdfu";
+    for(token = strtok_r(target->arguments, " \t", &save); NULL != token; token = strtok_r(NULL, " \t", &save)){
+        if(0 == strcmp(token, "--resource")){
+            token = strtok_r(NULL, " \t", &save);
+            if(NULL == token){
+                ERROR("Manifest line %d: --resource is missing its argument", line_number);
+                return -1;
+            }
+            if(add_target_resource(fleet, target, token, 1) < 0){
+                return -1;
+            }
+            continue;
+        }
+        target->argv[target->argc++] = token;
+    }
+    target->argv[target->argc] = NULL;
+    if(add_tool_resources(fleet, target) < 0){
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read all targets from the manifest file.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int read_manifest(struct fleet *fleet, const char *path){
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    int status = 0;
+
+    if(NULL == file){
+        ERROR("Opening manifest %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    while(getline(&line, &size, file) >= 0){
+        line_number += 1;
+        if(parse_target(fleet, line, line_number) < 0){
+            status = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    if(0 == status && 0 == fleet->target_count){
+        ERROR("Manifest %s does not contain any targets", path);
+        status = -1;
+    }
+    return status;
+}
+
+/**
+ * @brief Set the limit of a resource from a --limit <resource>=<count> argument.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int set_limit(struct fleet *fleet, char *limit){
+    char *separator = strrchr(limit, '=');
+    char *end;
+    long count;
+    int resource;
+
+    if(NULL == separator || separator == limit){
+        ERROR("Invalid limit %s, expected <resource>=<count>", limit);
+        return -1;
+    }
+    *separator = '\0';
+    count = strtol(separator + 1, &end, 10);
+    if('\0' != *end || count < 1){
+        ERROR("Invalid limit count %s for %s", separator + 1, limit);
+        return -1;
+    }
+    resource = get_resource(fleet, limit, (int) count);
+    if(resource < 0){
+        return -1;
+    }
+    fleet->resources[resource].limit = (int) count;
+    return 0;
+}
+
+/**
+ * @brief Check if all resources of a target are below their limit.
+ */
+static bool resources_available(const struct fleet *fleet, const fleet_target_t *target){
+    for(int i = 0; i < target->resource_count; i++){
+        const fleet_resource_t *resource = &fleet->resources[target->resources[i]];
+
+        if(resource->limit >= 0 && resource->active >= resource->limit){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Start a target in a child process.
+ *
+ * @return int 0 on success, -1 if the process could not be created.
+ */
+static int start_target(struct fleet *fleet, fleet_target_t *target){
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if(pid < 0){
+        ERROR("Starting target on manifest line %d failed: %s", target->line_number, strerror(errno));
+        return -1;
+    }
+    if(0 == pid){
+        if(NULL != fleet->log_dir){
+            char path[4096];
+            int fd;
+
+            snprintf(path, sizeof(path), "%s/%d.log", fleet->log_dir, target->line_number);
+            fd = open(path, O_WRONLY | O_CREAT | (target->attempts > 0 ? O_APPEND : O_TRUNC), 0644);
+            if(fd < 0){
+                ERROR("Opening log file %s failed: %s", path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        exit(run_action(target->argc, target->argv) & 0xff);
+    }
+    DEBUG("Started manifest line %d: %s", target->line_number, target->line);
+    target->pid = pid;
+    target->state = TARGET_RUNNING;
+    target->attempts += 1;
+    set_timeout(&target->started, 0);
+    for(int i = 0; i < target->resource_count; i++){
+        fleet->resources[target->resources[i]].active += 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait for a running target to finish.
+ *
+ * Releases the resources of the target and queues it again if it failed
+ * with an error and retries are left.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int wait_target(struct fleet *fleet){
+    fleet_target_t *target = NULL;
+    int status;
+    pid_t pid;
+
+    do {
+        pid = waitpid(-1, &status, 0);
+    } while(pid < 0 && EINTR == errno);
+    if(pid < 0){
+        ERROR("Waiting for targets failed: %s", strerror(errno));
+        return -1;
+    }
+    for(int i = 0; i < fleet->target_count; i++){
+        if(TARGET_RUNNING == fleet->targets[i].state && fleet->targets[i].pid == pid){
+            target = &fleet->targets[i];
+            break;
+        }
+    }
+    if(NULL == target){
+        return 0;
+    }
+    for(int i = 0; i < target->resource_count; i++){
+        fleet->resources[target->resources[i]].active -= 1;
+    }
+    target->elapsed += timeout_elapsed(&target->started);
+    target->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    target->state = TARGET_DONE;
+    // Only errors are retried, e.g. not a verify that found a different image
+    if(255 == target->exit_code && target->attempts <= fleet->retries){
+        INFO("Manifest line %d failed with exit code %d, retrying", target->line_number, target->exit_code);
+        target->state = TARGET_PENDING;
+    }
+    return 0;
+}
+
+/**
+ * @brief Print the result of each target and the totals.
+ *
+ * @return int Number of failed targets.
+ */
+static int print_summary(const struct fleet *fleet){
+    int failed = 0;
+
+    printf("Fleet summary\n");
+    for(int i = 0; i < fleet->target_count; i++){
+        const fleet_target_t *target = &fleet->targets[i];
+        const char *result = "ok";
+
+        if(0 != target->exit_code){
+            result = "failed";
+            failed += 1;
+        }
+        printf("line %d: %s, exit code %d, %d attempts, %.2f s: %s\n", target->line_number, result,
+            target->exit_code, target->attempts, target->elapsed, target->line);
+    }
+    printf("%d targets, %d succeeded, %d failed\n", fleet->target_count, fleet->target_count - failed, failed);
+    return failed;
+}
+
+/**
+ * @brief Parse the fleet action options.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int parse_fleet_arguments(struct fleet *fleet, int argc, char **argv, const char **manifest){
+    static struct option long_options[] =
+    {
+        {"manifest", required_argument, NULL, 'm'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"limit", required_argument, NULL, 'l'},
+        {"retries", required_argument, NULL, 'r'},
+        {"log-dir", required_argument, NULL, 'L'},
+        {0, 0, 0, 0}
+    };
+    // Limits are applied after the manifest is read so that they also
+    // cover the resources that the tools imply
+    char **limits = calloc((size_t) argc, sizeof(char *));
+    int limit_count = 0;
+    int status = 0;
+    int opt;
+
+    if(NULL == limits){
+        return -1;
+    }
+    optind = 0;
+    opterr = 0;
+    while(0 == status && -1 != (opt = getopt_long(argc, argv, ":", long_options, NULL))){
+        switch(opt){
+            case 'm':
+                *manifest = optarg;
+                break;
+            case 'j':
+                fleet->jobs = atoi(optarg);
+                if(fleet->jobs < 1){
+                    ERROR("Invalid number of jobs %s", optarg);
+                    status = -1;
+                }
+                break;
+            case 'l':
+                limits[limit_count++] = optarg;
+                break;
+            case 'r':
+                fleet->retries = atoi(optarg);
+                break;
+            case 'L':
+                fleet->log_dir = optarg;
+                break;
+            case ':':
+                ERROR("Option %s is missing its argument", argv[optind - 1]);
+                status = -1;
+                break;
+            default:
+                ERROR("Unrecognized option '%s'", argv[optind - 1]);
+                status = -1;
+                break;
+        }
+    }
+    if(0 == status && NULL == *manifest){
+        ERROR("Missing required --manifest option");
+        status = -1;
+    }
+    if(0 == status){
+        status = read_manifest(fleet, *manifest);
+    }
+    for(int i = 0; 0 == status && i < limit_count; i++){
+        status = set_limit(fleet, limits[i]);
+    }
+    free(limits);
+    return status;
+}
+
+/**
+ * @brief Free the fleet state.
+ */
+static void free_fleet(struct fleet *fleet){
+    for(int i = 0; i < fleet->target_count; i++){
+        free(fleet->targets[i].line);
+        free(fleet->targets[i].arguments);
+        free(fleet->targets[i].argv);
+    }
+    for(int i = 0; i < fleet->resource_count; i++){
+        free(fleet->resources[i].name);
+    }
+    free(fleet->targets);
+    free(fleet->resources);
+}
+
+/**
+ * @brief Run the targets of a manifest.
+ *
+ * Targets are started in manifest order as soon as a job slot is free and
+ * their resources are below the limits, so targets that wait for a busy
+ * resource do not block targets behind them.
+ *
+ * @param argc The number of fleet arguments.
+ * @param argv The fleet argument vector.
+ * @return 0 if all targets succeeded, -1 otherwise.
+ */
+int mdfu_fleet(int argc, char **argv){
+    struct fleet fleet = {
+        .jobs = FLEET_DEFAULT_JOBS,
+        .retries = 0
+    };
+    const char *manifest = NULL;
+    int running = 0;
+    int done = 0;
+    int status;
+
+    if(parse_fleet_arguments(&fleet, argc, argv, &manifest) < 0){
+        free_fleet(&fleet);
+        return -1;
+    }
+    for(int i = 0; i < fleet.target_count; i++){
+        const char *image = get_option(fleet.targets[i].argc, fleet.targets[i].argv, "--image");
+
+        // Targets open images that cannot be shared themselves and report the error
+        if(NULL != image && share_image(image) < 0){
+            WARN("Loading image %s of manifest line %d failed: %s", image, fleet.targets[i].line_number, strerror(errno));
+        }
+    }
+    while(done < fleet.target_count){
+        for(int i = 0; i < fleet.target_count && running < fleet.jobs; i++){
+            fleet_target_t *target = &fleet.targets[i];
+
+            if(TARGET_PENDING != target->state || !resources_available(&fleet, target)){
+                continue;
+            }
+            if(start_target(&fleet, target) < 0){
+                target->state = TARGET_DONE;
+                target->exit_code = 255;
+                done += 1;
+                continue;
+            }
+            running += 1;
+        }
+        if(0 == running){
+            break;
+        }
+        if(wait_target(&fleet) < 0){
+            break;
+        }
+        running = 0;
+        done = 0;
+        for(int i = 0; i < fleet.target_count; i++){
+            running += TARGET_RUNNING == fleet.targets[i].state;
+            done += TARGET_DONE == fleet.targets[i].state;
+        }
+    }
+    status = print_summary(&fleet) > 0 ? -1 : 0;
+    free_fleet(&fleet);
+    release_shared_images();
+    return status;
+}
@@ -4,9 +4,20 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "version.h"
 #include "mdfu/logging.h"
 #include "mdfu/mdfu.h"
+#include "mdfu/image_codec.h"
+#include "mdfu/sha256.h"
+#include "mdfu/transport/frame_trace.h"
+#include "mdfu/transport/serial_frame_cache.h"
 #include "cmdfu.h"
 
 struct args args = {
@@ -14,205 +25,839 @@ struct args args = {
     .version = false,
     .tool = TOOL_NONE,
     .action = ACTION_NONE,
-    .image = NULL
+    .image = NULL,
+    .skip_if_identical = false,
+    .stats = false,
+    .trace_file = NULL,
+    .frame_cache = NULL,
+    .client_info_cache = NULL,
+    .remote = NULL,
+    .remote_device = NULL,
+    .priority = 0,
+    .bench_rounds = 100,
+    .bench_chunks = 0,
+    .bench_sweep = NULL
 };
+
+/**
+ * @brief File descriptor of the --trace-file, -1 when frames are not traced.
+ */
+static int trace_fd = -1;
 extern int parse_mdfu_update_arguments(int argc, char **argv, int *new_argc, char **new_argv);
 extern int parse_common_arguments(int argc, char **argv, int *action_argc, char **action_argv);
+extern int parse_batch_arguments(int argc, char **argv, int *new_argc, char **new_argv);
+extern int parse_bench_link_arguments(int argc, char **argv, int *new_argc, char **new_argv);
 
 /**
- * @brief Retrieves and prints MDFU client information.
+ * @brief Key of the client in the --client-info-cache, set by open_session.
+ */
+static char *client_key = NULL;
+
+/**
+ * @brief Sets the key of the client from the tool and its options.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The tool argument vector, argv[0] is not a tool option.
+ */
+static void set_client_key(int argc, char **argv){
+    size_t length = strlen(tool_names[args.tool]) + 1;
+
+    for(int i = 1; i < argc; i++){
+        length += strlen(argv[i]) + 1;
+    }
+    free(client_key);
+    client_key = malloc(length);
+    if(NULL == client_key){
+        return;
+    }
+    strcpy(client_key, tool_names[args.tool]);
+    for(int i = 1; i < argc; i++){
+        strcat(client_key, " ");
+        strcat(client_key, argv[i]);
+    }
+}
+
+/**
+ * @brief Sets the client information from the --client-info-cache.
+ *
+ * The session then skips the GET_CLIENT_INFO command, the first command of
+ * the action checks the information and requests it from the client if it
+ * fails.
+ *
+ * @param session Opened MDFU session.
+ */
+void load_client_info(mdfu_session_t *session){
+    client_info_t client_info;
+
+    if(NULL == args.client_info_cache || NULL == client_key){
+        return;
+    }
+    if(client_cache_load(args.client_info_cache, client_key, &client_info) < 0){
+        DEBUG("No client information stored for %s", client_key);
+        return;
+    }
+    if(mdfu_session_set_client_info(session, &client_info) < 0){
+        WARN("Ignoring the stored client information for %s", client_key);
+        return;
+    }
+    DEBUG("Using the stored client information for %s", client_key);
+}
+
+/**
+ * @brief Updates the --client-info-cache after an action.
+ *
+ * Client information that the client confirmed is stored. After a failed
+ * action the entry is removed, so that the next action requests the client
+ * information again.
+ *
+ * @param session MDFU session of the action.
+ * @param status Exit status of the action.
+ */
+void store_client_info(const mdfu_session_t *session, int status){
+    client_info_t client_info;
+    bool confirmed;
+
+    if(NULL == args.client_info_cache || NULL == client_key){
+        return;
+    }
+    confirmed = status >= 0 && mdfu_session_get_confirmed_client_info(session, &client_info);
+    if(client_cache_store(args.client_info_cache, client_key, confirmed ? &client_info : NULL) < 0){
+        WARN("Updating the client information cache %s failed: %s", args.client_info_cache, strerror(errno));
+    }
+}
+
+/**
+ * @brief Connects to the client with the tool that --tool selected.
  *
  * This function performs the following steps:
  * 1. Retrieves the tool based on the provided type.
  * 2. Parses the arguments for the tool.
  * 3. Initializes the tool.
- * 4. Initializes the MDFU protocol.
+ * 4. Creates the MDFU session.
  * 5. Opens a connection to the tool.
- * 6. Retrieves client information.
- * 7. Prints the client information.
- * 8. Closes the connection and frees allocated resources.
  *
- * If any step fails, an error message is printed, resources are freed, and the function exits with a failure code.
+ * If any step fails, an error message is printed and the resources are freed.
  *
  * @param argc The number of tool arguments.
  * @param argv The tool argument vector.
+ * @param session Pointer where the opened MDFU session is stored.
+ * @param transport Pointer where the transport of the session is stored.
+ * @param tool_conf Pointer where the tool configuration is stored, it is
+ *                  released with close_session.
  * @return 0 on success, -1 on failure.
  */
-static int mdfu_client_info(int argc, char **argv){
+int open_session(int argc, char **argv, mdfu_session_t **session, transport_t **transport, void **tool_conf){
     tool_t *tool;
-    void *tool_conf = NULL;
-    client_info_t client_info;
 
+    *session = NULL;
+    *tool_conf = NULL;
     if(get_tool_by_type(args.tool, &tool) < 0){
         ERROR("Invalid tool selected");
-        goto err_exit;
+        return -1;
     }
-    if(tool->parse_arguments(argc, argv, &tool_conf) < 0){
+    if(tool->parse_arguments(argc, argv, tool_conf) < 0){
         ERROR("Invalid tool argument");
         goto err_exit;
     }
-    if(tool->init(tool_conf) < 0){
+    if(tool->init(*tool_conf, transport) < 0){
         ERROR("Tool initialization failed");
         goto err_exit;
     }
-
-    if(mdfu_init(&tool->ops, 2) < 0){
+    if(mdfu_session_create(session, *transport, MDFU_RETRY_BUDGET_DEFAULT) < 0){
         ERROR("MDFU protocol initialization failed");
+        transport_free(*transport);
         goto err_exit;
     }
-
-    if(mdfu_open() < 0){
+    if(mdfu_open(*session) < 0){
         ERROR("Connecting to tool failed");
+        mdfu_session_destroy(*session);
+        *session = NULL;
         goto err_exit;
     }
+    set_client_key(argc, argv);
+    return 0;
+
+    err_exit:
+        free(*tool_conf);
+        *tool_conf = NULL;
+        return -1;
+}
 
-    if(mdfu_get_client_info(&client_info) < 0){
+/**
+ * @brief Closes the connection that open_session opened and frees the session.
+ *
+ * @param session MDFU session, can be NULL.
+ * @param tool_conf Tool configuration, can be NULL.
+ */
+void close_session(mdfu_session_t *session, void *tool_conf){
+    free(client_key);
+    client_key = NULL;
+    if(NULL != session){
+        mdfu_close(session);
+        mdfu_session_destroy(session);
+    }
+    free(tool_conf);
+}
+
+/**
+ * @brief Retrieves and prints the MDFU client information.
+ *
+ * The client information is only requested once per session, so this does
+ * not add a command when an earlier action of the session requested it.
+ *
+ * @param session Opened MDFU session.
+ * @return 0 on success, -1 on failure.
+ */
+int session_client_info(mdfu_session_t *session){
+    client_info_t client_info;
+
+    if(mdfu_session_get_client_info(session, &client_info) < 0){
         ERROR("Failed to get client info");
-        mdfu_close();
-        goto err_exit;
+        return -1;
     }
     print_client_info(&client_info);
-    mdfu_close();
-    free(tool_conf);
     return 0;
+}
 
-    err_exit:
-        if(NULL != tool_conf){
-            free(tool_conf);
-        }
+/**
+ * @brief Retrieves and prints MDFU client information.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The tool argument vector.
+ * @return 0 on success, -1 on failure.
+ */
+static int mdfu_client_info(int argc, char **argv){
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+    int status;
+
+    if(open_session(argc, argv, &session, &transport, &tool_conf) < 0){
         return -1;
+    }
+    status = session_client_info(session);
+    store_client_info(session, status);
+    close_session(session, tool_conf);
+    return status;
 }
 
 /**
- * @brief Perform a firmware update using the specified tool and image file.
+ * @brief Prints the session statistics if requested with --stats.
  *
- * This function handles the process of updating firmware by performing the following steps:
- * 1. Retrieve the tool based on the specified type.
- * 2. Parse the arguments for the tool configuration.
- * 3. Open the firmware image file.
- * 4. Initialize the tool with the parsed configuration.
- * 5. Initialize the MDFU protocol.
- * 6. Connect to the tool.
- * 7. Run the firmware update process.
- * 8. Close the MDFU connection and the firmware image file reader.
+ * @param session MDFU session, can be NULL if the session was not created.
+ */
+void report_stats(const mdfu_session_t *session){
+    mdfu_stats_t stats;
+
+    if(args.stats && NULL != session){
+        mdfu_get_stats(session, &stats);
+        print_stats_json(stdout, &stats);
+    }
+}
+
+#ifndef _WIN32
+/**
+ * @brief Image that is loaded once and read by many actions.
+ */
+typedef struct {
+    char *path;
+    fwimg_image_t *image;
+} shared_image_t;
+
+/**
+ * @brief Images loaded with share_image, inherited by the fleet targets.
+ */
+static shared_image_t *shared_images = NULL;
+static int shared_image_count = 0;
+
+/**
+ * @brief Finds a shared image by its path.
  *
- * @param argc The number of tool arguments.
- * @param argv The array of tool arguments.
- * @return 0 on success, -1 on failure.
+ * @param path Image path as given with --image.
+ * @return fwimg_image_t* The image, or NULL if it is not shared.
  */
-static int mdfu_update(int argc, char **argv){
-    tool_t *tool;
-    void *tool_conf = NULL;
+static fwimg_image_t *find_shared_image(const char *path){
+    for(int i = 0; NULL != path && i < shared_image_count; i++){
+        if(0 == strcmp(shared_images[i].path, path)){
+            return shared_images[i].image;
+        }
+    }
+    return NULL;
+}
 
-    if(get_tool_by_type(args.tool, &tool) < 0){
-        ERROR("Invalid tool selected");
-        goto err_exit;
+/**
+ * @brief Loads an image once for all actions that use it.
+ *
+ * Actions that are run afterwards in this process or in forked child
+ * processes read the shared image with their own reader instead of opening
+ * the image file, so the image is only read once and kept in memory once.
+ * Images from pipes and the standard input can then be used by many actions.
+ *
+ * @param path Image path as given with --image.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int share_image(const char *path){
+    shared_image_t *images;
+    fwimg_image_t *image;
+
+    if(NULL != find_shared_image(path)){
+        return 0;
     }
-    if(tool->parse_arguments(argc, argv, &tool_conf) < 0){
-        ERROR("Invalid tool argument");
-        goto err_exit;
+    images = realloc(shared_images, (size_t) (shared_image_count + 1) * sizeof(shared_image_t));
+    if(NULL == images){
+        errno = ENOMEM;
+        return -1;
     }
-    if(fwimg_file_reader.open(args.image) < 0){
-        ERROR("Opening image file failed: %s", strerror(errno));
-        goto err_exit;
+    shared_images = images;
+    if(fwimg_image_open(&image, path) < 0){
+        return -1;
     }
-    if(tool->init(tool_conf) < 0){
-        ERROR("Tool initialization failed");
-        goto err_exit;
+    shared_images[shared_image_count].path = strdup(path);
+    if(NULL == shared_images[shared_image_count].path){
+        fwimg_image_unref(image);
+        errno = ENOMEM;
+        return -1;
+    }
+    shared_images[shared_image_count].image = image;
+    shared_image_count += 1;
+    return 0;
+}
+
+/**
+ * @brief Releases the images loaded with share_image.
+ */
+void release_shared_images(void){
+    for(int i = 0; i < shared_image_count; i++){
+        free(shared_images[i].path);
+        fwimg_image_unref(shared_images[i].image);
     }
+    free(shared_images);
+    shared_images = NULL;
+    shared_image_count = 0;
+}
+#endif
 
-    if(mdfu_init(&tool->ops, 2) < 0){
-        ERROR("MDFU protocol initialization failed");
-        goto err_exit;
+/**
+ * @brief Checks if the image can only be read once.
+ *
+ * @return true if the image is the standard input or not a regular file and
+ *         was not loaded with share_image.
+ */
+static bool image_is_stream(void){
+    struct stat st;
+
+#ifndef _WIN32
+    if(NULL != find_shared_image(args.image)){
+        return false;
+    }
+#endif
+    if(0 == strcmp(args.image, "-")){
+        return true;
     }
+    return 0 == stat(args.image, &st) && !S_ISREG(st.st_mode);
+}
 
-    if(mdfu_open() < 0){
-        ERROR("Connecting to tool failed");
-        goto err_exit;
+/**
+ * @brief Opens the image file with the best reader for it.
+ *
+ * Images loaded with share_image are read from memory. Otherwise the image is
+ * mapped into memory if possible or read ahead in a background thread, which
+ * also supports reading the image from pipes and from the standard input with "-"
+ * and decompresses gzip, zstd and LZ4 compressed images.
+ *
+ * @param image_reader Pointer where the image reader that opened the image is stored.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int open_image_reader(image_reader_t **image_reader){
+#ifndef _WIN32
+    fwimg_image_t *shared_image = find_shared_image(args.image);
+
+    if(NULL != shared_image){
+        return fwimg_image_reader_create(shared_image, image_reader);
+    }
+    if(fwimg_mmap_reader.open(&fwimg_mmap_reader, args.image) == 0){
+        const void *magic;
+        ssize_t magic_size = fwimg_mmap_reader.peek(&fwimg_mmap_reader, &magic, 4);
+
+        if(magic_size < 0 || !image_codec_is_compressed(magic, (size_t) magic_size)){
+            *image_reader = &fwimg_mmap_reader;
+            return 0;
+        }
+        // Compressed images are decompressed while reading ahead
+        fwimg_mmap_reader.close(&fwimg_mmap_reader);
+    }
+    *image_reader = &fwimg_prefetch_reader;
+    return fwimg_prefetch_reader.open(&fwimg_prefetch_reader, args.image);
+#endif
+    *image_reader = &fwimg_file_reader;
+    return fwimg_file_reader.open(&fwimg_file_reader, args.image);
+}
+
+/**
+ * @brief Opens the image file for reading.
+ *
+ * With --expect-sha256 the image is hashed while it is read and reading the
+ * end of the image fails if the digest differs.
+ *
+ * @param image_reader Pointer where the image reader that opened the image is stored.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int open_image(image_reader_t **image_reader){
+    image_reader_t *hash_reader;
+
+    if(open_image_reader(image_reader) < 0){
+        return -1;
+    }
+    if(NULL == args.expect_sha256){
+        return 0;
+    }
+    if(fwimg_sha256_reader_create(*image_reader, args.expect_sha256, &hash_reader) < 0){
+        (*image_reader)->close(*image_reader);
+        *image_reader = &fwimg_file_reader;
+        return -1;
+    }
+    *image_reader = hash_reader;
+    return 0;
+}
+
+/**
+ * @brief Sets up the --frame-cache for the update.
+ *
+ * The frames are assembled from the cache for image data that is borrowed from
+ * the image in memory, so the cache is not used for images that are read
+ * ahead from pipes or the standard input or by transports without serial framing.
+ *
+ * @param transport Transport of the update.
+ * @param image_reader Image reader that opened the image, before anything is read.
+ * @return serial_frame_cache_t* Frame cache that is released with close_frame_cache
+ *         after the update, or NULL if the cache is not used.
+ */
+static serial_frame_cache_t *open_frame_cache(transport_t *transport, image_reader_t *image_reader){
+    serial_frame_cache_t *cache = NULL;
+#ifndef _WIN32
+    const void *image;
+    ssize_t image_size;
+
+    if(NULL == args.frame_cache){
+        return NULL;
+    }
+    if(NULL == image_reader->peek){
+        WARN("--frame-cache is ignored for images that are read as a stream");
+        return NULL;
+    }
+    image_size = image_reader->peek(image_reader, &image, SIZE_MAX);
+    if(image_size <= 0 || serial_frame_cache_create(&cache, args.frame_cache, image, (size_t) image_size) < 0){
+        WARN("--frame-cache is ignored: %s", strerror(errno));
+        return NULL;
+    }
+    if(transport->ioctl(transport, TRANSPORT_IOC_FRAME_CACHE, cache) < 0){
+        WARN("--frame-cache is ignored, the tool does not use serial framing");
+        serial_frame_cache_destroy(cache);
+        return NULL;
+    }
+#else
+    (void) transport;
+    (void) image_reader;
+    if(NULL != args.frame_cache){
+        WARN("--frame-cache is not supported on this platform");
     }
+#endif
+    return cache;
+}
+
+/**
+ * @brief Releases the --frame-cache after the update.
+ *
+ * @param cache Frame cache, can be NULL.
+ */
+static void close_frame_cache(serial_frame_cache_t *cache){
+#ifndef _WIN32
+    serial_frame_cache_destroy(cache);
+#else
+    (void) cache;
+#endif
+}
+
+/**
+ * @brief Perform a firmware update with an opened image on an opened session.
+ *
+ * With --skip-if-identical the client image is compared with the image file
+ * first and the update is skipped if they match. With --frame-cache the frames
+ * are sent from the frame cache file.
+ *
+ * @param session Opened MDFU session.
+ * @param transport Transport of the session.
+ * @param image_reader Reader that opened the image, it is closed when the update is done.
+ * @return 0 on success, -1 on failure.
+ */
+static int update_image(mdfu_session_t *session, transport_t *transport, image_reader_t *image_reader){
+    serial_frame_cache_t *frame_cache = NULL;
+    bool identical = false;
 
-    if(mdfu_run_update(&fwimg_file_reader) < 0){
+    if(args.skip_if_identical){
+        if(image_is_stream()){
+            ERROR("--skip-if-identical requires an image that can be read twice, not a pipe or standard input");
+            goto err_exit;
+        }
+        if(mdfu_run_verify(session, image_reader, &identical) < 0){
+            ERROR("Firmware verification failed");
+            goto err_exit;
+        }
+        // Start reading the image from the beginning for the update
+        image_reader->close(image_reader);
+        image_reader = &fwimg_file_reader;
+        if(!identical && open_image(&image_reader) < 0){
+            ERROR("Opening image file failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    if(identical){
+        printf("Client firmware is identical to the image, skipping update\n");
+        return 0;
+    }
+    frame_cache = open_frame_cache(transport, image_reader);
+    if(mdfu_run_update(session, image_reader) < 0){
         ERROR("Firmware update failed");
         goto err_exit;
     }
-    mdfu_close();
-    fwimg_file_reader.close();
+    image_reader->close(image_reader);
+    close_frame_cache(frame_cache);
     printf("Firmware update completed successfully\n");
     return 0;
 
     err_exit:
-        fwimg_file_reader.close();
-        mdfu_close();
-        if(NULL != tool_conf){
-            free(tool_conf);
-        }
+        image_reader->close(image_reader);
+        close_frame_cache(frame_cache);
         return -1;
 }
 
 /**
- * @brief Perform a firmware dump (download) using the specified tool and output file.
+ * @brief Perform a firmware update with the image file on an opened session.
  *
- * This function handles the process of dumping firmware by performing the following steps:
- * 1. Retrieve the tool based on the specified type.
- * 2. Parse the arguments for the tool configuration.
- * 3. Open the output file for writing the dumped firmware.
- * 4. Initialize the tool with the parsed configuration.
- * 5. Initialize the MDFU protocol.
- * 6. Connect to the tool.
- * 7. Run the firmware dump process.
- * 8. Close the MDFU connection and the output file writer.
+ * @param session Opened MDFU session.
+ * @param transport Transport of the session.
+ * @return 0 on success, -1 on failure.
+ */
+int session_update(mdfu_session_t *session, transport_t *transport){
+    image_reader_t *image_reader = &fwimg_file_reader;
+
+    if(open_image(&image_reader) < 0){
+        ERROR("Opening image file failed: %s", strerror(errno));
+        return -1;
+    }
+    return update_image(session, transport, image_reader);
+}
+
+/**
+ * @brief Image that is opened while the tool connects to the client.
+ */
+typedef struct {
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+    image_reader_t *image_reader;
+    int status;
+    int error;
+} image_loader_t;
+
+/**
+ * @brief Reads a mapped image into memory and checks its --expect-sha256 digest.
+ *
+ * Touching each page moves the page faults of the mapping out of the
+ * transfer. A mapped image can be hashed before the first chunk is sent,
+ * so an image with the wrong digest is not sent at all.
+ *
+ * @param image_reader Reader that mapped the image.
+ * @return 0 on success, -1 with errno set to EBADMSG if the digest differs.
+ */
+static int preload_mapped_image(image_reader_t *image_reader){
+    const uint8_t *image;
+    ssize_t image_size = image_reader->peek(image_reader, (const void **) &image, SIZE_MAX);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    volatile uint8_t sink = 0;
+    sha256_t *sha;
+
+    if(image_size <= 0){
+        return 0;
+    }
+    for(ssize_t offset = 0; offset < image_size; offset += 4096){
+        sink ^= image[offset];
+    }
+    (void) sink;
+    if(NULL == args.expect_sha256 || sha256_create(&sha) < 0){
+        return 0;
+    }
+    sha256_update(sha, (size_t) image_size, image);
+    sha256_final(sha, digest);
+    sha256_destroy(sha);
+    if(0 != memcmp(digest, args.expect_sha256, SHA256_DIGEST_SIZE)){
+        ERROR("Image SHA-256 does not match the expected digest");
+        errno = EBADMSG;
+        return -1;
+    }
+    DEBUG("Image SHA-256 matches the expected digest");
+    return 0;
+}
+
+/**
+ * @brief Opens the image for an image loader.
+ *
+ * Mapped images are read into memory and hashed here, other images are
+ * hashed while they are sent.
+ *
+ * @param loader Image loader.
+ */
+static void load_image(image_loader_t *loader){
+    loader->image_reader = &fwimg_file_reader;
+#ifndef _WIN32
+    if(NULL == find_shared_image(args.image) && fwimg_mmap_reader.open(&fwimg_mmap_reader, args.image) == 0){
+        const void *magic;
+        ssize_t magic_size = fwimg_mmap_reader.peek(&fwimg_mmap_reader, &magic, 4);
+
+        if(magic_size < 0 || !image_codec_is_compressed(magic, (size_t) magic_size)){
+            loader->image_reader = &fwimg_mmap_reader;
+            loader->status = preload_mapped_image(&fwimg_mmap_reader);
+            loader->error = errno;
+            if(loader->status < 0){
+                fwimg_mmap_reader.close(&fwimg_mmap_reader);
+                loader->image_reader = &fwimg_file_reader;
+            }
+            return;
+        }
+        fwimg_mmap_reader.close(&fwimg_mmap_reader);
+    }
+#endif
+    loader->status = open_image(&loader->image_reader);
+    loader->error = errno;
+}
+
+#ifndef _WIN32
+static void *image_loader_thread(void *arg){
+    load_image(arg);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Starts opening the image in a background thread.
+ *
+ * The image is opened directly if the thread cannot be started or on
+ * platforms without threads.
+ *
+ * @param loader Image loader, finished with finish_image_loader.
+ */
+static void start_image_loader(image_loader_t *loader){
+#ifndef _WIN32
+    if(0 == pthread_create(&loader->thread, NULL, image_loader_thread, loader)){
+        return;
+    }
+#endif
+    load_image(loader);
+#ifndef _WIN32
+    loader->thread = pthread_self();
+#endif
+}
+
+/**
+ * @brief Waits until the image loader opened the image.
+ *
+ * @param loader Image loader.
+ * @param image_reader Pointer where the reader of the image is stored.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int finish_image_loader(image_loader_t *loader, image_reader_t **image_reader){
+#ifndef _WIN32
+    if(!pthread_equal(loader->thread, pthread_self())){
+        pthread_join(loader->thread, NULL);
+    }
+#endif
+    *image_reader = loader->image_reader;
+    errno = loader->error;
+    return loader->status;
+}
+
+/**
+ * @brief Perform a firmware update using the specified tool and image file.
+ *
+ * This function handles the process of updating firmware by performing the following steps:
+ * 1. Start opening the image in the background.
+ * 2. Connect to the client with the tool, see open_session, and get the
+ *    client information while the image is opened.
+ * 3. Run the firmware update process when the image is open, see update_image.
+ * 4. Print the statistics with --stats.
+ * 5. Close the MDFU connection.
  *
  * @param argc The number of tool arguments.
  * @param argv The array of tool arguments.
  * @return 0 on success, -1 on failure.
  */
-static int mdfu_dump(int argc, char **argv){
-    tool_t *tool;
-    void *tool_conf = NULL;
+static int mdfu_update(int argc, char **argv){
+    mdfu_session_t *session;
+    transport_t *transport;
+    image_reader_t *image_reader;
+    image_loader_t loader = {0};
+    client_info_t client_info;
+    void *tool_conf;
+    int status = 0;
 
-    if(get_tool_by_type(args.tool, &tool) < 0){
-        ERROR("Invalid tool selected");
-        goto err_exit;
+    start_image_loader(&loader);
+    if(open_session(argc, argv, &session, &transport, &tool_conf) < 0){
+        status = -1;
+    } else {
+        load_client_info(session);
+        if(mdfu_session_get_client_info(session, &client_info) < 0){
+            ERROR("Failed to get client info");
+            status = -1;
+        }
     }
-    if(tool->parse_arguments(argc, argv, &tool_conf) < 0){
-        ERROR("Invalid tool argument");
-        goto err_exit;
+    if(finish_image_loader(&loader, &image_reader) < 0){
+        ERROR("Opening image file failed: %s", strerror(errno));
+        status = -1;
+    } else if(status < 0){
+        image_reader->close(image_reader);
     }
-    if(fwimg_file_writer.open(args.image) < 0){
-        ERROR("Opening output file failed: %s", strerror(errno));
-        goto err_exit;
+    if(NULL == session){
+        return -1;
     }
-    if(tool->init(tool_conf) < 0){
-        ERROR("Tool initialization failed");
-        goto err_exit;
+    if(0 == status){
+        status = update_image(session, transport, image_reader);
     }
+    store_client_info(session, status);
+    report_stats(session);
+    close_session(session, tool_conf);
+    return status;
+}
 
-    if(mdfu_init(&tool->ops, 2) < 0){
-        ERROR("MDFU protocol initialization failed");
-        goto err_exit;
-    }
+/**
+ * @brief Perform a firmware dump (download) into the image file on an opened session.
+ *
+ * @param session Opened MDFU session.
+ * @return 0 on success, -1 on failure.
+ */
+int session_dump(mdfu_session_t *session){
+#ifndef _WIN32
+    // Write the image in the background so that disk latency does not delay the transfer
+    image_writer_t *image_writer = &fwimg_async_writer;
+#else
+    image_writer_t *image_writer = &fwimg_file_writer;
+#endif
 
-    if(mdfu_open() < 0){
-        ERROR("Connecting to tool failed");
-        goto err_exit;
+    if(image_writer->open(args.image) < 0){
+        ERROR("Opening output file failed: %s", strerror(errno));
+        return -1;
     }
-
-    if(mdfu_run_dump(&fwimg_file_writer) < 0){
+    if(mdfu_run_dump(session, image_writer) < 0){
         ERROR("Firmware dump failed");
-        goto err_exit;
+        image_writer->close();
+        return -1;
+    }
+    if(image_writer->close() < 0){
+        ERROR("Writing output file failed: %s", strerror(errno));
+        return -1;
     }
-    mdfu_close();
-    fwimg_file_writer.close();
     printf("Firmware dump completed successfully\n");
     return 0;
+}
 
-    err_exit:
-        fwimg_file_writer.close();
-        mdfu_close();
-        if(NULL != tool_conf){
-            free(tool_conf);
-        }
+/**
+ * @brief Perform a firmware dump (download) using the specified tool and output file.
+ *
+ * This function handles the process of dumping firmware by performing the following steps:
+ * 1. Connect to the client with the tool, see open_session.
+ * 2. Run the firmware dump process, see session_dump.
+ * 3. Print the statistics with --stats.
+ * 4. Close the MDFU connection.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The array of tool arguments.
+ * @return 0 on success, -1 on failure.
+ */
+static int mdfu_dump(int argc, char **argv){
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+    int status;
+
+    if(open_session(argc, argv, &session, &transport, &tool_conf) < 0){
+        return -1;
+    }
+    load_client_info(session);
+    status = session_dump(session);
+    store_client_info(session, status);
+    report_stats(session);
+    close_session(session, tool_conf);
+    return status;
+}
+
+/**
+ * @brief Compare the client firmware with the image file on an opened session.
+ *
+ * @param session Opened MDFU session.
+ * @return 0 if the client firmware matches the image, 1 if it differs, -1 on failure.
+ */
+int session_verify(mdfu_session_t *session){
+    image_reader_t *image_reader = &fwimg_file_reader;
+    bool identical;
+
+    if(open_image(&image_reader) < 0){
+        ERROR("Opening image file failed: %s", strerror(errno));
+        return -1;
+    }
+    if(mdfu_run_verify(session, image_reader, &identical) < 0){
+        ERROR("Firmware verification failed");
+        image_reader->close(image_reader);
+        return -1;
+    }
+    image_reader->close(image_reader);
+    if(!identical){
+        printf("Client firmware differs from the image\n");
+        return 1;
+    }
+    printf("Client firmware is identical to the image\n");
+    return 0;
+}
+
+/**
+ * @brief Compare the client firmware with an image file using the specified tool.
+ *
+ * This function handles the process of verifying firmware by performing the following steps:
+ * 1. Connect to the client with the tool, see open_session.
+ * 2. Run the firmware verification process, see session_verify.
+ * 3. Close the MDFU connection.
+ *
+ * @param argc The number of tool arguments.
+ * @param argv The array of tool arguments.
+ * @return 0 if the client firmware matches the image, 1 if it differs, -1 on failure.
+ */
+static int mdfu_verify(int argc, char **argv){
+    mdfu_session_t *session;
+    transport_t *transport;
+    void *tool_conf;
+    int status;
+
+    if(open_session(argc, argv, &session, &transport, &tool_conf) < 0){
         return -1;
+    }
+    load_client_info(session);
+    status = session_verify(session);
+    store_client_info(session, status);
+    close_session(session, tool_conf);
+    return status;
+}
+
+/**
+ * @brief Perform a mode change on an opened session.
+ *
+ * @param session Opened MDFU session.
+ * @return 0 on success, -1 on failure.
+ */
+int session_change_mode(mdfu_session_t *session) {
+  if (mdfu_run_change_mode(session) < 0) {
+    ERROR("Change mode failed");
+    return -1;
+  }
+  printf("Mode change completed successfully\n");
+  return 0;
 }
 
 /**
@@ -220,59 +865,85 @@ static int mdfu_dump(int argc, char **argv){
  *
  * This function handles the process of changing mode by performing the
  * following steps:
- * 1. Retrieve the tool based on the specified type.
- * 2. Parse the arguments for the tool configuration.
- * 3. Initialize the tool with the parsed configuration.
- * 4. Initialize the MDFU protocol.
- * 5. Connect to the tool.
- * 6. Run the change mode process.
- * 7. Close the MDFU connection and the firmware image file reader.
+ * 1. Connect to the client with the tool, see open_session.
+ * 2. Run the change mode process.
+ * 3. Close the MDFU connection.
  *
  * @param argc The number of tool arguments.
  * @param argv The array of tool arguments.
  * @return 0 on success, -1 on failure.
  */
 static int mdfu_change_mode(int argc, char **argv) {
-  tool_t *tool;
-  void *tool_conf = NULL;
-
-  if (get_tool_by_type(args.tool, &tool) < 0) {
-    ERROR("Invalid tool selected");
-    goto err_exit;
-  }
-  if (tool->parse_arguments(argc, argv, &tool_conf) < 0) {
-    ERROR("Invalid tool argument");
-    goto err_exit;
-  }
-  if (tool->init(tool_conf) < 0) {
-    ERROR("Tool initialization failed");
-    goto err_exit;
-  }
+  mdfu_session_t *session;
+  transport_t *transport;
+  void *tool_conf;
+  int status;
 
-  if (mdfu_init(&tool->ops, 2) < 0) {
-    ERROR("MDFU protocol initialization failed");
-    goto err_exit;
+  if (open_session(argc, argv, &session, &transport, &tool_conf) < 0) {
+    return -1;
   }
+  load_client_info(session);
+  status = session_change_mode(session);
+  store_client_info(session, status);
+  close_session(session, tool_conf);
+  return status;
+}
 
-  if (mdfu_open() < 0) {
-    ERROR("Connecting to tool failed");
-    goto err_exit;
-  }
+/**
+ * @brief Writes the frame trace on a signal.
+ *
+ * SIGUSR1 writes the trace and continues, other signals write the trace and
+ * then terminate the process with the default action of the signal.
+ *
+ * @param sig Signal number.
+ */
+static void trace_signal_handler(int sig){
+    frame_trace_dump(trace_fd);
+#ifdef SIGUSR1
+    if(SIGUSR1 == sig){
+        return;
+    }
+#endif
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-  if (mdfu_run_change_mode() < 0) {
-    ERROR("Change mode failed");
-    goto err_exit;
-  }
-  mdfu_close();
-  printf("Mode change completed successfully\n");
-  return 0;
+/**
+ * @brief Starts recording transport frames if requested with --trace-file.
+ *
+ * @return 0 on success, -1 if the trace file could not be opened.
+ */
+static int start_trace(void){
+    if(NULL == args.trace_file){
+        return 0;
+    }
+    trace_fd = open(args.trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace_fd < 0){
+        ERROR("Opening trace file failed: %s", strerror(errno));
+        return -1;
+    }
+    frame_trace_enable(true);
+    signal(SIGINT, trace_signal_handler);
+    signal(SIGTERM, trace_signal_handler);
+#ifdef SIGUSR1
+    signal(SIGUSR1, trace_signal_handler);
+#endif
+    return 0;
+}
 
-err_exit:
-  mdfu_close();
-  if (NULL != tool_conf) {
-    free(tool_conf);
-  }
-  return -1;
+/**
+ * @brief Writes the recorded transport frames to the trace file.
+ */
+static void stop_trace(void){
+    if(trace_fd < 0){
+        return;
+    }
+    frame_trace_enable(false);
+    if(frame_trace_dump(trace_fd) < 0){
+        ERROR("Writing trace file failed: %s", strerror(errno));
+    }
+    close(trace_fd);
+    trace_fd = -1;
 }
 
 /**
@@ -305,6 +976,137 @@ void tools_help(void){
     }
 }
 
+/**
+ * @brief Runs the action that parse_common_arguments selected.
+ *
+ * @param action_argc Number of action arguments.
+ * @param action_argv Action argument vector from parse_common_arguments.
+ * @return int Exit status of the action.
+ */
+static int run_parsed_action(int action_argc, char **action_argv){
+    // Keep it simple and allocate enough space for pointers to all
+    // action arguments since we don't know how many are tool options.
+    char **tool_argv = malloc((action_argc + 1) * sizeof(void *));
+    int tool_argc;
+    int exit_status = 0;
+
+    if(NULL != args.remote && ACTION_NONE != args.action){
+#ifndef _WIN32
+        exit_status = remote_submit(action_argc, action_argv);
+#else
+        ERROR("Remote actions are not supported on this platform");
+        exit_status = -1;
+#endif
+        free(tool_argv);
+        return exit_status;
+    }
+    switch(args.action){
+        case ACTION_UPDATE:
+            exit_status = parse_mdfu_update_arguments(action_argc, action_argv, &tool_argc, tool_argv);
+            if(0 == exit_status){
+                exit_status = mdfu_update(tool_argc, tool_argv);
+            }
+            break;
+        case ACTION_CLIENT_INFO:
+            exit_status = mdfu_client_info(action_argc, action_argv);
+            break;
+        case ACTION_TOOLS_HELP:
+            tools_help();
+            break;
+        case ACTION_CHANGE_MODE:
+            exit_status = mdfu_change_mode(action_argc, action_argv);
+            break;
+        case ACTION_DUMP:
+            exit_status = parse_mdfu_update_arguments(action_argc, action_argv, &tool_argc, tool_argv);
+            if(0 == exit_status){
+                exit_status = mdfu_dump(tool_argc, tool_argv);
+            }
+            break;
+        case ACTION_VERIFY:
+            exit_status = parse_mdfu_update_arguments(action_argc, action_argv, &tool_argc, tool_argv);
+            if(0 == exit_status){
+                exit_status = mdfu_verify(tool_argc, tool_argv);
+            }
+            break;
+        case ACTION_FLEET:
+#ifndef _WIN32
+            exit_status = mdfu_fleet(action_argc, action_argv);
+#else
+            ERROR("The fleet action is not supported on this platform");
+            exit_status = -1;
+#endif
+            break;
+        case ACTION_BATCH:
+#ifndef _WIN32
+            exit_status = parse_batch_arguments(action_argc, action_argv, &tool_argc, tool_argv);
+            if(0 == exit_status){
+                exit_status = mdfu_batch(tool_argc, tool_argv);
+            }
+#else
+            ERROR("The batch action is not supported on this platform");
+            exit_status = -1;
+#endif
+            break;
+        case ACTION_DAEMON:
+#ifndef _WIN32
+            exit_status = mdfu_daemon(action_argc, action_argv);
+#else
+            ERROR("The daemon action is not supported on this platform");
+            exit_status = -1;
+#endif
+            break;
+        case ACTION_BENCH_LINK:
+            exit_status = parse_bench_link_arguments(action_argc, action_argv, &tool_argc, tool_argv);
+            if(0 == exit_status){
+                exit_status = mdfu_bench_link(tool_argc, tool_argv);
+            }
+            break;
+        default:
+            break;
+    }
+    free(tool_argv);
+    return exit_status;
+}
+
+/**
+ * @brief Runs a cmdfu action from a complete argument vector.
+ *
+ * The global arguments are reset first, so that this can run the targets of
+ * a fleet one after the other. A fleet within a fleet is not supported.
+ *
+ * @param argc Argument count, argv[0] is the program name.
+ * @param argv Argument vector.
+ * @return int Exit status of the action.
+ */
+int run_action(int argc, char **argv){
+    char **action_argv = malloc((argc + 1) * sizeof(void *));
+    int action_argc;
+    int exit_status;
+
+    args.help = false;
+    args.version = false;
+    args.tool = TOOL_NONE;
+    args.action = ACTION_NONE;
+    args.image = NULL;
+    args.skip_if_identical = false;
+    args.stats = false;
+    args.bench_rounds = 100;
+    args.bench_chunks = 0;
+    args.bench_sweep = NULL;
+    // Restart the argument parsing of getopt
+    optind = 0;
+    exit_status = parse_common_arguments(argc, argv, &action_argc, action_argv);
+    if(0 == exit_status && (ACTION_FLEET == args.action || ACTION_DAEMON == args.action)){
+        ERROR("A fleet manifest can not contain fleet or daemon actions");
+        exit_status = -1;
+    }
+    if(0 == exit_status){
+        exit_status = run_parsed_action(action_argc, action_argv);
+    }
+    free(action_argv);
+    return exit_status;
+}
+
 /**
  * @brief Main entry point for MDFU application
  * 
@@ -318,43 +1120,30 @@ int main(int argc, char **argv)
     // Keep it simple and allocate enough space for pointers to all
     // arguments in argv since we don't know how many of the options
     // are tools options.
-    char **action_argv = malloc(argc * sizeof(void *));
+    char **action_argv;
     int action_argc;
-    char **tool_argv;
-    int tool_argc;
 
     init_logging(stderr);
+#ifdef CMDFU_DAEMON
+    // cmdfud is cmdfu with the daemon action, which is inserted as the
+    // first argument so that all given arguments are daemon options
+    char **daemon_argv = malloc((argc + 2) * sizeof(void *));
 
-    exit_status = parse_common_arguments(argc, argv, &action_argc, action_argv);
+    daemon_argv[0] = argv[0];
+    daemon_argv[1] = "daemon";
+    memcpy(&daemon_argv[2], &argv[1], argc * sizeof(void *));
+    argc += 1;
+    argv = daemon_argv;
+#endif
+    action_argv = malloc((argc + 1) * sizeof(void *));
 
+    exit_status = parse_common_arguments(argc, argv, &action_argc, action_argv);
     if(0 == exit_status){
-        switch(args.action){
-            case ACTION_UPDATE:
-                tool_argv = malloc(action_argc * sizeof(void *));
-                exit_status = parse_mdfu_update_arguments(action_argc, action_argv, &tool_argc, tool_argv);
-                if(0 == exit_status){
-                    exit_status = mdfu_update(tool_argc, tool_argv);
-                }
-                break;
-            case ACTION_CLIENT_INFO:
-                exit_status = mdfu_client_info(action_argc, action_argv);
-                break;
-            case ACTION_TOOLS_HELP:
-                tools_help();
-                break;
-            case ACTION_CHANGE_MODE:
-                exit_status = mdfu_change_mode(action_argc, action_argv);
-                break;
-            case ACTION_DUMP:
-                tool_argv = malloc(action_argc * sizeof(void *));
-                exit_status = parse_mdfu_update_arguments(action_argc, action_argv, &tool_argc, tool_argv);
-                if(0 == exit_status){
-                    exit_status = mdfu_dump(tool_argc, tool_argv);
-                }
-                break;
-            default:
-                break;
-        }
+        exit_status = start_trace();
+    }
+    if(0 == exit_status){
+        exit_status = run_parsed_action(action_argc, action_argv);
     }
+    stop_trace();
     exit(exit_status);
 }
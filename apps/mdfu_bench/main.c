@@ -0,0 +1,520 @@
+/**
+ * @file main.c
+ * @brief MDFU host throughput benchmark.
+ *
+ * Runs firmware updates and dumps against the simulated MDFU client MAC for
+ * each transport and reports the throughput, the number of MAC operations per
+ * chunk and the CPU time that the host spends per chunk. Each MAC operation
+ * corresponds to a system call of the hardware MAC that the simulated client
+ * replaces.
+ *
+ * With --virtual-clock the timeouts run on a virtual clock that the simulated
+ * client advances, so slow lines, long command delays and timeouts after
+ * dropped commands are simulated without waiting for them and the throughput
+ * is reported for the simulated time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include "mdfu/mdfu.h"
+#include "mdfu/mac/sim_mac.h"
+#include "mdfu/transport/transport.h"
+#include "mdfu/transport/serial_frame_cache.h"
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+
+/**
+ * @brief Benchmarked transport.
+ */
+struct bench_transport {
+    const char *name;
+    transport_type_t type;
+    sim_framing_t framing;
+};
+
+static const struct bench_transport bench_transports[] = {
+    {.name = "serial", .type = SERIAL_TRANSPORT, .framing = SIM_FRAMING_SERIAL},
+    {.name = "serial-buffered", .type = SERIAL_TRANSPORT_BUFFERED, .framing = SIM_FRAMING_SERIAL},
+    {.name = "spi", .type = SPI_TRANSPORT, .framing = SIM_FRAMING_SPI},
+    {.name = "i2c", .type = I2C_TRANSPORT, .framing = SIM_FRAMING_I2C}
+};
+
+#define BENCH_TRANSPORT_COUNT (int) (sizeof(bench_transports) / sizeof(bench_transports[0]))
+
+/**
+ * @brief Benchmarked action.
+ *
+ * BENCH_STEP runs the update with the step driven session API.
+ */
+enum bench_action {
+    BENCH_UPDATE,
+    BENCH_DUMP,
+    BENCH_STEP,
+    BENCH_ACTION_COUNT
+};
+
+static const char *bench_action_names[BENCH_ACTION_COUNT] = {"update", "dump", "step"};
+
+/**
+ * @brief Benchmark result of one run.
+ */
+struct bench_result {
+    double wall_time;
+    double cpu_time;
+    struct sim_mac_stats stats;
+};
+
+/**
+ * @brief In memory image that is written by updates and compared with dumps.
+ *
+ * Dumps are received into the lent buffer, like into the buffers of the
+ * write-behind image writer.
+ */
+static struct {
+    uint8_t *data;
+    size_t size;
+    size_t offset;
+    bool mismatch;
+    uint8_t lent[0x10000];
+} memory_image;
+
+static int memory_open(const char *fpath){
+    (void) fpath;
+    memory_image.offset = 0;
+    memory_image.mismatch = false;
+    return 0;
+}
+
+static int memory_close(void){
+    return 0;
+}
+
+static int memory_reader_open(const image_reader_t *reader, const char *fpath){
+    (void) reader;
+    return memory_open(fpath);
+}
+
+static int memory_reader_close(const image_reader_t *reader){
+    (void) reader;
+    return memory_close();
+}
+
+static ssize_t memory_read(const image_reader_t *reader, void *data, size_t size){
+    size_t remaining = memory_image.size - memory_image.offset;
+
+    (void) reader;
+    if(size > remaining){
+        size = remaining;
+    }
+    memcpy(data, &memory_image.data[memory_image.offset], size);
+    memory_image.offset += size;
+    return (ssize_t) size;
+}
+
+static ssize_t memory_peek(const image_reader_t *reader, const void **data, size_t size){
+    size_t remaining = memory_image.size - memory_image.offset;
+
+    (void) reader;
+    *data = &memory_image.data[memory_image.offset];
+    return (ssize_t) (size < remaining ? size : remaining);
+}
+
+static int memory_advance(const image_reader_t *reader, size_t size){
+    (void) reader;
+    if(size > memory_image.size - memory_image.offset){
+        errno = EINVAL;
+        return -1;
+    }
+    memory_image.offset += size;
+    return 0;
+}
+
+static ssize_t memory_write(void *data, size_t size){
+    if(size > memory_image.size - memory_image.offset ||
+        0 != memcmp(data, &memory_image.data[memory_image.offset], size)){
+        memory_image.mismatch = true;
+    }
+    memory_image.offset += size;
+    return (ssize_t) size;
+}
+
+static ssize_t memory_reserve(void **data, size_t size){
+    if(size > sizeof(memory_image.lent)){
+        return 0;
+    }
+    *data = memory_image.lent;
+    return (ssize_t) size;
+}
+
+static int memory_commit(size_t size){
+    return memory_write(memory_image.lent, size) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Image reader that borrows the data from the in memory image.
+ */
+static const image_reader_t memory_reader = {
+    .open = memory_reader_open,
+    .close = memory_reader_close,
+    .read = memory_read,
+    .peek = memory_peek,
+    .advance = memory_advance
+};
+
+/**
+ * @brief Image writer that compares the data with the in memory image.
+ */
+static const image_writer_t memory_writer = {
+    .open = memory_open,
+    .close = memory_close,
+    .write = memory_write,
+    .reserve = memory_reserve,
+    .commit = memory_commit
+};
+
+static double clock_seconds(clockid_t clock){
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Virtual clock of the timeouts, used with --virtual-clock.
+ */
+static timeout_virtual_clock_t virtual_clock;
+static bool use_virtual_clock = false;
+
+/**
+ * @brief Get the time of the timeout clock in seconds.
+ */
+static double timeout_clock_seconds(void){
+    struct timespec now;
+
+    timeout_now(&now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Run a step driven update from a poll loop.
+ *
+ * @param session Open MDFU session.
+ * @return int 0 on success, -1 on failure.
+ */
+static int run_step_update(mdfu_session_t *session){
+    struct pollfd pfd = {.events = POLLIN};
+    int status;
+
+    if(mdfu_session_start_update(session, &memory_reader) < 0){
+        return -1;
+    }
+    pfd.fd = mdfu_session_get_fd(session);
+    while(MDFU_STEP_PENDING == (status = mdfu_session_step(session))){
+        if(poll(&pfd, pfd.fd < 0 ? 0 : 1, mdfu_session_next_deadline(session)) < 0 && errno != EINTR){
+            return -1;
+        }
+    }
+    return MDFU_STEP_DONE == status ? 0 : -1;
+}
+
+/**
+ * @brief Run one update or dump against the simulated client.
+ *
+ * @param transport_info Transport to benchmark.
+ * @param config Simulated client configuration, the framing is set for the transport.
+ * @param action Action to run.
+ * @param retries Size of the MDFU session retry budget.
+ * @param frame_cache_path Frame cache file for updates with serial framing, or NULL.
+ * @param result Pointer where the result is stored.
+ * @return int 0 on success, -1 on failure.
+ */
+static int run_bench(const struct bench_transport *transport_info, struct sim_mac_config *config,
+                     enum bench_action action, int retries, const char *frame_cache_path,
+                     struct bench_result *result){
+    bool dump = BENCH_DUMP == action;
+    mac_t *mac;
+    transport_t *transport;
+    mdfu_session_t *session = NULL;
+    serial_frame_cache_t *frame_cache = NULL;
+    double wall_start;
+    double cpu_start;
+    int status;
+
+    config->framing = transport_info->framing;
+    if(get_sim_mac(&mac) < 0){
+        return -1;
+    }
+    if(mac->init(mac, config) < 0){
+        mac_free(mac);
+        return -1;
+    }
+    if(get_transport(transport_info->type, &transport) < 0){
+        mac_free(mac);
+        return -1;
+    }
+    transport->init(transport, mac, 2);
+    if(config->i2c_combined_response && SIM_FRAMING_I2C == config->framing){
+        transport->ioctl(transport, TRANSPORT_IOC_SPECULATIVE_READ, true);
+    }
+    if(NULL != frame_cache_path && !dump && SIM_FRAMING_SERIAL == config->framing){
+        if(serial_frame_cache_create(&frame_cache, frame_cache_path, memory_image.data, memory_image.size) < 0){
+            transport_free(transport);
+            return -1;
+        }
+        transport->ioctl(transport, TRANSPORT_IOC_FRAME_CACHE, frame_cache);
+    }
+    if(mdfu_session_create(&session, transport, retries) < 0){
+        transport_free(transport);
+        serial_frame_cache_destroy(frame_cache);
+        return -1;
+    }
+    if(mdfu_open(session) < 0){
+        mdfu_session_destroy(session);
+        serial_frame_cache_destroy(frame_cache);
+        return -1;
+    }
+    memory_open(NULL);
+    wall_start = timeout_clock_seconds();
+    cpu_start = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if(dump){
+        status = mdfu_run_dump(session, &memory_writer);
+    } else if(BENCH_STEP == action){
+        status = run_step_update(session);
+    } else {
+        status = mdfu_run_update(session, &memory_reader);
+    }
+    result->cpu_time = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    result->wall_time = timeout_clock_seconds() - wall_start;
+    sim_mac_get_stats(mac, &result->stats);
+    mdfu_close(session);
+    mdfu_session_destroy(session);
+    serial_frame_cache_destroy(frame_cache);
+
+    if(status < 0){
+        return -1;
+    }
+    if(dump && (memory_image.mismatch || memory_image.offset != memory_image.size)){
+        ERROR("Dumped image does not match the client image");
+        return -1;
+    }
+    if(!dump && result->stats.image_bytes != memory_image.size){
+        ERROR("Client received %llu bytes but the image has %zu bytes", result->stats.image_bytes, memory_image.size);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_result(const char *transport, const char *action, const struct bench_result *result){
+    unsigned long chunks = result->stats.chunks ? result->stats.chunks : 1;
+
+    printf("%-16s %-7s %12.0f %11.2f %14.1f %9lu %9lu %9lu\n",
+        transport, action,
+        (double) memory_image.size / result->wall_time,
+        (double) result->stats.calls / chunks,
+        result->cpu_time * 1e6 / chunks,
+        result->stats.dropped, result->stats.corrupted, result->stats.resends);
+}
+
+static void print_help(void){
+    printf("Usage: mdfu_bench [options]\n"
+        "\n"
+        "Runs MDFU firmware updates and dumps against a simulated client and reports\n"
+        "the host throughput, MAC operations (system calls) per chunk and host CPU time\n"
+        "per chunk for each transport.\n"
+        "\n"
+        "Options:\n"
+        "  --transport <name>      Transport to benchmark, can be repeated. One of serial,\n"
+        "                          serial-buffered, spi or i2c. Default is all transports.\n"
+        "  --action <name>         update, dump, step or all. Default is all. step runs\n"
+        "                          the update with the step driven session API.\n"
+        "  --image-size <bytes>    Image size, default 262144.\n"
+        "  --buffer-size <bytes>   Client command buffer size, default 512.\n"
+        "  --buffer-count <count>  Client command buffer count, default 1.\n"
+        "  --line-rate <bytes/s>   Emulated line rate, default 0 for no line delay.\n"
+        "  --command-delay <s>     Client processing time per command, default 0.\n"
+        "  --jitter <s>            Random extra processing time per command up to this limit.\n"
+        "  --drop <probability>    Probability that the client drops a command.\n"
+        "  --corrupt <probability> Probability that a response frame is corrupted.\n"
+        "  --resend <probability>  Probability that the client requests a resend.\n"
+        "  --seed <seed>           Seed for the error injection, default 1.\n"
+        "  --retries <count>       MDFU session retry budget, default 8.\n"
+        "  --speculative-read      I2C client sends the response frame right after the\n"
+        "                          length frame and the host reads both at once.\n"
+        "  --frame-cache <file>    Send the update frames of the serial transports from\n"
+        "                          the frame cache <file>, which is built if needed.\n"
+        "  --virtual-clock         Run the timeouts on a virtual clock that the simulated\n"
+        "                          client advances and report the simulated throughput.\n"
+        "  -v, --verbose <level>   Logging verbosity: error, warning, info or debug.\n"
+        "  -h, --help              Show this help.\n");
+}
+
+int main(int argc, char **argv){
+    static const struct option long_options[] = {
+        {"transport", required_argument, 0, 't'},
+        {"action", required_argument, 0, 'a'},
+        {"image-size", required_argument, 0, 's'},
+        {"buffer-size", required_argument, 0, 'b'},
+        {"buffer-count", required_argument, 0, 'c'},
+        {"line-rate", required_argument, 0, 'r'},
+        {"command-delay", required_argument, 0, 'd'},
+        {"jitter", required_argument, 0, 'j'},
+        {"drop", required_argument, 0, 'D'},
+        {"corrupt", required_argument, 0, 'C'},
+        {"resend", required_argument, 0, 'R'},
+        {"seed", required_argument, 0, 'S'},
+        {"retries", required_argument, 0, 'n'},
+        {"speculative-read", no_argument, 0, 'P'},
+        {"frame-cache", required_argument, 0, 'F'},
+        {"virtual-clock", no_argument, 0, 'V'},
+        {"verbose", required_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    static const char *levels[] = {"error", "warning", "info", "debug"};
+    struct sim_mac_config config = {
+        .buffer_size = 512,
+        .buffer_count = 1,
+        .seed = 1
+    };
+    bool selected[BENCH_TRANSPORT_COUNT] = {false};
+    bool any_selected = false;
+    bool run_action[BENCH_ACTION_COUNT] = {true, true, true};
+    int retries = MDFU_RETRY_BUDGET_DEFAULT;
+    const char *frame_cache_path = NULL;
+    int failures = 0;
+    int opt;
+    struct bench_result result;
+
+    memory_image.size = 256 * 1024;
+    init_logging(stderr);
+    while(-1 != (opt = getopt_long(argc, argv, "v:h", long_options, NULL))){
+        switch(opt){
+            case 't':
+                for(int i = 0; i < BENCH_TRANSPORT_COUNT; i++){
+                    if(0 == strcmp(optarg, bench_transports[i].name)){
+                        selected[i] = true;
+                        any_selected = true;
+                        break;
+                    }
+                    if(BENCH_TRANSPORT_COUNT - 1 == i){
+                        ERROR("Invalid transport %s", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case 'a': {
+                bool valid = false;
+
+                for(int i = 0; i < BENCH_ACTION_COUNT; i++){
+                    run_action[i] = 0 == strcmp(optarg, bench_action_names[i]) || 0 == strcmp(optarg, "all");
+                    valid = valid || run_action[i];
+                }
+                if(!valid){
+                    ERROR("Invalid action %s", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 's':
+                memory_image.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                config.buffer_size = (uint16_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                config.buffer_count = (uint8_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                config.line_rate = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                config.command_delay = strtof(optarg, NULL);
+                break;
+            case 'j':
+                config.command_jitter = strtof(optarg, NULL);
+                break;
+            case 'D':
+                config.drop_rate = strtof(optarg, NULL);
+                break;
+            case 'C':
+                config.corrupt_rate = strtof(optarg, NULL);
+                break;
+            case 'R':
+                config.resend_rate = strtof(optarg, NULL);
+                break;
+            case 'S':
+                config.seed = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                retries = atoi(optarg);
+                break;
+            case 'P':
+                config.i2c_combined_response = true;
+                break;
+            case 'F':
+                frame_cache_path = optarg;
+                break;
+            case 'V':
+                use_virtual_clock = true;
+                break;
+            case 'v':
+                for(int i = 0; i < 4; i++){
+                    if(0 == strcmp(optarg, levels[i])){
+                        set_debug_level(ERRORLEVEL + i);
+                    }
+                }
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+
+    memory_image.data = malloc(memory_image.size ? memory_image.size : 1);
+    if(NULL == memory_image.data){
+        ERROR("Allocating the image failed");
+        return 1;
+    }
+    // Include the serial framing reserved codes in the image
+    for(size_t i = 0; i < memory_image.size; i++){
+        memory_image.data[i] = (uint8_t) ((i * 2654435761U) >> 13);
+    }
+    config.image = memory_image.data;
+    config.image_size = memory_image.size;
+    if(use_virtual_clock){
+        timeout_virtual_clock_init(&virtual_clock);
+        timeout_set_clock(&virtual_clock.clock);
+    }
+
+    printf("image size %zu bytes, buffer size %u, buffer count %u, line rate %u bytes/s, command delay %g s%s\n",
+        memory_image.size, config.buffer_size, config.buffer_count, config.line_rate, config.command_delay,
+        use_virtual_clock ? ", virtual clock" : "");
+    printf("%-16s %-7s %12s %11s %14s %9s %9s %9s\n",
+        "transport", "action", "bytes/s", "calls/chunk", "cpu/chunk[us]", "dropped", "corrupted", "resends");
+    for(int i = 0; i < BENCH_TRANSPORT_COUNT; i++){
+        if(any_selected && !selected[i]){
+            continue;
+        }
+        for(int action = 0; action < BENCH_ACTION_COUNT; action++){
+            if(!run_action[action]){
+                continue;
+            }
+            if(run_bench(&bench_transports[i], &config, (enum bench_action) action, retries, frame_cache_path, &result) < 0){
+                printf("%-16s %-7s failed\n", bench_transports[i].name, bench_action_names[action]);
+                failures++;
+                continue;
+            }
+            print_result(bench_transports[i].name, bench_action_names[action], &result);
+        }
+    }
+    free(memory_image.data);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,473 @@
+/**
+ * @file main.c
+ * @brief Micro-benchmarks of the MDFU codec functions.
+ *
+ * Measures the time per byte and the heap allocations of the functions that
+ * encode and decode every MDFU packet and transport frame, for payloads with
+ * random bytes, with serial framing reserved codes only, which is the worst
+ * case of the serial framing, and with zeros. Each case runs for a minimum
+ * time in several rounds and the fastest round is reported, so that other
+ * load on the host has less influence on the result.
+ *
+ * The results can be saved as a baseline, later runs compared with it fail
+ * when a case got slower than the tolerance allows or allocates more.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "mdfu/mdfu.h"
+#include "mdfu/checksum.h"
+#include "mdfu/transport/serial_framing.h"
+#include "mdfu/logging.h"
+
+ssize_t mdfu_encode_cmd_packet(mdfu_packet_t *mdfu_packet);
+int mdfu_decode_packet(mdfu_packet_t *mdfu_packet, mdfu_packet_type_t type, int packet_size);
+int mdfu_decode_client_info(const uint8_t *data, int length, client_info_t *client_info);
+int spi_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size);
+int i2c_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size);
+
+/**
+ * @brief Largest payload size.
+ */
+#define MAX_PAYLOAD_SIZE 65536
+
+/**
+ * @brief Number of rounds per case, the fastest round is reported.
+ */
+#define ROUNDS 5
+
+/**
+ * @brief Maximum number of results in a baseline file.
+ */
+#define MAX_BASELINE_ENTRIES 64
+
+#ifdef MICROBENCH_COUNT_ALLOCATIONS
+/**
+ * @brief Number of heap allocations by the MDFU libraries.
+ *
+ * The executable is linked with --wrap for the allocation functions, so
+ * all calls from the libraries are counted here. Calls from the C library
+ * itself are not counted.
+ */
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *data, size_t size);
+
+void *__wrap_malloc(size_t size){
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size){
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *data, size_t size){
+    allocations++;
+    return __real_realloc(data, size);
+}
+#endif
+
+/**
+ * @brief Payload kind of a case.
+ */
+typedef enum {
+    PAYLOAD_RANDOM,
+    PAYLOAD_RESERVED,
+    PAYLOAD_ZEROS,
+    PAYLOAD_COUNT
+} payload_t;
+
+static const char *payload_names[PAYLOAD_COUNT] = {"random", "reserved", "zeros"};
+
+/**
+ * @brief Buffers that the benchmarked functions work on.
+ *
+ * input holds the payload, encoded the serial framing encoding of the
+ * payload that the decode case decodes.
+ */
+static struct {
+    int size;
+    uint8_t input[MAX_PAYLOAD_SIZE + 2];
+    uint8_t encoded[SERIAL_FRAME_MAX_SIZE(MAX_PAYLOAD_SIZE)];
+    int encoded_size;
+    uint8_t output[SERIAL_FRAME_MAX_SIZE(MAX_PAYLOAD_SIZE)];
+    /** @brief Sink for results, so that calls are not optimized away. */
+    volatile unsigned int sink;
+} bench;
+
+static const uint8_t client_info_data[] = {
+    2, 3, 0x00, 0x02, 2,    // Buffer info, size 512, 2 buffers
+    1, 3, 1, 2, 3,          // Protocol version 1.2.3
+    3, 9, 0, 10, 0,         // Command timeouts, default 10
+    3, 10, 0,               //   Write chunk 10
+    4, 0xf4, 0x01,          //   Get image state 500
+    4, 4, 0xe8, 0x03, 0, 0  // Inter transaction delay 1000 ns
+};
+
+static void run_crc16(void){
+    bench.sink += calculate_crc16(bench.size, bench.input);
+}
+
+static void run_serial_encode(void){
+    bench.sink += (unsigned int) serial_frame_encode_payload(bench.size, bench.input, bench.output);
+}
+
+static void run_serial_decode(void){
+    bench.sink += (unsigned int) serial_frame_decode_payload(bench.encoded_size, bench.encoded,
+        (int) sizeof(bench.output), bench.output);
+}
+
+static void run_encode_cmd_packet(void){
+    mdfu_packet_t packet = {
+        .sequence_number = 5,
+        .sync = false,
+        .command = WRITE_CHUNK,
+        .data_length = (uint16_t) bench.size,
+        .data = &bench.input[2],
+        .buf = bench.input
+    };
+
+    bench.sink += (unsigned int) mdfu_encode_cmd_packet(&packet);
+}
+
+static void run_decode_packet(void){
+    mdfu_packet_t packet = {.buf = bench.output};
+
+    bench.sink += (unsigned int) mdfu_decode_packet(&packet, MDFU_CMD, bench.size + 2) + packet.data_length;
+}
+
+static void run_decode_client_info(void){
+    client_info_t client_info;
+
+    bench.sink += (unsigned int) mdfu_decode_client_info(client_info_data, bench.size, &client_info) +
+        client_info.buffer_size;
+}
+
+static void run_spi_cmd_frame(void){
+    int frame_size;
+
+    bench.sink += (unsigned int) spi_create_cmd_frame(bench.size, bench.input, &frame_size, bench.output,
+        (int) sizeof(bench.output)) + (unsigned int) frame_size;
+}
+
+static void run_i2c_cmd_frame(void){
+    int frame_size;
+
+    bench.sink += (unsigned int) i2c_create_cmd_frame(bench.size, bench.input, &frame_size, bench.output,
+        (int) sizeof(bench.output)) + (unsigned int) frame_size;
+}
+
+/**
+ * @brief Benchmarked function.
+ *
+ * Functions with a fixed input, like the client information, are measured
+ * with one payload and their own input size.
+ */
+struct bench_case {
+    const char *name;
+    void (*run)(void);
+    bool fixed_input;
+};
+
+static const struct bench_case cases[] = {
+    {.name = "calculate_crc16", .run = run_crc16},
+    {.name = "serial_frame_encode_payload", .run = run_serial_encode},
+    {.name = "serial_frame_decode_payload", .run = run_serial_decode},
+    {.name = "mdfu_encode_cmd_packet", .run = run_encode_cmd_packet},
+    {.name = "mdfu_decode_packet", .run = run_decode_packet},
+    {.name = "mdfu_decode_client_info", .run = run_decode_client_info, .fixed_input = true},
+    {.name = "spi_create_cmd_frame", .run = run_spi_cmd_frame},
+    {.name = "i2c_create_cmd_frame", .run = run_i2c_cmd_frame}
+};
+
+#define CASE_COUNT (int) (sizeof(cases) / sizeof(cases[0]))
+
+/**
+ * @brief Result of a case, also the format of a baseline entry.
+ */
+struct bench_result {
+    char name[64];
+    char payload[16];
+    int size;
+    double ns_per_byte;
+    unsigned long allocations;
+};
+
+static double clock_ns(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+}
+
+/**
+ * @brief Fill the input with a payload and prepare the encoded copy for decoding.
+ */
+static void prepare_payload(payload_t payload, int size){
+    static const uint8_t reserved[] = {FRAME_START_CODE, FRAME_END_CODE, ESCAPE_SEQ_CODE};
+    uint32_t state = 1;
+
+    for(int i = 0; i < size + 2; i++){
+        switch(payload){
+            case PAYLOAD_RANDOM:
+                state = state * 1664525U + 1013904223U;
+                bench.input[i] = (uint8_t) (state >> 24);
+                break;
+            case PAYLOAD_RESERVED:
+                bench.input[i] = reserved[i % 3];
+                break;
+            default:
+                bench.input[i] = 0;
+                break;
+        }
+    }
+    bench.size = size;
+    bench.encoded_size = serial_frame_encode_payload(size, bench.input, bench.encoded);
+    // A valid write chunk command for the packet decoder
+    bench.output[0] = 5;
+    bench.output[1] = WRITE_CHUNK;
+}
+
+/**
+ * @brief Run a case for at least min_time per round and return the best time per call.
+ *
+ * @param bench_case Case to run.
+ * @param min_time Minimum time of a round in seconds.
+ * @param[out] allocations_per_call Heap allocations per call.
+ * @return double Nanoseconds per call.
+ */
+static double measure(const struct bench_case *bench_case, double min_time, unsigned long *allocations_per_call){
+    double best = 0;
+    long iterations = 1;
+    double start;
+    double elapsed;
+
+    // Find the number of calls that takes min_time
+    for(;;){
+        start = clock_ns();
+        for(long i = 0; i < iterations; i++){
+            bench_case->run();
+        }
+        elapsed = clock_ns() - start;
+        if(elapsed >= min_time * 1e9 || iterations >= (1L << 40)){
+            break;
+        }
+        iterations *= elapsed > 0 && elapsed * 8 < min_time * 1e9 ? 8 : 2;
+    }
+    best = elapsed / (double) iterations;
+    for(int round = 1; round < ROUNDS; round++){
+        start = clock_ns();
+        for(long i = 0; i < iterations; i++){
+            bench_case->run();
+        }
+        elapsed = (clock_ns() - start) / (double) iterations;
+        if(elapsed < best){
+            best = elapsed;
+        }
+    }
+#ifdef MICROBENCH_COUNT_ALLOCATIONS
+    allocations = 0;
+    bench_case->run();
+    *allocations_per_call = allocations;
+#else
+    *allocations_per_call = 0;
+#endif
+    return best;
+}
+
+/**
+ * @brief Read a baseline file.
+ *
+ * @return int Number of entries, or -1 on error with errno set.
+ */
+static int read_baseline(const char *path, struct bench_result *entries){
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int count = 0;
+
+    if(NULL == file){
+        return -1;
+    }
+    while(count < MAX_BASELINE_ENTRIES && NULL != fgets(line, sizeof(line), file)){
+        struct bench_result *entry = &entries[count];
+
+        if('#' == line[0]){
+            continue;
+        }
+        if(5 == sscanf(line, "%63s %15s %d %lf %lu", entry->name, entry->payload, &entry->size,
+                &entry->ns_per_byte, &entry->allocations)){
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+/**
+ * @brief Find the baseline entry of a result.
+ *
+ * @return const struct bench_result* Entry, or NULL if the baseline does not have the case.
+ */
+static const struct bench_result *find_baseline(const struct bench_result *entries, int count,
+                                                const struct bench_result *result){
+    for(int i = 0; i < count; i++){
+        if(0 == strcmp(entries[i].name, result->name) && 0 == strcmp(entries[i].payload, result->payload) &&
+            entries[i].size == result->size){
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void print_help(void){
+    printf("Usage: mdfu_microbench [options]\n"
+        "\n"
+        "Measures the time per byte and heap allocations per call of the MDFU codec\n"
+        "functions for random payloads, payloads of serial framing reserved codes\n"
+        "and payloads of zeros.\n"
+        "\n"
+        "Options:\n"
+        "  --size <bytes>          Payload size, default 512.\n"
+        "  --min-time <s>          Minimum time per round, default 0.05.\n"
+        "  --filter <text>         Only run functions whose name contains <text>.\n"
+        "  --save-baseline <file>  Write the results to <file>.\n"
+        "  --baseline <file>       Compare the results with <file> and fail when a case\n"
+        "                          is slower than the tolerance or allocates more.\n"
+        "  --tolerance <fraction>  Allowed slowdown against the baseline, default 0.25.\n"
+        "  -h, --help              Show this help.\n");
+}
+
+int main(int argc, char **argv){
+    static const struct option long_options[] = {
+        {"size", required_argument, 0, 's'},
+        {"min-time", required_argument, 0, 't'},
+        {"filter", required_argument, 0, 'f'},
+        {"save-baseline", required_argument, 0, 'S'},
+        {"baseline", required_argument, 0, 'B'},
+        {"tolerance", required_argument, 0, 'T'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    static struct bench_result baseline[MAX_BASELINE_ENTRIES];
+    int size = 512;
+    double min_time = 0.05;
+    double tolerance = 0.25;
+    const char *filter = NULL;
+    const char *save_path = NULL;
+    const char *baseline_path = NULL;
+    FILE *save_file = NULL;
+    int baseline_count = 0;
+    int regressions = 0;
+    int opt;
+
+    init_logging(stderr);
+    while(-1 != (opt = getopt_long(argc, argv, "h", long_options, NULL))){
+        switch(opt){
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 't':
+                min_time = strtod(optarg, NULL);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'S':
+                save_path = optarg;
+                break;
+            case 'B':
+                baseline_path = optarg;
+                break;
+            case 'T':
+                tolerance = strtod(optarg, NULL);
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if(size < 1 || size > MAX_PAYLOAD_SIZE){
+        ERROR("Payload size must be between 1 and %d bytes", MAX_PAYLOAD_SIZE);
+        return 1;
+    }
+    if(NULL != baseline_path){
+        baseline_count = read_baseline(baseline_path, baseline);
+        if(baseline_count < 0){
+            ERROR("Reading baseline %s failed: %s", baseline_path, strerror(errno));
+            return 1;
+        }
+    }
+    if(NULL != save_path){
+        save_file = fopen(save_path, "w");
+        if(NULL == save_file){
+            ERROR("Opening %s failed: %s", save_path, strerror(errno));
+            return 1;
+        }
+        fprintf(save_file, "# name payload size ns/byte allocations\n");
+    }
+
+    printf("%-28s %-9s %6s %10s %9s %7s %10s\n", "function", "payload", "bytes", "ns/call", "ns/byte", "allocs", "baseline");
+    for(int i = 0; i < CASE_COUNT; i++){
+        if(NULL != filter && NULL == strstr(cases[i].name, filter)){
+            continue;
+        }
+        for(int payload = 0; payload < PAYLOAD_COUNT; payload++){
+            struct bench_result result = {0};
+            const struct bench_result *reference;
+            const char *verdict = "-";
+            double ns_per_call;
+
+            if(cases[i].fixed_input && PAYLOAD_RANDOM != payload){
+                continue;
+            }
+            prepare_payload((payload_t) payload, size);
+            if(cases[i].fixed_input){
+                bench.size = (int) sizeof(client_info_data);
+            }
+            ns_per_call = measure(&cases[i], min_time, &result.allocations);
+            snprintf(result.name, sizeof(result.name), "%s", cases[i].name);
+            snprintf(result.payload, sizeof(result.payload), "%s", cases[i].fixed_input ? "fixed" : payload_names[payload]);
+            result.size = bench.size;
+            result.ns_per_byte = ns_per_call / bench.size;
+
+            reference = find_baseline(baseline, baseline_count, &result);
+            if(NULL != reference){
+                if(result.ns_per_byte > reference->ns_per_byte * (1 + tolerance)){
+                    verdict = "SLOWER";
+                    regressions++;
+                } else if(result.allocations > reference->allocations){
+                    verdict = "ALLOCS";
+                    regressions++;
+                } else {
+                    verdict = "ok";
+                }
+            }
+            printf("%-28s %-9s %6d %10.1f %9.3f %7lu %10s\n", result.name, result.payload, result.size,
+                ns_per_call, result.ns_per_byte, result.allocations, verdict);
+            if(NULL != save_file){
+                fprintf(save_file, "%s %s %d %.4f %lu\n", result.name, result.payload, result.size,
+                    result.ns_per_byte, result.allocations);
+            }
+        }
+    }
+    if(NULL != save_file && 0 != fclose(save_file)){
+        ERROR("Writing %s failed: %s", save_path, strerror(errno));
+        return 1;
+    }
+    if(regressions > 0){
+        ERROR("%d cases regressed against baseline %s", regressions, baseline_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,549 @@
+/**
+ * @file main.c
+ * @brief Fault injecting MDFU client simulator for the network tool.
+ *
+ * Serves the simulated MDFU client MAC over TCP, so that cmdfu can be run with
+ * `--tool network` against it. The serial transports use the raw serial framed
+ * byte stream and the SPI and I2C transports use packets with the "MDFU"
+ * header of the socket packet MAC:
+ *
+ * - SPI: Every packet from the host is one SPI transaction and is answered
+ *   with a packet of the same size holding the data the client returned.
+ * - I2C: Packets from the host are I2C writes. When the client has a response,
+ *   the response length frame and the response frame are sent as two packets,
+ *   which are the I2C reads of the host.
+ *
+ * With --udp every transport frame is one datagram without header, as sent by
+ * the UDP MAC of the network tool. The session ends when the host did not send
+ * anything for the idle timeout.
+ *
+ * The simulated client drops commands, corrupts responses, requests resends
+ * and delays responses as configured, and prints its counters when the host
+ * disconnects.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mdfu/mac/sim_mac.h"
+#include "mdfu/timeout.h"
+#include "mdfu/logging.h"
+
+#define PACKET_HEADER_SIZE 8
+#define PACKET_HEADER_MAGIC "MDFU"
+/**
+ * @brief Size of the I2C response length frame.
+ */
+#define I2C_LENGTH_FRAME_SIZE 5
+/**
+ * @brief Size of the socket receive and send buffers, large enough for any frame.
+ */
+#define BUFFER_SIZE 16384
+
+static uint8_t rx_buffer[BUFFER_SIZE];
+static uint8_t tx_buffer[PACKET_HEADER_SIZE + BUFFER_SIZE];
+/**
+ * @brief Serve the host over UDP with one datagram per frame.
+ */
+static bool datagram;
+/**
+ * @brief Time in ms after which a UDP session without host traffic ends.
+ */
+static int idle_timeout_ms = 10000;
+
+static int send_all(int sock, const uint8_t *data, size_t size){
+    while(size > 0){
+        ssize_t status = send(sock, data, size, 0);
+
+        if(status < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            ERROR("Sending to host failed: %s", strerror(errno));
+            return -1;
+        }
+        data += status;
+        size -= (size_t) status;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive an exact number of bytes.
+ *
+ * @return int 1 on success, 0 if the host disconnected and -1 on error.
+ */
+static int recv_all(int sock, uint8_t *data, size_t size){
+    while(size > 0){
+        ssize_t status = recv(sock, data, size, 0);
+
+        if(status < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            ERROR("Receiving from host failed: %s", strerror(errno));
+            return -1;
+        }
+        if(0 == status){
+            return 0;
+        }
+        data += status;
+        size -= (size_t) status;
+    }
+    return 1;
+}
+
+static int send_packet(int sock, int size){
+    if(datagram){
+        return send_all(sock, &tx_buffer[PACKET_HEADER_SIZE], (size_t) size);
+    }
+    memcpy(tx_buffer, PACKET_HEADER_MAGIC, 4);
+    for(int i = 0; i < 4; i++){
+        tx_buffer[4 + i] = (uint8_t) ((uint32_t) size >> (8 * i));
+    }
+    return send_all(sock, tx_buffer, (size_t) (PACKET_HEADER_SIZE + size));
+}
+
+/**
+ * @brief Wait until the host sent data or the client has a response.
+ *
+ * @return int 1 if the socket is readable, 0 if a response is ready, 2 if
+ *         the UDP session is idle and -1 on error.
+ */
+static int wait_for_event(int sock, mac_t *mac){
+    struct pollfd fd = {.fd = sock, .events = POLLIN};
+    float delay = sim_mac_response_delay(mac);
+    int timeout_ms = delay < 0 ? -1 : (int) (delay * 1000 + 0.999f);
+    bool idle_limit = false;
+    int status;
+
+    // UDP has no disconnect, an idle host ends the session
+    if(datagram && (timeout_ms < 0 || timeout_ms > idle_timeout_ms)){
+        timeout_ms = idle_timeout_ms;
+        idle_limit = true;
+    }
+    do{
+        status = poll(&fd, 1, timeout_ms);
+    }while(status < 0 && EINTR == errno);
+    if(status < 0){
+        ERROR("Waiting for host failed: %s", strerror(errno));
+        return -1;
+    }
+    if(status > 0){
+        return 1;
+    }
+    if(idle_limit){
+        INFO("No data from the host for %d ms, ending the session", idle_timeout_ms);
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Serve a host that uses the serial framed byte stream.
+ */
+static int serve_serial(int sock, mac_t *mac){
+    timeout_t now;
+    int status;
+
+    while(true){
+        status = wait_for_event(sock, mac);
+        if(status < 0){
+            return -1;
+        }
+        if(status == 2){
+            return 0;
+        }
+        if(status > 0){
+            ssize_t size = recv(sock, rx_buffer, sizeof(rx_buffer), 0);
+
+            if(size < 0 && EINTR == errno){
+                continue;
+            }
+            if(size <= 0){
+                return (int) size;
+            }
+            mac->write(mac, (int) size, rx_buffer);
+        }
+        // Forward all responses that are ready without waiting
+        set_timeout(&now, 0);
+        status = mac->read_deadline(mac, BUFFER_SIZE, &tx_buffer[PACKET_HEADER_SIZE], 0, &now);
+        if(status > 0 && send_all(sock, &tx_buffer[PACKET_HEADER_SIZE], (size_t) status) < 0){
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Send the I2C response length and response frames of a ready response.
+ */
+static int send_i2c_response(int sock, mac_t *mac){
+    uint8_t *data = &tx_buffer[PACKET_HEADER_SIZE];
+    int length;
+
+    if(mac->read(mac, I2C_LENGTH_FRAME_SIZE, data) < 0){
+        return 0;
+    }
+    length = data[1] | (data[2] << 8);
+    if(send_packet(sock, I2C_LENGTH_FRAME_SIZE) < 0){
+        return -1;
+    }
+    if(1 + length > BUFFER_SIZE || mac->read(mac, 1 + length, data) < 0){
+        ERROR("Reading the simulated client response failed");
+        return -1;
+    }
+    return send_packet(sock, 1 + length);
+}
+
+/**
+ * @brief Serve a host that uses the socket packet MAC.
+ */
+static int serve_packets(int sock, mac_t *mac, sim_framing_t framing){
+    uint8_t header[PACKET_HEADER_SIZE];
+    uint32_t size;
+    int status;
+
+    while(true){
+        status = wait_for_event(sock, mac);
+        if(status < 0){
+            return -1;
+        }
+        if(status == 2){
+            return 0;
+        }
+        if(0 == status){
+            if(SIM_FRAMING_I2C == framing && send_i2c_response(sock, mac) < 0){
+                return -1;
+            }
+            continue;
+        }
+        if(datagram){
+            ssize_t length = recv(sock, rx_buffer, sizeof(rx_buffer), 0);
+
+            if(length < 0){
+                if(EINTR == errno){
+                    continue;
+                }
+                ERROR("Receiving from host failed: %s", strerror(errno));
+                return -1;
+            }
+            size = (uint32_t) length;
+        } else {
+            status = recv_all(sock, header, sizeof(header));
+            if(status <= 0){
+                return status;
+            }
+            size = (uint32_t) header[4] | ((uint32_t) header[5] << 8) | ((uint32_t) header[6] << 16) | ((uint32_t) header[7] << 24);
+            if(0 != memcmp(header, PACKET_HEADER_MAGIC, 4) || size > BUFFER_SIZE){
+                ERROR("Received invalid packet header");
+                return -1;
+            }
+            status = recv_all(sock, rx_buffer, size);
+            if(status <= 0){
+                return status;
+            }
+        }
+        if(mac->write(mac, (int) size, rx_buffer) < 0){
+            ERROR("Simulated client rejected a %u byte packet", size);
+            return -1;
+        }
+        if(SIM_FRAMING_SPI == framing){
+            // Answer the transaction with the data that the client sent back
+            if(mac->read(mac, (int) size, &tx_buffer[PACKET_HEADER_SIZE]) < 0 ||
+                send_packet(sock, (int) size) < 0){
+                return -1;
+            }
+        }
+    }
+}
+
+static void print_stats(const mac_t *mac, double elapsed){
+    struct sim_mac_stats stats;
+
+    sim_mac_get_stats(mac, &stats);
+    printf("commands %lu, chunks %lu, dropped %lu, corrupted %lu, resends %lu, discarded %lu\n",
+        stats.commands, stats.chunks, stats.dropped, stats.corrupted, stats.resends, stats.discarded);
+    printf("image bytes %llu in %.3f s, %.0f bytes/s\n",
+        stats.image_bytes, elapsed, elapsed > 0 ? (double) stats.image_bytes / elapsed : 0.0);
+    fflush(stdout);
+}
+
+static int serve(int sock, const struct sim_mac_config *config){
+    mac_t *mac;
+    struct timespec start;
+    struct timespec end;
+    int status;
+
+    if(get_sim_mac(&mac) < 0 || mac->init(mac, (void *) config) < 0 || mac->open(mac) < 0){
+        mac_free(mac);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(SIM_FRAMING_SERIAL == config->framing){
+        status = serve_serial(sock, mac);
+    } else {
+        status = serve_packets(sock, mac, config->framing);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_stats(mac, (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) * 1e-9);
+    mac->close(mac);
+    mac_free(mac);
+    return status;
+}
+
+static uint8_t *load_image(const char *path, size_t *size){
+    FILE *file = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long length;
+
+    if(NULL == file){
+        return NULL;
+    }
+    if(0 == fseek(file, 0, SEEK_END) && (length = ftell(file)) >= 0 && 0 == fseek(file, 0, SEEK_SET)){
+        data = malloc(length ? (size_t) length : 1);
+        if(NULL != data && fread(data, 1, (size_t) length, file) != (size_t) length){
+            free(data);
+            data = NULL;
+        }
+        *size = (size_t) length;
+    }
+    fclose(file);
+    return data;
+}
+
+static void print_help(void){
+    printf("Usage: mdfu_netsim [options]\n"
+        "\n"
+        "Simulated MDFU client server for the cmdfu network tool, e.g.\n"
+        "  mdfu_netsim --port 5559 --transport spi --drop 0.01\n"
+        "  cmdfu update --tool network --transport spi --host 127.0.0.1 --port 5559 --image fw.img\n"
+        "\n"
+        "Options:\n"
+        "  --host <address>        Address to listen on, default 127.0.0.1.\n"
+        "  --port <port>           Port to listen on, default 5559.\n"
+        "  --transport <name>      serial (also for serial-buffered), spi or i2c. Default serial.\n"
+        "  --buffer-size <bytes>   Client command buffer size, default 512.\n"
+        "  --buffer-count <count>  Client command buffer count, default 1.\n"
+        "  --itd <ns>              Client inter transaction delay in nanoseconds, default 0.\n"
+        "  --line-rate <bytes/s>   Emulated line rate, default 0 for no line delay.\n"
+        "  --command-delay <s>     Client processing time per command, default 0.\n"
+        "  --jitter <s>            Random extra processing time per command up to this limit.\n"
+        "  --drop <probability>    Probability that the client drops a command.\n"
+        "  --corrupt <probability> Probability that a response frame is corrupted.\n"
+        "  --resend <probability>  Probability that the client requests a resend.\n"
+        "  --seed <seed>           Seed for the error injection, default 1.\n"
+        "  --image <file>          Client image returned by READ_CHUNK, default 4096 generated bytes.\n"
+        "  --udp                   Serve one datagram per frame over UDP instead of TCP.\n"
+        "  --idle-timeout <s>      Time without host data that ends a UDP session, default 10.\n"
+        "  --once                  Exit after the first connection.\n"
+        "  -v, --verbose <level>   Logging verbosity: error, warning, info or debug.\n"
+        "  -h, --help              Show this help.\n");
+}
+
+int main(int argc, char **argv){
+    static const struct option long_options[] = {
+        {"host", required_argument, 0, 'H'},
+        {"port", required_argument, 0, 'p'},
+        {"transport", required_argument, 0, 't'},
+        {"buffer-size", required_argument, 0, 'b'},
+        {"buffer-count", required_argument, 0, 'c'},
+        {"itd", required_argument, 0, 'i'},
+        {"line-rate", required_argument, 0, 'r'},
+        {"command-delay", required_argument, 0, 'd'},
+        {"jitter", required_argument, 0, 'j'},
+        {"drop", required_argument, 0, 'D'},
+        {"corrupt", required_argument, 0, 'C'},
+        {"resend", required_argument, 0, 'R'},
+        {"seed", required_argument, 0, 'S'},
+        {"image", required_argument, 0, 'I'},
+        {"udp", no_argument, 0, 'U'},
+        {"idle-timeout", required_argument, 0, 'T'},
+        {"once", no_argument, 0, 'o'},
+        {"verbose", required_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    static const char *levels[] = {"error", "warning", "info", "debug"};
+    struct sim_mac_config config = {
+        .framing = SIM_FRAMING_SERIAL,
+        .buffer_size = 512,
+        .buffer_count = 1,
+        .seed = 1
+    };
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(5559)
+    };
+    const char *host = "127.0.0.1";
+    const char *image_path = NULL;
+    uint8_t *image;
+    size_t image_size = 4096;
+    bool once = false;
+    int server;
+    int opt;
+    int enable = 1;
+
+    init_logging(stderr);
+    while(-1 != (opt = getopt_long(argc, argv, "v:h", long_options, NULL))){
+        switch(opt){
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                address.sin_port = htons((uint16_t) strtoul(optarg, NULL, 0));
+                break;
+            case 't':
+                if(0 == strcmp(optarg, "serial") || 0 == strcmp(optarg, "serial-buffered")){
+                    config.framing = SIM_FRAMING_SERIAL;
+                } else if(0 == strcmp(optarg, "spi")){
+                    config.framing = SIM_FRAMING_SPI;
+                } else if(0 == strcmp(optarg, "i2c")){
+                    config.framing = SIM_FRAMING_I2C;
+                } else {
+                    ERROR("Invalid transport %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                config.buffer_size = (uint16_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                config.buffer_count = (uint8_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                config.inter_transaction_delay = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                config.line_rate = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                config.command_delay = strtof(optarg, NULL);
+                break;
+            case 'j':
+                config.command_jitter = strtof(optarg, NULL);
+                break;
+            case 'D':
+                config.drop_rate = strtof(optarg, NULL);
+                break;
+            case 'C':
+                config.corrupt_rate = strtof(optarg, NULL);
+                break;
+            case 'R':
+                config.resend_rate = strtof(optarg, NULL);
+                break;
+            case 'S':
+                config.seed = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                image_path = optarg;
+                break;
+            case 'U':
+                datagram = true;
+                break;
+            case 'T':
+                idle_timeout_ms = (int) (strtof(optarg, NULL) * 1000);
+                break;
+            case 'o':
+                once = true;
+                break;
+            case 'v':
+                for(int i = 0; i < 4; i++){
+                    if(0 == strcmp(optarg, levels[i])){
+                        set_debug_level(ERRORLEVEL + i);
+                    }
+                }
+                break;
+            case 'h':
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+
+    if(NULL != image_path){
+        image = load_image(image_path, &image_size);
+        if(NULL == image){
+            ERROR("Loading image %s failed: %s", image_path, strerror(errno));
+            return 1;
+        }
+    } else {
+        image = malloc(image_size);
+        if(NULL == image){
+            return 1;
+        }
+        for(size_t i = 0; i < image_size; i++){
+            image[i] = (uint8_t) ((i * 2654435761U) >> 13);
+        }
+    }
+    config.image = image;
+    config.image_size = image_size;
+
+    if(1 != inet_pton(AF_INET, host, &address.sin_addr)){
+        ERROR("Invalid host address %s", host);
+        return 1;
+    }
+    server = socket(AF_INET, datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if(server < 0 ||
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        bind(server, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        (!datagram && listen(server, 1) < 0)){
+        ERROR("Listening on %s:%u failed: %s", host, ntohs(address.sin_port), strerror(errno));
+        return 1;
+    }
+    while(datagram){
+        struct sockaddr_in peer;
+        struct sockaddr_in unspec = {.sin_family = AF_UNSPEC};
+        socklen_t peer_size = sizeof(peer);
+
+        // The first datagram of a host starts the session, it stays queued
+        // so that it is served as usual
+        if(recvfrom(server, rx_buffer, sizeof(rx_buffer), MSG_PEEK, (struct sockaddr *) &peer, &peer_size) < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            ERROR("Receiving from host failed: %s", strerror(errno));
+            break;
+        }
+        if(connect(server, (struct sockaddr *) &peer, peer_size) < 0){
+            ERROR("Connecting to host failed: %s", strerror(errno));
+            break;
+        }
+        serve(server, &config);
+        connect(server, (struct sockaddr *) &unspec, sizeof(unspec));
+        if(once){
+            break;
+        }
+    }
+    while(!datagram){
+        int sock = accept(server, NULL, NULL);
+
+        if(sock < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            ERROR("Accepting connection failed: %s", strerror(errno));
+            break;
+        }
+        // Responses are small, send them without waiting for more data
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        serve(sock, &config);
+        close(sock);
+        if(once){
+            break;
+        }
+    }
+    close(server);
+    free(image);
+    return 0;
+}
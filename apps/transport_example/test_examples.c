@@ -23,13 +23,15 @@ struct socket_config conf = {
 void test_mac(void){
     mac_t *mac;
 
-    get_socket_mac(&mac);
-    mac->init((void *) &conf);
-    mac->open();
+    if(get_socket_mac(&mac) < 0){
+        return;
+    }
+    mac->init(mac, (void *) &conf);
+    mac->open(mac);
 
-    mac->write(sizeof(get_client_info_frame), get_client_info_frame);
+    mac->write(mac, sizeof(get_client_info_frame), get_client_info_frame);
     uint8_t buffer[1024];
-    mac->read(CLIENT_INFO_RETURN_FRAME_SIZE, buffer);
+    mac->read(mac, CLIENT_INFO_RETURN_FRAME_SIZE, buffer);
     
     for(int i=0; i < CLIENT_INFO_RETURN_FRAME_SIZE; i++)
     {
@@ -37,34 +39,41 @@ void test_mac(void){
     }
     printf("\n");
     fflush(NULL);
-    mac->close();
+    mac->close(mac);
+    mac_free(mac);
 }
 
 static void test_transport(void){
     mac_t *mac;
     puts("Initializing stack");
-    get_socket_mac(&mac);
-    if(mac->init((void *) &conf) < 0) {
+    if(get_socket_mac(&mac) < 0){
+        return;
+    }
+    if(mac->init(mac, (void *) &conf) < 0) {
         puts("Socket MAC init failed");
+        mac_free(mac);
         return;
     }
     transport_t *transport;
-    get_serial_transport(&transport);
-    transport->init(mac, 2);
+    if(get_serial_transport(&transport) < 0){
+        mac_free(mac);
+        return;
+    }
+    transport->init(transport, mac, 2);
 
-    if(transport->open() < 0){
+    if(transport->open(transport) < 0){
+        transport_free(transport);
         return;
     }
-    transport->write(sizeof(client_info_mdfu_cmd_packet), client_info_mdfu_cmd_packet);
+    transport->write(transport, sizeof(client_info_mdfu_cmd_packet), client_info_mdfu_cmd_packet);
     int size = 0;
     uint8_t buffer[1024];
-    int status = transport->read(&size, buffer, 1);
+    int status = transport->read(transport, &size, buffer, 1);
     if(status < 0){
         printf("Transport error\n");
-        transport->close();
-        return;
     }
-    transport->close();
+    transport->close(transport);
+    transport_free(transport);
 }
 
 int main(int argc, char **argv){
@@ -3,6 +3,21 @@
 
 #include <stdint.h>
 
+/**
+ * @brief Running frame checksum for data that is not in one buffer.
+ */
+typedef struct checksum {
+    /** @brief Sums of the bytes at even and odd offsets. */
+    uint32_t lanes[2];
+    /** @brief Number of bytes added so far. */
+    int size;
+} checksum_t;
+
 uint16_t calculate_crc16(int size, uint8_t *data);
+uint16_t calculate_crc16_copy(int size, const uint8_t *src, uint8_t *dst);
+void checksum_init(checksum_t *checksum);
+void checksum_update(checksum_t *checksum, int size, const uint8_t *data);
+void checksum_update_copy(checksum_t *checksum, int size, const uint8_t *src, uint8_t *dst);
+uint16_t checksum_final(const checksum_t *checksum);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef IMAGE_CODEC_H
+#define IMAGE_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Decoder for images that are stored compressed.
+ *
+ * The compression format is detected from the magic bytes at the start of the
+ * image: gzip, zstd and LZ4 frames. Each format is only supported
+ * if the library for it was found when building. Images without a known magic
+ * are passed through unchanged.
+ */
+typedef struct image_codec image_codec_t;
+
+bool image_codec_is_compressed(const uint8_t *data, size_t size);
+int image_codec_open(image_codec_t **codec, int fd);
+ssize_t image_codec_read(image_codec_t *codec, void *data, size_t size);
+const char *image_codec_name(const image_codec_t *codec);
+void image_codec_close(image_codec_t *codec);
+
+#endif
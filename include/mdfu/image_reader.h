@@ -2,6 +2,9 @@
 #define IMAGE_READER_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+typedef struct image_reader image_reader_t;
 
 /**
  * @struct image_reader_t
@@ -11,14 +14,51 @@
  * interact with firmware image files. It allows for abstraction of the file
  * reading process, so different file reader implementations can be used
  * without changing the code that uses them.
+ *
+ * The operations get the reader they are called on as first argument so that
+ * readers that are created for each use, like the readers of a shared image,
+ * can keep their own state in ctx. The fwimg_xxx_reader readers are single
+ * instances that keep their state in their module.
+ *
+ * peek and advance are optional and can be NULL. Readers that keep the image
+ * in memory implement them to lend out the image data without copying it.
+ * peek returns a pointer to up to size bytes of the image that stays valid
+ * until the reader is closed, and advance consumes bytes returned by peek.
  */
-typedef struct image_reader {
-    int (* open)(const char *fpath);
-    int (* close)(void);
-    ssize_t (* read)(void *data, size_t size);
-}image_reader_t;
+struct image_reader {
+    int (* open)(const image_reader_t *reader, const char *fpath);
+    int (* close)(const image_reader_t *reader);
+    ssize_t (* read)(const image_reader_t *reader, void *data, size_t size);
+    ssize_t (* peek)(const image_reader_t *reader, const void **data, size_t size);
+    int (* advance)(const image_reader_t *reader, size_t size);
+    void *ctx;
+};
 
 
 extern image_reader_t fwimg_file_reader;
 
-#endif
\ No newline at end of file
+int fwimg_sha256_reader_create(const image_reader_t *image_reader, const uint8_t *expected, image_reader_t **reader);
+
+#ifndef _WIN32
+extern image_reader_t fwimg_mmap_reader;
+extern image_reader_t fwimg_prefetch_reader;
+
+/**
+ * @brief Immutable firmware image that is shared by many readers.
+ *
+ * The image is loaded once, mapped from regular files or read completely from
+ * pipes and the standard input, and stays in memory until the last reference
+ * is released. Each reader that is created for the image has its own position,
+ * so many MDFU sessions can send the image at the same time, also from
+ * different threads.
+ */
+typedef struct fwimg_image fwimg_image_t;
+
+int fwimg_image_open(fwimg_image_t **image, const char *fpath);
+fwimg_image_t *fwimg_image_ref(fwimg_image_t *image);
+void fwimg_image_unref(fwimg_image_t *image);
+size_t fwimg_image_size(const fwimg_image_t *image);
+int fwimg_image_reader_create(fwimg_image_t *image, image_reader_t **reader);
+#endif
+
+#endif
@@ -11,14 +11,27 @@
  * interact with firmware image files. It allows for abstraction of the file
  * writing process, so different file writer implementations can be used
  * without changing the code that uses them.
+ *
+ * reserve and commit are optional and can be NULL. Writers that buffer the
+ * image implement them to lend out their buffers, so that image data can be
+ * received directly into them instead of being copied. reserve returns a
+ * pointer to a buffer of size bytes that stays valid until the next call to
+ * commit, or 0 if the writer cannot lend a buffer of this size. commit takes
+ * over the first size bytes of the buffer returned by reserve as if they were
+ * written with write, a size of zero releases the buffer.
  */
 typedef struct image_writer {
     int (* open)(const char *fpath);
     int (* close)(void);
     ssize_t (* write)(void *data, size_t size);
+    ssize_t (* reserve)(void **data, size_t size);
+    int (* commit)(size_t size);
 }image_writer_t;
 
 
 extern image_writer_t fwimg_file_writer;
+#ifndef _WIN32
+extern image_writer_t fwimg_async_writer;
+#endif
 
 #endif
\ No newline at end of file
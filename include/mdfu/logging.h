@@ -24,24 +24,24 @@ which the resemblance of logger() to a function would make C programmers want to
 } while (0)
 #else
 #define logger(level, format, ...) do {  \
-    if (level <= debug_level) { \
-        fprintf(dbgstream,"%s:" format "\n", ERROR_LEVEL_NAMES[level], ## __VA_ARGS__); \
+    if (level <= LOG_COMPILE_LEVEL && level <= debug_level) { \
+        log_message("%s:" format "\n", ERROR_LEVEL_NAMES[level], ## __VA_ARGS__); \
     } \
 } while (0)
 
 #define trace(level, format, ...) do {  \
-    if (level <= debug_level) { \
-        fprintf(dbgstream, format, ## __VA_ARGS__); \
+    if (level <= LOG_COMPILE_LEVEL && level <= debug_level) { \
+        log_message(format, ## __VA_ARGS__); \
     } \
 } while (0)
 #endif
 
 #else
 #define logger(level, ...) do {  \
-    if (level <= debug_level) { \
-        fprintf(dbgstream,"%s:%d:", __FILE__, __LINE__); \
-        fprintf(dbgstream,__VA_ARGS__); \
-        fprintf(dbgstream,"\n"); \
+    if (level <= LOG_COMPILE_LEVEL && level <= debug_level) { \
+        log_message("%s:%d:", __FILE__, __LINE__); \
+        log_message(__VA_ARGS__); \
+        log_message("\n"); \
     } \
 } while (0)
 
@@ -52,6 +52,17 @@ which the resemblance of logger() to a function would make C programmers want to
 #define INFOLEVEL  3
 #define DEBUGLEVEL 4
 
+/**
+ * @def LOG_COMPILE_LEVEL
+ * @brief Most verbose log level that is compiled in.
+ *
+ * Log calls with a higher level are removed by the compiler, independent of
+ * the debug level that is set at run time. Release builds set it to INFOLEVEL.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEBUGLEVEL
+#endif
+
 #define LOG(level, format, ...) logger(level, format, ## __VA_ARGS__)
 #define ERROR(format, ...) logger(ERRORLEVEL, format, ##  __VA_ARGS__)
 #define WARN(format, ...) logger(WARNLEVEL, format, ## __VA_ARGS__)
@@ -80,6 +91,10 @@ which the resemblance of logger() to a function would make C programmers want to
 #define DEBUG(format, arg...) \
 	swupdate_notify(RUN, format, DEBUGLEVEL, ## arg)
 #endif
+#ifdef __GNUC__
+__attribute__((format(printf, 1, 2)))
+#endif
+void log_message(const char *format, ...);
 void init_logging(FILE *logstream);
 void set_debug_level(int level);
 
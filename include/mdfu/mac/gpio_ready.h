@@ -0,0 +1,38 @@
+#ifndef GPIO_READY_H
+#define GPIO_READY_H
+
+#include <stdbool.h>
+#include "mdfu/timeout.h"
+
+/**
+ * @brief Maximum length of a GPIO chip device path.
+ */
+#define GPIO_READY_CHIP_MAX_SIZE 64
+
+/**
+ * @brief GPIO line that the client drives to signal that a response is ready.
+ */
+struct gpio_ready_config {
+    /** @brief GPIO chip device, e.g. /dev/gpiochip0. Empty if there is no ready line. */
+    char chip[GPIO_READY_CHIP_MAX_SIZE];
+    /** @brief Line offset on the chip. */
+    unsigned int line;
+    /** @brief Signal on the rising edge instead of the falling edge. */
+    bool rising_edge;
+};
+
+/**
+ * @brief Requested ready line.
+ */
+typedef struct gpio_ready {
+    /** @brief Line request file descriptor, -1 if the line is not requested. */
+    int fd;
+} gpio_ready_t;
+
+int gpio_ready_parse(const char *text, struct gpio_ready_config *config);
+int gpio_ready_open(gpio_ready_t *ready, const struct gpio_ready_config *config);
+int gpio_ready_discard(gpio_ready_t *ready);
+int gpio_ready_wait(gpio_ready_t *ready, timeout_t *deadline);
+void gpio_ready_close(gpio_ready_t *ready);
+
+#endif
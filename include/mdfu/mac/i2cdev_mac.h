@@ -2,12 +2,22 @@
 #define I2CDEV_MAC_H
 
 #include "mac.h"
+#include "gpio_ready.h"
 
 struct i2cdev_config {
     int address;
     char *path;
+    /**
+     * @brief Bus clock frequency in Hz, 0 to read it from the adapter.
+     */
+    int bus_speed;
+    /**
+     * @brief Line that the client signals a ready response on, the client is
+     * polled if no chip is set.
+     */
+    struct gpio_ready_config ready_gpio;
 };
 
-void get_i2cdev_mac(mac_t **mac);
+int get_i2cdev_mac(mac_t **mac);
 
 #endif
\ No newline at end of file
@@ -2,14 +2,124 @@
 #define MAC_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "mdfu/timeout.h"
 
+typedef struct mac_ mac_t;
 
-typedef struct mac_ {
-    int (* init)(void *);
-    int (* open)(void);
-    int (* close)(void);
-    int (* read)(int, uint8_t *);
-    int (* write)(int, uint8_t *);
-} mac_t;
+/**
+ * @brief Maximum number of segments in a batched MAC transfer.
+ */
+#define MAC_TRANSFER_MAX_SEGMENTS 4
 
-#endif
\ No newline at end of file
+/**
+ * @brief Segment of a batched MAC transfer.
+ *
+ * Each segment is a separate transaction on the bus, e.g. the chip select of
+ * a SPI bus is released between segments. On half duplex buses like I2C a
+ * segment with tx_data is a write and a segment without it is a read into
+ * rx_data, consecutive segments are joined with repeated starts.
+ */
+typedef struct mac_segment {
+    /** @brief Data to send. */
+    uint8_t *tx_data;
+    /** @brief Buffer for the size bytes received while sending, can be tx_data.
+     *  Not used for writes on half duplex buses. */
+    uint8_t *rx_data;
+    /** @brief Number of bytes to exchange. */
+    int size;
+    /** @brief Delay in microseconds after this segment before the next one starts. */
+    uint16_t delay_us;
+} mac_segment_t;
+
+/**
+ * @brief Maximum number of buffers in a scatter/gather MAC or transport write.
+ */
+#define MAC_IOVEC_MAX 8
+
+/**
+ * @brief Buffer of a scatter/gather write.
+ */
+typedef struct mac_iovec {
+    /** @brief Data to send. */
+    const uint8_t *data;
+    /** @brief Number of bytes to send. */
+    int size;
+} mac_iovec_t;
+
+/**
+ * @brief MAC layer instance.
+ *
+ * The operations get the instance they are called on as first argument so
+ * that each instance can keep its own state in ctx. Instances are created
+ * with the get_xxx_mac functions and released with mac_free.
+ *
+ * read_deadline is optional and can be NULL. It reads up to size bytes and
+ * blocks until at least min_size bytes are received or the deadline expires,
+ * so that callers can wait for data without polling read. It returns the
+ * number of bytes read, which is less than min_size when the deadline expired,
+ * or -1 on error.
+ *
+ * transfer is optional and can be NULL. It exchanges a batch of up to
+ * MAC_TRANSFER_MAX_SEGMENTS segments in one operation and returns 0 on success
+ * or -1 on error.
+ *
+ * writev is optional and can be NULL. It sends the concatenation of up to
+ * MAC_IOVEC_MAX buffers as if it was passed to write in a single buffer, so
+ * that callers do not need to assemble it first. Unlike write it does not
+ * return until all data is sent and returns the number of bytes sent or -1
+ * on error.
+ *
+ * wait_ready is optional and can be NULL. It blocks until the client signals
+ * that a response is ready after the last transaction, e.g. on a GPIO line,
+ * or the deadline expires. It returns 1 when the client signalled, 0 when the
+ * deadline expired or -1 on error. MACs only provide it when a ready signal
+ * is configured, otherwise the client has to be polled.
+ *
+ * has_data is optional and can be NULL. It returns true when received data is
+ * held in a buffer of the MAC, where it does not make the file descriptor of
+ * get_fd readable.
+ */
+struct mac_ {
+    int (* init)(mac_t *, void *);
+    int (* open)(mac_t *);
+    int (* close)(mac_t *);
+    int (* read)(mac_t *, int, uint8_t *);
+    int (* write)(mac_t *, int, uint8_t *);
+    int (* read_deadline)(mac_t *, int size, uint8_t *data, int min_size, timeout_t *deadline);
+    int (* transfer)(mac_t *, int count, mac_segment_t *segments);
+    int (* writev)(mac_t *, int count, const mac_iovec_t *iov);
+    int (* get_fd)(mac_t *);
+    bool (* has_data)(mac_t *);
+    int (* wait_ready)(mac_t *, timeout_t *deadline);
+    void *ctx;
+};
+
+/**
+ * @def MAC_OPS
+ * @brief Operations of a MAC instance.
+ *
+ * In a single tool build (MDFU_STATIC_MAC) all instances are of the same MAC
+ * and this is its operations table, so that the transport calls the MAC
+ * directly. The instance is still evaluated so that it counts as used.
+ * wait_ready is set per instance and is always called through the instance.
+ */
+#ifdef MDFU_STATIC_MAC
+extern const mac_t MDFU_STATIC_MAC;
+#define MAC_OPS(mac) ((void) (mac), &MDFU_STATIC_MAC)
+#else
+#define MAC_OPS(mac) (mac)
+#endif
+
+int mac_alloc(const mac_t *ops, size_t ctx_size, mac_t **mac);
+int mac_resize_ctx(mac_t *mac, size_t ctx_size);
+void mac_free(mac_t *mac);
+int mac_iovec_size(int count, const mac_iovec_t *iov);
+#ifndef _WIN32
+struct iovec;
+int mac_iovec_to_iovec(int count, const mac_iovec_t *iov, struct iovec *vector);
+int mac_iovec_consume(int count, struct iovec **vector, size_t size);
+#endif
+
+#endif
@@ -1,13 +1,37 @@
 #ifndef SERIAL_MAC_H
 #define SERIAL_MAC_H
 
+#include <stdbool.h>
 #include "mac.h"
 
+/**
+ * @brief Flow control of a serial port.
+ */
+typedef enum {
+    /** @brief No flow control. */
+    SERIAL_FLOW_CONTROL_NONE = 0,
+    /** @brief Hardware flow control with the RTS and CTS lines. */
+    SERIAL_FLOW_CONTROL_RTSCTS = 1
+} serial_flow_control_t;
+
+/**
+ * @brief Serial port configuration.
+ *
+ * rx_queue_size is the size in bytes of the driver receive queue, 0 keeps
+ * the default of the MAC. Only the Windows serial MAC can change it.
+ */
 struct serial_config {
     char * port;
     int baudrate;
+    serial_flow_control_t flow_control;
+    int rx_queue_size;
 };
 
-void get_serial_mac(mac_t **mac);
+int get_serial_mac(mac_t **mac);
+#ifdef __linux__
+int serial_mac_set_custom_baudrate(int fd, int baudrate);
+int serial_mac_set_low_latency(int fd, bool enable, bool *previous);
+int serial_mac_set_latency_timer(const char *port, int milliseconds, int *previous);
+#endif
 
 #endif
\ No newline at end of file
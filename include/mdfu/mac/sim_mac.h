@@ -0,0 +1,82 @@
+#ifndef SIM_MAC_H
+#define SIM_MAC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "mac.h"
+
+/**
+ * @brief Transport framing that the simulated client expects from the host.
+ */
+typedef enum {
+    SIM_FRAMING_SERIAL = 0,
+    SIM_FRAMING_SPI = 1,
+    SIM_FRAMING_I2C = 2
+} sim_framing_t;
+
+/**
+ * @brief Simulated MDFU client configuration.
+ */
+struct sim_mac_config {
+    /** @brief Framing of the transport that is used on top of the MAC. */
+    sim_framing_t framing;
+    /** @brief Client command buffer size reported in the client info. */
+    uint16_t buffer_size;
+    /** @brief Number of client command buffers reported in the client info. */
+    uint8_t buffer_count;
+    /** @brief Client inter transaction delay in nanoseconds. */
+    uint32_t inter_transaction_delay;
+    /** @brief Line rate in bytes per second, 0 for no line delay. */
+    uint32_t line_rate;
+    /** @brief Client processing time for a command in seconds. */
+    float command_delay;
+    /** @brief Upper limit of a random time in seconds that is added to the command delay. */
+    float command_jitter;
+    /** @brief Probability that a command is not answered. */
+    float drop_rate;
+    /** @brief Probability that a response frame is corrupted. */
+    float corrupt_rate;
+    /** @brief Probability that the client requests a resend of a command. */
+    float resend_rate;
+    /** @brief Seed for the error injection. */
+    uint32_t seed;
+    /** @brief Client image that is returned by READ_CHUNK commands, can be NULL. */
+    const uint8_t *image;
+    /** @brief Size of the client image in bytes. */
+    size_t image_size;
+    /** @brief I2C client appends the response frame to the response length
+     *  frame when the host reads past it. */
+    bool i2c_combined_response;
+};
+
+/**
+ * @brief Simulated MDFU client counters.
+ */
+struct sim_mac_stats {
+    /** @brief Number of MAC operations, each corresponds to a system call of a real MAC. */
+    unsigned long calls;
+    /** @brief Number of bytes sent by the host. */
+    unsigned long long tx_bytes;
+    /** @brief Number of bytes received by the host. */
+    unsigned long long rx_bytes;
+    /** @brief Number of MDFU commands received by the client. */
+    unsigned long commands;
+    /** @brief Number of WRITE_CHUNK and READ_CHUNK commands executed by the client. */
+    unsigned long chunks;
+    /** @brief Number of commands that were dropped by the error injection. */
+    unsigned long dropped;
+    /** @brief Number of response frames that were corrupted by the error injection. */
+    unsigned long corrupted;
+    /** @brief Number of resend requests sent by the error injection. */
+    unsigned long resends;
+    /** @brief Number of command frames that the client discarded. */
+    unsigned long discarded;
+    /** @brief Number of image bytes received with WRITE_CHUNK commands. */
+    unsigned long long image_bytes;
+};
+
+int get_sim_mac(mac_t **mac);
+void sim_mac_get_stats(const mac_t *mac, struct sim_mac_stats *stats);
+float sim_mac_response_delay(const mac_t *mac);
+
+#endif
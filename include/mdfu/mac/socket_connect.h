@@ -0,0 +1,47 @@
+#ifndef SOCKET_CONNECT_H
+#define SOCKET_CONNECT_H
+
+#include <stdint.h>
+#include "mdfu/timeout.h"
+
+/**
+ * @brief Maximum number of connection attempts that race at the same time.
+ */
+#define SOCKET_CONNECT_MAX_ATTEMPTS 4
+
+struct addrinfo;
+
+/**
+ * @brief Connection that is being set up to one of the addresses of a host.
+ *
+ * The connection is started with socket_connect_start, which resolves the
+ * host and starts the first connection attempt without waiting for it, and
+ * completed with socket_connect_finish. Other work can be done in between,
+ * while the handshake is in progress.
+ */
+typedef struct socket_connect {
+    /** @brief Resolved addresses, NULL when no connection is in progress. */
+    struct addrinfo *addresses;
+    /** @brief Addresses in the order they are tried. */
+    struct addrinfo **order;
+    int order_count;
+    /** @brief Index of the next address in order to try. */
+    int next;
+    /** @brief Sockets of the attempts in progress. */
+    int attempts[SOCKET_CONNECT_MAX_ATTEMPTS];
+    /** @brief Address of each attempt in progress. */
+    struct addrinfo *attempt_addresses[SOCKET_CONNECT_MAX_ATTEMPTS];
+    int attempt_count;
+    /** @brief Error of the last attempt that failed. */
+    int error;
+    /** @brief Time when the next attempt is started if none succeeded. */
+    timeout_t next_attempt;
+    /** @brief Time when the connection setup fails. */
+    timeout_t deadline;
+} socket_connect_t;
+
+int socket_connect_start(socket_connect_t *connection, const char *host, uint16_t port, int type, float timeout);
+int socket_connect_finish(socket_connect_t *connection);
+void socket_connect_cancel(socket_connect_t *connection);
+
+#endif
@@ -8,7 +8,8 @@ struct socket_config {
     uint16_t port;
 };
 
-void get_socket_mac(mac_t **mac);
-void get_socket_packet_mac(mac_t **mac);
+int get_socket_mac(mac_t **mac);
+int get_socket_packet_mac(mac_t **mac);
+int get_udp_mac(mac_t **mac);
 
 #endif
\ No newline at end of file
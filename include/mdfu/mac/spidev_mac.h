@@ -2,14 +2,20 @@
 #define SPIDEV_MAC_H
 
 #include "mac.h"
+#include "gpio_ready.h"
 
 struct spidev_config {
     uint8_t mode;
     uint8_t bits_per_word;
     uint32_t speed;
     char *path;
+    /**
+     * @brief Line that the client signals a ready response on, the client is
+     * polled if no chip is set.
+     */
+    struct gpio_ready_config ready_gpio;
 };
 
-void get_spidev_mac(mac_t **mac);
+int get_spidev_mac(mac_t **mac);
 
 #endif
\ No newline at end of file
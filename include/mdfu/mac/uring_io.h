@@ -0,0 +1,68 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "mdfu/timeout.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * @brief io_uring of a MAC that exchanges frames over a file descriptor.
+ *
+ * Each frame write is submitted together with a read of the response into
+ * the receive buffer of the MAC, which is registered with the ring, so that
+ * the response is received without further system calls while the host
+ * waits for it. The ring file descriptor becomes readable when the response
+ * was received and can be polled instead of the file descriptor of the MAC.
+ *
+ * The ring is set up with uring_io_open, which fails when the kernel does
+ * not support io_uring, in which case the MAC uses its file descriptor
+ * directly.
+ */
+typedef struct uring_io {
+    /** @brief Ring file descriptor, -1 when the ring is not set up. */
+    int ring;
+    /** @brief File descriptor of the MAC. */
+    int fd;
+    /** @brief Receive buffer and its size. */
+    uint8_t *buffer;
+    size_t size;
+    /** @brief The receive buffer is registered and read with READ_FIXED. */
+    bool fixed_buffer;
+    /** @brief A read into the receive buffer was submitted and not completed. */
+    bool read_pending;
+    /** @brief A read completed and its result was not taken yet. */
+    bool read_done;
+    int read_result;
+    /** @brief A write was submitted and not completed. */
+    bool write_pending;
+    int write_result;
+    /** @brief Mapped submission and completion rings. */
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_io_t;
+
+int uring_io_open(uring_io_t *io, int fd, uint8_t *buffer, size_t size);
+void uring_io_close(uring_io_t *io);
+bool uring_io_active(const uring_io_t *io);
+bool uring_io_busy(const uring_io_t *io);
+int uring_io_writev(uring_io_t *io, struct iovec *vector, int count, size_t offset);
+int uring_io_read(uring_io_t *io, size_t offset, timeout_t *deadline);
+
+#endif
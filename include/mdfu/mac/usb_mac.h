@@ -0,0 +1,28 @@
+#ifndef USB_MAC_H
+#define USB_MAC_H
+
+#include <stdint.h>
+#include "mac.h"
+
+/**
+ * @brief USB CDC device configuration.
+ *
+ * The device is selected by its vendor and product ID and, when more than
+ * one is connected, its serial number. The MAC uses the bulk endpoints of the
+ * CDC data interface. A baud rate other than zero is set with the CDC line
+ * coding request, for bridges that forward the data to a UART.
+ */
+struct usb_config {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    /** @brief Serial number of the device, NULL for any. */
+    char *serial_number;
+    /** @brief Number of the CDC data interface, -1 for the first one. */
+    int interface;
+    /** @brief Baud rate for the line coding request, 0 to leave it unchanged. */
+    int baudrate;
+};
+
+int get_usb_mac(mac_t **mac);
+
+#endif
@@ -37,6 +37,17 @@
  */
 #define MDFU_RESPONSE_PACKET_MAX_SIZE (MDFU_SEQUENCE_FIELD_SIZE + MDFU_RESPONSE_STATUS_CODES_SIZE + MDFU_MAX_RESPONSE_DATA_LENGTH)
 
+/**
+ * @def MDFU_PACKET_DEFAULT_SIZE
+ * @brief Size in bytes of the largest MDFU packet before the client buffer size is known.
+ *
+ * Transports are created with frame buffers for this packet size. Sessions
+ * set a larger size with TRANSPORT_IOC_PACKET_SIZE when the client reports a
+ * larger buffer size.
+ */
+#define MDFU_PACKET_DEFAULT_SIZE (MDFU_CMD_PACKET_MAX_SIZE > MDFU_RESPONSE_PACKET_MAX_SIZE ? \
+                                  MDFU_CMD_PACKET_MAX_SIZE : MDFU_RESPONSE_PACKET_MAX_SIZE)
+
 typedef enum {
   GET_CLIENT_INFO = 0x01U,
   START_TRANSFER = 0x02U,
@@ -113,12 +124,106 @@ typedef struct{
     uint32_t inter_transaction_delay;
 }client_info_t;
 
-int mdfu_init(transport_t *transport, int retries);
-int mdfu_open(void);
-int mdfu_close(void);
-int mdfu_get_client_info(client_info_t *client_info);
+/**
+ * @def MDFU_STATS_RTT_BUCKETS
+ * @brief Number of buckets in the command round trip time histograms.
+ *
+ * Bucket 0 counts round trip times below 2 us and bucket i counts round trip
+ * times from 2^i us up to 2^(i+1) us. The last bucket also counts all longer
+ * round trip times.
+ */
+#define MDFU_STATS_RTT_BUCKETS 24
+
+/**
+ * @brief Statistics for one MDFU command.
+ */
+typedef struct {
+    /** @brief Number of commands that received a response. */
+    uint32_t count;
+    /** @brief Number of times the command was sent, including retransmissions. */
+    uint32_t attempts;
+    /** @brief Number of command and response data bytes of successful commands. */
+    uint64_t data_bytes;
+    /** @brief Shortest round trip time in seconds. */
+    float rtt_min;
+    /** @brief Longest round trip time in seconds. */
+    float rtt_max;
+    /** @brief Sum of all round trip times in seconds. */
+    double rtt_sum;
+    /** @brief Number of measured round trip times. */
+    uint32_t rtt_count;
+    /** @brief Round trip time histogram, see MDFU_STATS_RTT_BUCKETS. */
+    uint32_t rtt_histogram[MDFU_STATS_RTT_BUCKETS];
+}mdfu_cmd_stats_t;
+
+/**
+ * @brief Statistics of a MDFU session.
+ */
+typedef struct {
+    /** @brief Time in seconds since the session was opened. */
+    float elapsed;
+    /** @brief Size in bytes of the session packet buffers, which only grow, so this is the peak. */
+    uint32_t packet_buffer_bytes;
+    /** @brief Retries after the client did not execute a command, by cause. */
+    uint32_t retries_not_executed[MAX_CMD_NOT_EXECUTED_ERROR_CAUSE];
+    /** @brief Retries after a resend request without a known cause. */
+    uint32_t retries_resend;
+    /** @brief Retries after a response timeout. */
+    uint32_t retries_timeout;
+    /** @brief Retries after a response failed the transport integrity check. */
+    uint32_t retries_integrity;
+    /** @brief Retries after other transport errors. */
+    uint32_t retries_transport;
+    /** @brief Statistics indexed by the MDFU command code. */
+    mdfu_cmd_stats_t cmd[MAX_MDFU_CMD];
+    /** @brief Statistics of the session transport. */
+    transport_stats_t transport;
+}mdfu_stats_t;
+
+/**
+ * @brief Opaque MDFU host session.
+ *
+ * A session holds all protocol state for one client connection. Sessions
+ * are created with mdfu_session_create and released with mdfu_session_destroy.
+ */
+typedef struct mdfu_session mdfu_session_t;
+
+/**
+ * @brief Progress of a step driven update, see mdfu_session_step.
+ */
+typedef enum {
+    /** @brief The update failed or was not started. */
+    MDFU_STEP_FAILED = -1,
+    /** @brief The update completed successfully. */
+    MDFU_STEP_DONE = 0,
+    /** @brief The update waits for a response from the client. */
+    MDFU_STEP_PENDING = 1
+} mdfu_step_status_t;
+
+/**
+ * @def MDFU_RETRY_BUDGET_DEFAULT
+ * @brief Default size of the session retry budget, see mdfu_session_create.
+ */
+#define MDFU_RETRY_BUDGET_DEFAULT 8
+
+int mdfu_session_create(mdfu_session_t **session, transport_t *transport, int retries);
+void mdfu_session_destroy(mdfu_session_t *session);
+int mdfu_open(mdfu_session_t *session);
+int mdfu_close(mdfu_session_t *session);
+int mdfu_get_client_info(mdfu_session_t *session, client_info_t *client_info);
+int mdfu_session_get_client_info(mdfu_session_t *session, client_info_t *client_info);
+int mdfu_session_set_client_info(mdfu_session_t *session, const client_info_t *client_info);
+bool mdfu_session_get_confirmed_client_info(const mdfu_session_t *session, client_info_t *client_info);
 void print_client_info(const client_info_t *client_info);
-int mdfu_run_update(const image_reader_t *image_reader);
-int mdfu_run_dump(const image_writer_t *image_writer);
-int mdfu_run_change_mode(void);
+int mdfu_run_update(mdfu_session_t *session, const image_reader_t *image_reader);
+int mdfu_run_dump(mdfu_session_t *session, const image_writer_t *image_writer);
+int mdfu_run_dump_chunks(mdfu_session_t *session, const image_writer_t *image_writer, int chunk_count);
+int mdfu_run_verify(mdfu_session_t *session, const image_reader_t *image_reader, bool *identical);
+int mdfu_run_change_mode(mdfu_session_t *session);
+int mdfu_session_start_update(mdfu_session_t *session, const image_reader_t *image_reader);
+int mdfu_session_step(mdfu_session_t *session);
+int mdfu_session_get_fd(const mdfu_session_t *session);
+int mdfu_session_next_deadline(const mdfu_session_t *session);
+void mdfu_get_stats(const mdfu_session_t *session, mdfu_stats_t *stats);
+void print_stats_json(FILE *stream, const mdfu_stats_t *stats);
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Size of a SHA-256 digest in bytes.
+ */
+#define SHA256_DIGEST_SIZE 32
+
+/**
+ * @brief Running SHA-256 digest for data that is not in one buffer.
+ *
+ * Uses the SHA-256 of libcrypto when it was found when building, which uses
+ * the SHA extensions of the CPU when they are available, and a portable
+ * implementation otherwise.
+ */
+typedef struct sha256 sha256_t;
+
+int sha256_create(sha256_t **sha);
+void sha256_update(sha256_t *sha, size_t size, const uint8_t *data);
+void sha256_final(sha256_t *sha, uint8_t *digest);
+void sha256_reset(sha256_t *sha);
+void sha256_destroy(sha256_t *sha);
+
+#endif
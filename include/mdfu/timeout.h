@@ -5,8 +5,46 @@
 
 typedef struct timespec timeout_t;
 
+/**
+ * @brief Clock source of the timeouts.
+ *
+ * The timeouts use the monotonic clock unless another clock is set with
+ * timeout_set_clock, e.g. a virtual clock that lets simulations run faster
+ * than real time.
+ */
+typedef struct timeout_clock {
+    /** @brief Get the current time, returns 0 on success and -1 on error. */
+    int (*now)(struct timeout_clock *clock, timeout_t *now);
+    /** @brief Return when the current time is after the deadline, returns 0
+     *  on success and -1 on error. */
+    int (*wait)(struct timeout_clock *clock, const timeout_t *deadline);
+} timeout_clock_t;
+
+/**
+ * @brief Virtual clock that only advances when it is waited on or advanced
+ * with timeout_virtual_clock_advance.
+ *
+ * Waiting for a deadline moves the clock past the deadline without any delay,
+ * so that a simulated client, which waits for the time its transmissions
+ * take, determines the time that passes.
+ */
+typedef struct {
+    timeout_clock_t clock;
+    timeout_t time;
+} timeout_virtual_clock_t;
+
 
 int set_timeout(timeout_t *timer, float timeout);
 bool timeout_expired(timeout_t *timer);
+bool timeout_expired_coarse(timeout_t *timer);
+long long timeout_remaining_ns(timeout_t *timer);
+int timeout_remaining_ms(timeout_t *timer);
+float timeout_elapsed(timeout_t *timer);
+int timeout_wait(timeout_t *timer);
+int set_timeout_spin_time(float seconds);
+void timeout_set_clock(timeout_clock_t *clock);
+int timeout_now(timeout_t *now);
+void timeout_virtual_clock_init(timeout_virtual_clock_t *clock);
+void timeout_virtual_clock_advance(timeout_virtual_clock_t *clock, long long nanoseconds);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,13 @@
 #pragma once
+#include <stdbool.h>
 #include "mdfu/tools/tools.h"
 #include "mdfu/mac/i2cdev_mac.h"
+#include "mdfu/transport/poll_policy.h"
+
+struct i2cdev_tool_config {
+    struct i2cdev_config i2cdev_config;
+    poll_policy_type_t poll_policy;
+    bool speculative_read;
+};
 
 extern tool_t i2cdev_tool;
\ No newline at end of file
@@ -3,10 +3,23 @@
 #include "mdfu/tools/tools.h"
 #include "mdfu/mac/socket_mac.h"
 #include "mdfu/transport/transport.h"
+#include "mdfu/transport/poll_policy.h"
+
+/**
+ * @brief Network protocol that carries the transport frames.
+ */
+typedef enum network_protocol {
+    /** @brief TCP byte stream, with packet headers for the SPI and I2C transports. */
+    NETWORK_PROTOCOL_TCP = 0,
+    /** @brief One UDP datagram per transport frame. */
+    NETWORK_PROTOCOL_UDP = 1
+} network_protocol_t;
 
 struct network_config {
     struct socket_config socket_config;
+    network_protocol_t protocol;
     transport_type_t transport;
+    poll_policy_type_t poll_policy;
 };
 
 extern tool_t network_tool;
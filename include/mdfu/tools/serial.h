@@ -2,4 +2,10 @@
 #include "mdfu/tools/tools.h"
 #include "mdfu/mac/serial_mac.h"
 
+/**
+ * @def SERIAL_BAUDRATE_AUTO
+ * @brief Serial configuration baud rate that selects the rate by probing the client.
+ */
+#define SERIAL_BAUDRATE_AUTO -1
+
 extern tool_t serial_tool;
\ No newline at end of file
@@ -1,5 +1,11 @@
 #pragma once
 #include "mdfu/tools/tools.h"
 #include "mdfu/mac/spidev_mac.h"
+#include "mdfu/transport/poll_policy.h"
+
+struct spidev_tool_config {
+    struct spidev_config spidev_config;
+    poll_policy_type_t poll_policy;
+};
 
 extern tool_t spidev_tool;
\ No newline at end of file
@@ -3,9 +3,15 @@
 
 #include "mdfu/transport/transport.h"
 
+/**
+ * @brief Tool interface.
+ *
+ * The init function creates a new transport instance for the tool
+ * configuration. The caller owns the returned transport and releases it
+ * with transport_free.
+ */
 typedef struct {
-    transport_t ops;
-    int (* init)(void *config);
+    int (* init)(void *config, transport_t **transport);
     void (* list_connected_tools)(void);
     int (* parse_arguments)(int tool_argc, char **tool_argv, void **config);
     char *(* get_parameter_help)(void);
@@ -23,6 +29,9 @@ typedef enum tool_type {
 #endif
 #ifdef USE_TOOL_I2C
     TOOL_I2CDEV,
+#endif
+#ifdef USE_TOOL_USB
+    TOOL_USB,
 #endif
     TOOL_NONE
 }tool_type_t;
@@ -0,0 +1,7 @@
+#ifndef USB_H
+#define USB_H
+#include "mdfu/tools/tools.h"
+#include "mdfu/mac/usb_mac.h"
+
+extern tool_t usb_tool;
+#endif
@@ -0,0 +1,39 @@
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mdfu/mac/mac.h"
+
+/**
+ * @def FRAME_TRACE_SLOTS
+ * @brief Number of frames kept in the frame trace ring, must be a power of two.
+ */
+#ifndef FRAME_TRACE_SLOTS
+#define FRAME_TRACE_SLOTS 256
+#endif
+
+/**
+ * @def FRAME_TRACE_CAPTURE_SIZE
+ * @brief Number of bytes recorded for each frame.
+ *
+ * Longer frames are truncated, the trace still contains their full size.
+ */
+#ifndef FRAME_TRACE_CAPTURE_SIZE
+#define FRAME_TRACE_CAPTURE_SIZE 256
+#endif
+
+/**
+ * @brief Direction of a traced frame.
+ */
+typedef enum frame_trace_direction {
+    FRAME_TRACE_TX = 0,
+    FRAME_TRACE_RX = 1
+} frame_trace_direction_t;
+
+void frame_trace_enable(bool enable);
+void frame_trace_record(frame_trace_direction_t direction, int size, const uint8_t *data);
+void frame_trace_recordv(frame_trace_direction_t direction, int count, const mac_iovec_t *iov);
+int frame_trace_dump(int fd);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef POLL_POLICY_H
+#define POLL_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mdfu/timeout.h"
+
+/**
+ * @brief Number of response times kept, indexed by the MDFU command code.
+ */
+#define POLL_POLICY_COMMANDS 8
+
+/**
+ * @brief Policies for polling a client for a response.
+ *
+ * POLL_POLICY_FIXED: Poll as fast as the inter transaction delay allows.
+ * POLL_POLICY_ADAPTIVE: Delay the first poll by the learned response time of the
+ * command and back off exponentially while the client is busy.
+ */
+typedef enum poll_policy_type {
+    POLL_POLICY_FIXED,
+    POLL_POLICY_ADAPTIVE
+} poll_policy_type_t;
+
+/**
+ * @brief Response polling state of a transport instance.
+ */
+typedef struct poll_policy {
+    /** @brief Selected policy. */
+    poll_policy_type_t type;
+    /** @brief Smoothed response time in seconds for each command. */
+    float latency[POLL_POLICY_COMMANDS];
+    /** @brief Command of the transaction in progress. */
+    int command;
+    /** @brief Time when the command of the transaction in progress was sent. */
+    timeout_t sent;
+    /** @brief Current delay between polls in seconds. */
+    float interval;
+} poll_policy_t;
+
+void poll_policy_init(poll_policy_t *policy, poll_policy_type_t type);
+float poll_policy_command_sent(poll_policy_t *policy, const uint8_t *packet, float itd);
+float poll_policy_busy(poll_policy_t *policy, float itd);
+void poll_policy_response_received(poll_policy_t *policy);
+int get_poll_policy_by_name(const char *name, poll_policy_type_t *type);
+
+#endif
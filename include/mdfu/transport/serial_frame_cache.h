@@ -0,0 +1,43 @@
+#ifndef SERIAL_FRAME_CACHE_H
+#define SERIAL_FRAME_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mdfu/mac/mac.h"
+#include "mdfu/transport/serial_framing.h"
+
+/**
+ * @def SERIAL_FRAME_CACHE_HEADER_SIZE
+ * @brief Size of the MDFU packet header in front of the cached image data.
+ */
+#define SERIAL_FRAME_CACHE_HEADER_SIZE 2
+
+/**
+ * @brief Cache of the escaped image chunks of serial transport frames.
+ *
+ * The cache file holds the image split into chunks of the client buffer size,
+ * each already escaped and with its checksum lane sums, and an index of the
+ * chunks. Frames for WRITE_CHUNK commands are assembled from the MDFU header,
+ * which contains the sequence number, the cached chunk and the frame check
+ * sequence without encoding the image data again.
+ */
+typedef struct serial_frame_cache serial_frame_cache_t;
+
+/**
+ * @brief Serial transport frame assembled from a cached chunk.
+ */
+typedef struct serial_frame_cache_frame {
+    /** @brief Frame start code and escaped MDFU header. */
+    uint8_t head[FRAME_START_CODE_SIZE + SERIAL_FRAME_CACHE_HEADER_SIZE * 2];
+    /** @brief Escaped frame check sequence and frame end code. */
+    uint8_t tail[FRAME_CHECK_SEQUENCE_SIZE * 2 + FRAME_END_CODE_SIZE];
+    /** @brief Head, cached chunk and tail of the frame. */
+    mac_iovec_t iov[3];
+} serial_frame_cache_frame_t;
+
+int serial_frame_cache_create(serial_frame_cache_t **cache, const char *path, const uint8_t *image, size_t image_size);
+void serial_frame_cache_destroy(serial_frame_cache_t *cache);
+int serial_frame_cache_encodev(serial_frame_cache_t *cache, int count, const mac_iovec_t *iov,
+                               serial_frame_cache_frame_t *frame, uint16_t *frame_check_sequence);
+
+#endif
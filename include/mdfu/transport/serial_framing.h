@@ -0,0 +1,66 @@
+#ifndef SERIAL_FRAMING_H
+#define SERIAL_FRAMING_H
+
+#include <stdint.h>
+#include "mdfu/mac/mac.h"
+
+/** @def FRAME_CHECK_SEQUENCE_SIZE
+ *  @brief Size of the frame check sequence in bytes.
+ */
+#define FRAME_CHECK_SEQUENCE_SIZE 2
+
+/** @def FRAME_START_CODE_SIZE
+ *  @brief Size of the frame start code in bytes.
+ */
+#define FRAME_START_CODE_SIZE 1
+
+/** @def FRAME_END_CODE_SIZE
+ *  @brief Size of the frame end code in bytes.
+ */
+#define FRAME_END_CODE_SIZE 1
+
+/** @def FRAME_START_CODE
+ *  @brief Indicates the start of a frame.
+ */
+#define FRAME_START_CODE 0x56
+
+/** @def FRAME_END_CODE
+ *  @brief The ending byte code of a frame.
+ */
+#define FRAME_END_CODE 0x9E
+
+/** @def ESCAPE_SEQ_CODE
+ *  @brief The byte code used to indicate the start of an escape sequence.
+ */
+#define ESCAPE_SEQ_CODE 0xCC
+
+/** @def FRAME_START_ESC_SEQ
+ *  @brief The escape sequence replacement for the frame start code.
+ */
+#define FRAME_START_ESC_SEQ (~FRAME_START_CODE & 0xff)
+
+/** @def FRAME_END_ESC_SEQ
+ *  @brief The escape sequence replacement for the frame end code.
+ */
+#define FRAME_END_ESC_SEQ  (~FRAME_END_CODE & 0xff)
+
+/** @def ESCAPE_SEQ_ESC_SEQ
+ *  @brief The escape sequence replacement for the escape sequence code itself.
+ */
+#define ESCAPE_SEQ_ESC_SEQ (~ESCAPE_SEQ_CODE & 0xff)
+
+/** @def SERIAL_FRAME_MAX_SIZE
+ *  @brief Worst case size of an encoded frame for a payload of the given size.
+ *
+ *  The worst case is a payload and frame check sequence that consist of
+ *  reserved codes only, which are all replaced with two byte escape sequences.
+ */
+#define SERIAL_FRAME_MAX_SIZE(payload_size) \
+    (FRAME_START_CODE_SIZE + ((payload_size) + FRAME_CHECK_SEQUENCE_SIZE) * 2 + FRAME_END_CODE_SIZE)
+
+int serial_frame_encode_payload(int data_size, const uint8_t *data, uint8_t *encoded_data);
+int serial_frame_encode(int data_size, const uint8_t *data, uint8_t *frame, uint16_t *frame_check_sequence);
+int serial_frame_encodev(int count, const mac_iovec_t *iov, uint8_t *frame, uint16_t *frame_check_sequence);
+int serial_frame_decode_payload(int data_size, const uint8_t *data, int max_size, uint8_t *decoded_data);
+
+#endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define TRANSPORT_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "mdfu/mac/mac.h"
 
 typedef enum transport_type{
@@ -14,16 +15,143 @@ typedef enum transport_type{
 
 // IOCTL argument is a float and represents seconds
 #define TRANSPORT_IOC_INTER_TRANSACTION_DELAY 1
+// IOCTL argument is a pointer to a bool that is set to true when the transport
+// supports sending multiple MDFU commands before receiving the responses
+#define TRANSPORT_IOC_PIPELINING 2
+// IOCTL argument is a poll_policy_type_t that selects how the client is polled
+// for responses by transports that poll
+#define TRANSPORT_IOC_POLL_POLICY 3
+// IOCTL argument is a pointer to an int that is set to a file descriptor that
+// becomes readable when a response arrives. Only supported by transports where
+// the client sends the responses without being polled.
+#define TRANSPORT_IOC_GET_FD 4
+// IOCTL argument is a bool that enables reading the response frame in the same
+// read as the response length frame, for I2C clients that send both at once
+#define TRANSPORT_IOC_SPECULATIVE_READ 5
+// IOCTL argument is an int with the size in bytes of the largest MDFU packet
+// that is sent or received, transports resize their frame buffers for it
+#define TRANSPORT_IOC_PACKET_SIZE 6
+// IOCTL argument is a pointer to a serial_frame_cache_t that the frames for
+// image chunks are taken from, or NULL to encode all frames. Only supported by
+// the serial transports, the cache must stay valid while it is set.
+#define TRANSPORT_IOC_FRAME_CACHE 7
+// IOCTL argument is a pointer to a bool that is set to true when received data
+// is buffered in the transport or its MAC, where it does not make the file
+// descriptor of TRANSPORT_IOC_GET_FD readable.
+#define TRANSPORT_IOC_HAS_DATA 8
 
-typedef struct transport {
-    int (* init)(mac_t *, int timeout);
-    int (* open)(void);
-    int (* close)(void);
-    int (* read)(int *, uint8_t *, float);
-    int (* write)(int, uint8_t *);
-    int (* ioctl)(int, ...);
-} transport_t;
+/**
+ * @brief Maximum number of buffers in a transport scatter/gather write.
+ *
+ * One MAC buffer is left for framing that the transport adds.
+ */
+#define TRANSPORT_IOVEC_MAX (MAC_IOVEC_MAX - 1)
+
+typedef struct transport transport_t;
+
+/**
+ * @brief Buffer of a scatter read.
+ */
+typedef struct transport_iovec {
+    /** @brief Buffer for the received data. */
+    uint8_t *data;
+    /** @brief Size of the buffer in bytes. */
+    int size;
+} transport_iovec_t;
+
+/**
+ * @brief Transport statistics.
+ *
+ * The counters are updated by the transport implementations while sending
+ * and receiving frames. Byte counters on the wire include all framing, e.g.
+ * frame codes, escape sequences, frame types and checksums, while payload
+ * byte counters only include the MDFU packets.
+ */
+typedef struct transport_stats {
+    /** @brief Number of command frames sent. */
+    uint64_t frames_sent;
+    /** @brief Number of valid response frames received. */
+    uint64_t frames_received;
+    /** @brief Number of bytes sent on the wire. */
+    uint64_t bytes_sent;
+    /** @brief Number of bytes received on the wire. */
+    uint64_t bytes_received;
+    /** @brief Number of MDFU packet bytes sent. */
+    uint64_t payload_bytes_sent;
+    /** @brief Number of MDFU packet bytes received. */
+    uint64_t payload_bytes_received;
+    /** @brief Number of times the client was polled for a response. */
+    uint64_t polls;
+    /** @brief Number of polls where the client was busy. */
+    uint64_t busy_polls;
+    /** @brief Number of reads that timed out. */
+    uint64_t timeouts;
+    /** @brief Number of received frames that failed the integrity check. */
+    uint64_t integrity_errors;
+} transport_stats_t;
+
+/**
+ * @brief Transport layer instance.
+ *
+ * The operations get the instance they are called on as first argument so
+ * that each instance can keep its own state in ctx. The MAC passed to init
+ * is owned by the transport and released together with it in transport_free.
+ *
+ * writev is optional and can be NULL. It sends a MDFU packet that is split
+ * over up to TRANSPORT_IOVEC_MAX buffers, e.g. the MDFU header and image data that
+ * is borrowed from the image reader, without assembling it first. It returns
+ * the same as write for the concatenated packet.
+ *
+ * readv is optional and can be NULL. It receives a MDFU packet like read and
+ * scatters it over the buffers in order, e.g. the MDFU header into the status
+ * packet buffer and the data into a buffer that is lent by the image writer.
+ * The size of the whole packet is returned in the size argument. Packets that
+ * do not fit into the buffers are discarded with errno set to ENOBUFS.
+ *
+ * prepare is optional and can be NULL. It frames the MDFU packet that is sent
+ * next, e.g. while the response to the previous command is outstanding, so
+ * that the write or writev of the same buffers only sends the prepared frame.
+ * The buffers must not change until the packet is sent. Sending any other
+ * packet first discards the prepared frame. Returns 0 on success, -1 if the
+ * packet was not prepared, in which case it is framed when it is sent.
+ *
+ * stats is zero initialized by transport_alloc.
+ */
+struct transport {
+    int (* init)(transport_t *, mac_t *, int timeout);
+    int (* open)(transport_t *);
+    int (* close)(transport_t *);
+    int (* read)(transport_t *, int *, uint8_t *, float);
+    int (* write)(transport_t *, int, uint8_t *);
+    int (* writev)(transport_t *, int count, const mac_iovec_t *iov);
+    int (* readv)(transport_t *, int *size, int count, const transport_iovec_t *iov, float timeout);
+    int (* prepare)(transport_t *, int count, const mac_iovec_t *iov);
+    int (* ioctl)(transport_t *, int, ...);
+    mac_t *mac;
+    void *ctx;
+    transport_stats_t stats;
+};
+
+/**
+ * @def TRANSPORT_OPS
+ * @brief Operations of a transport instance.
+ *
+ * In a single tool build (MDFU_STATIC_TRANSPORT) all instances are of the
+ * same transport and this is its operations table, so that the calls are
+ * direct and can be inlined with link time optimization. The instance is
+ * still evaluated so that it counts as used.
+ */
+#ifdef MDFU_STATIC_TRANSPORT
+extern const transport_t MDFU_STATIC_TRANSPORT;
+#define TRANSPORT_OPS(transport) ((void) (transport), &MDFU_STATIC_TRANSPORT)
+#else
+#define TRANSPORT_OPS(transport) (transport)
+#endif
 
 int get_transport(transport_type_t type, transport_t **transport);
+int transport_alloc(const transport_t *ops, size_t ctx_size, transport_t **transport);
+int transport_resize_ctx(transport_t *transport, size_t ctx_size);
+void transport_free(transport_t *transport);
+int transport_iovec_scatter(int size, const uint8_t *data, int count, const transport_iovec_t *iov, uint16_t *checksum);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,193 @@
+/**
+ * @file gpio_ready.c
+ * @brief Client ready signalling with a GPIO line.
+ *
+ * The line is requested with edge detection from the GPIO character device,
+ * so the kernel queues an event for each edge and the host can block in
+ * poll() until the client signals a response instead of polling the bus.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "mdfu/mac/gpio_ready.h"
+#include "mdfu/logging.h"
+
+/**
+ * @brief Consumer label of the requested line, shown by gpioinfo.
+ */
+#define GPIO_READY_CONSUMER "mdfu-ready"
+
+/**
+ * @brief Parse a ready line in the format <chip>:<line>[:rising|falling].
+ *
+ * The chip is a GPIO chip device path, a chip name like gpiochip0 or the
+ * chip number. The line is signalled on the falling edge unless the rising
+ * edge is selected.
+ *
+ * @param text Ready line description.
+ * @param config Configuration where the line is stored.
+ * @return int 0 on success, -1 on error with errno set to EINVAL.
+ */
+int gpio_ready_parse(const char *text, struct gpio_ready_config *config){
+    const char *separator = strchr(text, ':');
+    char *end;
+    unsigned long line;
+    size_t chip_size;
+
+    if(NULL == separator || separator == text){
+        ERROR("Invalid ready GPIO %s, expected <chip>:<line> e.g. gpiochip0:17", text);
+        errno = EINVAL;
+        return -1;
+    }
+    chip_size = (size_t) (separator - text);
+    errno = 0;
+    line = strtoul(separator + 1, &end, 10);
+    if(end == separator + 1 || 0 != errno || line > UINT32_MAX){
+        ERROR("Invalid ready GPIO line in %s", text);
+        errno = EINVAL;
+        return -1;
+    }
+    if('\0' == *end || 0 == strcmp(end, ":falling")){
+        config->rising_edge = false;
+    } else if(0 == strcmp(end, ":rising")){
+        config->rising_edge = true;
+    } else {
+        ERROR("Invalid ready GPIO edge in %s, expected rising or falling", text);
+        errno = EINVAL;
+        return -1;
+    }
+    if('/' == text[0]){
+        snprintf(config->chip, sizeof(config->chip), "%.*s", (int) chip_size, text);
+    } else if(strspn(text, "0123456789") == chip_size){
+        snprintf(config->chip, sizeof(config->chip), "/dev/gpiochip%.*s", (int) chip_size, text);
+    } else {
+        snprintf(config->chip, sizeof(config->chip), "/dev/%.*s", (int) chip_size, text);
+    }
+    config->line = (unsigned int) line;
+    return 0;
+}
+
+/**
+ * @brief Request the ready line as input with edge events.
+ *
+ * @param ready Ready line state.
+ * @param config Ready line configuration.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int gpio_ready_open(gpio_ready_t *ready, const struct gpio_ready_config *config){
+    struct gpio_v2_line_request request;
+    int chip;
+    int status;
+
+    memset(&request, 0, sizeof(request));
+    request.offsets[0] = config->line;
+    request.num_lines = 1;
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+        (config->rising_edge ? GPIO_V2_LINE_FLAG_EDGE_RISING : GPIO_V2_LINE_FLAG_EDGE_FALLING);
+    strncpy(request.consumer, GPIO_READY_CONSUMER, sizeof(request.consumer) - 1);
+
+    chip = open(config->chip, O_RDONLY | O_CLOEXEC);
+    if(chip < 0){
+        ERROR("Failed to open GPIO chip %s: %s", config->chip, strerror(errno));
+        return -1;
+    }
+    status = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &request);
+    close(chip);
+    if(status < 0){
+        ERROR("Failed to request ready GPIO line %u of %s: %s", config->line, config->chip, strerror(errno));
+        return -1;
+    }
+    // Non-blocking so that queued events can be discarded without waiting
+    if(fcntl(request.fd, F_SETFL, O_NONBLOCK) < 0){
+        close(request.fd);
+        return -1;
+    }
+    DEBUG("Waiting for %s edges on GPIO line %u of %s", config->rising_edge ? "rising" : "falling", config->line, config->chip);
+    ready->fd = request.fd;
+    return 0;
+}
+
+/**
+ * @brief Read all queued edge events.
+ *
+ * @param ready Ready line state.
+ * @return int Number of events read, or -1 on error with errno set.
+ */
+static int read_events(gpio_ready_t *ready){
+    struct gpio_v2_line_event events[16];
+    int count = 0;
+    ssize_t size;
+
+    while((size = read(ready->fd, events, sizeof(events))) > 0){
+        count += (int) ((size_t) size / sizeof(events[0]));
+    }
+    if(size < 0 && EAGAIN != errno && EINTR != errno){
+        ERROR("Failed to read ready GPIO events: %s", strerror(errno));
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * @brief Discard the edge events that were queued so far.
+ *
+ * Called before a transaction so that only a signal after it is taken as
+ * ready, e.g. not the signal for the previous response.
+ *
+ * @param ready Ready line state.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int gpio_ready_discard(gpio_ready_t *ready){
+    return read_events(ready) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Wait until the client signals on the ready line.
+ *
+ * @param ready Ready line state.
+ * @param deadline Time when to stop waiting.
+ * @return int 1 if the client signalled, 0 if the deadline expired or -1 on
+ *         error with errno set.
+ */
+int gpio_ready_wait(gpio_ready_t *ready, timeout_t *deadline){
+    struct pollfd pfd = {.fd = ready->fd, .events = POLLIN};
+    int status;
+
+    while(true){
+        status = read_events(ready);
+        if(0 != status){
+            return status < 0 ? -1 : 1;
+        }
+        status = timeout_remaining_ms(deadline);
+        if(status < 0){
+            return -1;
+        }
+        status = poll(&pfd, 1, status);
+        if(status < 0 && EINTR != errno){
+            ERROR("Failed to wait for the ready GPIO: %s", strerror(errno));
+            return -1;
+        }
+        if(0 == status){
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Release the ready line.
+ *
+ * @param ready Ready line state, the line does not need to be requested.
+ */
+void gpio_ready_close(gpio_ready_t *ready){
+    if(ready->fd >= 0){
+        close(ready->fd);
+        ready->fd = -1;
+    }
+}
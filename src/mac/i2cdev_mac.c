@@ -19,21 +19,41 @@
 #include "mdfu/mac/i2cdev_mac.h"
 
 #define PATH_NAME_MAX_SIZE 256
+/**
+ * @brief Largest message that the i2c-dev driver accepts in one write.
+ */
+#define I2CDEV_WRITE_MAX_SIZE 8192
+/**
+ * @brief Bus clock frequency in Hz that is assumed when it is neither
+ * configured nor reported by the adapter.
+ */
+#define I2CDEV_DEFAULT_BUS_SPEED 100000
+/**
+ * @brief Time in milliseconds that the adapter waits for a transaction in
+ * addition to the time the largest message takes on the bus.
+ */
+#define I2CDEV_TIMEOUT_BASE_MS 100
 
+/**
+ * @brief i2cdev MAC instance state.
+ */
 typedef struct {
     int fd;
     unsigned long address;
+    int bus_speed;
     char path[PATH_NAME_MAX_SIZE];
+    struct gpio_ready_config ready_config;
+    gpio_ready_t ready;
 } i2c_device_t;
 
-static i2c_device_t device = {
-    .fd = -1,
-};
+static int mac_transfer(mac_t *mac, int count, mac_segment_t *segments);
+static int mac_wait_ready(mac_t *mac, timeout_t *deadline);
 
-int mac_init(void *conf)
+int mac_init(mac_t *mac, void *conf)
 {
+    i2c_device_t *device = mac->ctx;
     struct i2cdev_config *config = (struct i2cdev_config *) conf;
-    if(device.fd != -1){
+    if(device->fd != -1){
         ERROR("Cannot initialize while MAC is opened.");
         errno = EBUSY;
         return -1;
@@ -45,42 +65,124 @@ int mac_init(void *conf)
         errno = EINVAL;
         return -1;
     }
-    strncpy(device.path, config->path, PATH_NAME_MAX_SIZE);
-    device.address = config->address;
+    strncpy(device->path, config->path, PATH_NAME_MAX_SIZE);
+    device->address = config->address;
+    device->bus_speed = config->bus_speed;
+    device->ready_config = config->ready_gpio;
+    mac->wait_ready = ('\0' != device->ready_config.chip[0]) ? mac_wait_ready : NULL;
     return 0;
 }
 
-int mac_open(void)
+/**
+ * @brief Read the bus clock frequency of an I2C adapter.
+ *
+ * The bus speed is set by the adapter driver and cannot be changed from
+ * user space. It is only reported for adapters described in the device tree.
+ *
+ * @param path i2c-dev device path, e.g. /dev/i2c-1.
+ * @return int Bus clock frequency in Hz, or -1 if the adapter does not report it.
+ */
+static int read_bus_speed(const char *path)
+{
+    char attribute[PATH_NAME_MAX_SIZE + 64];
+    const char *name = strrchr(path, '/');
+    uint8_t value[4];
+    size_t size;
+    FILE *file;
+
+    name = (NULL == name) ? path : name + 1;
+    snprintf(attribute, sizeof(attribute), "/sys/class/i2c-dev/%s/device/of_node/clock-frequency", name);
+    file = fopen(attribute, "rb");
+    if(NULL == file){
+        return -1;
+    }
+    size = fread(value, 1, sizeof(value), file);
+    fclose(file);
+    if(sizeof(value) != size){
+        return -1;
+    }
+    // Device tree properties are stored big endian
+    return (int) (((uint32_t) value[0] << 24) | ((uint32_t) value[1] << 16) | ((uint32_t) value[2] << 8) | value[3]);
+}
+
+/**
+ * @brief Select the bus speed and set the adapter timeout for it.
+ *
+ * The speed reported by the adapter takes precedence over the configured one.
+ * The timeout covers the largest message at this speed, 9 clock cycles per
+ * byte including the acknowledge.
+ *
+ * @param device i2cdev MAC instance state.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int set_bus_timing(i2c_device_t *device)
+{
+    int adapter_speed = read_bus_speed(device->path);
+    int bus_speed = device->bus_speed;
+    unsigned long timeout;
+
+    if(adapter_speed > 0){
+        if(bus_speed > 0 && bus_speed != adapter_speed){
+            WARN("I2C adapter bus speed is %d Hz, the configured %d Hz are not used", adapter_speed, bus_speed);
+        }
+        bus_speed = adapter_speed;
+    } else if(bus_speed <= 0){
+        bus_speed = I2CDEV_DEFAULT_BUS_SPEED;
+    }
+    DEBUG("I2C bus speed %d Hz", bus_speed);
+    timeout = I2CDEV_TIMEOUT_BASE_MS + (unsigned long) I2CDEV_WRITE_MAX_SIZE * 9 * 1000 / (unsigned long) bus_speed;
+    // The adapter timeout is set in units of 10 ms
+    return ioctl(device->fd, I2C_TIMEOUT, (timeout + 9) / 10);
+}
+
+int mac_open(mac_t *mac)
 {
+    i2c_device_t *device = mac->ctx;
+    unsigned long functions;
     DEBUG("Opening i2cdev MAC");
-    if(device.fd != -1){
+    if(device->fd != -1){
         errno = EBUSY;
         return -1;
     }
 
-    device.fd = open(device.path, O_RDWR);
-    if (device.fd < 0) {
+    device->fd = open(device->path, O_RDWR);
+    if (device->fd < 0) {
         ERROR("Failed to open I2C device: %s", strerror(errno));
         return -1;
     }
 
-    if (ioctl(device.fd, I2C_SLAVE, device.address) < 0 ||
-        ioctl(device.fd, I2C_TIMEOUT, 10) < 0 ||
-        ioctl(device.fd, I2C_RETRIES, 0) < 0) {
+    if (ioctl(device->fd, I2C_SLAVE, device->address) < 0 ||
+        set_bus_timing(device) < 0 ||
+        ioctl(device->fd, I2C_RETRIES, 0) < 0 ||
+        ioctl(device->fd, I2C_FUNCS, &functions) < 0) {
         ERROR("Failed to set I2C parameters %s", strerror(errno));
-        close(device.fd);
-        device.fd = -1;
+        close(device->fd);
+        device->fd = -1;
         return -1;
     }
+    if('\0' != device->ready_config.chip[0] && gpio_ready_open(&device->ready, &device->ready_config) < 0){
+        close(device->fd);
+        device->fd = -1;
+        return -1;
+    }
+    // SMBus only adapters cannot combine messages with repeated starts
+    if(functions & I2C_FUNC_I2C){
+        mac->transfer = mac_transfer;
+    } else {
+        DEBUG("I2C adapter does not support combined transactions");
+        mac->transfer = NULL;
+    }
     return 0;
 }
 
-int mac_close(void)
+int mac_close(mac_t *mac)
 {
+    i2c_device_t *device = mac->ctx;
     DEBUG("Closing i2cdev MAC");
-    if(device.fd != -1){
-        close(device.fd);
-        device.fd = -1;
+    if(device->fd != -1){
+        close(device->fd);
+        device->fd = -1;
+        gpio_ready_close(&device->ready);
         return 0;
     } else {
         errno = EBADF;
@@ -88,36 +190,173 @@ int mac_close(void)
     }
 }
 
-int mac_read(int size, uint8_t *data)
+int mac_read(mac_t *mac, int size, uint8_t *data)
 {
+    i2c_device_t *device = mac->ctx;
     int status;
 
-    status = read(device.fd, data, size);
+    status = read(device->fd, data, size);
     if(status < 0){
         ERROR("i2cdev MAC read: %s", strerror(errno));
     }
     return status;
 }
 
-int mac_write(int size, uint8_t *data)
+/**
+ * @brief Discard ready signals before a write, so that only a signal for the
+ * command that is written is taken as ready.
+ *
+ * @param device i2cdev MAC instance state.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int discard_ready(i2c_device_t *device)
+{
+    if(device->ready.fd < 0){
+        return 0;
+    }
+    return gpio_ready_discard(&device->ready);
+}
+
+int mac_write(mac_t *mac, int size, uint8_t *data)
 {
+    i2c_device_t *device = mac->ctx;
     int status;
 
-    status = write(device.fd, data, size);
+    if(discard_ready(device) < 0){
+        return -1;
+    }
+    status = write(device->fd, data, size);
     if(status < 0){
         ERROR("i2cdev MAC write: %s", strerror(errno));
     }
     return status;
 }
 
-mac_t i2cdev_mac = {
+/**
+ * @brief Writes multiple buffers as one I2C write transaction.
+ *
+ * The i2c-dev driver turns every write system call into a separate
+ * transaction, so writev on the device would split the message. The buffers
+ * are gathered into a single message instead.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the message.
+ * @return int Number of bytes sent, or -1 on error.
+ */
+int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov)
+{
+    uint8_t message[I2CDEV_WRITE_MAX_SIZE];
+    int size = mac_iovec_size(count, iov);
+    int offset = 0;
+
+    if(size < 0){
+        return -1;
+    }
+    if(size > I2CDEV_WRITE_MAX_SIZE){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        memcpy(&message[offset], iov[i].data, (size_t) iov[i].size);
+        offset += iov[i].size;
+    }
+    return mac_write(mac, size, message);
+}
+
+/**
+ * @brief Performs a batch of I2C messages with a single ioctl.
+ *
+ * The messages are joined with repeated starts, so the bus is only released
+ * after the last one. A segment delay ends the batch, the remaining segments
+ * are sent with another ioctl after the delay.
+ *
+ * @param mac MAC instance.
+ * @param count Number of segments.
+ * @param segments Segments to transfer, writes if tx_data is set, reads otherwise.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_transfer(mac_t *mac, int count, mac_segment_t *segments)
+{
+    i2c_device_t *device = mac->ctx;
+    struct i2c_msg messages[MAC_TRANSFER_MAX_SEGMENTS];
+    struct i2c_rdwr_ioctl_data batch = {.msgs = messages, .nmsgs = 0};
+
+    if(device->fd < 0){
+        errno = EBADF;
+        return -1;
+    }
+    if(count < 1 || count > MAC_TRANSFER_MAX_SEGMENTS){
+        errno = EINVAL;
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        if(NULL != segments[i].tx_data && discard_ready(device) < 0){
+            return -1;
+        }
+    }
+    for(int i = 0; i < count; i++){
+        struct i2c_msg *message = &messages[batch.nmsgs++];
+
+        if(segments[i].size > I2CDEV_WRITE_MAX_SIZE){
+            errno = EMSGSIZE;
+            return -1;
+        }
+        message->addr = (uint16_t) device->address;
+        message->flags = (NULL != segments[i].tx_data) ? 0 : I2C_M_RD;
+        message->len = (uint16_t) segments[i].size;
+        message->buf = (NULL != segments[i].tx_data) ? segments[i].tx_data : segments[i].rx_data;
+        if(i < count - 1 && 0 == segments[i].delay_us){
+            continue;
+        }
+        if(ioctl(device->fd, I2C_RDWR, &batch) < 0){
+            // Not an error by itself, a busy client does not acknowledge reads
+            DEBUG("i2cdev MAC transfer: %s", strerror(errno));
+            return -1;
+        }
+        batch.nmsgs = 0;
+        if(i < count - 1){
+            usleep(segments[i].delay_us);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait for the client to signal a ready response on the ready GPIO.
+ *
+ * @param mac MAC instance.
+ * @param deadline Time when to stop waiting.
+ * @return int 1 if the client signalled, 0 if the deadline expired or -1 on error.
+ */
+static int mac_wait_ready(mac_t *mac, timeout_t *deadline)
+{
+    i2c_device_t *device = mac->ctx;
+
+    return gpio_ready_wait(&device->ready, deadline);
+}
+
+const mac_t i2cdev_mac = {
     .open = mac_open,
     .close = mac_close,
     .init = mac_init,
     .write = mac_write,
-    .read = mac_read
+    .read = mac_read,
+    .transfer = mac_transfer,
+    .writev = mac_writev
 };
 
-void get_i2cdev_mac(mac_t **mac){
-    *mac = &i2cdev_mac;
+/**
+ * @brief Create a new i2cdev MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_i2cdev_mac(mac_t **mac){
+    if(mac_alloc(&i2cdev_mac, sizeof(i2c_device_t), mac) < 0){
+        return -1;
+    }
+    ((i2c_device_t *) (*mac)->ctx)->fd = -1;
+    ((i2c_device_t *) (*mac)->ctx)->ready.fd = -1;
+    return 0;
 }
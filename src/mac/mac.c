@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "mdfu/mac/mac.h"
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+/**
+ * @brief Allocate a new MAC instance.
+ *
+ * Copies the operations from a MAC implementation into a new instance and
+ * allocates zero initialized private state for it. No private state is
+ * allocated when ctx_size is zero.
+ *
+ * @param ops MAC implementation operations.
+ * @param ctx_size Size of the MAC private state in bytes.
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int mac_alloc(const mac_t *ops, size_t ctx_size, mac_t **mac){
+    mac_t *instance = malloc(sizeof(mac_t));
+
+    if(NULL == instance){
+        errno = ENOMEM;
+        return -1;
+    }
+    *instance = *ops;
+    instance->ctx = NULL;
+    if(ctx_size > 0){
+        instance->ctx = calloc(1, ctx_size);
+    }
+    if(ctx_size > 0 && NULL == instance->ctx){
+        free(instance);
+        errno = ENOMEM;
+        return -1;
+    }
+    *mac = instance;
+    return 0;
+}
+
+/**
+ * @brief Resize the private state of a MAC instance.
+ *
+ * Used by MACs that keep buffers at the end of their private state and grow
+ * them for the largest transfer. The content is kept up to the smaller of the
+ * old and the new size, added space is not initialized.
+ *
+ * @param mac MAC instance.
+ * @param ctx_size New size of the MAC private state in bytes.
+ * @return int 0 on success, -1 on error with errno set. The private state is
+ *         unchanged on error.
+ */
+int mac_resize_ctx(mac_t *mac, size_t ctx_size){
+    void *ctx = realloc(mac->ctx, ctx_size);
+
+    if(NULL == ctx){
+        errno = ENOMEM;
+        return -1;
+    }
+    mac->ctx = ctx;
+    return 0;
+}
+
+/**
+ * @brief Release a MAC instance.
+ *
+ * The MAC must be closed before it is released.
+ *
+ * @param mac MAC instance, can be NULL.
+ */
+void mac_free(mac_t *mac){
+    if(NULL != mac){
+        free(mac->ctx);
+        free(mac);
+    }
+}
+
+/**
+ * @brief Calculate the total size of scatter/gather write buffers.
+ *
+ * @param count Number of buffers.
+ * @param iov Buffers.
+ * @return int Total size in bytes, or -1 with errno set to EINVAL if count
+ *         exceeds MAC_IOVEC_MAX or a size is negative.
+ */
+int mac_iovec_size(int count, const mac_iovec_t *iov){
+    int size = 0;
+
+    if(count < 0 || count > MAC_IOVEC_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        if(iov[i].size < 0){
+            errno = EINVAL;
+            return -1;
+        }
+        size += iov[i].size;
+    }
+    return size;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Convert scatter/gather write buffers to a system I/O vector.
+ *
+ * @param count Number of buffers.
+ * @param iov Buffers.
+ * @param vector System I/O vector with room for MAC_IOVEC_MAX entries.
+ * @return int Total size in bytes, or -1 on error with errno set.
+ */
+int mac_iovec_to_iovec(int count, const mac_iovec_t *iov, struct iovec *vector){
+    int size = mac_iovec_size(count, iov);
+
+    for(int i = 0; i < count && size >= 0; i++){
+        vector[i].iov_base = (void *) iov[i].data;
+        vector[i].iov_len = (size_t) iov[i].size;
+    }
+    return size;
+}
+
+/**
+ * @brief Remove sent data from the front of a system I/O vector.
+ *
+ * Used for continuing a writev or sendmsg call that only sent part of the data.
+ *
+ * @param count Number of entries in the vector.
+ * @param vector Pointer to the vector, updated to point at the first entry
+ *               with data left to send.
+ * @param size Number of bytes that were sent.
+ * @return int Number of entries left in the vector.
+ */
+int mac_iovec_consume(int count, struct iovec **vector, size_t size){
+    struct iovec *entry = *vector;
+
+    while(count > 0 && size >= entry->iov_len){
+        size -= entry->iov_len;
+        entry++;
+        count--;
+    }
+    if(count > 0){
+        entry->iov_base = (uint8_t *) entry->iov_base + size;
+        entry->iov_len -= size;
+    }
+    *vector = entry;
+    return count;
+}
+#endif
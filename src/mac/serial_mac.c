@@ -10,15 +10,57 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "mdfu/mac/serial_mac.h"
 #include "mdfu/logging.h"
+#ifdef USE_IO_URING
+#include "mdfu/mac/uring_io.h"
+#endif
 
 #define PORT_NAME_MAX_SIZE 256
+/**
+ * @brief Time in milliseconds that read waits for data before returning.
+ */
+#define READ_WAIT_TIME_MS 1000
 
-static bool opened = false;
-static char port[PORT_NAME_MAX_SIZE + 1];
-static int serial_port = 0;
-static int baudrate = 0;
+/**
+ * @brief USB serial latency timer in milliseconds that is set while the port is open.
+ */
+#define SERIAL_LATENCY_TIMER_MS 1
+
+#ifdef USE_IO_URING
+/**
+ * @brief Size of the receive buffer that io_uring reads responses into.
+ */
+#define RX_BUFFER_SIZE 2048
+#endif
+
+/**
+ * @brief Serial MAC instance state.
+ *
+ * The latency settings that were changed when the port was opened are
+ * restored when it is closed.
+ *
+ * With io_uring each frame write is submitted together with the read of the
+ * response into rx_buffer, rx_head is the offset of the next unconsumed byte
+ * and rx_count the number of valid bytes.
+ */
+struct serial_mac_ctx {
+    bool opened;
+    char port[PORT_NAME_MAX_SIZE + 1];
+    int serial_port;
+    int baudrate;
+    serial_flow_control_t flow_control;
+    bool restore_low_latency;
+    int saved_latency_timer;
+#ifdef USE_IO_URING
+    uring_io_t uring;
+    int rx_head;
+    int rx_count;
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+#endif
+};
 
 int get_baudrate(int baud)
 {
@@ -64,10 +106,11 @@ int get_baudrate(int baud)
     }
 }
 
-static int mac_init(void *conf)
+static int mac_init(mac_t *mac, void *conf)
 {
+    struct serial_mac_ctx *ctx = mac->ctx;
     struct serial_config *config = (struct serial_config *) conf;
-    if(opened){
+    if(ctx->opened){
         ERROR("Cannot initialize while MAC is opened.");
         errno = EBUSY;
         return -1;
@@ -79,36 +122,107 @@ static int mac_init(void *conf)
         errno = EINVAL;
         return -1;
     }
-    strcpy(port, config->port);
-    baudrate = config->baudrate;
+    strcpy(ctx->port, config->port);
+    ctx->baudrate = config->baudrate;
+    ctx->flow_control = config->flow_control;
+#ifndef CRTSCTS
+    if(SERIAL_FLOW_CONTROL_RTSCTS == ctx->flow_control){
+        ERROR("RTS/CTS flow control is not supported on this platform");
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+    if(config->rx_queue_size > 0){
+        DEBUG("Serial MAC: The receive queue size of the tty layer is fixed, ignoring %d", config->rx_queue_size);
+    }
     return 0;
 }
 
-static int mac_open(void)
+#ifdef __linux__
+/**
+ * @brief Lower the receive latency of the serial port where permitted.
+ *
+ * Failures are not errors since ports that are not USB serial bridges do not
+ * have these settings and changing the latency timer needs write access to
+ * sysfs.
+ *
+ * @param ctx MAC instance state with the open port.
+ */
+static void reduce_latency(struct serial_mac_ctx *ctx)
+{
+    bool low_latency;
+    int latency_timer;
+
+    ctx->restore_low_latency = false;
+    ctx->saved_latency_timer = -1;
+    if(serial_mac_set_low_latency(ctx->serial_port, true, &low_latency) < 0){
+        DEBUG("Serial MAC: Low latency mode not available: %s", strerror(errno));
+    }else{
+        ctx->restore_low_latency = !low_latency;
+    }
+    if(serial_mac_set_latency_timer(ctx->port, SERIAL_LATENCY_TIMER_MS, &latency_timer) < 0){
+        if(ENOENT == errno){
+            DEBUG("Serial MAC: %s has no latency timer", ctx->port);
+        }else{
+            INFO("Serial MAC: Could not lower the latency timer of %s: %s", ctx->port, strerror(errno));
+        }
+    }else if(latency_timer != SERIAL_LATENCY_TIMER_MS){
+        DEBUG("Serial MAC: Lowered the latency timer from %d ms to %d ms", latency_timer, SERIAL_LATENCY_TIMER_MS);
+        ctx->saved_latency_timer = latency_timer;
+    }
+}
+
+/**
+ * @brief Restore the latency settings changed by reduce_latency.
+ *
+ * @param ctx MAC instance state with the open port.
+ */
+static void restore_latency(struct serial_mac_ctx *ctx)
 {
+    if(ctx->restore_low_latency){
+        serial_mac_set_low_latency(ctx->serial_port, false, NULL);
+    }
+    if(ctx->saved_latency_timer >= 0){
+        serial_mac_set_latency_timer(ctx->port, ctx->saved_latency_timer, NULL);
+    }
+}
+#endif
+
+static int mac_open(mac_t *mac)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
     struct termios tty;
     DEBUG("Opening serial MAC");
-    if(opened){
+    if(ctx->opened){
         errno = EBUSY;
         return -1;
     }
 
-    serial_port = open(port, O_RDWR);
+    ctx->serial_port = open(ctx->port, O_RDWR);
 
-    if(serial_port < 0){
-        ERROR("open: %s %s", strerror(errno), port);
+    if(ctx->serial_port < 0){
+        ERROR("open: %s %s", strerror(errno), ctx->port);
         return -1;
     }
 
-    if(tcgetattr(serial_port, &tty) != 0){
+    if(tcgetattr(ctx->serial_port, &tty) != 0){
         ERROR("tcgetattr: %s", strerror(errno));
+        close(ctx->serial_port);
         return -1;
     }
     tty.c_cflag &= ~PARENB; // clear parity bit
     tty.c_cflag &= ~CSTOPB; // one stop bit
     tty.c_cflag &= ~CSIZE; // clear, then set 8 bits per byte
     tty.c_cflag |= CS8;
-    //tty.c_cflag &= ~CRTSCTS; // hardware flow control - seems not support on my Linux distro
+#ifdef CRTSCTS
+    // With hardware flow control the driver deasserts RTS when its receive
+    // buffer fills up and only sends while CTS is asserted
+    if(SERIAL_FLOW_CONTROL_RTSCTS == ctx->flow_control){
+        tty.c_cflag |= CRTSCTS;
+    }else{
+        tty.c_cflag &= ~CRTSCTS;
+    }
+#endif
     tty.c_cflag |= CREAD | CLOCAL; // enable read and ignore ctrl lines
     
     tty.c_lflag &= ~ECHO; // Disable echo
@@ -123,34 +237,65 @@ static int mac_open(void)
     tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
     tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
 
-    tty.c_cc[VTIME] = 10;    // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
+    // Reads return immediately with the available data, waiting for data is done with poll()
+    tty.c_cc[VTIME] = 0;
     tty.c_cc[VMIN] = 0;
 
-    int speed = get_baudrate(baudrate);
-    if( speed < 0){
+    int speed = get_baudrate(ctx->baudrate);
+    bool custom_speed = speed < 0;
+    if(custom_speed){
+#ifdef __linux__
+        // Placeholder, the actual rate is set with termios2 below
+        speed = B38400;
+#else
         ERROR("Non standard baudrate not supported");
+        close(ctx->serial_port);
         errno = EINVAL;
         return -1;
+#endif
     };
 
     cfsetispeed(&tty, speed);
     cfsetospeed(&tty, speed);
 
     // Save tty settings, also checking for error
-    if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {
+    if (tcsetattr(ctx->serial_port, TCSANOW, &tty) != 0) {
         ERROR("tcsetattr: %s", strerror(errno));
+        close(ctx->serial_port);
         return -1;
     }
-    opened = true;
+#ifdef __linux__
+    if(custom_speed && serial_mac_set_custom_baudrate(ctx->serial_port, ctx->baudrate) < 0){
+        ERROR("Setting baudrate %d failed: %s", ctx->baudrate, strerror(errno));
+        close(ctx->serial_port);
+        return -1;
+    }
+    reduce_latency(ctx);
+#endif
+#ifdef USE_IO_URING
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+    if(uring_io_open(&ctx->uring, ctx->serial_port, ctx->rx_buffer, RX_BUFFER_SIZE) == 0){
+        DEBUG("Serial MAC uses io_uring");
+    }
+#endif
+    ctx->opened = true;
     return 0;
 }
 
-static int mac_close(void)
+static int mac_close(mac_t *mac)
 {
+    struct serial_mac_ctx *ctx = mac->ctx;
     DEBUG("Closing serial MAC");
-    if(opened){
-        close(serial_port);
-        opened = false;
+    if(ctx->opened){
+#ifdef USE_IO_URING
+        uring_io_close(&ctx->uring);
+#endif
+#ifdef __linux__
+        restore_latency(ctx);
+#endif
+        close(ctx->serial_port);
+        ctx->opened = false;
         return 0;
     } else {
         errno = EBADF;
@@ -158,10 +303,105 @@ static int mac_close(void)
     }
 }
 
-static int mac_read(int size, uint8_t *data)
+/**
+ * @brief Wait until the serial port has data to read.
+ *
+ * @param fd Serial port file descriptor.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return int 1 if data is available, 0 if the wait timed out and -1 on error.
+ */
+static int wait_readable(int fd, int timeout_ms)
 {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
     int status;
-    status = read(serial_port, data, size);
+
+    do {
+        status = poll(&pfd, 1, timeout_ms);
+    } while(status < 0 && errno == EINTR);
+
+    if(status < 0){
+        ERROR("Serial MAC poll: %s", strerror(errno));
+        return -1;
+    }
+    if(status > 0 && (pfd.revents & (POLLERR | POLLNVAL))){
+        ERROR("Serial MAC poll: port error");
+        errno = EIO;
+        return -1;
+    }
+    return status;
+}
+
+#ifdef USE_IO_URING
+/**
+ * @brief Read from the receive buffer that io_uring fills.
+ *
+ * The response read that was submitted with the last frame is taken, or a
+ * new read is submitted, whenever the buffer is empty.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int read_deadline_uring(struct serial_mac_ctx *ctx, int size, uint8_t *data, int min_size, timeout_t *deadline)
+{
+    int received = 0;
+    int count;
+
+    do {
+        if(ctx->rx_head == ctx->rx_count){
+            if(!uring_io_busy(&ctx->uring)){
+                ctx->rx_head = 0;
+                ctx->rx_count = 0;
+            }
+            count = uring_io_read(&ctx->uring, (size_t) ctx->rx_count, deadline);
+            if(count < 0){
+                if(errno == ETIMEDOUT){
+                    break;
+                }
+                ERROR("Serial MAC read: %s", strerror(errno));
+                return -1;
+            }
+            if(count == 0){
+                // Port hung up, there will be no more data
+                break;
+            }
+            ctx->rx_count += count;
+        }
+        count = ctx->rx_count - ctx->rx_head;
+        if(count > size - received){
+            count = size - received;
+        }
+        memcpy(&data[received], &ctx->rx_buffer[ctx->rx_head], (size_t) count);
+        ctx->rx_head += count;
+        received += count;
+    } while(received < min_size);
+    return received;
+}
+#endif
+
+static int mac_read(mac_t *mac, int size, uint8_t *data)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
+    int status;
+
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        timeout_t deadline;
+
+        set_timeout(&deadline, READ_WAIT_TIME_MS / 1000.0f);
+        return read_deadline_uring(ctx, size, data, 1, &deadline);
+    }
+#endif
+
+    status = wait_readable(ctx->serial_port, READ_WAIT_TIME_MS);
+    if(status <= 0){
+        return status;
+    }
+    status = read(ctx->serial_port, data, size);
     if(status < 0){
         ERROR("Serial MAC read: %s", strerror(errno));
         return -1;
@@ -169,25 +409,192 @@ static int mac_read(int size, uint8_t *data)
     return status;
 }
 
-static int mac_write(int size, uint8_t *data)
+/**
+ * @brief Read from the serial port until enough data is received or a deadline expires.
+ *
+ * The thread sleeps in poll() until data arrives or the deadline expires, so no CPU time
+ * is spent while waiting. All available data up to size bytes is returned.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
+    int received = 0;
+    int status;
+
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        return read_deadline_uring(ctx, size, data, min_size, deadline);
+    }
+#endif
+    do {
+        status = timeout_remaining_ms(deadline);
+        if(status < 0){
+            return -1;
+        }
+        status = wait_readable(ctx->serial_port, status);
+        if(status < 0){
+            return -1;
+        }
+        if(status == 0){
+            break;
+        }
+        status = read(ctx->serial_port, &data[received], size - received);
+        if(status < 0){
+            if(errno == EINTR || errno == EAGAIN){
+                continue;
+            }
+            ERROR("Serial MAC read: %s", strerror(errno));
+            return -1;
+        }
+        if(status == 0){
+            // Port hung up, there will be no more data
+            break;
+        }
+        received += status;
+    } while(received < min_size);
+    return received;
+}
+
+/**
+ * @brief Writes multiple buffers to the serial port with writev.
+ *
+ * Partial writes are continued until all data is sent. With io_uring the
+ * read of the response is submitted together with the buffers.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers to send.
+ * @return int Number of bytes sent, or -1 on error.
+ */
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov)
 {
+    struct serial_mac_ctx *ctx = mac->ctx;
+    struct iovec vector[MAC_IOVEC_MAX];
+    struct iovec *remaining = vector;
     ssize_t status;
-    status = write(serial_port, data, size);
+    int size;
+
+    size = mac_iovec_to_iovec(count, iov, vector);
+    if(size < 0){
+        return -1;
+    }
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        if(ctx->rx_head > 0 && !uring_io_busy(&ctx->uring)){
+            memmove(ctx->rx_buffer, &ctx->rx_buffer[ctx->rx_head], (size_t) (ctx->rx_count - ctx->rx_head));
+            ctx->rx_count -= ctx->rx_head;
+            ctx->rx_head = 0;
+        }
+        if(uring_io_writev(&ctx->uring, vector, count, (size_t) ctx->rx_count) < 0){
+            ERROR("Serial MAC write: %s", strerror(errno));
+            return -1;
+        }
+        return size;
+    }
+#endif
+    while(count > 0){
+        status = writev(ctx->serial_port, remaining, count);
+        if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            ERROR("Serial MAC write: %s", strerror(errno));
+            return -1;
+        }
+        count = mac_iovec_consume(count, &remaining, (size_t) status);
+    }
+    return size;
+}
+
+/**
+ * @brief Write a buffer, with io_uring together with the read of the response.
+ *
+ * @param mac MAC instance.
+ * @param size Number of bytes to write.
+ * @param data Data to write.
+ * @return int Number of bytes written, or -1 on error.
+ */
+static int mac_write(mac_t *mac, int size, uint8_t *data)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
+    ssize_t status;
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        mac_iovec_t iov = {.data = data, .size = size};
+
+        return mac_writev(mac, 1, &iov);
+    }
+#endif
+    status = write(ctx->serial_port, data, size);
     if(status < 0){
         ERROR("Serial MAC write: %s", strerror(errno));
     }
     return status;
 }
 
-mac_t serial_mac = {
+/**
+ * @brief Get the file descriptor of the serial port.
+ *
+ * With io_uring this is the ring, which becomes readable when the response
+ * was received into the receive buffer.
+ *
+ * @param mac MAC instance.
+ * @return int File descriptor, or -1 if the MAC is not open.
+ */
+static int mac_get_fd(mac_t *mac)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
+
+    if(!ctx->opened){
+        return -1;
+    }
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        return ctx->uring.ring;
+    }
+#endif
+    return ctx->serial_port;
+}
+
+/**
+ * @brief Check if received data is waiting in the receive buffer.
+ *
+ * @param mac MAC instance.
+ * @return bool True if a read returns data without waiting for the serial port.
+ */
+static bool mac_has_data(mac_t *mac)
+{
+    struct serial_mac_ctx *ctx = mac->ctx;
+
+    return ctx->rx_head < ctx->rx_count;
+}
+
+const mac_t serial_mac = {
     .open = mac_open,
     .close = mac_close,
     .init = mac_init,
     .write = mac_write,
-    .read = mac_read
+    .read = mac_read,
+    .read_deadline = mac_read_deadline,
+    .writev = mac_writev,
+    .get_fd = mac_get_fd,
+    .has_data = mac_has_data
 };
 
-
-void get_serial_mac(mac_t **mac){
-    *mac = &serial_mac;
+/**
+ * @brief Create a new serial MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_serial_mac(mac_t **mac){
+    return mac_alloc(&serial_mac, sizeof(struct serial_mac_ctx), mac);
 }
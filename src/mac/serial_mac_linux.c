@@ -0,0 +1,142 @@
+/**
+ * @file serial_mac_linux.c
+ * @brief Linux specific serial port settings.
+ *
+ * Arbitrary baud rates are set with the termios2 interface, which is kept in
+ * its own file because the kernel definitions of struct termios conflict with
+ * the ones from <termios.h> that the serial MAC uses for the other port
+ * settings. The latency settings reduce the time that received bytes wait in
+ * the USB serial driver and the tty layer before a read returns them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h> // basename()
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include "mdfu/mac/serial_mac.h"
+
+/**
+ * @brief Set a serial port to a baud rate without a Bxxxx constant.
+ *
+ * USB serial bridges derive the rate from their own clock and accept most
+ * rates up to their maximum, e.g. 6 or 12 Mbaud.
+ *
+ * @param fd Serial port file descriptor.
+ * @param baudrate Baud rate in bits per second.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int serial_mac_set_custom_baudrate(int fd, int baudrate)
+{
+    struct termios2 tty;
+
+    if(ioctl(fd, TCGETS2, &tty) < 0){
+        return -1;
+    }
+    tty.c_cflag &= ~(tcflag_t) CBAUD;
+    tty.c_cflag |= BOTHER;
+    tty.c_ispeed = (speed_t) baudrate;
+    tty.c_ospeed = (speed_t) baudrate;
+    return ioctl(fd, TCSETS2, &tty);
+}
+
+/**
+ * @brief Enable or disable the low latency mode of a serial port.
+ *
+ * In low latency mode the driver passes received bytes to the tty layer
+ * immediately instead of deferring it to a work queue.
+ *
+ * @param fd Serial port file descriptor.
+ * @param enable True to enable low latency mode.
+ * @param[out] previous Set to true if low latency mode was enabled before, can be NULL.
+ * @return int 0 on success, -1 on error with errno set, e.g. ENOTTY for ports
+ *         that do not support it.
+ */
+int serial_mac_set_low_latency(int fd, bool enable, bool *previous)
+{
+    struct serial_struct serial;
+
+    if(ioctl(fd, TIOCGSERIAL, &serial) < 0){
+        return -1;
+    }
+    if(previous){
+        *previous = 0 != (serial.flags & ASYNC_LOW_LATENCY);
+    }
+    if(enable){
+        serial.flags |= ASYNC_LOW_LATENCY;
+    }else{
+        serial.flags &= ~ASYNC_LOW_LATENCY;
+    }
+    return ioctl(fd, TIOCSSERIAL, &serial);
+}
+
+/**
+ * @brief Get the sysfs path of the latency timer of a USB serial port.
+ *
+ * @param port Serial port device path, symbolic links are resolved.
+ * @param path Buffer for the path.
+ * @param size Size of the buffer.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int latency_timer_path(const char *port, char *path, size_t size)
+{
+    char device[PATH_MAX];
+
+    if(NULL == realpath(port, device)){
+        return -1;
+    }
+    if(snprintf(path, size, "/sys/class/tty/%s/device/latency_timer", basename(device)) >= (int) size){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Set the latency timer of a USB serial port.
+ *
+ * FTDI style bridges hold received bytes for up to the latency timer, 16 ms
+ * by default, before sending them to the host unless their buffer fills up.
+ * Writing the sysfs attribute usually needs root or a udev rule.
+ *
+ * @param port Serial port device path.
+ * @param milliseconds New latency timer value.
+ * @param[out] previous Set to the previous latency timer value, can be NULL.
+ * @return int 0 on success, -1 on error with errno set, e.g. ENOENT for ports
+ *         without a latency timer or EACCES without write permission.
+ */
+int serial_mac_set_latency_timer(const char *port, int milliseconds, int *previous)
+{
+    char path[PATH_MAX];
+    char value[16];
+    ssize_t size;
+    int fd;
+
+    if(latency_timer_path(port, path, sizeof(path)) < 0){
+        return -1;
+    }
+    fd = open(path, O_RDWR);
+    if(fd < 0){
+        return -1;
+    }
+    size = read(fd, value, sizeof(value) - 1);
+    if(size < 0){
+        close(fd);
+        return -1;
+    }
+    value[size] = '\0';
+    if(previous){
+        *previous = atoi(value);
+    }
+    size = snprintf(value, sizeof(value), "%d", milliseconds);
+    if(lseek(fd, 0, SEEK_SET) < 0 || write(fd, value, (size_t) size) != size){
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
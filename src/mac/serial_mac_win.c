@@ -1,3 +1,14 @@
+/**
+ * @file serial_mac_win.c
+ * @brief Windows serial MAC with overlapped I/O.
+ *
+ * The port is opened for overlapped I/O so that reads wait on an event with
+ * the remaining time of the caller's deadline instead of fixed COMMTIMEOUTS.
+ * Received data is read in bulk into a read-ahead buffer and handed out from
+ * there, so the byte by byte reads of the transports do not each cost a
+ * ReadFile call. A read that is still waiting when the deadline expires is
+ * kept pending and completed by the next read, so no data is lost.
+ */
 #include <Windows.h>
 #include <errhandlingapi.h>
 #include <winbase.h>
@@ -15,16 +26,86 @@
 
 #define PORT_NAME_MAX_SIZE 256
 
-static bool opened = false;
-static char port[PORT_NAME_MAX_SIZE + 1];
-static int baudrate = 0;
-static HANDLE hSerial = NULL;
-static COMMTIMEOUTS timeouts = {0};
-static DCB params = {0};
+/**
+ * @brief Time in milliseconds that read waits for data before returning.
+ */
+#define READ_WAIT_TIME_MS 1000
 
-static int mac_init(void *conf) {
+/**
+ * @brief Size of the driver receive queue requested with SetupComm.
+ *
+ * The driver default is often 4 KiB, which overflows at high baud rates when
+ * the host is busy. The driver may use a smaller size. Can be overridden at
+ * build time.
+ */
+#ifndef SERIAL_RX_QUEUE_SIZE
+#define SERIAL_RX_QUEUE_SIZE 65536
+#endif
+
+/**
+ * @brief Size of the driver transmit queue requested with SetupComm.
+ */
+#ifndef SERIAL_TX_QUEUE_SIZE
+#define SERIAL_TX_QUEUE_SIZE 65536
+#endif
+
+/**
+ * @brief Size of the read-ahead buffer, the most that one ReadFile call returns.
+ */
+#define READ_AHEAD_SIZE 4096
+
+/**
+ * @brief Size of the buffer that writev assembles its buffers in.
+ */
+#define WRITEV_BUFFER_SIZE 4096
+
+/**
+ * @brief Serial MAC instance state.
+ *
+ * Bytes from rx_start up to rx_end of the read-ahead buffer are received but
+ * not read by the transport yet. While read_pending is set a ReadFile into
+ * the read-ahead buffer is in progress and the buffer is empty.
+ */
+struct serial_mac_ctx {
+  bool opened;
+  char port[PORT_NAME_MAX_SIZE + 1];
+  int baudrate;
+  serial_flow_control_t flow_control;
+  DWORD rx_queue_size;
+  HANDLE hSerial;
+  COMMTIMEOUTS timeouts;
+  DCB params;
+  OVERLAPPED read_overlapped;
+  OVERLAPPED write_overlapped;
+  bool read_pending;
+  uint8_t rx_buffer[READ_AHEAD_SIZE];
+  DWORD rx_start;
+  DWORD rx_end;
+  uint8_t tx_buffer[WRITEV_BUFFER_SIZE];
+};
+
+/**
+ * @brief Log the last Win32 error.
+ *
+ * @param what Operation that failed.
+ */
+static void log_last_error(const char *what) {
+  LPSTR messageBuffer = NULL;
+  DWORD errorId = GetLastError();
+  // Ask Win32 to give us the string version of the error code.
+  FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
+                    FORMAT_MESSAGE_IGNORE_INSERTS,
+                NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                (LPSTR)&messageBuffer, 0, NULL);
+  ERROR("Serial MAC %s: 0x%08X %s", what, (uint32_t)errorId,
+        messageBuffer ? messageBuffer : "");
+  LocalFree(messageBuffer);
+}
+
+static int mac_init(mac_t *mac, void *conf) {
+  struct serial_mac_ctx *ctx = mac->ctx;
   struct serial_config *config = (struct serial_config *)conf;
-  if (opened) {
+  if (ctx->opened) {
     ERROR("Cannot initialize while MAC is opened.");
     errno = EBUSY;
     return -1;
@@ -37,115 +118,149 @@ static int mac_init(void *conf) {
     errno = EINVAL;
     return -1;
   }
-  sprintf(port, "\\\\.\\%s", config->port);
-  baudrate = config->baudrate;
+  sprintf(ctx->port, "\\\\.\\%s", config->port);
+  ctx->baudrate = config->baudrate;
+  ctx->flow_control = config->flow_control;
+  ctx->rx_queue_size =
+      config->rx_queue_size > 0 ? (DWORD)config->rx_queue_size : SERIAL_RX_QUEUE_SIZE;
   return 0;
 }
 
-static int mac_open(void) {
+/**
+ * @brief Release the port handle and the events of an open or partly opened port.
+ *
+ * @param ctx Serial MAC instance state.
+ */
+static void release_port(struct serial_mac_ctx *ctx) {
+  if (ctx->read_pending) {
+    CancelIo(ctx->hSerial);
+    DWORD received;
+    GetOverlappedResult(ctx->hSerial, &ctx->read_overlapped, &received, TRUE);
+    ctx->read_pending = false;
+  }
+  CloseHandle(ctx->hSerial);
+  if (NULL != ctx->read_overlapped.hEvent) {
+    CloseHandle(ctx->read_overlapped.hEvent);
+  }
+  if (NULL != ctx->write_overlapped.hEvent) {
+    CloseHandle(ctx->write_overlapped.hEvent);
+  }
+  ctx->read_overlapped.hEvent = NULL;
+  ctx->write_overlapped.hEvent = NULL;
+}
+
+static int mac_open(mac_t *mac) {
+  struct serial_mac_ctx *ctx = mac->ctx;
   DEBUG("Opening serial MAC");
-  if (opened) {
+  if (ctx->opened) {
     errno = EBUSY;
     return -1;
   }
 
-  hSerial = CreateFile(port,                         // port name
-                       GENERIC_READ | GENERIC_WRITE, // Read/Write
-                       0,                            // No Sharing
-                       NULL,                         // No Security
-                       OPEN_EXISTING,                // Open existing port only
-                       0,                            // Non Overlapped I/O
-                       NULL);                        // Null for Comm Devices
-
-  if (hSerial == INVALID_HANDLE_VALUE) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    // Ask Win32 to give us the string version of the error code.
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC CreateFile: 0x%08X %s %s", (uint32_t)errorId,
-          messageBuffer, port);
+  ctx->hSerial = CreateFile(ctx->port,                   // port name
+                            GENERIC_READ | GENERIC_WRITE, // Read/Write
+                            0,                            // No Sharing
+                            NULL,                         // No Security
+                            OPEN_EXISTING,        // Open existing port only
+                            FILE_FLAG_OVERLAPPED, // Overlapped I/O
+                            NULL);                // Null for Comm Devices
+
+  if (ctx->hSerial == INVALID_HANDLE_VALUE) {
+    log_last_error("CreateFile");
+    ERROR("Serial MAC could not open %s", ctx->port);
+    errno = ENODEV;
     return -1;
   }
+  memset(&ctx->read_overlapped, 0, sizeof(ctx->read_overlapped));
+  memset(&ctx->write_overlapped, 0, sizeof(ctx->write_overlapped));
+  ctx->read_pending = false;
+  ctx->rx_start = 0;
+  ctx->rx_end = 0;
+  // Manual reset events, as GetOverlappedResult expects
+  ctx->read_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  ctx->write_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (NULL == ctx->read_overlapped.hEvent ||
+      NULL == ctx->write_overlapped.hEvent) {
+    log_last_error("CreateEvent");
+    release_port(ctx);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (!SetupComm(ctx->hSerial, ctx->rx_queue_size, SERIAL_TX_QUEUE_SIZE)) {
+    // Not fatal, the driver keeps its default queue sizes
+    DEBUG("Serial MAC SetupComm failed, using the driver queue sizes");
+  }
+
+  // A read returns as soon as any data is received, like VMIN=0 on POSIX,
+  // and waits up to READ_WAIT_TIME_MS for the first byte otherwise. Callers
+  // with a deadline stop waiting for the read earlier and leave it pending.
+  // Writes may take the transmission time of the data plus 100 ms.
+  ctx->timeouts.ReadIntervalTimeout = MAXDWORD;
+  ctx->timeouts.ReadTotalTimeoutConstant = READ_WAIT_TIME_MS;
+  ctx->timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+  ctx->timeouts.WriteTotalTimeoutConstant = 100;
+  ctx->timeouts.WriteTotalTimeoutMultiplier =
+      ctx->baudrate > 0 ? 1 + 10000 / ctx->baudrate : 1;
 
-  // Configure read and write operations to time out after 100 ms.
-  timeouts.ReadIntervalTimeout = 0;
-  timeouts.ReadTotalTimeoutConstant = 100;
-  timeouts.ReadTotalTimeoutMultiplier = 0;
-  timeouts.WriteTotalTimeoutConstant = 100;
-  timeouts.WriteTotalTimeoutMultiplier = 0;
-
-  if (!SetCommTimeouts(hSerial, &timeouts)) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC SetCommTimeouts: 0x%08X %s", (uint32_t)errorId,
-          messageBuffer);
-    CloseHandle(hSerial);
+  if (!SetCommTimeouts(ctx->hSerial, &ctx->timeouts)) {
+    log_last_error("SetCommTimeouts");
+    release_port(ctx);
+    errno = EIO;
     return -1;
   }
 
   // Set the baud rate and other options.
-  params.DCBlength = sizeof(params);
-  if (!GetCommState(hSerial, &params)) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC GetCommState: 0x%08X %s", (uint32_t)errorId,
-          messageBuffer);
-    CloseHandle(hSerial);
+  ctx->params.DCBlength = sizeof(ctx->params);
+  if (!GetCommState(ctx->hSerial, &ctx->params)) {
+    log_last_error("GetCommState");
+    release_port(ctx);
+    errno = EIO;
     return -1;
   }
-  params.BaudRate = baudrate;               // Set Baud Rate
-  params.ByteSize = 8;                      // Data Size = 8 bits
-  params.StopBits = ONESTOPBIT;             // One Stop Bit
-  params.Parity = NOPARITY;                 // No Parity
-  params.fDtrControl = DTR_CONTROL_DISABLE; // Disable DTR
-  params.fRtsControl = RTS_CONTROL_DISABLE; // Disable RTS
-  params.fOutxCtsFlow = FALSE;              // Disable CTS output flow control
-  params.fOutxDsrFlow = FALSE;              // Disable DSR output flow control
-  params.fDsrSensitivity = FALSE;           // Disable DSR sensitivity
-  params.fOutX = FALSE;         // Disable XON/XOFF output flow control
-  params.fInX = FALSE;          // Disable XON/XOFF input flow control
-  params.fErrorChar = FALSE;    // Disable error replacement
-  params.fNull = FALSE;         // Disable null stripping
-  params.fBinary = TRUE;        // Enable binary mode
-  params.fAbortOnError = FALSE; // Do not abort on error
-  params.fTXContinueOnXoff =
+  ctx->params.BaudRate = ctx->baudrate;          // Set Baud Rate
+  ctx->params.ByteSize = 8;                      // Data Size = 8 bits
+  ctx->params.StopBits = ONESTOPBIT;             // One Stop Bit
+  ctx->params.Parity = NOPARITY;                 // No Parity
+  ctx->params.fDtrControl = DTR_CONTROL_DISABLE; // Disable DTR
+  if (SERIAL_FLOW_CONTROL_RTSCTS == ctx->flow_control) {
+    // The driver deasserts RTS when its receive queue fills up
+    ctx->params.fRtsControl = RTS_CONTROL_HANDSHAKE;
+    ctx->params.fOutxCtsFlow = TRUE; // Only send while CTS is asserted
+  } else {
+    ctx->params.fRtsControl = RTS_CONTROL_DISABLE; // Disable RTS
+    ctx->params.fOutxCtsFlow = FALSE; // Disable CTS output flow control
+  }
+  ctx->params.fOutxDsrFlow = FALSE;              // Disable DSR output flow control
+  ctx->params.fDsrSensitivity = FALSE;           // Disable DSR sensitivity
+  ctx->params.fOutX = FALSE;         // Disable XON/XOFF output flow control
+  ctx->params.fInX = FALSE;          // Disable XON/XOFF input flow control
+  ctx->params.fErrorChar = FALSE;    // Disable error replacement
+  ctx->params.fNull = FALSE;         // Disable null stripping
+  ctx->params.fBinary = TRUE;        // Enable binary mode
+  ctx->params.fAbortOnError = FALSE; // Do not abort on error
+  ctx->params.fTXContinueOnXoff =
       TRUE; // Continue transmitting when XOFF is received
 
-  if (!SetCommState(hSerial, &params)) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC SetCommState: 0x%08X %s", (uint32_t)errorId,
-          messageBuffer);
-    CloseHandle(hSerial);
-    FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, GetLastError(), 0, port, PORT_NAME_MAX_SIZE, NULL);
+  if (!SetCommState(ctx->hSerial, &ctx->params)) {
+    log_last_error("SetCommState");
+    release_port(ctx);
+    errno = EINVAL;
     return -1;
   }
+  // Discard what the port received before it was opened
+  PurgeComm(ctx->hSerial, PURGE_RXCLEAR | PURGE_TXCLEAR);
 
-  opened = true;
+  ctx->opened = true;
   return 0;
 }
 
-static int mac_close(void) {
+static int mac_close(mac_t *mac) {
+  struct serial_mac_ctx *ctx = mac->ctx;
   DEBUG("Closing serial MAC");
-  if (opened) {
-    CloseHandle(hSerial);
-    opened = false;
+  if (ctx->opened) {
+    release_port(ctx);
+    ctx->opened = false;
     return 0;
   } else {
     errno = EBADF;
@@ -153,39 +268,218 @@ static int mac_close(void) {
   }
 }
 
-static int mac_read(int size, uint8_t *data) {
-  DWORD received;
-  if (!ReadFile(hSerial, data, size, &received, NULL)) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC read: 0x%08X %s", (uint32_t)errorId, messageBuffer);
+/**
+ * @brief Receive data into the empty read-ahead buffer.
+ *
+ * Starts a read of up to READ_AHEAD_SIZE bytes, or continues the read that
+ * is pending from an earlier call, and waits up to timeout_ms for it.
+ *
+ * @param ctx Serial MAC instance state.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return int Number of bytes received, 0 if the wait timed out and -1 on error.
+ */
+static int fill_read_ahead(struct serial_mac_ctx *ctx, DWORD timeout_ms) {
+  DWORD received = 0;
+
+  ctx->rx_start = 0;
+  ctx->rx_end = 0;
+  if (!ctx->read_pending) {
+    ResetEvent(ctx->read_overlapped.hEvent);
+    if (ReadFile(ctx->hSerial, ctx->rx_buffer, READ_AHEAD_SIZE, &received,
+                 &ctx->read_overlapped)) {
+      ctx->rx_end = received;
+      return (int)received;
+    }
+    if (ERROR_IO_PENDING != GetLastError()) {
+      log_last_error("read");
+      errno = EIO;
+      return -1;
+    }
+    ctx->read_pending = true;
+  }
+  switch (WaitForSingleObject(ctx->read_overlapped.hEvent, timeout_ms)) {
+  case WAIT_OBJECT_0:
+    break;
+  case WAIT_TIMEOUT:
+    return 0;
+  default:
+    log_last_error("read wait");
+    errno = EIO;
+    return -1;
+  }
+  ctx->read_pending = false;
+  if (!GetOverlappedResult(ctx->hSerial, &ctx->read_overlapped, &received,
+                           FALSE)) {
+    log_last_error("read");
+    errno = EIO;
     return -1;
   }
+  ctx->rx_end = received;
   return (int)received;
 }
 
-static int mac_write(int size, uint8_t *data) {
-  DWORD written;
-  if (!WriteFile(hSerial, data, size, &written, NULL)) {
-    LPSTR messageBuffer = NULL;
-    DWORD errorId = GetLastError();
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
-                      FORMAT_MESSAGE_IGNORE_INSERTS,
-                  NULL, errorId, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                  (LPSTR)&messageBuffer, 0, NULL);
-    ERROR("Serial MAC write: 0x%08X %s", (uint32_t)errorId, messageBuffer);
+/**
+ * @brief Take received data from the read-ahead buffer.
+ *
+ * @param ctx Serial MAC instance state.
+ * @param size Maximum number of bytes to take.
+ * @param data Buffer for the data.
+ * @return int Number of bytes taken.
+ */
+static int take_read_ahead(struct serial_mac_ctx *ctx, int size,
+                           uint8_t *data) {
+  DWORD available = ctx->rx_end - ctx->rx_start;
+  DWORD count = (DWORD)size < available ? (DWORD)size : available;
+
+  memcpy(data, &ctx->rx_buffer[ctx->rx_start], count);
+  ctx->rx_start += count;
+  return (int)count;
+}
+
+static int mac_read(mac_t *mac, int size, uint8_t *data) {
+  struct serial_mac_ctx *ctx = mac->ctx;
+  int status;
+
+  if (ctx->rx_start == ctx->rx_end) {
+    status = fill_read_ahead(ctx, READ_WAIT_TIME_MS);
+    if (status <= 0) {
+      return status;
+    }
+  }
+  return take_read_ahead(ctx, size, data);
+}
+
+/**
+ * @brief Read from the serial port until enough data is received or a deadline expires.
+ *
+ * The thread waits on the event of the overlapped read until data arrives or
+ * the deadline expires, so no CPU time is spent while waiting. All available
+ * data up to size bytes is returned.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size,
+                             timeout_t *deadline) {
+  struct serial_mac_ctx *ctx = mac->ctx;
+  int received = take_read_ahead(ctx, size, data);
+  int status;
+
+  while (received < min_size) {
+    status = timeout_remaining_ms(deadline);
+    if (status < 0) {
+      return -1;
+    }
+    status = fill_read_ahead(ctx, (DWORD)status);
+    if (status < 0) {
+      return -1;
+    }
+    if (status == 0) {
+      // A read that completes without data timed out in the driver,
+      // wait again unless the deadline expired
+      if (ctx->read_pending || timeout_expired(deadline)) {
+        break;
+      }
+      continue;
+    }
+    received += take_read_ahead(ctx, size - received, &data[received]);
+  }
+  return received;
+}
+
+/**
+ * @brief Write data and wait until the driver took all of it.
+ *
+ * @param ctx Serial MAC instance state.
+ * @param size Number of bytes to write.
+ * @param data Data to write.
+ * @return int Number of bytes written, or -1 on error.
+ */
+static int write_all(struct serial_mac_ctx *ctx, DWORD size,
+                     const uint8_t *data) {
+  DWORD written = 0;
+
+  ResetEvent(ctx->write_overlapped.hEvent);
+  if (!WriteFile(ctx->hSerial, data, size, &written, &ctx->write_overlapped)) {
+    if (ERROR_IO_PENDING != GetLastError() ||
+        !GetOverlappedResult(ctx->hSerial, &ctx->write_overlapped, &written,
+                             TRUE)) {
+      log_last_error("write");
+      errno = EIO;
+      return -1;
+    }
+  }
+  if (written < size) {
+    ERROR("Serial MAC write: timeout after %lu of %lu bytes",
+          (unsigned long)written, (unsigned long)size);
   }
   return (int)written;
 }
 
-mac_t serial_mac = {.open = mac_open,
-                    .close = mac_close,
-                    .init = mac_init,
-                    .write = mac_write,
-                    .read = mac_read};
+static int mac_write(mac_t *mac, int size, uint8_t *data) {
+  struct serial_mac_ctx *ctx = mac->ctx;
+
+  return write_all(ctx, (DWORD)size, data);
+}
+
+/**
+ * @brief Writes multiple buffers to the serial port.
+ *
+ * Windows has no gather write for serial ports, so buffers that fit into the
+ * write buffer are assembled there and sent with one WriteFile call.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers to send.
+ * @return int Number of bytes sent, or -1 on error.
+ */
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov) {
+  struct serial_mac_ctx *ctx = mac->ctx;
+  int size = mac_iovec_size(count, iov);
+  int offset = 0;
+
+  if (size < 0) {
+    return -1;
+  }
+  if (size <= WRITEV_BUFFER_SIZE) {
+    for (int i = 0; i < count; i++) {
+      memcpy(&ctx->tx_buffer[offset], iov[i].data, iov[i].size);
+      offset += iov[i].size;
+    }
+    if (write_all(ctx, (DWORD)size, ctx->tx_buffer) != size) {
+      errno = EIO;
+      return -1;
+    }
+    return size;
+  }
+  for (int i = 0; i < count; i++) {
+    if (write_all(ctx, (DWORD)iov[i].size, iov[i].data) != iov[i].size) {
+      errno = EIO;
+      return -1;
+    }
+  }
+  return size;
+}
+
+const mac_t serial_mac = {.open = mac_open,
+                                 .close = mac_close,
+                                 .init = mac_init,
+                                 .write = mac_write,
+                                 .read = mac_read,
+                                 .read_deadline = mac_read_deadline,
+                                 .writev = mac_writev};
 
-void get_serial_mac(mac_t **mac) { *mac = &serial_mac; }
+/**
+ * @brief Create a new serial MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_serial_mac(mac_t **mac) {
+  return mac_alloc(&serial_mac, sizeof(struct serial_mac_ctx), mac);
+}
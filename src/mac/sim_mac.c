@@ -0,0 +1,1001 @@
+/**
+ * @file sim_mac.c
+ * @brief Simulated MDFU client MAC.
+ *
+ * The MAC implements a MDFU client in the same process as the host, so that
+ * the host protocol and transport layers can be exercised and measured
+ * without hardware. The client decodes the serial, SPI or I2C transport frames
+ * that the host sends, runs the MDFU client command handling and returns the
+ * response frames in the same way as a client on the respective bus would.
+ *
+ * The time that frames take on the line and the client command processing
+ * time are emulated with the configured line rate and command delay. Errors
+ * can be injected by dropping commands, corrupting response frames and
+ * requesting command resends.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "mdfu/mac/sim_mac.h"
+#include "mdfu/mdfu.h"
+#include "mdfu/checksum.h"
+#include "mdfu/timeout.h"
+#include "mdfu/logging.h"
+
+/**
+ * @brief Serial transport frame codes.
+ */
+#define FRAME_START_CODE 0x56
+#define FRAME_END_CODE 0x9E
+#define ESCAPE_SEQ_CODE 0xCC
+
+/**
+ * @brief SPI transport frame types.
+ */
+#define SPI_FRAME_TYPE_CMD 0x11
+#define SPI_FRAME_TYPE_RSP_RETRIEVAL 0x55
+/**
+ * @brief Size of the SPI transport response frame prefix, including the
+ * byte that is received while the frame type is sent.
+ */
+#define SPI_RSP_PREFIX_SIZE 4
+
+/**
+ * @brief I2C transport response frame types.
+ */
+#define I2C_FRAME_TYPE_LENGTH 'L'
+#define I2C_FRAME_TYPE_RESPONSE 'R'
+
+/**
+ * @brief Size of the frame check sequence in bytes.
+ */
+#define FRAME_CHECKSUM_SIZE 2
+/**
+ * @brief Size of the response length field in bytes.
+ */
+#define RSP_LENGTH_SIZE 2
+/**
+ * @brief Size of the I2C transport response length frame.
+ */
+#define I2C_LENGTH_FRAME_SIZE (1 + RSP_LENGTH_SIZE + FRAME_CHECKSUM_SIZE)
+
+/**
+ * @brief MDFU packet header bits.
+ */
+#define HEADER_SYNC 0x80
+#define HEADER_RESEND 0x40
+#define HEADER_SEQUENCE_NUMBER 0x1F
+
+/**
+ * @brief Largest client buffer size that the simulated client supports.
+ *
+ * Independent of the host buffer configuration, so that hosts that size their
+ * buffers for the client buffer size can be exercised with large buffers.
+ */
+#define BUFFER_SIZE_MAX 8192
+/**
+ * @brief Largest command or response packet.
+ */
+#define PACKET_MAX_SIZE (MDFU_SEQUENCE_FIELD_SIZE + MDFU_COMMAND_SIZE + BUFFER_SIZE_MAX)
+/**
+ * @brief Largest command frame that the client accepts, without serial escaping.
+ */
+#define COMMAND_FRAME_MAX_SIZE (1 + PACKET_MAX_SIZE + FRAME_CHECKSUM_SIZE)
+/**
+ * @brief Largest response packet including its frame check sequence.
+ */
+#define RESPONSE_MAX_SIZE (PACKET_MAX_SIZE + FRAME_CHECKSUM_SIZE)
+/**
+ * @brief Largest encoded serial response frame.
+ */
+#define RESPONSE_FRAME_MAX_SIZE (2 * RESPONSE_MAX_SIZE + 2)
+/**
+ * @brief Number of responses that the client can queue.
+ *
+ * Only the serial framing supports more than one outstanding command.
+ */
+#define RESPONSE_QUEUE_SIZE 16
+/**
+ * @brief Time in seconds that read waits for data when no deadline is given.
+ */
+#define READ_WAIT_TIME 1.0
+
+/**
+ * @brief Client response that was not retrieved by the host yet.
+ */
+struct sim_response {
+    /** @brief Time when the response is available to the host. */
+    double ready;
+    /** @brief Response packet followed by its frame check sequence. */
+    uint8_t packet[RESPONSE_MAX_SIZE];
+    /** @brief Size of the response packet without frame check sequence. */
+    int packet_size;
+    /** @brief Encoded serial frame. */
+    uint8_t frame[RESPONSE_FRAME_MAX_SIZE];
+    /** @brief Size of the encoded serial frame. */
+    int frame_size;
+    /** @brief Number of serial frame bytes that the host already received. */
+    int frame_offset;
+    /** @brief Response is corrupted when it is sent to the host. */
+    bool corrupt;
+};
+
+/**
+ * @brief Simulated client MAC instance state.
+ */
+struct sim_mac_ctx {
+    struct sim_mac_config config;
+    struct sim_mac_stats stats;
+    /** @brief Error injection random number generator state. */
+    uint32_t random;
+    /** @brief Host to client line is busy until this time. */
+    double tx_line_free;
+    /** @brief Client to host line is busy until this time. */
+    double rx_line_free;
+    /** @brief Client is processing a command until this time. */
+    double client_free;
+    /** @brief Command frame that is being received. */
+    uint8_t command[COMMAND_FRAME_MAX_SIZE];
+    /** @brief Number of bytes in the command frame. */
+    int command_size;
+    /** @brief Serial decoder is inside a frame. */
+    bool in_frame;
+    /** @brief Serial decoder received an escape code. */
+    bool escape;
+    /** @brief Serial decoder discards the rest of the frame. */
+    bool overflow;
+    /** @brief Next expected sequence number. */
+    uint8_t sequence_number;
+    /** @brief Last response for answering a resent command. */
+    uint8_t last_response[RESPONSE_MAX_SIZE];
+    /** @brief Size of the last response, zero if there is none. */
+    int last_response_size;
+    /** @brief READ_CHUNK position in the client image. */
+    size_t image_offset;
+    /** @brief The response length of the first queued response was sent. */
+    bool length_sent;
+    /** @brief Receive data of the last SPI transaction. */
+    uint8_t miso[COMMAND_FRAME_MAX_SIZE + RESPONSE_MAX_SIZE];
+    /** @brief Size of the receive data of the last SPI transaction. */
+    int miso_size;
+    /** @brief Queued client responses. */
+    struct sim_response queue[RESPONSE_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    bool opened;
+};
+
+/**
+ * @brief Get the time of the timeout clock.
+ *
+ * With a virtual timeout clock the waits of the client for the line and the
+ * command processing advance the clock, so a simulation takes the time of
+ * the host processing only.
+ *
+ * @return double Time in seconds.
+ */
+static double clock_now(void){
+    struct timespec now;
+
+    timeout_now(&now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Wait until a point in time.
+ *
+ * @param time Timeout clock time in seconds.
+ */
+static void wait_until(double time){
+    timeout_t timer;
+    double remaining = time - clock_now();
+
+    if(remaining > 0){
+        set_timeout(&timer, (float) remaining);
+        timeout_wait(&timer);
+    }
+}
+
+/**
+ * @brief Get the time when data arrives at the other end of a line.
+ *
+ * @param ctx MAC instance state.
+ * @param line_free Time until the line is busy, updated with the new end of transmission.
+ * @param start Time when the data is ready for transmission.
+ * @param size Number of bytes to send.
+ * @return double Time when the data was transmitted.
+ */
+static double line_transfer(struct sim_mac_ctx *ctx, double *line_free, double start, int size){
+    if(*line_free > start){
+        start = *line_free;
+    }
+    if(0 == ctx->config.line_rate){
+        return start;
+    }
+    *line_free = start + (double) size / ctx->config.line_rate;
+    return *line_free;
+}
+
+/**
+ * @brief Get a random number for the error injection.
+ *
+ * Uses a xorshift random number generator so that a seed results in the
+ * same sequence of errors on every platform.
+ *
+ * @param ctx MAC instance state.
+ * @return double Random number in the range [0, 1].
+ */
+static double random_uniform(struct sim_mac_ctx *ctx){
+    ctx->random ^= ctx->random << 13;
+    ctx->random ^= ctx->random >> 17;
+    ctx->random ^= ctx->random << 5;
+    return (double) ctx->random / UINT32_MAX;
+}
+
+/**
+ * @brief Decide if an error is injected.
+ *
+ * @param ctx MAC instance state.
+ * @param rate Probability of the error.
+ * @return true if the error is injected, false otherwise.
+ */
+static bool inject_error(struct sim_mac_ctx *ctx, float rate){
+    if(rate <= 0){
+        return false;
+    }
+    return random_uniform(ctx) < rate;
+}
+
+/**
+ * @brief Get the first queued response if the host can retrieve it.
+ *
+ * @param ctx MAC instance state.
+ * @return struct sim_response* Response or NULL if the client is busy.
+ */
+static struct sim_response *ready_response(struct sim_mac_ctx *ctx){
+    struct sim_response *response = &ctx->queue[ctx->queue_head];
+
+    if(0 == ctx->queue_count || response->ready > clock_now()){
+        return NULL;
+    }
+    return response;
+}
+
+/**
+ * @brief Remove the first queued response.
+ *
+ * @param ctx MAC instance state.
+ */
+static void dequeue_response(struct sim_mac_ctx *ctx){
+    ctx->queue_head = (ctx->queue_head + 1) % RESPONSE_QUEUE_SIZE;
+    ctx->queue_count--;
+    ctx->length_sent = false;
+}
+
+/**
+ * @brief Encode a serial transport frame.
+ *
+ * @param size Size of the data including the frame check sequence.
+ * @param data Data to encode.
+ * @param frame Buffer for the frame.
+ * @return int Size of the frame.
+ */
+static int encode_serial_frame(int size, const uint8_t *data, uint8_t *frame){
+    int frame_size = 0;
+
+    frame[frame_size++] = FRAME_START_CODE;
+    for(int i = 0; i < size; i++){
+        if(FRAME_START_CODE == data[i] || FRAME_END_CODE == data[i] || ESCAPE_SEQ_CODE == data[i]){
+            frame[frame_size++] = ESCAPE_SEQ_CODE;
+            frame[frame_size++] = (uint8_t) ~data[i];
+        } else {
+            frame[frame_size++] = data[i];
+        }
+    }
+    frame[frame_size++] = FRAME_END_CODE;
+    return frame_size;
+}
+
+/**
+ * @brief Queue a response for the host.
+ *
+ * The response is available after the client finished processing the command
+ * and, for the serial framing, after the response frame was transmitted.
+ *
+ * @param ctx MAC instance state.
+ * @param arrival Time when the command was received.
+ * @param size Size of the response packet.
+ * @param packet Response packet.
+ */
+static void queue_response(struct sim_mac_ctx *ctx, double arrival, int size, const uint8_t *packet){
+    struct sim_response *response;
+    uint16_t frame_check_sequence;
+    double start = arrival > ctx->client_free ? arrival : ctx->client_free;
+
+    if(RESPONSE_QUEUE_SIZE == ctx->queue_count){
+        DEBUG("Simulated client response queue is full, discarding response");
+        ctx->stats.discarded++;
+        return;
+    }
+    response = &ctx->queue[(ctx->queue_head + ctx->queue_count) % RESPONSE_QUEUE_SIZE];
+    ctx->queue_count++;
+    ctx->client_free = start + ctx->config.command_delay;
+    if(ctx->config.command_jitter > 0){
+        ctx->client_free += ctx->config.command_jitter * random_uniform(ctx);
+    }
+
+    memcpy(response->packet, packet, (size_t) size);
+    frame_check_sequence = calculate_crc16(size, response->packet);
+    response->packet[size] = (uint8_t) (frame_check_sequence & 0xff);
+    response->packet[size + 1] = (uint8_t) ((frame_check_sequence >> 8) & 0xff);
+    response->packet_size = size;
+    response->frame_offset = 0;
+    response->ready = ctx->client_free;
+    response->corrupt = inject_error(ctx, ctx->config.corrupt_rate);
+    if(response->corrupt){
+        DEBUG("Simulated client corrupting response");
+        ctx->stats.corrupted++;
+    }
+    if(SIM_FRAMING_SERIAL == ctx->config.framing){
+        response->frame_size = encode_serial_frame(size + FRAME_CHECKSUM_SIZE, response->packet, response->frame);
+        if(response->corrupt){
+            // Flip a bit of the first header byte so that the frame keeps its structure
+            response->frame[1] ^= 0x01;
+        }
+        // Transmission of the response starts when it is ready
+        response->ready = line_transfer(ctx, &ctx->rx_line_free, response->ready, response->frame_size);
+    } else if(response->corrupt){
+        response->packet[0] ^= 0x01;
+    }
+}
+
+/**
+ * @brief Encode the client info parameters.
+ *
+ * @param ctx MAC instance state.
+ * @param data Buffer for the client info.
+ * @return int Size of the client info.
+ */
+static int encode_client_info(struct sim_mac_ctx *ctx, uint8_t *data){
+    int size = 0;
+    // Command timeout with one second margin above the processing time, in 0.1 s units
+    uint16_t timeout = (uint16_t) (10 + (int) (ctx->config.command_delay * 10 + 0.999f));
+    uint32_t itd = ctx->config.inter_transaction_delay;
+
+    data[size++] = 1; // protocol version
+    data[size++] = 3;
+    data[size++] = MDFU_PROTOCOL_VERSION_MAJOR;
+    data[size++] = MDFU_PROTOCOL_VERSION_MINOR;
+    data[size++] = MDFU_PROTOCOL_VERSION_PATCH;
+    data[size++] = 2; // buffer info
+    data[size++] = 3;
+    data[size++] = (uint8_t) (ctx->config.buffer_size & 0xff);
+    data[size++] = (uint8_t) (ctx->config.buffer_size >> 8);
+    data[size++] = ctx->config.buffer_count;
+    data[size++] = 3; // default command timeout
+    data[size++] = 3;
+    data[size++] = 0;
+    data[size++] = (uint8_t) (timeout & 0xff);
+    data[size++] = (uint8_t) (timeout >> 8);
+    data[size++] = 4; // inter transaction delay
+    data[size++] = 4;
+    for(int i = 0; i < 4; i++){
+        data[size++] = (uint8_t) (itd >> (8 * i));
+    }
+    return size;
+}
+
+/**
+ * @brief Execute a MDFU command.
+ *
+ * @param ctx MAC instance state.
+ * @param command Command code.
+ * @param size Size of the command data.
+ * @param data Command data.
+ * @param response Buffer for the response packet, the header is already set.
+ * @return int Size of the response packet.
+ */
+static int execute_command(struct sim_mac_ctx *ctx, uint8_t command, int size, const uint8_t *data, uint8_t *response){
+    int response_size = 2;
+    size_t remaining;
+
+    response[1] = SUCCESS;
+    switch(command){
+        case GET_CLIENT_INFO:
+            response_size += encode_client_info(ctx, &response[2]);
+            break;
+        case START_TRANSFER:
+            ctx->image_offset = 0;
+            break;
+        case WRITE_CHUNK:
+            if(size > ctx->config.buffer_size){
+                response[1] = COMMAND_NOT_EXECUTED;
+                response[response_size++] = COMMAND_TOO_LONG;
+                break;
+            }
+            ctx->stats.chunks++;
+            ctx->stats.image_bytes += (unsigned long long) size;
+            (void) data;
+            break;
+        case GET_IMAGE_STATE:
+            response[response_size++] = 1; // valid
+            break;
+        case END_TRANSFER:
+        case CHANGE_MODE:
+            break;
+        case READ_CHUNK:
+            remaining = ctx->config.image_size - ctx->image_offset;
+            if(remaining > ctx->config.buffer_size){
+                remaining = ctx->config.buffer_size;
+            }
+            if(remaining > 0){
+                memcpy(&response[2], &ctx->config.image[ctx->image_offset], remaining);
+            }
+            ctx->image_offset += remaining;
+            response_size += (int) remaining;
+            ctx->stats.chunks++;
+            break;
+        default:
+            response[1] = COMMAND_NOT_SUPPORTED;
+    }
+    return response_size;
+}
+
+/**
+ * @brief Handle a MDFU command packet.
+ *
+ * Implements the client sequence number handling: a sync command sets the
+ * expected sequence number, a resent command is answered with the last
+ * response and a command with an unexpected sequence number is rejected.
+ *
+ * @param ctx MAC instance state.
+ * @param arrival Time when the command was received.
+ * @param size Size of the command packet.
+ * @param packet Command packet.
+ */
+static void handle_command(struct sim_mac_ctx *ctx, double arrival, int size, const uint8_t *packet){
+    uint8_t response[PACKET_MAX_SIZE];
+    uint8_t sequence_number;
+    int response_size = 3;
+
+    ctx->stats.commands++;
+    if(size < 2){
+        ctx->stats.discarded++;
+        return;
+    }
+    if(inject_error(ctx, ctx->config.drop_rate)){
+        DEBUG("Simulated client dropping command");
+        ctx->stats.dropped++;
+        return;
+    }
+    sequence_number = packet[0] & HEADER_SEQUENCE_NUMBER;
+    response[0] = sequence_number;
+    if(inject_error(ctx, ctx->config.resend_rate)){
+        DEBUG("Simulated client requesting resend");
+        ctx->stats.resends++;
+        response[0] |= HEADER_RESEND;
+        response[1] = COMMAND_NOT_EXECUTED;
+        response[2] = TRANSPORT_INTEGRITY_CHECK_ERROR;
+        queue_response(ctx, arrival, response_size, response);
+        return;
+    }
+    if(packet[0] & HEADER_SYNC){
+        ctx->sequence_number = sequence_number;
+    }
+    if(sequence_number == ((ctx->sequence_number - 1) & HEADER_SEQUENCE_NUMBER) && ctx->last_response_size > 0){
+        queue_response(ctx, arrival, ctx->last_response_size, ctx->last_response);
+        return;
+    }
+    if(sequence_number != ctx->sequence_number){
+        response[1] = COMMAND_NOT_EXECUTED;
+        response[2] = SEQUENCE_NUMBER_INVALID;
+        queue_response(ctx, arrival, response_size, response);
+        return;
+    }
+    response_size = execute_command(ctx, packet[1], size - 2, &packet[2], response);
+    ctx->sequence_number = (ctx->sequence_number + 1) & HEADER_SEQUENCE_NUMBER;
+    memcpy(ctx->last_response, response, (size_t) response_size);
+    ctx->last_response_size = response_size;
+    queue_response(ctx, arrival, response_size, response);
+}
+
+/**
+ * @brief Check the frame check sequence of a command and handle it.
+ *
+ * @param ctx MAC instance state.
+ * @param arrival Time when the command was received.
+ * @param size Size of the command packet including the frame check sequence.
+ * @param packet Command packet.
+ */
+static void handle_command_frame(struct sim_mac_ctx *ctx, double arrival, int size, uint8_t *packet){
+    uint16_t frame_check_sequence;
+
+    if(size < 2 + FRAME_CHECKSUM_SIZE){
+        ctx->stats.discarded++;
+        return;
+    }
+    size -= FRAME_CHECKSUM_SIZE;
+    frame_check_sequence = (uint16_t) (packet[size] | (packet[size + 1] << 8));
+    if(frame_check_sequence != calculate_crc16(size, packet)){
+        DEBUG("Simulated client received command with invalid frame check sequence");
+        ctx->stats.discarded++;
+        return;
+    }
+    handle_command(ctx, arrival, size, packet);
+}
+
+/**
+ * @brief Decode serial transport data sent by the host.
+ *
+ * @param ctx MAC instance state.
+ * @param arrival Time when the data was received.
+ * @param size Size of the data.
+ * @param data Data sent by the host.
+ */
+static void decode_serial(struct sim_mac_ctx *ctx, double arrival, int size, const uint8_t *data){
+    for(int i = 0; i < size; i++){
+        uint8_t code = data[i];
+
+        if(FRAME_START_CODE == code){
+            ctx->in_frame = true;
+            ctx->escape = false;
+            ctx->overflow = false;
+            ctx->command_size = 0;
+        } else if(!ctx->in_frame){
+            continue;
+        } else if(FRAME_END_CODE == code){
+            ctx->in_frame = false;
+            if(ctx->overflow || ctx->escape){
+                ctx->stats.discarded++;
+            } else {
+                handle_command_frame(ctx, arrival, ctx->command_size, ctx->command);
+            }
+        } else if(ESCAPE_SEQ_CODE == code){
+            ctx->escape = true;
+        } else if(ctx->command_size == COMMAND_FRAME_MAX_SIZE){
+            ctx->overflow = true;
+        } else {
+            ctx->command[ctx->command_size++] = ctx->escape ? (uint8_t) ~code : code;
+            ctx->escape = false;
+        }
+    }
+}
+
+/**
+ * @brief Copy ready serial response frames to the host.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the host buffer.
+ * @param data Host buffer.
+ * @return int Number of bytes copied.
+ */
+static int copy_serial_responses(struct sim_mac_ctx *ctx, int size, uint8_t *data){
+    struct sim_response *response;
+    int received = 0;
+
+    while(received < size && NULL != (response = ready_response(ctx))){
+        int count = response->frame_size - response->frame_offset;
+
+        if(count > size - received){
+            count = size - received;
+        }
+        memcpy(&data[received], &response->frame[response->frame_offset], (size_t) count);
+        response->frame_offset += count;
+        received += count;
+        if(response->frame_offset == response->frame_size){
+            dequeue_response(ctx);
+        }
+    }
+    return received;
+}
+
+/**
+ * @brief Read serial transport data with a deadline.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the host buffer.
+ * @param data Host buffer.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Deadline in seconds.
+ * @return int Number of bytes read.
+ */
+static int read_serial(struct sim_mac_ctx *ctx, int size, uint8_t *data, int min_size, double deadline){
+    int received = 0;
+
+    while(true){
+        received += copy_serial_responses(ctx, size - received, &data[received]);
+        if(received >= min_size || received == size || clock_now() >= deadline){
+            break;
+        }
+        if(ctx->queue_count > 0 && ctx->queue[ctx->queue_head].ready < deadline){
+            wait_until(ctx->queue[ctx->queue_head].ready);
+        } else {
+            wait_until(deadline);
+        }
+    }
+    ctx->stats.rx_bytes += (unsigned long long) received;
+    return received;
+}
+
+/**
+ * @brief Do one SPI transaction.
+ *
+ * Command frames are handled after the transaction. Response retrieval frames
+ * receive the response length frame followed by the response frame once the
+ * client finished processing the command, and zeros while it is busy.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the transaction.
+ * @param tx_data Data sent by the host.
+ * @param rx_data Buffer for the data received by the host.
+ */
+static void spi_exchange(struct sim_mac_ctx *ctx, int size, const uint8_t *tx_data, uint8_t *rx_data){
+    struct sim_response *response = ready_response(ctx);
+    double arrival;
+    uint8_t length[RSP_LENGTH_SIZE + FRAME_CHECKSUM_SIZE];
+    uint16_t frame_check_sequence;
+    uint8_t frame_type;
+
+    arrival = line_transfer(ctx, &ctx->tx_line_free, clock_now(), size);
+    wait_until(arrival);
+    ctx->stats.tx_bytes += (unsigned long long) size;
+    ctx->stats.rx_bytes += (unsigned long long) size;
+    if(size < 1){
+        return;
+    }
+    // The transmit and receive buffers can be the same
+    frame_type = tx_data[0];
+    if(SPI_FRAME_TYPE_CMD == frame_type && size - 1 <= COMMAND_FRAME_MAX_SIZE){
+        memcpy(ctx->command, &tx_data[1], (size_t) (size - 1));
+    }
+    memset(rx_data, 0, (size_t) size);
+    if(SPI_FRAME_TYPE_CMD == frame_type){
+        if(size - 1 > COMMAND_FRAME_MAX_SIZE){
+            ctx->stats.discarded++;
+            return;
+        }
+        handle_command_frame(ctx, arrival, size - 1, ctx->command);
+        return;
+    }
+    if(SPI_FRAME_TYPE_RSP_RETRIEVAL != frame_type || NULL == response){
+        return;
+    }
+    if(!ctx->length_sent){
+        if(size < SPI_RSP_PREFIX_SIZE + (int) sizeof(length)){
+            return;
+        }
+        length[0] = (uint8_t) ((response->packet_size + FRAME_CHECKSUM_SIZE) & 0xff);
+        length[1] = (uint8_t) ((response->packet_size + FRAME_CHECKSUM_SIZE) >> 8);
+        frame_check_sequence = calculate_crc16(RSP_LENGTH_SIZE, length);
+        length[2] = (uint8_t) (frame_check_sequence & 0xff);
+        length[3] = (uint8_t) (frame_check_sequence >> 8);
+        memcpy(&rx_data[1], "LEN", 3);
+        memcpy(&rx_data[SPI_RSP_PREFIX_SIZE], length, sizeof(length));
+        ctx->length_sent = true;
+        return;
+    }
+    if(size < SPI_RSP_PREFIX_SIZE + response->packet_size + FRAME_CHECKSUM_SIZE){
+        return;
+    }
+    memcpy(&rx_data[1], "RSP", 3);
+    memcpy(&rx_data[SPI_RSP_PREFIX_SIZE], response->packet, (size_t) (response->packet_size + FRAME_CHECKSUM_SIZE));
+    dequeue_response(ctx);
+}
+
+/**
+ * @brief Do one I2C read transaction.
+ *
+ * With the combined response option the response frame follows the response
+ * length frame in the same read. It is only released when the host read all
+ * of it, otherwise it is sent again on the next read.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the read.
+ * @param data Buffer for the data received by the host.
+ * @return int Number of bytes read, or -1 with errno set to EIO when the client
+ *         is busy and does not acknowledge the read.
+ */
+static int i2c_read(struct sim_mac_ctx *ctx, int size, uint8_t *data){
+    struct sim_response *response = ready_response(ctx);
+    uint16_t frame_check_sequence;
+    int length;
+
+    wait_until(line_transfer(ctx, &ctx->tx_line_free, clock_now(), size));
+    if(NULL == response){
+        errno = EIO;
+        return -1;
+    }
+    ctx->stats.rx_bytes += (unsigned long long) size;
+    memset(data, 0, (size_t) size);
+    if(!ctx->length_sent){
+        if(size < I2C_LENGTH_FRAME_SIZE){
+            return size;
+        }
+        length = response->packet_size + FRAME_CHECKSUM_SIZE;
+        data[0] = I2C_FRAME_TYPE_LENGTH;
+        data[1] = (uint8_t) (length & 0xff);
+        data[2] = (uint8_t) (length >> 8);
+        frame_check_sequence = calculate_crc16(RSP_LENGTH_SIZE, &data[1]);
+        data[3] = (uint8_t) (frame_check_sequence & 0xff);
+        data[4] = (uint8_t) (frame_check_sequence >> 8);
+        ctx->length_sent = true;
+        if(!ctx->config.i2c_combined_response || size <= I2C_LENGTH_FRAME_SIZE){
+            return size;
+        }
+        length = size - I2C_LENGTH_FRAME_SIZE - 1;
+        data[I2C_LENGTH_FRAME_SIZE] = I2C_FRAME_TYPE_RESPONSE;
+        if(length < response->packet_size + FRAME_CHECKSUM_SIZE){
+            memcpy(&data[I2C_LENGTH_FRAME_SIZE + 1], response->packet, (size_t) length);
+            return size;
+        }
+        memcpy(&data[I2C_LENGTH_FRAME_SIZE + 1], response->packet, (size_t) (response->packet_size + FRAME_CHECKSUM_SIZE));
+        dequeue_response(ctx);
+        return size;
+    }
+    if(size < 1 + response->packet_size + FRAME_CHECKSUM_SIZE){
+        return size;
+    }
+    data[0] = I2C_FRAME_TYPE_RESPONSE;
+    memcpy(&data[1], response->packet, (size_t) (response->packet_size + FRAME_CHECKSUM_SIZE));
+    dequeue_response(ctx);
+    return size;
+}
+
+/**
+ * @brief Handle data written by the host.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the data.
+ * @param data Data written by the host.
+ * @return int Number of bytes written, or -1 on error with errno set.
+ */
+static int write_data(struct sim_mac_ctx *ctx, int size, uint8_t *data){
+    double arrival;
+
+    switch(ctx->config.framing){
+        case SIM_FRAMING_SERIAL:
+            // Serial writes only queue the data for transmission
+            arrival = line_transfer(ctx, &ctx->tx_line_free, clock_now(), size);
+            ctx->stats.tx_bytes += (unsigned long long) size;
+            decode_serial(ctx, arrival, size, data);
+            return size;
+        case SIM_FRAMING_SPI:
+            if(size > (int) sizeof(ctx->miso)){
+                errno = EOVERFLOW;
+                return -1;
+            }
+            spi_exchange(ctx, size, data, ctx->miso);
+            ctx->miso_size = size;
+            return size;
+        case SIM_FRAMING_I2C:
+            if(size > COMMAND_FRAME_MAX_SIZE){
+                errno = EOVERFLOW;
+                return -1;
+            }
+            arrival = line_transfer(ctx, &ctx->tx_line_free, clock_now(), size);
+            wait_until(arrival);
+            ctx->stats.tx_bytes += (unsigned long long) size;
+            memcpy(ctx->command, data, (size_t) size);
+            handle_command_frame(ctx, arrival, size, ctx->command);
+            return size;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline);
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov);
+static int mac_transfer(mac_t *mac, int count, mac_segment_t *segments);
+
+static int mac_init(mac_t *mac, void *conf){
+    struct sim_mac_ctx *ctx = mac->ctx;
+    const struct sim_mac_config *config = conf;
+
+    if(config->buffer_size > BUFFER_SIZE_MAX || config->buffer_size == 0){
+        ERROR("Simulated client buffer size %d is not supported", config->buffer_size);
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->config = *config;
+    // Provide the optional operations of the hardware MAC for the framing
+    mac->read_deadline = (SIM_FRAMING_SERIAL == config->framing) ? mac_read_deadline : NULL;
+    mac->transfer = (SIM_FRAMING_SERIAL == config->framing) ? NULL : mac_transfer;
+    mac->writev = (SIM_FRAMING_SPI == config->framing) ? NULL : mac_writev;
+    if(NULL == ctx->config.image){
+        ctx->config.image_size = 0;
+    }
+    // Spread small seeds over all bits, xorshift returns small numbers at first otherwise
+    ctx->random = (config->seed * 2654435761U) ^ 0x9E3779B9U;
+    if(0 == ctx->random){
+        ctx->random = 1;
+    }
+    for(int i = 0; i < 8; i++){
+        random_uniform(ctx);
+    }
+    return 0;
+}
+
+static int mac_open(mac_t *mac){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    if(ctx->opened){
+        errno = EBUSY;
+        return -1;
+    }
+    ctx->stats.calls++;
+    ctx->queue_head = 0;
+    ctx->queue_count = 0;
+    ctx->in_frame = false;
+    ctx->length_sent = false;
+    ctx->last_response_size = 0;
+    ctx->tx_line_free = 0;
+    ctx->rx_line_free = 0;
+    ctx->client_free = 0;
+    ctx->opened = true;
+    return 0;
+}
+
+static int mac_close(mac_t *mac){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    if(!ctx->opened){
+        errno = EBADF;
+        return -1;
+    }
+    ctx->stats.calls++;
+    ctx->opened = false;
+    return 0;
+}
+
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    ctx->stats.calls++;
+    return read_serial(ctx, size, data, min_size, (double) deadline->tv_sec + (double) deadline->tv_nsec * 1e-9);
+}
+
+static int mac_read(mac_t *mac, int size, uint8_t *data){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    switch(ctx->config.framing){
+        case SIM_FRAMING_SERIAL:
+            ctx->stats.calls++;
+            return read_serial(ctx, size, data, 1, clock_now() + READ_WAIT_TIME);
+        case SIM_FRAMING_SPI:
+            // The receive data was stored by the transaction, like in the spidev MAC
+            if(size != ctx->miso_size){
+                ERROR("Simulated client MAC read size must match last write size");
+                errno = EINVAL;
+                return -1;
+            }
+            memcpy(data, ctx->miso, (size_t) size);
+            ctx->miso_size = 0;
+            return size;
+        case SIM_FRAMING_I2C:
+            ctx->stats.calls++;
+            return i2c_read(ctx, size, data);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+static int mac_write(mac_t *mac, int size, uint8_t *data){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    ctx->stats.calls++;
+    return write_data(ctx, size, data);
+}
+
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov){
+    struct sim_mac_ctx *ctx = mac->ctx;
+    uint8_t buffer[COMMAND_FRAME_MAX_SIZE * 2 + 2];
+    int size = mac_iovec_size(count, iov);
+
+    if(size < 0){
+        return -1;
+    }
+    if(size > (int) sizeof(buffer)){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    size = 0;
+    for(int i = 0; i < count; i++){
+        memcpy(&buffer[size], iov[i].data, (size_t) iov[i].size);
+        size += iov[i].size;
+    }
+    ctx->stats.calls++;
+    return write_data(ctx, size, buffer);
+}
+
+static int mac_transfer(mac_t *mac, int count, mac_segment_t *segments){
+    struct sim_mac_ctx *ctx = mac->ctx;
+
+    if(SIM_FRAMING_SERIAL == ctx->config.framing || count > MAC_TRANSFER_MAX_SEGMENTS){
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->stats.calls++;
+    for(int i = 0; i < count; i++){
+        if(SIM_FRAMING_SPI == ctx->config.framing){
+            spi_exchange(ctx, segments[i].size, segments[i].tx_data, segments[i].rx_data);
+        } else if(NULL != segments[i].tx_data){
+            if(write_data(ctx, segments[i].size, segments[i].tx_data) < 0){
+                return -1;
+            }
+        } else if(i2c_read(ctx, segments[i].size, segments[i].rx_data) < 0){
+            // Like the adapter, abort the remaining messages when the client does not acknowledge
+            return -1;
+        }
+        wait_until(clock_now() + segments[i].delay_us * 1e-6);
+    }
+    return 0;
+}
+
+/**
+ * @brief Simulated client MAC operations.
+ *
+ * The optional operations are selected for the configured framing in init.
+ */
+static const mac_t sim_mac = {
+    .init = mac_init,
+    .open = mac_open,
+    .close = mac_close,
+    .read = mac_read,
+    .write = mac_write,
+    .read_deadline = mac_read_deadline,
+    .transfer = mac_transfer,
+    .writev = mac_writev
+};
+
+/**
+ * @brief Create a new simulated MDFU client MAC instance.
+ *
+ * The framing is selected with the configuration passed to init. Depending
+ * on the framing, the transfer operation is provided for SPI and the read
+ * with deadline for serial, so that the transports use the same code paths
+ * as with the respective hardware MACs.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int get_sim_mac(mac_t **mac){
+    return mac_alloc(&sim_mac, sizeof(struct sim_mac_ctx), mac);
+}
+
+/**
+ * @brief Get the simulated client counters.
+ *
+ * @param mac Simulated client MAC instance.
+ * @param stats Pointer where the counters are stored.
+ */
+void sim_mac_get_stats(const mac_t *mac, struct sim_mac_stats *stats){
+    const struct sim_mac_ctx *ctx = mac->ctx;
+
+    *stats = ctx->stats;
+}
+
+/**
+ * @brief Get the time until the first queued response is available to the host.
+ *
+ * Allows servers that forward the simulated client over another link to sleep
+ * until there is a response to send.
+ *
+ * @param mac Simulated client MAC instance.
+ * @return float Time in seconds, 0 if a response is ready, or -1 if no
+ *         response is queued.
+ */
+float sim_mac_response_delay(const mac_t *mac){
+    const struct sim_mac_ctx *ctx = mac->ctx;
+    double delay;
+
+    if(0 == ctx->queue_count){
+        return -1;
+    }
+    delay = ctx->queue[ctx->queue_head].ready - clock_now();
+    return delay > 0 ? (float) delay : 0;
+}
@@ -0,0 +1,284 @@
+/**
+ * @file socket_connect.c
+ * @brief Non-blocking connection setup for the socket MACs.
+ *
+ * The host is resolved with getaddrinfo, so host names and IPv6 addresses
+ * can be used, and the addresses are tried in the manner of Happy Eyeballs
+ * (RFC 8305): the address families are interleaved and a new attempt is
+ * started when the previous one did not complete within a short delay, while
+ * the earlier attempts keep running. The first attempt that completes wins.
+ * All attempts are non-blocking and bounded by the connection deadline, so
+ * a host that does not answer costs at most the deadline and no time is
+ * spent in the kernel connect timeout.
+ */
+#define _GNU_SOURCE // SOCK_NONBLOCK, SOCK_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "mdfu/mac/socket_connect.h"
+#include "mdfu/logging.h"
+
+/**
+ * @brief Time in seconds after which the next address is tried when no
+ * attempt has completed yet, the value recommended by RFC 8305.
+ */
+#define CONNECTION_ATTEMPT_DELAY 0.25f
+
+/**
+ * @brief Order the resolved addresses for the connection attempts.
+ *
+ * getaddrinfo already sorts the addresses by preference. The families are
+ * interleaved starting with the family of the preferred address, so that a
+ * family that does not work only delays the connection by one attempt delay.
+ *
+ * @param connection Connection with the resolved addresses.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int order_addresses(socket_connect_t *connection){
+    struct addrinfo *address;
+    struct addrinfo *preferred = NULL;
+    struct addrinfo *other = NULL;
+    int count = 0;
+    int family;
+
+    for(address = connection->addresses; NULL != address; address = address->ai_next){
+        count++;
+    }
+    connection->order = calloc((size_t) count, sizeof(struct addrinfo *));
+    if(NULL == connection->order){
+        errno = ENOMEM;
+        return -1;
+    }
+    family = connection->addresses->ai_family;
+    preferred = connection->addresses;
+    other = connection->addresses;
+    while(connection->order_count < count){
+        while(NULL != preferred && preferred->ai_family != family){
+            preferred = preferred->ai_next;
+        }
+        while(NULL != other && other->ai_family == family){
+            other = other->ai_next;
+        }
+        if(NULL != preferred){
+            connection->order[connection->order_count++] = preferred;
+            preferred = preferred->ai_next;
+        }
+        if(NULL != other){
+            connection->order[connection->order_count++] = other;
+            other = other->ai_next;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Start connection attempts until one is in progress or no address is left.
+ *
+ * Addresses where the connection fails immediately, e.g. because the address
+ * family is not available, are skipped.
+ *
+ * @param connection Connection in progress.
+ * @return int 0 if an attempt was started, -1 if no address is left.
+ */
+static int start_attempt(socket_connect_t *connection){
+    while(connection->next < connection->order_count &&
+          connection->attempt_count < SOCKET_CONNECT_MAX_ATTEMPTS){
+        struct addrinfo *address = connection->order[connection->next++];
+        char name[NI_MAXHOST] = "?";
+        char port[NI_MAXSERV] = "?";
+        int sock;
+
+        getnameinfo(address->ai_addr, address->ai_addrlen, name, sizeof(name), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+        DEBUG("Connecting to host %s on port %s", name, port);
+        sock = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if(sock < 0){
+            connection->error = errno;
+            continue;
+        }
+        if(connect(sock, address->ai_addr, address->ai_addrlen) < 0 && EINPROGRESS != errno){
+            DEBUG("Connecting to host %s failed with: %s", name, strerror(errno));
+            connection->error = errno;
+            close(sock);
+            continue;
+        }
+        connection->attempts[connection->attempt_count] = sock;
+        connection->attempt_addresses[connection->attempt_count] = address;
+        connection->attempt_count++;
+        set_timeout(&connection->next_attempt, CONNECTION_ATTEMPT_DELAY);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Remove a connection attempt from the attempts in progress.
+ *
+ * @param connection Connection in progress.
+ * @param index Index of the attempt.
+ * @param close_socket Close the socket of the attempt.
+ */
+static void remove_attempt(socket_connect_t *connection, int index, bool close_socket){
+    if(close_socket){
+        close(connection->attempts[index]);
+    }
+    connection->attempt_count--;
+    connection->attempts[index] = connection->attempts[connection->attempt_count];
+    connection->attempt_addresses[index] = connection->attempt_addresses[connection->attempt_count];
+}
+
+/**
+ * @brief Resolve a host and start connecting to it.
+ *
+ * The function returns after the first connection attempt was started, the
+ * connection is completed with socket_connect_finish.
+ *
+ * @param connection Connection state.
+ * @param host Host name or numeric IPv4 or IPv6 address.
+ * @param port Port number.
+ * @param type Socket type, SOCK_STREAM or SOCK_DGRAM.
+ * @param timeout Time in seconds until the connection must be set up.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int socket_connect_start(socket_connect_t *connection, const char *host, uint16_t port, int type, float timeout){
+    struct addrinfo hints;
+    char service[8];
+    int status;
+
+    memset(connection, 0, sizeof(*connection));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%u", (unsigned int) port);
+    set_timeout(&connection->deadline, timeout);
+    status = getaddrinfo(host, service, &hints, &connection->addresses);
+    if(0 != status){
+        ERROR("Resolving host %s failed: %s", host, gai_strerror(status));
+        connection->addresses = NULL;
+        errno = (EAI_SYSTEM == status) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    connection->error = EHOSTUNREACH;
+    if(order_addresses(connection) < 0 || start_attempt(connection) < 0){
+        status = (NULL == connection->order) ? ENOMEM : connection->error;
+        ERROR("Connecting to host %s failed with: %s", host, strerror(status));
+        socket_connect_cancel(connection);
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait until a connection attempt succeeds.
+ *
+ * Further attempts are started while none succeeds. The socket of the
+ * winning attempt is switched back to blocking mode and all other attempts
+ * are closed.
+ *
+ * @param connection Connection started with socket_connect_start.
+ * @return int Socket of the connection, or -1 on error with errno set to
+ *         ETIMEDOUT if the deadline expired.
+ */
+int socket_connect_finish(socket_connect_t *connection){
+    struct pollfd fds[SOCKET_CONNECT_MAX_ATTEMPTS];
+    int status;
+    int wait;
+
+    if(NULL == connection->addresses){
+        errno = EINVAL;
+        return -1;
+    }
+    while(true){
+        if(0 == connection->attempt_count && start_attempt(connection) < 0){
+            status = connection->error;
+            break;
+        }
+        wait = timeout_remaining_ms(&connection->deadline);
+        if(connection->next < connection->order_count && connection->attempt_count < SOCKET_CONNECT_MAX_ATTEMPTS){
+            int next_attempt = timeout_remaining_ms(&connection->next_attempt);
+            if(next_attempt < wait){
+                wait = next_attempt;
+            }
+        }
+        for(int i = 0; i < connection->attempt_count; i++){
+            fds[i].fd = connection->attempts[i];
+            fds[i].events = POLLOUT;
+            fds[i].revents = 0;
+        }
+        status = poll(fds, (nfds_t) connection->attempt_count, wait);
+        if(status < 0 && EINTR != errno){
+            status = errno;
+            break;
+        }
+        // Walk backwards so that removing an attempt does not skip one
+        for(int i = connection->attempt_count - 1; status > 0 && i >= 0; i--){
+            int error = 0;
+            socklen_t length = sizeof(error);
+            int sock = connection->attempts[i];
+
+            if(0 == fds[i].revents){
+                continue;
+            }
+            if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) < 0){
+                error = errno;
+            }
+            if(0 != error){
+                DEBUG("Connection attempt failed with: %s", strerror(error));
+                connection->error = error;
+                remove_attempt(connection, i, true);
+                continue;
+            }
+            remove_attempt(connection, i, false);
+            socket_connect_cancel(connection);
+            if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0){
+                status = errno;
+                close(sock);
+                errno = status;
+                return -1;
+            }
+            return sock;
+        }
+        if(timeout_expired(&connection->deadline)){
+            status = ETIMEDOUT;
+            break;
+        }
+        if(timeout_expired(&connection->next_attempt) || 0 == connection->attempt_count){
+            // Failing to start another attempt is not an error while others are in progress
+            start_attempt(connection);
+        }
+    }
+    ERROR("Connecting failed with: %s", strerror(status));
+    socket_connect_cancel(connection);
+    errno = status;
+    return -1;
+}
+
+/**
+ * @brief Stop connecting and release the connection state.
+ *
+ * Can be called on a connection that was finished, cancelled or not started.
+ *
+ * @param connection Connection state.
+ */
+void socket_connect_cancel(socket_connect_t *connection){
+    while(connection->attempt_count > 0){
+        remove_attempt(connection, 0, true);
+    }
+    if(NULL != connection->addresses){
+        freeaddrinfo(connection->addresses);
+        connection->addresses = NULL;
+    }
+    free(connection->order);
+    connection->order = NULL;
+    connection->order_count = 0;
+    connection->next = 0;
+}
@@ -9,14 +9,66 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
-#include <arpa/inet.h> // inet_pton
+#include <netinet/tcp.h>
 #include "mdfu/mac/socket_mac.h"
+#include "mdfu/mac/socket_connect.h"
+#ifdef USE_IO_URING
+#include "mdfu/mac/uring_io.h"
+#endif
 #include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+
+/**
+ * @def READ_WAIT_TIME
+ * @brief Time in seconds that mac_read waits for data.
+ */
+#define READ_WAIT_TIME 5.0f
+
+/**
+ * @def RX_BUFFER_SIZE
+ * @brief Size of the receive buffer.
+ */
+#define RX_BUFFER_SIZE 2048
 
-static int sock = 0;
-static struct sockaddr_in socket_address;
-static bool opened = false;
+/**
+ * @def HOST_NAME_MAX_SIZE
+ * @brief Size of the buffer for the host name or address.
+ */
+#define HOST_NAME_MAX_SIZE 256
+
+/**
+ * @def CONNECT_TIMEOUT
+ * @brief Time in seconds to set up the connection to the host.
+ */
+#define CONNECT_TIMEOUT 5.0f
+
+/**
+ * @brief Socket MAC instance state.
+ *
+ * Received data is collected in rx_buffer, rx_head is the offset of the next
+ * unconsumed byte and rx_count the number of valid bytes. This lets readers
+ * that take a few bytes at a time get them without a system call each.
+ *
+ * With io_uring the buffer is registered with the ring and each frame write
+ * is submitted together with the read of the response, which is appended to
+ * the buffer.
+ */
+struct socket_mac_ctx {
+    int sock;
+    char host[HOST_NAME_MAX_SIZE];
+    uint16_t port;
+    socket_connect_t connection;
+    bool opened;
+    int rx_head;
+    int rx_count;
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+#ifdef USE_IO_URING
+    uring_io_t uring;
+#endif
+};
 
 /** Blocking socket implementation
  * 
@@ -60,105 +112,416 @@ bool SetSocketBlockingEnabled(int fd, bool blocking)
 }
 */
 
-static int mac_init(void *conf)
+/**
+ * @brief Re-enable quick acknowledgments on the socket.
+ *
+ * Linux falls back to delayed acknowledgments after some time, so this is
+ * done after each receive. Each frame is answered by the peer only after it
+ * was acknowledged, so delayed acknowledgments would stall every exchange.
+ *
+ * @param sock Socket file descriptor.
+ */
+static void enable_quickack(int sock)
+{
+#ifdef TCP_QUICKACK
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable));
+#else
+    (void) sock;
+#endif
+}
+
+/**
+ * @brief Initializes the MAC and starts connecting to the host.
+ *
+ * The connection is set up in the background until the MAC is opened, so
+ * that connecting overlaps with the rest of the tool and session setup.
+ *
+ * @param mac MAC instance.
+ * @param conf Socket configuration with the host name or address and port.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_init(mac_t *mac, void *conf)
 {
+    struct socket_mac_ctx *ctx = mac->ctx;
     struct socket_config *config = (struct socket_config *) conf;
-    struct timeval timeout = {
-        .tv_sec = 5,
-        .tv_usec = 0
-    };
+
     DEBUG("Initializing socket MAC");
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-		perror("Socket MAC init");
-		return -1;
-	}
-    
-    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &timeout, sizeof(timeout)) < 0){
-        perror("Socket MAC init");
+    if(ctx->opened){
+        errno = EBUSY;
         return -1;
     }
-
-    // The send timeout will also set the connect timeout, which is very long otherwise ~75 seconds
-    // Maybe we should do this differently with poll/select
-    if(setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0){
-        perror("Socket MAC initialization failed with: ");
+    if(strlen(config->host) >= HOST_NAME_MAX_SIZE){
+        ERROR("Host name %s is too long", config->host);
+        errno = EINVAL;
         return -1;
     }
-
-    bzero(&socket_address, sizeof(socket_address));
-    inet_pton(AF_INET, config->host, &(socket_address.sin_addr));
-    socket_address.sin_family = AF_INET;
-    socket_address.sin_port = htons(config->port);
-    opened = false;
-    return 0;
+    strcpy(ctx->host, config->host);
+    ctx->port = config->port;
+    socket_connect_cancel(&ctx->connection);
+    return socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_STREAM, CONNECT_TIMEOUT);
 }
 
-static int mac_open(void)
+/**
+ * @brief Completes the connection to the host.
+ *
+ * A connection that was closed before is set up again.
+ *
+ * @param mac MAC instance.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_open(mac_t *mac)
 {
+    struct socket_mac_ctx *ctx = mac->ctx;
+    struct timeval timeout = {
+        .tv_sec = 5,
+        .tv_usec = 0
+    };
+    int enable = 1;
+
     DEBUG("Opening socket MAC");
-    if(opened){
+    if(ctx->opened){
         errno = EBUSY;
-        return -EBUSY;
+        return -1;
     }
-    char buf[64];
-    inet_ntop (AF_INET, &socket_address.sin_addr, buf, sizeof(buf));
-    DEBUG("Connecting to host %s on port %d",buf , ntohs(socket_address.sin_port));
-
-    if(connect(sock, (struct sockaddr *) &socket_address, sizeof(socket_address)) < 0){
-        if(errno == EINPROGRESS){
-            ERROR("Socket MAC connect timed out");
-        } else {
-            ERROR("Socket MAC connect failed with: %s", strerror(errno));
-        }
-        close(sock);
-        return -ETIMEDOUT;
+    if(NULL == ctx->connection.addresses &&
+        socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_STREAM, CONNECT_TIMEOUT) < 0){
+        return -1;
     }
-    opened = true;
+    ctx->sock = socket_connect_finish(&ctx->connection);
+    if(ctx->sock < 0){
+        ERROR("Connecting to host %s on port %u failed", ctx->host, (unsigned int) ctx->port);
+        return -1;
+    }
+    // Frames are small and each one is answered by the peer, so they must
+    // not be held back by the Nagle algorithm. Sends that block longer than
+    // the timeout fail instead of stalling the session.
+    if(setsockopt(ctx->sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0 ||
+        setsockopt(ctx->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0){
+        ERROR("socket MAC open: %s", strerror(errno));
+        close(ctx->sock);
+        return -1;
+    }
+    enable_quickack(ctx->sock);
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+#ifdef USE_IO_URING
+    if(uring_io_open(&ctx->uring, ctx->sock, ctx->rx_buffer, RX_BUFFER_SIZE) == 0){
+        DEBUG("Socket MAC uses io_uring");
+    }
+#endif
+    ctx->opened = true;
     return 0;
 }
 
-static int mac_close(void)
+static int mac_close(mac_t *mac)
 {
-    if(opened){
-        close(sock);
-        opened = false;
+    struct socket_mac_ctx *ctx = mac->ctx;
+    // Stops a connection that was started but not opened
+    socket_connect_cancel(&ctx->connection);
+    if(ctx->opened){
+#ifdef USE_IO_URING
+        uring_io_close(&ctx->uring);
+#endif
+        close(ctx->sock);
+        ctx->opened = false;
         return 0;
     } else {
         return -1;
     }
 }
 
-static int mac_read(int size, uint8_t *data)
+#ifdef USE_IO_URING
+/**
+ * @brief Move the unconsumed data to the start of the receive buffer.
+ *
+ * Not done while io_uring may store data in the buffer.
+ *
+ * @param ctx MAC instance state.
+ */
+static void rx_compact(struct socket_mac_ctx *ctx)
+{
+    if(ctx->rx_head > 0 && !uring_io_busy(&ctx->uring)){
+        memmove(ctx->rx_buffer, &ctx->rx_buffer[ctx->rx_head], (size_t) (ctx->rx_count - ctx->rx_head));
+        ctx->rx_count -= ctx->rx_head;
+        ctx->rx_head = 0;
+    }
+}
+
+/**
+ * @brief Receive data with io_uring and append it to the receive buffer.
+ *
+ * Takes the response read that was submitted with the last frame, or
+ * submits a new read.
+ *
+ * @param ctx MAC instance state.
+ * @param deadline Time when to stop waiting for data.
+ * @return int Number of bytes received, 0 if the deadline expired or -1 on error.
+ */
+static int rx_fill_uring(struct socket_mac_ctx *ctx, timeout_t *deadline)
 {
     int status;
 
-    status = recv(sock, data, size, 0);
+    rx_compact(ctx);
+    status = uring_io_read(&ctx->uring, (size_t) ctx->rx_count, deadline);
     if(status < 0){
+        if(errno == ETIMEDOUT){
+            return 0;
+        }
         perror("Socket MAC read");
+        return -1;
+    }
+    if(status == 0){
+        ERROR("Socket MAC read: Connection closed by peer");
+        errno = ECONNRESET;
+        return -1;
     }
+    enable_quickack(ctx->sock);
+    ctx->rx_count += status;
     return status;
 }
+#endif
 
-static int mac_write(int size, uint8_t *data)
+/**
+ * @brief Receive all available data into the empty receive buffer.
+ *
+ * @param ctx MAC instance state.
+ * @param deadline Time when to stop waiting for data.
+ * @return int Number of bytes received, 0 if the deadline expired or -1 on error.
+ */
+static int rx_fill(struct socket_mac_ctx *ctx, timeout_t *deadline)
 {
+    struct pollfd pfd = {.fd = ctx->sock, .events = POLLIN};
+    ssize_t status;
+
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        return rx_fill_uring(ctx, deadline);
+    }
+#endif
+    while(true){
+        status = timeout_remaining_ms(deadline);
+        if(status < 0){
+            return -1;
+        }
+        status = poll(&pfd, 1, (int) status);
+        if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Socket MAC read");
+            return -1;
+        }
+        if(status == 0){
+            return 0;
+        }
+        status = recv(ctx->sock, ctx->rx_buffer, RX_BUFFER_SIZE, 0);
+        if(status < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
+                continue;
+            }
+            perror("Socket MAC read");
+            return -1;
+        }
+        if(status == 0){
+            ERROR("Socket MAC read: Connection closed by peer");
+            errno = ECONNRESET;
+            return -1;
+        }
+        enable_quickack(ctx->sock);
+        ctx->rx_head = 0;
+        ctx->rx_count = (int) status;
+        return (int) status;
+    }
+}
+
+/**
+ * @brief Read from the socket until enough data is received or a deadline expires.
+ *
+ * Data is taken from the receive buffer first, which is refilled with all
+ * data that is available when it is empty.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline)
+{
+    struct socket_mac_ctx *ctx = mac->ctx;
+    int received = 0;
+    int count;
+
+    do {
+        if(ctx->rx_head == ctx->rx_count){
+            count = rx_fill(ctx, deadline);
+            if(count < 0){
+                return -1;
+            }
+            if(count == 0){
+                break;
+            }
+        }
+        count = ctx->rx_count - ctx->rx_head;
+        if(count > size - received){
+            count = size - received;
+        }
+        memcpy(&data[received], &ctx->rx_buffer[ctx->rx_head], (size_t) count);
+        ctx->rx_head += count;
+        received += count;
+    } while(received < min_size);
+    return received;
+}
+
+/**
+ * @brief Read the data that is available or wait up to READ_WAIT_TIME for it.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @return int Number of bytes read, 0 if no data was received or -1 on error.
+ */
+static int mac_read(mac_t *mac, int size, uint8_t *data)
+{
+    timeout_t deadline;
+
+    set_timeout(&deadline, READ_WAIT_TIME);
+    return mac_read_deadline(mac, size, data, 1, &deadline);
+}
+
+/**
+ * @brief Sends multiple buffers over the socket with sendmsg.
+ *
+ * Partial sends are continued until all data is sent. With io_uring the
+ * read of the response is submitted together with the buffers.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers to send.
+ * @return int Number of bytes sent, or -1 on error.
+ */
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov)
+{
+    struct socket_mac_ctx *ctx = mac->ctx;
+    struct iovec vector[MAC_IOVEC_MAX];
+    struct msghdr message = {0};
+    ssize_t status;
+    int size;
+
+    size = mac_iovec_to_iovec(count, iov, vector);
+    if(size < 0){
+        return -1;
+    }
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        rx_compact(ctx);
+        if(uring_io_writev(&ctx->uring, vector, count, (size_t) ctx->rx_count) < 0){
+            perror("Socket MAC send:");
+            return -1;
+        }
+        return size;
+    }
+#endif
+    message.msg_iov = vector;
+    while(count > 0){
+        message.msg_iovlen = count;
+        status = sendmsg(ctx->sock, &message, 0);
+        if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Socket MAC send:");
+            return -1;
+        }
+        count = mac_iovec_consume(count, &message.msg_iov, (size_t) status);
+    }
+    return size;
+}
+
+/**
+ * @brief Write a buffer, with io_uring together with the read of the response.
+ *
+ * @param mac MAC instance.
+ * @param size Number of bytes to write.
+ * @param data Data to write.
+ * @return int Number of bytes written, or -1 on error.
+ */
+static int mac_write(mac_t *mac, int size, uint8_t *data)
+{
+    struct socket_mac_ctx *ctx = mac->ctx;
     int status;
-    status = send(sock, data, size, 0);
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        mac_iovec_t iov = {.data = data, .size = size};
+
+        return mac_writev(mac, 1, &iov);
+    }
+#endif
+    status = send(ctx->sock, data, size, 0);
     if(status < 0){
         perror("Socket MAC send:");
     }
     return status;
 }
 
-mac_t network_mac = {
+/**
+ * @brief Get the file descriptor of the socket.
+ *
+ * With io_uring this is the ring, which becomes readable when the response
+ * was received into the receive buffer.
+ *
+ * @param mac MAC instance.
+ * @return int File descriptor, or -1 if the MAC is not open.
+ */
+static int mac_get_fd(mac_t *mac)
+{
+    struct socket_mac_ctx *ctx = mac->ctx;
+
+    if(!ctx->opened){
+        return -1;
+    }
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        return ctx->uring.ring;
+    }
+#endif
+    return ctx->sock;
+}
+
+/**
+ * @brief Check if received data is waiting in the receive buffer.
+ *
+ * @param mac MAC instance.
+ * @return bool True if a read returns data without waiting for the socket.
+ */
+static bool mac_has_data(mac_t *mac)
+{
+    struct socket_mac_ctx *ctx = mac->ctx;
+
+    return ctx->rx_head < ctx->rx_count;
+}
+
+static const mac_t network_mac = {
     .open = mac_open,
     .close = mac_close,
     .init = mac_init,
     .write = mac_write,
-    .read = mac_read
+    .read = mac_read,
+    .read_deadline = mac_read_deadline,
+    .writev = mac_writev,
+    .get_fd = mac_get_fd,
+    .has_data = mac_has_data
 };
 
-
-void get_socket_mac(mac_t **mac){
-    *mac = &network_mac;
+/**
+ * @brief Create a new socket MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_socket_mac(mac_t **mac){
+    return mac_alloc(&network_mac, sizeof(struct socket_mac_ctx), mac);
 }
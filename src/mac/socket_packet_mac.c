@@ -9,81 +9,185 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
-#include <arpa/inet.h> // inet_pton
+#include <netinet/tcp.h>
 #include "mdfu/mac/socket_mac.h"
+#include "mdfu/mac/socket_connect.h"
+#ifdef USE_IO_URING
+#include "mdfu/mac/uring_io.h"
+#endif
 #include "mdfu/logging.h"
+#include "mdfu/timeout.h"
 
 #define HEADER_SIZE 8
 #define HEADER_MAGIC "MDFU"
 
-static int sock = 0;
-static struct sockaddr_in socket_address;
-static bool opened = false;
+/**
+ * @def READ_TIMEOUT
+ * @brief Time in seconds to wait for a complete frame in mac_read.
+ */
+#define READ_TIMEOUT 5.0f
+
+/**
+ * @def RX_BUFFER_SIZE
+ * @brief Size of the receive buffer that frames are reassembled in.
+ */
+#define RX_BUFFER_SIZE 2048
+
+/**
+ * @def HOST_NAME_MAX_SIZE
+ * @brief Size of the buffer for the host name or address.
+ */
+#define HOST_NAME_MAX_SIZE 256
+
+/**
+ * @def CONNECT_TIMEOUT
+ * @brief Time in seconds to set up the connection to the host.
+ */
+#define CONNECT_TIMEOUT 5.0f
+
+/**
+ * @brief Socket packet MAC instance state.
+ *
+ * Received data is collected in rx_buffer, rx_head is the offset of the next
+ * unconsumed byte and rx_count the number of valid bytes. rx_skip is the
+ * number of payload bytes of an incomplete frame that must be discarded
+ * before the next frame header.
+ *
+ * With io_uring the buffer is registered with the ring and each frame write
+ * is submitted together with the read of the response.
+ */
+struct socket_packet_mac_ctx {
+    int sock;
+    char host[HOST_NAME_MAX_SIZE];
+    uint16_t port;
+    socket_connect_t connection;
+    bool opened;
+    int rx_head;
+    int rx_count;
+    uint32_t rx_skip;
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+#ifdef USE_IO_URING
+    uring_io_t uring;
+#endif
+};
+
+/**
+ * @brief Re-enable quick acknowledgments on the socket.
+ *
+ * Linux falls back to delayed acknowledgments after some time, so this is
+ * done after each receive. Each frame is answered by the peer only after it
+ * was acknowledged, so delayed acknowledgments would stall every exchange.
+ *
+ * @param sock Socket file descriptor.
+ */
+static void enable_quickack(int sock)
+{
+#ifdef TCP_QUICKACK
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable));
+#else
+    (void) sock;
+#endif
+}
 
-static int mac_init(void *conf)
+/**
+ * @brief Initializes the MAC and starts connecting to the host.
+ *
+ * The connection is set up in the background until the MAC is opened, so
+ * that connecting overlaps with the rest of the tool and session setup.
+ *
+ * @param mac MAC instance.
+ * @param conf Socket configuration with the host name or address and port.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_init(mac_t *mac, void *conf)
 {
+    struct socket_packet_mac_ctx *ctx = mac->ctx;
     struct socket_config *config = (struct socket_config *) conf;
-    struct timeval timeout = {
-        .tv_sec = 5,
-        .tv_usec = 0
-    };
-    DEBUG("Initializing socket MAC");
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-		perror("Socket MAC init");
-		return -1;
-	}
-    
-    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &timeout, sizeof(timeout)) < 0){
-        perror("Socket MAC init");
+
+    DEBUG("Initializing socket packet MAC");
+    if(ctx->opened){
+        errno = EBUSY;
         return -1;
     }
-
-    // The send timeout will also set the connect timeout, which is very long otherwise ~75 seconds
-    // Maybe we should do this differently with poll/select
-    if(setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0){
-        perror("Socket MAC initialization failed with: ");
+    if(strlen(config->host) >= HOST_NAME_MAX_SIZE){
+        ERROR("Host name %s is too long", config->host);
+        errno = EINVAL;
         return -1;
     }
-
-    bzero(&socket_address, sizeof(socket_address));
-    inet_pton(AF_INET, config->host, &(socket_address.sin_addr));
-    socket_address.sin_family = AF_INET;
-    socket_address.sin_port = htons(config->port);
-    opened = false;
-    return 0;
+    strcpy(ctx->host, config->host);
+    ctx->port = config->port;
+    socket_connect_cancel(&ctx->connection);
+    return socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_STREAM, CONNECT_TIMEOUT);
 }
 
-static int mac_open(void)
+/**
+ * @brief Completes the connection to the host.
+ *
+ * A connection that was closed before is set up again.
+ *
+ * @param mac MAC instance.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_open(mac_t *mac)
 {
-    DEBUG("Opening socket MAC");
-    if(opened){
+    struct socket_packet_mac_ctx *ctx = mac->ctx;
+    struct timeval timeout = {
+        .tv_sec = 5,
+        .tv_usec = 0
+    };
+    int enable = 1;
+
+    DEBUG("Opening socket packet MAC");
+    if(ctx->opened){
         errno = EBUSY;
-        return -EBUSY;
+        return -1;
     }
-    char buf[64];
-    inet_ntop (AF_INET, &socket_address.sin_addr, buf, sizeof(buf));
-    DEBUG("Connecting to host %s on port %d",buf , ntohs(socket_address.sin_port));
-
-    if(connect(sock, (struct sockaddr *) &socket_address, sizeof(socket_address)) < 0){
-        if(errno == EINPROGRESS){
-            ERROR("Socket MAC connect timed out");
-        } else {
-            ERROR("Socket MAC connect failed with: %s", strerror(errno));
-        }
-        close(sock);
-        return -ETIMEDOUT;
+    if(NULL == ctx->connection.addresses &&
+        socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_STREAM, CONNECT_TIMEOUT) < 0){
+        return -1;
+    }
+    ctx->sock = socket_connect_finish(&ctx->connection);
+    if(ctx->sock < 0){
+        ERROR("Connecting to host %s on port %u failed", ctx->host, (unsigned int) ctx->port);
+        return -1;
     }
-    opened = true;
+    // Frames are small and each one is answered by the peer, so they must
+    // not be held back by the Nagle algorithm. Sends that block longer than
+    // the timeout fail instead of stalling the session.
+    if(setsockopt(ctx->sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0 ||
+        setsockopt(ctx->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0){
+        ERROR("socket packet MAC open: %s", strerror(errno));
+        close(ctx->sock);
+        return -1;
+    }
+    enable_quickack(ctx->sock);
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+#ifdef USE_IO_URING
+    if(uring_io_open(&ctx->uring, ctx->sock, ctx->rx_buffer, RX_BUFFER_SIZE) == 0){
+        DEBUG("Socket packet MAC uses io_uring");
+    }
+#endif
+    ctx->rx_skip = 0;
+    ctx->opened = true;
     return 0;
 }
 
-static int mac_close(void)
+static int mac_close(mac_t *mac)
 {
-    if(opened){
-        close(sock);
-        opened = false;
+    struct socket_packet_mac_ctx *ctx = mac->ctx;
+    // Stops a connection that was started but not opened
+    socket_connect_cancel(&ctx->connection);
+    if(ctx->opened){
+#ifdef USE_IO_URING
+        uring_io_close(&ctx->uring);
+#endif
+        close(ctx->sock);
+        ctx->opened = false;
         return 0;
     } else {
         return -1;
@@ -91,133 +195,348 @@ static int mac_close(void)
 }
 
 /**
- * @brief Reads a MAC frame from a socket.
+ * @brief Move the unconsumed data to the start of the receive buffer.
  *
- * This function reads a MAC frame from a socket. It first reads the header to
- * verify the frame and then reads the actual data if the header is valid.
+ * Not done while io_uring may store data in the buffer.
  *
- * @param size The expected size of the data to be read.
- * @param data A pointer to a buffer where the read data will be stored.
- * @return The number of bytes read on success, or -1 on failure.
+ * @param ctx MAC instance state.
+ */
+static void rx_compact(struct socket_packet_mac_ctx *ctx)
+{
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring) && uring_io_busy(&ctx->uring)){
+        return;
+    }
+#endif
+    if(ctx->rx_head > 0){
+        memmove(ctx->rx_buffer, &ctx->rx_buffer[ctx->rx_head], (size_t) (ctx->rx_count - ctx->rx_head));
+        ctx->rx_count -= ctx->rx_head;
+        ctx->rx_head = 0;
+    }
+}
+
+#ifdef USE_IO_URING
+/**
+ * @brief Receive data with io_uring and append it to the receive buffer.
  *
- * @details
- * The function performs the following steps:
- * 1. Reads the header from the socket.
- * 2. Verifies that the header contains the expected 'MDFU' signature.
- * 3. Extracts the frame size from the header.
- * 4. Compares the extracted frame size with the expected size.
- * 5. Reads the data from the socket if the sizes match.
+ * Takes the response read that was submitted with the last frame, or
+ * submits a new read.
+ *
+ * @param ctx MAC instance state.
+ * @param deadline Time when to stop waiting for data.
+ * @return int Number of bytes received, 0 if the deadline expired or -1 on error.
  */
-static int mac_read(int size, uint8_t *data)
+static int rx_fill_uring(struct socket_packet_mac_ctx *ctx, timeout_t *deadline)
 {
     int status;
-    uint8_t header[HEADER_SIZE];
-    uint32_t frame_size;
 
-    // Receive the header
-    status = recv(sock, header, HEADER_SIZE, 0);
+    rx_compact(ctx);
+    status = uring_io_read(&ctx->uring, (size_t) ctx->rx_count, deadline);
     if(status < 0){
+        if(errno == ETIMEDOUT){
+            return 0;
+        }
         ERROR("MacSocketPacket: %s", strerror(errno));
         return -1;
     }
-    if(memcmp(header, HEADER_MAGIC, 4) == 0){
-        frame_size =  (header[7] << 25) | (header[6] << 16) | (header[5] << 8) | header[4];
-        if(frame_size != size){
-            ERROR("MacSocketPacket: Requested read size (%d) does not match packet size (%d)", size, frame_size);
+    if(status == 0){
+        ERROR("MacSocketPacket: Connection closed by peer");
+        errno = ECONNRESET;
+        return -1;
+    }
+    enable_quickack(ctx->sock);
+    ctx->rx_count += status;
+    return status;
+}
+#endif
+
+/**
+ * @brief Receive more data into the receive buffer.
+ *
+ * Unconsumed data is moved to the start of the buffer and all data that is
+ * available up to the free buffer space is received with one call.
+ *
+ * @param ctx MAC instance state.
+ * @param deadline Time when to stop waiting for data.
+ * @return int Number of bytes received, 0 if the deadline expired or -1 on error.
+ */
+static int rx_fill(struct socket_packet_mac_ctx *ctx, timeout_t *deadline)
+{
+    struct pollfd pfd = {.fd = ctx->sock, .events = POLLIN};
+    ssize_t status;
+
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        return rx_fill_uring(ctx, deadline);
+    }
+#endif
+    while(true){
+        status = timeout_remaining_ms(deadline);
+        if(status < 0){
             return -1;
         }
-        // Receive the data
-        status = recv(sock, data, frame_size, 0);
+        status = poll(&pfd, 1, (int) status);
         if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
             ERROR("MacSocketPacket: %s", strerror(errno));
-        return -1;
+            return -1;
+        }
+        if(status == 0){
+            return 0;
+        }
+        rx_compact(ctx);
+        status = recv(ctx->sock, &ctx->rx_buffer[ctx->rx_count], (size_t) (RX_BUFFER_SIZE - ctx->rx_count), 0);
+        if(status < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
+                continue;
+            }
+            ERROR("MacSocketPacket: %s", strerror(errno));
+            return -1;
+        }
+        if(status == 0){
+            ERROR("MacSocketPacket: Connection closed by peer");
+            errno = ECONNRESET;
+            return -1;
+        }
+        enable_quickack(ctx->sock);
+        ctx->rx_count += (int) status;
+        return (int) status;
+    }
+}
+
+/**
+ * @brief Take data from the received stream.
+ *
+ * Copies data from the receive buffer and refills the buffer until size bytes
+ * are taken or the deadline expires.
+ *
+ * @param ctx MAC instance state.
+ * @param size Number of bytes to take.
+ * @param data Buffer for the data, or NULL to discard it.
+ * @param deadline Time when to stop waiting for data.
+ * @return int Number of bytes taken, which is less than size if the deadline
+ *         expired, or -1 on error.
+ */
+static int rx_take(struct socket_packet_mac_ctx *ctx, uint32_t size, uint8_t *data, timeout_t *deadline)
+{
+    uint32_t taken = 0;
+    uint32_t count;
+    int status;
+
+    while(taken < size){
+        if(ctx->rx_head == ctx->rx_count){
+            status = rx_fill(ctx, deadline);
+            if(status <= 0){
+                return status < 0 ? -1 : (int) taken;
+            }
+        }
+        count = (uint32_t) (ctx->rx_count - ctx->rx_head);
+        if(count > size - taken){
+            count = size - taken;
+        }
+        if(NULL != data){
+            memcpy(&data[taken], &ctx->rx_buffer[ctx->rx_head], count);
+        }
+        ctx->rx_head += (int) count;
+        taken += count;
+    }
+    return (int) taken;
+}
+
+/**
+ * @brief Reads a MAC frame from a socket until a deadline.
+ *
+ * The received stream is reassembled in the receive buffer, so frames can
+ * arrive in any number of TCP segments. Frames are only returned as a whole,
+ * so size must be the frame size and min_size is not used. The rest of a
+ * frame that is partly received when the deadline expires is discarded by
+ * the next read.
+ *
+ * @param mac MAC instance.
+ * @param size The expected size of the frame.
+ * @param data A pointer to a buffer where the frame will be stored.
+ * @param min_size Not used, frames are read completely.
+ * @param deadline Time when to stop waiting for the frame.
+ * @return The number of bytes read, 0 if the deadline expired before the
+ *         frame was received, or -1 on failure.
+ *
+ * @details
+ * The function performs the following steps:
+ * 1. Discards the rest of a frame that was not completely received before.
+ * 2. Reads the header and verifies the 'MDFU' signature.
+ * 3. Compares the frame size from the header with the expected size.
+ * 4. Reads the data if the sizes match.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline)
+{
+    struct socket_packet_mac_ctx *ctx = mac->ctx;
+    const uint8_t *header;
+    uint32_t frame_size;
+    int status;
+
+    (void) min_size;
+    if(ctx->rx_skip > 0){
+        status = rx_take(ctx, ctx->rx_skip, NULL, deadline);
+        if(status < 0){
+            return -1;
+        }
+        ctx->rx_skip -= (uint32_t) status;
+        if(ctx->rx_skip > 0){
+            return 0;
+        }
     }
-    }else{
+    // The header is only consumed when it is complete, so that a timeout
+    // does not leave the stream in the middle of a header
+    while(ctx->rx_count - ctx->rx_head < HEADER_SIZE){
+        status = rx_fill(ctx, deadline);
+        if(status <= 0){
+            return status;
+        }
+    }
+    header = &ctx->rx_buffer[ctx->rx_head];
+    if(memcmp(header, HEADER_MAGIC, 4) != 0){
         ERROR("MacSocketPacket: Received invalid frame header");
+        errno = EPROTO;
         return -1;
-    } 
+    }
+    frame_size = (uint32_t) header[7] << 24 | (uint32_t) header[6] << 16 | (uint32_t) header[5] << 8 | header[4];
+    ctx->rx_head += HEADER_SIZE;
+    if(frame_size != (uint32_t) size){
+        ERROR("MacSocketPacket: Requested read size (%d) does not match packet size (%d)", size, frame_size);
+        ctx->rx_skip = frame_size;
+        errno = EPROTO;
+        return -1;
+    }
+    status = rx_take(ctx, frame_size, data, deadline);
+    if(status < 0){
+        return -1;
+    }
+    if((uint32_t) status < frame_size){
+        ctx->rx_skip = frame_size - (uint32_t) status;
+        return 0;
+    }
     return status;
 }
 
 /**
- * @brief Sends the entire buffer over a socket.
+ * @brief Reads a MAC frame from a socket.
  *
- * This function attempts to send the entire buffer over the specified socket.
- * It handles partial sends and retries in case of interruptions by signals.
+ * The whole frame must be received within READ_TIMEOUT.
  *
- * @param sockfd The file descriptor of the socket.
- * @param buffer A pointer to the buffer containing the data to be sent.
- * @param length The length of the buffer in bytes.
- * @return The total number of bytes sent, or -1 if an error occurred.
+ * @param size The expected size of the data to be read.
+ * @param data A pointer to a buffer where the read data will be stored.
+ * @return The number of bytes read on success, or -1 on failure with errno
+ *         set to ETIMEDOUT when the frame was not received in time.
+ */
+static int mac_read(mac_t *mac, int size, uint8_t *data)
+{
+    timeout_t deadline;
+    int status;
+
+    set_timeout(&deadline, READ_TIMEOUT);
+    status = mac_read_deadline(mac, size, data, size, &deadline);
+    if(0 == status && size > 0){
+        ERROR("MacSocketPacket: Timeout while receiving frame");
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return status;
+}
+
+/**
+ * @brief Sends a data frame that is split over multiple buffers.
  *
+ * The frame header and all buffers are passed to a single sendmsg call, so
+ * that the frame is sent with one system call in the common case. Partial
+ * sends are continued until the whole frame is sent. With io_uring the read
+ * of the response is submitted together with the frame.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the data frame.
+ * @return The number of data bytes sent on success, or -1 on failure.
  */
-static ssize_t send_all(int sockfd, const void *buffer, size_t length) {
-    const char *ptr = (const char *)buffer;
-    size_t total_sent = 0;
-    ssize_t bytes_sent;
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov)
+{
+    struct socket_packet_mac_ctx *ctx = mac->ctx;
+    uint8_t header[HEADER_SIZE] = {'M','D','F','U',0,0,0,0};
+    struct iovec vector[MAC_IOVEC_MAX + 1];
+    struct msghdr message = {0};
+    ssize_t status;
+    int size;
 
-    while (total_sent < length) {
-        bytes_sent = send(sockfd, ptr + total_sent, length - total_sent, 0);
-        if (bytes_sent == -1) {
-            if (errno == EINTR) {
-                // Interrupted by a signal, retry sending
-                continue;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Non-blocking mode and no data can be sent right now, retry sending
+    size = mac_iovec_to_iovec(count, iov, &vector[1]);
+    if(size < 0){
+        return -1;
+    }
+    header[4] = size & 0xff;
+    header[5] = (size >> 8) & 0xff;
+    header[6] = (size >> 16) & 0xff;
+    header[7] = (size >> 24) & 0xff;
+    vector[0].iov_base = header;
+    vector[0].iov_len = HEADER_SIZE;
+    count += 1;
+#ifdef USE_IO_URING
+    if(uring_io_active(&ctx->uring)){
+        rx_compact(ctx);
+        if(uring_io_writev(&ctx->uring, vector, count, (size_t) ctx->rx_count) < 0){
+            ERROR("MacSocketPacket: %s", strerror(errno));
+            return -1;
+        }
+        return size;
+    }
+#endif
+
+    message.msg_iov = vector;
+    while(count > 0){
+        message.msg_iovlen = count;
+        status = sendmsg(ctx->sock, &message, 0);
+        if(status < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
                 continue;
-            } else {
-                // An error occurred
-                ERROR("MacSocketPacket: %s", strerror(errno));
-                return -1;
             }
+            ERROR("MacSocketPacket: %s", strerror(errno));
+            return -1;
         }
-        total_sent += bytes_sent;
+        count = mac_iovec_consume(count, &message.msg_iov, (size_t) status);
     }
-    return total_sent;
+    return size;
 }
 
 /**
  * @brief Sends a data frame with a specific header over a socket.
  *
- * This function constructs a header with the format "MDFU" followed by the size of the data frame.
- * It then sends the header and the data frame over a socket.
+ * The frame header and the data are sent with a single sendmsg call.
  *
  * @param size The size of the data frame to be sent.
  * @param data A pointer to the data frame to be sent.
  * @return The number of bytes sent on success, or -1 on failure.
- *
  */
-static int mac_write(int size, uint8_t *data)
+static int mac_write(mac_t *mac, int size, uint8_t *data)
 {
-    ssize_t status;
-    uint8_t header[HEADER_SIZE] = {'M','D','F','U',0,0,0,0};
-    uint32_t frame_size = size;
-
-    header[4] = frame_size & 0xff;
-    header[5] = (frame_size >> 8) & 0xff;
-    header[6] = (frame_size >> 16) & 0xff;
-    header[7] = (frame_size >> 24) & 0xff;
+    mac_iovec_t iov = {.data = data, .size = size};
 
-    status = send_all(sock, header, HEADER_SIZE);
-    if(status < 0){
-        return -1;
-    }
-    status = send_all(sock, data, size);
-    if(status < 0){
-        return -1;
-    }
-    return status;
+    return mac_writev(mac, 1, &iov);
 }
 
-mac_t network_packet_mac = {
+static const mac_t network_packet_mac = {
     .open = mac_open,
     .close = mac_close,
     .init = mac_init,
     .write = mac_write,
-    .read = mac_read
+    .read = mac_read,
+    .read_deadline = mac_read_deadline,
+    .writev = mac_writev
 };
 
-
-void get_socket_packet_mac(mac_t **mac){
-    *mac = &network_packet_mac;
+/**
+ * @brief Create a new socket packet MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_socket_packet_mac(mac_t **mac){
+    return mac_alloc(&network_packet_mac, sizeof(struct socket_packet_mac_ctx), mac);
 }
@@ -1,5 +1,7 @@
+#define _POSIX_C_SOURCE 200809L // posix_memalign
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -14,25 +16,54 @@
 #include "mdfu/logging.h"
 
 #define PATH_NAME_MAX_SIZE 256
+/**
+ * @brief Maximum number of bytes that a SPI transport frame adds to a MDFU packet.
+ */
+#define FRAME_OVERHEAD_MAX_SIZE 8
+/**
+ * @brief Initial size of the receive buffer, large enough for the largest SPI
+ * transport frame of the default MDFU packet size. The buffer grows for larger
+ * frames.
+ */
+#define RX_BUFFER_SIZE ((MDFU_MAX_COMMAND_DATA_LENGTH > MDFU_MAX_RESPONSE_DATA_LENGTH ? \
+                         MDFU_MAX_COMMAND_DATA_LENGTH : MDFU_MAX_RESPONSE_DATA_LENGTH) + FRAME_OVERHEAD_MAX_SIZE)
+/**
+ * @brief spidev module parameter with the maximum size of a SPI message.
+ */
+#define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+/**
+ * @brief Maximum size of a SPI message when the module parameter cannot be read,
+ * this is the spidev default.
+ */
+#define SPIDEV_BUFSIZ_DEFAULT 4096
+/**
+ * @brief Maximum number of transfers in one SPI message.
+ */
+#define MESSAGE_MAX_TRANSFERS 16
 
-static char rx_buffer[MDFU_MAX_COMMAND_DATA_LENGTH];
-
+/**
+ * @brief spidev MAC instance state.
+ */
 typedef struct {
     int fd;
     uint8_t mode;
     uint8_t bits_per_word;
     uint32_t speed;
     char path[PATH_NAME_MAX_SIZE];
-    char *rx_buffer;
+    struct gpio_ready_config ready_config;
+    gpio_ready_t ready;
+    /** @brief Maximum number of bytes that spidev accepts in one SPI message. */
+    size_t bufsiz;
+    /** @brief Transfers of the SPI message that is being assembled. */
+    struct spi_ioc_transfer message[MESSAGE_MAX_TRANSFERS];
+    int message_count;
+    size_t message_size;
     int rx_data_length;
+    size_t rx_buffer_size;
+    /** @brief Page aligned receive buffer, allocated on open and reused for all transfers. */
+    uint8_t *rx_buffer;
 } spi_device_t;
-
-static spi_device_t device = {
-    .fd = -1,
-    .rx_buffer = rx_buffer,
-    .rx_data_length = 0
-};
-
+static int mac_wait_ready(mac_t *mac, timeout_t *deadline);
 
 /**
  * @brief Initializes the MAC with the given configuration.
@@ -53,10 +84,11 @@ static spi_device_t device = {
  *       - `EBUSY`: The device is already opened.
  *       - `EINVAL`: The path name length exceeds the maximum allowed size.
  */
-static int mac_init(void *conf)
+static int mac_init(mac_t *mac, void *conf)
 {
+    spi_device_t *device = mac->ctx;
     struct spidev_config *config = (struct spidev_config *) conf;
-    if(device.fd != -1){
+    if(device->fd != -1){
         ERROR("Cannot initialize while MAC is opened.");
         errno = EBUSY;
         return -1;
@@ -68,44 +100,122 @@ static int mac_init(void *conf)
         errno = EINVAL;
         return -1;
     }
-    strncpy(device.path, config->path, PATH_NAME_MAX_SIZE);
-    device.mode = config->mode;
-    device.bits_per_word = config->bits_per_word;
-    device.speed = config->speed;
+    strncpy(device->path, config->path, PATH_NAME_MAX_SIZE);
+    device->mode = config->mode;
+    device->bits_per_word = config->bits_per_word;
+    device->speed = config->speed;
+    device->ready_config = config->ready_gpio;
+    mac->wait_ready = ('\0' != device->ready_config.chip[0]) ? mac_wait_ready : NULL;
+    return 0;
+}
+
+/**
+ * @brief Read the maximum SPI message size from the spidev module parameter.
+ *
+ * @return size_t Maximum message size in bytes, SPIDEV_BUFSIZ_DEFAULT if the
+ *         parameter cannot be read.
+ */
+static size_t read_spidev_bufsiz(void)
+{
+    FILE *file = fopen(SPIDEV_BUFSIZ_PATH, "r");
+    unsigned long bufsiz = 0;
+
+    if(NULL != file){
+        if(1 != fscanf(file, "%lu", &bufsiz)){
+            bufsiz = 0;
+        }
+        fclose(file);
+    }
+    if(0 == bufsiz){
+        DEBUG("Could not read %s, using a SPI message size of %d", SPIDEV_BUFSIZ_PATH, SPIDEV_BUFSIZ_DEFAULT);
+        return SPIDEV_BUFSIZ_DEFAULT;
+    }
+    return (size_t) bufsiz;
+}
+
+/**
+ * @brief Make sure the receive buffer holds at least size bytes.
+ *
+ * The buffer is page aligned and its size is a multiple of the page size, so
+ * that the SPI controller driver can use it for DMA without bounce buffers.
+ *
+ * @param device spidev MAC instance state.
+ * @param size Required size in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int reserve_rx_buffer(spi_device_t *device, size_t size)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    void *buffer;
+    int status;
+
+    if(size <= device->rx_buffer_size){
+        return 0;
+    }
+    size = (size + page_size - 1) / page_size * page_size;
+    status = posix_memalign(&buffer, page_size, size);
+    if(0 != status){
+        errno = status;
+        return -1;
+    }
+    free(device->rx_buffer);
+    device->rx_buffer = buffer;
+    device->rx_buffer_size = size;
     return 0;
 }
 
-static int mac_open(void)
+static int mac_open(mac_t *mac)
 {
+    spi_device_t *device = mac->ctx;
     DEBUG("Opening spidev MAC");
-    if(device.fd != -1){
+    if(device->fd != -1){
         errno = EBUSY;
         return -1;
     }
 
-    device.fd = open(device.path, O_RDWR);
-    if (device.fd < 0) {
+    device->fd = open(device->path, O_RDWR);
+    if (device->fd < 0) {
         perror("Failed to open SPI device");
         return -1;
     }
 
-    if (ioctl(device.fd, SPI_IOC_WR_MODE, &device.mode) < 0 ||
-        ioctl(device.fd, SPI_IOC_WR_BITS_PER_WORD, &device.bits_per_word) < 0 ||
-        ioctl(device.fd, SPI_IOC_WR_MAX_SPEED_HZ, &device.speed) < 0) {
+    if (ioctl(device->fd, SPI_IOC_WR_MODE, &device->mode) < 0 ||
+        ioctl(device->fd, SPI_IOC_WR_BITS_PER_WORD, &device->bits_per_word) < 0 ||
+        ioctl(device->fd, SPI_IOC_WR_MAX_SPEED_HZ, &device->speed) < 0) {
         perror("Failed to set SPI parameters");
-        close(device.fd);
-        device.fd = -1;
+        close(device->fd);
+        device->fd = -1;
         return -1;
     }
+    if(reserve_rx_buffer(device, RX_BUFFER_SIZE) < 0){
+        ERROR("Failed to allocate SPI buffer: %s", strerror(errno));
+        close(device->fd);
+        device->fd = -1;
+        return -1;
+    }
+    if('\0' != device->ready_config.chip[0] && gpio_ready_open(&device->ready, &device->ready_config) < 0){
+        close(device->fd);
+        device->fd = -1;
+        return -1;
+    }
+    device->bufsiz = read_spidev_bufsiz();
+    device->message_count = 0;
+    device->message_size = 0;
+    device->rx_data_length = 0;
     return 0;
 }
 
-static int mac_close(void)
+static int mac_close(mac_t *mac)
 {
+    spi_device_t *device = mac->ctx;
     DEBUG("Closing SPI MAC");
-    if(device.fd != -1){
-        close(device.fd);
-        device.fd = -1;
+    if(device->fd != -1){
+        close(device->fd);
+        device->fd = -1;
+        gpio_ready_close(&device->ready);
+        free(device->rx_buffer);
+        device->rx_buffer = NULL;
+        device->rx_buffer_size = 0;
         return 0;
     } else {
         errno = EBADF;
@@ -114,60 +224,209 @@ static int mac_close(void)
 }
 
 
-static int spi_transfer(uint8_t *tx_buffer, uint8_t *rx_buffer, size_t length) {
-    if (device.fd < 0 || !tx_buffer || !rx_buffer || length == 0) return -1;
-    assert(device.fd >= 0);
-
-    struct spi_ioc_transfer transfer = {
-        .tx_buf = (unsigned long)tx_buffer,
-        .rx_buf = (unsigned long)rx_buffer,
-        .len = length,
-        .speed_hz = device.speed,
-        .bits_per_word = device.bits_per_word,
-    };
+/**
+ * @brief Send the assembled SPI message.
+ *
+ * spidev rejects messages with more than bufsiz bytes, so larger transactions
+ * are sent as several messages. The chip select of the last transfer is kept
+ * asserted after the message when the transaction continues in the next one.
+ *
+ * @param device spidev MAC instance state.
+ * @param hold_cs Keep the chip select asserted after the message.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int flush_message(spi_device_t *device, bool hold_cs)
+{
+    int count = device->message_count;
 
-    if (ioctl(device.fd, SPI_IOC_MESSAGE(1), &transfer) < 0) {
+    if(0 == count){
+        return 0;
+    }
+    // On the last transfer of a message cs_change keeps the chip select asserted
+    device->message[count - 1].cs_change = hold_cs ? 1 : 0;
+    device->message_count = 0;
+    device->message_size = 0;
+    // Only a ready signal after this transaction is for the next response
+    if(device->ready.fd >= 0 && gpio_ready_discard(&device->ready) < 0){
+        return -1;
+    }
+    if(ioctl(device->fd, SPI_IOC_MESSAGE(count), device->message) < 0){
         ERROR("Failed to perform SPI transfer: %s", strerror(errno));
         return -1;
     }
+    return 0;
+}
+
+/**
+ * @brief Add a SPI transaction to the message, split into segments of at most bufsiz bytes.
+ *
+ * The chip select stays asserted between the segments of the transaction.
+ * Segments are added to the message until it is full, then the message is
+ * sent and the next one is started.
+ *
+ * @param device spidev MAC instance state.
+ * @param tx_buffer Data to send.
+ * @param rx_buffer Buffer for the received data.
+ * @param length Number of bytes to exchange.
+ * @param delay_us Delay after the transaction in microseconds.
+ * @param release_cs Release the chip select after the transaction.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int add_transaction(spi_device_t *device, const uint8_t *tx_buffer, uint8_t *rx_buffer,
+                           size_t length, uint16_t delay_us, bool release_cs)
+{
+    size_t offset = 0;
+
+    do {
+        struct spi_ioc_transfer *transfer;
+        size_t segment_size;
+
+        if(device->message_size >= device->bufsiz || MESSAGE_MAX_TRANSFERS == device->message_count){
+            // A message ending in the middle of the transaction holds the chip select
+            if(flush_message(device, offset > 0) < 0){
+                return -1;
+            }
+        }
+        segment_size = length - offset;
+        if(segment_size > device->bufsiz - device->message_size){
+            segment_size = device->bufsiz - device->message_size;
+        }
+        transfer = &device->message[device->message_count++];
+        memset(transfer, 0, sizeof(*transfer));
+        transfer->tx_buf = (unsigned long) (tx_buffer + offset);
+        transfer->rx_buf = (unsigned long) (rx_buffer + offset);
+        transfer->len = segment_size;
+        transfer->speed_hz = device->speed;
+        transfer->bits_per_word = device->bits_per_word;
+        device->message_size += segment_size;
+        offset += segment_size;
+    } while(offset < length);
+    device->message[device->message_count - 1].delay_usecs = delay_us;
+    // Within a message cs_change releases the chip select after the transfer
+    device->message[device->message_count - 1].cs_change = release_cs ? 1 : 0;
+    return 0;
+}
 
+static int spi_transfer(spi_device_t *device, uint8_t *tx_buffer, uint8_t *rx_buffer, size_t length) {
+    if (device->fd < 0 || !tx_buffer || !rx_buffer || length == 0) return -1;
+    assert(device->fd >= 0);
+
+    if(add_transaction(device, tx_buffer, rx_buffer, length, 0, true) < 0 ||
+        flush_message(device, false) < 0){
+        device->message_count = 0;
+        device->message_size = 0;
+        return -1;
+    }
     return 0;
 }
 
-static int mac_read(int size, uint8_t *data)
+static int mac_read(mac_t *mac, int size, uint8_t *data)
 {
+    spi_device_t *device = mac->ctx;
     int status;
     
-    if(device.rx_data_length != size){
+    if(device->rx_data_length != size){
         ERROR("spidev MAC read size must match last write size: %s", strerror(errno));
-        ERROR("Requested size was %d and buffer contains %d", size, device.rx_data_length);
+        ERROR("Requested size was %d and buffer contains %d", size, device->rx_data_length);
         return -1;
     }
 
-    memcpy(data, device.rx_buffer, size);
-    device.rx_data_length = 0;
-    return 0;
+    memcpy(data, device->rx_buffer, size);
+    device->rx_data_length = 0;
+    return size;
 }
 
-static int mac_write(int size, uint8_t *data)
+static int mac_write(mac_t *mac, int size, uint8_t *data)
 {
-    if(spi_transfer(data, device.rx_buffer, size) < 0){
+    spi_device_t *device = mac->ctx;
+    if(device->fd < 0){
+        errno = EBADF;
+        return -1;
+    }
+    if(reserve_rx_buffer(device, (size_t) size) < 0){
+        ERROR("spidev MAC write size %d exceeds buffer size %zu", size, device->rx_buffer_size);
+        return -1;
+    }
+    if(spi_transfer(device, data, device->rx_buffer, size) < 0){
         ERROR("Serial MAC write: %s", strerror(errno));
         return -1;
     }
-    device.rx_data_length = size;
+    device->rx_data_length = size;
     return 0;
 }
 
-mac_t spidev_mac = {
+/**
+ * @brief Performs a batch of SPI transactions with as few ioctls as possible.
+ *
+ * The chip select is released after each segment except the last one and
+ * the segment delay is inserted before the chip select is released. Segments
+ * that do not fit into one spidev message are split like in spi_transfer.
+ *
+ * @param mac MAC instance.
+ * @param count Number of segments.
+ * @param segments Segments to transfer.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_transfer(mac_t *mac, int count, mac_segment_t *segments)
+{
+    spi_device_t *device = mac->ctx;
+    int status = 0;
+
+    if(device->fd < 0){
+        errno = EBADF;
+        return -1;
+    }
+    if(count < 1 || count > MAC_TRANSFER_MAX_SEGMENTS){
+        errno = EINVAL;
+        return -1;
+    }
+    for(int i = 0; 0 == status && i < count; i++){
+        status = add_transaction(device, segments[i].tx_data, segments[i].rx_data, (size_t) segments[i].size,
+                                 segments[i].delay_us, i < count - 1);
+    }
+    if(0 == status){
+        status = flush_message(device, false);
+    }
+    device->message_count = 0;
+    device->message_size = 0;
+    device->rx_data_length = 0;
+    return status;
+}
+
+/**
+ * @brief Wait for the client to signal a ready response on the ready GPIO.
+ *
+ * @param mac MAC instance.
+ * @param deadline Time when to stop waiting.
+ * @return int 1 if the client signalled, 0 if the deadline expired or -1 on error.
+ */
+static int mac_wait_ready(mac_t *mac, timeout_t *deadline)
+{
+    spi_device_t *device = mac->ctx;
+
+    return gpio_ready_wait(&device->ready, deadline);
+}
+
+const mac_t spidev_mac = {
     .open = mac_open,
     .close = mac_close,
     .init = mac_init,
     .write = mac_write,
-    .read = mac_read
+    .read = mac_read,
+    .transfer = mac_transfer
 };
 
-
-void get_spidev_mac(mac_t **mac){
-    *mac = &spidev_mac;
+/**
+ * @brief Create a new spidev MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_spidev_mac(mac_t **mac){
+    if(mac_alloc(&spidev_mac, sizeof(spi_device_t), mac) < 0){
+        return -1;
+    }
+    ((spi_device_t *) (*mac)->ctx)->fd = -1;
+    ((spi_device_t *) (*mac)->ctx)->ready.fd = -1;
+    return 0;
 }
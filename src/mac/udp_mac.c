@@ -0,0 +1,403 @@
+/**
+ * @file udp_mac.c
+ * @brief Datagram socket MAC.
+ *
+ * Sends each transport frame as one UDP datagram and returns the received
+ * datagrams in order. Lost datagrams are not repeated by this layer, they
+ * show up as transport timeouts that the MDFU retry logic recovers from.
+ */
+#define _GNU_SOURCE // recvmmsg
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> // close()
+#include <strings.h> // bzero()
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "mdfu/mac/socket_mac.h"
+#include "mdfu/mac/socket_connect.h"
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+
+/**
+ * @def READ_WAIT_TIME
+ * @brief Time in seconds that mac_read waits for a datagram.
+ */
+#define READ_WAIT_TIME 5.0f
+
+/**
+ * @def UDP_DATAGRAM_SIZE
+ * @brief Maximum size of a received datagram.
+ */
+#define UDP_DATAGRAM_SIZE 4096
+
+/**
+ * @def UDP_RX_QUEUE_SIZE
+ * @brief Number of datagrams that are received with one system call.
+ *
+ * Responses to pipelined commands can arrive back to back, so all that are
+ * queued in the socket are fetched at once.
+ */
+#define UDP_RX_QUEUE_SIZE 16
+
+/**
+ * @def HOST_NAME_MAX_SIZE
+ * @brief Size of the buffer for the host name or address.
+ */
+#define HOST_NAME_MAX_SIZE 256
+
+/**
+ * @def CONNECT_TIMEOUT
+ * @brief Time in seconds to resolve the host and set up the socket.
+ */
+#define CONNECT_TIMEOUT 5.0f
+
+/**
+ * @brief Received datagram.
+ */
+struct udp_datagram {
+    int size;
+    uint8_t data[UDP_DATAGRAM_SIZE];
+};
+
+/**
+ * @brief UDP MAC instance state.
+ *
+ * The receive queue holds rx_count datagrams starting at rx_first,
+ * rx_offset is the number of bytes already consumed from the first one.
+ */
+struct udp_mac_ctx {
+    int sock;
+    char host[HOST_NAME_MAX_SIZE];
+    uint16_t port;
+    socket_connect_t connection;
+    bool opened;
+    int rx_first;
+    int rx_count;
+    int rx_offset;
+    struct udp_datagram rx_queue[UDP_RX_QUEUE_SIZE];
+};
+
+/**
+ * @brief Initializes the MAC and resolves the host.
+ *
+ * @param mac MAC instance.
+ * @param conf Socket configuration with the host name or address and port.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int mac_init(mac_t *mac, void *conf)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+    struct socket_config *config = (struct socket_config *) conf;
+
+    DEBUG("Initializing UDP MAC");
+    if(ctx->opened){
+        errno = EBUSY;
+        return -1;
+    }
+    if(strlen(config->host) >= HOST_NAME_MAX_SIZE){
+        ERROR("UDP MAC: Host name %s is too long", config->host);
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(ctx->host, config->host);
+    ctx->port = config->port;
+    socket_connect_cancel(&ctx->connection);
+    return socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_DGRAM, CONNECT_TIMEOUT);
+}
+
+static int mac_open(mac_t *mac)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+
+    DEBUG("Opening UDP MAC");
+    if(ctx->opened){
+        errno = EBUSY;
+        return -EBUSY;
+    }
+    // Connecting sets the default destination and drops datagrams from other peers
+    if(NULL == ctx->connection.addresses &&
+        socket_connect_start(&ctx->connection, ctx->host, ctx->port, SOCK_DGRAM, CONNECT_TIMEOUT) < 0){
+        return -1;
+    }
+    ctx->sock = socket_connect_finish(&ctx->connection);
+    if(ctx->sock < 0){
+        ERROR("UDP MAC connect to host %s on port %u failed", ctx->host, (unsigned int) ctx->port);
+        return -1;
+    }
+    ctx->rx_first = 0;
+    ctx->rx_count = 0;
+    ctx->rx_offset = 0;
+    ctx->opened = true;
+    return 0;
+}
+
+static int mac_close(mac_t *mac)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+    // Stops a connection that was started but not opened
+    socket_connect_cancel(&ctx->connection);
+    if(ctx->opened){
+        close(ctx->sock);
+        ctx->opened = false;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+/**
+ * @brief Receive all queued datagrams into the empty receive queue.
+ *
+ * @param ctx MAC instance state.
+ * @param deadline Time when to stop waiting for a datagram.
+ * @return int Number of datagrams received, 0 if the deadline expired or -1 on error.
+ */
+static int rx_fill(struct udp_mac_ctx *ctx, timeout_t *deadline)
+{
+    struct pollfd pfd = {.fd = ctx->sock, .events = POLLIN};
+    struct mmsghdr messages[UDP_RX_QUEUE_SIZE];
+    struct iovec vector[UDP_RX_QUEUE_SIZE];
+    int status;
+
+    memset(messages, 0, sizeof(messages));
+    for(int i = 0; i < UDP_RX_QUEUE_SIZE; i++){
+        vector[i].iov_base = ctx->rx_queue[i].data;
+        vector[i].iov_len = UDP_DATAGRAM_SIZE;
+        messages[i].msg_hdr.msg_iov = &vector[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    while(true){
+        status = timeout_remaining_ms(deadline);
+        if(status < 0){
+            return -1;
+        }
+        status = poll(&pfd, 1, status);
+        if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            ERROR("UDP MAC read: %s", strerror(errno));
+            return -1;
+        }
+        if(status == 0){
+            return 0;
+        }
+        status = recvmmsg(ctx->sock, messages, UDP_RX_QUEUE_SIZE, MSG_DONTWAIT, NULL);
+        if(status < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
+                continue;
+            }
+            // E.g. ECONNREFUSED when an earlier datagram was not delivered
+            ERROR("UDP MAC read: %s", strerror(errno));
+            return -1;
+        }
+        for(int i = 0; i < status; i++){
+            if(messages[i].msg_hdr.msg_flags & MSG_TRUNC){
+                WARN("UDP MAC read: Datagram larger than %d bytes truncated", UDP_DATAGRAM_SIZE);
+            }
+            ctx->rx_queue[i].size = (int) messages[i].msg_len;
+        }
+        ctx->rx_first = 0;
+        ctx->rx_count = status;
+        ctx->rx_offset = 0;
+        return status;
+    }
+}
+
+/**
+ * @brief Take data from the first datagram in the receive queue.
+ *
+ * Datagrams are released when all of their data is taken.
+ *
+ * @param ctx MAC instance state.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the data.
+ * @return int Number of bytes taken.
+ */
+static int rx_take(struct udp_mac_ctx *ctx, int size, uint8_t *data)
+{
+    struct udp_datagram *datagram = &ctx->rx_queue[ctx->rx_first];
+    int count = datagram->size - ctx->rx_offset;
+
+    if(count > size){
+        count = size;
+    }
+    memcpy(data, &datagram->data[ctx->rx_offset], (size_t) count);
+    ctx->rx_offset += count;
+    if(ctx->rx_offset == datagram->size){
+        ctx->rx_first += 1;
+        ctx->rx_count -= 1;
+        ctx->rx_offset = 0;
+    }
+    return count;
+}
+
+/**
+ * @brief Read one datagram or wait up to READ_WAIT_TIME for it.
+ *
+ * Each read returns data of a single datagram so that the packet transports
+ * receive one frame per read. A datagram that is larger than the buffer is
+ * returned by multiple reads.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @return int Number of bytes read, or -1 on error with errno set to
+ *         ETIMEDOUT if no datagram was received.
+ */
+static int mac_read(mac_t *mac, int size, uint8_t *data)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+    timeout_t deadline;
+    int status;
+
+    if(0 == ctx->rx_count){
+        set_timeout(&deadline, READ_WAIT_TIME);
+        status = rx_fill(ctx, &deadline);
+        if(status < 0){
+            return -1;
+        }
+        if(status == 0){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return rx_take(ctx, size, data);
+}
+
+/**
+ * @brief Read datagrams until enough data is received or a deadline expires.
+ *
+ * The data of consecutive datagrams is concatenated, which is how the serial
+ * transports read their byte stream.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+    int received = 0;
+    int status;
+
+    do {
+        if(0 == ctx->rx_count){
+            status = rx_fill(ctx, deadline);
+            if(status < 0){
+                return -1;
+            }
+            if(status == 0){
+                break;
+            }
+        }
+        received += rx_take(ctx, size - received, &data[received]);
+    } while(received < min_size || (received < size && ctx->rx_count > 0));
+    return received;
+}
+
+/**
+ * @brief Sends a frame that is split over multiple buffers as one datagram.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the frame.
+ * @return The number of bytes sent on success, or -1 on failure.
+ */
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+    struct iovec vector[MAC_IOVEC_MAX];
+    struct msghdr message = {0};
+    ssize_t status;
+    int size;
+
+    size = mac_iovec_to_iovec(count, iov, vector);
+    if(size < 0){
+        return -1;
+    }
+    message.msg_iov = vector;
+    message.msg_iovlen = count;
+    do {
+        status = sendmsg(ctx->sock, &message, 0);
+    } while(status < 0 && errno == EINTR);
+    if(status < 0){
+        ERROR("UDP MAC send: %s", strerror(errno));
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * @brief Sends a frame as one datagram.
+ *
+ * @param mac MAC instance.
+ * @param size The size of the frame.
+ * @param data The frame.
+ * @return The number of bytes sent on success, or -1 on failure.
+ */
+static int mac_write(mac_t *mac, int size, uint8_t *data)
+{
+    mac_iovec_t iov = {.data = data, .size = size};
+
+    return mac_writev(mac, 1, &iov);
+}
+
+/**
+ * @brief Get the file descriptor of the socket.
+ *
+ * @param mac MAC instance.
+ * @return int File descriptor, or -1 if the MAC is not open.
+ */
+static int mac_get_fd(mac_t *mac)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+
+    return ctx->opened ? ctx->sock : -1;
+}
+
+/**
+ * @brief Check if received data is waiting in the receive queue.
+ *
+ * @param mac MAC instance.
+ * @return bool True if a read returns data without waiting for the socket.
+ */
+static bool mac_has_data(mac_t *mac)
+{
+    struct udp_mac_ctx *ctx = mac->ctx;
+
+    return ctx->rx_count > 0;
+}
+
+static const mac_t udp_mac = {
+    .open = mac_open,
+    .close = mac_close,
+    .init = mac_init,
+    .write = mac_write,
+    .read = mac_read,
+    .read_deadline = mac_read_deadline,
+    .writev = mac_writev,
+    .get_fd = mac_get_fd,
+    .has_data = mac_has_data
+};
+
+/**
+ * @brief Create a new UDP MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_udp_mac(mac_t **mac){
+    return mac_alloc(&udp_mac, sizeof(struct udp_mac_ctx), mac);
+}
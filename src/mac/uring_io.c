@@ -0,0 +1,442 @@
+/**
+ * @file uring_io.c
+ * @brief io_uring based frame exchange for the serial and socket MACs.
+ *
+ * A frame write is submitted as one chain with a poll and a read of the
+ * response into the registered receive buffer of the MAC:
+ *
+ *     WRITEV -> POLL_ADD(POLLIN) -> READ_FIXED
+ *
+ * The poll makes the read wait for data also on serial ports, which return
+ * immediately from reads without data. The host only enters the kernel to
+ * submit the chain and to collect the completions, instead of a write, a poll
+ * and a read system call for each frame. The waits are bounded by the
+ * deadline of the caller, a read that did not complete stays pending so that
+ * no received data is lost, and is cancelled when the MAC is closed.
+ *
+ * The rings are set up with the system calls directly, so no library is
+ * needed. Kernels older than 5.11, or where io_uring is disabled, fail the
+ * setup and the MACs fall back to poll and read.
+ */
+#define _GNU_SOURCE // syscall()
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "mdfu/mac/mac.h"
+#include "mdfu/mac/uring_io.h"
+#include "mdfu/logging.h"
+
+/**
+ * @brief Number of submission queue entries, a write chain takes three and
+ * cancelling the read two.
+ */
+#define URING_ENTRIES 8
+
+/**
+ * @brief Time in seconds to wait for a cancelled read when the ring is closed.
+ */
+#define URING_CANCEL_TIMEOUT 1.0f
+
+/**
+ * @brief Tags of the submissions in the completion entries.
+ */
+enum uring_tag {
+    URING_WRITE = 1,
+    URING_POLL,
+    URING_READ,
+    URING_CANCEL,
+    URING_NOTIFY
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params){
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring, unsigned int submit, unsigned int wait, unsigned int flags, void *arg, size_t arg_size){
+    return (int) syscall(__NR_io_uring_enter, ring, submit, wait, flags, arg, arg_size);
+}
+
+static int uring_register(int ring, unsigned int opcode, void *arg, unsigned int count){
+    return (int) syscall(__NR_io_uring_register, ring, opcode, arg, count);
+}
+
+/**
+ * @brief Release the mapped rings and close the ring file descriptor.
+ *
+ * @param io Ring state.
+ */
+static void unmap_rings(uring_io_t *io){
+    if(NULL != io->sqes){
+        munmap(io->sqes, io->sqes_size);
+        io->sqes = NULL;
+    }
+    if(NULL != io->cq_map){
+        munmap(io->cq_map, io->cq_map_size);
+        io->cq_map = NULL;
+    }
+    if(NULL != io->sq_map){
+        munmap(io->sq_map, io->sq_map_size);
+        io->sq_map = NULL;
+    }
+    if(io->ring >= 0){
+        close(io->ring);
+        io->ring = -1;
+    }
+}
+
+/**
+ * @brief Map a ring of the io_uring instance.
+ *
+ * @param io Ring state.
+ * @param size Size of the ring.
+ * @param offset Offset that selects the ring.
+ * @return void* Mapped ring, or NULL on error.
+ */
+static void *map_ring(uring_io_t *io, size_t size, off_t offset){
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring, offset);
+
+    return MAP_FAILED == map ? NULL : map;
+}
+
+/**
+ * @brief Set up the ring for a MAC.
+ *
+ * The receive buffer is registered with the ring, so that the kernel does
+ * not map it for each read. When registering fails, e.g. because of the
+ * locked memory limit, the buffer is read with plain reads.
+ *
+ * @param io Ring state.
+ * @param fd File descriptor of the MAC.
+ * @param buffer Receive buffer, it must stay valid until the ring is closed.
+ * @param size Size of the receive buffer.
+ * @return int 0 on success, -1 when io_uring is not available with errno set.
+ */
+int uring_io_open(uring_io_t *io, int fd, uint8_t *buffer, size_t size){
+    struct io_uring_params params;
+    struct iovec registered = {.iov_base = buffer, .iov_len = size};
+
+    memset(io, 0, sizeof(*io));
+    memset(&params, 0, sizeof(params));
+    io->fd = fd;
+    io->buffer = buffer;
+    io->size = size;
+    io->ring = uring_setup(URING_ENTRIES, &params);
+    if(io->ring < 0){
+        DEBUG("io_uring setup failed: %s", strerror(errno));
+        return -1;
+    }
+    // Waits with a timeout need the extended enter arguments of Linux 5.11
+    if(0 == (params.features & IORING_FEAT_EXT_ARG)){
+        DEBUG("io_uring does not support wait timeouts");
+        unmap_rings(io);
+        errno = ENOSYS;
+        return -1;
+    }
+    io->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    io->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sq_map = map_ring(io, io->sq_map_size, IORING_OFF_SQ_RING);
+    io->cq_map = map_ring(io, io->cq_map_size, IORING_OFF_CQ_RING);
+    io->sqes = map_ring(io, io->sqes_size, IORING_OFF_SQES);
+    if(NULL == io->sq_map || NULL == io->cq_map || NULL == io->sqes){
+        int error = errno;
+
+        DEBUG("io_uring mapping failed: %s", strerror(error));
+        unmap_rings(io);
+        errno = error;
+        return -1;
+    }
+    io->sq_head = (unsigned int *) ((uint8_t *) io->sq_map + params.sq_off.head);
+    io->sq_tail = (unsigned int *) ((uint8_t *) io->sq_map + params.sq_off.tail);
+    io->sq_mask = (unsigned int *) ((uint8_t *) io->sq_map + params.sq_off.ring_mask);
+    io->sq_array = (unsigned int *) ((uint8_t *) io->sq_map + params.sq_off.array);
+    io->cq_head = (unsigned int *) ((uint8_t *) io->cq_map + params.cq_off.head);
+    io->cq_tail = (unsigned int *) ((uint8_t *) io->cq_map + params.cq_off.tail);
+    io->cq_mask = (unsigned int *) ((uint8_t *) io->cq_map + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) ((uint8_t *) io->cq_map + params.cq_off.cqes);
+    io->fixed_buffer = 0 == uring_register(io->ring, IORING_REGISTER_BUFFERS, &registered, 1);
+    if(!io->fixed_buffer){
+        DEBUG("io_uring buffer registration failed: %s", strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * @brief Check if the ring is set up.
+ *
+ * @param io Ring state.
+ * @return bool True when the MAC exchanges frames through the ring.
+ */
+bool uring_io_active(const uring_io_t *io){
+    return io->ring >= 0;
+}
+
+/**
+ * @brief Check if the kernel may store data in the receive buffer.
+ *
+ * While a read is pending or its result was not taken yet, the data in the
+ * receive buffer must not be moved.
+ *
+ * @param io Ring state.
+ * @return bool True when a read into the receive buffer was not taken yet.
+ */
+bool uring_io_busy(const uring_io_t *io){
+    return io->read_pending || io->read_done;
+}
+
+/**
+ * @brief Get a cleared submission queue entry.
+ *
+ * The entry is submitted with the next call of submit_wait.
+ *
+ * @param io Ring state.
+ * @param opcode Operation.
+ * @param tag Tag of the completion.
+ * @return struct io_uring_sqe* Submission queue entry.
+ */
+static struct io_uring_sqe *get_sqe(uring_io_t *io, uint8_t opcode, enum uring_tag tag){
+    unsigned int tail = *io->sq_tail;
+    unsigned int index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = io->fd;
+    sqe->user_data = tag;
+    io->sq_array[index] = index;
+    // The kernel only reads the entries in io_uring_enter, so the entry can
+    // be filled in after it was added
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * @brief Queue a poll for received data linked to a read into the receive buffer.
+ *
+ * @param io Ring state.
+ * @param offset Offset in the receive buffer where the data is stored.
+ */
+static void queue_read(uring_io_t *io, size_t offset){
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(io, IORING_OP_POLL_ADD, URING_POLL);
+    sqe->poll32_events = POLLIN;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = get_sqe(io, io->fixed_buffer ? IORING_OP_READ_FIXED : IORING_OP_READ, URING_READ);
+    sqe->addr = (uintptr_t) &io->buffer[offset];
+    sqe->len = (uint32_t) (io->size - offset);
+    io->read_pending = true;
+}
+
+/**
+ * @brief Take the completions from the completion queue.
+ *
+ * The write of a chain completes before the read starts. Stopping after the
+ * write leaves the completion of the read in the queue, so that the ring
+ * stays readable for callers that poll it until the read is taken.
+ *
+ * @param io Ring state.
+ * @param until_write Stop after the completion of the write.
+ */
+static void reap(uring_io_t *io, bool until_write){
+    unsigned int head = *io->cq_head;
+    unsigned int tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail){
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+
+        head++;
+        if(URING_WRITE == cqe->user_data){
+            io->write_pending = false;
+            io->write_result = cqe->res;
+            if(until_write){
+                break;
+            }
+        }else if(URING_READ == cqe->user_data){
+            io->read_pending = false;
+            io->read_done = true;
+            io->read_result = cqe->res;
+        }
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Submit the queued entries and wait for a completion.
+ *
+ * @param io Ring state.
+ * @param deadline Time when to stop waiting, NULL to wait without limit.
+ * @return int 0 on success, -1 on error with errno set to ETIME when the
+ *         deadline expired.
+ */
+static int submit_wait(uring_io_t *io, timeout_t *deadline){
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec wait_time;
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    unsigned int submit;
+    long long remaining;
+    int status;
+
+    memset(&arg, 0, sizeof(arg));
+    if(NULL != deadline){
+        remaining = timeout_remaining_ns(deadline);
+        if(remaining < 0){
+            return -1;
+        }
+        wait_time.tv_sec = remaining / 1000000000LL;
+        wait_time.tv_nsec = remaining % 1000000000LL;
+        arg.ts = (uintptr_t) &wait_time;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    // The kernel consumes the entries on submit, even if the wait is interrupted
+    submit = *io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+    status = uring_enter(io->ring, submit, 1, flags, NULL == deadline ? NULL : &arg, sizeof(arg));
+    if(status < 0 && EINTR == errno){
+        return 0;
+    }
+    return status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Write a frame and start receiving the response.
+ *
+ * The write is linked to a read into the receive buffer at offset unless a
+ * read is already pending or offset is at the end of the buffer. The read
+ * stays pending when the function returns, its data is taken with
+ * uring_io_read. The rest of a partial write is written directly.
+ *
+ * @param io Ring state.
+ * @param vector Buffers to write, modified for partial writes.
+ * @param count Number of buffers.
+ * @param offset Offset in the receive buffer where the response is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int uring_io_writev(uring_io_t *io, struct iovec *vector, int count, size_t offset){
+    struct io_uring_sqe *sqe;
+    ssize_t status;
+
+    sqe = get_sqe(io, IORING_OP_WRITEV, URING_WRITE);
+    sqe->addr = (uintptr_t) vector;
+    sqe->len = (uint32_t) count;
+    io->write_pending = true;
+    if(!uring_io_busy(io) && offset < io->size){
+        sqe->flags = IOSQE_IO_LINK;
+        queue_read(io, offset);
+    }
+    while(io->write_pending){
+        if(submit_wait(io, NULL) < 0){
+            return -1;
+        }
+        reap(io, true);
+    }
+    // A read that was pending before completed while waiting for the write,
+    // a no-op completion keeps the ring readable until the data is taken
+    if(io->read_done){
+        get_sqe(io, IORING_OP_NOP, URING_NOTIFY);
+        uring_enter(io->ring, 1, 0, 0, NULL, 0);
+    }
+    if(io->write_result < 0){
+        errno = -io->write_result;
+        return -1;
+    }
+    // A partial write breaks the chain, the read is restarted by uring_io_read
+    count = mac_iovec_consume(count, &vector, (size_t) io->write_result);
+    while(count > 0){
+        status = writev(io->fd, vector, count);
+        if(status < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            return -1;
+        }
+        count = mac_iovec_consume(count, &vector, (size_t) status);
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait for data in the receive buffer.
+ *
+ * Takes the result of the pending read, or starts a read into the receive
+ * buffer at offset when none is pending. When the deadline expires the read
+ * stays pending, so offset must not change until it completed.
+ *
+ * @param io Ring state.
+ * @param offset Offset in the receive buffer where the data is stored.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes received, 0 at the end of the stream or -1 on
+ *         error with errno set to ETIMEDOUT when the deadline expired.
+ */
+int uring_io_read(uring_io_t *io, size_t offset, timeout_t *deadline){
+    while(true){
+        reap(io, false);
+        if(io->read_done){
+            io->read_done = false;
+            if(-ECANCELED == io->read_result || -EINTR == io->read_result || -EAGAIN == io->read_result){
+                continue;
+            }
+            if(io->read_result < 0){
+                errno = -io->read_result;
+                return -1;
+            }
+            return io->read_result;
+        }
+        if(!io->read_pending){
+            if(offset >= io->size){
+                errno = ENOBUFS;
+                return -1;
+            }
+            queue_read(io, offset);
+        }
+        if(submit_wait(io, deadline) < 0){
+            if(ETIME != errno){
+                return -1;
+            }
+            reap(io, false);
+            if(!io->read_done){
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Cancel the pending read and release the ring.
+ *
+ * Must be called before the receive buffer is released or the file
+ * descriptor of the MAC is closed.
+ *
+ * @param io Ring state.
+ */
+void uring_io_close(uring_io_t *io){
+    timeout_t deadline;
+    struct io_uring_sqe *sqe;
+
+    if(io->ring < 0){
+        return;
+    }
+    if(io->read_pending || io->write_pending){
+        sqe = get_sqe(io, IORING_OP_ASYNC_CANCEL, URING_CANCEL);
+        sqe->addr = URING_POLL;
+        sqe = get_sqe(io, IORING_OP_ASYNC_CANCEL, URING_CANCEL);
+        sqe->addr = URING_READ;
+        set_timeout(&deadline, URING_CANCEL_TIMEOUT);
+        while(io->read_pending || io->write_pending){
+            if(submit_wait(io, &deadline) < 0 && EINTR != errno){
+                ERROR("io_uring read was not cancelled: %s", strerror(errno));
+                break;
+            }
+            reap(io, false);
+        }
+    }
+    unmap_rings(io);
+    io->read_done = false;
+}
@@ -0,0 +1,809 @@
+/**
+ * @file usb_mac.c
+ * @brief USB CDC MAC that drives the bulk endpoints with libusb.
+ *
+ * The MAC claims the CDC data interface of a USB serial bridge or debugger
+ * and exchanges the data with asynchronous bulk transfers instead of going
+ * through the tty layer. USB_RX_TRANSFERS bulk IN transfers are kept queued
+ * so that the device can send as soon as it has data, and the received data
+ * is collected in a ring buffer that the reads take it from. Writes are
+ * copied into one of USB_TX_TRANSFERS bulk OUT transfers and return when the
+ * transfer is submitted, so several frames can be on the bus at the same time.
+ *
+ * libusb calls the transfer callbacks from libusb_handle_events in the thread
+ * that reads or writes, so the state needs no locking.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <libusb.h>
+#include "mdfu/mac/usb_mac.h"
+#include "mdfu/logging.h"
+#include "mdfu/timeout.h"
+
+/**
+ * @brief Number of bulk IN transfers that are kept queued.
+ */
+#define USB_RX_TRANSFERS 4
+
+/**
+ * @brief Number of bulk OUT transfers, the number of writes that can be in flight.
+ */
+#define USB_TX_TRANSFERS 8
+
+/**
+ * @brief Size of each bulk transfer, a multiple of all bulk packet sizes.
+ */
+#define USB_TRANSFER_SIZE 16384
+
+/**
+ * @brief Size of the receive ring buffer.
+ *
+ * Bulk IN transfers are only submitted while the ring has space for all
+ * transfers in flight, so received data is never dropped.
+ */
+#define USB_RX_RING_SIZE (2 * USB_RX_TRANSFERS * USB_TRANSFER_SIZE)
+
+/**
+ * @brief Time in milliseconds that read waits for data before returning.
+ */
+#define READ_WAIT_TIME_MS 1000
+
+/**
+ * @brief Time in milliseconds that write waits for a free transfer and
+ * control requests wait for the device.
+ */
+#define USB_TIMEOUT_MS 1000
+
+/**
+ * @brief CDC class request that sets the UART parameters of the bridge.
+ */
+#define CDC_SET_LINE_CODING 0x20
+
+/**
+ * @brief CDC class request that sets the DTR and RTS lines.
+ */
+#define CDC_SET_CONTROL_LINE_STATE 0x22
+
+/**
+ * @brief DTR and RTS bits of CDC_SET_CONTROL_LINE_STATE, many devices only
+ * send data while DTR is set, like after opening the tty.
+ */
+#define CDC_CONTROL_LINE_DTR_RTS 0x03
+
+#define SERIAL_NUMBER_MAX_SIZE 128
+
+struct usb_mac_ctx;
+
+/**
+ * @brief Bulk transfer with its state.
+ */
+struct usb_slot {
+    struct libusb_transfer *transfer;
+    struct usb_mac_ctx *ctx;
+    bool busy;
+};
+
+/**
+ * @brief USB MAC instance state.
+ *
+ * The ring buffer holds rx_count received bytes starting at rx_head. error
+ * is set to an errno value when a transfer fails and reported by the next
+ * read or write.
+ */
+struct usb_mac_ctx {
+    bool opened;
+    struct usb_config config;
+    char serial_number[SERIAL_NUMBER_MAX_SIZE];
+    libusb_context *usb;
+    libusb_device_handle *handle;
+    int control_interface;
+    int data_interface;
+    uint8_t in_endpoint;
+    uint8_t out_endpoint;
+    struct usb_slot rx[USB_RX_TRANSFERS];
+    struct usb_slot tx[USB_TX_TRANSFERS];
+    int rx_in_flight;
+    bool closing;
+    int error;
+    size_t rx_head;
+    size_t rx_count;
+    uint8_t rx_ring[USB_RX_RING_SIZE];
+};
+
+/**
+ * @brief Convert a libusb error to an errno value.
+ *
+ * @param status libusb error code.
+ * @return int errno value.
+ */
+static int usb_errno(int status){
+    switch(status){
+        case LIBUSB_ERROR_NO_DEVICE:
+            return ENODEV;
+        case LIBUSB_ERROR_ACCESS:
+            return EACCES;
+        case LIBUSB_ERROR_BUSY:
+            return EBUSY;
+        case LIBUSB_ERROR_NOT_FOUND:
+            return ENOENT;
+        case LIBUSB_ERROR_TIMEOUT:
+            return ETIMEDOUT;
+        case LIBUSB_ERROR_NO_MEM:
+            return ENOMEM;
+        case LIBUSB_ERROR_INVALID_PARAM:
+            return EINVAL;
+        default:
+            return EIO;
+    }
+}
+
+/**
+ * @brief Log a libusb error and set errno for it.
+ *
+ * @param what Operation that failed.
+ * @param status libusb error code.
+ * @return int Always -1.
+ */
+static int usb_error(const char *what, int status){
+    ERROR("USB MAC %s: %s", what, libusb_strerror((enum libusb_error) status));
+    errno = usb_errno(status);
+    return -1;
+}
+
+static int mac_init(mac_t *mac, void *conf){
+    struct usb_mac_ctx *ctx = mac->ctx;
+    struct usb_config *config = (struct usb_config *) conf;
+
+    if(ctx->opened){
+        ERROR("Cannot initialize while MAC is opened.");
+        errno = EBUSY;
+        return -1;
+    }
+    DEBUG("Initializing USB MAC");
+    ctx->config = *config;
+    ctx->config.serial_number = NULL;
+    if(NULL != config->serial_number){
+        if(strlen(config->serial_number) >= SERIAL_NUMBER_MAX_SIZE){
+            ERROR("USB serial number is too long");
+            errno = EINVAL;
+            return -1;
+        }
+        strcpy(ctx->serial_number, config->serial_number);
+        ctx->config.serial_number = ctx->serial_number;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check if a device has the configured serial number.
+ *
+ * @param handle Open device.
+ * @param descriptor Device descriptor.
+ * @param serial_number Serial number to match.
+ * @return true if the serial numbers match.
+ */
+static bool match_serial_number(libusb_device_handle *handle, const struct libusb_device_descriptor *descriptor,
+                                const char *serial_number){
+    unsigned char value[SERIAL_NUMBER_MAX_SIZE];
+    int status;
+
+    if(0 == descriptor->iSerialNumber){
+        return false;
+    }
+    status = libusb_get_string_descriptor_ascii(handle, descriptor->iSerialNumber, value, sizeof(value));
+    return status >= 0 && 0 == strcmp((const char *) value, serial_number);
+}
+
+/**
+ * @brief Open the configured device.
+ *
+ * @param ctx USB MAC instance state.
+ * @param[out] device The opened device.
+ * @return int 0 on success, -1 with errno set to ENODEV if no device matches.
+ */
+static int open_device(struct usb_mac_ctx *ctx, libusb_device **device){
+    libusb_device **devices;
+    struct libusb_device_descriptor descriptor;
+    ssize_t count = libusb_get_device_list(ctx->usb, &devices);
+    int status = LIBUSB_ERROR_NO_DEVICE;
+
+    if(count < 0){
+        return usb_error("device list", (int) count);
+    }
+    for(ssize_t i = 0; i < count && NULL == ctx->handle; i++){
+        if(0 != libusb_get_device_descriptor(devices[i], &descriptor) ||
+            descriptor.idVendor != ctx->config.vendor_id || descriptor.idProduct != ctx->config.product_id){
+            continue;
+        }
+        status = libusb_open(devices[i], &ctx->handle);
+        if(0 != status){
+            continue;
+        }
+        if(NULL != ctx->config.serial_number &&
+            !match_serial_number(ctx->handle, &descriptor, ctx->config.serial_number)){
+            libusb_close(ctx->handle);
+            ctx->handle = NULL;
+            status = LIBUSB_ERROR_NO_DEVICE;
+            continue;
+        }
+        *device = devices[i];
+        libusb_ref_device(*device);
+    }
+    libusb_free_device_list(devices, 1);
+    if(NULL == ctx->handle){
+        ERROR("USB device %04x:%04x%s%s not found", ctx->config.vendor_id, ctx->config.product_id,
+            NULL == ctx->config.serial_number ? "" : " with serial number ",
+            NULL == ctx->config.serial_number ? "" : ctx->config.serial_number);
+        return usb_error("open", status);
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the CDC data interface with its bulk endpoints and the communication interface.
+ *
+ * @param ctx USB MAC instance state.
+ * @param device Device to search.
+ * @return int 0 on success, -1 with errno set to ENOENT if the device has no
+ *         matching data interface.
+ */
+static int find_interfaces(struct usb_mac_ctx *ctx, libusb_device *device){
+    struct libusb_config_descriptor *config;
+    int status = libusb_get_active_config_descriptor(device, &config);
+
+    if(0 != status){
+        return usb_error("configuration descriptor", status);
+    }
+    ctx->data_interface = -1;
+    ctx->control_interface = -1;
+    for(int i = 0; i < config->bNumInterfaces && ctx->data_interface < 0; i++){
+        const struct libusb_interface_descriptor *interface = &config->interface[i].altsetting[0];
+        uint8_t in_endpoint = 0;
+        uint8_t out_endpoint = 0;
+
+        if(LIBUSB_CLASS_COMM == interface->bInterfaceClass){
+            ctx->control_interface = interface->bInterfaceNumber;
+            continue;
+        }
+        if(ctx->config.interface >= 0 ? interface->bInterfaceNumber != ctx->config.interface :
+            LIBUSB_CLASS_DATA != interface->bInterfaceClass){
+            continue;
+        }
+        for(int j = 0; j < interface->bNumEndpoints; j++){
+            const struct libusb_endpoint_descriptor *endpoint = &interface->endpoint[j];
+
+            if(LIBUSB_TRANSFER_TYPE_BULK != (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)){
+                continue;
+            }
+            if(endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN){
+                in_endpoint = endpoint->bEndpointAddress;
+            }else{
+                out_endpoint = endpoint->bEndpointAddress;
+            }
+        }
+        if(0 != in_endpoint && 0 != out_endpoint){
+            ctx->data_interface = interface->bInterfaceNumber;
+            ctx->in_endpoint = in_endpoint;
+            ctx->out_endpoint = out_endpoint;
+        }
+    }
+    libusb_free_config_descriptor(config);
+    if(ctx->data_interface < 0){
+        ERROR("USB device has no data interface with bulk IN and OUT endpoints");
+        errno = ENOENT;
+        return -1;
+    }
+    DEBUG("USB MAC using interface %d, endpoints 0x%02x and 0x%02x",
+        ctx->data_interface, ctx->in_endpoint, ctx->out_endpoint);
+    return 0;
+}
+
+/**
+ * @brief Set the line coding and the control lines of the CDC device.
+ *
+ * Devices without a communication interface are used as they are.
+ *
+ * @param ctx USB MAC instance state.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int configure_line(struct usb_mac_ctx *ctx){
+    uint32_t baudrate = (uint32_t) ctx->config.baudrate;
+    // dwDTERate, one stop bit, no parity, 8 data bits
+    unsigned char line_coding[7] = {
+        (unsigned char) baudrate, (unsigned char) (baudrate >> 8),
+        (unsigned char) (baudrate >> 16), (unsigned char) (baudrate >> 24), 0, 0, 8
+    };
+    uint8_t request_type = LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE | LIBUSB_ENDPOINT_OUT;
+    int status;
+
+    if(ctx->control_interface < 0){
+        return 0;
+    }
+    if(ctx->config.baudrate > 0){
+        status = libusb_control_transfer(ctx->handle, request_type, CDC_SET_LINE_CODING, 0,
+            (uint16_t) ctx->control_interface, line_coding, sizeof(line_coding), USB_TIMEOUT_MS);
+        if(status < 0){
+            return usb_error("set line coding", status);
+        }
+    }
+    status = libusb_control_transfer(ctx->handle, request_type, CDC_SET_CONTROL_LINE_STATE,
+        CDC_CONTROL_LINE_DTR_RTS, (uint16_t) ctx->control_interface, NULL, 0, USB_TIMEOUT_MS);
+    if(status < 0){
+        // Not all devices implement it
+        DEBUG("USB MAC set control line state: %s", libusb_strerror((enum libusb_error) status));
+    }
+    return 0;
+}
+
+/**
+ * @brief Submit the free bulk IN transfers that the ring buffer has space for.
+ *
+ * @param ctx USB MAC instance state.
+ */
+static void submit_rx(struct usb_mac_ctx *ctx){
+    int status;
+
+    for(int i = 0; i < USB_RX_TRANSFERS && !ctx->closing && 0 == ctx->error; i++){
+        size_t reserved = (size_t) (ctx->rx_in_flight + 1) * USB_TRANSFER_SIZE;
+
+        if(ctx->rx[i].busy){
+            continue;
+        }
+        if(USB_RX_RING_SIZE - ctx->rx_count < reserved){
+            break;
+        }
+        status = libusb_submit_transfer(ctx->rx[i].transfer);
+        if(0 != status){
+            usb_error("submit read", status);
+            ctx->error = errno;
+            break;
+        }
+        ctx->rx[i].busy = true;
+        ctx->rx_in_flight += 1;
+    }
+}
+
+static void LIBUSB_CALL rx_callback(struct libusb_transfer *transfer){
+    struct usb_slot *slot = transfer->user_data;
+    struct usb_mac_ctx *ctx = slot->ctx;
+    size_t tail;
+    size_t size;
+
+    slot->busy = false;
+    ctx->rx_in_flight -= 1;
+    if(LIBUSB_TRANSFER_COMPLETED == transfer->status){
+        // submit_rx reserved space for the whole transfer
+        tail = (ctx->rx_head + ctx->rx_count) % USB_RX_RING_SIZE;
+        size = (size_t) transfer->actual_length;
+        if(size > USB_RX_RING_SIZE - tail){
+            memcpy(&ctx->rx_ring[tail], transfer->buffer, USB_RX_RING_SIZE - tail);
+            memcpy(ctx->rx_ring, &transfer->buffer[USB_RX_RING_SIZE - tail], size - (USB_RX_RING_SIZE - tail));
+        }else{
+            memcpy(&ctx->rx_ring[tail], transfer->buffer, size);
+        }
+        ctx->rx_count += size;
+    }else if(LIBUSB_TRANSFER_CANCELLED != transfer->status){
+        ERROR("USB MAC read transfer failed with status %d", transfer->status);
+        ctx->error = LIBUSB_TRANSFER_NO_DEVICE == transfer->status ? ENODEV : EIO;
+    }
+    submit_rx(ctx);
+}
+
+static void LIBUSB_CALL tx_callback(struct libusb_transfer *transfer){
+    struct usb_slot *slot = transfer->user_data;
+    struct usb_mac_ctx *ctx = slot->ctx;
+
+    slot->busy = false;
+    if(LIBUSB_TRANSFER_CANCELLED == transfer->status){
+        return;
+    }
+    if(LIBUSB_TRANSFER_COMPLETED != transfer->status || transfer->actual_length != transfer->length){
+        ERROR("USB MAC write transfer failed with status %d after %d of %d bytes",
+            transfer->status, transfer->actual_length, transfer->length);
+        ctx->error = LIBUSB_TRANSFER_NO_DEVICE == transfer->status ? ENODEV : EIO;
+    }
+}
+
+/**
+ * @brief Run the transfer callbacks of completed transfers.
+ *
+ * @param ctx USB MAC instance state.
+ * @param timeout_ms Maximum time to wait for a transfer to complete.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int handle_events(struct usb_mac_ctx *ctx, int timeout_ms){
+    struct timeval timeout = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    int status = libusb_handle_events_timeout_completed(ctx->usb, &timeout, NULL);
+
+    if(status < 0 && LIBUSB_ERROR_INTERRUPTED != status){
+        return usb_error("handle events", status);
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocate the bulk transfers.
+ *
+ * @param ctx USB MAC instance state.
+ * @return int 0 on success, -1 with errno set to ENOMEM.
+ */
+static int alloc_transfers(struct usb_mac_ctx *ctx){
+    for(int i = 0; i < USB_RX_TRANSFERS + USB_TX_TRANSFERS; i++){
+        bool rx = i < USB_RX_TRANSFERS;
+        struct usb_slot *slot = rx ? &ctx->rx[i] : &ctx->tx[i - USB_RX_TRANSFERS];
+        unsigned char *buffer = malloc(USB_TRANSFER_SIZE);
+
+        slot->ctx = ctx;
+        slot->busy = false;
+        slot->transfer = libusb_alloc_transfer(0);
+        if(NULL == buffer || NULL == slot->transfer){
+            free(buffer);
+            errno = ENOMEM;
+            return -1;
+        }
+        libusb_fill_bulk_transfer(slot->transfer, ctx->handle, rx ? ctx->in_endpoint : ctx->out_endpoint,
+            buffer, USB_TRANSFER_SIZE, rx ? rx_callback : tx_callback, slot, 0);
+        // The buffer is released with the transfer, writes end with a zero
+        // length packet when they fill the last packet
+        slot->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | (rx ? 0 : LIBUSB_TRANSFER_ADD_ZERO_PACKET);
+    }
+    return 0;
+}
+
+/**
+ * @brief Cancel and release all transfers, release the interfaces and close the device.
+ *
+ * @param ctx USB MAC instance state.
+ */
+static void release_device(struct usb_mac_ctx *ctx){
+    timeout_t timer;
+    bool busy = false;
+
+    ctx->closing = true;
+    for(int i = 0; i < USB_RX_TRANSFERS + USB_TX_TRANSFERS; i++){
+        struct usb_slot *slot = i < USB_RX_TRANSFERS ? &ctx->rx[i] : &ctx->tx[i - USB_RX_TRANSFERS];
+
+        if(slot->busy){
+            libusb_cancel_transfer(slot->transfer);
+        }
+    }
+    set_timeout(&timer, USB_TIMEOUT_MS / 1000.0f);
+    do {
+        busy = ctx->rx_in_flight > 0;
+        for(int i = 0; i < USB_TX_TRANSFERS; i++){
+            busy = busy || ctx->tx[i].busy;
+        }
+        if(busy && handle_events(ctx, timeout_remaining_ms(&timer)) < 0){
+            break;
+        }
+    } while(busy && !timeout_expired(&timer));
+    for(int i = 0; i < USB_RX_TRANSFERS + USB_TX_TRANSFERS; i++){
+        struct usb_slot *slot = i < USB_RX_TRANSFERS ? &ctx->rx[i] : &ctx->tx[i - USB_RX_TRANSFERS];
+
+        // Transfers that did not complete are leaked rather than freed while in use
+        if(!slot->busy){
+            libusb_free_transfer(slot->transfer);
+        }
+        slot->transfer = NULL;
+    }
+    if(ctx->data_interface >= 0){
+        libusb_release_interface(ctx->handle, ctx->data_interface);
+    }
+    if(ctx->control_interface >= 0){
+        libusb_release_interface(ctx->handle, ctx->control_interface);
+    }
+    libusb_close(ctx->handle);
+    ctx->handle = NULL;
+    libusb_exit(ctx->usb);
+    ctx->usb = NULL;
+}
+
+static int mac_open(mac_t *mac){
+    struct usb_mac_ctx *ctx = mac->ctx;
+    libusb_device *device = NULL;
+    int status;
+
+    DEBUG("Opening USB MAC");
+    if(ctx->opened){
+        errno = EBUSY;
+        return -1;
+    }
+    status = libusb_init(&ctx->usb);
+    if(0 != status){
+        return usb_error("init", status);
+    }
+    ctx->handle = NULL;
+    ctx->data_interface = -1;
+    ctx->control_interface = -1;
+    ctx->rx_in_flight = 0;
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+    ctx->error = 0;
+    ctx->closing = false;
+    if(open_device(ctx, &device) < 0){
+        libusb_exit(ctx->usb);
+        return -1;
+    }
+    status = find_interfaces(ctx, device);
+    libusb_unref_device(device);
+    if(status < 0){
+        libusb_close(ctx->handle);
+        libusb_exit(ctx->usb);
+        return -1;
+    }
+    // The cdc_acm driver is attached again when the interfaces are released
+    libusb_set_auto_detach_kernel_driver(ctx->handle, 1);
+    status = libusb_claim_interface(ctx->handle, ctx->data_interface);
+    if(0 == status && ctx->control_interface >= 0 &&
+        0 != libusb_claim_interface(ctx->handle, ctx->control_interface)){
+        // Line coding is sent without the interface when it is shared
+        DEBUG("USB MAC could not claim the communication interface");
+    }
+    if(0 != status){
+        usb_error("claim interface", status);
+        ctx->data_interface = -1;
+        ctx->control_interface = -1;
+        release_device(ctx);
+        return -1;
+    }
+    if(configure_line(ctx) < 0 || alloc_transfers(ctx) < 0){
+        status = errno;
+        release_device(ctx);
+        errno = status;
+        return -1;
+    }
+    submit_rx(ctx);
+    if(0 != ctx->error){
+        status = ctx->error;
+        release_device(ctx);
+        errno = status;
+        return -1;
+    }
+    ctx->opened = true;
+    return 0;
+}
+
+static int mac_close(mac_t *mac){
+    struct usb_mac_ctx *ctx = mac->ctx;
+
+    DEBUG("Closing USB MAC");
+    if(!ctx->opened){
+        errno = EBADF;
+        return -1;
+    }
+    release_device(ctx);
+    ctx->opened = false;
+    return 0;
+}
+
+/**
+ * @brief Take received data from the ring buffer.
+ *
+ * Bulk IN transfers that waited for space are submitted again.
+ *
+ * @param ctx USB MAC instance state.
+ * @param size Maximum number of bytes to take.
+ * @param data Buffer for the data.
+ * @return int Number of bytes taken.
+ */
+static int take_rx(struct usb_mac_ctx *ctx, int size, uint8_t *data){
+    size_t count = (size_t) size < ctx->rx_count ? (size_t) size : ctx->rx_count;
+    size_t first = USB_RX_RING_SIZE - ctx->rx_head;
+
+    if(0 == count){
+        return 0;
+    }
+    if(count > first){
+        memcpy(data, &ctx->rx_ring[ctx->rx_head], first);
+        memcpy(&data[first], ctx->rx_ring, count - first);
+    }else{
+        memcpy(data, &ctx->rx_ring[ctx->rx_head], count);
+    }
+    ctx->rx_head = (ctx->rx_head + count) % USB_RX_RING_SIZE;
+    ctx->rx_count -= count;
+    if(ctx->rx_in_flight < USB_RX_TRANSFERS){
+        submit_rx(ctx);
+    }
+    return (int) count;
+}
+
+/**
+ * @brief Read from the device until enough data is received or a deadline expires.
+ *
+ * The thread waits in libusb for the queued bulk IN transfers, so no CPU time
+ * is spent while waiting. All available data up to size bytes is returned.
+ *
+ * @param mac MAC instance.
+ * @param size Size of the data buffer.
+ * @param data Buffer for the received data.
+ * @param min_size Number of bytes to wait for.
+ * @param deadline Time when to stop waiting.
+ * @return int Number of bytes read, which is less than min_size if the deadline
+ *         expired, or -1 on error.
+ */
+static int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline){
+    struct usb_mac_ctx *ctx = mac->ctx;
+    int received = 0;
+    bool expired = false;
+    int remaining;
+
+    for(;;){
+        received += take_rx(ctx, size - received, &data[received]);
+        if(received >= min_size || expired){
+            break;
+        }
+        if(0 != ctx->error){
+            errno = ctx->error;
+            return -1;
+        }
+        remaining = timeout_remaining_ms(deadline);
+        if(remaining < 0){
+            return -1;
+        }
+        // Completed transfers are still collected after the deadline
+        expired = 0 == remaining;
+        if(handle_events(ctx, remaining) < 0){
+            return -1;
+        }
+    }
+    return received;
+}
+
+static int mac_read(mac_t *mac, int size, uint8_t *data){
+    timeout_t deadline;
+
+    if(set_timeout(&deadline, READ_WAIT_TIME_MS / 1000.0f) < 0){
+        return -1;
+    }
+    return mac_read_deadline(mac, size, data, 1, &deadline);
+}
+
+/**
+ * @brief Get a free bulk OUT transfer, waiting for one to complete if all are in flight.
+ *
+ * @param ctx USB MAC instance state.
+ * @return struct usb_slot* Free transfer, or NULL on error with errno set.
+ */
+static struct usb_slot *get_tx_slot(struct usb_mac_ctx *ctx){
+    timeout_t timer;
+
+    set_timeout(&timer, USB_TIMEOUT_MS / 1000.0f);
+    for(;;){
+        if(0 != ctx->error){
+            errno = ctx->error;
+            return NULL;
+        }
+        for(int i = 0; i < USB_TX_TRANSFERS; i++){
+            if(!ctx->tx[i].busy){
+                return &ctx->tx[i];
+            }
+        }
+        if(timeout_expired(&timer)){
+            ERROR("USB MAC write: device does not take data");
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        if(handle_events(ctx, timeout_remaining_ms(&timer)) < 0){
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Submit a free bulk OUT transfer with the data that was copied into it.
+ *
+ * @param ctx USB MAC instance state.
+ * @param slot Transfer with the data in its buffer.
+ * @param size Number of bytes in the buffer.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int submit_tx(struct usb_mac_ctx *ctx, struct usb_slot *slot, int size){
+    int status;
+
+    slot->transfer->length = size;
+    status = libusb_submit_transfer(slot->transfer);
+    if(0 != status){
+        return usb_error("submit write", status);
+    }
+    slot->busy = true;
+    // Run callbacks of completed transfers without waiting
+    return handle_events(ctx, 0);
+}
+
+/**
+ * @brief Queue data for sending.
+ *
+ * The data is copied into bulk OUT transfers, so the call returns as soon as
+ * the transfers are submitted and the caller can reuse its buffer.
+ *
+ * @param mac MAC instance.
+ * @param size Number of bytes to send.
+ * @param data Data to send.
+ * @return int Number of bytes queued, or -1 on error.
+ */
+static int mac_write(mac_t *mac, int size, uint8_t *data){
+    struct usb_mac_ctx *ctx = mac->ctx;
+    struct usb_slot *slot;
+    int chunk;
+
+    for(int offset = 0; offset < size; offset += chunk){
+        chunk = size - offset < USB_TRANSFER_SIZE ? size - offset : USB_TRANSFER_SIZE;
+        slot = get_tx_slot(ctx);
+        if(NULL == slot){
+            return -1;
+        }
+        memcpy(slot->transfer->buffer, &data[offset], (size_t) chunk);
+        if(submit_tx(ctx, slot, chunk) < 0){
+            return -1;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Queue multiple buffers for sending.
+ *
+ * Buffers that fit into one bulk transfer are gathered into it, so a frame
+ * goes out in one transfer.
+ *
+ * @param mac MAC instance.
+ * @param count Number of buffers.
+ * @param iov Buffers to send.
+ * @return int Number of bytes queued, or -1 on error.
+ */
+static int mac_writev(mac_t *mac, int count, const mac_iovec_t *iov){
+    struct usb_mac_ctx *ctx = mac->ctx;
+    struct usb_slot *slot;
+    int size = mac_iovec_size(count, iov);
+    int offset = 0;
+
+    if(size < 0){
+        return -1;
+    }
+    if(size > USB_TRANSFER_SIZE){
+        for(int i = 0; i < count; i++){
+            if(mac_write(mac, iov[i].size, (uint8_t *) iov[i].data) < 0){
+                return -1;
+            }
+        }
+        return size;
+    }
+    slot = get_tx_slot(ctx);
+    if(NULL == slot){
+        return -1;
+    }
+    for(int i = 0; i < count; i++){
+        memcpy(&slot->transfer->buffer[offset], iov[i].data, (size_t) iov[i].size);
+        offset += iov[i].size;
+    }
+    if(submit_tx(ctx, slot, size) < 0){
+        return -1;
+    }
+    return size;
+}
+
+const mac_t usb_mac = {
+    .open = mac_open,
+    .close = mac_close,
+    .init = mac_init,
+    .write = mac_write,
+    .read = mac_read,
+    .read_deadline = mac_read_deadline,
+    .writev = mac_writev
+};
+
+/**
+ * @brief Create a new USB MAC instance.
+ *
+ * @param mac Pointer where the new MAC instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int get_usb_mac(mac_t **mac){
+    return mac_alloc(&usb_mac, sizeof(struct usb_mac_ctx), mac);
+}
@@ -19,10 +19,14 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
 #include "mdfu/mdfu.h"
 #include "mdfu/logging.h"
 #include "mdfu/image_reader.h"
 #include "mdfu/image_writer.h"
+#include "mdfu/timeout.h"
 #include "mdfu/error.h"
 
 /**
@@ -155,7 +159,9 @@ static const char *MDFU_COMMANDS_STR[] = {
     "Start Transfer",
     "Write Chunk",
     "Get Image State",
-    "End Transfer"
+    "End Transfer",
+    "Change Mode",
+    "Read Chunk"
 };
 
 /**
@@ -196,13 +202,176 @@ static const char *MDFU_CMD_NOT_EXECUTED_CAUSE_STR[] = {
     "Sequence number of the received command is invalid"
 };
 
-static transport_t *mdfu_transport = NULL;
-static uint8_t sequence_number;
-static int send_retries;
-static client_info_t local_client_info;
-static bool client_info_valid = false;
-static uint8_t cmd_packet_buffer[MDFU_CMD_PACKET_MAX_SIZE];
-static uint8_t status_packet_buffer[MDFU_RESPONSE_PACKET_MAX_SIZE];
+#if MDFU_MAX_WINDOW_SIZE < 1 || MDFU_MAX_WINDOW_SIZE > 16
+    #error "MDFU_MAX_WINDOW_SIZE must be between 1 and 16"
+#endif
+
+/**
+ * @def MDFU_PIPELINE_SLOTS
+ * @brief Number of command buffers that chunks are prepared in while the
+ * previous chunk is in flight, for updates with one command in flight.
+ */
+#define MDFU_PIPELINE_SLOTS 2
+
+/**
+ * @def MDFU_WINDOW_SLOTS
+ * @brief Number of session window slots, enough for the send window and the pipeline.
+ */
+#define MDFU_WINDOW_SLOTS (MDFU_MAX_WINDOW_SIZE > MDFU_PIPELINE_SLOTS ? MDFU_MAX_WINDOW_SIZE : MDFU_PIPELINE_SLOTS)
+
+/**
+ * @def MDFU_LOG_DATA_MAX_SIZE
+ * @brief Maximum number of packet data bytes that are logged.
+ */
+#define MDFU_LOG_DATA_MAX_SIZE MDFU_MAX_COMMAND_DATA_LENGTH
+
+/**
+ * @def FRAME_CHECK_SEQUENCE_SIZE
+ * @brief Size of the frame check sequence that transports can store after a
+ * received MDFU packet.
+ */
+#define FRAME_CHECK_SEQUENCE_SIZE 2
+
+/**
+ * @def MDFU_RTO_MIN
+ * @brief Lower limit in seconds of the adaptive response timeout.
+ */
+#define MDFU_RTO_MIN 0.02f
+
+/**
+ * @def MDFU_RTO_GRANULARITY
+ * @brief Smallest margin in seconds between the smoothed round trip time and
+ * the adaptive response timeout.
+ */
+#define MDFU_RTO_GRANULARITY 0.005f
+
+/**
+ * @def MDFU_RETRY_BUDGET_DEPOSIT
+ * @brief Retries that each completed command adds to the session retry budget.
+ */
+#define MDFU_RETRY_BUDGET_DEPOSIT 0.1f
+
+/**
+ * @brief Slot in the WRITE_CHUNK send window.
+ *
+ * Holds an encoded command packet until the client has acknowledged it, so
+ * that it can be retransmitted.
+ */
+typedef struct {
+    mdfu_packet_t packet;
+    int size;
+    timeout_t sent;
+    bool retransmitted;
+    uint8_t *buffer;
+}window_slot_t;
+
+/**
+ * @brief Response timeout estimator of a command.
+ *
+ * Smoothed round trip time and round trip time variation as in TCP
+ * (RFC 6298). rto is zero until the first round trip time was measured.
+ */
+typedef struct {
+    float srtt;
+    float rttvar;
+    float rto;
+}rtt_estimator_t;
+
+/**
+ * @def TRANSACTION_RETRY
+ * @brief Result of a transaction step after which the command is sent again.
+ */
+#define TRANSACTION_RETRY 1
+
+/**
+ * @brief Command transaction.
+ *
+ * Holds the state of a command between sending it and receiving the
+ * response, so that both can be done in separate steps.
+ *
+ * When rx_data is set the response data is received into it instead of
+ * the status packet buffer, e.g. into a buffer lent by the image writer.
+ */
+typedef struct {
+    mdfu_packet_t *cmd_packet;
+    mdfu_packet_t *status_packet;
+    int cmd_packet_size;
+    uint8_t *rx_data;
+    int rx_data_size;
+    int attempts;
+    float timeout;
+    transport_stats_t before;
+    timeout_t sent;
+}transaction_t;
+
+/**
+ * @brief State of a step driven update, see mdfu_session_start_update.
+ *
+ * The update sends one command at a time, command is the command that is in
+ * flight and deadline the time when its response times out.
+ */
+typedef struct {
+    mdfu_step_status_t status;
+    mdfu_command_t command;
+    const image_reader_t *image_reader;
+    mdfu_packet_t cmd_packet;
+    mdfu_packet_t status_packet;
+    transaction_t transaction;
+    timeout_t deadline;
+    int fd;
+}step_state_t;
+
+/**
+ * @brief MDFU host session.
+ *
+ * Holds the protocol state of a connection to one client. Sessions do not
+ * share any state, so multiple sessions can be used at the same time as
+ * long as each session is only accessed from one thread at a time.
+ *
+ * The packet buffers are allocated for MDFU packets of packet_size bytes,
+ * which grows when the client reports a larger buffer size. They are taken
+ * from one allocation, the arena, that holds the status packet buffer, with
+ * room for the frame check sequence that some transports decode together
+ * with the packet, and window_count command packet buffers. The command
+ * packet buffer is the first window slot, since commands are either sent
+ * one at a time or all from the window, and the window only has slots for
+ * the commands that the client and the transport can take at once. Updates
+ * with one command in flight add a second slot on their first chunk, see
+ * mdfu_write_chunks_pipelined.
+ *
+ * The first command after opening the session is sent with the sync flag,
+ * which is the GET_CLIENT_INFO command unless the client information was
+ * set with mdfu_session_set_client_info.
+ *
+ * Commands are sent again from the retry budget, which holds up to
+ * retry_budget_max retries and is refilled by commands that complete. The
+ * response timeout of each command adapts to its measured round trip times.
+ */
+struct mdfu_session {
+    transport_t *transport;
+    uint8_t sequence_number;
+    int retry_budget_max;
+    float retry_budget;
+    rtt_estimator_t rtt[MAX_MDFU_CMD];
+    client_info_t client_info;
+    bool client_info_valid;
+    /** @brief True if client_info was set with mdfu_session_set_client_info and no command confirmed it yet. */
+    bool client_info_preloaded;
+    /** @brief True if client_info was reported by the client or confirmed by a command in this connection. */
+    bool client_info_confirmed;
+    /** @brief False until the first command after opening the session was sent with the sync flag. */
+    bool synced;
+    int packet_size;
+    int window_count;
+    uint8_t *arena;
+    size_t arena_size;
+    uint8_t *cmd_packet_buffer;
+    uint8_t *status_packet_buffer;
+    window_slot_t window[MDFU_WINDOW_SLOTS];
+    timeout_t opened;
+    mdfu_stats_t stats;
+    step_state_t step;
+};
 
 void mdfu_log_packet(const mdfu_packet_t *packet, mdfu_packet_type_t type);
 ssize_t mdfu_encode_cmd_packet(mdfu_packet_t *mdfu_packet);
@@ -210,22 +379,238 @@ int mdfu_decode_packet(mdfu_packet_t *mdfu_packet, mdfu_packet_type_t type, int
 int mdfu_decode_client_info(const uint8_t *data, int length, client_info_t *client_info);
 
 static void log_error_cause(const mdfu_packet_t *status_packet);
-int mdfu_send_cmd(mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet);
-
-int mdfu_start_transfer(void);
-int mdfu_end_transfer(void);
-ssize_t mdfu_write_chunk(const image_reader_t* image_reader, int size);
-ssize_t mdfu_read_chunk(const image_writer_t* image_writer, int size);
-int mdfu_get_image_state(mdfu_image_state_t *state);
-int mdfu_change_mode(void);
+int mdfu_send_cmd(mdfu_session_t *session, mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet);
+static void transaction_begin(mdfu_session_t *session, transaction_t *transaction, mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet);
+static int transaction_send(mdfu_session_t *session, transaction_t *transaction);
+static int transaction_receive(mdfu_session_t *session, transaction_t *transaction, float timeout);
+static int transaction_run(mdfu_session_t *session, transaction_t *transaction);
+
+int mdfu_start_transfer(mdfu_session_t *session);
+int mdfu_end_transfer(mdfu_session_t *session);
+ssize_t mdfu_write_chunk(mdfu_session_t *session, const image_reader_t* image_reader, int size);
+static int mdfu_write_chunks_windowed(mdfu_session_t *session, const image_reader_t *image_reader, int size, int window_size);
+static int mdfu_write_chunks_pipelined(mdfu_session_t *session, const image_reader_t *image_reader, int size);
+ssize_t mdfu_read_chunk(mdfu_session_t *session, const image_writer_t* image_writer, int size);
+static ssize_t mdfu_verify_chunk(mdfu_session_t *session, const image_reader_t *image_reader, int size, size_t offset, bool *identical);
+int mdfu_get_image_state(mdfu_session_t *session, mdfu_image_state_t *state);
+int mdfu_change_mode(mdfu_session_t *session);
 
 /**
  * @brief Increment the MDFU packet sequence number
  * 
  * Will wrap around to 0 according to spec when passing 31.
+ *
+ * @param session MDFU session
+ */
+static inline void increment_sequence_number(mdfu_session_t *session){
+    session->sequence_number = (session->sequence_number + 1) & 0x1F;
+}
+
+/**
+ * @brief Records the round trip time of a command.
+ *
+ * @param stats Command statistics
+ * @param rtt Round trip time in seconds
+ */
+static void record_rtt(mdfu_cmd_stats_t *stats, float rtt){
+    uint32_t us;
+    int bucket = 0;
+
+    if(rtt < 0){
+        rtt = 0;
+    }
+    if(0 == stats->rtt_count || rtt < stats->rtt_min){
+        stats->rtt_min = rtt;
+    }
+    if(rtt > stats->rtt_max){
+        stats->rtt_max = rtt;
+    }
+    stats->rtt_sum += rtt;
+    stats->rtt_count += 1;
+    us = rtt < 4000.0f ? (uint32_t) (rtt * 1e6f) : UINT32_MAX;
+    while(us > 1 && bucket < MDFU_STATS_RTT_BUCKETS - 1){
+        us >>= 1;
+        bucket += 1;
+    }
+    stats->rtt_histogram[bucket] += 1;
+}
+
+/**
+ * @brief Records a failed command attempt after a transport error.
+ *
+ * The cause is taken from the transport statistics, which count timeouts and
+ * frames that failed the integrity check.
+ *
+ * @param session MDFU session
+ * @param before Transport statistics before the attempt
+ */
+static void record_transport_retry(mdfu_session_t *session, const transport_stats_t *before){
+    if(session->transport->stats.timeouts != before->timeouts){
+        session->stats.retries_timeout += 1;
+    }else if(session->transport->stats.integrity_errors != before->integrity_errors){
+        session->stats.retries_integrity += 1;
+    }else{
+        session->stats.retries_transport += 1;
+    }
+}
+
+/**
+ * @brief Records a failed command attempt that the client asked to resend.
+ *
+ * @param session MDFU session
+ * @param status_packet MDFU status packet returned from client.
+ */
+static void record_client_retry(mdfu_session_t *session, const mdfu_packet_t *status_packet){
+    if(COMMAND_NOT_EXECUTED == status_packet->status &&
+        status_packet->data_length > 0 &&
+        status_packet->data[0] < MAX_CMD_NOT_EXECUTED_ERROR_CAUSE){
+        session->stats.retries_not_executed[status_packet->data[0]] += 1;
+    }else{
+        session->stats.retries_resend += 1;
+    }
+}
+
+/**
+ * @brief Get the timeout for a MDFU command
+ *
+ * @param session MDFU session
+ * @param command MDFU command
+ * @return float Command timeout in seconds
+ */
+static float get_cmd_timeout(mdfu_session_t *session, uint8_t command){
+    float cmd_timeout = MDFU_CLIENT_INFO_CMD_TIMEOUT;
+
+    if(session->client_info_valid){
+        cmd_timeout = (float) (session->client_info.cmd_timeouts[command - 1] * SECONDS_PER_LSB);
+    }
+    return cmd_timeout;
+}
+
+/**
+ * @brief Get the response timeout for a MDFU command
+ *
+ * The timeout adapts to the measured round trip times of the command, so that
+ * lost responses are detected long before the client command timeout, which
+ * is set for the slowest execution of a command. The client command timeout
+ * is the upper limit and is used until a round trip time was measured.
+ *
+ * @param session MDFU session
+ * @param command MDFU command
+ * @return float Response timeout in seconds
+ */
+static float get_response_timeout(mdfu_session_t *session, uint8_t command){
+    float cmd_timeout = get_cmd_timeout(session, command);
+    float rto = session->rtt[command].rto;
+
+    if(rto > 0 && rto < cmd_timeout){
+        return rto;
+    }
+    return cmd_timeout;
+}
+
+/**
+ * @brief Updates the response timeout of a command with a round trip time.
+ *
+ * Only round trip times of commands that were sent once are used, since the
+ * response to a retransmitted command can belong to any of the attempts.
+ *
+ * @param session MDFU session
+ * @param command MDFU command
+ * @param rtt Round trip time in seconds
+ */
+static void rtt_sample(mdfu_session_t *session, uint8_t command, float rtt){
+    rtt_estimator_t *estimator = &session->rtt[command];
+    float deviation;
+
+    if(rtt < 0){
+        rtt = 0;
+    }
+    if(0 == estimator->rto){
+        estimator->srtt = rtt;
+        estimator->rttvar = rtt / 2;
+    }else{
+        deviation = estimator->srtt > rtt ? estimator->srtt - rtt : rtt - estimator->srtt;
+        estimator->rttvar = 0.75f * estimator->rttvar + 0.25f * deviation;
+        estimator->srtt = 0.875f * estimator->srtt + 0.125f * rtt;
+    }
+    estimator->rto = estimator->srtt + (4 * estimator->rttvar > MDFU_RTO_GRANULARITY ? 4 * estimator->rttvar : MDFU_RTO_GRANULARITY);
+    if(estimator->rto < MDFU_RTO_MIN){
+        estimator->rto = MDFU_RTO_MIN;
+    }
+}
+
+/**
+ * @brief Doubles the response timeout of a command after a timeout.
+ *
+ * The timeout stays backed off until the next round trip time is measured.
+ *
+ * @param session MDFU session
+ * @param command MDFU command
+ */
+static void rtt_backoff(mdfu_session_t *session, uint8_t command){
+    rtt_estimator_t *estimator = &session->rtt[command];
+    float cmd_timeout = get_cmd_timeout(session, command);
+
+    estimator->rto *= 2;
+    if(estimator->rto > cmd_timeout){
+        estimator->rto = cmd_timeout;
+    }
+}
+
+/**
+ * @brief Takes a retry from the session retry budget.
+ *
+ * @param session MDFU session
+ * @return bool True if the budget had a retry left.
+ */
+static bool retry_budget_withdraw(mdfu_session_t *session){
+    if(session->retry_budget < 1.0f){
+        return false;
+    }
+    session->retry_budget -= 1.0f;
+    return true;
+}
+
+/**
+ * @brief Refills the session retry budget for completed commands.
+ *
+ * @param session MDFU session
+ * @param count Number of completed commands.
+ */
+static void retry_budget_deposit(mdfu_session_t *session, int count){
+    session->retry_budget += MDFU_RETRY_BUDGET_DEPOSIT * (float) count;
+    if(session->retry_budget > (float) session->retry_budget_max){
+        session->retry_budget = (float) session->retry_budget_max;
+    }
+}
+
+/**
+ * @brief Get the number of WRITE_CHUNK commands that can be in flight.
+ *
+ * The window is limited by the number of command buffers reported by the
+ * client, the host window buffers (MDFU_MAX_WINDOW_SIZE) and the transport.
+ * Transports where the host polls the client for the response, e.g. SPI and
+ * I2C, do not support pipelining and result in a window size of 1.
+ *
+ * @param session MDFU session
+ * @return int Window size
  */
-static inline void increment_sequence_number(){
-    sequence_number = (sequence_number + 1) & 0x1F;
+static int get_window_size(mdfu_session_t *session){
+    bool pipelining = false;
+    int window_size = session->client_info.buffer_count;
+
+    if(TRANSPORT_OPS(session->transport)->ioctl == NULL ||
+        0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_PIPELINING, &pipelining) ||
+        !pipelining){
+        return 1;
+    }
+    if(window_size > MDFU_MAX_WINDOW_SIZE){
+        window_size = MDFU_MAX_WINDOW_SIZE;
+    }
+    if(window_size < 1){
+        window_size = 1;
+    }
+    return window_size;
 }
 
 /**
@@ -263,14 +648,15 @@ static int version_check(uint8_t major, uint8_t minor, uint8_t patch){
  *
  * Initializes the buffer pointers in the MDFU packets for a transaction.
  *
+ * @param session MDFU session
  * @param cmd_packet MDFU command packet
  * @param status_packet MDFU status packet
  */
-int mdfu_get_packet_buffer(mdfu_packet_t *cmd_packet, mdfu_packet_t *status_packet){
-    cmd_packet->buf = cmd_packet_buffer;
-    cmd_packet->data = &cmd_packet_buffer[2];
-    status_packet->buf = status_packet_buffer;
-    status_packet->data = &status_packet_buffer[2];
+int mdfu_get_packet_buffer(mdfu_session_t *session, mdfu_packet_t *cmd_packet, mdfu_packet_t *status_packet){
+    cmd_packet->buf = session->cmd_packet_buffer;
+    cmd_packet->data = &session->cmd_packet_buffer[2];
+    status_packet->buf = session->status_packet_buffer;
+    status_packet->data = &session->status_packet_buffer[2];
     return 0;
 }
 
@@ -282,8 +668,9 @@ int mdfu_get_packet_buffer(mdfu_packet_t *cmd_packet, mdfu_packet_t *status_pack
  */
 void mdfu_log_packet(const mdfu_packet_t *packet, mdfu_packet_type_t type){
     // Best estimate 128 chars for printed text, x2 for data since we print them as hex characters
-    char buf[128 + MDFU_MAX_COMMAND_DATA_LENGTH * 2];
+    char buf[128 + MDFU_LOG_DATA_MAX_SIZE * 2];
     int cnt = 0;
+    int data_length = packet->data_length;
     if(type == MDFU_CMD){
         cnt = sprintf((char *) &buf, "Sequence number: %d; Command: %s; Sync: %s; Data size: %d",
             packet->sequence_number,
@@ -297,11 +684,17 @@ void mdfu_log_packet(const mdfu_packet_t *packet, mdfu_packet_type_t type){
             packet->resend ? "true" : "false",
             packet->data_length);
     }
-    if(packet->data_length) {
+    if(data_length > MDFU_LOG_DATA_MAX_SIZE) {
+        data_length = MDFU_LOG_DATA_MAX_SIZE;
+    }
+    if(data_length) {
         cnt += sprintf(&buf[cnt], ";Data: 0x");
-        for(int i = 0; i < packet->data_length; i++){
+        for(int i = 0; i < data_length; i++){
             cnt += sprintf(&buf[cnt], "%02x", packet->data[i]);
         }
+        if(data_length < packet->data_length){
+            sprintf(&buf[cnt], "...");
+        }
     }
     DEBUG("%s", (char *) &buf);
 }
@@ -344,6 +737,13 @@ int mdfu_decode_packet(mdfu_packet_t *mdfu_packet, mdfu_packet_type_t type, int
     int status = 0;
     assert(type == MDFU_CMD || type == MDFU_STATUS);
 
+    // The header is missing from runt packets and the buffer holds stale data
+    if(packet_size < 2){
+        ERROR("Invalid MDFU packet size %d", packet_size);
+        mdfu_packet->data = NULL;
+        mdfu_packet->data_length = 0;
+        return -1;
+    }
     if(type == MDFU_CMD){
         mdfu_packet->sync = (mdfu_packet->buf[0] & MDFU_HEADER_SYNC) ? true : false;
         mdfu_packet->command = mdfu_packet->buf[1];
@@ -372,182 +772,484 @@ int mdfu_decode_packet(mdfu_packet_t *mdfu_packet, mdfu_packet_type_t type, int
 }
 
 /**
- * @brief MDFU initialization
+ * @brief Allocates the session packet buffers for a MDFU packet size.
  *
- * @param transport MDFU transport
- * @param retries Number of retries for a MDFU transaction
- * @return int Initialization status. 0 for sucess
- */
-int mdfu_init(transport_t *transport, int retries){
-    mdfu_transport = transport;
-    sequence_number = 0;
-    send_retries = retries;
-    client_info_valid = false;
+ * All buffers are taken from one arena, see struct mdfu_session. The old
+ * arena is only released when the new one was allocated.
+ *
+ * @param session MDFU session
+ * @param packet_size Size in bytes of the largest MDFU packet.
+ * @param window_count Number of command packet buffers.
+ * @return int 0 for success and -1 for error with errno set
+ */
+static int alloc_packet_buffers(mdfu_session_t *session, int packet_size, int window_count){
+    size_t status_size = (size_t) packet_size + FRAME_CHECK_SEQUENCE_SIZE;
+    size_t arena_size = status_size + (size_t) packet_size * (size_t) window_count;
+    uint8_t *arena = ALLOCATE(uint8_t, arena_size);
+
+    if(NULL == arena){
+        errno = ENOMEM;
+        return -1;
+    }
+    FREE(session->arena);
+    session->arena = arena;
+    session->arena_size = arena_size;
+    session->status_packet_buffer = arena;
+    session->cmd_packet_buffer = &arena[status_size];
+    for(int i = 0; i < window_count; i++){
+        session->window[i].buffer = &session->cmd_packet_buffer[i * packet_size];
+    }
+    session->packet_size = packet_size;
+    session->window_count = window_count;
     return 0;
 }
 
 /**
- * @brief Runs the MDFU firmware update process using the provided image reader.
+ * @brief Create a MDFU session
  *
- * This function performs a series of steps to update the firmware, including
- * retrieving client information, checking protocol version compatibility,
- * setting inter-transaction delays, and writing data chunks. It ensures that
- * the image state is valid before finalizing the transfer.
+ * The session takes ownership of the transport and releases it in
+ * mdfu_session_destroy. The packet buffers are allocated for
+ * MDFU_PACKET_DEFAULT_SIZE until the client reports a larger buffer size.
  *
- * @param image_reader Pointer to the image reader structure that provides the firmware image.
- * @return int Returns 0 on success, or -1 on failure.
+ * @param session Pointer where the new session is stored
+ * @param transport MDFU transport
+ * @param retries Size of the retry budget, the number of times that commands
+ *                can be sent again before the budget is refilled by completed
+ *                commands.
+ * @return int 0 for success and -1 for error with errno set
  */
-int mdfu_run_update(const image_reader_t *image_reader){
-    mdfu_image_state_t state;
-    ssize_t size;
+int mdfu_session_create(mdfu_session_t **session, transport_t *transport, int retries){
+    mdfu_session_t *instance = calloc(1, sizeof(mdfu_session_t));
 
-    if(mdfu_get_client_info(&local_client_info) < 0){
-        goto err_exit;
-    }
-    if(version_check(local_client_info.version.major, local_client_info.version.minor, local_client_info.version.patch) < 0)
-    {
-        ERROR("MDFU client protocol version %d.%d.%d not supported. "\
-            "This MDFU host implements MDFU protocol version %s. "\
-            "Please update cmdfu to the latest version.", local_client_info.version.major, local_client_info.version.minor, local_client_info.version.patch, MDFU_PROTOCOL_VERSION);
-        goto err_exit;
-    }
-    if(MDFU_MAX_COMMAND_DATA_LENGTH < local_client_info.buffer_size){
-        ERROR("MDFU host protocol buffers are configured for a maximum command data length of %d but the client requires %d", MDFU_MAX_COMMAND_DATA_LENGTH, local_client_info.buffer_size);
-        goto err_exit;
+    if(NULL == instance){
+        errno = ENOMEM;
+        return -1;
     }
-    if (mdfu_transport->ioctl != NULL &&
-            0 > mdfu_transport->ioctl(TRANSPORT_IOC_INTER_TRANSACTION_DELAY, (float) local_client_info.inter_transaction_delay * ITD_SECONDS_PER_LSB)) {
-            goto err_exit;
+    instance->transport = transport;
+    instance->sequence_number = 0;
+    instance->retry_budget_max = retries;
+    instance->retry_budget = (float) retries;
+    instance->client_info_valid = false;
+    instance->step.status = MDFU_STEP_FAILED;
+    instance->step.fd = -1;
+    if(alloc_packet_buffers(instance, MDFU_PACKET_DEFAULT_SIZE, 1) < 0){
+        free(instance);
+        return -1;
     }
-    client_info_valid = true;
-    if(mdfu_start_transfer() < 0){
-        goto err_exit;
+    *session = instance;
+    return 0;
+}
+
+/**
+ * @brief Destroy a MDFU session
+ *
+ * Releases the session together with its transport. The session must be
+ * closed before it is destroyed.
+ *
+ * @param session MDFU session, can be NULL
+ */
+void mdfu_session_destroy(mdfu_session_t *session){
+    if(NULL != session){
+        transport_free(session->transport);
+        FREE(session->arena);
+        free(session);
     }
+}
 
-    do{
-        size = mdfu_write_chunk(image_reader, local_client_info.buffer_size);
-        if(size < 0){
-            goto err_exit;
-        }
-    // last data chunk read will be zero or less than client buffer size
-    }while(size == local_client_info.buffer_size);
+/**
+ * @brief Sizes the session and transport buffers for the client buffer size.
+ *
+ * The session buffers are sized for the window of WRITE_CHUNK commands that
+ * the client and the transport take. Buffers only grow, so that they always
+ * hold at least the packets of the default size.
+ *
+ * @param session MDFU session with the client information.
+ * @return int 0 on success, -1 on failure.
+ */
+static int client_buffers_configure(mdfu_session_t *session){
+    int packet_size = MDFU_SEQUENCE_FIELD_SIZE + MDFU_COMMAND_SIZE + session->client_info.buffer_size;
+    int window_count = get_window_size(session);
 
-    if(mdfu_get_image_state(&state) < 0){
-        goto err_exit;
+    if(packet_size <= session->packet_size && window_count <= session->window_count){
+        return 0;
     }
-    if(state != VALID){
-        ERROR("Image state %d is invalid", state);
-        goto err_exit;
+    if(packet_size < session->packet_size){
+        packet_size = session->packet_size;
     }
-    if(mdfu_end_transfer() < 0){
-        goto err_exit;
+    if(window_count < session->window_count){
+        window_count = session->window_count;
+    }
+    if(packet_size > session->packet_size && (TRANSPORT_OPS(session->transport)->ioctl == NULL ||
+        0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_PACKET_SIZE, packet_size))){
+        ERROR("Transport does not support the client buffer size of %d", session->client_info.buffer_size);
+        return -1;
+    }
+    if(alloc_packet_buffers(session, packet_size, window_count) < 0){
+        ERROR("Allocating buffers for the client buffer size of %d failed", session->client_info.buffer_size);
+        return -1;
     }
+    DEBUG("Allocated %zu bytes of MDFU buffers for the client buffer size of %d and %d commands in flight",
+          session->arena_size, session->client_info.buffer_size, window_count);
     return 0;
-
-    err_exit:
-    return -1;
 }
 
 /**
- * @brief Runs the MDFU firmware dump process using the provided image writer.
+ * @brief Configures the session for the client information.
  *
- * This function performs a series of steps to download the firmware, including
- * retrieving client information, checking protocol version compatibility,
- * setting inter-transaction delays, and reading data chunks. It ensures that
- * the image state is valid before finalizing the transfer.
+ * Checks that the client protocol version and buffer size are supported,
+ * sizes the protocol and transport buffers for the client buffer size and
+ * sets the inter transaction delay of the transport.
  *
- * @param image_writer Pointer to the image writer structure that provides the
- *                     interface for writing the firmware image.
- * @return int Returns 0 on success, or -1 on failure.
+ * @param session MDFU session with the client information.
+ * @return int 0 on success, -1 on failure.
  */
-int mdfu_run_dump(const image_writer_t *image_writer){
-    mdfu_image_state_t state;
-    ssize_t size;
-
-    if(mdfu_get_client_info(&local_client_info) < 0){
-        goto err_exit;
-    }
-    if(version_check(local_client_info.version.major, local_client_info.version.minor, local_client_info.version.patch) < 0)
+static int client_configure(mdfu_session_t *session){
+    if(version_check(session->client_info.version.major, session->client_info.version.minor, session->client_info.version.patch) < 0)
     {
         ERROR("MDFU client protocol version %d.%d.%d not supported. "\
             "This MDFU host implements MDFU protocol version %s. "\
-            "Please update cmdfu to the latest version.", local_client_info.version.major, local_client_info.version.minor, local_client_info.version.patch, MDFU_PROTOCOL_VERSION);
-        goto err_exit;
+            "Please update cmdfu to the latest version.", session->client_info.version.major, session->client_info.version.minor, session->client_info.version.patch, MDFU_PROTOCOL_VERSION);
+        return -1;
     }
-    if(MDFU_MAX_COMMAND_DATA_LENGTH < local_client_info.buffer_size){
-        ERROR("MDFU host protocol buffers are configured for a maximum command data length of %d but the client requires %d", MDFU_MAX_COMMAND_DATA_LENGTH, local_client_info.buffer_size);
-        goto err_exit;
+#ifndef MDFU_DYNAMIC_BUFFER_ALLOCATION
+    // Dynamically allocated buffers fit any client buffer size
+    if(MDFU_MAX_BUFFER_SIZE < session->client_info.buffer_size){
+        ERROR("MDFU host protocol buffers are configured for a maximum command data length of %d but the client requires %d", MDFU_MAX_BUFFER_SIZE, session->client_info.buffer_size);
+        return -1;
     }
-    if (mdfu_transport->ioctl != NULL &&
-            0 > mdfu_transport->ioctl(TRANSPORT_IOC_INTER_TRANSACTION_DELAY, (float) local_client_info.inter_transaction_delay * ITD_SECONDS_PER_LSB)) {
-            goto err_exit;
+#endif
+    if(client_buffers_configure(session) < 0){
+        return -1;
     }
-    client_info_valid = true;
-    if(mdfu_start_transfer() < 0){
-        goto err_exit;
+    if (TRANSPORT_OPS(session->transport)->ioctl != NULL &&
+            0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_INTER_TRANSACTION_DELAY, (float) session->client_info.inter_transaction_delay * ITD_SECONDS_PER_LSB)) {
+            return -1;
     }
+    session->client_info_valid = true;
+    return 0;
+}
 
-    do{
-        size = mdfu_read_chunk(image_writer, local_client_info.buffer_size);
-        if(size < 0){
-            goto err_exit;
-        }
-    // last data chunk read will be zero or less than client buffer size
-    }while(size == local_client_info.buffer_size);
-
-    if(mdfu_end_transfer() < 0){
-        goto err_exit;
+/**
+ * @brief Retrieves the client information and configures the session for it.
+ *
+ * The client information is only requested once per connection, so that
+ * several actions on one open session do not repeat it.
+ *
+ * @param session MDFU session
+ * @return int 0 on success, -1 on failure.
+ */
+static int client_setup(mdfu_session_t *session){
+    if(session->client_info_valid){
+        return 0;
+    }
+    if(mdfu_get_client_info(session, &session->client_info) < 0){
+        return -1;
+    }
+    if(client_configure(session) < 0){
+        return -1;
     }
+    session->client_info_confirmed = true;
     return 0;
-
-    err_exit:
-    return -1;
 }
 
 /**
- * @brief Runs the MDFU change mode process.
+ * @brief Sends the first command of an action and checks preloaded client information.
  *
- * This function performs a series of steps to change bootloader mode, including
- * retrieving client information, checking protocol version compatibility,
- * setting inter-transaction delays, and writing data chunks. It ensures that
- * the image state is valid before finalizing the transfer.
+ * Client information that was set with mdfu_session_set_client_info is
+ * confirmed when the command succeeds. If the command fails, the information
+ * is requested from the client and the command is sent again, so that stale
+ * information only costs a failed command.
  *
- * @param image_reader Pointer to the image reader structure that provides the
- * firmware image.
- * @return int Returns 0 on success, or -1 on failure.
+ * @param session MDFU session
+ * @param command Function that sends the command.
+ * @return int 0 on success, -1 on failure.
  */
-int mdfu_run_change_mode(void) {
-
-  if (mdfu_get_client_info(&local_client_info) < 0) {
-    goto err_exit;
-  }
-  if (version_check(local_client_info.version.major,
-                    local_client_info.version.minor,
-                    local_client_info.version.patch) < 0) {
-    ERROR("MDFU client protocol version %d.%d.%d not supported. "
-          "This MDFU host implements MDFU protocol version %s. "
-          "Please update cmdfu to the latest version.",
-          local_client_info.version.major, local_client_info.version.minor,
-          local_client_info.version.patch, MDFU_PROTOCOL_VERSION);
+static int first_command(mdfu_session_t *session, int (*command)(mdfu_session_t *session)){
+    if(command(session) == 0){
+        if(session->client_info_preloaded){
+            session->client_info_preloaded = false;
+            session->client_info_confirmed = true;
+        }
+        return 0;
+    }
+    if(!session->client_info_preloaded){
+        return -1;
+    }
+    WARN("Command failed with the stored client information, requesting it from the client");
+    session->client_info_preloaded = false;
+    session->client_info_valid = false;
+    if(client_setup(session) < 0){
+        return -1;
+    }
+    return command(session);
+}
+
+/**
+ * @brief Sets the client information without requesting it from the client.
+ *
+ * This skips the GET_CLIENT_INFO command for known clients, e.g. with
+ * information that was stored from an earlier session with the same client.
+ * The session is configured for the information right away and the first
+ * command of the next mdfu_run_xxx function checks it, see first_command.
+ * mdfu_open discards the information.
+ *
+ * @param session Opened MDFU session
+ * @param client_info Client information.
+ * @return int 0 on success, -1 if the host does not support the client.
+ */
+int mdfu_session_set_client_info(mdfu_session_t *session, const client_info_t *client_info){
+    session->client_info = *client_info;
+    if(client_configure(session) < 0){
+        session->client_info_valid = false;
+        return -1;
+    }
+    session->client_info_preloaded = true;
+    session->client_info_confirmed = false;
+    return 0;
+}
+
+/**
+ * @brief Gets the client information that the client confirmed in this connection.
+ *
+ * The information was either reported by the client or set with
+ * mdfu_session_set_client_info and confirmed by a successful command. It
+ * stays available after a mode change, which ends the connection to the
+ * bootloader that reported it.
+ *
+ * @param session MDFU session
+ * @param client_info Pointer where the client information is stored.
+ * @return true if confirmed client information is available.
+ */
+bool mdfu_session_get_confirmed_client_info(const mdfu_session_t *session, client_info_t *client_info){
+    if(!session->client_info_confirmed){
+        return false;
+    }
+    *client_info = session->client_info;
+    return true;
+}
+
+/**
+ * @brief Runs the MDFU firmware update process using the provided image reader.
+ *
+ * This function performs a series of steps to update the firmware, including
+ * retrieving client information, checking protocol version compatibility,
+ * setting inter-transaction delays, and writing data chunks. It ensures that
+ * the image state is valid before finalizing the transfer.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to the image reader structure that provides the firmware image.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int mdfu_run_update(mdfu_session_t *session, const image_reader_t *image_reader){
+    mdfu_image_state_t state;
+    ssize_t size;
+    int window_size;
+
+    if(client_setup(session) < 0){
+        goto err_exit;
+    }
+    if(first_command(session, mdfu_start_transfer) < 0){
+        goto err_exit;
+    }
+
+    window_size = get_window_size(session);
+    if(window_size > session->window_count){
+        window_size = session->window_count;
+    }
+    if(window_size > 1){
+        DEBUG("Sending image with %d write chunk commands in flight", window_size);
+        if(mdfu_write_chunks_windowed(session, image_reader, session->client_info.buffer_size, window_size) < 0){
+            goto err_exit;
+        }
+    }else if(session->window_count >= MDFU_PIPELINE_SLOTS ||
+             alloc_packet_buffers(session, session->packet_size, MDFU_PIPELINE_SLOTS) == 0){
+        if(mdfu_write_chunks_pipelined(session, image_reader, session->client_info.buffer_size) < 0){
+            goto err_exit;
+        }
+    }else{
+        DEBUG("Sending image without preparing the next chunk, allocating its buffer failed");
+        do{
+            size = mdfu_write_chunk(session, image_reader, session->client_info.buffer_size);
+            if(size < 0){
+                goto err_exit;
+            }
+        // last data chunk read will be zero or less than client buffer size
+        }while(size == session->client_info.buffer_size);
+    }
+
+    if(mdfu_get_image_state(session, &state) < 0){
+        goto err_exit;
+    }
+    if(state != VALID){
+        ERROR("Image state %d is invalid", state);
+        goto err_exit;
+    }
+    if(mdfu_end_transfer(session) < 0){
+        goto err_exit;
+    }
+    return 0;
+
+    err_exit:
+    return -1;
+}
+
+/**
+ * @brief Runs the MDFU firmware dump process using the provided image writer.
+ *
+ * This function performs a series of steps to download the firmware, including
+ * retrieving client information, checking protocol version compatibility,
+ * setting inter-transaction delays, and reading data chunks. It ensures that
+ * the image state is valid before finalizing the transfer.
+ *
+ * @param session MDFU session
+ * @param image_writer Pointer to the image writer structure that provides the
+ *                     interface for writing the firmware image.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int mdfu_run_dump(mdfu_session_t *session, const image_writer_t *image_writer){
+    return mdfu_run_dump_chunks(session, image_writer, 0);
+}
+
+/**
+ * @brief Runs the MDFU firmware dump process for the first chunks of the image.
+ *
+ * Same as mdfu_run_dump, but the transfer is ended after chunk_count chunks
+ * like a verify that found a difference, e.g. to measure the read throughput
+ * of a link without reading the whole image.
+ *
+ * @param session MDFU session
+ * @param image_writer Pointer to the image writer structure that provides the
+ *                     interface for writing the firmware image.
+ * @param chunk_count Maximum number of chunks to read, 0 reads the whole image.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int mdfu_run_dump_chunks(mdfu_session_t *session, const image_writer_t *image_writer, int chunk_count){
+    ssize_t size;
+    int chunks = 0;
+
+    if(client_setup(session) < 0){
+        goto err_exit;
+    }
+    if(first_command(session, mdfu_start_transfer) < 0){
+        goto err_exit;
+    }
+
+    do{
+        size = mdfu_read_chunk(session, image_writer, session->client_info.buffer_size);
+        if(size < 0){
+            goto err_exit;
+        }
+        chunks++;
+    // last data chunk read will be zero or less than client buffer size
+    }while(size == session->client_info.buffer_size && (0 == chunk_count || chunks < chunk_count));
+
+    if(mdfu_end_transfer(session) < 0){
+        goto err_exit;
+    }
+    return 0;
+
+    err_exit:
+    return -1;
+}
+
+/**
+ * @brief Compares the client firmware image with the provided image.
+ *
+ * Reads the client image back with READ_CHUNK commands and compares each chunk
+ * as it is received, so that the comparison stops at the first chunk that
+ * differs. Only the length of the provided image is compared, client data past
+ * its end is not read.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to the image reader structure that provides the
+ *                     image to compare with.
+ * @param[out] identical Set to true if the client image matches, false otherwise.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int mdfu_run_verify(mdfu_session_t *session, const image_reader_t *image_reader, bool *identical){
+    ssize_t size;
+    size_t offset = 0;
+
+    *identical = false;
+    if(client_setup(session) < 0){
+        goto err_exit;
+    }
+    if(first_command(session, mdfu_start_transfer) < 0){
+        goto err_exit;
+    }
+
+    *identical = true;
+    do{
+        size = mdfu_verify_chunk(session, image_reader, session->client_info.buffer_size, offset, identical);
+        if(size < 0){
+            goto err_exit;
+        }
+        offset += (size_t) size;
+    // last image chunk will be zero or less than client buffer size
+    }while(*identical && size == session->client_info.buffer_size);
+
+    if(mdfu_end_transfer(session) < 0){
+        goto err_exit;
+    }
+    return 0;
+
+    err_exit:
+    *identical = false;
+    return -1;
+}
+
+/**
+ * @brief Runs the MDFU change mode process.
+ *
+ * This function performs a series of steps to change bootloader mode, including
+ * retrieving client information, checking protocol version compatibility,
+ * setting inter-transaction delays, and writing data chunks. It ensures that
+ * the image state is valid before finalizing the transfer.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to the image reader structure that provides the
+ * firmware image.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int mdfu_run_change_mode(mdfu_session_t *session) {
+
+  if (!session->client_info_valid) {
+    if (mdfu_get_client_info(session, &session->client_info) < 0) {
+      goto err_exit;
+    }
+    session->client_info_confirmed = true;
+  }
+  if (version_check(session->client_info.version.major,
+                    session->client_info.version.minor,
+                    session->client_info.version.patch) < 0) {
+    ERROR("MDFU client protocol version %d.%d.%d not supported. "
+          "This MDFU host implements MDFU protocol version %s. "
+          "Please update cmdfu to the latest version.",
+          session->client_info.version.major, session->client_info.version.minor,
+          session->client_info.version.patch, MDFU_PROTOCOL_VERSION);
     goto err_exit;
   }
-  if (MDFU_MAX_COMMAND_DATA_LENGTH < local_client_info.buffer_size) {
+#ifndef MDFU_DYNAMIC_BUFFER_ALLOCATION
+  if (MDFU_MAX_BUFFER_SIZE < session->client_info.buffer_size) {
     ERROR("MDFU host protocol buffers are configured for a maximum command "
           "data length of %d but the client requires %d",
-          MDFU_MAX_COMMAND_DATA_LENGTH, local_client_info.buffer_size);
+          MDFU_MAX_BUFFER_SIZE, session->client_info.buffer_size);
     goto err_exit;
   }
-  if (mdfu_transport->ioctl != NULL &&
-      0 > mdfu_transport->ioctl(
-              TRANSPORT_IOC_INTER_TRANSACTION_DELAY,
-              (float)local_client_info.inter_transaction_delay *
+#endif
+  if (TRANSPORT_OPS(session->transport)->ioctl != NULL &&
+      0 > TRANSPORT_OPS(session->transport)->ioctl(
+              session->transport, TRANSPORT_IOC_INTER_TRANSACTION_DELAY,
+              (float)session->client_info.inter_transaction_delay *
                   ITD_SECONDS_PER_LSB)) {
     goto err_exit;
   }
-  client_info_valid = true;
-  if (mdfu_change_mode() < 0) {
+  session->client_info_valid = true;
+  if (first_command(session, mdfu_change_mode) < 0) {
     goto err_exit;
   }
+  // The client leaves the bootloader
+  session->client_info_valid = false;
   return 0;
 
 err_exit:
@@ -559,18 +1261,19 @@ err_exit:
  *
  * This function sends a START_TRANSFER command to initiate a data transfer.
  *
+ * @param session MDFU session
  * @return 0 on success, -1 on failure.
  */
-int mdfu_start_transfer(void){
+int mdfu_start_transfer(mdfu_session_t *session){
     mdfu_packet_t mdfu_status_packet;
     mdfu_packet_t mdfu_cmd_packet = {
         .command = START_TRANSFER,
         .sync = false,
         .data_length = 0
     };
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
 
-    if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+    if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
         return -1;
     }
     return 0;
@@ -581,17 +1284,18 @@ int mdfu_start_transfer(void){
  *
  * This function sends an END_TRANSFER command to terminate a data transfer.
  *
+ * @param session MDFU session
  * @return 0 on success, -1 on failure.
  */
-int mdfu_end_transfer(void){
+int mdfu_end_transfer(mdfu_session_t *session){
     mdfu_packet_t mdfu_status_packet;
     mdfu_packet_t mdfu_cmd_packet = {
         .command = END_TRANSFER,
         .sync = false,
         .data_length = 0
     };
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
-    if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
+    if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
         return -1;
     }
     return 0;
@@ -603,18 +1307,19 @@ int mdfu_end_transfer(void){
  * This function sends a GET_IMAGE_STATE command and updates the provided state variable
  * with the current image state.
  *
+ * @param session MDFU session
  * @param[out] state Pointer to a variable to store the current image state.
  * @return 0 on success, -1 on failure.
  */
-int mdfu_get_image_state(mdfu_image_state_t *state){
+int mdfu_get_image_state(mdfu_session_t *session, mdfu_image_state_t *state){
     mdfu_packet_t mdfu_status_packet;
     mdfu_packet_t mdfu_cmd_packet = {
         .command = GET_IMAGE_STATE,
         .sync = false,
         .data_length = 0
     };
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
-    if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
+    if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
         return -1;
     }
     assert(mdfu_status_packet.data != NULL);
@@ -622,6 +1327,81 @@ int mdfu_get_image_state(mdfu_image_state_t *state){
     return 0;
 }
 
+/**
+ * @brief Reads the data for a WRITE_CHUNK command from the image.
+ *
+ * When the image reader can lend out its data and the transport can send a
+ * packet from multiple buffers, the packet data points directly into the
+ * image instead of being copied into the packet buffer.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to an image reader structure.
+ * @param packet Command packet, data points to the packet buffer on entry.
+ * @param size The size of the data chunk to read.
+ * @return ssize_t Number of bytes read, zero at the end of the image or -1 on error.
+ */
+static ssize_t read_chunk(mdfu_session_t *session, const image_reader_t *image_reader, mdfu_packet_t *packet, int size){
+    const void *data;
+    ssize_t read_size;
+
+    if(NULL == image_reader->peek || NULL == TRANSPORT_OPS(session->transport)->writev){
+        return image_reader->read(image_reader, packet->data, size);
+    }
+    read_size = image_reader->peek(image_reader, &data, size);
+    if(read_size > 0){
+        if(image_reader->advance(image_reader, read_size) < 0){
+            return -1;
+        }
+        // Borrowed image data is only read
+        packet->data = (uint8_t *) data;
+    }
+    return read_size;
+}
+
+/**
+ * @brief Gets the buffers that an encoded MDFU command packet is sent from.
+ *
+ * Packets with data outside of the packet buffer are sent from the header and
+ * the data, all others from the packet buffer.
+ *
+ * @param packet Encoded command packet.
+ * @param size Size of the encoded packet.
+ * @param[out] iov Two buffers for the packet.
+ * @return int Number of buffers.
+ */
+static int packet_iov(const mdfu_packet_t *packet, int size, mac_iovec_t *iov){
+    if(packet->data != &packet->buf[2]){
+        iov[0].data = packet->buf;
+        iov[0].size = 2;
+        iov[1].data = packet->data;
+        iov[1].size = packet->data_length;
+        return 2;
+    }
+    iov[0].data = packet->buf;
+    iov[0].size = size;
+    return 1;
+}
+
+/**
+ * @brief Sends an encoded MDFU command packet.
+ *
+ * Packets with data outside of the packet buffer are sent with a scatter/gather
+ * write of the header and the data.
+ *
+ * @param session MDFU session
+ * @param packet Encoded command packet.
+ * @param size Size of the encoded packet.
+ * @return int Status of the transport write.
+ */
+static int send_packet(mdfu_session_t *session, const mdfu_packet_t *packet, int size){
+    mac_iovec_t iov[2];
+
+    if(2 == packet_iov(packet, size, iov)){
+        return TRANSPORT_OPS(session->transport)->writev(session->transport, 2, iov);
+    }
+    return TRANSPORT_OPS(session->transport)->write(session->transport, size, packet->buf);
+}
+
 /**
  * @brief Writes a chunk of firmware update image data.
  *
@@ -630,60 +1410,415 @@ int mdfu_get_image_state(mdfu_image_state_t *state){
  * until the whole image is transferred. For the last data chunk the function will return
  * less than the requested size.
  *
+ * @param session MDFU session
  * @param[in] image_reader Pointer to an image reader structure.
  * @param[in] size The size of the data chunk to read and write.
  * @return The number of bytes read and written on success, -1 on failure.
  */
-ssize_t mdfu_write_chunk(const image_reader_t *image_reader, int size){
+ssize_t mdfu_write_chunk(mdfu_session_t *session, const image_reader_t *image_reader, int size){
     mdfu_packet_t mdfu_cmd_packet = {
         .command = WRITE_CHUNK,
         .sync = false,
     };
     mdfu_packet_t mdfu_status_packet;
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
     ssize_t read_size;
 
-    read_size = image_reader->read(mdfu_cmd_packet.data, size);
+    read_size = read_chunk(session, image_reader, &mdfu_cmd_packet, size);
     if(0 > read_size){
         ERROR("%s", strerror(errno));
         return -1;
     }
     if(0 != read_size){
         mdfu_cmd_packet.data_length = (uint16_t) read_size;
-        if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+        if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
             return -1;
         }
     }
     return read_size;
 }
 
+/**
+ * @brief Prepares a WRITE_CHUNK command in a window slot.
+ *
+ * Reads the next chunk of the image into the slot and encodes the MDFU header
+ * with the sequence number that the command will be sent with.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to an image reader structure.
+ * @param slot Window slot for the command.
+ * @param size The size of the data chunk to read.
+ * @param sequence_number Sequence number of the command.
+ * @return ssize_t Number of bytes read, zero at the end of the image or -1 on error.
+ */
+static ssize_t window_prepare(mdfu_session_t *session, const image_reader_t *image_reader, window_slot_t *slot, int size, uint8_t sequence_number){
+    ssize_t read_size;
+
+    slot->packet.buf = slot->buffer;
+    slot->packet.data = &slot->buffer[2];
+    read_size = read_chunk(session, image_reader, &slot->packet, size);
+    if(0 > read_size){
+        ERROR("%s", strerror(errno));
+        return -1;
+    }
+    slot->packet.command = WRITE_CHUNK;
+    slot->packet.sync = false;
+    slot->packet.data_length = (uint16_t) read_size;
+    slot->packet.sequence_number = sequence_number;
+    slot->size = (int) mdfu_encode_cmd_packet(&slot->packet);
+    slot->retransmitted = false;
+    return read_size;
+}
+
+/**
+ * @brief Sends a command from the send window.
+ *
+ * @param session MDFU session
+ * @param slot Window slot holding the encoded command packet.
+ * @return int 0 on success, negative value on error.
+ */
+static int window_send(mdfu_session_t *session, window_slot_t *slot){
+    session->stats.cmd[WRITE_CHUNK].attempts += 1;
+    set_timeout(&slot->sent, 0);
+    DEBUG("Sending MDFU command packet");
+    mdfu_log_packet(&slot->packet, MDFU_CMD);
+    return send_packet(session, &slot->packet, slot->size);
+}
+
+/**
+ * @brief Discards client responses for commands that will be retransmitted.
+ *
+ * @param session MDFU session
+ * @param count Number of responses still expected from the client.
+ * @param timeout Timeout in seconds for all responses.
+ */
+static void window_drain(mdfu_session_t *session, int count, float timeout){
+    timeout_t deadline;
+    float remaining;
+    int size;
+
+    set_timeout(&deadline, timeout);
+    for(; count > 0; count--){
+        remaining = (float) timeout_remaining_ns(&deadline) / 1e9f;
+        if(remaining <= 0 ||
+            TRANSPORT_OPS(session->transport)->read(session->transport, &size, session->status_packet_buffer, remaining) < 0){
+            break;
+        }
+        DEBUG("Discarded MDFU status packet for retransmitted command");
+    }
+}
+
+/**
+ * @brief Writes the firmware image with multiple WRITE_CHUNK commands in flight.
+ *
+ * Up to window_size commands are sent before waiting for the response to the
+ * oldest unacknowledged command. Commands are tracked by their sequence number
+ * and a successful response acknowledges the command with the same sequence
+ * number and all commands sent before it, since the client executes the
+ * commands in order.
+ *
+ * After a resend request, a rejected sequence number or a corrupted response
+ * the responses to the other commands in flight are still received, since a
+ * later successful response shows that the client executed the command after
+ * all. The client only repeats the response to the last command it executed,
+ * so retransmitting commands it already executed would get them rejected.
+ * Once no more responses are expected, or on a response timeout, all
+ * unacknowledged commands are retransmitted, starting with the oldest one.
+ * New commands are only sent after all of them were sent again.
+ *
+ * @param session MDFU session
+ * @param[in] image_reader Pointer to an image reader structure.
+ * @param[in] size The size of the data chunks.
+ * @param[in] window_size Maximum number of commands in flight.
+ * @return int 0 on success, negative error code on failure.
+ */
+static int mdfu_write_chunks_windowed(mdfu_session_t *session, const image_reader_t *image_reader, int size, int window_size){
+    mdfu_packet_t mdfu_status_packet = {
+        .buf = session->status_packet_buffer
+    };
+    float cmd_timeout;
+    bool end_of_image = false;
+    int head = 0;       // Window index of the oldest unacknowledged command
+    int in_flight = 0;  // Number of unacknowledged commands
+    int pending = 0;    // Number of responses expected from the client
+    int unsent = 0;     // Number of unacknowledged commands to retransmit
+    int status_packet_size;
+    int acked;
+    int status;
+    bool retransmit;
+    bool resend = false;  // Retransmit once the responses in flight were received
+    mdfu_cmd_stats_t *cmd_stats = &session->stats.cmd[WRITE_CHUNK];
+    transport_stats_t before;
+
+    while(!end_of_image || in_flight > 0){
+        retransmit = false;
+
+        // Retransmit the unacknowledged commands, oldest first
+        while(unsent > 0){
+            window_slot_t *slot = &session->window[(head + in_flight - unsent) % window_size];
+
+            slot->retransmitted = true;
+            before = session->transport->stats;
+            if(window_send(session, slot) < 0){
+                record_transport_retry(session, &before);
+                retransmit = true;
+                break;
+            }
+            unsent -= 1;
+            pending += 1;
+        }
+
+        // Fill up the window with new chunks unless commands must be resent
+        while(!retransmit && !resend && !end_of_image && in_flight < window_size){
+            window_slot_t *slot = &session->window[(head + in_flight) % window_size];
+            ssize_t read_size;
+
+            read_size = window_prepare(session, image_reader, slot, size, session->sequence_number);
+            if(0 > read_size){
+                return -1;
+            }
+            // last data chunk read will be zero or less than client buffer size
+            if(read_size < size){
+                end_of_image = true;
+            }
+            if(0 == read_size){
+                break;
+            }
+            increment_sequence_number(session);
+            in_flight += 1;
+            before = session->transport->stats;
+            if(window_send(session, slot) < 0){
+                record_transport_retry(session, &before);
+                retransmit = true;
+                break;
+            }
+            pending += 1;
+        }
+        if(0 == in_flight){
+            break;
+        }
+
+        cmd_timeout = get_response_timeout(session, WRITE_CHUNK);
+        if(!retransmit){
+            before = session->transport->stats;
+            status = TRANSPORT_OPS(session->transport)->read(session->transport, &status_packet_size, mdfu_status_packet.buf, cmd_timeout);
+            if(pending > 0){
+                pending -= 1;
+            }
+            if(status < 0 && session->transport->stats.integrity_errors == before.integrity_errors){
+                if(session->transport->stats.timeouts != before.timeouts){
+                    rtt_backoff(session, WRITE_CHUNK);
+                }
+                record_transport_retry(session, &before);
+                retransmit = true;
+            }else if(status < 0 || mdfu_decode_packet(&mdfu_status_packet, MDFU_STATUS, status_packet_size) < 0){
+                // A malformed response is handled like a corrupted one
+                DEBUG("Discarded corrupted MDFU status packet");
+                if(0 == pending){
+                    session->stats.retries_integrity += 1;
+                }
+                resend = true;
+            }else{
+                DEBUG("Received MDFU status packet");
+                mdfu_log_packet(&mdfu_status_packet, MDFU_STATUS);
+
+                // Find the command this response belongs to
+                for(acked = 0; acked < in_flight; acked++){
+                    if(session->window[(head + acked) % window_size].packet.sequence_number == mdfu_status_packet.sequence_number){
+                        break;
+                    }
+                }
+                if(acked == in_flight){
+                    DEBUG("Ignoring MDFU status packet with sequence number %d outside of the send window", mdfu_status_packet.sequence_number);
+                    acked = 0;
+                }else{
+                    window_slot_t *acked_slot = &session->window[(head + acked) % window_size];
+                    // Responses arrive in order, so earlier commands without a
+                    // response were lost and only the later ones are answered
+                    pending = in_flight - acked - 1;
+                    record_rtt(cmd_stats, timeout_elapsed(&acked_slot->sent));
+                    if(!acked_slot->retransmitted){
+                        rtt_sample(session, WRITE_CHUNK, timeout_elapsed(&acked_slot->sent));
+                    }
+                    if(mdfu_status_packet.resend){
+                        DEBUG("Client requested resending MDFU packet with sequence number %d", mdfu_status_packet.sequence_number);
+                        record_client_retry(session, &mdfu_status_packet);
+                        resend = true;
+                    }else if(mdfu_status_packet.status == COMMAND_NOT_EXECUTED &&
+                                mdfu_status_packet.data_length > 0 &&
+                                mdfu_status_packet.data[0] == SEQUENCE_NUMBER_INVALID){
+                        // The client rejects commands that follow a command it did not
+                        // receive so none of the commands in the window are acknowledged
+                        DEBUG("Client rejected MDFU packet with sequence number %d", mdfu_status_packet.sequence_number);
+                        record_client_retry(session, &mdfu_status_packet);
+                        acked = 0;
+                        resend = true;
+                    }else if(mdfu_status_packet.status != SUCCESS){
+                        log_error_cause(&mdfu_status_packet);
+                        return -EPROTO;
+                    }else{
+                        // Commands before and including this one are acknowledged
+                        acked += 1;
+                        retry_budget_deposit(session, acked);
+                        for(int i = 0; i < acked; i++){
+                            cmd_stats->count += 1;
+                            cmd_stats->data_bytes += session->window[(head + i) % window_size].packet.data_length;
+                        }
+                        // Earlier commands that were rejected or got a corrupted
+                        // response were executed after all
+                        resend = false;
+                    }
+                    head = (head + acked) % window_size;
+                    in_flight -= acked;
+                }
+            }
+            if(resend && 0 == pending && in_flight > 0){
+                retransmit = true;
+            }
+        }
+        if(retransmit){
+            if(!retry_budget_withdraw(session)){
+                ERROR("Failed to send command, retry budget of %d retries exhausted", session->retry_budget_max);
+                return -EIO;
+            }
+            window_drain(session, pending, cmd_timeout);
+            pending = 0;
+            unsent = in_flight;
+            resend = false;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the firmware image with the next chunk prepared while the
+ * current one is in flight.
+ *
+ * For clients that take one WRITE_CHUNK command at a time the command and
+ * response alternate, so the link is idle while the host reads the next chunk
+ * and the transport frames it. Here the next chunk is read into the other of
+ * two window slots and its header encoded while the response to the current
+ * chunk is outstanding, and transports with a prepare operation also frame it
+ * then, so it is sent right after the response arrives. The sequence number of
+ * the next command is known in advance since a command is only followed by the
+ * next one after it succeeded.
+ *
+ * @param session MDFU session with at least MDFU_PIPELINE_SLOTS window slots.
+ * @param[in] image_reader Pointer to an image reader structure.
+ * @param[in] size The size of the data chunks.
+ * @return int 0 on success, negative error code on failure.
+ */
+static int mdfu_write_chunks_pipelined(mdfu_session_t *session, const image_reader_t *image_reader, int size){
+    mdfu_packet_t mdfu_status_packet = {
+        .buf = session->status_packet_buffer
+    };
+    transaction_t transaction;
+    window_slot_t *slot = &session->window[0];
+    window_slot_t *next = &session->window[1];
+    window_slot_t *swap;
+    ssize_t read_size;
+    ssize_t next_size;
+    int status;
+
+    next_size = window_prepare(session, image_reader, slot, size, session->sequence_number);
+    while(next_size > 0){
+        read_size = next_size;
+        next_size = 0;
+        transaction_begin(session, &transaction, &slot->packet, &mdfu_status_packet);
+        status = transaction_send(session, &transaction);
+
+        // last data chunk read will be zero or less than client buffer size
+        if(read_size == size){
+            next_size = window_prepare(session, image_reader, next, size, (session->sequence_number + 1) & 0x1F);
+            if(0 > next_size){
+                return -1;
+            }
+            if(next_size > 0 && NULL != TRANSPORT_OPS(session->transport)->prepare){
+                mac_iovec_t iov[2];
+                int count = packet_iov(&next->packet, next->size, iov);
+
+                // A chunk that could not be prepared is framed when it is sent
+                TRANSPORT_OPS(session->transport)->prepare(session->transport, count, iov);
+            }
+        }
+
+        if(status >= 0){
+            status = transaction_receive(session, &transaction, transaction.timeout);
+        }else{
+            status = TRANSACTION_RETRY;
+        }
+        if(TRANSACTION_RETRY == status){
+            status = transaction_run(session, &transaction);
+        }
+        if(status < 0){
+            return status;
+        }
+        swap = slot;
+        slot = next;
+        next = swap;
+    }
+    return 0;
+}
+
 /**
  * @brief Reads a chunk of firmware update image data.
  *
  * This function sends a command to read a chunk of data from the client and writes it
- * to the provided image writer.
+ * to the provided image writer. When the image writer can lend out its buffers and the
+ * transport can receive a packet into multiple buffers, the data is received directly
+ * into the image writer buffer instead of being copied from the status packet buffer.
  *
+ * @param session MDFU session
  * @param[in] image_writer Pointer to an image writer structure.
  * @param[in] size The size of the data chunk to read and write.
  * @return The number of bytes read and written on success, -1 on failure.
  */
-ssize_t mdfu_read_chunk(const image_writer_t *image_writer, int size){
+ssize_t mdfu_read_chunk(mdfu_session_t *session, const image_writer_t *image_writer, int size){
     mdfu_packet_t mdfu_cmd_packet = {
         .command = READ_CHUNK,
         .sync = false,
         .data_length = 0
     };
     mdfu_packet_t mdfu_status_packet;
+    transaction_t transaction;
     ssize_t write_size = 0;
+    ssize_t lent_size = 0;
+    void *lent_data = NULL;
+    int status;
 
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
+
+    if(NULL != image_writer->reserve && NULL != TRANSPORT_OPS(session->transport)->readv){
+        lent_size = image_writer->reserve(&lent_data, (size_t) size);
+        if(lent_size < 0){
+            ERROR("%s", strerror(errno));
+            return -1;
+        }
+    }
 
     // Send the command to request a chunk from the client
-    if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+    transaction_begin(session, &transaction, &mdfu_cmd_packet, &mdfu_status_packet);
+    if(lent_size > 0){
+        transaction.rx_data = lent_data;
+        transaction.rx_data_size = (int) lent_size;
+    }
+    status = transaction_run(session, &transaction);
+
+    if(lent_size > 0){
+        // The data is already in the image writer buffer, hand it over or release the buffer
+        if(image_writer->commit(status < 0 ? 0 : mdfu_status_packet.data_length) < 0){
+            ERROR("%s", strerror(errno));
+            return -1;
+        }
+    }
+    if(status < 0){
         return -1;
     }
 
-    if(mdfu_status_packet.data_length > 0){
+    if(mdfu_status_packet.data_length > 0 && lent_size > 0){
+        write_size = mdfu_status_packet.data_length;
+    }
+    else if(mdfu_status_packet.data_length > 0){
         // Write the received data to the image writer
         write_size = image_writer->write(mdfu_status_packet.data, mdfu_status_packet.data_length);
         if(write_size < 0){
@@ -698,87 +1833,295 @@ ssize_t mdfu_read_chunk(const image_writer_t *image_writer, int size){
     return write_size;
 }
 
+/**
+ * @brief Compares a chunk of the client image with the provided image.
+ *
+ * Reads the next image chunk and requests the same amount of data from the
+ * client with a READ_CHUNK command. Nothing is requested from the client at
+ * the end of the image.
+ *
+ * @param session MDFU session
+ * @param[in] image_reader Pointer to an image reader structure.
+ * @param[in] size The size of the data chunk to compare.
+ * @param[in] offset Offset of the chunk in the image, used for logging.
+ * @param[out] identical Set to false if the chunk differs.
+ * @return The number of bytes compared on success, -1 on failure.
+ */
+static ssize_t mdfu_verify_chunk(mdfu_session_t *session, const image_reader_t *image_reader, int size, size_t offset, bool *identical){
+    mdfu_packet_t mdfu_cmd_packet = {
+        .command = READ_CHUNK,
+        .sync = false,
+        .data_length = 0
+    };
+    mdfu_packet_t mdfu_status_packet;
+    uint8_t *buffer;
+    const void *expected;
+    ssize_t read_size;
+
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
+    // READ_CHUNK has no command data, so the image chunk is read into the
+    // data area of the command packet buffer
+    buffer = mdfu_cmd_packet.data;
+    expected = buffer;
+
+    if(NULL != image_reader->peek){
+        read_size = image_reader->peek(image_reader, &expected, size);
+        if(read_size > 0 && image_reader->advance(image_reader, read_size) < 0){
+            read_size = -1;
+        }
+    } else {
+        read_size = image_reader->read(image_reader, buffer, size);
+    }
+    if(0 > read_size){
+        ERROR("%s", strerror(errno));
+        return -1;
+    }
+    if(0 == read_size){
+        return 0;
+    }
+
+    if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
+        return -1;
+    }
+    if(mdfu_status_packet.data_length < read_size){
+        INFO("Client image ends at offset %zu before the end of the image", offset + mdfu_status_packet.data_length);
+        *identical = false;
+    } else if(0 != memcmp(mdfu_status_packet.data, expected, (size_t) read_size)){
+        INFO("Client image differs from the image in chunk at offset %zu", offset);
+        *identical = false;
+    }
+    return read_size;
+}
+
 /**
  * @brief Requests mode change from bootloader to application
  *
  * This function sends a CHANGE_MODE command to request mode change.
  *
- * @param None
+ * @param session MDFU session
  * @return 0 on success, -1 on failure.
  */
-int mdfu_change_mode(void) {
+int mdfu_change_mode(mdfu_session_t *session) {
   mdfu_packet_t mdfu_status_packet;
   mdfu_packet_t mdfu_cmd_packet = {
       .command = CHANGE_MODE, .sync = false, .data_length = 0};
-  mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
-  if (mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0) {
+  mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
+  if (mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0) {
     return -1;
   }
   return 0;
 }
 
 /**
- * @brief Sends a command packet and waits for a status packet response.
+ * @brief Starts a command transaction.
  *
- * This function encodes and sends a command packet, then waits for a status packet response.
- * It handles retries and timeouts based on the client information and command type.
+ * Assigns the sequence number, encodes the command packet and resets the
+ * retry counter.
  *
- * @param[in] mdfu_cmd_packet Pointer to the command packet to be sent.
- * @param[out] mdfu_status_packet Pointer to the status packet to be received.
- * @return int 0 on success, negative error code on failure.
+ * @param session MDFU session
+ * @param transaction Transaction to start.
+ * @param mdfu_cmd_packet Command packet to send.
+ * @param mdfu_status_packet Status packet for the response.
  */
-int mdfu_send_cmd(mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet){
-    int status;
-    int cmd_packet_size;
-    int status_packet_size;
-    int retries = send_retries;
-    float cmd_timeout = MDFU_CLIENT_INFO_CMD_TIMEOUT;
-
-    if(client_info_valid){
-        cmd_timeout = (float) (local_client_info.cmd_timeouts[mdfu_cmd_packet->command - 1] * SECONDS_PER_LSB);
+static void transaction_begin(mdfu_session_t *session, transaction_t *transaction, mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet){
+    if(!session->synced){
+        mdfu_cmd_packet->sync = true;
+        session->synced = true;
     }
     if(mdfu_cmd_packet->sync){
-        sequence_number = 0;
+        session->sequence_number = 0;
     }
-    mdfu_cmd_packet->sequence_number = sequence_number;
+    mdfu_cmd_packet->sequence_number = session->sequence_number;
 
-    cmd_packet_size = (int) mdfu_encode_cmd_packet(mdfu_cmd_packet);
+    transaction->cmd_packet = mdfu_cmd_packet;
+    transaction->status_packet = mdfu_status_packet;
+    transaction->cmd_packet_size = (int) mdfu_encode_cmd_packet(mdfu_cmd_packet);
+    transaction->rx_data = NULL;
+    transaction->rx_data_size = 0;
+    transaction->attempts = 0;
 
     DEBUG("Sending MDFU command packet");
     mdfu_log_packet(mdfu_cmd_packet, MDFU_CMD);
+}
 
-    while(retries){
-        retries -= 1;
-        status = mdfu_transport->write(cmd_packet_size, mdfu_cmd_packet->buf);
-        if(status < 0){
-            continue;
+/**
+ * @brief Checks if the command of a transaction can be sent.
+ *
+ * The first attempt is always allowed, each further attempt takes a retry
+ * from the session retry budget.
+ *
+ * @param session MDFU session
+ * @param transaction Started transaction.
+ * @return bool True if the command can be sent.
+ */
+static bool transaction_can_send(mdfu_session_t *session, const transaction_t *transaction){
+    return 0 == transaction->attempts || retry_budget_withdraw(session);
+}
+
+/**
+ * @brief Sends the command of a transaction.
+ *
+ * Sets the response timeout of the attempt from the adaptive response
+ * timeout of the command.
+ *
+ * @param session MDFU session
+ * @param transaction Started transaction that transaction_can_send allowed to send.
+ * @return int Status of the transport write, negative value on error.
+ */
+static int transaction_send(mdfu_session_t *session, transaction_t *transaction){
+    int status;
+
+    transaction->attempts += 1;
+    transaction->timeout = get_response_timeout(session, transaction->cmd_packet->command);
+    session->stats.cmd[transaction->cmd_packet->command].attempts += 1;
+    transaction->before = session->transport->stats;
+    set_timeout(&transaction->sent, 0);
+    status = send_packet(session, transaction->cmd_packet, transaction->cmd_packet_size);
+    if(status < 0){
+        record_transport_retry(session, &transaction->before);
+    }
+    return status;
+}
+
+/**
+ * @brief Receives a status packet.
+ *
+ * Responses with data for a buffer outside of the status packet buffer are
+ * received with a scatter read of the header and the data.
+ *
+ * @param session MDFU session
+ * @param transaction Transaction whose command was sent.
+ * @param size Pointer where the size of the status packet is stored.
+ * @param timeout Time in seconds to wait for the response.
+ * @return int Status of the transport read.
+ */
+static int receive_packet(mdfu_session_t *session, const transaction_t *transaction, int *size, float timeout){
+    if(NULL != transaction->rx_data){
+        transport_iovec_t iov[] = {
+            {.data = transaction->status_packet->buf, .size = 2},
+            {.data = transaction->rx_data, .size = transaction->rx_data_size}
+        };
+        return TRANSPORT_OPS(session->transport)->readv(session->transport, size, 2, iov, timeout);
+    }
+    return TRANSPORT_OPS(session->transport)->read(session->transport, size, transaction->status_packet->buf, timeout);
+}
+
+/**
+ * @brief Receives the response to the command of a transaction.
+ *
+ * Responses to earlier commands, which the client sends again when a command
+ * is retransmitted after its response was only late, are discarded.
+ *
+ * A response timeout backs off the response timeout of the command, while a
+ * corrupted response is retried right away.
+ *
+ * @param session MDFU session
+ * @param transaction Transaction whose command was sent.
+ * @param timeout Time in seconds to wait for the response.
+ * @return int 0 on success, TRANSACTION_RETRY if the command must be sent
+ *         again or -EPROTO if the client did not execute the command.
+ */
+static int transaction_receive(mdfu_session_t *session, transaction_t *transaction, float timeout){
+    mdfu_packet_t *mdfu_cmd_packet = transaction->cmd_packet;
+    mdfu_packet_t *mdfu_status_packet = transaction->status_packet;
+    mdfu_cmd_stats_t *cmd_stats = &session->stats.cmd[mdfu_cmd_packet->command];
+    int status_packet_size;
+    timeout_t started;
+    float remaining = timeout;
+    float rtt;
+
+    set_timeout(&started, 0);
+    while(true){
+        if(receive_packet(session, transaction, &status_packet_size, remaining) < 0){
+            if(session->transport->stats.timeouts != transaction->before.timeouts){
+                rtt_backoff(session, mdfu_cmd_packet->command);
+            }
+            record_transport_retry(session, &transaction->before);
+            return TRANSACTION_RETRY;
         }
-        status = mdfu_transport->read(&status_packet_size, mdfu_status_packet->buf, cmd_timeout);
-        if(status < 0){
-            continue;
+        if(mdfu_decode_packet(mdfu_status_packet, MDFU_STATUS, status_packet_size) < 0){
+            // A malformed response is handled like a corrupted one
+            session->stats.retries_integrity += 1;
+            return TRANSACTION_RETRY;
         }
-        mdfu_decode_packet(mdfu_status_packet, MDFU_STATUS, status_packet_size);
-        DEBUG("Received MDFU status packet");
-        mdfu_log_packet(mdfu_status_packet, MDFU_STATUS);
-
-        if(mdfu_status_packet->resend){
-            DEBUG("Client requested resending MDFU packet with sequence number %d", mdfu_status_packet->sequence_number);
-            continue;
+        if(mdfu_status_packet->resend || mdfu_status_packet->sequence_number == mdfu_cmd_packet->sequence_number){
+            break;
         }
+        DEBUG("Discarding MDFU status packet with sequence number %d of an earlier command", mdfu_status_packet->sequence_number);
+        remaining = timeout - timeout_elapsed(&started);
+        if(remaining < 0){
+            remaining = 0;
+        }
+    }
+    rtt = timeout_elapsed(&transaction->sent);
+    record_rtt(cmd_stats, rtt);
+    if(1 == transaction->attempts){
+        rtt_sample(session, mdfu_cmd_packet->command, rtt);
+    }
+    if(NULL != transaction->rx_data && mdfu_status_packet->data_length > 0){
+        mdfu_status_packet->data = transaction->rx_data;
+    }
+    DEBUG("Received MDFU status packet");
+    mdfu_log_packet(mdfu_status_packet, MDFU_STATUS);
 
-        increment_sequence_number();
+    if(mdfu_status_packet->resend){
+        DEBUG("Client requested resending MDFU packet with sequence number %d", mdfu_status_packet->sequence_number);
+        record_client_retry(session, mdfu_status_packet);
+        return TRANSACTION_RETRY;
+    }
 
-        if(mdfu_status_packet->status != SUCCESS){
-            log_error_cause(mdfu_status_packet);
-            status = -EPROTO;
-        }
-        break;
+    increment_sequence_number(session);
+    retry_budget_deposit(session, 1);
+    cmd_stats->count += 1;
+    cmd_stats->data_bytes += (uint64_t) (mdfu_cmd_packet->data_length + mdfu_status_packet->data_length);
+
+    if(mdfu_status_packet->status != SUCCESS){
+        log_error_cause(mdfu_status_packet);
+        return -EPROTO;
     }
-    if(retries == 0){
-        ERROR("Tried %d times to send command without success", send_retries);
-        status = -EIO;
+    return 0;
+}
+
+/**
+ * @brief Sends the command of a started transaction until a response is received.
+ *
+ * @param session MDFU session
+ * @param transaction Started transaction.
+ * @return int 0 on success, negative error code on failure.
+ */
+static int transaction_run(mdfu_session_t *session, transaction_t *transaction){
+    int status;
+
+    while(transaction_can_send(session, transaction)){
+        if(transaction_send(session, transaction) < 0){
+            continue;
+        }
+        status = transaction_receive(session, transaction, transaction->timeout);
+        // A response on the last attempt is not a failure
+        if(TRANSACTION_RETRY != status){
+            return status;
+        }
     }
-    return status;
+    ERROR("Tried %d times to send command without success, retry budget exhausted", transaction->attempts);
+    return -EIO;
+}
+
+/**
+ * @brief Sends a command packet and waits for a status packet response.
+ *
+ * This function encodes and sends a command packet, then waits for a status packet response.
+ * It handles retries and timeouts based on the client information and command type.
+ *
+ * @param session MDFU session
+ * @param[in] mdfu_cmd_packet Pointer to the command packet to be sent.
+ * @param[out] mdfu_status_packet Pointer to the status packet to be received.
+ * @return int 0 on success, negative error code on failure.
+ */
+int mdfu_send_cmd(mdfu_session_t *session, mdfu_packet_t *mdfu_cmd_packet, mdfu_packet_t *mdfu_status_packet){
+    transaction_t transaction;
+
+    transaction_begin(session, &transaction, mdfu_cmd_packet, mdfu_status_packet);
+    return transaction_run(session, &transaction);
 }
 
 /**
@@ -973,13 +2316,39 @@ int mdfu_decode_client_info(const uint8_t *data, int length, client_info_t *clie
     return 0;
 }
 
+/**
+ * @brief Gets the client information of the session.
+ *
+ * The client information is requested from the client on the first call
+ * after the session was opened and the session is configured for it, later
+ * calls and the mdfu_run_xxx functions use the stored information. The
+ * information of clients that this host does not support is also returned.
+ *
+ * @param session MDFU session
+ * @param client_info Pointer to client_info_t struct to store the data.
+ * @return int Success=0, Error=-1
+ */
+int mdfu_session_get_client_info(mdfu_session_t *session, client_info_t *client_info){
+    if(!session->client_info_valid){
+        if(mdfu_get_client_info(session, &session->client_info) < 0){
+            return -1;
+        }
+        // Clients that are not supported are still reported, the next
+        // action requests the information again and fails
+        session->client_info_confirmed = 0 == client_configure(session);
+    }
+    *client_info = session->client_info;
+    return 0;
+}
+
 /**
  * @brief Get MDFU client info
  * 
+ * @param session MDFU session
  * @param client_info Pointer to client_info_t struct to store the data.
  * @return int Success=0, Error=-1
  */
-int mdfu_get_client_info(client_info_t *client_info){
+int mdfu_get_client_info(mdfu_session_t *session, client_info_t *client_info){
     mdfu_packet_t mdfu_status_packet;
     mdfu_packet_t mdfu_cmd_packet = {
         .command = GET_CLIENT_INFO,
@@ -987,14 +2356,14 @@ int mdfu_get_client_info(client_info_t *client_info){
         .sequence_number = 0,
         .data_length = 0
     };
-    mdfu_get_packet_buffer(&mdfu_cmd_packet, &mdfu_status_packet);
+    mdfu_get_packet_buffer(session, &mdfu_cmd_packet, &mdfu_status_packet);
     // Configure default transport layer inter transaction delay for transports
     // that support it
-    if(mdfu_transport->ioctl != NULL &&
-        0 > mdfu_transport->ioctl(TRANSPORT_IOC_INTER_TRANSACTION_DELAY, MDFU_INTER_TRANSACTION_DELAY_DEFAULT)){
+    if(TRANSPORT_OPS(session->transport)->ioctl != NULL &&
+        0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_INTER_TRANSACTION_DELAY, MDFU_INTER_TRANSACTION_DELAY_DEFAULT)){
         return -1;
     }
-    if(mdfu_send_cmd(&mdfu_cmd_packet, &mdfu_status_packet) < 0){
+    if(mdfu_send_cmd(session, &mdfu_cmd_packet, &mdfu_status_packet) < 0){
         return -1;
     }
     if(mdfu_decode_client_info(mdfu_status_packet.data, mdfu_status_packet.data_length, client_info) < 0){
@@ -1043,16 +2412,23 @@ void print_client_info(const client_info_t *client_info){
  * This operation must be done before accessing any other MDFU
  * API operation.
  * 
+ * @param session MDFU session
  * @return int, 0 for success and -1 for error.
  */
-int mdfu_open(void){
+int mdfu_open(mdfu_session_t *session){
     int status = 0;
 
-    if(NULL != mdfu_transport){
-        if(mdfu_transport->open() < 0){
+    if(NULL != session && NULL != session->transport){
+        if(TRANSPORT_OPS(session->transport)->open(session->transport) < 0){
             DEBUG("MDFU failed to open transport");
             status = -1;
         }
+        set_timeout(&session->opened, 0);
+        // The connection can be to a different client
+        session->client_info_valid = false;
+        session->client_info_preloaded = false;
+        session->client_info_confirmed = false;
+        session->synced = false;
     }else{
         status = -1;
     }
@@ -1063,13 +2439,14 @@ int mdfu_open(void){
 /**
  * @brief Close MDFU protocol layer.
  * 
+ * @param session MDFU session
  * @return int, 0 for success and -1 for error.
  */
-int mdfu_close(void){
+int mdfu_close(mdfu_session_t *session){
     int status = 0;
 
-    if(NULL != mdfu_transport){
-        if(0 > mdfu_transport->close()){
+    if(NULL != session && NULL != session->transport){
+        if(0 > TRANSPORT_OPS(session->transport)->close(session->transport)){
             DEBUG("MDFU failed to close transport");
             status = -1;
         }
@@ -1078,3 +2455,284 @@ int mdfu_close(void){
     }
     return status;
 }
+
+/**
+ * @brief Get the statistics of a MDFU session.
+ *
+ * The statistics are collected from the time the session was created and
+ * include the statistics of the session transport.
+ *
+ * @param session MDFU session
+ * @param[out] stats Pointer where the statistics are stored.
+ */
+void mdfu_get_stats(const mdfu_session_t *session, mdfu_stats_t *stats){
+    timeout_t opened = session->opened;
+
+    *stats = session->stats;
+    stats->elapsed = timeout_elapsed(&opened);
+    stats->packet_buffer_bytes = (uint32_t) session->arena_size;
+    stats->transport = session->transport->stats;
+}
+
+/**
+ * @brief Prepares the command of the current step driven update stage.
+ *
+ * In the WRITE_CHUNK stage the next image chunk is read and at the end of the
+ * image the update moves on to the GET_IMAGE_STATE stage.
+ *
+ * @param session MDFU session
+ * @return int 0 on success, -1 on failure.
+ */
+static int step_prepare(mdfu_session_t *session){
+    step_state_t *step = &session->step;
+    mdfu_packet_t *packet = &step->cmd_packet;
+    ssize_t read_size = 0;
+
+    mdfu_get_packet_buffer(session, packet, &step->status_packet);
+    if(WRITE_CHUNK == step->command){
+        read_size = read_chunk(session, step->image_reader, packet, session->client_info.buffer_size);
+        if(0 > read_size){
+            ERROR("%s", strerror(errno));
+            return -1;
+        }
+        if(0 == read_size){
+            step->command = GET_IMAGE_STATE;
+        }
+    }
+    packet->command = step->command;
+    packet->sync = GET_CLIENT_INFO == step->command;
+    packet->data_length = (uint16_t) read_size;
+    transaction_begin(session, &step->transaction, packet, &step->status_packet);
+    return 0;
+}
+
+/**
+ * @brief Sends the command of the step driven update.
+ *
+ * Sets the deadline for the response. Failed sends are retried immediately.
+ *
+ * @param session MDFU session
+ * @return int 0 on success, negative error code on failure.
+ */
+static int step_send(mdfu_session_t *session){
+    step_state_t *step = &session->step;
+
+    while(transaction_can_send(session, &step->transaction)){
+        if(transaction_send(session, &step->transaction) >= 0){
+            set_timeout(&step->deadline, step->transaction.timeout);
+            return 0;
+        }
+    }
+    ERROR("Tried %d times to send command without success, retry budget exhausted", step->transaction.attempts);
+    return -EIO;
+}
+
+/**
+ * @brief Processes a successful response and selects the next update stage.
+ *
+ * @param session MDFU session
+ * @return int 0 on success, -1 on failure.
+ */
+static int step_complete(mdfu_session_t *session){
+    step_state_t *step = &session->step;
+    mdfu_packet_t *status_packet = &step->status_packet;
+
+    switch(step->command){
+        case GET_CLIENT_INFO:
+            if(mdfu_decode_client_info(status_packet->data, status_packet->data_length, &session->client_info) < 0 ||
+                client_configure(session) < 0){
+                return -1;
+            }
+            session->client_info_confirmed = true;
+            step->command = START_TRANSFER;
+            break;
+        case START_TRANSFER:
+            step->command = WRITE_CHUNK;
+            break;
+        case WRITE_CHUNK:
+            // last data chunk read will be zero or less than client buffer size
+            if(step->cmd_packet.data_length < session->client_info.buffer_size){
+                step->command = GET_IMAGE_STATE;
+            }
+            break;
+        case GET_IMAGE_STATE:
+            assert(status_packet->data != NULL);
+            if(status_packet->data[0] != VALID){
+                ERROR("Image state %d is invalid", status_packet->data[0]);
+                return -1;
+            }
+            step->command = END_TRANSFER;
+            break;
+        default:
+            step->status = MDFU_STEP_DONE;
+            break;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks if the transport of a step driven update holds received data.
+ *
+ * Data that the transport or its MAC already read into a buffer does not make
+ * the file descriptor readable, so it is queried from the transport.
+ *
+ * @param session MDFU session
+ * @return bool True if received data is buffered in the transport.
+ */
+static bool step_buffered(const mdfu_session_t *session){
+    bool has_data = false;
+
+    if(TRANSPORT_OPS(session->transport)->ioctl == NULL ||
+       0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_HAS_DATA, &has_data)){
+        return false;
+    }
+    return has_data;
+}
+
+/**
+ * @brief Checks if the transport of the step driven update has data.
+ *
+ * Without a file descriptor the transport is always treated as readable and
+ * the transport read waits for the response.
+ *
+ * @param session MDFU session
+ * @return bool True if the response can be read.
+ */
+static bool step_readable(const mdfu_session_t *session){
+    const step_state_t *step = &session->step;
+#ifndef _WIN32
+    struct pollfd pfd = {.fd = step->fd, .events = POLLIN};
+
+    if(step->fd >= 0){
+        return step_buffered(session) || poll(&pfd, 1, 0) != 0;
+    }
+#endif
+    (void) step;
+    return true;
+}
+
+/**
+ * @brief Starts a step driven firmware update.
+ *
+ * Performs the same update as mdfu_run_update but returns after sending the
+ * first command instead of waiting for the responses, so that the update can
+ * be driven from an event loop together with other work, e.g. updates of other
+ * clients. The update is advanced with mdfu_session_step whenever the file
+ * descriptor from mdfu_session_get_fd becomes readable or the time from
+ * mdfu_session_next_deadline has passed:
+ *
+ * @code
+ * struct pollfd pfd = {.fd = mdfu_session_get_fd(session), .events = POLLIN};
+ * while(MDFU_STEP_PENDING == mdfu_session_step(session)){
+ *     poll(&pfd, pfd.fd < 0 ? 0 : 1, mdfu_session_next_deadline(session));
+ * }
+ * @endcode
+ *
+ * Only one command is in flight at a time, the session window is not used.
+ * The session must be open and must not be used for other operations until
+ * mdfu_session_step reports that the update finished.
+ *
+ * @param session MDFU session
+ * @param image_reader Pointer to the image reader structure that provides the firmware image.
+ * @return int 0 on success, -1 on failure.
+ */
+int mdfu_session_start_update(mdfu_session_t *session, const image_reader_t *image_reader){
+    step_state_t *step = &session->step;
+
+    step->status = MDFU_STEP_FAILED;
+    step->image_reader = image_reader;
+    step->command = GET_CLIENT_INFO;
+    step->fd = -1;
+    if(TRANSPORT_OPS(session->transport)->ioctl != NULL){
+        // Configure default transport layer inter transaction delay for transports
+        // that support it
+        if(0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_INTER_TRANSACTION_DELAY, MDFU_INTER_TRANSACTION_DELAY_DEFAULT)){
+            return -1;
+        }
+        if(0 > TRANSPORT_OPS(session->transport)->ioctl(session->transport, TRANSPORT_IOC_GET_FD, &step->fd)){
+            step->fd = -1;
+        }
+    }
+    if(step_prepare(session) < 0 || step_send(session) < 0){
+        return -1;
+    }
+    step->status = MDFU_STEP_PENDING;
+    return 0;
+}
+
+/**
+ * @brief Advances a step driven firmware update.
+ *
+ * Returns without waiting when the response to the command in flight has not
+ * started to arrive and its deadline has not passed. Otherwise the response is
+ * received, which waits for the rest of a partially received response frame
+ * at most until the deadline, and the next command is sent. After a timeout
+ * or a resend request the command is sent again.
+ *
+ * For transports without a file descriptor, e.g. transports that poll the
+ * client for the response, each step waits for the response.
+ *
+ * @param session MDFU session with an update started by mdfu_session_start_update.
+ * @return int MDFU_STEP_PENDING while the update is in progress, MDFU_STEP_DONE
+ *         when it completed and MDFU_STEP_FAILED on failure.
+ */
+int mdfu_session_step(mdfu_session_t *session){
+    step_state_t *step = &session->step;
+    int remaining;
+    int status;
+
+    if(MDFU_STEP_PENDING != step->status){
+        return step->status;
+    }
+    remaining = timeout_remaining_ms(&step->deadline);
+    if(remaining > 0 && !step_readable(session)){
+        return MDFU_STEP_PENDING;
+    }
+    status = transaction_receive(session, &step->transaction, remaining > 0 ? (float) remaining / 1000.0f : 0);
+    if(TRANSACTION_RETRY == status){
+        status = step_send(session);
+    }else if(0 == status){
+        status = step_complete(session);
+        if(0 == status && MDFU_STEP_PENDING == step->status){
+            status = step_prepare(session);
+            if(0 == status){
+                status = step_send(session);
+            }
+        }
+    }
+    if(status < 0){
+        step->status = MDFU_STEP_FAILED;
+    }
+    return step->status;
+}
+
+/**
+ * @brief Get the file descriptor to wait on for a step driven update.
+ *
+ * @param session MDFU session
+ * @return int File descriptor that becomes readable when a response arrives,
+ *         or -1 if the transport does not provide one.
+ */
+int mdfu_session_get_fd(const mdfu_session_t *session){
+    return session->step.fd;
+}
+
+/**
+ * @brief Get the time until a step driven update must be advanced.
+ *
+ * @param session MDFU session
+ * @return int Time in milliseconds until the response to the command in flight
+ *         times out, or 0 if mdfu_session_step must be called without waiting,
+ *         e.g. because the transport already received data that does not make
+ *         the file descriptor readable. The value can be used as poll timeout.
+ */
+int mdfu_session_next_deadline(const mdfu_session_t *session){
+    timeout_t deadline = session->step.deadline;
+    int remaining;
+
+    if(MDFU_STEP_PENDING != session->step.status || session->step.fd < 0 || step_buffered(session)){
+        return 0;
+    }
+    remaining = timeout_remaining_ms(&deadline);
+    return remaining > 0 ? remaining : 0;
+}
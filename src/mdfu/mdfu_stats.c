@@ -0,0 +1,115 @@
+/**
+ * @file mdfu_stats.c
+ * @brief MDFU session statistics reporting.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "mdfu/mdfu.h"
+
+/**
+ * @brief JSON keys for the MDFU commands, indexed by the command code.
+ */
+static const char *STATS_COMMAND_KEYS[] = {
+    "", // Command code 0 does not exist
+    "get_client_info",
+    "start_transfer",
+    "write_chunk",
+    "get_image_state",
+    "end_transfer",
+    "change_mode",
+    "read_chunk"
+};
+
+/**
+ * @brief JSON keys for the command not executed causes, indexed by the cause.
+ */
+static const char *STATS_NOT_EXECUTED_KEYS[] = {
+    "transport_integrity_check_error",
+    "command_too_long",
+    "command_too_short",
+    "sequence_number_invalid"
+};
+
+/**
+ * @brief Prints the statistics of one MDFU command as JSON object.
+ *
+ * @param stream Output stream.
+ * @param stats Command statistics.
+ */
+static void print_cmd_stats_json(FILE *stream, const mdfu_cmd_stats_t *stats){
+    bool first = true;
+
+    fprintf(stream, "{\"count\":%" PRIu32 ",\"attempts\":%" PRIu32 ",\"data_bytes\":%" PRIu64,
+        stats->count, stats->attempts, stats->data_bytes);
+    if(stats->rtt_count > 0){
+        fprintf(stream, ",\"rtt_min_s\":%.6f,\"rtt_mean_s\":%.6f,\"rtt_max_s\":%.6f",
+            stats->rtt_min, stats->rtt_sum / stats->rtt_count, stats->rtt_max);
+    }
+    // Only buckets with samples are printed as [lower bound in us, count] pairs
+    fprintf(stream, ",\"rtt_histogram_us\":[");
+    for(int i = 0; i < MDFU_STATS_RTT_BUCKETS; i++){
+        if(0 == stats->rtt_histogram[i]){
+            continue;
+        }
+        fprintf(stream, "%s[%" PRIu32 ",%" PRIu32 "]", first ? "" : ",",
+            i == 0 ? 0 : (uint32_t) 1 << i, stats->rtt_histogram[i]);
+        first = false;
+    }
+    fprintf(stream, "]}");
+}
+
+/**
+ * @brief Prints MDFU session statistics as a single line JSON object.
+ *
+ * Only commands that were sent at least once are included. The throughput is
+ * the number of command and response data bytes of all successful commands
+ * per second of the session.
+ *
+ * @param stream Output stream.
+ * @param stats Session statistics from mdfu_get_stats.
+ */
+void print_stats_json(FILE *stream, const mdfu_stats_t *stats){
+    const transport_stats_t *transport = &stats->transport;
+    uint64_t data_bytes = 0;
+    bool first = true;
+
+    for(int cmd = 1; cmd < MAX_MDFU_CMD; cmd++){
+        data_bytes += stats->cmd[cmd].data_bytes;
+    }
+    fprintf(stream, "{\"elapsed_s\":%.6f,\"data_bytes\":%" PRIu64 ",\"throughput_bytes_per_s\":%.1f"
+        ",\"packet_buffer_bytes\":%" PRIu32,
+        stats->elapsed, data_bytes, stats->elapsed > 0 ? (double) data_bytes / stats->elapsed : 0.0,
+        stats->packet_buffer_bytes);
+
+    fprintf(stream, ",\"transport\":{\"frames_sent\":%" PRIu64 ",\"frames_received\":%" PRIu64
+        ",\"bytes_sent\":%" PRIu64 ",\"bytes_received\":%" PRIu64
+        ",\"payload_bytes_sent\":%" PRIu64 ",\"payload_bytes_received\":%" PRIu64
+        ",\"polls\":%" PRIu64 ",\"busy_polls\":%" PRIu64
+        ",\"timeouts\":%" PRIu64 ",\"integrity_errors\":%" PRIu64 "}",
+        transport->frames_sent, transport->frames_received,
+        transport->bytes_sent, transport->bytes_received,
+        transport->payload_bytes_sent, transport->payload_bytes_received,
+        transport->polls, transport->busy_polls,
+        transport->timeouts, transport->integrity_errors);
+
+    fprintf(stream, ",\"retries\":{\"timeout\":%" PRIu32 ",\"integrity\":%" PRIu32
+        ",\"transport\":%" PRIu32 ",\"resend\":%" PRIu32,
+        stats->retries_timeout, stats->retries_integrity,
+        stats->retries_transport, stats->retries_resend);
+    for(int cause = 0; cause < MAX_CMD_NOT_EXECUTED_ERROR_CAUSE; cause++){
+        fprintf(stream, ",\"%s\":%" PRIu32, STATS_NOT_EXECUTED_KEYS[cause], stats->retries_not_executed[cause]);
+    }
+    fprintf(stream, "}");
+
+    fprintf(stream, ",\"commands\":{");
+    for(int cmd = 1; cmd < MAX_MDFU_CMD; cmd++){
+        if(0 == stats->cmd[cmd].attempts){
+            continue;
+        }
+        fprintf(stream, "%s\"%s\":", first ? "" : ",", STATS_COMMAND_KEYS[cmd]);
+        print_cmd_stats_json(stream, &stats->cmd[cmd]);
+        first = false;
+    }
+    fprintf(stream, "}}\n");
+}
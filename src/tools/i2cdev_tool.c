@@ -6,70 +6,59 @@
 #include "mdfu/tools/tools.h"
 #include "mdfu/transport/transport.h"
 #include "mdfu/logging.h"
-#include "mdfu/mac/i2cdev_mac.h"
+#include "mdfu/tools/i2cdev.h"
 
 #define TOOL_PARAMETERS_HELP "\
 Serial Tool Options:\n\
     --address <address>: e.g. 55\n\
-    --dev <device> e.g. /dev/i2c-0"
+    --dev <device> e.g. /dev/i2c-0\n\
+    --poll-policy <policy> One of [fixed, adaptive]. Default is fixed\n\
+    --bus-speed <Hz>: I2C bus clock frequency for adapters that do not report it,\n\
+        e.g. 400000. Default is 100000\n\
+    --speculative-read: Read the response together with the response length,\n\
+        for clients that send the response frame right after the length frame\n\
+    --ready-gpio <chip>:<line>[:rising|falling] GPIO line that the client\n\
+        signals a ready response on instead of being polled, e.g. gpiochip0:17.\n\
+        Default edge is falling\n"
 
-static mac_t *i2cdev_mac = NULL;
-static transport_t *i2cdev_transport = NULL;
-
-static int open(void){
-    DEBUG("Opening i2cdev tool");
-    if(i2cdev_transport != NULL){
-        return i2cdev_transport->open();
-    }
-    return -1;
-}
-
-static int close(void){
-    DEBUG("Closing i2cdev tool");
-    if(i2cdev_transport != NULL){
-        return i2cdev_transport->close();
-    }
-    return -1;
-}
-
-static int init(void *config){
-    struct spidev_config *i2cdev_conf = (struct spidev_config *) config;
-    int status = 0;
+static int init(void *config, transport_t **transport){
+    struct i2cdev_tool_config *tool_conf = (struct i2cdev_tool_config *) config;
+    mac_t *i2cdev_mac = NULL;
+    transport_t *i2cdev_transport = NULL;
+    int status;
     DEBUG("Initializing i2cdev tool");
-    get_i2cdev_mac(&i2cdev_mac);
+    status = get_i2cdev_mac(&i2cdev_mac);
     if(0 == status){
-        status = i2cdev_mac->init((void *) i2cdev_conf);
+        status = i2cdev_mac->init(i2cdev_mac, (void *) &tool_conf->i2cdev_config);
         if(status < 0){
             ERROR("i2cdev MAC init failed");
         }
+    }
+    if(0 == status){
+        status = get_transport(I2C_TRANSPORT, &i2cdev_transport);
         if(0 == status){
-            status = get_transport(I2C_TRANSPORT, &i2cdev_transport);
-            if(0 == status){
-                status = i2cdev_transport->init(i2cdev_mac, 2);
-            }
+            status = i2cdev_transport->init(i2cdev_transport, i2cdev_mac, 2);
         }
     }
-    if(status < 0){
-        i2cdev_mac = NULL;
-        i2cdev_transport = NULL;
+    if(0 == status && POLL_POLICY_FIXED != tool_conf->poll_policy){
+        status = i2cdev_transport->ioctl(i2cdev_transport, TRANSPORT_IOC_POLL_POLICY, tool_conf->poll_policy);
+        if(status < 0){
+            ERROR("Transport does not support the selected poll policy");
+        }
     }
-    return status;
-}
-
-static int read(int *size, uint8_t *data, float timeout){
-    if(i2cdev_transport != NULL){
-        return i2cdev_transport->read(size, data, timeout);
-    } else{
-        return -1;
+    if(0 == status && tool_conf->speculative_read){
+        status = i2cdev_transport->ioctl(i2cdev_transport, TRANSPORT_IOC_SPECULATIVE_READ, true);
     }
-}
-
-static int write(int size, uint8_t *data){
-    if(i2cdev_transport != NULL){
-        return i2cdev_transport->write(size, data);
-    } else {
-        return -1;
+    if(status < 0){
+        if(NULL != i2cdev_transport){
+            transport_free(i2cdev_transport);
+        }else{
+            mac_free(i2cdev_mac);
+        }
+        return status;
     }
+    *transport = i2cdev_transport;
+    return 0;
 }
 
 static int parse_arguments(int tool_argc, char **tool_argv, void **config){
@@ -78,12 +67,17 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
     {
         {"address", required_argument, NULL, 'a'},
         {"dev", required_argument, NULL, 'p'},
+        {"poll-policy", required_argument, NULL, 'P'},
+        {"bus-speed", required_argument, NULL, 's'},
+        {"speculative-read", no_argument, NULL, 'S'},
+        {"ready-gpio", required_argument, NULL, 'r'},
         // Indicator for end of options list
         {0, 0, 0, 0}
     };
     bool error_exit = false;
-    *config = calloc(sizeof(struct i2cdev_config), 1);
-    struct i2cdev_config *i2cdev_conf = (struct i2cdev_config *) *config;
+    *config = calloc(sizeof(struct i2cdev_tool_config), 1);
+    struct i2cdev_tool_config *tool_conf = (struct i2cdev_tool_config *) *config;
+    struct i2cdev_config *i2cdev_conf = &tool_conf->i2cdev_config;
     
     i2cdev_conf->address = -1;
     // Setting optind to zero triggers a re-initialization of the getopt parsing
@@ -117,6 +111,31 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
                 strcpy(i2cdev_conf->path, optarg);
                 break;
 
+            case 'P':
+                if(get_poll_policy_by_name(optarg, &tool_conf->poll_policy) < 0){
+                    ERROR("Unknown poll policy %s", optarg);
+                    error_exit = true;
+                }
+                break;
+
+            case 's':
+                i2cdev_conf->bus_speed = atoi(optarg);
+                if(i2cdev_conf->bus_speed <= 0){
+                    ERROR("I2C bus speed must be a positive frequency in Hz");
+                    error_exit = true;
+                }
+                break;
+
+            case 'S':
+                tool_conf->speculative_read = true;
+                break;
+
+            case 'r':
+                if(gpio_ready_parse(optarg, &i2cdev_conf->ready_gpio) < 0){
+                    error_exit = true;
+                }
+                break;
+
             case '?':
                 ERROR("Error encountered during tool argument parsing");
                 /* getopt_long already printed an error message. */
@@ -154,13 +173,6 @@ static char *get_parameter_help(void){
 }
 
 tool_t i2cdev_tool = {
-    .ops = {
-        .open = open,
-        .close = close,
-        .init = NULL,
-        .write = write,
-        .read = read,
-    },
     .init = init,
     .list_connected_tools = NULL,
     .parse_arguments = parse_arguments,
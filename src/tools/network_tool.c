@@ -9,128 +9,72 @@
 
 #define TOOL_PARAMETERS_HELP "\
 Networking Tool Options:\n\
-    --host <host>: e.g. 127.0.0.1\n\
+    --host <host>: Host name or IPv4 or IPv6 address, e.g. 127.0.0.1\n\
     --port <port>: e.g. 5559\n\
-    --transport <transport>: Chose from serial, spi. Default is serial"
+    --transport <transport>: Chose from serial, serial-buffered, spi, i2c. Default is serial\n\
+    --protocol <protocol>: tcp, or udp to send one datagram per transport frame. Default is tcp\n\
+    --poll-policy <policy>: One of [fixed, adaptive] for spi and i2c. Default is fixed\n"
 
 /** @brief MAC layer pointer */
-static mac_t *net_mac = NULL;
-/** @brief Transport layer pointer */
-static transport_t *net_transport = NULL;
-
 /**
  * @brief Networking tool initialization
  * 
+ * Creates the socket MAC and the transport layer requested in the
+ * configuration. The returned transport owns the MAC and must be
+ * released with transport_free.
+ *
  * @param config This is a struct network_config type for this tool but
  * passed in as an opaque object here so that the tool API is agnostic
  * to any specific tool implementations.
+ * @param transport Pointer where the created transport instance is stored
  * @return int -1 for error and 0 for success
  */
-static int init(void *config){
+static int init(void *config, transport_t **transport){
     struct network_config *net_conf = (struct network_config *) config;
-    int status = 0;
+    mac_t *net_mac = NULL;
+    transport_t *net_transport = NULL;
+    int status = -1;
 
     DEBUG("Initializing network tool");
 
-    if(SERIAL_TRANSPORT == net_conf->transport || SERIAL_TRANSPORT_BUFFERED == net_conf->transport ){
-        get_socket_mac(&net_mac);
-        status = net_mac->init((void *) &net_conf->socket_config);
-        if(status < 0){
-            ERROR("Socket MAC init failed");
-        }
-        if(0 == status){
-            status = get_transport(net_conf->transport, &net_transport);
-            if(0 == status){
-                status = net_transport->init(net_mac, 2);
-            }
-        }
+    if(NETWORK_PROTOCOL_UDP == net_conf->protocol){
+        status = get_udp_mac(&net_mac);
+    }else if(SERIAL_TRANSPORT == net_conf->transport || SERIAL_TRANSPORT_BUFFERED == net_conf->transport ){
+        status = get_socket_mac(&net_mac);
     }else if(SPI_TRANSPORT == net_conf->transport){
         DEBUG("Configuring SPI transport for network transport");
-        get_socket_packet_mac(&net_mac);
-        status = net_mac->init((void *) &net_conf->socket_config);
+        status = get_socket_packet_mac(&net_mac);
+    }else if(I2C_TRANSPORT == net_conf->transport){
+        status = get_socket_packet_mac(&net_mac);
+    }
+    if(0 == status){
+        status = net_mac->init(net_mac, (void *) &net_conf->socket_config);
         if(status < 0){
             ERROR("Socket MAC init failed");
         }
+    }
+    if(0 == status){
+        status = get_transport(net_conf->transport, &net_transport);
         if(0 == status){
-            status = get_transport(SPI_TRANSPORT, &net_transport);
-            if(0 == status){
-                status = net_transport->init(net_mac, 2);
-            }
+            status = net_transport->init(net_transport, net_mac, 2);
         }
-    }else if(I2C_TRANSPORT == net_conf->transport){
-        get_socket_packet_mac(&net_mac);
-        status = net_mac->init((void * ) &net_conf->socket_config);
+    }
+    if(0 == status && POLL_POLICY_FIXED != net_conf->poll_policy){
+        status = net_transport->ioctl(net_transport, TRANSPORT_IOC_POLL_POLICY, net_conf->poll_policy);
         if(status < 0){
-            ERROR("Socket MAC init failed");
-        }else{
-            status = get_transport(I2C_TRANSPORT, &net_transport);
-            if(0 == status){
-                status = net_transport->init(net_mac, 2);
-            }
+            ERROR("Transport does not support the selected poll policy");
         }
     }
     if(status < 0){
-        net_mac = NULL;
-        net_transport = NULL;
-    }
-    return status;
-}
-
-/**
- * @brief Start a session with the networking tool.
- * 
- * @return int -1 for error and 0 for success
- */
-static int open(void){
-    DEBUG("Opening network tool");
-    if(net_transport != NULL){
-        return net_transport->open();
-    }
-    return -1;
-}
-
-/**
- * @brief Close networking tool session.
- * 
- * @return int -1 for error and 0 for success
- */
-static int close(void){
-    DEBUG("Closing network tool");
-    if(net_transport != NULL){
-        return net_transport->close();
-    }
-    return -1;
-}
-
-/**
- * @brief Read MDFU response from networking tool.
- * 
- * @param size Pointer where the response size is written to
- * @param data Pointer where the response is written to
- * @param timeout Timeout in seconds for this read operation
- * @return int -1 for error and 0 for success
- */
-static int read(int *size, uint8_t *data, float timeout){
-    if(net_transport != NULL){
-        return net_transport->read(size, data, timeout);
-    } else{
-        return -1;
-    }
-}
-
-/**
- * @brief Write a MDFU command to networking tool.
- * 
- * @param size Size of the command
- * @param data Command
- * @return int -1 for error and 0 for success
- */
-static int write(int size, uint8_t *data){
-    if(net_transport != NULL){
-        return net_transport->write(size, data);
-    } else {
-        return -1;
+        if(NULL != net_transport){
+            transport_free(net_transport);
+        }else{
+            mac_free(net_mac);
+        }
+        return status;
     }
+    *transport = net_transport;
+    return 0;
 }
 
 /**
@@ -152,6 +96,8 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
         {"host", required_argument, NULL, 'h'},
         {"port", required_argument, NULL, 'p'},
         {"transport", required_argument, NULL, 't'},
+        {"poll-policy", required_argument, NULL, 'P'},
+        {"protocol", required_argument, NULL, 'u'},
         // Indicator for end of options list
         {0, 0, 0, 0}
     };
@@ -201,6 +147,22 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
                     error_exit = true;
                 }
                 break;
+            case 'u':
+                if(0 == strcmp("tcp", optarg)){
+                    net_conf->protocol = NETWORK_PROTOCOL_TCP;
+                }else if(0 == strcmp("udp", optarg)){
+                    net_conf->protocol = NETWORK_PROTOCOL_UDP;
+                }else{
+                    ERROR("Unknown protocol %s", optarg);
+                    error_exit = true;
+                }
+                break;
+            case 'P':
+                if(get_poll_policy_by_name(optarg, &net_conf->poll_policy) < 0){
+                    ERROR("Unknown poll policy %s", optarg);
+                    error_exit = true;
+                }
+                break;
             case '?':
                 ERROR("Unrecognized option '%s'", tool_argv[optind - 1]);
                 error_exit = true;
@@ -238,13 +200,6 @@ static char *get_parameter_help(void){
 }
 
 tool_t network_tool = {
-    .ops = {
-        .open = open,
-        .close = close,
-        .init = NULL,
-        .write = write,
-        .read = read,
-    },
     .init = init,
     .list_connected_tools = NULL,
     .parse_arguments = parse_arguments,
@@ -3,73 +3,210 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
 #include "mdfu/tools/tools.h"
+#include "mdfu/tools/serial.h"
 #include "mdfu/transport/transport.h"
 #include "mdfu/logging.h"
 #include "mdfu/mac/serial_mac.h"
+#include "mdfu/mdfu.h"
+#include "mdfu/timeout.h"
 
 #define TOOL_PARAMETERS_HELP "\
 Serial Tool Options:\n\
-    --baudrate <baudrate>: e.g. 9600\n\
-    --port <port> e.g. /dev/ttyACM0\n"
+    --baudrate <baudrate>: e.g. 9600 or 6000000, or auto to use the fastest\n\
+                           rate at which the client responds\n\
+    --port <port> e.g. /dev/ttyACM0\n\
+    --flow-control <none|rtscts>: Hardware flow control with the RTS and CTS\n\
+                           lines, default none\n\
+    --rx-queue-size <bytes>: Size of the driver receive queue, only supported\n\
+                           by the Windows serial driver\n"
 
-static mac_t *serial_mac = NULL;
-static transport_t *serial_transport = NULL;
+/**
+ * @brief Baud rates that are probed for --baudrate auto, fastest first.
+ */
+static const int auto_baudrates[] = {
+    12000000, 6000000, 4000000, 3000000, 2000000, 1000000, 921600, 460800, 230400, 115200
+};
 
-static int open(void){
-    DEBUG("Opening serial tool");
-    if(serial_transport != NULL){
-        return serial_transport->open();
+/**
+ * @def PROBE_ROUND_TRIPS
+ * @brief Number of GET_CLIENT_INFO round trips that must succeed at a probed baud rate.
+ */
+#define PROBE_ROUND_TRIPS 3
+
+/**
+ * @def PROBE_TIMEOUT
+ * @brief Time in seconds to wait for a probe response.
+ */
+#define PROBE_TIMEOUT 0.2f
+
+/**
+ * @brief Round trip times of the probe commands.
+ */
+struct probe_result {
+    /** @brief Shortest round trip time in seconds. */
+    float rtt_min;
+    /** @brief Longest round trip time in seconds. */
+    float rtt_max;
+    /** @brief Average round trip time in seconds. */
+    float rtt_avg;
+};
+
+/**
+ * @brief Check that the client answers GET_CLIENT_INFO commands.
+ *
+ * The commands are sent with the sync flag so that the client accepts them
+ * regardless of the sequence number it expects.
+ *
+ * @param transport Open transport.
+ * @param[out] result Round trip times of the commands.
+ * @return int 0 if all round trips returned a successful response, -1 otherwise.
+ */
+static int probe_client(transport_t *transport, struct probe_result *result){
+    uint8_t command[] = {0x80, GET_CLIENT_INFO};
+    // Room for the frame check sequence that the transport reads with the packet
+    uint8_t response[MDFU_PACKET_DEFAULT_SIZE + 2];
+    timeout_t sent;
+    float rtt;
+    int size;
+
+    result->rtt_min = 0;
+    result->rtt_max = 0;
+    result->rtt_avg = 0;
+    for(int i = 0; i < PROBE_ROUND_TRIPS; i++){
+        set_timeout(&sent, 0);
+        if(transport->write(transport, sizeof(command), command) < 0 ||
+            transport->read(transport, &size, response, PROBE_TIMEOUT) < 0 ||
+            size < 2 || SUCCESS != response[1]){
+            return -1;
+        }
+        rtt = timeout_elapsed(&sent);
+        if(0 == i || rtt < result->rtt_min){
+            result->rtt_min = rtt;
+        }
+        if(rtt > result->rtt_max){
+            result->rtt_max = rtt;
+        }
+        result->rtt_avg += rtt / PROBE_ROUND_TRIPS;
     }
-    return -1;
+    return 0;
+}
+
+/**
+ * @brief Report the round trip times of the probe commands.
+ *
+ * @param baudrate Baud rate of the probe.
+ * @param result Round trip times.
+ */
+static void report_round_trip(int baudrate, const struct probe_result *result){
+    INFO("Serial round trip time at %d baud: min %.3f ms, avg %.3f ms, max %.3f ms",
+        baudrate, result->rtt_min * 1e3, result->rtt_avg * 1e3, result->rtt_max * 1e3);
 }
 
-static int close(void){
-    DEBUG("Closing serial tool");
-    if(serial_transport != NULL){
-        return serial_transport->close();
+/**
+ * @brief Measure the round trip time to the client.
+ *
+ * The time includes the delays of the USB serial bridge and the tty layer,
+ * which dominate the transfer time of small chunks. Failures are only logged
+ * since the MDFU session reports a client that does not respond.
+ *
+ * @param transport Transport, closed.
+ * @param baudrate Configured baud rate.
+ */
+static void measure_round_trip(transport_t *transport, int baudrate){
+    struct probe_result result;
+    int status;
+
+    if(transport->open(transport) < 0){
+        return;
+    }
+    status = probe_client(transport, &result);
+    transport->close(transport);
+    if(0 == status){
+        report_round_trip(baudrate, &result);
+    }else{
+        DEBUG("Measuring the serial round trip time failed");
     }
+}
+
+/**
+ * @brief Select the fastest baud rate at which the client responds.
+ *
+ * Rates that the serial port does not support are skipped.
+ *
+ * @param transport Transport, closed.
+ * @param config Serial configuration, the baud rate is set to the selected rate.
+ * @return int 0 on success, -1 on error.
+ */
+static int probe_baudrate(transport_t *transport, struct serial_config *config){
+    struct serial_config probe_config = *config;
+    struct probe_result result;
+    int status;
+
+    for(size_t i = 0; i < sizeof(auto_baudrates) / sizeof(auto_baudrates[0]); i++){
+        probe_config.baudrate = auto_baudrates[i];
+        if(transport->mac->init(transport->mac, &probe_config) < 0){
+            return -1;
+        }
+        if(transport->open(transport) < 0){
+            if(EINVAL != errno){
+                return -1;
+            }
+            DEBUG("Baudrate %d is not supported by the serial port", probe_config.baudrate);
+            continue;
+        }
+        status = probe_client(transport, &result);
+        transport->close(transport);
+        if(0 == status){
+            INFO("Using baudrate %d", probe_config.baudrate);
+            report_round_trip(probe_config.baudrate, &result);
+            config->baudrate = probe_config.baudrate;
+            return 0;
+        }
+        DEBUG("Client did not respond at baudrate %d", probe_config.baudrate);
+    }
+    ERROR("Client did not respond at any of the probed baudrates");
+    errno = ETIMEDOUT;
     return -1;
 }
 
-static int init(void *config){
+static int init(void *config, transport_t **transport){
     struct serial_config *serial_conf = (struct serial_config *) config;
-    int status = 0;
+    mac_t *serial_mac = NULL;
+    transport_t *serial_transport = NULL;
+    int status;
     DEBUG("Initializing serial tool");
-    get_serial_mac(&serial_mac);
+    status = get_serial_mac(&serial_mac);
     if(0 == status){
-        status = serial_mac->init((void *) serial_conf);
+        status = serial_mac->init(serial_mac, (void *) serial_conf);
         if(status < 0){
             ERROR("Serial MAC init failed");
         }
+    }
+    if(0 == status){
+        status = get_transport(SERIAL_TRANSPORT, &serial_transport);
         if(0 == status){
-            status = get_transport(SERIAL_TRANSPORT, &serial_transport);
-            if(0 == status){
-                status = serial_transport->init(serial_mac, 2);
-            }
+            status = serial_transport->init(serial_transport, serial_mac, 2);
         }
     }
-    if(status < 0){
-        serial_mac = NULL;
-        serial_transport = NULL;
-    }
-    return status;
-}
-
-static int read(int *size, uint8_t *data, float timeout){
-    if(serial_transport != NULL){
-        return serial_transport->read(size, data, timeout);
-    } else{
-        return -1;
+    if(0 == status){
+        if(SERIAL_BAUDRATE_AUTO == serial_conf->baudrate){
+            status = probe_baudrate(serial_transport, serial_conf);
+        }else{
+            measure_round_trip(serial_transport, serial_conf->baudrate);
+        }
     }
-}
-
-static int write(int size, uint8_t *data){
-    if(serial_transport != NULL){
-        return serial_transport->write(size, data);
-    } else {
-        return -1;
+    if(status < 0){
+        if(NULL != serial_transport){
+            transport_free(serial_transport);
+        }else{
+            mac_free(serial_mac);
+        }
+        return status;
     }
+    *transport = serial_transport;
+    return 0;
 }
 
 static int parse_arguments(int tool_argc, char **tool_argv, void **config){
@@ -78,6 +215,8 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
     {
         {"baudrate", required_argument, NULL, 'b'},
         {"port", required_argument, NULL, 'p'},
+        {"flow-control", required_argument, NULL, 'f'},
+        {"rx-queue-size", required_argument, NULL, 'q'},
         // Indicator for end of options list
         {0, 0, 0, 0}
     };
@@ -104,7 +243,15 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
 
         switch (opt) {
             case 'b':
-                serial_conf->baudrate = atoi(optarg);
+                if(0 == strcmp(optarg, "auto")){
+                    serial_conf->baudrate = SERIAL_BAUDRATE_AUTO;
+                }else{
+                    serial_conf->baudrate = atoi(optarg);
+                    if(serial_conf->baudrate <= 0){
+                        ERROR("Invalid baudrate %s", optarg);
+                        return -1;
+                    }
+                }
                 break;
 
             case 'p':
@@ -112,6 +259,25 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
                 strcpy(serial_conf->port, optarg);
                 break;
 
+            case 'f':
+                if(0 == strcmp(optarg, "none")){
+                    serial_conf->flow_control = SERIAL_FLOW_CONTROL_NONE;
+                }else if(0 == strcmp(optarg, "rtscts")){
+                    serial_conf->flow_control = SERIAL_FLOW_CONTROL_RTSCTS;
+                }else{
+                    ERROR("Invalid flow control %s, must be none or rtscts", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'q':
+                serial_conf->rx_queue_size = atoi(optarg);
+                if(serial_conf->rx_queue_size <= 0){
+                    ERROR("Invalid receive queue size %s", optarg);
+                    return -1;
+                }
+                break;
+
             case '?':
                 ERROR("Error encountered during tool argument parsing");
                 /* getopt_long already printed an error message. */
@@ -149,13 +315,6 @@ static char *get_parameter_help(void){
 }
 
 tool_t serial_tool = {
-    .ops = {
-        .open = open,
-        .close = close,
-        .init = NULL,
-        .write = write,
-        .read = read,
-    },
     .init = init,
     .list_connected_tools = NULL,
     .parse_arguments = parse_arguments,
@@ -6,71 +6,53 @@
 #include "mdfu/tools/tools.h"
 #include "mdfu/transport/transport.h"
 #include "mdfu/logging.h"
-#include "mdfu/mac/spidev_mac.h"
+#include "mdfu/tools/spidev.h"
 
 #define TOOL_PARAMETERS_HELP "\
 Serial Tool Options:\n\
     --clk-speed <clock speed>: e.g. 1000000\n\
     --dev <device> e.g. /dev/spidev0.0\n\
-    --mode <mode> One of [0, 1, 2, 3]\n"
-
-static mac_t *spidev_mac = NULL;
-static transport_t *spidev_transport = NULL;
-
-static int open(void){
-    DEBUG("Opening spidev tool");
-    if(spidev_transport != NULL){
-        return spidev_transport->open();
-    }
-    return -1;
-}
-
-static int close(void){
-    DEBUG("Closing spidev tool");
-    if(spidev_transport != NULL){
-        return spidev_transport->close();
-    }
-    return -1;
-}
-
-static int init(void *config){
-    struct spidev_config *spidev_conf = (struct spidev_config *) config;
-    int status = 0;
+    --mode <mode> One of [0, 1, 2, 3]\n\
+    --poll-policy <policy> One of [fixed, adaptive]. Default is fixed\n\
+    --ready-gpio <chip>:<line>[:rising|falling] GPIO line that the client\n\
+        signals a ready response on instead of being polled, e.g. gpiochip0:17.\n\
+        Default edge is falling\n"
+
+static int init(void *config, transport_t **transport){
+    struct spidev_tool_config *tool_conf = (struct spidev_tool_config *) config;
+    mac_t *spidev_mac = NULL;
+    transport_t *spidev_transport = NULL;
+    int status;
     DEBUG("Initializing spidev tool");
-    get_spidev_mac(&spidev_mac);
+    status = get_spidev_mac(&spidev_mac);
     if(0 == status){
-        status = spidev_mac->init((void *) spidev_conf);
+        status = spidev_mac->init(spidev_mac, (void *) &tool_conf->spidev_config);
         if(status < 0){
             ERROR("spidev MAC init failed");
         }
+    }
+    if(0 == status){
+        status = get_transport(SPI_TRANSPORT, &spidev_transport);
         if(0 == status){
-            status = get_transport(SPI_TRANSPORT, &spidev_transport);
-            if(0 == status){
-                status = spidev_transport->init(spidev_mac, 2);
-            }
+            status = spidev_transport->init(spidev_transport, spidev_mac, 2);
         }
     }
-    if(status < 0){
-        spidev_mac = NULL;
-        spidev_transport = NULL;
-    }
-    return status;
-}
-
-static int read(int *size, uint8_t *data, float timeout){
-    if(spidev_transport != NULL){
-        return spidev_transport->read(size, data, timeout);
-    } else{
-        return -1;
+    if(0 == status && POLL_POLICY_FIXED != tool_conf->poll_policy){
+        status = spidev_transport->ioctl(spidev_transport, TRANSPORT_IOC_POLL_POLICY, tool_conf->poll_policy);
+        if(status < 0){
+            ERROR("Transport does not support the selected poll policy");
+        }
     }
-}
-
-static int write(int size, uint8_t *data){
-    if(spidev_transport != NULL){
-        return spidev_transport->write(size, data);
-    } else {
-        return -1;
+    if(status < 0){
+        if(NULL != spidev_transport){
+            transport_free(spidev_transport);
+        }else{
+            mac_free(spidev_mac);
+        }
+        return status;
     }
+    *transport = spidev_transport;
+    return 0;
 }
 
 static int parse_arguments(int tool_argc, char **tool_argv, void **config){
@@ -80,12 +62,15 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
         {"clk-speed", required_argument, NULL, 'b'},
         {"dev", required_argument, NULL, 'p'},
         {"mode", required_argument, NULL, 'm'},
+        {"poll-policy", required_argument, NULL, 'P'},
+        {"ready-gpio", required_argument, NULL, 'r'},
         // Indicator for end of options list
         {0, 0, 0, 0}
     };
     bool error_exit = false;
-    *config = calloc(sizeof(struct spidev_config), 1);
-    struct spidev_config *spidev_conf = (struct spidev_config *) *config;
+    *config = calloc(sizeof(struct spidev_tool_config), 1);
+    struct spidev_tool_config *tool_conf = (struct spidev_tool_config *) *config;
+    struct spidev_config *spidev_conf = &tool_conf->spidev_config;
     
     // Setting optind to zero triggers a re-initialization of the getopt parsing
     // library. This also sets the optind to the default value of 1 after the
@@ -124,6 +109,19 @@ static int parse_arguments(int tool_argc, char **tool_argv, void **config){
                 strcpy(spidev_conf->path, optarg);
                 break;
 
+            case 'P':
+                if(get_poll_policy_by_name(optarg, &tool_conf->poll_policy) < 0){
+                    ERROR("Unknown poll policy %s", optarg);
+                    error_exit = true;
+                }
+                break;
+
+            case 'r':
+                if(gpio_ready_parse(optarg, &spidev_conf->ready_gpio) < 0){
+                    error_exit = true;
+                }
+                break;
+
             case '?':
                 ERROR("Error encountered during tool argument parsing");
                 /* getopt_long already printed an error message. */
@@ -161,13 +159,6 @@ static char *get_parameter_help(void){
 }
 
 tool_t spidev_tool = {
-    .ops = {
-        .open = open,
-        .close = close,
-        .init = NULL,
-        .write = write,
-        .read = read,
-    },
     .init = init,
     .list_connected_tools = NULL,
     .parse_arguments = parse_arguments,
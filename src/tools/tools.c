@@ -6,6 +6,7 @@
 #include "mdfu/tools/spidev.h"
 #include "mdfu/tools/i2cdev.h"
 #include "mdfu/tools/serial.h"
+#include "mdfu/tools/usb.h"
 #include "mdfu/logging.h"
 /**
  * @brief Array of tool names.
@@ -28,6 +29,9 @@ const char *tool_names[] = {
 #endif
 #ifdef USE_TOOL_I2C
     "i2cdev",
+#endif
+#ifdef USE_TOOL_USB
+    "usb",
 #endif
     NULL};
 
@@ -53,6 +57,9 @@ static tool_t *tools[] = {
 #endif
 #ifdef USE_TOOL_I2C
     &i2cdev_tool,
+#endif
+#ifdef USE_TOOL_USB
+    &usb_tool,
 #endif
     NULL};
 
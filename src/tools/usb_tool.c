@@ -0,0 +1,155 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "mdfu/tools/tools.h"
+#include "mdfu/tools/usb.h"
+#include "mdfu/transport/transport.h"
+#include "mdfu/logging.h"
+#include "mdfu/mac/usb_mac.h"
+
+#define TOOL_PARAMETERS_HELP "\
+USB Tool Options:\n\
+    --device <vid>:<pid> USB vendor and product ID in hexadecimal, e.g. 03eb:2175\n\
+    --serial-number <serial number> Serial number of the device when more\n\
+                         than one is connected\n\
+    --interface <number> CDC data interface, default is the first one\n\
+    --baudrate <baudrate> UART baud rate of USB serial bridges, default is to\n\
+                         leave it unchanged\n\
+\n\
+    The tool claims the CDC data interface of the device and exchanges the\n\
+    serial transport frames with bulk transfers instead of the serial port.\n"
+
+static int init(void *config, transport_t **transport){
+    struct usb_config *usb_conf = (struct usb_config *) config;
+    mac_t *usb_mac = NULL;
+    transport_t *usb_transport = NULL;
+    int status;
+
+    DEBUG("Initializing USB tool");
+    status = get_usb_mac(&usb_mac);
+    if(0 == status){
+        status = usb_mac->init(usb_mac, (void *) usb_conf);
+        if(status < 0){
+            ERROR("USB MAC init failed");
+        }
+    }
+    if(0 == status){
+        status = get_transport(SERIAL_TRANSPORT, &usb_transport);
+        if(0 == status){
+            status = usb_transport->init(usb_transport, usb_mac, 2);
+        }
+    }
+    if(status < 0){
+        if(NULL != usb_transport){
+            transport_free(usb_transport);
+        }else{
+            mac_free(usb_mac);
+        }
+        return status;
+    }
+    *transport = usb_transport;
+    return 0;
+}
+
+/**
+ * @brief Parse a <vid>:<pid> device ID.
+ *
+ * @param text Device ID.
+ * @param config Configuration where the IDs are stored.
+ * @return int 0 on success, -1 if the ID is invalid.
+ */
+static int parse_device(const char *text, struct usb_config *config){
+    unsigned int vendor_id;
+    unsigned int product_id;
+    char end;
+
+    if(2 != sscanf(text, "%x:%x%c", &vendor_id, &product_id, &end) ||
+        vendor_id > 0xffff || product_id > 0xffff){
+        ERROR("Invalid USB device %s, expected <vid>:<pid> e.g. 03eb:2175", text);
+        return -1;
+    }
+    config->vendor_id = (uint16_t) vendor_id;
+    config->product_id = (uint16_t) product_id;
+    return 0;
+}
+
+static int parse_arguments(int tool_argc, char **tool_argv, void **config){
+    int opt;
+    static struct option long_options[] =
+    {
+        {"device", required_argument, NULL, 'd'},
+        {"serial-number", required_argument, NULL, 's'},
+        {"interface", required_argument, NULL, 'i'},
+        {"baudrate", required_argument, NULL, 'b'},
+        // Indicator for end of options list
+        {0, 0, 0, 0}
+    };
+    bool device_set = false;
+    struct usb_config *usb_conf;
+
+    *config = calloc(sizeof(struct usb_config), 1);
+    usb_conf = (struct usb_config *) *config;
+    if(NULL == usb_conf){
+        errno = ENOMEM;
+        return -1;
+    }
+    usb_conf->interface = -1;
+    // Setting optind to zero triggers a re-initialization of the getopt parsing
+    // library. This also sets the optind to the default value of 1 after the
+    // initialization, thus we have a dummy value as first element in the array.
+    optind = 0;
+    opterr = 1;
+    while(-1 != (opt = getopt_long(tool_argc, tool_argv, "", long_options, NULL))){
+        switch(opt){
+            case 'd':
+                if(parse_device(optarg, usb_conf) < 0){
+                    return -1;
+                }
+                device_set = true;
+                break;
+            case 's':
+                usb_conf->serial_number = strdup(optarg);
+                break;
+            case 'i':
+                usb_conf->interface = atoi(optarg);
+                if(usb_conf->interface < 0 || usb_conf->interface > 255){
+                    ERROR("Invalid USB interface %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+                usb_conf->baudrate = atoi(optarg);
+                if(usb_conf->baudrate <= 0){
+                    ERROR("Invalid baudrate %s", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                ERROR("Error encountered during tool argument parsing");
+                return -1;
+        }
+    }
+    if(optind < tool_argc){
+        ERROR("Invalid argument \"%s\"", tool_argv[optind]);
+        return -1;
+    }
+    if(!device_set){
+        ERROR("No USB device was provided, use --device <vid>:<pid>");
+        return -1;
+    }
+    return 0;
+}
+
+static char *get_parameter_help(void){
+    return TOOL_PARAMETERS_HELP;
+}
+
+tool_t usb_tool = {
+    .init = init,
+    .list_connected_tools = NULL,
+    .parse_arguments = parse_arguments,
+    .get_parameter_help = get_parameter_help
+};
@@ -0,0 +1,226 @@
+/**
+ * @file frame_trace.c
+ * @brief In-memory binary trace of transport frames.
+ *
+ * Transports record the frames they send and receive into a fixed size ring
+ * of slots. Recording only copies the frame into a slot and takes a time
+ * stamp, so it can stay enabled during an update. The ring is formatted as
+ * hex text only when it is dumped.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mdfu/transport/frame_trace.h"
+
+#if FRAME_TRACE_SLOTS & (FRAME_TRACE_SLOTS - 1)
+    #error "FRAME_TRACE_SLOTS must be a power of two"
+#endif
+
+/**
+ * @brief Slot in the frame trace ring.
+ *
+ * The sequence number is zero while the slot is written and set to the
+ * record number plus one when the record is complete, so that a reader can
+ * detect records that were overwritten while it read them.
+ */
+typedef struct {
+    atomic_uint_fast32_t sequence;
+    uint8_t direction;
+    uint16_t captured;
+    uint32_t size;
+    struct timespec timestamp;
+    uint8_t data[FRAME_TRACE_CAPTURE_SIZE];
+} trace_slot_t;
+
+/**
+ * @brief Frame trace ring state.
+ *
+ * Writers reserve a record number with an atomic increment of next, which
+ * selects the slot, so concurrent transports never write the same slot
+ * unless the ring wrapped around while a record was written.
+ */
+static struct {
+    atomic_bool enabled;
+    atomic_uint_fast32_t next;
+    trace_slot_t ring[FRAME_TRACE_SLOTS];
+} trace;
+
+/**
+ * @brief Enable or disable recording of frames.
+ *
+ * @param enable True to record frames.
+ */
+void frame_trace_enable(bool enable){
+    atomic_store(&trace.enabled, enable);
+}
+
+/**
+ * @brief Record a frame that is split over multiple buffers.
+ *
+ * Does nothing unless recording was enabled with frame_trace_enable.
+ *
+ * @param direction Direction of the frame.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the frame.
+ */
+void frame_trace_recordv(frame_trace_direction_t direction, int count, const mac_iovec_t *iov){
+    uint_fast32_t sequence;
+    trace_slot_t *slot;
+    int captured = 0;
+    uint32_t size = 0;
+
+    if(!atomic_load_explicit(&trace.enabled, memory_order_relaxed)){
+        return;
+    }
+    sequence = atomic_fetch_add_explicit(&trace.next, 1, memory_order_relaxed);
+    slot = &trace.ring[sequence & (FRAME_TRACE_SLOTS - 1)];
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    clock_gettime(CLOCK_MONOTONIC, &slot->timestamp);
+    for(int i = 0; i < count; i++){
+        int copy = iov[i].size;
+        if(copy > FRAME_TRACE_CAPTURE_SIZE - captured){
+            copy = FRAME_TRACE_CAPTURE_SIZE - captured;
+        }
+        memcpy(&slot->data[captured], iov[i].data, (size_t) copy);
+        captured += copy;
+        size += (uint32_t) iov[i].size;
+    }
+    slot->direction = (uint8_t) direction;
+    slot->captured = (uint16_t) captured;
+    slot->size = size;
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+}
+
+/**
+ * @brief Record a frame.
+ *
+ * Does nothing unless recording was enabled with frame_trace_enable.
+ *
+ * @param direction Direction of the frame.
+ * @param size Size of the frame.
+ * @param data Frame data.
+ */
+void frame_trace_record(frame_trace_direction_t direction, int size, const uint8_t *data){
+    mac_iovec_t iov = {.data = data, .size = size};
+
+    frame_trace_recordv(direction, 1, &iov);
+}
+
+/**
+ * @brief Format an unsigned number as decimal text.
+ *
+ * @param buf Buffer for the text.
+ * @param value Number to format.
+ * @param width Minimum number of digits, shorter numbers are padded with zeros.
+ * @return int Number of characters written.
+ */
+static int format_decimal(char *buf, uint64_t value, int width){
+    char digits[20];
+    int count = 0;
+    int size = 0;
+
+    do{
+        digits[count++] = (char) ('0' + value % 10);
+        value /= 10;
+    }while(value > 0);
+    while(count < width){
+        digits[count++] = '0';
+    }
+    while(count > 0){
+        buf[size++] = digits[--count];
+    }
+    return size;
+}
+
+/**
+ * @brief Write all data to a file descriptor.
+ *
+ * @param fd File descriptor.
+ * @param data Data to write.
+ * @param size Number of bytes to write.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int write_all(int fd, const char *data, size_t size){
+    ssize_t status;
+
+    while(size > 0){
+        status = write(fd, data, size);
+        if(status < 0){
+            return -1;
+        }
+        data += status;
+        size -= (size_t) status;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the recorded frames as hex text, the oldest frame first.
+ *
+ * Each frame is written on one line with the monotonic time stamp in seconds,
+ * the direction, the frame size and the frame bytes. Truncated frames end
+ * with "...". Frames that are overwritten while the ring is dumped are
+ * skipped.
+ *
+ * The function only uses async-signal-safe functions, so it can be called
+ * from a signal handler.
+ *
+ * @param fd File descriptor to write to.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int frame_trace_dump(int fd){
+    static const char hex[] = "0123456789abcdef";
+    static const char header[] = "# MDFU frame trace: time direction size data\n";
+    char line[64 + 3 * FRAME_TRACE_CAPTURE_SIZE];
+    uint_fast32_t next = atomic_load_explicit(&trace.next, memory_order_acquire);
+    uint_fast32_t first = next > FRAME_TRACE_SLOTS ? next - FRAME_TRACE_SLOTS : 0;
+
+    if(write_all(fd, header, sizeof(header) - 1) < 0){
+        return -1;
+    }
+    for(uint_fast32_t sequence = first; sequence != next; sequence++){
+        const trace_slot_t *slot = &trace.ring[sequence & (FRAME_TRACE_SLOTS - 1)];
+        struct timespec timestamp;
+        uint8_t direction;
+        uint32_t size;
+        int captured;
+        int length = 0;
+
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != sequence + 1){
+            continue;
+        }
+        timestamp = slot->timestamp;
+        direction = slot->direction;
+        size = slot->size;
+        captured = slot->captured;
+        length += format_decimal(&line[length], (uint64_t) timestamp.tv_sec, 1);
+        line[length++] = '.';
+        length += format_decimal(&line[length], (uint64_t) timestamp.tv_nsec, 9);
+        memcpy(&line[length], FRAME_TRACE_TX == direction ? " TX " : " RX ", 4);
+        length += 4;
+        length += format_decimal(&line[length], size, 1);
+        for(int i = 0; i < captured; i++){
+            line[length++] = ' ';
+            line[length++] = hex[slot->data[i] >> 4];
+            line[length++] = hex[slot->data[i] & 0x0f];
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence + 1){
+            continue;
+        }
+        if((uint32_t) captured < size){
+            memcpy(&line[length], " ...", 4);
+            length += 4;
+        }
+        line[length++] = '\n';
+        if(write_all(fd, line, (size_t) length) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
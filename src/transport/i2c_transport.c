@@ -5,8 +5,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdarg.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include "mdfu/error.h"
@@ -16,6 +16,8 @@
 #include "mdfu/mdfu_config.h"
 #include "mdfu/mdfu.h"
 #include "mdfu/checksum.h"
+#include "mdfu/transport/poll_policy.h"
+#include "mdfu/transport/frame_trace.h"
 
 
 /**
@@ -28,6 +30,8 @@ static const char rsp_frame_type_length = 'L';
  */
 static const char rsp_frame_type_response = 'R';
 
+int i2c_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size);
+
 
 /**
  * @brief Defines the size of the frame type.
@@ -55,79 +59,122 @@ static const char rsp_frame_type_response = 'R';
 #define RSP_LENGTH_FRAME_LENGTH_SIZE 2
 
 /**
- * @brief Defines the maximum size of the frame buffer.
+ * @brief Defines the size of the frame buffer for a MDFU packet size.
  *
- * This macro calculates the maximum size of the frame buffer by summing the sizes of the frame type,
- * MDFU command packet, and frame checksum. The resulting value represents the total maximum size
- * that the frame buffer can accommodate.
- */
-#define FRAME_BUFFER_MAX_SIZE (FRAME_TYPE_SIZE + MDFU_CMD_PACKET_MAX_SIZE + FRAME_CHECKSUM_SIZE)
-
-/** 
- * @brief MAC layer interface used for transport layer communication.
- * 
- * This variable holds the MAC layer interface.
+ * This macro calculates the size of the frame buffer by summing the sizes of the frame type,
+ * MDFU packet, and frame checksum. A response length frame is added so that a speculative
+ * read of the length frame and the largest response frame fits into the buffer.
  */
-static mac_t *transport_mac;
+#define FRAME_BUFFER_SIZE(packet_size) (RSP_LENGTH_FRAME_SIZE + FRAME_TYPE_SIZE + (packet_size) + FRAME_CHECKSUM_SIZE)
 
 /**
- * @brief I2C transport inter transaction delay timer.
+ * @brief Longest inter transaction delay in seconds that can be inserted between
+ * the segments of a batched MAC transfer.
  */
-static timeout_t itd_timer;
+#define BATCH_ITD_MAX (UINT16_MAX * 1e-6f)
 
 /**
- * @brief Inter transaction delay in seconds.
+ * @brief I2C transport instance state.
  */
-static float itd_delay = 0.01f;
-
-/** 
- * @brief Buffer for storing data frames.
- * 
- * This buffer is used to store the data frames that are constructed or received
- * by the transport layer. The size of the buffer is calculated based on the
- * maximum expected size of the frames, including frame type field, sequence field,
- * command size, maximum command data length, and frame check sequence.
- */
-static uint8_t buffer[FRAME_BUFFER_MAX_SIZE];
+struct i2c_transport_ctx {
+    /**
+     * @brief Inter transaction delay timer.
+     */
+    timeout_t itd_timer;
+    /**
+     * @brief Inter transaction delay in seconds.
+     */
+    float itd_delay;
+    /**
+     * @brief Response polling state.
+     */
+    poll_policy_t poll;
+    /**
+     * @brief Buffer for response length frames.
+     */
+    uint8_t length_buffer[RSP_LENGTH_FRAME_SIZE];
+    /**
+     * @brief Length of the last response including the checksum, 0 if unknown.
+     *
+     * When the MAC supports batched transfers a response frame of this length
+     * is read together with each response length frame.
+     */
+    int expected_length;
+    /**
+     * @brief The buffer holds the response frame that was read together with
+     * the last response length frame.
+     */
+    bool response_pending;
+    /**
+     * @brief Read the response frame of expected_length in the same read as the
+     * response length frame, the client sends it right after the length frame.
+     */
+    bool speculative_read;
+    /**
+     * @brief Size of the largest MDFU packet that is sent or received.
+     */
+    int packet_size;
+    /**
+     * @brief Size of the frame buffer in bytes.
+     */
+    int buffer_size;
+    /**
+     * @brief Buffer for storing data frames.
+     *
+     * This buffer is used to store the data frames that are constructed or received
+     * by the transport layer. The size of the buffer is calculated based on the
+     * maximum expected size of the frames, including response length frame, frame
+     * type field, a MDFU packet of packet_size, and frame check sequence.
+     */
+    uint8_t buffer[];
+};
 
 /**
  * @brief Initializes the transport layer.
  *
- * This function copies the MAC function pointers from the provided mac object
- * into the global transport_mac structure and sets the transport timeout.
+ * This function stores the MAC instance that the transport uses for
+ * communication. The transport takes ownership of the MAC.
  *
- * @param mac Pointer to a mac_t structure that contains the MAC layer function pointers.
+ * @param transport Transport instance.
+ * @param mac Pointer to the MAC layer instance.
  * @param timeout The default timeout value to be used for transport layer operations.
  * @return Always returns 0 to indicate success.
  */
-static int init(mac_t *mac, int timeout){
-    transport_mac = mac;
-    set_timeout(&itd_timer, 0);
+static int init(transport_t *transport, mac_t *mac, int timeout){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    transport->mac = mac;
+    set_timeout(&ctx->itd_timer, 0);
     return 0;
 }
 
 /**
  * @brief Opens the transport layer.
  *
- * This function calls the open method on the transport_mac object, which is responsible
+ * This function calls the open method on the transport MAC, which is responsible
  * for establishing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int open(void){
-    return transport_mac->open();
+static int open(transport_t *transport){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+
+    ctx->expected_length = 0;
+    ctx->response_pending = false;
+    return MAC_OPS(transport->mac)->open(transport->mac);
 }
 
 /**
  * @brief Closes the transport layer.
  *
- * This function calls the close method on the transport_mac object, which is responsible
+ * This function calls the close method on the transport MAC, which is responsible
  * for closing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int close(void){
-    return transport_mac->close();
+static int close(transport_t *transport){
+    return MAC_OPS(transport->mac)->close(transport->mac);
 }
 
 /**
@@ -160,27 +207,134 @@ static void log_frame(int size, const uint8_t *data){
  * @param data Pointer to the MDFU packet buffer.
  * @param frame_size Pointer to an integer where the size of the created frame will be stored.
  * @param frame Pointer to the buffer where the created frame will be stored.
+ * @param frame_max_size Size of the frame buffer.
  * @return 0 on success, -1 on error (with errno set to EOVERFLOW if the input size is too large).
+ *
+ * Not static so that mdfu_microbench can measure it.
  */
-static int create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame){
+int i2c_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size){
     int buf_index = 0;
     uint16_t frame_check_sequence;
 
-    if((size + FRAME_CHECKSUM_SIZE) > sizeof(buffer)){
+    if((size + FRAME_CHECKSUM_SIZE) > frame_max_size){
         errno = EOVERFLOW;
         return -1;
     }
 
-    for(int i = 0;i < size; i++){
-        frame[buf_index++] = data[i];
-    }
-    frame_check_sequence = calculate_crc16(size, data);
+    frame_check_sequence = calculate_crc16_copy(size, data, &frame[buf_index]);
+    buf_index += size;
     frame[buf_index++] = (uint8_t) (frame_check_sequence & 0xff);
     frame[buf_index++] = (uint8_t) ((frame_check_sequence >> 8) & 0xff);
     *frame_size = buf_index;
     return 0;
 }
 
+/**
+ * @brief Completes sending a MDFU command.
+ *
+ * Errors on write are ignored as defined in the MDFU specification, they are
+ * detected once polling for a response. Starts the delay before the first
+ * response poll.
+ *
+ * @param transport Transport instance.
+ * @param status Status of the MAC write.
+ * @param packet MDFU packet header of the command that was sent.
+ * @param size Size of the MDFU packet that was sent.
+ * @return int 0 on success, -1 on failure.
+ */
+static int cmd_sent(transport_t *transport, int status, const uint8_t *packet, int size){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    float first_poll_delay;
+
+    if(status < 0){
+        DEBUG("I2C transport error on sending command");
+    } else {
+        transport->stats.frames_sent += 1;
+        transport->stats.bytes_sent += (uint64_t) (FRAME_TYPE_SIZE + size + FRAME_CHECKSUM_SIZE);
+        transport->stats.payload_bytes_sent += (uint64_t) size;
+    }
+    first_poll_delay = poll_policy_command_sent(&ctx->poll, packet, ctx->itd_delay);
+    if(NULL != transport->mac->wait_ready){
+        // The client signals when the response is ready, it is not polled before
+        first_poll_delay = ctx->itd_delay;
+    }
+    if(0 > set_timeout(&ctx->itd_timer, first_poll_delay)){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a MDFU command that is split over multiple buffers via I2C transport.
+ *
+ * When the MAC supports scatter/gather writes the MDFU packet buffers and the frame
+ * checksum are passed to the MAC as they are, otherwise they are gathered into the
+ * frame buffer first.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers, at most TRANSPORT_IOVEC_MAX.
+ * @param iov Buffers that make up the MDFU packet.
+ * @return int Status of the write operation. Returns 0 on success,
+ *         -1 on failure.
+ */
+static int writev(transport_t *transport, int count, const mac_iovec_t *iov){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    mac_iovec_t frame[MAC_IOVEC_MAX];
+    uint8_t header[MDFU_SEQUENCE_FIELD_SIZE + MDFU_COMMAND_SIZE];
+    uint8_t frame_check_sequence[FRAME_CHECKSUM_SIZE];
+    checksum_t checksum;
+    uint16_t fcs;
+    int size;
+    int status;
+
+    if(count > TRANSPORT_IOVEC_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    size = mac_iovec_size(count, iov);
+    if(size < 0){
+        return -1;
+    }
+    if((size + FRAME_CHECKSUM_SIZE) > ctx->buffer_size || size < (int) sizeof(header)){
+        errno = EOVERFLOW;
+        return -1;
+    }
+    checksum_init(&checksum);
+    for(int i = 0; i < count; i++){
+        // Keep the MDFU header for the response polling policy
+        for(int j = 0; j < iov[i].size && checksum.size + j < (int) sizeof(header); j++){
+            header[checksum.size + j] = iov[i].data[j];
+        }
+        checksum_update(&checksum, iov[i].size, iov[i].data);
+        frame[i] = iov[i];
+    }
+    fcs = checksum_final(&checksum);
+    frame_check_sequence[0] = (uint8_t) (fcs & 0xff);
+    frame_check_sequence[1] = (uint8_t) ((fcs >> 8) & 0xff);
+    frame[count].data = frame_check_sequence;
+    frame[count].size = FRAME_CHECKSUM_SIZE;
+
+    TRACE(DEBUGLEVEL, "DEBUG:I2C transport sending frame: ");
+    for(int i = 0; i <= count; i++){
+        log_frame(frame[i].size, frame[i].data);
+    }
+    frame_trace_recordv(FRAME_TRACE_TX, count + 1, frame);
+
+    timeout_wait(&ctx->itd_timer);
+
+    if(NULL != MAC_OPS(transport->mac)->writev){
+        status = MAC_OPS(transport->mac)->writev(transport->mac, count + 1, frame);
+    } else {
+        int frame_size = 0;
+        for(int i = 0; i <= count; i++){
+            memcpy(&ctx->buffer[frame_size], frame[i].data, (size_t) frame[i].size);
+            frame_size += frame[i].size;
+        }
+        status = MAC_OPS(transport->mac)->write(transport->mac, frame_size, ctx->buffer);
+    }
+    return cmd_sent(transport, status, header, size);
+}
+
 /**
  * @brief Sends a MDFU command via I2C transport.
  *
@@ -190,37 +344,104 @@ static int create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *f
  * occur during the write operation as per the MDFU specification.
  * The function also sets a timeout for the operation.
  *
+ * @param transport Transport instance.
  * @param size The size of the MDFU packet to be written.
  * @param data Pointer to the MDFU packet to be written.
  * @return int Status of the write operation. Returns 0 on success, 
  *         -1 on failure.
  */
-static int write(int size, uint8_t *data){
+static int write(transport_t *transport, int size, uint8_t *data){
+    struct i2c_transport_ctx *ctx = transport->ctx;
     int frame_size = 0;
     int status = 0;
-    
-    if(create_cmd_frame(size, data, &frame_size, buffer) < 0){
+
+    if(i2c_create_cmd_frame(size, data, &frame_size, ctx->buffer, ctx->buffer_size) < 0){
         return -1;
     }
 
     TRACE(DEBUGLEVEL, "DEBUG:I2C transport sending frame: ");
-    log_frame(frame_size, buffer);
+    log_frame(frame_size, ctx->buffer);
+    frame_trace_record(FRAME_TRACE_TX, frame_size, ctx->buffer);
 
-    while(!timeout_expired(&itd_timer)){/* do nothing*/}
+    timeout_wait(&ctx->itd_timer);
 
-    status = transport_mac->write(frame_size, buffer);
-    // Ignore errors on write as defined in MDFU spec
-    // Error will be detected once polling for a response
-    if(status < 0){
-        DEBUG("I2C transport error on sending command");
-        status = 0;
+    status = MAC_OPS(transport->mac)->write(transport->mac, frame_size, ctx->buffer);
+    return cmd_sent(transport, status, data, size);
+}
+
+/**
+ * @brief Reads a frame from the client.
+ *
+ * MACs that wait for the client to send the frame, e.g. over a network, wait
+ * until the deadline of the response instead of their own read timeout, so
+ * that a missing response does not delay the retry beyond the deadline. Bus
+ * MACs do not wait, the client does not acknowledge the read when it is busy.
+ *
+ * @param transport Transport instance.
+ * @param size Size of the frame.
+ * @param data Buffer for the frame.
+ * @param timer Deadline of the response.
+ * @return int Number of bytes read, or -1 if the client did not acknowledge
+ *         the read or the deadline expired.
+ */
+static int read_frame(transport_t *transport, int size, uint8_t *data, timeout_t *timer){
+    int status;
+
+    if(NULL == MAC_OPS(transport->mac)->read_deadline){
+        return MAC_OPS(transport->mac)->read(transport->mac, size, data);
     }
-    if(0 > set_timeout(&itd_timer, itd_delay)){
-        status = -1;
+    status = MAC_OPS(transport->mac)->read_deadline(transport->mac, size, data, size, timer);
+    if(0 == status){
+        errno = ETIMEDOUT;
+        return -1;
     }
     return status;
 }
 
+/**
+ * @brief Reads a response length frame and, if possible, the response frame.
+ *
+ * The client returns the response frame on the first read after the response
+ * length frame. When the MAC supports batched transfers both are read in one
+ * operation with repeated starts, using the length of the last response as
+ * size of the response frame. With speculative reads both frames are read in
+ * a single read transaction instead.
+ *
+ * @param transport Transport instance.
+ * @param timer Deadline of the response.
+ * @return int 0 on success, -1 if the client did not acknowledge the read.
+ */
+static int read_length_frame(transport_t *transport, timeout_t *timer){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    int frame_size = FRAME_TYPE_SIZE + ctx->expected_length;
+
+    ctx->response_pending = false;
+    if(ctx->speculative_read && 0 != ctx->expected_length &&
+        RSP_LENGTH_FRAME_SIZE + frame_size <= ctx->buffer_size){
+        if(read_frame(transport, RSP_LENGTH_FRAME_SIZE + frame_size, ctx->buffer, timer) < 0){
+            return -1;
+        }
+        memcpy(ctx->length_buffer, ctx->buffer, RSP_LENGTH_FRAME_SIZE);
+        memmove(ctx->buffer, &ctx->buffer[RSP_LENGTH_FRAME_SIZE], (size_t) frame_size);
+        transport->stats.bytes_received += (uint64_t) frame_size;
+        ctx->response_pending = true;
+        return 0;
+    }
+    if(NULL == MAC_OPS(transport->mac)->transfer || 0 == ctx->expected_length || ctx->itd_delay > BATCH_ITD_MAX){
+        return read_frame(transport, RSP_LENGTH_FRAME_SIZE, ctx->length_buffer, timer);
+    }
+    mac_segment_t segments[] = {
+        {.rx_data = ctx->length_buffer, .size = RSP_LENGTH_FRAME_SIZE,
+         .delay_us = (uint16_t) (ctx->itd_delay * 1e6f)},
+        {.rx_data = ctx->buffer, .size = frame_size}
+    };
+    if(MAC_OPS(transport->mac)->transfer(transport->mac, 2, segments) < 0){
+        return -1;
+    }
+    transport->stats.bytes_received += (uint64_t) frame_size;
+    ctx->response_pending = true;
+    return 0;
+}
 
 /**
  * Polls for a client response length within a specified timeout period.
@@ -231,53 +452,112 @@ static int write(int size, uint8_t *data){
  * does not match, it returns a checksum error. If the timeout expires during polling, it returns
  * a timeout error.
  *
+ * @param transport Transport instance.
  * @param timer Pointer to the timeout structure.
  * @return The size of the data if a valid response length frame is received.
  *         -TIMEOUT_ERROR if the timeout expires during polling.
  *         -CHECKSUM_ERROR if the checksum verification fails.
  *         -1 for other errors.
  */
-static ssize_t poll_for_client_response_length(timeout_t *timer){
+static ssize_t poll_for_client_response_length(transport_t *transport, timeout_t *timer){
+    struct i2c_transport_ctx *ctx = transport->ctx;
     int data_size = -1;
 
     // Poll for a client response
     while(true){
-        while(!timeout_expired(&itd_timer)){/* do nothing*/}
+        timeout_wait(&ctx->itd_timer);
 
         DEBUG("Polling client for response length");
-        if(transport_mac->read(RSP_LENGTH_FRAME_SIZE, buffer) < 0){
-            set_timeout(&itd_timer, itd_delay);
-            if(timeout_expired(timer)){
+        transport->stats.polls += 1;
+        if(read_length_frame(transport, timer) < 0){
+            // Client is busy and did not acknowledge the read
+            transport->stats.busy_polls += 1;
+            set_timeout(&ctx->itd_timer, poll_policy_busy(&ctx->poll, ctx->itd_delay));
+            if(timeout_expired_coarse(timer)){
                 DEBUG("Timeout during polling for response length");
+                transport->stats.timeouts += 1;
                 return -TIMEOUT_ERROR;
             }
             continue;
         }
-        if(0 > set_timeout(&itd_timer, itd_delay)){
+        transport->stats.bytes_received += RSP_LENGTH_FRAME_SIZE;
+        if(0 > set_timeout(&ctx->itd_timer, ctx->itd_delay)){
             return -1;
         }
+        frame_trace_record(FRAME_TRACE_RX, RSP_LENGTH_FRAME_SIZE, ctx->length_buffer);
         TRACE(DEBUGLEVEL, "DEBUG:I2C transport received frame: ");
-        log_frame(RSP_LENGTH_FRAME_SIZE, buffer);
-        if(rsp_frame_type_length == buffer[0]){
+        log_frame(RSP_LENGTH_FRAME_SIZE, ctx->length_buffer);
+        if(rsp_frame_type_length == ctx->length_buffer[0]){
 
-            data_size = *((uint16_t *) &buffer[RSP_LENGTH_FRAME_LENGTH_START]);
-            uint16_t checksum = *((uint16_t *) &buffer[RSP_LENGTH_FRAME_CRC_START]);
-            uint16_t calc_checksum = calculate_crc16(RSP_LENGTH_FRAME_LENGTH_SIZE, &buffer[RSP_LENGTH_FRAME_LENGTH_START]);
+            data_size = ctx->length_buffer[RSP_LENGTH_FRAME_LENGTH_START] | (ctx->length_buffer[RSP_LENGTH_FRAME_LENGTH_START + 1] << 8);
+            uint16_t checksum = (uint16_t) (ctx->length_buffer[RSP_LENGTH_FRAME_CRC_START] | (ctx->length_buffer[RSP_LENGTH_FRAME_CRC_START + 1] << 8));
+            uint16_t calc_checksum = calculate_crc16(RSP_LENGTH_FRAME_LENGTH_SIZE, &ctx->length_buffer[RSP_LENGTH_FRAME_LENGTH_START]);
             if(checksum != calc_checksum){
                 ERROR("I2C transport frame checksum mismatch");
+                transport->stats.integrity_errors += 1;
                 return -CHECKSUM_ERROR;
             }
+            poll_policy_response_received(&ctx->poll);
             break;
         }
 
-        if(timeout_expired(timer)){
+        transport->stats.busy_polls += 1;
+        if(timeout_expired_coarse(timer)){
             DEBUG("Timeout during polling for response length");
+            transport->stats.timeouts += 1;
             return -TIMEOUT_ERROR;
         }
+        if(0 > set_timeout(&ctx->itd_timer, poll_policy_busy(&ctx->poll, ctx->itd_delay))){
+            return -1;
+        }
     }
     return data_size;
 }
 
+/**
+ * @brief Decodes a response frame in the frame buffer.
+ *
+ * @param transport Transport instance.
+ * @param response_length Length of the response data including the checksum.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the response will be copied to in order.
+ * @return 0 on success, 1 if the buffer does not hold a response frame, or a
+ *         negative error code on failure:
+ *         -EOVERFLOW if the response packet exceeds the allocated buffer size
+ *         or the receive buffers.
+ *         -CHECKSUM_ERROR if there is a checksum mismatch.
+ */
+static int decode_response_frame(transport_t *transport, int response_length, int count, const transport_iovec_t *iov){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+
+    frame_trace_record(FRAME_TRACE_RX, FRAME_TYPE_SIZE + response_length, ctx->buffer);
+    TRACE(DEBUGLEVEL, "DEBUG:I2C transport received response frame: ");
+    log_frame(FRAME_TYPE_SIZE + response_length, ctx->buffer);
+
+    if(rsp_frame_type_response != ctx->buffer[0]){
+        return 1;
+    }
+    int checksum_start = FRAME_TYPE_SIZE + response_length - FRAME_CHECKSUM_SIZE;
+    uint16_t checksum = (uint16_t) (ctx->buffer[checksum_start] | (ctx->buffer[checksum_start + 1] << 8));
+    if((response_length - FRAME_CHECKSUM_SIZE) > ctx->packet_size){
+        ERROR("Received MDFU response packet (%d) exceeds allocated buffer (%d)", response_length - FRAME_CHECKSUM_SIZE, ctx->packet_size);
+        return -EOVERFLOW;
+    }
+    // Copy the payload while calculating its checksum, the data is discarded on a mismatch
+    uint16_t calc_checksum;
+    if(transport_iovec_scatter(response_length - FRAME_CHECKSUM_SIZE, &ctx->buffer[FRAME_TYPE_SIZE], count, iov, &calc_checksum) < 0){
+        ERROR("Received MDFU response packet (%d) exceeds the receive buffers", response_length - FRAME_CHECKSUM_SIZE);
+        return -EOVERFLOW;
+    }
+    if(checksum != calc_checksum){
+        ERROR("I2C transport frame checksum mismatch");
+        transport->stats.integrity_errors += 1;
+        return -CHECKSUM_ERROR;
+    }
+    transport->stats.frames_received += 1;
+    transport->stats.payload_bytes_received += (uint64_t) (response_length - FRAME_CHECKSUM_SIZE);
+    return 0;
+}
 
 /**
  * Polls for a client response within a specified timeout period.
@@ -287,120 +567,235 @@ static ssize_t poll_for_client_response_length(timeout_t *timer){
  * verifies the frame type, and checks the checksum for data integrity. If the response is valid,
  * it copies the response data to the provided buffer.
  *
+ * @param transport Transport instance.
  * @param timer Pointer to the timeout structure.
  * @param response_length Length of the expected response data.
- * @param data Pointer to the buffer where the response will be copied.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the response will be copied to in order.
  * @return 0 on success, or a negative error code on failure:
  *         -EOVERFLOW if the response frame length exceeds the allocated buffer size.
  *         -TIMEOUT_ERROR if the polling times out.
  *         -CHECKSUM_ERROR if there is a checksum mismatch.
  *         -EINVAL if the response_length is invalid
  */
-static int poll_for_client_response(timeout_t *timer, int response_length, uint8_t *data){
-    if(FRAME_TYPE_SIZE + response_length > sizeof(buffer)){
-        ERROR("I2C transport response frame length (%d) exceeds allocated buffer (%d)", FRAME_TYPE_SIZE + response_length, (int) sizeof(buffer));
+static int poll_for_client_response(transport_t *transport, timeout_t *timer, int response_length, int count, const transport_iovec_t *iov){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    int status;
+    if(FRAME_TYPE_SIZE + response_length > ctx->buffer_size){
+        ERROR("I2C transport response frame length (%d) exceeds allocated buffer (%d)", FRAME_TYPE_SIZE + response_length, ctx->buffer_size);
         return -EOVERFLOW;
     }
     if(response_length < 2){
         ERROR("I2C transport: Invalid response length (%d). Expected at least a length of 2.", response_length);
         return -EINVAL;
     }
+    // A response frame that is at least as long as the response was already read
+    // together with the length, otherwise it is read again with the right size
+    if(ctx->response_pending && response_length <= ctx->expected_length){
+        ctx->response_pending = false;
+        transport->stats.polls += 1;
+        status = decode_response_frame(transport, response_length, count, iov);
+        if(status <= 0){
+            return status;
+        }
+        if(ctx->speculative_read){
+            DEBUG("I2C client does not send the response frame after the length frame, speculative reads disabled");
+            ctx->speculative_read = false;
+        }
+        transport->stats.busy_polls += 1;
+    }
+    ctx->response_pending = false;
     while(true){
-        while(!timeout_expired(&itd_timer)){/* do nothing*/}
+        timeout_wait(&ctx->itd_timer);
 
-        if(transport_mac->read(FRAME_TYPE_SIZE + response_length, buffer) < 0){
-            set_timeout(&itd_timer, itd_delay);
-            if(timeout_expired(timer)){
+        transport->stats.polls += 1;
+        if(read_frame(transport, FRAME_TYPE_SIZE + response_length, ctx->buffer, timer) < 0){
+            transport->stats.busy_polls += 1;
+            set_timeout(&ctx->itd_timer, ctx->itd_delay);
+            if(timeout_expired_coarse(timer)){
                 DEBUG("Timeout during polling for response");
+                transport->stats.timeouts += 1;
                 return -TIMEOUT_ERROR;
             }
             continue;
         }
-        set_timeout(&itd_timer, itd_delay);
-
-        TRACE(DEBUGLEVEL, "DEBUG:I2C transport received response frame: ");
-        log_frame(FRAME_TYPE_SIZE + response_length, buffer);
-
-        if(rsp_frame_type_response == buffer[0]){
+        set_timeout(&ctx->itd_timer, ctx->itd_delay);
+        transport->stats.bytes_received += (uint64_t) (FRAME_TYPE_SIZE + response_length);
 
-            uint16_t checksum = *((uint16_t *) &buffer[FRAME_TYPE_SIZE + response_length - FRAME_CHECKSUM_SIZE]);
-            uint16_t calc_checksum = calculate_crc16(response_length - FRAME_CHECKSUM_SIZE, &buffer[FRAME_TYPE_SIZE]);
-            if(checksum != calc_checksum){
-                ERROR("I2C transport frame checksum mismatch");
-                return -CHECKSUM_ERROR;
-            }
-            if((response_length - FRAME_CHECKSUM_SIZE) > MDFU_RESPONSE_PACKET_MAX_SIZE){
-                ERROR("Received MDFU response packet (%d) exceeds allocated buffer (%d)", response_length - FRAME_CHECKSUM_SIZE, MDFU_RESPONSE_PACKET_MAX_SIZE);
-                return -EOVERFLOW;
-            }
-            memcpy(data, &buffer[FRAME_TYPE_SIZE], response_length - FRAME_CHECKSUM_SIZE);
-            break;
+        status = decode_response_frame(transport, response_length, count, iov);
+        if(status <= 0){
+            return status;
         }
-        if(timeout_expired(timer)){
+        transport->stats.busy_polls += 1;
+        if(timeout_expired_coarse(timer)){
             DEBUG("Timeout during polling for response");
+            transport->stats.timeouts += 1;
             return -TIMEOUT_ERROR;
         }
     }
-    return 0;
 }
 
+/**
+ * @brief Waits for the client to signal a ready response when the MAC has a ready signal.
+ *
+ * The response is then read without polling the client while it is busy.
+ * Without a ready signal the function returns immediately and the client is
+ * polled.
+ *
+ * @param transport Transport instance.
+ * @param timer Pointer to the timeout structure.
+ * @return int 0 when the response can be read, -TIMEOUT_ERROR if the timeout
+ *         expired or -1 on other errors.
+ */
+static int wait_for_client_ready(transport_t *transport, timeout_t *timer){
+    int status;
+
+    if(NULL == transport->mac->wait_ready){
+        return 0;
+    }
+    DEBUG("Waiting for client ready signal");
+    status = transport->mac->wait_ready(transport->mac, timer);
+    if(0 == status){
+        DEBUG("Timeout while waiting for client ready signal");
+        transport->stats.timeouts += 1;
+        return -TIMEOUT_ERROR;
+    }
+    return status < 0 ? -1 : 0;
+}
 
 /**
- * @brief Reads MDFU response from a client.
+ * @brief Reads MDFU response from a client into multiple buffers.
  *
  * This function polls for a client response length and then reads the client response.
  * It uses a timeout mechanism to ensure the operations do not hang indefinitely.
+ * The response is copied from the frame buffer to the buffers in order.
  *
+ * @param transport Transport instance.
  * @param size Pointer to an integer where the size of the MDFU response packet will be stored.
- * @param data Pointer to a buffer where the MDFU response packet will be stored.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the MDFU response packet will be stored.
  * @param timeout The maximum time to wait for the client response, in seconds.
  *
  * @return 0 on success, or a negative value on error.
  */
-static int read(int *size, uint8_t *data, float timeout){
+static int readv(transport_t *transport, int *size, int count, const transport_iovec_t *iov, float timeout){
+    struct i2c_transport_ctx *ctx = transport->ctx;
     timeout_t timer;
     ssize_t response_length;
     int status;
 
+    set_timeout(&timer, timeout);
+    status = wait_for_client_ready(transport, &timer);
+    if(status < 0){
+        return status;
+    }
     // Poll for a client response
     DEBUG("Starting client response length polling");
-    set_timeout(&timer, timeout);
-    response_length = poll_for_client_response_length(&timer);
+    response_length = poll_for_client_response_length(transport, &timer);
     if(response_length < 0){
         return (int) response_length;
     }
     *size = (int) (response_length - FRAME_CHECKSUM_SIZE);
     DEBUG("Starting client response polling");
-    status = poll_for_client_response(&timer, (int) response_length, data);
+    status = poll_for_client_response(transport, &timer, (int) response_length, count, iov);
     if(status < 0){
         return status;
     }
+    ctx->expected_length = (int) response_length;
     return 0;
 }
 
+/**
+ * @brief Reads MDFU response from a client.
+ *
+ * @param transport Transport instance.
+ * @param size Pointer to an integer where the size of the MDFU response packet will be stored.
+ * @param data Pointer to a buffer where the MDFU response packet will be stored.
+ * @param timeout The maximum time to wait for the client response, in seconds.
+ *
+ * @return 0 on success, or a negative value on error.
+ */
+static int read(transport_t *transport, int *size, uint8_t *data, float timeout){
+    struct i2c_transport_ctx *ctx = transport->ctx;
+    transport_iovec_t iov = {.data = data, .size = ctx->packet_size};
+
+    return readv(transport, size, 1, &iov, timeout);
+}
+
+/**
+ * @brief Sets the size of the largest MDFU packet and resizes the frame buffer for it.
+ *
+ * @param transport Transport instance.
+ * @param packet_size MDFU packet size in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int set_packet_size(transport_t *transport, int packet_size){
+    struct i2c_transport_ctx *ctx;
+
+    if(packet_size <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(transport_resize_ctx(transport, sizeof(struct i2c_transport_ctx) + FRAME_BUFFER_SIZE((size_t) packet_size)) < 0){
+        return -1;
+    }
+    ctx = transport->ctx;
+    ctx->packet_size = packet_size;
+    ctx->buffer_size = FRAME_BUFFER_SIZE(packet_size);
+    return 0;
+}
 
-static int ioctl(int request, ...){
+static int ioctl(transport_t *transport, int request, ...){
+    struct i2c_transport_ctx *ctx = transport->ctx;
     va_list args;
     va_start(args, request);
     int result = -1;
     if(TRANSPORT_IOC_INTER_TRANSACTION_DELAY == request){
-        itd_delay = (float) va_arg(args, double);
+        ctx->itd_delay = (float) va_arg(args, double);
+        result = 0;
+    } else if(TRANSPORT_IOC_POLL_POLICY == request){
+        poll_policy_init(&ctx->poll, (poll_policy_type_t) va_arg(args, int));
+        result = 0;
+    } else if(TRANSPORT_IOC_SPECULATIVE_READ == request){
+        ctx->speculative_read = (bool) va_arg(args, int);
         result = 0;
+    } else if(TRANSPORT_IOC_PACKET_SIZE == request){
+        result = set_packet_size(transport, va_arg(args, int));
     }
     va_end(args);
     return result;
 }
 
-transport_t i2c_transport ={
+const transport_t i2c_transport ={
     .close = close,
     .open = open,
     .read = read,
+    .readv = readv,
     .write = write,
+    .writev = writev,
     .init = init,
     .ioctl = ioctl
 };
 
+/**
+ * @brief Create a new I2C transport instance.
+ *
+ * Allocates a transport instance with its own inter transaction delay timer
+ * and frame buffer. The frame buffer is sized for MDFU_PACKET_DEFAULT_SIZE
+ * until a larger packet size is set with TRANSPORT_IOC_PACKET_SIZE. The
+ * instance must be released with transport_free.
+ *
+ * @param[out] transport Pointer where the new transport instance is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
 int get_i2c_transport(transport_t **transport){
-    *transport = &i2c_transport;
+    if(transport_alloc(&i2c_transport, sizeof(struct i2c_transport_ctx), transport) < 0){
+        return -1;
+    }
+    if(set_packet_size(*transport, MDFU_PACKET_DEFAULT_SIZE) < 0){
+        transport_free(*transport);
+        return -1;
+    }
+    ((struct i2c_transport_ctx *)(*transport)->ctx)->itd_delay = 0.01f;
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,129 @@
+/**
+ * @file poll_policy.c
+ * @brief Response polling policies for transports that poll the client.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "mdfu/transport/poll_policy.h"
+#include "mdfu/logging.h"
+#include "mdfu/mdfu.h"
+
+/**
+ * @brief Weight of a new response time sample in the smoothed response time.
+ */
+#define LATENCY_EWMA_WEIGHT 0.125f
+/**
+ * @brief Fraction of the smoothed response time that the first poll is delayed.
+ *
+ * Polling slightly before the expected response catches responses that are
+ * faster than usual without many wasted polls.
+ */
+#define FIRST_POLL_FRACTION 0.75f
+/**
+ * @brief Upper limit for the delay between polls relative to the smoothed response time.
+ */
+#define POLL_INTERVAL_FRACTION 0.125f
+/**
+ * @brief Upper limit in seconds for the delay between polls.
+ */
+#define POLL_INTERVAL_MAX 0.05f
+
+/**
+ * @brief Initialize the response polling state.
+ *
+ * @param policy Polling state.
+ * @param type Polling policy to use.
+ */
+void poll_policy_init(poll_policy_t *policy, poll_policy_type_t type){
+    memset(policy, 0, sizeof(*policy));
+    policy->type = type;
+}
+
+/**
+ * @brief Record that a command was sent and get the delay until the first poll.
+ *
+ * @param policy Polling state.
+ * @param packet MDFU command packet that was sent.
+ * @param itd Inter transaction delay in seconds.
+ * @return float Delay in seconds before the client is polled for the response.
+ */
+float poll_policy_command_sent(poll_policy_t *policy, const uint8_t *packet, float itd){
+    float delay = itd;
+
+    policy->command = packet[MDFU_SEQUENCE_FIELD_SIZE];
+    if(policy->command >= POLL_POLICY_COMMANDS){
+        policy->command = 0;
+    }
+    policy->interval = itd;
+    set_timeout(&policy->sent, 0);
+    if(POLL_POLICY_ADAPTIVE == policy->type &&
+        FIRST_POLL_FRACTION * policy->latency[policy->command] > delay){
+        delay = FIRST_POLL_FRACTION * policy->latency[policy->command];
+    }
+    return delay;
+}
+
+/**
+ * @brief Get the delay until the next poll after the client reported busy.
+ *
+ * @param policy Polling state.
+ * @param itd Inter transaction delay in seconds.
+ * @return float Delay in seconds before the client is polled again.
+ */
+float poll_policy_busy(poll_policy_t *policy, float itd){
+    if(POLL_POLICY_FIXED == policy->type){
+        return itd;
+    }
+    float delay = policy->interval;
+    // Limit the overshoot past the response to a fraction of the expected response time
+    float interval_max = POLL_INTERVAL_MAX;
+    if(0 < policy->latency[policy->command] &&
+        POLL_INTERVAL_FRACTION * policy->latency[policy->command] < interval_max){
+        interval_max = POLL_INTERVAL_FRACTION * policy->latency[policy->command];
+    }
+    policy->interval *= 2;
+    if(policy->interval > interval_max){
+        policy->interval = interval_max;
+    }
+    return delay > itd ? delay : itd;
+}
+
+/**
+ * @brief Record that the client response is available.
+ *
+ * Updates the smoothed response time of the command with the time since
+ * the command was sent.
+ *
+ * @param policy Polling state.
+ */
+void poll_policy_response_received(poll_policy_t *policy){
+    float sample = timeout_elapsed(&policy->sent);
+    float *latency = &policy->latency[policy->command];
+
+    if(0 == *latency){
+        *latency = sample;
+    } else {
+        *latency += LATENCY_EWMA_WEIGHT * (sample - *latency);
+    }
+    DEBUG("Response time %.6f s, smoothed %.6f s", sample, *latency);
+}
+
+/**
+ * @brief Get a polling policy by its name.
+ *
+ * @param name Name of the policy, "fixed" or "adaptive".
+ * @param type Pointer where the policy is stored.
+ * @return int 0 on success, -1 with errno set to EINVAL for unknown names.
+ */
+int get_poll_policy_by_name(const char *name, poll_policy_type_t *type){
+    if(0 == strcmp("fixed", name)){
+        *type = POLL_POLICY_FIXED;
+    } else if(0 == strcmp("adaptive", name)){
+        *type = POLL_POLICY_ADAPTIVE;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
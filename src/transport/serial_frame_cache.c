@@ -0,0 +1,445 @@
+/**
+ * @file serial_frame_cache.c
+ * @brief Cache of escaped image chunks for serial transport frames.
+ *
+ * Cache file layout, in host byte order since the file is only used on the
+ * host that built it:
+ * - struct frame_cache_header
+ * - struct frame_cache_index for each chunk
+ * - the escaped chunks
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mdfu/transport/serial_frame_cache.h"
+#include "mdfu/checksum.h"
+#include "mdfu/logging.h"
+
+/** @def FRAME_CACHE_MAGIC
+ *  @brief Identifies a frame cache file, "MDFC".
+ */
+#define FRAME_CACHE_MAGIC 0x4344464dU
+
+/** @def FRAME_CACHE_VERSION
+ *  @brief Version of the cache file layout.
+ */
+#define FRAME_CACHE_VERSION 1U
+
+/**
+ * @brief Cache file header.
+ */
+struct frame_cache_header {
+    /** @brief FRAME_CACHE_MAGIC. */
+    uint32_t magic;
+    /** @brief FRAME_CACHE_VERSION. */
+    uint32_t version;
+    /** @brief Size of the image in bytes. */
+    uint64_t image_size;
+    /** @brief FNV-1a hash of the image. */
+    uint64_t image_hash;
+    /** @brief Size of the chunks the image is split into. */
+    uint32_t chunk_size;
+    /** @brief Number of chunks. */
+    uint32_t chunk_count;
+};
+
+/**
+ * @brief Cache file index entry of a chunk.
+ */
+struct frame_cache_index {
+    /** @brief Offset of the escaped chunk in the cache file. */
+    uint64_t offset;
+    /** @brief Size of the escaped chunk in bytes. */
+    uint32_t size;
+    /** @brief Unused, keeps the lanes aligned. */
+    uint32_t reserved;
+    /** @brief Checksum lane sums of the chunk data. */
+    uint32_t lanes[2];
+};
+
+/**
+ * @brief State of the cache file.
+ */
+enum frame_cache_state {
+    /** @brief The chunk size is not known yet. */
+    FRAME_CACHE_UNLOADED,
+    /** @brief The cache file is mapped. */
+    FRAME_CACHE_LOADED,
+    /** @brief The cache file could not be loaded or built, frames are encoded. */
+    FRAME_CACHE_FAILED
+};
+
+struct serial_frame_cache {
+    /** @brief Path of the cache file. */
+    char *path;
+    /** @brief Image the cache is for. */
+    const uint8_t *image;
+    /** @brief Size of the image in bytes. */
+    size_t image_size;
+    enum frame_cache_state state;
+    /** @brief Mapped cache file. */
+    const uint8_t *mapping;
+    /** @brief Size of the mapped cache file in bytes. */
+    size_t mapping_size;
+    /** @brief Header in the mapped cache file. */
+    const struct frame_cache_header *header;
+    /** @brief Index in the mapped cache file. */
+    const struct frame_cache_index *index;
+};
+
+/**
+ * @brief Calculates the 64-bit FNV-1a hash of the image.
+ *
+ * @param size Size of the image in bytes.
+ * @param data Image data.
+ * @return uint64_t Hash of the image.
+ */
+static uint64_t image_hash(size_t size, const uint8_t *data){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for(size_t i = 0; i < size; i++){
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Writes a buffer to a file offset, continuing after partial writes.
+ *
+ * @param fd File descriptor.
+ * @param data Data to write.
+ * @param size Number of bytes to write.
+ * @param offset File offset.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int pwrite_all(int fd, const void *data, size_t size, off_t offset){
+    const uint8_t *p = data;
+    ssize_t status;
+
+    while(size > 0){
+        status = pwrite(fd, p, size, offset);
+        if(status < 0){
+            if(EINTR == errno){
+                continue;
+            }
+            return -1;
+        }
+        p += status;
+        size -= (size_t) status;
+        offset += status;
+    }
+    return 0;
+}
+
+/**
+ * @brief Builds the cache file.
+ *
+ * The file is written under a temporary name and renamed when it is complete,
+ * so that concurrent updates from the same image never map a partial file.
+ *
+ * @param cache Frame cache.
+ * @param chunk_size Size of the image chunks.
+ * @param hash Hash of the image.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int build(serial_frame_cache_t *cache, uint32_t chunk_size, uint64_t hash){
+    struct frame_cache_header header = {
+        .magic = FRAME_CACHE_MAGIC,
+        .version = FRAME_CACHE_VERSION,
+        .image_size = cache->image_size,
+        .image_hash = hash,
+        .chunk_size = chunk_size,
+        .chunk_count = (uint32_t) ((cache->image_size + chunk_size - 1) / chunk_size)
+    };
+    struct frame_cache_index *index = calloc(header.chunk_count, sizeof(*index));
+    uint8_t *encoded = malloc((size_t) chunk_size * 2);
+    size_t path_size = strlen(cache->path) + 32;
+    char *tmp_path = malloc(path_size);
+    uint64_t offset = sizeof(header) + (uint64_t) header.chunk_count * sizeof(*index);
+    size_t position = 0;
+    checksum_t checksum;
+    int fd = -1;
+    int saved_errno;
+
+    if(NULL == index || NULL == encoded || NULL == tmp_path){
+        errno = ENOMEM;
+        goto err_exit;
+    }
+    snprintf(tmp_path, path_size, "%s.tmp.%ld", cache->path, (long) getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        goto err_exit;
+    }
+    for(uint32_t i = 0; i < header.chunk_count; i++){
+        int size = (int) (cache->image_size - position < chunk_size ? cache->image_size - position : chunk_size);
+
+        checksum_init(&checksum);
+        checksum_update(&checksum, size, &cache->image[position]);
+        index[i].offset = offset;
+        index[i].size = (uint32_t) serial_frame_encode_payload(size, &cache->image[position], encoded);
+        index[i].lanes[0] = checksum.lanes[0];
+        index[i].lanes[1] = checksum.lanes[1];
+        if(pwrite_all(fd, encoded, index[i].size, (off_t) offset) < 0){
+            goto err_exit;
+        }
+        offset += index[i].size;
+        position += (size_t) size;
+    }
+    if(pwrite_all(fd, index, header.chunk_count * sizeof(*index), sizeof(header)) < 0 ||
+        pwrite_all(fd, &header, sizeof(header), 0) < 0 ||
+        fsync(fd) < 0){
+        goto err_exit;
+    }
+    if(close(fd) < 0){
+        fd = -1;
+        goto err_exit;
+    }
+    fd = -1;
+    if(rename(tmp_path, cache->path) < 0){
+        goto err_exit;
+    }
+    free(tmp_path);
+    free(encoded);
+    free(index);
+    return 0;
+
+err_exit:
+    saved_errno = errno;
+    if(fd >= 0){
+        close(fd);
+    }
+    if(NULL != tmp_path){
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(encoded);
+    free(index);
+    errno = saved_errno;
+    return -1;
+}
+
+/**
+ * @brief Maps the cache file and checks that it is for the image and chunk size.
+ *
+ * @param cache Frame cache.
+ * @param chunk_size Size of the image chunks.
+ * @param hash Hash of the image.
+ * @return int 0 on success, -1 on error with errno set. ENOENT if there is no
+ *         cache file and ESTALE if the cache file is for a different image or
+ *         chunk size or is damaged.
+ */
+static int map(serial_frame_cache_t *cache, uint32_t chunk_size, uint64_t hash){
+    const struct frame_cache_header *header;
+    const struct frame_cache_index *index;
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    fd = open(cache->path, O_RDONLY);
+    if(fd < 0){
+        return -1;
+    }
+    if(fstat(fd, &st) < 0){
+        close(fd);
+        return -1;
+    }
+    if((size_t) st.st_size < sizeof(*header)){
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == mapping){
+        return -1;
+    }
+    header = mapping;
+    index = (const struct frame_cache_index *) &header[1];
+    if(FRAME_CACHE_MAGIC != header->magic || FRAME_CACHE_VERSION != header->version ||
+        cache->image_size != header->image_size || hash != header->image_hash ||
+        chunk_size != header->chunk_size ||
+        header->chunk_count != (cache->image_size + chunk_size - 1) / chunk_size ||
+        (uint64_t) st.st_size < sizeof(*header) + (uint64_t) header->chunk_count * sizeof(*index)){
+        goto stale;
+    }
+    for(uint32_t i = 0; i < header->chunk_count; i++){
+        if(index[i].size > (uint64_t) chunk_size * 2 || index[i].offset > (uint64_t) st.st_size ||
+            index[i].size > (uint64_t) st.st_size - index[i].offset){
+            goto stale;
+        }
+    }
+    // The chunks are sent from start to end
+    madvise(mapping, (size_t) st.st_size, MADV_SEQUENTIAL);
+    cache->mapping = mapping;
+    cache->mapping_size = (size_t) st.st_size;
+    cache->header = header;
+    cache->index = index;
+    return 0;
+
+stale:
+    munmap(mapping, (size_t) st.st_size);
+    errno = ESTALE;
+    return -1;
+}
+
+/**
+ * @brief Loads the cache file for a chunk size, building it if needed.
+ *
+ * @param cache Frame cache.
+ * @param chunk_size Size of the image chunks.
+ */
+static void load(serial_frame_cache_t *cache, uint32_t chunk_size){
+    uint64_t hash = image_hash(cache->image_size, cache->image);
+
+    cache->state = FRAME_CACHE_FAILED;
+    if(map(cache, chunk_size, hash) == 0){
+        DEBUG("Frame cache: Using %s", cache->path);
+        cache->state = FRAME_CACHE_LOADED;
+        return;
+    }
+    if(ENOENT != errno && ESTALE != errno){
+        WARN("Frame cache %s not used: %s", cache->path, strerror(errno));
+        return;
+    }
+    DEBUG("Frame cache: Building %s for chunk size %u", cache->path, chunk_size);
+    if(build(cache, chunk_size, hash) < 0 || map(cache, chunk_size, hash) < 0){
+        WARN("Frame cache %s not used: %s", cache->path, strerror(errno));
+        return;
+    }
+    cache->state = FRAME_CACHE_LOADED;
+}
+
+/**
+ * @brief Creates a frame cache for an image.
+ *
+ * The cache file is only loaded, or built if it does not exist or is for a
+ * different image, when the first chunk is sent since the chunk size depends
+ * on the client.
+ *
+ * @param cache Pointer where the frame cache is stored.
+ * @param path Path of the cache file.
+ * @param image Image data that stays valid while the cache is used, frames
+ *              are only assembled from the cache for data in the image.
+ * @param image_size Size of the image in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int serial_frame_cache_create(serial_frame_cache_t **cache, const char *path, const uint8_t *image, size_t image_size){
+    serial_frame_cache_t *new_cache;
+
+    if(NULL == cache || NULL == path || NULL == image || 0 == image_size){
+        errno = EINVAL;
+        return -1;
+    }
+    new_cache = calloc(1, sizeof(*new_cache));
+    if(NULL == new_cache){
+        errno = ENOMEM;
+        return -1;
+    }
+    new_cache->path = strdup(path);
+    if(NULL == new_cache->path){
+        free(new_cache);
+        errno = ENOMEM;
+        return -1;
+    }
+    new_cache->image = image;
+    new_cache->image_size = image_size;
+    new_cache->state = FRAME_CACHE_UNLOADED;
+    *cache = new_cache;
+    return 0;
+}
+
+/**
+ * @brief Releases a frame cache.
+ *
+ * The cache file is kept for the next update.
+ *
+ * @param cache Frame cache, can be NULL.
+ */
+void serial_frame_cache_destroy(serial_frame_cache_t *cache){
+    if(NULL != cache){
+        if(NULL != cache->mapping){
+            munmap((void *) cache->mapping, cache->mapping_size);
+        }
+        free(cache->path);
+        free(cache);
+    }
+}
+
+/**
+ * @brief Assembles the frame for a MDFU packet from the cache.
+ *
+ * Only packets that consist of a MDFU header and a chunk of the image, like
+ * the WRITE_CHUNK commands that are sent with data borrowed from the image
+ * reader, are in the cache. The header, with the sequence number of this
+ * packet, is escaped and its checksum is added to the cached checksum of the
+ * chunk, so the chunk itself is not read.
+ *
+ * @param cache Frame cache.
+ * @param count Number of packet buffers.
+ * @param iov Packet buffers.
+ * @param frame Frame that points into the cache, valid until the cache is destroyed.
+ * @param frame_check_sequence Pointer where the frame check sequence is stored.
+ * @return int Size of the frame in bytes, or -1 with errno set to ENOENT if
+ *         the packet is not in the cache.
+ */
+int serial_frame_cache_encodev(serial_frame_cache_t *cache, int count, const mac_iovec_t *iov,
+                               serial_frame_cache_frame_t *frame, uint16_t *frame_check_sequence){
+    const struct frame_cache_index *entry;
+    checksum_t checksum;
+    uint8_t fcs[FRAME_CHECK_SEQUENCE_SIZE];
+    size_t offset;
+    size_t chunk_size;
+    int head_size;
+    int tail_size;
+
+    if(2 != count || SERIAL_FRAME_CACHE_HEADER_SIZE != iov[0].size || iov[1].size <= 0 ||
+        iov[1].data < cache->image || iov[1].data >= cache->image + cache->image_size){
+        errno = ENOENT;
+        return -1;
+    }
+    offset = (size_t) (iov[1].data - cache->image);
+    if(FRAME_CACHE_UNLOADED == cache->state && 0 == offset){
+        load(cache, (uint32_t) iov[1].size);
+    }
+    if(FRAME_CACHE_LOADED != cache->state){
+        errno = ENOENT;
+        return -1;
+    }
+    chunk_size = cache->header->chunk_size;
+    if(0 != offset % chunk_size ||
+        (size_t) iov[1].size != (cache->image_size - offset < chunk_size ? cache->image_size - offset : chunk_size)){
+        errno = ENOENT;
+        return -1;
+    }
+    entry = &cache->index[offset / chunk_size];
+
+    // The header has an even size, so the chunk starts in the even lane
+    checksum_init(&checksum);
+    checksum_update(&checksum, SERIAL_FRAME_CACHE_HEADER_SIZE, iov[0].data);
+    checksum.lanes[0] += entry->lanes[0];
+    checksum.lanes[1] += entry->lanes[1];
+    *frame_check_sequence = checksum_final(&checksum);
+
+    frame->head[0] = FRAME_START_CODE;
+    head_size = FRAME_START_CODE_SIZE + serial_frame_encode_payload(SERIAL_FRAME_CACHE_HEADER_SIZE, iov[0].data, &frame->head[FRAME_START_CODE_SIZE]);
+    fcs[0] = (uint8_t) *frame_check_sequence;
+    fcs[1] = (uint8_t) (*frame_check_sequence >> 8);
+    tail_size = serial_frame_encode_payload(FRAME_CHECK_SEQUENCE_SIZE, fcs, frame->tail);
+    frame->tail[tail_size] = FRAME_END_CODE;
+    tail_size += FRAME_END_CODE_SIZE;
+
+    frame->iov[0].data = frame->head;
+    frame->iov[0].size = head_size;
+    frame->iov[1].data = &cache->mapping[entry->offset];
+    frame->iov[1].size = (int) entry->size;
+    frame->iov[2].data = frame->tail;
+    frame->iov[2].size = tail_size;
+    return head_size + (int) entry->size + tail_size;
+}
@@ -0,0 +1,244 @@
+/**
+ * @file serial_framing.c
+ * @brief Serial transport frame encoding.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include "mdfu/transport/serial_framing.h"
+
+/**
+ * @brief Word with all bytes set to 0x01.
+ */
+#define ONES_WORD ((uint64_t) 0x0101010101010101ULL)
+/**
+ * @brief Word with all bytes set to 0x80.
+ */
+#define HIGHS_WORD ((uint64_t) 0x8080808080808080ULL)
+
+/**
+ * @brief Maps the byte following an escape sequence code to the reserved code it replaces.
+ *
+ * Bytes that are not valid escape sequences map to zero, which is not a reserved code.
+ */
+static const uint8_t unescape_table[256] = {
+    [FRAME_START_ESC_SEQ] = FRAME_START_CODE,
+    [FRAME_END_ESC_SEQ] = FRAME_END_CODE,
+    [ESCAPE_SEQ_ESC_SEQ] = ESCAPE_SEQ_CODE
+};
+
+/**
+ * @brief Checks if a word contains a zero byte.
+ *
+ * The result is non-zero if at least one byte of the word is zero.
+ *
+ * @param word Word to check.
+ * @return uint64_t Non-zero if the word contains a zero byte.
+ */
+static inline uint64_t has_zero_byte(uint64_t word){
+    return (word - ONES_WORD) & ~word & HIGHS_WORD;
+}
+
+/**
+ * @brief Checks if any of the eight bytes at data is a reserved code.
+ *
+ * The bytes are loaded with memcpy so that the check works for any alignment
+ * and byte order.
+ *
+ * @param data Pointer to eight bytes of data.
+ * @return true if a reserved code is present, false otherwise.
+ */
+static inline bool word_has_reserved_code(const uint8_t *data){
+    uint64_t word;
+
+    memcpy(&word, data, sizeof(word));
+    return 0 != (has_zero_byte(word ^ (ONES_WORD * FRAME_START_CODE)) |
+                 has_zero_byte(word ^ (ONES_WORD * FRAME_END_CODE)) |
+                 has_zero_byte(word ^ (ONES_WORD * ESCAPE_SEQ_CODE)));
+}
+
+/**
+ * @brief Checks if a byte is a reserved code that must be escaped.
+ *
+ * @param code Byte to check.
+ * @return true if the byte is a reserved code, false otherwise.
+ */
+static inline bool is_reserved_code(uint8_t code){
+    return code == FRAME_START_CODE || code == FRAME_END_CODE || code == ESCAPE_SEQ_CODE;
+}
+
+/**
+ * @brief Adds eight bytes to the checksum byte lane sums.
+ *
+ * @param data Pointer to eight bytes of data.
+ * @param offset Offset of the data within the checksummed data, determines
+ *               which bytes belong to the low byte lane.
+ * @param lanes Low and high byte lane sums of the checksum.
+ */
+static inline void add_word_to_lanes(const uint8_t *data, int offset, uint32_t *lanes){
+    lanes[offset & 1] += (uint32_t) data[0] + data[2] + data[4] + data[6];
+    lanes[(offset + 1) & 1] += (uint32_t) data[1] + data[3] + data[5] + data[7];
+}
+
+/**
+ * @brief Encodes data and sums it into the checksum byte lanes.
+ *
+ * Runs of data without reserved codes are located eight bytes at a time and
+ * copied in bulk. Each reserved code is replaced with the escape sequence code
+ * followed by the complement of the reserved code. Every byte is added to the
+ * checksum lane sums while it is scanned so that the data is only read once.
+ *
+ * @param data_size The size of the input data.
+ * @param data A pointer to the data that needs to be encoded.
+ * @param encoded_data A pointer to the buffer where the encoded data will be stored.
+ * @param offset Offset of the data within the checksummed data.
+ * @param lanes Low and high byte lane sums of the checksum.
+ * @return int Size of the encoded data in bytes.
+ */
+static int encode(int data_size, const uint8_t *data, uint8_t *encoded_data, int offset, uint32_t *lanes){
+    int in = 0;
+    int out = 0;
+    int run;
+
+    while(in < data_size){
+        run = in;
+        while(run + (int) sizeof(uint64_t) <= data_size && !word_has_reserved_code(&data[run])){
+            add_word_to_lanes(&data[run], offset + run, lanes);
+            run += (int) sizeof(uint64_t);
+        }
+        while(run < data_size && !is_reserved_code(data[run])){
+            lanes[(offset + run) & 1] += data[run];
+            run += 1;
+        }
+        memcpy(&encoded_data[out], &data[in], (size_t) (run - in));
+        out += run - in;
+        in = run;
+        if(in < data_size){
+            lanes[(offset + in) & 1] += data[in];
+            encoded_data[out] = ESCAPE_SEQ_CODE;
+            encoded_data[out + 1] = (uint8_t) ~data[in];
+            out += 2;
+            in += 1;
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Encodes data by escaping reserved codes.
+ *
+ * @param data_size The size of the input data.
+ * @param data A pointer to the data that needs to be encoded.
+ * @param encoded_data A pointer to the buffer where the encoded data will be stored.
+ *                     The buffer must hold at least 2 * data_size bytes.
+ * @return int Size of the encoded data in bytes.
+ */
+int serial_frame_encode_payload(int data_size, const uint8_t *data, uint8_t *encoded_data){
+    uint32_t lanes[2] = {0, 0};
+
+    return encode(data_size, data, encoded_data, 0, lanes);
+}
+
+/**
+ * @brief Encodes a complete serial transport frame.
+ *
+ * The frame consists of the frame start code, the encoded payload, the encoded
+ * frame check sequence in little endian byte order and the frame end code.
+ * The frame check sequence is calculated while the payload is encoded and is
+ * the same as calculate_crc16 returns for the payload.
+ *
+ * @param data_size The size of the payload.
+ * @param data A pointer to the payload.
+ * @param frame A pointer to the buffer where the frame will be stored. The buffer
+ *              must hold at least SERIAL_FRAME_MAX_SIZE(data_size) bytes.
+ * @param frame_check_sequence Pointer where the frame check sequence is stored.
+ * @return int Size of the frame in bytes.
+ */
+int serial_frame_encode(int data_size, const uint8_t *data, uint8_t *frame, uint16_t *frame_check_sequence){
+    mac_iovec_t iov = {.data = data, .size = data_size};
+
+    return serial_frame_encodev(1, &iov, frame, frame_check_sequence);
+}
+
+/**
+ * @brief Encodes a complete serial transport frame from a payload split over multiple buffers.
+ *
+ * Same as serial_frame_encode for the concatenation of the buffers.
+ *
+ * @param count Number of payload buffers.
+ * @param iov Payload buffers.
+ * @param frame A pointer to the buffer where the frame will be stored. The buffer
+ *              must hold at least SERIAL_FRAME_MAX_SIZE() of the total payload size.
+ * @param frame_check_sequence Pointer where the frame check sequence is stored.
+ * @return int Size of the frame in bytes.
+ */
+int serial_frame_encodev(int count, const mac_iovec_t *iov, uint8_t *frame, uint16_t *frame_check_sequence){
+    uint32_t lanes[2] = {0, 0};
+    uint8_t fcs[FRAME_CHECK_SEQUENCE_SIZE];
+    int offset = 0;
+    int size = 0;
+
+    frame[size] = FRAME_START_CODE;
+    size += FRAME_START_CODE_SIZE;
+    for(int i = 0; i < count; i++){
+        size += encode(iov[i].size, iov[i].data, &frame[size], offset, lanes);
+        offset += iov[i].size;
+    }
+    *frame_check_sequence = (uint16_t) ~(lanes[0] + (lanes[1] << 8));
+    fcs[0] = (uint8_t) *frame_check_sequence;
+    fcs[1] = (uint8_t) (*frame_check_sequence >> 8);
+    size += serial_frame_encode_payload(FRAME_CHECK_SEQUENCE_SIZE, fcs, &frame[size]);
+    frame[size] = FRAME_END_CODE;
+    size += FRAME_END_CODE_SIZE;
+    return size;
+}
+
+/**
+ * @brief Decodes an escaped frame payload.
+ *
+ * The escape sequence codes are located with memchr and the runs of data in
+ * between are moved in bulk. Decoding never makes the data larger, so the
+ * decoded data may be stored in the same buffer as the encoded data.
+ *
+ * @param data_size The size of the encoded data.
+ * @param data A pointer to the encoded data, without frame start and end codes.
+ * @param max_size Size of the decoded data buffer.
+ * @param decoded_data A pointer to the buffer where the decoded data will be stored.
+ *                     May be the same as data.
+ * @return int Size of the decoded data in bytes on success, -1 on error with errno set:
+ *         - EINVAL if an escape sequence code is followed by an invalid code.
+ *         - ENOBUFS if the decoded data does not fit into max_size bytes.
+ */
+int serial_frame_decode_payload(int data_size, const uint8_t *data, int max_size, uint8_t *decoded_data){
+    const uint8_t *escape;
+    int in = 0;
+    int out = 0;
+    int run;
+
+    while(in < data_size){
+        escape = memchr(&data[in], ESCAPE_SEQ_CODE, (size_t) (data_size - in));
+        run = (NULL == escape) ? data_size - in : (int) (escape - &data[in]);
+        if(out + run > max_size){
+            errno = ENOBUFS;
+            return -1;
+        }
+        memmove(&decoded_data[out], &data[in], (size_t) run);
+        out += run;
+        in += run;
+        if(in < data_size){
+            if(in + 1 == data_size || 0 == unescape_table[data[in + 1]]){
+                errno = EINVAL;
+                return -1;
+            }
+            if(out == max_size){
+                errno = ENOBUFS;
+                return -1;
+            }
+            decoded_data[out] = unescape_table[data[in + 1]];
+            out += 1;
+            in += 2;
+        }
+    }
+    return out;
+}
@@ -5,115 +5,144 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdarg.h>
 #include "mdfu/transport/serial_transport.h"
+#include "mdfu/transport/serial_framing.h"
+#include "mdfu/transport/serial_frame_cache.h"
+#include "mdfu/transport/frame_trace.h"
 #include "mdfu/timeout.h"
 #include "mdfu/logging.h"
 #include "mdfu/mdfu_config.h"
 #include "mdfu/mdfu.h"
-#include "mdfu/checksum.h"
 #include "mdfu/error.h"
 
-/** @def FRAME_CHECK_SEQUENCE_SIZE
- *  @brief Size of the frame check sequence in bytes.
- */
-#define FRAME_CHECK_SEQUENCE_SIZE 2
-
 /** @def FRAME_PAYLOAD_LENGTH_SIZE
  *  @brief Size of payload length field in bytes.
  */
 #define FRAME_PAYLOAD_LENGTH_SIZE 2
 
-/** @def FRAME_START_CODE_SIZE
- *  @brief Size of the frame start code in bytes.
- */
-#define FRAME_START_CODE_SIZE 1
-
-/** @def FRAME_END_CODE_SIZE
- *  @brief Size of the frame end code in bytes.
- */
-#define FRAME_END_CODE_SIZE 1
-
-/** @def FRAME_START_CODE
- *  @brief Indicates the start of a frame.
- */
-#define FRAME_START_CODE 0x56
-
-/** @def FRAME_END_CODE
- *  @brief The ending byte code of a frame.
- */
-#define FRAME_END_CODE 0x9E
-
-/** @def ESCAPE_SEQ_CODE
- *  @brief The byte code used to indicate the start of an escape sequence.
- */
-#define ESCAPE_SEQ_CODE 0xCC
-
-/** @def FRAME_START_ESC_SEQ
- *  @brief The escape sequence replacement for the frame start code.
+/** @def RX_BUFFER_SIZE
+ *  @brief Size of the receive buffer in bytes.
+ *
+ *  The receive buffer holds the data of one MAC read so that the frame can be
+ *  scanned in memory instead of reading one byte at a time from the MAC.
  */
-#define FRAME_START_ESC_SEQ (~FRAME_START_CODE & 0xff)
+#define RX_BUFFER_SIZE 512
 
-/** @def FRAME_END_ESC_SEQ
- *  @brief The escape sequence replacement for the frame end code.
+/** @def FRAME_MIN_DECODED_SIZE
+ *  @brief Minimum number of decoded bytes in a valid frame.
+ *
+ *  A frame contains at least a one byte status and the frame check sequence.
  */
-#define FRAME_END_ESC_SEQ  (~FRAME_END_CODE & 0xff)
+#define FRAME_MIN_DECODED_SIZE (1 + FRAME_CHECK_SEQUENCE_SIZE)
 
-/** @def ESCAPE_SEQ_ESC_SEQ
- *  @brief The escape sequence replacement for the escape sequence code itself.
+/**
+ * @brief Serial transport instance state.
  */
-#define ESCAPE_SEQ_ESC_SEQ (~ESCAPE_SEQ_CODE & 0xff)
-
+struct serial_transport_ctx {
+    /** @brief Data received from the MAC that was not consumed yet. */
+    uint8_t rx_buffer[RX_BUFFER_SIZE];
+    /** @brief Index of the next unconsumed byte in rx_buffer. */
+    int rx_head;
+    /** @brief Number of valid bytes in rx_buffer. */
+    int rx_count;
+    /** @brief Size of the largest MDFU packet that is sent or received. */
+    int packet_size;
+    /** @brief Cache that frames for image chunks are taken from, NULL if not used. */
+    serial_frame_cache_t *frame_cache;
+    /** @brief Buffers of the packet that was framed by prepare, prepared_count
+     *  is zero if tx_buffer does not hold a prepared frame. */
+    int prepared_count;
+    mac_iovec_t prepared_iov[TRANSPORT_IOVEC_MAX];
+    /** @brief Size and frame check sequence of the prepared frame. */
+    int prepared_frame_size;
+    uint16_t prepared_frame_check_sequence;
+    /** @brief Buffer for the encoded frame that is sent to the client, sized
+     *  for packet_size. */
+    uint8_t tx_buffer[];
+};
 
-/** 
- * @brief MAC layer interface used for transport layer communication.
- * 
- * This variable holds the MAC layer interface.
+/**
+ * @brief Makes sure that received data is available in the receive buffer.
+ *
+ * If all data in the receive buffer was consumed, this function reads
+ * whatever the MAC has available in one read operation into the buffer.
+ * When the MAC supports reading with a deadline, the read blocks until at
+ * least min_size bytes are received or the timer expires, otherwise the
+ * MAC read returns after its own wait time.
+ *
+ * @param transport Transport instance.
+ * @param min_size Number of bytes the caller expects at least.
+ * @param timer Deadline for the read.
+ * @return int Number of unconsumed bytes in the receive buffer, which can be
+ *         zero if the MAC did not have any data, or -1 on a MAC read error.
  */
-static mac_t transport_mac;
+static int rx_fill(transport_t *transport, int min_size, timeout_t *timer)
+{
+    struct serial_transport_ctx *ctx = transport->ctx;
+    int status;
 
+    if(ctx->rx_head < ctx->rx_count){
+        return ctx->rx_count - ctx->rx_head;
+    }
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+    if(NULL != MAC_OPS(transport->mac)->read_deadline){
+        status = MAC_OPS(transport->mac)->read_deadline(transport->mac, RX_BUFFER_SIZE, ctx->rx_buffer, min_size, timer);
+    } else {
+        status = MAC_OPS(transport->mac)->read(transport->mac, RX_BUFFER_SIZE, ctx->rx_buffer);
+    }
+    assert(status <= RX_BUFFER_SIZE);
+    if(status < 0){
+        return -1;
+    }
+    ctx->rx_count = status;
+    return status;
+}
 
 /**
  * @brief Discards all incoming data until a specific code is encountered or a timeout occurs.
  *
- * This function reads data from a transport medium character by character until it finds the specified code.
- * If the code is found, the function returns 0. If a read error occurs or a timeout expires before finding the code,
- * the function returns -1 and sets the errno to ETIMEDOUT in case of a timeout.
+ * This function scans the received data for the specified code and discards everything up to
+ * and including it. If the code is found, the function returns 0. If a timeout expires before
+ * finding the code, the function returns -1 and sets the errno to ETIMEDOUT.
  *
+ * @param transport Transport instance.
  * @param code The byte code to look for in the incoming data stream.
  * @param timer A timeout_t structure that defines the timeout condition.
  *
  * @return int Returns 0 if the code is found, -1 if an error occurs or if a timeout expires.
  *
  */
-static int discard_until(uint8_t code, timeout_t timer)
+static int discard_until(transport_t *transport, uint8_t code, timeout_t timer)
 {
-    int status = -1;
-    uint8_t data;
-    bool continue_discarding = true;
+    struct serial_transport_ctx *ctx = transport->ctx;
+    int status;
+    const uint8_t *found;
 
-    while(continue_discarding)
+    while(true)
     {
-        status = transport_mac.read(1, &data);
-        assert(status <= 1);
+        status = rx_fill(transport, 1, &timer);
         // if we have an error e.g. buffer overrun or framing error
         // keep going to dispose of any characters until we time out
         // so that we can have a fresh start on the next attempt
-        if(status < 0){
-            continue_discarding = true;
-        }else if((status == 1) && (data == code)){
-                status = 0;
-                continue_discarding = false;
+        if(status > 0){
+            found = memchr(&ctx->rx_buffer[ctx->rx_head], code, (size_t) status);
+            if(NULL != found){
+                ctx->rx_head = (int) (found - ctx->rx_buffer) + 1;
+                return 0;
+            }
+            ctx->rx_head = ctx->rx_count;
         }
-        if(continue_discarding && timeout_expired(&timer)){
+        if(timeout_expired(&timer)){
             DEBUG("Timeout expired while waiting for frame start code");
-            status = -1;
             errno = ETIMEDOUT;
-            continue_discarding = false;
+            return -1;
         }
     }
-    return status;
 }
 
 /**
@@ -163,166 +192,123 @@ static int process_byte(uint8_t tmp, uint8_t **pdata, bool *escape_code)
 /**
  * @brief Reads data from a transport layer and decodes it until the frame end code is received.
  *
- * This function reads bytes one by one from a transport layer, handling escape sequences
+ * This function decodes the received data in the receive buffer, handling escape sequences
  * and stopping when the frame end code is encountered or the buffer is full. If an escape
- * sequence is detected, the function decodes it to the original byte. The function also
- * checks for a timeout condition.
+ * sequence is detected, the function decodes it to the original byte. Data following the
+ * frame end code is kept in the receive buffer for the next frame. The timeout condition is
+ * checked each time the receive buffer has been consumed.
+ *
+ * The checksum of the decoded data is calculated while decoding. It excludes the last two
+ * decoded bytes, which are the frame check sequence, by adding each byte to the checksum
+ * only once two more bytes have been decoded after it.
  *
+ * @param transport Transport instance.
  * @param max_size The maximum number of bytes to read into the buffer.
  * @param data A pointer to the buffer where the decoded data will be stored.
  * @param timer A timeout_t structure that defines the timeout condition.
+ * @param checksum Pointer where the checksum of the decoded data without the frame check
+ *                 sequence is stored.
  *
  * @return On success, the number of bytes read and decoded. On failure, -1 and errno is set
  *         to indicate the error (ENOBUFS for buffer overflow, EINVAL for invalid escape sequence,
  *         ETIMEDOUT for timeout).
- *
- * @warning The function asserts that the status returned by transport_mac.read is less than or equal to 1.
- *          The transport_mac.read function is assumed to be a part of the transport_mac object which should
- *          be defined and initialized elsewhere.
  */
-static ssize_t read_and_decode_until(int max_size, uint8_t *data, timeout_t timer){
-    int status = -1;
+static ssize_t read_and_decode_until(transport_t *transport, int max_size, uint8_t *data, timeout_t timer, uint16_t *checksum){
+    struct serial_transport_ctx *ctx = transport->ctx;
+    int status;
     uint8_t tmp;
     uint8_t *pdata = data;
+    uint8_t *pchecksum = data;
+    uint32_t lanes[2] = {0, 0};
     bool escape_code = false;
-    bool continue_reading = true;
+    int wanted;
+    // Frame start code that was consumed by discard_until
+    int wire_size = FRAME_START_CODE_SIZE;
 
     DEBUG("Receiving frame: ");
-    while(continue_reading)
+    while(true)
     {
-        if(max_size == pdata - data){
-            errno = ENOBUFS;
-            DEBUG("Buffer overflow in serial transport while waiting for frame end code");
-            break;
-        }
-        status = transport_mac.read(1, &tmp);
-        assert(status <= 1);
-
+        // Wait for at least the bytes that are still missing in the shortest valid frame
+        wanted = FRAME_MIN_DECODED_SIZE - (int) (pdata - data) + FRAME_END_CODE_SIZE;
+        status = rx_fill(transport, wanted > 1 ? wanted : 1, &timer);
         if(status < 0){
-            continue_reading = false;
-        }else if(status == 1) {
+            return -1;
+        }
+        while(ctx->rx_head < ctx->rx_count){
+            tmp = ctx->rx_buffer[ctx->rx_head];
+            ctx->rx_head += 1;
+            wire_size += 1;
             if(tmp == FRAME_END_CODE){
-                status = (int) (pdata - data);
-                continue_reading = false;
-            }else{
-                status = process_byte(tmp, &pdata, &escape_code);
-                if(status < 0){
-                    continue_reading = false;
-                }
+                transport->stats.bytes_received += (uint64_t) wire_size;
+                *checksum = (uint16_t) ~(lanes[0] + (lanes[1] << 8));
+                return (ssize_t) (pdata - data);
+            }
+            // The buffer is full, only the frame end code can follow
+            if(max_size == pdata - data){
+                errno = ENOBUFS;
+                DEBUG("Buffer overflow in serial transport while waiting for frame end code");
+                return -1;
+            }
+            if(process_byte(tmp, &pdata, &escape_code) < 0){
+                return -1;
+            }
+            if(pdata - pchecksum > FRAME_CHECK_SEQUENCE_SIZE){
+                lanes[(pchecksum - data) & 1] += *pchecksum;
+                pchecksum++;
             }
         }
-        if(continue_reading && timeout_expired(&timer)){
-            status = -1;
+        if(timeout_expired(&timer)){
             DEBUG("Timeout expired while waiting for frame end code");
             errno = ETIMEDOUT;
-            continue_reading = false;
+            return -1;
         }
     }
-    return status;
 }
 
 /**
  * @brief Initializes the transport layer.
  *
- * This function copies the MAC function pointers from the provided mac object
- * into the global transport_mac structure and sets the transport timeout.
+ * This function stores the MAC instance that the transport uses for
+ * communication. The transport takes ownership of the MAC.
  *
- * @param mac Pointer to a mac_t structure that contains the MAC layer function pointers.
+ * @param transport Transport instance.
+ * @param mac Pointer to the MAC layer instance.
  * @param timeout The default timeout value to be used for transport layer operations.
  * @return Always returns 0 to indicate success.
  */
-static int init(mac_t *mac, int timeout){ // cppcheck-suppress
-    transport_mac.open = mac->open;
-    transport_mac.close = mac->close;
-    transport_mac.read = mac->read;
-    transport_mac.write = mac->write;
-    transport_mac.init = mac->init;
+static int init(transport_t *transport, mac_t *mac, int timeout){ // cppcheck-suppress
+    transport->mac = mac;
     return 0;
 }
 
 /**
  * @brief Opens the transport layer.
  *
- * This function calls the open method on the transport_mac object, which is responsible
- * for establishing the transport layer connection.
+ * This function discards any data left in the receive buffer and calls the open
+ * method on the transport MAC, which is responsible for establishing the transport
+ * layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int open(void){
-    return transport_mac.open();
+static int open(transport_t *transport){
+    struct serial_transport_ctx *ctx = transport->ctx;
+    ctx->rx_head = 0;
+    ctx->rx_count = 0;
+    return MAC_OPS(transport->mac)->open(transport->mac);
 }
 
 /**
  * @brief Closes the transport layer.
  *
- * This function calls the close method on the transport_mac object, which is responsible
+ * This function calls the close method on the transport MAC, which is responsible
  * for closing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int close(void){
-    return transport_mac.close();
-}
-
-/**
- * @brief Encodes data and sends it to MDFU client
- *
- * This function takes an array of data and encodes it by inserting escape sequences
- * before any special codes that appear in the data, and then sends the data
- * via the MAC layer to the MDFU client.
- *
- * @param data_size The size of the input data array.
- * @param data A pointer to the array of data that needs to be encoded.
- *
- */
-static int encode_and_send(int data_size, const uint8_t *data){
-    uint8_t code;
-    uint8_t encoded_data[2];
-    int size = 0;
-    int status = 0;
-
-    for(int i = 0; i < data_size; i++)
-    {
-        size = 0;
-        code = data[i];
-        if(code == FRAME_START_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = FRAME_START_ESC_SEQ;
-            size += 1;
-        } else if(code == FRAME_END_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = FRAME_END_ESC_SEQ;
-            size += 1;
-        } else if(code == ESCAPE_SEQ_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = ESCAPE_SEQ_ESC_SEQ;
-            size += 1;
-        } else {
-            encoded_data[size] = code;
-            size += 1;
-        }
-        if(transport_mac.write(size, (uint8_t *) &encoded_data) < 0){
-            status = -1;
-            break;
-        }
-    }
-    return status;
-}
-
-static void log_frame(int size, const uint8_t *data, uint16_t checksum){
-    int i = 0;
-    if(DEBUGLEVEL > debug_level){
-        return;
-    }
-    TRACE(DEBUGLEVEL, "size=%d payload=0x", size);
-    
-    for(; i < size - 2; i++){
-        TRACE(DEBUGLEVEL, "%02x", data[i]);
-    }
-    TRACE(DEBUGLEVEL, " fcs=0x%04x\n", checksum);
+static int close(transport_t *transport){
+    return MAC_OPS(transport->mac)->close(transport->mac);
 }
 
 /**
@@ -332,6 +318,7 @@ static void log_frame(int size, const uint8_t *data, uint16_t checksum){
  * start of the packet is detected. It then reads and decodes the packet, verifies the checksum,
  * and returns the size of the packet.
  *
+ * @param transport Transport instance.
  * @param size Pointer to an integer where the size of the MDFU packet will be stored.
  * @param data Pointer to a buffer where the decoded MDFU packet will be stored.
  * @param timeout The timeout period for reading the packet, in seconds.
@@ -341,99 +328,353 @@ static void log_frame(int size, const uint8_t *data, uint16_t checksum){
  * @note The function assumes that the caller has allocated sufficient space in the data buffer
  *       pointed to by data to store the decoded packet.
  */
-static int read(int *size, uint8_t *data, float timeout){
+static int read(transport_t *transport, int *size, uint8_t *data, float timeout){
+    const struct serial_transport_ctx *ctx = transport->ctx;
     ssize_t status;
     uint16_t checksum;
     timeout_t timer;
     set_timeout(&timer, timeout);
 
-    status = discard_until(FRAME_START_CODE, timer);
+    status = discard_until(transport, FRAME_START_CODE, timer);
     if(status < 0){
+        if(ETIMEDOUT == errno){
+            transport->stats.timeouts += 1;
+        }
         return (int) status;
     }
-    status = read_and_decode_until(MDFU_CMD_PACKET_MAX_SIZE, data, timer);
+    status = read_and_decode_until(transport, ctx->packet_size + FRAME_CHECK_SEQUENCE_SIZE, data, timer, &checksum);
     if(status < 0){
+        if(ETIMEDOUT == errno){
+            transport->stats.timeouts += 1;
+        } else if(EINVAL == errno || ENOBUFS == errno){
+            transport->stats.integrity_errors += 1;
+        }
         return (int) status;
     }
     *size = (int) status;
     // Minimum status response should be 1 byte status and two bytes for CRC
-    if(*size < 3){
-        DEBUG("Serial Transport: Received invalid frame with length %d but minimum is 3", *size);
+    if(*size < FRAME_MIN_DECODED_SIZE){
+        DEBUG("Serial Transport: Received invalid frame with length %d but minimum is %d", *size, FRAME_MIN_DECODED_SIZE);
+        transport->stats.integrity_errors += 1;
         return -1;
     }
-    uint16_t frame_checksum = *((uint16_t *) &data[*size - 2]);
-#ifdef MDFU_LOG_TRANSPORT_FRAME
-    log_frame(*size, data, frame_checksum);
-#endif
-    checksum = calculate_crc16(*size - 2, data);
+    uint16_t frame_checksum = (uint16_t) (data[*size - 2] | (data[*size - 1] << 8));
+    // The frame is decoded while it is received so the trace holds the decoded frame
+    frame_trace_record(FRAME_TRACE_RX, *size, data);
     if(checksum != frame_checksum){
         DEBUG("Serial Transport: Frame check sequence verification failed, calculated 0x%04x but got 0x%04x\n", checksum, frame_checksum);
+        transport->stats.integrity_errors += 1;
         return -1;
     }
     *size -= 2; // remove checksum size to get payload size
+    transport->stats.frames_received += 1;
+    transport->stats.payload_bytes_received += (uint64_t) *size;
+    return 0;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Sends a MDFU packet with a frame from the frame cache.
+ *
+ * The cached image chunk is sent straight from the cache file mapping with a
+ * scatter/gather MAC write, or copied into the transmit buffer when the MAC
+ * cannot write multiple buffers.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ * @param frame_check_sequence Pointer where the frame check sequence is stored.
+ *
+ * @return Size of the sent frame on success, -1 on error with errno set
+ *         appropriately, ENOENT if the packet is not in the cache.
+ */
+static int send_cached_frame(transport_t *transport, int count, const mac_iovec_t *iov, uint16_t *frame_check_sequence){
+    struct serial_transport_ctx *ctx = transport->ctx;
+    serial_frame_cache_frame_t frame;
+    int frame_size;
+    int status;
+    int sent = 0;
+
+    frame_size = serial_frame_cache_encodev(ctx->frame_cache, count, iov, &frame, frame_check_sequence);
+    if(frame_size < 0){
+        return -1;
+    }
+    frame_trace_recordv(FRAME_TRACE_TX, 3, frame.iov);
+    if(NULL != MAC_OPS(transport->mac)->writev){
+        return MAC_OPS(transport->mac)->writev(transport->mac, 3, frame.iov) < 0 ? -1 : frame_size;
+    }
+    for(int i = 0; i < 3; i++){
+        memcpy(&ctx->tx_buffer[sent], frame.iov[i].data, (size_t) frame.iov[i].size);
+        sent += frame.iov[i].size;
+    }
+    sent = 0;
+    while(sent < frame_size){
+        status = MAC_OPS(transport->mac)->write(transport->mac, frame_size - sent, &ctx->tx_buffer[sent]);
+        if(status <= 0){
+            return -1;
+        }
+        sent += status;
+    }
+    return frame_size;
+}
+#endif
+
+/**
+ * @brief Checks if the transmit buffer holds the prepared frame of a packet.
+ *
+ * @param ctx Transport instance state.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ * @return true if prepare framed the packet in the same buffers.
+ */
+static bool is_prepared(const struct serial_transport_ctx *ctx, int count, const mac_iovec_t *iov){
+    if(count != ctx->prepared_count){
+        return false;
+    }
+    for(int i = 0; i < count; i++){
+        if(iov[i].data != ctx->prepared_iov[i].data || iov[i].size != ctx->prepared_iov[i].size){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Encodes a MDFU packet into a frame and sends it.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ * @param frame_check_sequence Pointer where the frame check sequence is stored.
+ *
+ * @return 0 on success, -1 on error with errno set appropriately.
+ */
+static int send_frame(transport_t *transport, int count, const mac_iovec_t *iov, uint16_t *frame_check_sequence){
+    struct serial_transport_ctx *ctx = transport->ctx;
+    int status;
+    int size;
+    int frame_size;
+    int sent = 0;
+
+    size = mac_iovec_size(count, iov);
+    if(size < 0){
+        return -1;
+    }
+    if(size > ctx->packet_size){
+        errno = EOVERFLOW;
+        return -1;
+    }
+#ifndef _WIN32
+    if(NULL != ctx->frame_cache){
+        status = send_cached_frame(transport, count, iov, frame_check_sequence);
+        if(status >= 0){
+            transport->stats.frames_sent += 1;
+            transport->stats.bytes_sent += (uint64_t) status;
+            transport->stats.payload_bytes_sent += (uint64_t) size;
+            return 0;
+        }
+        if(ENOENT != errno){
+            return -1;
+        }
+    }
+#endif
+    if(is_prepared(ctx, count, iov)){
+        frame_size = ctx->prepared_frame_size;
+        *frame_check_sequence = ctx->prepared_frame_check_sequence;
+    } else {
+        frame_size = serial_frame_encodev(count, iov, ctx->tx_buffer, frame_check_sequence);
+    }
+    ctx->prepared_count = 0;
+    frame_trace_record(FRAME_TRACE_TX, frame_size, ctx->tx_buffer);
+    while(sent < frame_size){
+        // The MAC can return after writing only a part of the frame
+        status = MAC_OPS(transport->mac)->write(transport->mac, frame_size - sent, &ctx->tx_buffer[sent]);
+        if(status <= 0){
+            return -1;
+        }
+        sent += status;
+    }
+    transport->stats.frames_sent += 1;
+    transport->stats.bytes_sent += (uint64_t) frame_size;
+    transport->stats.payload_bytes_sent += (uint64_t) size;
     return 0;
 }
 
 /**
  * @brief Writes a MDFU packet to a serial transport.
  *
- * This function writes a MDFU packet to a serial transport. It calculates the checksum for the
- * frame, sends the frame start code, encodes and sends the MDFU packet, sends the checksum, and
- * finally sends the frame end code.
+ * This function encodes the complete frame for a MDFU packet, with frame start code,
+ * escaped MDFU packet, escaped checksum and frame end code, into the transmit buffer
+ * and sends it with a single MAC write.
  *
+ * @param transport Transport instance.
  * @param size The size of the MDFU packet to be sent.
  * @param data Pointer to the buffer containing the MDFU packet to be sent.
  *
  * @return 0 on success, negative value on error with errno set appropriately.
  */
-static int write(int size, uint8_t *data){
-    int status = 0;
-    uint8_t code;
-    uint16_t frame_check_sequence = calculate_crc16(size, data);
-    
-    // Send frame start code
-    code = FRAME_START_CODE;
-    status = transport_mac.write(1, &code);
-    if(status < 0){
-        goto exit;
+static int write(transport_t *transport, int size, uint8_t *data){
+    mac_iovec_t iov = {.data = data, .size = size};
+    uint16_t frame_check_sequence;
+
+    return send_frame(transport, 1, &iov, &frame_check_sequence);
+}
+
+/**
+ * @brief Writes a MDFU packet that is split over multiple buffers to a serial transport.
+ *
+ * The buffers are encoded directly into the frame in the transmit buffer, so the MDFU
+ * packet does not need to be assembled first.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ *
+ * @return 0 on success, negative value on error with errno set appropriately.
+ */
+static int writev(transport_t *transport, int count, const mac_iovec_t *iov){
+    uint16_t frame_check_sequence;
+
+    return send_frame(transport, count, iov, &frame_check_sequence);
+}
+
+/**
+ * @brief Frames the MDFU packet that is sent next.
+ *
+ * The frame is encoded into the transmit buffer, which is free once the
+ * previous frame was written to the MAC, and sent by the next write or writev
+ * of the same buffers. Packets that are sent from the frame cache are not
+ * prepared since their frames are already encoded.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ *
+ * @return 0 on success, -1 on error with errno set appropriately.
+ */
+static int prepare(transport_t *transport, int count, const mac_iovec_t *iov){
+    struct serial_transport_ctx *ctx = transport->ctx;
+    int size = mac_iovec_size(count, iov);
+
+    ctx->prepared_count = 0;
+    if(size < 0 || count > TRANSPORT_IOVEC_MAX){
+        errno = EINVAL;
+        return -1;
     }
-    // Send frame payload
-    status = encode_and_send(size, data);
-    if(status < 0){
-        goto exit;
+    if(size > ctx->packet_size){
+        errno = EOVERFLOW;
+        return -1;
     }
-    // Send frame checksum
-    code = (uint8_t) frame_check_sequence;
-    status = encode_and_send(1, &code);
-    if(status < 0){
-        goto exit;
+    if(NULL != ctx->frame_cache){
+        errno = EEXIST;
+        return -1;
     }
-    code = (uint8_t) (frame_check_sequence >> 8);
-    status = encode_and_send(1, &code);
-    if(status < 0){
-        goto exit;
+    ctx->prepared_frame_size = serial_frame_encodev(count, iov, ctx->tx_buffer, &ctx->prepared_frame_check_sequence);
+    memcpy(ctx->prepared_iov, iov, (size_t) count * sizeof(mac_iovec_t));
+    ctx->prepared_count = count;
+    return 0;
+}
+
+/**
+ * @brief Sets the size of the largest MDFU packet and resizes the frame buffer for it.
+ *
+ * @param transport Transport instance.
+ * @param packet_size MDFU packet size in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int set_packet_size(transport_t *transport, int packet_size){
+    if(packet_size <= 0){
+        errno = EINVAL;
+        return -1;
     }
-    // Send frame end code
-    code = FRAME_END_CODE;
-    status = transport_mac.write(1, &code);
+    if(transport_resize_ctx(transport, sizeof(struct serial_transport_ctx) + SERIAL_FRAME_MAX_SIZE((size_t) packet_size)) < 0){
+        return -1;
+    }
+    ((struct serial_transport_ctx *) transport->ctx)->packet_size = packet_size;
+    ((struct serial_transport_ctx *) transport->ctx)->prepared_count = 0;
+    return 0;
+}
 
-#ifdef MDFU_LOG_TRANSPORT_FRAME
-    log_frame(size, data, frame_check_sequence);
+/**
+ * @brief Handle ioctl requests for transport settings.
+ *
+ * This function processes ioctl requests to configure or query the transport.
+ * It currently supports the following requests:
+ * - TRANSPORT_IOC_INTER_TRANSACTION_DELAY: Accepted but ignored since the serial
+ *   transport does not use an inter transaction delay.
+ * - TRANSPORT_IOC_PIPELINING: Reports that multiple commands can be in flight
+ *   since the client responses are received as a stream of frames.
+ * - TRANSPORT_IOC_GET_FD: Reports the file descriptor of the MAC, if the MAC
+ *   has one.
+ * - TRANSPORT_IOC_HAS_DATA: Reports if received data is buffered in the
+ *   transport or in the MAC.
+ * - TRANSPORT_IOC_PACKET_SIZE: Resizes the frame buffer for a MDFU packet size.
+ * - TRANSPORT_IOC_FRAME_CACHE: Sets the cache that frames for image chunks are
+ *   taken from.
+ *
+ * @param transport Transport instance.
+ * @param request The ioctl request code.
+ * @param ... Additional arguments depending on the request code.
+ * @return 0 on success, -1 on failure.
+ */
+static int ioctl(transport_t *transport, int request, ...){
+    va_list args;
+    va_start(args, request);
+    int result = -1;
+    if(TRANSPORT_IOC_INTER_TRANSACTION_DELAY == request){
+        result = 0;
+    }else if(TRANSPORT_IOC_PIPELINING == request){
+        bool *pipelining = va_arg(args, bool *);
+        *pipelining = true;
+        result = 0;
+    }else if(TRANSPORT_IOC_GET_FD == request){
+        int *fd = va_arg(args, int *);
+        *fd = MAC_OPS(transport->mac)->get_fd ? MAC_OPS(transport->mac)->get_fd(transport->mac) : -1;
+        result = *fd < 0 ? -1 : 0;
+    }else if(TRANSPORT_IOC_HAS_DATA == request){
+        struct serial_transport_ctx *ctx = transport->ctx;
+        bool *has_data = va_arg(args, bool *);
+        *has_data = ctx->rx_head < ctx->rx_count || (NULL != MAC_OPS(transport->mac)->has_data && MAC_OPS(transport->mac)->has_data(transport->mac));
+        result = 0;
+    }else if(TRANSPORT_IOC_PACKET_SIZE == request){
+        result = set_packet_size(transport, va_arg(args, int));
+#ifndef _WIN32
+    }else if(TRANSPORT_IOC_FRAME_CACHE == request){
+        ((struct serial_transport_ctx *) transport->ctx)->frame_cache = va_arg(args, serial_frame_cache_t *);
+        result = 0;
 #endif
-    exit:
-        return status;
+    }
+    va_end(args);
+    return result;
 }
 
-transport_t serial_transport ={
+const transport_t serial_transport ={
     .close = close,
     .open = open,
     .read = read,
     .write = write,
+    .writev = writev,
+    .prepare = prepare,
     .init = init,
-    .ioctl = NULL
+    .ioctl = ioctl
 };
 
+/**
+ * @brief Create a new serial transport instance.
+ *
+ * The frame buffer is sized for MDFU_PACKET_DEFAULT_SIZE until a larger
+ * packet size is set with TRANSPORT_IOC_PACKET_SIZE.
+ *
+ * @param transport Pointer where the new transport instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
 int get_serial_transport(transport_t **transport){
-    *transport = &serial_transport;
+    if(transport_alloc(&serial_transport, sizeof(struct serial_transport_ctx), transport) < 0){
+        return -1;
+    }
+    if(set_packet_size(*transport, MDFU_PACKET_DEFAULT_SIZE) < 0){
+        transport_free(*transport);
+        return -1;
+    }
     return 0;
 }
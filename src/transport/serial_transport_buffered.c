@@ -5,85 +5,75 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdarg.h>
 #include "mdfu/transport/serial_transport.h"
+#include "mdfu/transport/serial_framing.h"
+#include "mdfu/transport/serial_frame_cache.h"
+#include "mdfu/transport/frame_trace.h"
 #include "mdfu/timeout.h"
+#include "mdfu/checksum.h"
 #include "mdfu/logging.h"
 #include "mdfu/mdfu_config.h"
 #include "mdfu/mdfu.h"
-#include "mdfu/checksum.h"
-
-/** @def FRAME_CHECK_SEQUENCE_SIZE
- *  @brief Size of the frame check sequence in bytes.
- */
-#define FRAME_CHECK_SEQUENCE_SIZE 2
 
 /** @def FRAME_PAYLOAD_LENGTH_SIZE
  *  @brief Size of payload length field in bytes.
  */
 #define FRAME_PAYLOAD_LENGTH_SIZE 2
 
-/** @def FRAME_START_CODE_SIZE
- *  @brief Size of the frame start code in bytes.
- */
-#define FRAME_START_CODE_SIZE 1
 
-/** @def FRAME_END_CODE_SIZE
- *  @brief Size of the frame end code in bytes.
- */
-#define FRAME_END_CODE_SIZE 1
-
-/** @def FRAME_START_CODE
- *  @brief Indicates the start of a frame.
- */
-#define FRAME_START_CODE 0x56
 
-/** @def FRAME_END_CODE
- *  @brief The ending byte code of a frame.
- */
-#define FRAME_END_CODE 0x9E
-
-/** @def ESCAPE_SEQ_CODE
- *  @brief The byte code used to indicate the start of an escape sequence.
- */
-#define ESCAPE_SEQ_CODE 0xCC
-
-/** @def FRAME_START_ESC_SEQ
- *  @brief The escape sequence replacement for the frame start code.
- */
-#define FRAME_START_ESC_SEQ (~FRAME_START_CODE & 0xff)
-
-/** @def FRAME_END_ESC_SEQ
- *  @brief The escape sequence replacement for the frame end code.
- */
-#define FRAME_END_ESC_SEQ  (~FRAME_END_CODE & 0xff)
-
-/** @def ESCAPE_SEQ_ESC_SEQ
- *  @brief The escape sequence replacement for the escape sequence code itself.
+/**
+ * @brief Buffered serial transport instance state.
  */
-#define ESCAPE_SEQ_ESC_SEQ (~ESCAPE_SEQ_CODE & 0xff)
-
+struct serial_transport_buffered_ctx {
+    /**
+     * @brief Size of the largest MDFU packet that is sent or received.
+     */
+    int packet_size;
+    /**
+     * @brief Size of the frame buffer in bytes.
+     */
+    int buffer_size;
+    /**
+     * @brief Cache that frames for image chunks are taken from, NULL if not used.
+     */
+    serial_frame_cache_t *frame_cache;
+    /**
+     * @brief Buffer for storing data frames.
+     *
+     * This buffer is used to store the data frames that are constructed or received
+     * by the transport layer. The size of the buffer is calculated based on the
+     * maximum expected size of the frames, including start/end codes, the MDFU
+     * packet of packet_size and frame check sequence.
+     *
+     * @note The buffer size is calculated for the worst case scenario where all data
+     * bytes consist of reserved codes that need to be replaced with escape sequences.
+     */
+    uint8_t buffer[];
+};
 
-/** 
- * @brief MAC layer interface used for transport layer communication.
- * 
- * This variable holds the MAC layer interface.
- */
-static mac_t transport_mac;
-
-/** 
- * @brief Buffer for storing data frames.
- * 
- * This buffer is used to store the data frames that are constructed or received
- * by the transport layer. The size of the buffer is calculated based on the
- * maximum expected size of the frames, including start/end codes, sequence field,
- * command size, maximum command data length, and frame check sequence.
- * 
- * @note The buffer size is calculated for the worst case scenario where all data
- * bytes consist of reserved codes that need to be replaced with escape sequences.
+/**
+ * @brief Reads one byte from the MAC layer.
+ *
+ * The MAC read with deadline is used when the MAC supports it, so that the
+ * read returns as soon as the byte arrives or the timer expires.
+ *
+ * @param mac MAC layer to read from.
+ * @param data Pointer where the byte is stored.
+ * @param timer Deadline for the read.
+ * @return int 1 if a byte was read, 0 if no byte was received and -1 on error.
  */
-static uint8_t buffer[FRAME_START_CODE + (MDFU_SEQUENCE_FIELD_SIZE + MDFU_COMMAND_SIZE  + MDFU_MAX_COMMAND_DATA_LENGTH + FRAME_CHECK_SEQUENCE_SIZE) * 2 + FRAME_END_CODE_SIZE];
+static int mac_read_byte(mac_t *mac, uint8_t *data, timeout_t *timer)
+{
+    if(NULL != mac->read_deadline){
+        return mac->read_deadline(mac, 1, data, 1, timer);
+    }
+    return mac->read(mac, 1, data);
+}
 
 /**
  * @brief Discards all incoming data until a specific code is encountered or a timeout occurs.
@@ -92,13 +82,14 @@ static uint8_t buffer[FRAME_START_CODE + (MDFU_SEQUENCE_FIELD_SIZE + MDFU_COMMAN
  * If the code is found, the function returns 0. If a read error occurs or a timeout expires before finding the code,
  * the function returns -1 and sets the errno to ETIMEDOUT in case of a timeout.
  *
+ * @param mac MAC layer to read from.
  * @param code The byte code to look for in the incoming data stream.
  * @param timer A timeout_t structure that defines the timeout condition.
  *
  * @return int Returns 0 if the code is found, -1 if an error occurs or if a timeout expires.
  *
  */
-static int discard_until(uint8_t code, timeout_t timer)
+static int discard_until(mac_t *mac, uint8_t code, timeout_t timer)
 {
     int status = -1;
     uint8_t data;
@@ -106,7 +97,7 @@ static int discard_until(uint8_t code, timeout_t timer)
 
     while(continue_discarding)
     {
-        status = transport_mac.read(1, &data);
+        status = mac_read_byte(mac, &data, &timer);
         assert(status <= 1);
         if(status < 0){
             continue_discarding = false;
@@ -130,6 +121,7 @@ static int discard_until(uint8_t code, timeout_t timer)
  * This function reads bytes one by one from a MAC layer into a buffer until either the specified end code is read,
  * the buffer is filled to its maximum size, or a timeout occurs.
  *
+ * @param mac MAC layer to read from.
  * @param code The byte code to read until.
  * @param max_size The maximum number of bytes to read into the buffer.
  * @param data A pointer to the buffer where the read bytes will be stored.
@@ -141,7 +133,7 @@ static int discard_until(uint8_t code, timeout_t timer)
  *         - ETIMEDOUT if the operation times out before the end code is encountered.
  *         - Error codes from the MAC layer are passed through
  */
-static ssize_t read_until(uint8_t code, int max_size, uint8_t *data, timeout_t timer){
+static ssize_t read_until(mac_t *mac, uint8_t code, int max_size, uint8_t *data, timeout_t timer){
     int status = -1;
     uint8_t tmp;
     uint8_t *pdata = data;
@@ -154,7 +146,7 @@ static ssize_t read_until(uint8_t code, int max_size, uint8_t *data, timeout_t t
             DEBUG("Buffer overflow in serial transport while waiting for frame end code");
             continue_reading = false;
         }else{
-            status = transport_mac.read(1, &tmp);
+            status = mac_read_byte(mac, &tmp, &timer);
             assert(status <= 1);
 
             if(status < 0){
@@ -182,129 +174,43 @@ static ssize_t read_until(uint8_t code, int max_size, uint8_t *data, timeout_t t
 /**
  * @brief Initializes the transport layer.
  *
- * This function copies the MAC function pointers from the provided mac object
- * into the global transport_mac structure and sets the transport timeout.
+ * This function stores the MAC instance that the transport uses for
+ * communication. The transport takes ownership of the MAC.
  *
- * @param mac Pointer to a mac_t structure that contains the MAC layer function pointers.
+ * @param transport Transport instance.
+ * @param mac Pointer to the MAC layer instance.
  * @param timeout The default timeout value to be used for transport layer operations.
  * @return Always returns 0 to indicate success.
  */
-static int init(mac_t *mac, int timeout){//NOSONAR
-    transport_mac.open = mac->open;
-    transport_mac.close = mac->close;
-    transport_mac.read = mac->read;
-    transport_mac.write = mac->write;
-    transport_mac.init = mac->init;
+static int init(transport_t *transport, mac_t *mac, int timeout){//NOSONAR
+    transport->mac = mac;
     return 0;
 }
 
 /**
  * @brief Opens the transport layer.
  *
- * This function calls the open method on the transport_mac object, which is responsible
+ * This function calls the open method on the transport MAC, which is responsible
  * for establishing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int open(void){
-    return transport_mac.open();
+static int open(transport_t *transport){
+    return transport->mac->open(transport->mac);
 }
 
 /**
  * @brief Closes the transport layer.
  *
- * This function calls the close method on the transport_mac object, which is responsible
+ * This function calls the close method on the transport MAC, which is responsible
  * for closing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int close(void){
-    return transport_mac.close();
-}
-
-/**
- * @brief Encodes the payload of a frame by escaping special codes.
- *
- * This function takes an array of data and encodes it by inserting escape sequences
- * before any special codes that appear in the data. The special codes include the
- * start of frame code, end of frame code, and the escape sequence code itself.
- *
- * @param data_size The size of the input data array.
- * @param data A pointer to the array of data that needs to be encoded.
- * @param encoded_data A pointer to the array where the encoded data will be stored.
- * @param encoded_data_size A pointer to an integer where the size of the encoded data will be stored.
- *
- * @note The encoded_data array should be large enough to accommodate the encoded data,
- *       which may be larger than the input data due to the addition of escape sequences.
- *
- * @warning The function assumes that the encoded_data array has enough space to hold
- *          the encoded data. If the encoded_data array is not large enough, a buffer
- *          overflow can occur.
- */
-static void encode_frame_payload(int data_size, const uint8_t *data, uint8_t *encoded_data, int *encoded_data_size){
-    uint8_t code;
-    int size = 0;
-
-    for(int i = 0; i < data_size; i++)
-    {
-        code = data[i];
-        if(code == FRAME_START_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = FRAME_START_ESC_SEQ;
-            size += 1;
-        } else if(code == FRAME_END_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = FRAME_END_ESC_SEQ;
-            size += 1;
-        } else if(code == ESCAPE_SEQ_CODE){
-            encoded_data[size] = ESCAPE_SEQ_CODE;
-            size += 1;
-            encoded_data[size] = ESCAPE_SEQ_ESC_SEQ;
-            size += 1;
-        } else {
-            encoded_data[size] = code;
-            size += 1;
-        }
-    }
-    *encoded_data_size = size;
-}
-
-static int decode_frame_payload(int data_size, const uint8_t *data, int *decoded_data_size, uint8_t *decoded_data){
-    bool escape_code = false;
-    uint8_t code;
-    int size = 0;
-    int status = 0;
-    
-    for(int i = 0; i < data_size; i++)
-    {
-        code = data[i];
-        if(escape_code){
-            if(code == FRAME_START_ESC_SEQ){
-                decoded_data[size] = FRAME_START_CODE;
-            } else if(code == FRAME_END_ESC_SEQ){
-                decoded_data[size] = FRAME_END_CODE;
-            } else if(code == ESCAPE_SEQ_ESC_SEQ){
-                decoded_data[size] = ESCAPE_SEQ_CODE;
-            } else {
-                DEBUG("Invalid code (%x) after escape code", code);
-                status = -1;
-                errno = EINVAL;
-                break;
-            }
-            size += 1;
-        } else {
-            if(code == ESCAPE_SEQ_CODE){
-                escape_code = true;
-            } else {
-                decoded_data[size] = code;
-                size += 1;
-            }
-        }
-    }
-    *decoded_data_size = size;
-    return status;
+static int close(transport_t *transport){
+    return transport->mac->close(transport->mac);
 }
 
 static void log_frame(int size, uint8_t *data){
@@ -317,89 +223,365 @@ static void log_frame(int size, uint8_t *data){
     for(; i < size - 2; i++){
         TRACE(DEBUGLEVEL, "%02x", data[i]);
     }
-    TRACE(DEBUGLEVEL, " fcs=0x%04x\n", *((uint16_t *) &data[size - 2]));
+    TRACE(DEBUGLEVEL, " fcs=0x%04x\n", (uint16_t) (data[size - 2] | (data[size - 1] << 8)));
 }
 
-static int read(int *size, uint8_t *data, float timeout){
+/**
+ * @brief Receives a frame and decodes it.
+ *
+ * @param transport Transport instance.
+ * @param decoded_data Buffer for the decoded MDFU packet and frame check sequence,
+ *                     either a buffer with room for them or the frame buffer,
+ *                     in which case the frame is decoded in place.
+ * @param timeout The maximum time to wait for the frame, in seconds.
+ * @return int Size of the decoded data including the frame check sequence on
+ *         success, -1 on error with errno set.
+ */
+static int read_frame(transport_t *transport, uint8_t *decoded_data, float timeout){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
     ssize_t status;
-    uint16_t checksum;
-    int decoded_size;
+    int size;
     timeout_t timer;
     set_timeout(&timer, timeout);
 
-    status = discard_until(FRAME_START_CODE, timer);
+    status = discard_until(transport->mac, FRAME_START_CODE, timer);
     if(status < 0){
-        goto exit;
+        goto read_error;
     }
 
-    status = read_until(FRAME_END_CODE, sizeof(buffer), buffer, timer);
+    status = read_until(transport->mac, FRAME_END_CODE, ctx->buffer_size, ctx->buffer, timer);
     if(status < 0){
-        goto exit;
+        goto read_error;
     }
-    *size = (int) status;
+    size = (int) status;
+    frame_trace_record(FRAME_TRACE_RX, size, ctx->buffer);
+    transport->stats.bytes_received += (uint64_t) (FRAME_START_CODE_SIZE + size + FRAME_END_CODE_SIZE);
 
-    status = decode_frame_payload(*size, buffer, &decoded_size, data);
+    status = serial_frame_decode_payload(size, ctx->buffer, ctx->packet_size + FRAME_CHECK_SEQUENCE_SIZE, decoded_data);
     if(status < 0){
-        goto exit;
+        DEBUG("Serial Transport: Frame decoding failed: %s\n", strerror(errno));
+        transport->stats.integrity_errors += 1;
+        return -1;
+    }
+    if(status < FRAME_CHECK_SEQUENCE_SIZE){
+        DEBUG("Serial Transport: Frame is too short for a frame check sequence\n");
+        transport->stats.integrity_errors += 1;
+        errno = EINVAL;
+        return -1;
     }
-    *size = decoded_size;
-    uint16_t frame_checksum = *((uint16_t *) &data[*size - 2]);
     DEBUG("Got a frame: ");
-    log_frame(*size, data);
+    log_frame((int) status, decoded_data);
+    return (int) status;
+
+    read_error:
+        if(ETIMEDOUT == errno){
+            transport->stats.timeouts += 1;
+        }
+        return -1;
+}
+
+/**
+ * @brief Verifies the frame check sequence of a decoded frame.
+ *
+ * @param transport Transport instance.
+ * @param size Size of the MDFU packet without the frame check sequence.
+ * @param fcs Pointer to the frame check sequence that follows the MDFU packet.
+ * @param checksum Checksum calculated for the MDFU packet.
+ * @return int 0 on success, -1 on a mismatch.
+ */
+static int check_frame(transport_t *transport, int size, const uint8_t *fcs, uint16_t checksum){
+    uint16_t frame_checksum = (uint16_t) (fcs[0] | (fcs[1] << 8));
 
-    checksum = calculate_crc16(*size - 2, data);
     if(checksum != frame_checksum){
         DEBUG("Serial Transport: Frame check sequence verification failed, calculated 0x%04x but got 0x%04x\n", checksum, frame_checksum);
-        status = -1;
-        goto exit;
+        transport->stats.integrity_errors += 1;
+        return -1;
+    }
+    transport->stats.frames_received += 1;
+    transport->stats.payload_bytes_received += (uint64_t) size;
+    return 0;
+}
+
+static int read(transport_t *transport, int *size, uint8_t *data, float timeout){
+    int decoded_size = read_frame(transport, data, timeout);
+
+    if(decoded_size < 0){
+        return -1;
+    }
+    *size = decoded_size - FRAME_CHECK_SEQUENCE_SIZE;
+    return check_frame(transport, *size, &data[*size], calculate_crc16(*size, data));
+}
+
+/**
+ * @brief Reads a MDFU packet into multiple buffers.
+ *
+ * The frame is decoded in place in the frame buffer and the MDFU packet is
+ * copied from there to the buffers while its checksum is calculated.
+ *
+ * @param transport Transport instance.
+ * @param size Pointer where the size of the MDFU packet is stored.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the MDFU packet is stored in order.
+ * @param timeout The maximum time to wait for the frame, in seconds.
+ * @return int 0 on success, -1 on error.
+ */
+static int readv(transport_t *transport, int *size, int count, const transport_iovec_t *iov, float timeout){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
+    int decoded_size = read_frame(transport, ctx->buffer, timeout);
+    uint16_t checksum;
+
+    if(decoded_size < 0){
+        return -1;
+    }
+    *size = decoded_size - FRAME_CHECK_SEQUENCE_SIZE;
+    if(transport_iovec_scatter(*size, ctx->buffer, count, iov, &checksum) < 0){
+        DEBUG("Serial Transport: MDFU packet (%d) exceeds the receive buffers\n", *size);
+        return -1;
+    }
+    return check_frame(transport, *size, &ctx->buffer[*size], checksum);
+}
+
+/**
+ * @brief Sends the encoded frame in the frame buffer.
+ *
+ * @param transport Transport instance.
+ * @param size Size of the MDFU packet in the frame.
+ * @param frame_size Size of the encoded frame.
+ *
+ * @return Status of the MAC write.
+ */
+static int send_frame(transport_t *transport, int size, int frame_size){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
+    int status;
+
+    frame_trace_record(FRAME_TRACE_TX, frame_size, ctx->buffer);
+    status = transport->mac->write(transport->mac, frame_size, ctx->buffer);
+
+    if(status >= 0){
+        transport->stats.frames_sent += 1;
+        transport->stats.bytes_sent += (uint64_t) frame_size;
+        transport->stats.payload_bytes_sent += (uint64_t) size;
     }
-    *size -= 2; // remove checksum size to get payload size
-    exit:
-        return (int) status;
+    return status;
 }
 
+#ifndef _WIN32
+/**
+ * @brief Sends a MDFU packet with a frame from the frame cache.
+ *
+ * The cached image chunk is sent straight from the cache file mapping with a
+ * scatter/gather MAC write, or copied into the frame buffer when the MAC
+ * cannot write multiple buffers.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ * @param size Size of the MDFU packet.
+ *
+ * @return Status of the MAC write, or -1 with errno set to ENOENT if the
+ *         packet is not in the cache.
+ */
+static int send_cached_frame(transport_t *transport, int count, const mac_iovec_t *iov, int size){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
+    serial_frame_cache_frame_t frame;
+    uint16_t frame_check_sequence;
+    int frame_size;
+    int status;
+    int offset = 0;
+
+    frame_size = serial_frame_cache_encodev(ctx->frame_cache, count, iov, &frame, &frame_check_sequence);
+    if(frame_size < 0){
+        return -1;
+    }
+    if(NULL == transport->mac->writev){
+        for(int i = 0; i < 3; i++){
+            memcpy(&ctx->buffer[offset], frame.iov[i].data, (size_t) frame.iov[i].size);
+            offset += frame.iov[i].size;
+        }
+        return send_frame(transport, size, frame_size);
+    }
+    frame_trace_recordv(FRAME_TRACE_TX, 3, frame.iov);
+    status = transport->mac->writev(transport->mac, 3, frame.iov);
+    if(status >= 0){
+        transport->stats.frames_sent += 1;
+        transport->stats.bytes_sent += (uint64_t) frame_size;
+        transport->stats.payload_bytes_sent += (uint64_t) size;
+    }
+    return status;
+}
+#endif
+
 /**
  * @brief Writes a MDFU packet to a serial transport.
  *
- * This function writes a MDFU packet to a serial transport. It calculates the checksum for the
- * frame, sends the frame start code, encodes and sends the MDFU packet, sends the checksum, and
- * finally sends the frame end code.
+ * This function writes a MDFU packet to a serial transport. It encodes the frame start code,
+ * the MDFU packet, the checksum and the frame end code into the frame buffer, which is then
+ * sent with a single MAC write.
  *
+ * @param transport Transport instance.
  * @param size The size of the MDFU packet to be sent.
  * @param data Pointer to the buffer containing the MDFU packet to be sent.
  *
  * @return 0 on success, negative value on error with errno set appropriately.
  */
-static int write(int size, uint8_t *data){
-    int encoded_data_size = 0;
-    int buf_index = 0;
+static int write(transport_t *transport, int size, uint8_t *data){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
+    uint8_t *buffer = ctx->buffer;
+    int frame_size;
 
-    buffer[buf_index] = FRAME_START_CODE;
-    buf_index += 1;
+    uint16_t frame_check_sequence;
 
-    uint16_t frame_check_sequence = calculate_crc16(size, data);
-    encode_frame_payload(size, data, &buffer[buf_index], &encoded_data_size);
-    buf_index += encoded_data_size;
-    encode_frame_payload(2, (uint8_t *) &frame_check_sequence, &buffer[buf_index], &encoded_data_size);
-    buf_index += encoded_data_size;
+    frame_size = serial_frame_encode(size, data, buffer, &frame_check_sequence);
+    DEBUG("Sending frame: ");
+    log_frame(frame_size - 2, &buffer[1]);
+    return send_frame(transport, size, frame_size);
+}
 
-    buffer[buf_index] = FRAME_END_CODE;
-    buf_index += 1;
+/**
+ * @brief Writes a MDFU packet that is split over multiple buffers to a serial transport.
+ *
+ * The buffers are encoded directly into the frame buffer, so the MDFU packet does
+ * not need to be assembled first.
+ *
+ * @param transport Transport instance.
+ * @param count Number of buffers.
+ * @param iov Buffers that make up the MDFU packet.
+ *
+ * @return 0 on success, negative value on error with errno set appropriately.
+ */
+static int writev(transport_t *transport, int count, const mac_iovec_t *iov){
+    struct serial_transport_buffered_ctx *ctx = transport->ctx;
+    uint8_t *buffer = ctx->buffer;
+    int frame_size;
+    int size = mac_iovec_size(count, iov);
+
+    uint16_t frame_check_sequence;
+
+    if(size < 0){
+        return -1;
+    }
+    if(size > ctx->packet_size){
+        errno = EOVERFLOW;
+        return -1;
+    }
+#ifndef _WIN32
+    if(NULL != ctx->frame_cache){
+        int status = send_cached_frame(transport, count, iov, size);
+
+        if(status >= 0 || ENOENT != errno){
+            return status;
+        }
+    }
+#endif
+    frame_size = serial_frame_encodev(count, iov, buffer, &frame_check_sequence);
     DEBUG("Sending frame: ");
-    log_frame(buf_index - 2, &buffer[1]);
-    return transport_mac.write(buf_index, buffer);
+    log_frame(frame_size - 2, &buffer[1]);
+    return send_frame(transport, size, frame_size);
 }
 
-transport_t serial_transport_buffered ={
+/**
+ * @brief Sets the size of the largest MDFU packet and resizes the frame buffer for it.
+ *
+ * @param transport Transport instance.
+ * @param packet_size MDFU packet size in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int set_packet_size(transport_t *transport, int packet_size){
+    struct serial_transport_buffered_ctx *ctx;
+    int buffer_size = SERIAL_FRAME_MAX_SIZE(packet_size);
+
+    if(packet_size <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(transport_resize_ctx(transport, sizeof(struct serial_transport_buffered_ctx) + (size_t) buffer_size) < 0){
+        return -1;
+    }
+    ctx = transport->ctx;
+    ctx->packet_size = packet_size;
+    ctx->buffer_size = buffer_size;
+    return 0;
+}
+
+/**
+ * @brief Handle ioctl requests for transport settings.
+ *
+ * This function processes ioctl requests to configure or query the transport.
+ * It currently supports the following requests:
+ * - TRANSPORT_IOC_INTER_TRANSACTION_DELAY: Accepted but ignored since the serial
+ *   transport does not use an inter transaction delay.
+ * - TRANSPORT_IOC_PIPELINING: Reports that multiple commands can be in flight
+ *   since the client responses are received as a stream of frames.
+ * - TRANSPORT_IOC_GET_FD: Reports the file descriptor of the MAC, if the MAC
+ *   has one.
+ * - TRANSPORT_IOC_HAS_DATA: Reports if received data is buffered in the
+ *   MAC.
+ * - TRANSPORT_IOC_PACKET_SIZE: Resizes the frame buffer for a MDFU packet size.
+ * - TRANSPORT_IOC_FRAME_CACHE: Sets the cache that frames for image chunks are
+ *   taken from.
+ *
+ * @param transport Transport instance.
+ * @param request The ioctl request code.
+ * @param ... Additional arguments depending on the request code.
+ * @return 0 on success, -1 on failure.
+ */
+static int ioctl(transport_t *transport, int request, ...){
+    va_list args;
+    va_start(args, request);
+    int result = -1;
+    if(TRANSPORT_IOC_INTER_TRANSACTION_DELAY == request){
+        result = 0;
+    }else if(TRANSPORT_IOC_PIPELINING == request){
+        bool *pipelining = va_arg(args, bool *);
+        *pipelining = true;
+        result = 0;
+    }else if(TRANSPORT_IOC_GET_FD == request){
+        int *fd = va_arg(args, int *);
+        *fd = transport->mac->get_fd ? transport->mac->get_fd(transport->mac) : -1;
+        result = *fd < 0 ? -1 : 0;
+    }else if(TRANSPORT_IOC_HAS_DATA == request){
+        bool *has_data = va_arg(args, bool *);
+        *has_data = NULL != transport->mac->has_data && transport->mac->has_data(transport->mac);
+        result = 0;
+    }else if(TRANSPORT_IOC_PACKET_SIZE == request){
+        result = set_packet_size(transport, va_arg(args, int));
+#ifndef _WIN32
+    }else if(TRANSPORT_IOC_FRAME_CACHE == request){
+        ((struct serial_transport_buffered_ctx *) transport->ctx)->frame_cache = va_arg(args, serial_frame_cache_t *);
+        result = 0;
+#endif
+    }
+    va_end(args);
+    return result;
+}
+
+static const transport_t serial_transport_buffered ={
     .close = close,
     .open = open,
     .read = read,
+    .readv = readv,
     .write = write,
+    .writev = writev,
     .init = init,
-    .ioctl = NULL
+    .ioctl = ioctl
 };
 
+/**
+ * @brief Create a new buffered serial transport instance.
+ *
+ * The frame buffer is sized for MDFU_PACKET_DEFAULT_SIZE until a larger
+ * packet size is set with TRANSPORT_IOC_PACKET_SIZE.
+ *
+ * @param transport Pointer where the new transport instance is stored.
+ * @return int 0 on success, -1 on error.
+ */
 int get_serial_transport_buffered(transport_t **transport){
-    *transport = &serial_transport_buffered;
+    if(transport_alloc(&serial_transport_buffered, sizeof(struct serial_transport_buffered_ctx), transport) < 0){
+        return -1;
+    }
+    if(set_packet_size(*transport, MDFU_PACKET_DEFAULT_SIZE) < 0){
+        transport_free(*transport);
+        return -1;
+    }
     return 0;
 }
@@ -5,7 +5,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdarg.h>
@@ -15,6 +14,8 @@
 #include "mdfu/mdfu_config.h"
 #include "mdfu/mdfu.h"
 #include "mdfu/checksum.h"
+#include "mdfu/transport/poll_policy.h"
+#include "mdfu/transport/frame_trace.h"
 
 /**
  * @brief MDFU SPI transport frame prefix to indicate a response length frame.
@@ -26,6 +27,8 @@ static const char frame_length_prefix[] = {'L', 'E', 'N'};
  */
 static const char frame_response_prefix[] = {'R', 'S', 'P'};
 
+int spi_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size);
+
 /**
  * This section defines various constants used for parsing client responses.
  *
@@ -58,78 +61,113 @@ static const char frame_response_prefix[] = {'R', 'S', 'P'};
 #define FRAME_CHECKSUM_SIZE 2
 
 /**
- * @brief Defines the maximum size of the frame buffer.
+ * @brief Defines the size of the frame buffer for a MDFU packet size.
  *
- * The frame buffer size is calculated as the sum of the frame type size,
- * the maximum size of the MDFU command packet, and the frame checksum size.
+ * The frame buffer size is calculated as the sum of the response frame prefix
+ * size, which is larger than the command frame type, the MDFU packet size,
+ * and the frame checksum size.
  */
-#define FRAME_BUFFER_MAX_SIZE (FRAME_TYPE_SIZE + MDFU_CMD_PACKET_MAX_SIZE + FRAME_CHECKSUM_SIZE)
+#define FRAME_BUFFER_SIZE(packet_size) (CLIENT_RSP_PREFIX_SIZE + (packet_size) + FRAME_CHECKSUM_SIZE)
 
-/** 
- * @brief MAC layer interface used for transport layer communication.
- * 
- * This variable holds the MAC layer interface.
+/**
+ * @brief Size of a response length retrieval frame.
  */
-static mac_t *transport_mac = NULL;
+#define LENGTH_FRAME_SIZE (CLIENT_RSP_PREFIX_SIZE + CLIENT_RSP_LEN_LENGTH_SIZE + FRAME_CHECKSUM_SIZE)
 
 /**
- * @brief SPI transport inter transaction delay timer.
+ * @brief Longest inter transaction delay in seconds that can be inserted between
+ * the segments of a batched MAC transfer.
  */
-static timeout_t itd_timer;
+#define BATCH_ITD_MAX (UINT16_MAX * 1e-6f)
 
 /**
- * @brief Inter transaction delay in seconds.
- */
-static float itd_delay = 0.01f;
-
-/** 
- * @brief Buffer for storing SPI transport frames.
- * 
- * This buffer is used to store the frames that are constructed or received
- * by the transport layer. The size of the buffer is calculated based on the
- * maximum expected size of the frames, including frame type field,
- * maximum MDFU command packet length, and frame check sequence.
+ * @brief SPI transport instance state.
  */
-static uint8_t buffer[FRAME_BUFFER_MAX_SIZE];
+struct spi_transport_ctx {
+    /**
+     * @brief Inter transaction delay timer.
+     */
+    timeout_t itd_timer;
+    /**
+     * @brief Inter transaction delay in seconds.
+     */
+    float itd_delay;
+    /**
+     * @brief Buffer for response length retrieval frames.
+     */
+    uint8_t length_buffer[LENGTH_FRAME_SIZE];
+    /**
+     * @brief The first response length retrieval was already done together with the
+     * command and its result is in length_buffer.
+     */
+    bool length_pending;
+    /**
+     * @brief Response polling state.
+     */
+    poll_policy_t poll;
+    /**
+     * @brief Size of the largest MDFU packet that is sent or received.
+     */
+    int packet_size;
+    /**
+     * @brief Size of the frame buffer in bytes.
+     */
+    int buffer_size;
+    /**
+     * @brief Buffer for storing SPI transport frames.
+     *
+     * This buffer is used to store the frames that are constructed or received
+     * by the transport layer. The size of the buffer is calculated based on the
+     * maximum expected size of the frames, including the response frame prefix,
+     * a MDFU packet of packet_size, and frame check sequence.
+     */
+    uint8_t buffer[];
+};
 
 /**
  * @brief Initializes the transport layer.
  *
- * This function copies the MAC function pointers from the provided mac object
- * into the global transport_mac structure and sets the transport timeout.
+ * This function stores the MAC instance that the transport uses for
+ * communication. The transport takes ownership of the MAC.
  *
- * @param mac Pointer to a mac_t structure that contains the MAC layer function pointers.
+ * @param transport Transport instance.
+ * @param mac Pointer to the MAC layer instance.
  * @param timeout The default timeout value to be used for transport layer operations.
  * @return Always returns 0 to indicate success.
  */
-static int init(mac_t *mac, int timeout){ // NOSONAR
-    transport_mac = mac;
-    set_timeout(&itd_timer, 0);
+static int init(transport_t *transport, mac_t *mac, int timeout){ // NOSONAR
+    struct spi_transport_ctx *ctx = transport->ctx;
+    transport->mac = mac;
+    set_timeout(&ctx->itd_timer, 0);
     return 0;
 }
 
 /**
  * @brief Opens the transport layer.
  *
- * This function calls the open method on the transport_mac object, which is responsible
+ * This function calls the open method on the transport MAC, which is responsible
  * for establishing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int open(void){
-    return transport_mac->open();
+static int open(transport_t *transport){
+    struct spi_transport_ctx *ctx = transport->ctx;
+    ctx->length_pending = false;
+    return MAC_OPS(transport->mac)->open(transport->mac);
 }
 
 /**
  * @brief Closes the transport layer.
  *
- * This function calls the close method on the transport_mac object, which is responsible
+ * This function calls the close method on the transport MAC, which is responsible
  * for closing the transport layer connection.
  *
+ * @param transport Transport instance.
  * @return int Returns 0 on success, or a non-zero error code on failure.
  */
-static int close(void){
-    return transport_mac->close();
+static int close(transport_t *transport){
+    return MAC_OPS(transport->mac)->close(transport->mac);
 }
 
 
@@ -164,27 +202,28 @@ static void log_frame(int size, const uint8_t *data){
  * @param data Pointer to the MDFU packet to be included in the frame.
  * @param frame_size Pointer to an integer where the size of the created frame will be stored.
  * @param frame Pointer to the buffer where the created frame will be stored.
+ * @param frame_max_size Size of the frame buffer.
  * @return 0 on success, -1 on error with errno set appropriately.
  *
  * This function constructs a command frame by adding a frame type, copying the data,
  * and appending a CRC16 checksum. If the size of the data exceeds the buffer capacity,
  * it sets errno to EOVERFLOW and returns -1.
+ *
+ * Not static so that mdfu_microbench can measure it.
  */
-static int create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame){
+int spi_create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *frame, int frame_max_size){
     int buf_index = 0;
     uint16_t frame_check_sequence;
 
-    if(size > (sizeof(buffer) - FRAME_CHECKSUM_SIZE - FRAME_TYPE_SIZE)){
+    if(size > (frame_max_size - FRAME_CHECKSUM_SIZE - FRAME_TYPE_SIZE)){
         errno = EOVERFLOW;
         return -1;
     }
 
     frame[buf_index++] = FRAME_TYPE_CMD;
 
-    for(int i = 0;i < size; i++){
-        frame[buf_index++] = data[i];
-    }
-    frame_check_sequence = calculate_crc16(size, data);
+    frame_check_sequence = calculate_crc16_copy(size, data, &frame[buf_index]);
+    buf_index += size;
     frame[buf_index++] = (uint8_t) (frame_check_sequence & 0xff);
     frame[buf_index++] = (uint8_t) ((frame_check_sequence >> 8) & 0xff);
     *frame_size = buf_index;
@@ -203,14 +242,15 @@ static int create_cmd_frame(int size, uint8_t *data, int *frame_size, uint8_t *f
  * @param response_length The length of the response, including the 2-byte CRC.
  * @param frame_size Pointer to an integer where the size of the created frame will be stored.
  * @param frame Pointer to the buffer where the frame will be created.
+ * @param frame_max_size Size of the frame buffer.
  * @return 0 on success, -1 on failure with errno set to EOVERFLOW.
  */
-static int create_rsp_frame(int response_length, int *frame_size, uint8_t *frame){
+static int create_rsp_frame(int response_length, int *frame_size, uint8_t *frame, int frame_max_size){
     int buf_index = 0;
 
     // Ensure the buffer can hold a full response
     // The response length includes the 2-bytes CRC
-    if((CLIENT_RSP_PREFIX_SIZE + response_length) > sizeof(buffer)){
+    if((CLIENT_RSP_PREFIX_SIZE + response_length) > frame_max_size){
         errno = EOVERFLOW;
         ERROR("SPI transport buffer to small to fit command");
         return -1;
@@ -237,32 +277,39 @@ static int create_rsp_frame(int response_length, int *frame_size, uint8_t *frame
  * read size does not match the write size, it returns an error. Otherwise, it logs the received
  * frame and returns success.
  *
+ * @param transport Transport instance.
  * @param size The size of the data frame to be transferred.
+ * @param buffer Frame to send, which is replaced with the received frame.
  * @return 0 on success, -1 on failure.
  */
-static int spi_transfer(int size){
+static int spi_transfer(transport_t *transport, int size, uint8_t *buffer){
+    struct spi_transport_ctx *ctx = transport->ctx;
     int read_size;
 
     // wait for inter transaction delay timeout to expire
-    while(!timeout_expired(&itd_timer)){/* do nothing  */}
+    timeout_wait(&ctx->itd_timer);
 
     TRACE(DEBUGLEVEL, "DEBUG:SPI transport sending frame: ");
     log_frame(size, buffer);
-    if(transport_mac->write(size, buffer) < 0){
-        set_timeout(&itd_timer, itd_delay);
+    frame_trace_record(FRAME_TRACE_TX, size, buffer);
+    if(MAC_OPS(transport->mac)->write(transport->mac, size, buffer) < 0){
+        set_timeout(&ctx->itd_timer, ctx->itd_delay);
         return -1;
     }
-    if(set_timeout(&itd_timer, itd_delay) < 0){
+    if(set_timeout(&ctx->itd_timer, ctx->itd_delay) < 0){
         return -1;
     }
     // No need to have a inter transaction timeout on read
     // because the write implicitely did already the read.
-    read_size = transport_mac->read(size, buffer);
+    read_size = MAC_OPS(transport->mac)->read(transport->mac, size, buffer);
     if(read_size < 0){
 
         return -1;
     }
 
+    transport->stats.bytes_sent += (uint64_t) size;
+    transport->stats.bytes_received += (uint64_t) read_size;
+    frame_trace_record(FRAME_TRACE_RX, read_size, buffer);
     TRACE(DEBUGLEVEL, "DEBUG:SPI transport received frame: ");
     log_frame(read_size, buffer);
     if(read_size != size){
@@ -272,23 +319,91 @@ static int spi_transfer(int size){
     return 0;
 }
 
+/**
+ * @brief Sends a command frame and the first response length retrieval in one MAC transfer.
+ *
+ * The delay before the first poll is inserted by the MAC between the two transactions, so
+ * the command and the first length poll only need a single system call. The received
+ * length frame is kept in the length buffer for the next read.
+ *
+ * @param transport Transport instance.
+ * @param size The size of the command frame in the frame buffer.
+ * @param delay Delay in seconds between the command and the length retrieval.
+ * @return 0 on success, -1 on failure.
+ */
+static int spi_transfer_cmd_and_length(transport_t *transport, int size, float delay){
+    struct spi_transport_ctx *ctx = transport->ctx;
+    int length_frame_size;
+    int status;
+
+    if(create_rsp_frame(CLIENT_RSP_LEN_LENGTH_SIZE + FRAME_CHECKSUM_SIZE, &length_frame_size, ctx->length_buffer, LENGTH_FRAME_SIZE) < 0){
+        return -1;
+    }
+    mac_segment_t segments[] = {
+        {.tx_data = ctx->buffer, .rx_data = ctx->buffer, .size = size,
+         .delay_us = (uint16_t) (delay * 1e6f)},
+        {.tx_data = ctx->length_buffer, .rx_data = ctx->length_buffer, .size = length_frame_size}
+    };
+
+    timeout_wait(&ctx->itd_timer);
+    TRACE(DEBUGLEVEL, "DEBUG:SPI transport sending frame: ");
+    log_frame(size, ctx->buffer);
+    frame_trace_record(FRAME_TRACE_TX, size, ctx->buffer);
+    frame_trace_record(FRAME_TRACE_TX, length_frame_size, ctx->length_buffer);
+    status = MAC_OPS(transport->mac)->transfer(transport->mac, 2, segments);
+    if(set_timeout(&ctx->itd_timer, ctx->itd_delay) < 0 || status < 0){
+        return -1;
+    }
+    transport->stats.bytes_sent += (uint64_t) (size + length_frame_size);
+    transport->stats.bytes_received += (uint64_t) (size + length_frame_size);
+    frame_trace_record(FRAME_TRACE_RX, size, ctx->buffer);
+    frame_trace_record(FRAME_TRACE_RX, length_frame_size, ctx->length_buffer);
+    TRACE(DEBUGLEVEL, "DEBUG:SPI transport received frame: ");
+    log_frame(length_frame_size, ctx->length_buffer);
+    ctx->length_pending = true;
+    return 0;
+}
+
 /**
  * @brief Sends a MDFU packet over SPI transport.
  *
  * This function creates a SPI transport command frame from the provided data and size,
  * and then transfers the frame over SPI.
  *
+ * @param transport Transport instance.
  * @param size The size of the MDFU packet to be written.
  * @param data A pointer to the MDFU packet to be written.
  * @return int Returns -1 if creating the command frame fails, otherwise returns the result of spi_transfer.
  */
-static int write(int size, uint8_t *data){
+static int write(transport_t *transport, int size, uint8_t *data){
+    struct spi_transport_ctx *ctx = transport->ctx;
     int frame_size = 0;
+    float first_poll_delay;
     
-    if(create_cmd_frame(size, data, &frame_size, buffer) < 0){
+    ctx->length_pending = false;
+    if(spi_create_cmd_frame(size, data, &frame_size, ctx->buffer, ctx->buffer_size) < 0){
         return -1;
     }
-    return spi_transfer(frame_size);
+    first_poll_delay = poll_policy_command_sent(&ctx->poll, data, ctx->itd_delay);
+    if(NULL != transport->mac->wait_ready){
+        // The client signals when the response is ready, it is not polled before
+        first_poll_delay = ctx->itd_delay;
+    }
+    if(NULL != MAC_OPS(transport->mac)->transfer && NULL == transport->mac->wait_ready && first_poll_delay <= BATCH_ITD_MAX){
+        if(spi_transfer_cmd_and_length(transport, frame_size, first_poll_delay) < 0){
+            return -1;
+        }
+    } else {
+        if(spi_transfer(transport, frame_size, ctx->buffer) < 0){
+            return -1;
+        }
+        if(set_timeout(&ctx->itd_timer, first_poll_delay) < 0){
+            return -1;
+        }
+    }
+    transport->stats.frames_sent += 1;
+    transport->stats.payload_bytes_sent += (uint64_t) size;
+    return 0;
 }
 
 /**
@@ -300,42 +415,59 @@ static int write(int size, uint8_t *data){
  * there is a checksum mismatch, an error is logged and the function returns -1.
  * If the timeout expires during polling, the function also returns -1.
  *
+ * @param transport Transport instance.
  * @param timer A pointer to a timeout_t structure that specifies the timeout period.
  * @return The length of the client response if successful, or -1 if an error occurs.
  */
-static ssize_t poll_for_client_response_length(timeout_t *timer){
+static ssize_t poll_for_client_response_length(transport_t *transport, timeout_t *timer){
+    struct spi_transport_ctx *ctx = transport->ctx;
     int frame_size;
     int response_length = -1;
 
     // Poll for a client response
     while(true){
-        if(create_rsp_frame(CLIENT_RSP_LEN_LENGTH_SIZE + FRAME_CHECKSUM_SIZE, &frame_size, buffer) < 0){
-            return -1;
-        }
-        if(spi_transfer(frame_size) < 0){
-            return -1;
+        transport->stats.polls += 1;
+        if(ctx->length_pending){
+            // Length was already retrieved together with the command
+            ctx->length_pending = false;
+        } else {
+            if(create_rsp_frame(CLIENT_RSP_LEN_LENGTH_SIZE + FRAME_CHECKSUM_SIZE, &frame_size, ctx->length_buffer, LENGTH_FRAME_SIZE) < 0){
+                return -1;
+            }
+            if(spi_transfer(transport, frame_size, ctx->length_buffer) < 0){
+                return -1;
+            }
         }
 
-        if(frame_length_prefix[0] == buffer[1] &&
-            frame_length_prefix[1] == buffer[2] &&
-            frame_length_prefix[2] == buffer[3]){
+        if(frame_length_prefix[0] == ctx->length_buffer[1] &&
+            frame_length_prefix[1] == ctx->length_buffer[2] &&
+            frame_length_prefix[2] == ctx->length_buffer[3]){
 
-            response_length = *((uint16_t *) &buffer[CLIENT_RSP_LEN_LENGTH_START]);
+            response_length = ctx->length_buffer[CLIENT_RSP_LEN_LENGTH_START] | (ctx->length_buffer[CLIENT_RSP_LEN_LENGTH_START + 1] << 8);
             if(response_length < 2){
                 ERROR("SPI transport response length must be at lest 2 bytes but client reported %d", response_length);
+                transport->stats.integrity_errors += 1;
                 return -1;
             }
-            uint16_t checksum = *((uint16_t *) &buffer[CLIENT_RSP_LEN_CHECKSUM_START]);
-            uint16_t calc_checksum = calculate_crc16(CLIENT_RSP_LEN_LENGTH_SIZE, &buffer[CLIENT_RSP_LEN_LENGTH_START]);
+            uint16_t checksum = (uint16_t) (ctx->length_buffer[CLIENT_RSP_LEN_CHECKSUM_START] | (ctx->length_buffer[CLIENT_RSP_LEN_CHECKSUM_START + 1] << 8));
+            uint16_t calc_checksum = calculate_crc16(CLIENT_RSP_LEN_LENGTH_SIZE, &ctx->length_buffer[CLIENT_RSP_LEN_LENGTH_START]);
             if(checksum != calc_checksum){
                 ERROR("SPI transport frame checksum mismatch");
+                transport->stats.integrity_errors += 1;
                 return -1;
             }
+            poll_policy_response_received(&ctx->poll);
             break;
         }
         DEBUG("Received client busy frame");
-        if(timeout_expired(timer)){
+        transport->stats.busy_polls += 1;
+        if(timeout_expired_coarse(timer)){
             DEBUG("Timeout during polling for response length");
+            transport->stats.timeouts += 1;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(set_timeout(&ctx->itd_timer, poll_policy_busy(&ctx->poll, ctx->itd_delay)) < 0){
             return -1;
         }
     }
@@ -347,51 +479,65 @@ static ssize_t poll_for_client_response_length(timeout_t *timer){
  *
  * This function continuously polls for a client response by transferring data over SPI.
  * It verifies the response frame's prefix, size, and checksum to ensure data integrity.
- * If the response is valid, it copies the response payload to the provided data buffer.
+ * If the response is valid, it copies the response payload to the provided buffers.
  * The function returns 0 on success and -1 on failure.
  *
+ * @param transport Transport instance.
  * @param timer Pointer to a timeout structure that defines the polling timeout period.
  * @param response_length Expected length of the response frame.
- * @param data Pointer to a buffer where the response payload will be copied.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the response payload will be copied to in order.
  * @return 0 on success, -1 on failure.
  */
-static int poll_for_client_response(timeout_t *timer, int response_length, uint8_t *data){
+static int poll_for_client_response(transport_t *transport, timeout_t *timer, int response_length, int count, const transport_iovec_t *iov){
+    struct spi_transport_ctx *ctx = transport->ctx;
     int frame_size;
 
-    if(create_rsp_frame(response_length, &frame_size, buffer) < 0){
-        return -1;
-    }
     while(true){
-
-        if(spi_transfer(frame_size) < 0){
+        transport->stats.polls += 1;
+        // The transfer replaces the frame with the received data so it is created for each poll
+        if(create_rsp_frame(response_length, &frame_size, ctx->buffer, ctx->buffer_size) < 0){
+            return -1;
+        }
+        if(spi_transfer(transport, frame_size, ctx->buffer) < 0){
             return -1;
         }
 
-        if(frame_response_prefix[0] == buffer[1] &&
-            frame_response_prefix[1] == buffer[2] &&
-            frame_response_prefix[2] == buffer[3]){
+        if(frame_response_prefix[0] == ctx->buffer[1] &&
+            frame_response_prefix[1] == ctx->buffer[2] &&
+            frame_response_prefix[2] == ctx->buffer[3]){
 
             if (frame_size < 2) {
                 ERROR("SPI transport frame size is too small");
                 return -1;
             }
-            uint16_t checksum = *((uint16_t *) &buffer[frame_size - 2]);
+            uint16_t checksum = (uint16_t) (ctx->buffer[frame_size - 2] | (ctx->buffer[frame_size - 1] << 8));
             int response_payload_size = frame_size - FRAME_CHECKSUM_SIZE - CLIENT_RSP_PREFIX_SIZE;
-            if(response_payload_size > MDFU_RESPONSE_PACKET_MAX_SIZE){
-                ERROR("SPI transport response length (%d) exceeds maximum MDFU response packet size (%d)", response_payload_size, MDFU_CMD_PACKET_MAX_SIZE);
+            if(response_payload_size > ctx->packet_size){
+                ERROR("SPI transport response length (%d) exceeds maximum MDFU response packet size (%d)", response_payload_size, ctx->packet_size);
+                return -1;
+            }
+            // Copy the payload while calculating its checksum, the data is discarded on a mismatch
+            uint16_t calc_checksum;
+            if(transport_iovec_scatter(response_payload_size, &ctx->buffer[CLIENT_RSP_RSP_PAYLOAD_START], count, iov, &calc_checksum) < 0){
+                ERROR("SPI transport response length (%d) exceeds the receive buffers", response_payload_size);
                 return -1;
             }
-            uint16_t calc_checksum = calculate_crc16(response_payload_size, &buffer[CLIENT_RSP_RSP_PAYLOAD_START]);
             if(checksum != calc_checksum){
                 ERROR("SPI transport frame checksum mismatch");
+                transport->stats.integrity_errors += 1;
                 return -1;
             }
-            memcpy(data, &buffer[CLIENT_RSP_RSP_PAYLOAD_START], response_payload_size);
+            transport->stats.frames_received += 1;
+            transport->stats.payload_bytes_received += (uint64_t) response_payload_size;
             break;
         }
         DEBUG("Received client busy frame");
-        if(timeout_expired(timer)){
+        transport->stats.busy_polls += 1;
+        if(timeout_expired_coarse(timer)){
             DEBUG("Timeout during polling for response length");
+            transport->stats.timeouts += 1;
+            errno = ETIMEDOUT;
             return -1;
         }
     }
@@ -399,55 +545,138 @@ static int poll_for_client_response(timeout_t *timer, int response_length, uint8
 }
 
 /**
- * @brief Reads a MDFU response from client with a specified timeout.
+ * @brief Waits for the client to signal a ready response when the MAC has a ready signal.
+ *
+ * The response is then read without polling the client while it is busy.
+ * Without a ready signal the function returns immediately and the client is
+ * polled.
+ *
+ * @param transport Transport instance.
+ * @param timer Timeout for the response.
+ * @return int 0 when the response can be read, -1 on error or timeout with errno set.
+ */
+static int wait_for_client_ready(transport_t *transport, timeout_t *timer){
+    int status;
+
+    if(NULL == transport->mac->wait_ready){
+        return 0;
+    }
+    DEBUG("Waiting for client ready signal");
+    status = transport->mac->wait_ready(transport->mac, timer);
+    if(0 == status){
+        DEBUG("Timeout while waiting for client ready signal");
+        transport->stats.timeouts += 1;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Reads a MDFU response from client into multiple buffers with a specified timeout.
  *
  * This function initiates a polling process to read the response length from a client
- * and then reads the actual response if the length is valid. The size of the
- * response data is returned through the size parameter.
+ * and then reads the actual response if the length is valid. The response is copied
+ * from the frame buffer to the buffers in order and the size of the response data is
+ * returned through the size parameter.
  *
+ * @param transport Transport instance.
  * @param size Pointer to an integer where the size of the response will be stored.
- * @param data Pointer to a buffer where the response will be stored.
+ * @param count Number of buffers in iov.
+ * @param iov Buffers where the response will be stored.
  * @param timeout The maximum time to wait for the client response, in seconds.
  *
  * @return 0 on success, -1 on failure (e.g., if the response length is less than 2 or
  *         if polling for the client response fails).
  */
-static int read(int *size, uint8_t *data, float timeout){
+static int readv(transport_t *transport, int *size, int count, const transport_iovec_t *iov, float timeout){
     timeout_t timer;
     ssize_t response_length;
 
-    DEBUG("Starting client response length polling");
     set_timeout(&timer, timeout);
-    response_length = poll_for_client_response_length(&timer);
+    if(wait_for_client_ready(transport, &timer) < 0){
+        return -1;
+    }
+    DEBUG("Starting client response length polling");
+    response_length = poll_for_client_response_length(transport, &timer);
     if(response_length < 2){
         return -1;
     }
     DEBUG("Starting client response polling");
-    if(poll_for_client_response(&timer, (int) response_length, data) < 0){
+    if(poll_for_client_response(transport, &timer, (int) response_length, count, iov) < 0){
         return -1;
     }
     *size = (int) response_length - FRAME_CHECKSUM_SIZE;
     return 0;
 }
 
+/**
+ * @brief Reads a MDFU response from client with a specified timeout.
+ *
+ * @param transport Transport instance.
+ * @param size Pointer to an integer where the size of the response will be stored.
+ * @param data Pointer to a buffer where the response will be stored.
+ * @param timeout The maximum time to wait for the client response, in seconds.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int read(transport_t *transport, int *size, uint8_t *data, float timeout){
+    struct spi_transport_ctx *ctx = transport->ctx;
+    transport_iovec_t iov = {.data = data, .size = ctx->packet_size};
+
+    return readv(transport, size, 1, &iov, timeout);
+}
+
+/**
+ * @brief Sets the size of the largest MDFU packet and resizes the frame buffer for it.
+ *
+ * @param transport Transport instance.
+ * @param packet_size MDFU packet size in bytes.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int set_packet_size(transport_t *transport, int packet_size){
+    struct spi_transport_ctx *ctx;
+
+    if(packet_size <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(transport_resize_ctx(transport, sizeof(struct spi_transport_ctx) + FRAME_BUFFER_SIZE((size_t) packet_size)) < 0){
+        return -1;
+    }
+    ctx = transport->ctx;
+    ctx->packet_size = packet_size;
+    ctx->buffer_size = FRAME_BUFFER_SIZE(packet_size);
+    return 0;
+}
+
 /**
  * @brief Handle ioctl requests for transport settings.
  *
  * This function processes various ioctl requests to configure transport settings.
- * It currently supports the following request:
+ * It currently supports the following requests:
  * - TRANSPORT_IOC_INTER_TRANSACTION_DELAY: Sets the inter-transaction delay.
+ * - TRANSPORT_IOC_POLL_POLICY: Selects the response polling policy.
+ * - TRANSPORT_IOC_PACKET_SIZE: Resizes the frame buffer for a MDFU packet size.
  *
+ * @param transport Transport instance.
  * @param request The ioctl request code.
  * @param ... Additional arguments depending on the request code.
  * @return 0 on success, -1 on failure.
  */
-static int ioctl(int request, ...){
+static int ioctl(transport_t *transport, int request, ...){
+    struct spi_transport_ctx *ctx = transport->ctx;
     va_list args;
     va_start(args, request);
     int result = -1;
     if(TRANSPORT_IOC_INTER_TRANSACTION_DELAY == request){
-        itd_delay = (float) va_arg(args, double);
+        ctx->itd_delay = (float) va_arg(args, double);
         result = 0;
+    } else if(TRANSPORT_IOC_POLL_POLICY == request){
+        poll_policy_init(&ctx->poll, (poll_policy_type_t) va_arg(args, int));
+        result = 0;
+    } else if(TRANSPORT_IOC_PACKET_SIZE == request){
+        result = set_packet_size(transport, va_arg(args, int));
     }
     va_end(args);
     return result;
@@ -459,26 +688,35 @@ static int ioctl(int request, ...){
  * This structure contains function pointers for various SPI transport operations
  * such as open, close, read, write, init, and ioctl.
  */
-transport_t spi_transport ={
+const transport_t spi_transport ={
     .close = close,
     .open = open,
     .read = read,
+    .readv = readv,
     .write = write,
     .init = init,
     .ioctl = ioctl
 };
 
 /**
- * @brief Retrieves the SPI transport instance.
+ * @brief Create a new SPI transport instance.
  *
- * This function assigns the address of the SPI transport instance to the provided
- * transport pointer and returns 0 to indicate success.
+ * Allocates a transport instance with its own inter transaction delay timer
+ * and frame buffer. The frame buffer is sized for MDFU_PACKET_DEFAULT_SIZE
+ * until a larger packet size is set with TRANSPORT_IOC_PACKET_SIZE. The
+ * instance must be released with transport_free.
  *
- * @param[out] transport Pointer to a transport_t pointer that will be set to the address
- *                       of the SPI transport instance.
- * @return int Returns 0 to indicate success.
+ * @param[out] transport Pointer where the new transport instance is stored.
+ * @return int 0 on success, -1 on error with errno set.
  */
 int get_spi_transport(transport_t **transport){
-    *transport = &spi_transport;
+    if(transport_alloc(&spi_transport, sizeof(struct spi_transport_ctx), transport) < 0){
+        return -1;
+    }
+    if(set_packet_size(*transport, MDFU_PACKET_DEFAULT_SIZE) < 0){
+        transport_free(*transport);
+        return -1;
+    }
+    ((struct spi_transport_ctx *)(*transport)->ctx)->itd_delay = 0.01f;
     return 0;
 }
@@ -1,27 +1,146 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include "mdfu/transport/transport.h"
+#include "mdfu/checksum.h"
 #include "mdfu/transport/serial_transport.h"
 #include "mdfu/transport/spi_transport.h"
 #include "mdfu/transport/i2c_transport.h"
 
+#ifdef MDFU_STATIC_TRANSPORT
 int get_transport(transport_type_t type, transport_t **transport){
-    
+    // Only the transport of the single tool build is linked in
+    if(MDFU_STATIC_TRANSPORT_TYPE == type){
+        return MDFU_STATIC_TRANSPORT_GET(transport);
+    }
+    errno = EINVAL;
+    return -EINVAL;
+}
+#else
+int get_transport(transport_type_t type, transport_t **transport){
+
     switch(type){
         case SERIAL_TRANSPORT:
-            get_serial_transport(transport);
-            break;
+            return get_serial_transport(transport);
         case SERIAL_TRANSPORT_BUFFERED:
-            get_serial_transport_buffered(transport);
-            break;
+            return get_serial_transport_buffered(transport);
         case SPI_TRANSPORT:
-            get_spi_transport(transport);
-            break;
+            return get_spi_transport(transport);
         case I2C_TRANSPORT:
-            get_i2c_transport(transport);
-            break;
+            return get_i2c_transport(transport);
         default:
             errno = EINVAL;
             return -EINVAL;
     }
+}
+#endif
+
+/**
+ * @brief Allocate a new transport instance.
+ *
+ * Copies the operations from a transport implementation into a new instance
+ * and allocates zero initialized private state for it. No private state is
+ * allocated when ctx_size is zero. The statistics of the new instance are
+ * cleared.
+ *
+ * @param ops Transport implementation operations.
+ * @param ctx_size Size of the transport private state in bytes.
+ * @param transport Pointer where the new transport instance is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int transport_alloc(const transport_t *ops, size_t ctx_size, transport_t **transport){
+    transport_t *instance = malloc(sizeof(transport_t));
+
+    if(NULL == instance){
+        errno = ENOMEM;
+        return -1;
+    }
+    *instance = *ops;
+    instance->mac = NULL;
+    instance->ctx = NULL;
+    memset(&instance->stats, 0, sizeof(instance->stats));
+    if(ctx_size > 0){
+        instance->ctx = calloc(1, ctx_size);
+    }
+    if(ctx_size > 0 && NULL == instance->ctx){
+        free(instance);
+        errno = ENOMEM;
+        return -1;
+    }
+    *transport = instance;
+    return 0;
+}
+
+/**
+ * @brief Resize the private state of a transport instance.
+ *
+ * Used by transports that keep frame buffers at the end of their private
+ * state and size them for the MDFU packet size. The content is kept up to
+ * the smaller of the old and the new size, added space is not initialized.
+ *
+ * @param transport Transport instance.
+ * @param ctx_size New size of the transport private state in bytes.
+ * @return int 0 on success, -1 on error with errno set. The private state is
+ *         unchanged on error.
+ */
+int transport_resize_ctx(transport_t *transport, size_t ctx_size){
+    void *ctx = realloc(transport->ctx, ctx_size);
+
+    if(NULL == ctx){
+        errno = ENOMEM;
+        return -1;
+    }
+    transport->ctx = ctx;
+    return 0;
+}
+
+/**
+ * @brief Release a transport instance and the MAC that it owns.
+ *
+ * The transport must be closed before it is released.
+ *
+ * @param transport Transport instance, can be NULL.
+ */
+void transport_free(transport_t *transport){
+    if(NULL != transport){
+        mac_free(transport->mac);
+        free(transport->ctx);
+        free(transport);
+    }
+}
+
+/**
+ * @brief Copy a received MDFU packet into the buffers of a scatter read.
+ *
+ * The frame checksum of the packet is calculated while it is copied, so
+ * transports that check it after the copy only read the packet once.
+ *
+ * @param size Size of the MDFU packet in bytes.
+ * @param data Pointer to the MDFU packet.
+ * @param count Number of buffers.
+ * @param iov Buffers that the packet is copied to in order.
+ * @param checksum Pointer where the frame checksum of the packet is stored.
+ * @return int 0 on success, -1 with errno set to ENOBUFS if the packet does
+ *         not fit into the buffers.
+ */
+int transport_iovec_scatter(int size, const uint8_t *data, int count, const transport_iovec_t *iov, uint16_t *checksum){
+    checksum_t running;
+    int copied = 0;
+    int part;
+
+    checksum_init(&running);
+    for(int i = 0; i < count && copied < size; i++){
+        part = size - copied;
+        if(part > iov[i].size){
+            part = iov[i].size;
+        }
+        checksum_update_copy(&running, part, &data[copied], iov[i].data);
+        copied += part;
+    }
+    if(copied < size){
+        errno = ENOBUFS;
+        return -1;
+    }
+    *checksum = checksum_final(&running);
     return 0;
-}
\ No newline at end of file
+}
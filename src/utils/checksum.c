@@ -1,10 +1,24 @@
 #include "mdfu/checksum.h"
 
+/**
+ * @brief Fold the even and odd byte lane sums into a frame checksum.
+ *
+ * @param even Sum of the bytes at even offsets (low byte of the 16-bit words).
+ * @param odd Sum of the bytes at odd offsets (high byte of the 16-bit words).
+ * @return uint16_t Inverted 16-bit checksum.
+ */
+static inline uint16_t fold_lanes(uint32_t even, uint32_t odd){
+    return (uint16_t) ~(even + (odd << 8));
+}
+
 /**
  * @brief Calculate inverted 16-bit two's complement frame checksum.
  * 
  * Pads data implicitly with zero byte to calulate checksum.
- * This function will not work on big-endian machines.
+ * The data is summed as little endian 16-bit words by accumulating the
+ * low and high byte lanes separately, eight bytes per iteration. Since the
+ * words are assembled from bytes the result does not depend on the byte
+ * order of the host.
  * 
  * @param [in] data - Pointer to data for checksum calculation.
  * @param [in] size - Number of bytes in data.
@@ -12,20 +26,140 @@
  */
 uint16_t calculate_crc16(int size, uint8_t *data)
 {
-    uint16_t checksum = 0U;
+    uint32_t even = 0U;
+    uint32_t odd = 0U;
+    int index = 0;
+
+    for (; index + 8 <= size; index += 8)
+    {
+        even += (uint32_t) data[index] + data[index + 2] + data[index + 4] + data[index + 6];
+        odd += (uint32_t) data[index + 1] + data[index + 3] + data[index + 5] + data[index + 7];
+    }
+    for (; index + 2 <= size; index += 2)
+    {
+        even += data[index];
+        odd += data[index + 1];
+    }
+    if (index < size)
+    {
+        even += data[index];
+    }
+    return fold_lanes(even, odd);
+}
+
+/**
+ * @brief Copy data and calculate its frame checksum in one pass.
+ *
+ * Calculates the same checksum as calculate_crc16 while copying the data,
+ * so that each byte is only read once.
+ *
+ * @param [in] size - Number of bytes to copy.
+ * @param [in] src - Pointer to data for checksum calculation.
+ * @param [out] dst - Pointer to the buffer where the data is copied to.
+ *                    Must not overlap with src.
+ * @return uint16_t - Frame check sequence.
+ */
+uint16_t calculate_crc16_copy(int size, const uint8_t *src, uint8_t *dst)
+{
+    uint32_t even = 0U;
+    uint32_t odd = 0U;
+    int index = 0;
+
+    for (; index + 2 <= size; index += 2)
+    {
+        dst[index] = src[index];
+        dst[index + 1] = src[index + 1];
+        even += src[index];
+        odd += src[index + 1];
+    }
+    if (index < size)
+    {
+        dst[index] = src[index];
+        even += src[index];
+    }
+    return fold_lanes(even, odd);
+}
+
+/**
+ * @brief Start a running frame checksum.
+ *
+ * @param [out] checksum - Running checksum to initialize.
+ */
+void checksum_init(checksum_t *checksum)
+{
+    checksum->lanes[0] = 0U;
+    checksum->lanes[1] = 0U;
+    checksum->size = 0;
+}
 
-    for (uint16_t index = 0; index < size; index++)
+/**
+ * @brief Add data to a running frame checksum.
+ *
+ * The data continues at the offset where the previous data ended, so adding
+ * the parts of a buffer one after another gives the same checksum as
+ * calculate_crc16 for the whole buffer.
+ *
+ * @param [in,out] checksum - Running checksum.
+ * @param [in] size - Number of bytes in data.
+ * @param [in] data - Pointer to the data to add.
+ */
+void checksum_update(checksum_t *checksum, int size, const uint8_t *data)
+{
+    uint32_t *first = &checksum->lanes[checksum->size & 1];
+    uint32_t *second = &checksum->lanes[(checksum->size + 1) & 1];
+    int index = 0;
+
+    for (; index + 2 <= size; index += 2)
+    {
+        *first += data[index];
+        *second += data[index + 1];
+    }
+    if (index < size)
     {
-        uint8_t nextByte = data[index];
+        *first += data[index];
+    }
+    checksum->size += size;
+}
+
+/**
+ * @brief Copy data and add it to a running frame checksum in one pass.
+ *
+ * Same as checksum_update for src while copying the data to dst.
+ *
+ * @param [in,out] checksum - Running checksum.
+ * @param [in] size - Number of bytes to copy.
+ * @param [in] src - Pointer to the data to add.
+ * @param [out] dst - Pointer to the buffer where the data is copied to.
+ *                    Must not overlap with src.
+ */
+void checksum_update_copy(checksum_t *checksum, int size, const uint8_t *src, uint8_t *dst)
+{
+    uint32_t *first = &checksum->lanes[checksum->size & 1];
+    uint32_t *second = &checksum->lanes[(checksum->size + 1) & 1];
+    int index = 0;
 
-        if ((index % 2) == 0)
-        {
-            checksum += (uint16_t) nextByte;
-        }
-        else
-        {
-            checksum += ((uint16_t) nextByte) << 8;
-        }
+    for (; index + 2 <= size; index += 2)
+    {
+        dst[index] = src[index];
+        dst[index + 1] = src[index + 1];
+        *first += src[index];
+        *second += src[index + 1];
+    }
+    if (index < size)
+    {
+        dst[index] = src[index];
+        *first += src[index];
     }
-    return ~checksum;
-}
\ No newline at end of file
+    checksum->size += size;
+}
+
+/**
+ * @brief Get the frame check sequence of a running frame checksum.
+ *
+ * @param [in] checksum - Running checksum.
+ * @return uint16_t - Frame check sequence.
+ */
+uint16_t checksum_final(const checksum_t *checksum)
+{
+    return fold_lanes(checksum->lanes[0], checksum->lanes[1]);
+}
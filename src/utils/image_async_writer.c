@@ -0,0 +1,326 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mdfu/image_writer.h"
+
+/**
+ * @brief Size in bytes of each write-behind buffer.
+ */
+#define WRITE_BEHIND_BLOCK_SIZE 4096
+/**
+ * @brief Number of write-behind buffers in the ring.
+ */
+#define WRITE_BEHIND_BLOCK_COUNT 16
+
+/**
+ * @brief Write-behind buffer.
+ */
+typedef struct {
+    uint8_t data[WRITE_BEHIND_BLOCK_SIZE];
+    size_t size;
+} write_behind_block_t;
+
+/**
+ * @brief Write-behind writer state.
+ *
+ * write fills the block at head and hands it to the writer thread when it is
+ * full. Blocks from tail up to head are waiting to be written to the file.
+ */
+static struct {
+    int fd;
+    bool opened;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    write_behind_block_t ring[WRITE_BEHIND_BLOCK_COUNT];
+    unsigned head;      // Number of blocks handed to the thread
+    unsigned tail;      // Number of blocks written by the thread
+    bool closing;
+    int error;
+} writer = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .emptied = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * @brief Writes a block to the image file.
+ *
+ * @param block Block to write.
+ * @return int 0 on success, errno value on failure.
+ */
+static int write_block(const write_behind_block_t *block){
+    size_t written = 0;
+    ssize_t status;
+
+    while(written < block->size){
+        status = write(writer.fd, &block->data[written], block->size - written);
+        if(status < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return errno;
+        }
+        written += (size_t) status;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writer thread that writes filled blocks to the image file.
+ *
+ * After an error the remaining blocks are discarded so that write does not
+ * block on a full ring.
+ *
+ * @param arg Unused.
+ * @return void* Always NULL.
+ */
+static void *writer_thread(void *arg){
+    write_behind_block_t *block;
+    int error = 0;
+
+    (void) arg;
+    pthread_mutex_lock(&writer.lock);
+    while(true){
+        while(writer.head == writer.tail && !writer.closing){
+            pthread_cond_wait(&writer.filled, &writer.lock);
+        }
+        if(writer.head == writer.tail){
+            break;
+        }
+        block = &writer.ring[writer.tail % WRITE_BEHIND_BLOCK_COUNT];
+        // write does not touch blocks that were handed over, write without the lock
+        pthread_mutex_unlock(&writer.lock);
+        if(0 == error){
+            error = write_block(block);
+        }
+        pthread_mutex_lock(&writer.lock);
+        if(0 != error && 0 == writer.error){
+            writer.error = error;
+        }
+        writer.tail += 1;
+        pthread_cond_signal(&writer.emptied);
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return NULL;
+}
+
+/**
+ * @brief Opens an image file for writing and starts the writer thread.
+ *
+ * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
+ * @return int Returns 0 if the file is successfully opened, or -1 if the file cannot be opened
+ * with `errno` set appropriately.
+ */
+static int writer_open(const char *fpath){
+    int status;
+
+    if(writer.opened){
+        errno = EBUSY;
+        return -1;
+    }
+    writer.fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(writer.fd < 0){
+        return -1;
+    }
+    writer.head = 0;
+    writer.tail = 0;
+    writer.ring[0].size = 0;
+    writer.closing = false;
+    writer.error = 0;
+    status = pthread_create(&writer.thread, NULL, writer_thread, NULL);
+    if(0 != status){
+        close(writer.fd);
+        writer.fd = -1;
+        errno = status;
+        return -1;
+    }
+    writer.opened = true;
+    return 0;
+}
+
+/**
+ * @brief Hands the block at head to the writer thread.
+ *
+ * Waits for a free block if all blocks are waiting to be written.
+ * Must be called with the lock held.
+ */
+static void submit_block(void){
+    writer.head += 1;
+    pthread_cond_signal(&writer.filled);
+    while(writer.head - writer.tail == WRITE_BEHIND_BLOCK_COUNT){
+        pthread_cond_wait(&writer.emptied, &writer.lock);
+    }
+    writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT].size = 0;
+}
+
+/**
+ * @brief Writes the remaining data, waits for the writer thread and closes the file.
+ *
+ * The file is synchronized to the storage device once, before it is closed.
+ *
+ * @return int Returns 0 on success, -1 on error with 'errno' set appropriately,
+ *         including errors from earlier writes.
+ */
+static int writer_close(void){
+    int error;
+
+    if(!writer.opened){
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&writer.lock);
+    if(writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT].size > 0){
+        submit_block();
+    }
+    writer.closing = true;
+    pthread_cond_signal(&writer.filled);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+
+    error = writer.error;
+    if(0 == error && fsync(writer.fd) < 0 && errno != EINVAL){
+        // EINVAL is returned for files that cannot be synchronized, e.g. pipes
+        error = errno;
+    }
+    if(close(writer.fd) < 0 && 0 == error){
+        error = errno;
+    }
+    writer.fd = -1;
+    writer.opened = false;
+    if(0 != error){
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies data into the write-behind buffers.
+ *
+ * The data is written to the file by the writer thread, so this function only
+ * blocks when all buffers are waiting to be written.
+ *
+ * @param data A pointer to the buffer containing bytes to be written.
+ * @param size The number of bytes to write.
+ * @return On success, the number of bytes written is returned.
+ *         On error, -1 is returned, and `errno` is set appropriately. Errors
+ *         of the file writes are reported by the following write or close.
+ */
+static ssize_t writer_write(void *data, size_t size){
+    const uint8_t *in = data;
+    write_behind_block_t *block;
+    size_t copied = 0;
+    size_t count;
+
+    if(!writer.opened || NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&writer.lock);
+    if(0 != writer.error){
+        errno = writer.error;
+        pthread_mutex_unlock(&writer.lock);
+        return -1;
+    }
+    while(copied < size){
+        block = &writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT];
+        count = WRITE_BEHIND_BLOCK_SIZE - block->size;
+        if(count > size - copied){
+            count = size - copied;
+        }
+        memcpy(&block->data[block->size], &in[copied], count);
+        block->size += count;
+        copied += count;
+        if(WRITE_BEHIND_BLOCK_SIZE == block->size){
+            submit_block();
+        }
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return (ssize_t) copied;
+}
+
+/**
+ * @brief Lends the free space of the write-behind buffer at head.
+ *
+ * When the free space is smaller than size the buffer is handed to the
+ * writer thread first, so that the data is always contiguous. The buffer at
+ * head is only accessed by the thread that writes, so the lent space can be
+ * filled without holding the lock.
+ *
+ * @param data Pointer where the address of the lent space is stored.
+ * @param size Number of bytes to lend.
+ * @return ssize_t size on success, 0 if size exceeds the size of a write-behind
+ *         buffer, or -1 on error with `errno` set appropriately.
+ */
+static ssize_t writer_reserve(void **data, size_t size){
+    write_behind_block_t *block;
+
+    if(!writer.opened){
+        errno = EINVAL;
+        return -1;
+    }
+    if(size > WRITE_BEHIND_BLOCK_SIZE){
+        return 0;
+    }
+    pthread_mutex_lock(&writer.lock);
+    if(0 != writer.error){
+        errno = writer.error;
+        pthread_mutex_unlock(&writer.lock);
+        return -1;
+    }
+    if(WRITE_BEHIND_BLOCK_SIZE - writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT].size < size){
+        submit_block();
+    }
+    block = &writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT];
+    pthread_mutex_unlock(&writer.lock);
+    *data = &block->data[block->size];
+    return (ssize_t) size;
+}
+
+/**
+ * @brief Adds data that was received into the lent space to the write-behind buffer.
+ *
+ * @param size Number of bytes that were stored in the space returned by reserve.
+ * @return int 0 on success, -1 on error with `errno` set appropriately.
+ */
+static int writer_commit(size_t size){
+    write_behind_block_t *block;
+
+    if(!writer.opened){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&writer.lock);
+    block = &writer.ring[writer.head % WRITE_BEHIND_BLOCK_COUNT];
+    if(size > WRITE_BEHIND_BLOCK_SIZE - block->size){
+        pthread_mutex_unlock(&writer.lock);
+        errno = EINVAL;
+        return -1;
+    }
+    block->size += size;
+    if(WRITE_BEHIND_BLOCK_SIZE == block->size){
+        submit_block();
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return 0;
+}
+
+/**
+ * @var fwimg_async_writer
+ * @brief Global instance of image_writer_t that writes firmware images in a
+ * background thread.
+ */
+image_writer_t fwimg_async_writer = {
+    .open = writer_open,
+    .close = writer_close,
+    .write = writer_write,
+    .reserve = writer_reserve,
+    .commit = writer_commit
+};
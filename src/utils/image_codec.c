@@ -0,0 +1,375 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mdfu/image_codec.h"
+#include "mdfu/logging.h"
+#ifdef MDFU_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MDFU_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MDFU_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/**
+ * @brief Size of the buffer for compressed input.
+ */
+#define CODEC_INPUT_SIZE 65536
+
+/**
+ * @brief Number of bytes at the start of the image that identify the format.
+ */
+#define CODEC_MAGIC_SIZE 4
+
+typedef enum {
+    CODEC_NONE,
+    CODEC_GZIP,
+    CODEC_ZSTD,
+    CODEC_LZ4
+} codec_type_t;
+
+/**
+ * @brief Compression format.
+ */
+typedef struct {
+    codec_type_t type;
+    const char *name;
+    const uint8_t *magic;
+    size_t magic_size;
+} codec_format_t;
+
+static const codec_format_t formats[] = {
+    {.type = CODEC_GZIP, .name = "gzip", .magic = (const uint8_t *) "\x1f\x8b\x08", .magic_size = 3},
+    {.type = CODEC_ZSTD, .name = "zstd", .magic = (const uint8_t *) "\x28\xb5\x2f\xfd", .magic_size = 4},
+    {.type = CODEC_LZ4, .name = "lz4", .magic = (const uint8_t *) "\x04\x22\x4d\x18", .magic_size = 4}
+};
+
+/**
+ * @brief Decoder state.
+ *
+ * Input from the file is buffered in input, bytes from start up to end are
+ * not consumed by the decoder yet.
+ */
+struct image_codec {
+    const codec_format_t *format;
+    int fd;
+    uint8_t input[CODEC_INPUT_SIZE];
+    size_t start;
+    size_t end;
+    bool end_of_file;
+    /** @brief True if the decoder is at the end of a compressed frame or member. */
+    bool frame_done;
+#ifdef MDFU_HAVE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef MDFU_HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+#ifdef MDFU_HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+};
+
+/**
+ * @brief Finds the compression format of data by its magic bytes.
+ *
+ * @param data Start of the image.
+ * @param size Number of bytes at data.
+ * @return const codec_format_t* Format, or NULL if the data is not compressed.
+ */
+static const codec_format_t *find_format(const uint8_t *data, size_t size){
+    for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++){
+        if(size >= formats[i].magic_size && 0 == memcmp(data, formats[i].magic, formats[i].magic_size)){
+            return &formats[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks if an image starts with the magic bytes of a compression format.
+ *
+ * @param data Start of the image.
+ * @param size Number of bytes at data.
+ * @return true if the image is compressed.
+ */
+bool image_codec_is_compressed(const uint8_t *data, size_t size){
+    return NULL != find_format(data, size);
+}
+
+/**
+ * @brief Reads more input from the file.
+ *
+ * Unconsumed input is moved to the start of the buffer first.
+ *
+ * @param codec Decoder.
+ * @return int 0 on success, also at the end of the file, -1 on error with errno set.
+ */
+static int fill_input(image_codec_t *codec){
+    ssize_t status;
+
+    if(codec->start > 0){
+        memmove(codec->input, &codec->input[codec->start], codec->end - codec->start);
+        codec->end -= codec->start;
+        codec->start = 0;
+    }
+    while(codec->end < sizeof(codec->input) && !codec->end_of_file){
+        status = read(codec->fd, &codec->input[codec->end], sizeof(codec->input) - codec->end);
+        if(status < 0 && EINTR == errno){
+            continue;
+        }
+        if(status < 0){
+            return -1;
+        }
+        if(0 == status){
+            codec->end_of_file = true;
+        }
+        codec->end += (size_t) status;
+        // Decode what a pipe delivered instead of waiting for a full buffer
+        if(codec->end >= CODEC_MAGIC_SIZE){
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts the decoder for the detected format.
+ *
+ * @param codec Decoder.
+ * @return int 0 on success, -1 with errno set to ENOTSUP if the format is not
+ *         supported by this build or ENOMEM.
+ */
+static int start_decoder(image_codec_t *codec){
+    switch(codec->format->type){
+#ifdef MDFU_HAVE_ZLIB
+    case CODEC_GZIP:
+        memset(&codec->zlib, 0, sizeof(codec->zlib));
+        if(Z_OK != inflateInit2(&codec->zlib, 15 + 16)){
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+#endif
+#ifdef MDFU_HAVE_ZSTD
+    case CODEC_ZSTD:
+        codec->zstd = ZSTD_createDStream();
+        if(NULL == codec->zstd){
+            errno = ENOMEM;
+            return -1;
+        }
+        ZSTD_initDStream(codec->zstd);
+        return 0;
+#endif
+#ifdef MDFU_HAVE_LZ4
+    case CODEC_LZ4:
+        if(LZ4F_isError(LZ4F_createDecompressionContext(&codec->lz4, LZ4F_VERSION))){
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+#endif
+    default:
+        ERROR("Image is compressed with %s, which is not supported by this build", codec->format->name);
+        errno = ENOTSUP;
+        return -1;
+    }
+}
+
+/**
+ * @brief Opens a decoder for an image file.
+ *
+ * The first bytes of the file are read to detect the compression format, so
+ * this blocks until they are available when the file is a pipe.
+ *
+ * @param codec Pointer where the decoder is stored.
+ * @param fd File descriptor of the image, which is not closed by the decoder.
+ * @return int 0 on success, -1 on error with errno set. ENOTSUP if the image is
+ *         compressed with a format that is not supported by this build.
+ */
+int image_codec_open(image_codec_t **codec, int fd){
+    image_codec_t *new_codec = calloc(1, sizeof(image_codec_t));
+
+    if(NULL == new_codec){
+        errno = ENOMEM;
+        return -1;
+    }
+    new_codec->fd = fd;
+    if(fill_input(new_codec) < 0){
+        free(new_codec);
+        return -1;
+    }
+    new_codec->format = find_format(new_codec->input, new_codec->end);
+    if(NULL != new_codec->format && start_decoder(new_codec) < 0){
+        free(new_codec);
+        return -1;
+    }
+    *codec = new_codec;
+    return 0;
+}
+
+/**
+ * @brief Decodes input into the output buffer with the detected format.
+ *
+ * @param codec Decoder.
+ * @param data Output buffer.
+ * @param size Size of the output buffer.
+ * @return ssize_t Number of decoded bytes, or -1 with errno set to EBADMSG if
+ *         the input is corrupted.
+ */
+static ssize_t decode(image_codec_t *codec, uint8_t *data, size_t size){
+    size_t in_size = codec->end - codec->start;
+    size_t out_size = size;
+
+    switch(codec->format->type){
+#ifdef MDFU_HAVE_ZLIB
+    case CODEC_GZIP: {
+        int status;
+
+        if(codec->frame_done){
+            // Concatenated gzip members are decoded as one image
+            inflateReset(&codec->zlib);
+        }
+        codec->zlib.next_in = &codec->input[codec->start];
+        codec->zlib.avail_in = (uInt) in_size;
+        codec->zlib.next_out = data;
+        codec->zlib.avail_out = (uInt) size;
+        status = inflate(&codec->zlib, Z_NO_FLUSH);
+        if(Z_OK != status && Z_STREAM_END != status && Z_BUF_ERROR != status){
+            errno = EBADMSG;
+            return -1;
+        }
+        codec->frame_done = Z_STREAM_END == status;
+        in_size -= codec->zlib.avail_in;
+        out_size -= codec->zlib.avail_out;
+        break;
+    }
+#endif
+#ifdef MDFU_HAVE_ZSTD
+    case CODEC_ZSTD: {
+        ZSTD_inBuffer in = {.src = &codec->input[codec->start], .size = in_size, .pos = 0};
+        ZSTD_outBuffer out = {.dst = data, .size = size, .pos = 0};
+        size_t status = ZSTD_decompressStream(codec->zstd, &out, &in);
+
+        if(ZSTD_isError(status)){
+            errno = EBADMSG;
+            return -1;
+        }
+        codec->frame_done = 0 == status;
+        in_size = in.pos;
+        out_size = out.pos;
+        break;
+    }
+#endif
+#ifdef MDFU_HAVE_LZ4
+    case CODEC_LZ4: {
+        size_t status = LZ4F_decompress(codec->lz4, data, &out_size, &codec->input[codec->start], &in_size, NULL);
+
+        if(LZ4F_isError(status)){
+            errno = EBADMSG;
+            return -1;
+        }
+        codec->frame_done = 0 == status;
+        break;
+    }
+#endif
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+    codec->start += in_size;
+    return (ssize_t) out_size;
+}
+
+/**
+ * @brief Reads decoded image data.
+ *
+ * @param codec Decoder.
+ * @param data Buffer for the decoded data.
+ * @param size Size of the buffer.
+ * @return ssize_t Number of bytes read, which can be less than size, zero at
+ *         the end of the image, or -1 on error with errno set. EBADMSG if the
+ *         compressed image is corrupted or truncated.
+ */
+ssize_t image_codec_read(image_codec_t *codec, void *data, size_t size){
+    size_t consumed;
+    ssize_t status;
+
+    if(NULL == codec->format){
+        if(codec->start < codec->end){
+            status = (ssize_t) (codec->end - codec->start < size ? codec->end - codec->start : size);
+            memcpy(data, &codec->input[codec->start], (size_t) status);
+            codec->start += (size_t) status;
+            return status;
+        }
+        do {
+            status = read(codec->fd, data, size);
+        } while(status < 0 && EINTR == errno);
+        return status;
+    }
+    while(size > 0){
+        if(codec->start < codec->end){
+            consumed = codec->start;
+            status = decode(codec, data, size);
+            if(0 != status){
+                return status;
+            }
+            if(codec->start != consumed){
+                // Headers and trailers are consumed without output
+                continue;
+            }
+        }
+        // The decoder needs more input
+        if(codec->end_of_file){
+            if(codec->start == codec->end && codec->frame_done){
+                return 0;
+            }
+            errno = EBADMSG;
+            return -1;
+        }
+        if(fill_input(codec) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets the name of the detected compression format.
+ *
+ * @param codec Decoder.
+ * @return const char* Format name, "none" for images that are not compressed.
+ */
+const char *image_codec_name(const image_codec_t *codec){
+    return NULL == codec->format ? "none" : codec->format->name;
+}
+
+/**
+ * @brief Releases a decoder.
+ *
+ * @param codec Decoder, can be NULL.
+ */
+void image_codec_close(image_codec_t *codec){
+    if(NULL == codec){
+        return;
+    }
+#ifdef MDFU_HAVE_ZLIB
+    if(NULL != codec->format && CODEC_GZIP == codec->format->type){
+        inflateEnd(&codec->zlib);
+    }
+#endif
+#ifdef MDFU_HAVE_ZSTD
+    ZSTD_freeDStream(codec->zstd);
+#endif
+#ifdef MDFU_HAVE_LZ4
+    if(NULL != codec->lz4){
+        LZ4F_freeDecompressionContext(codec->lz4);
+    }
+#endif
+    free(codec);
+}
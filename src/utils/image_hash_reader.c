@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mdfu/image_reader.h"
+#include "mdfu/sha256.h"
+#include "mdfu/logging.h"
+
+/**
+ * @brief Reader that hashes the image data that is read from another reader.
+ */
+typedef struct {
+    image_reader_t reader;
+    /** @brief Reader of the image data. */
+    const image_reader_t *image_reader;
+    sha256_t *sha;
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    /** @brief Data of the last peek, hashed when it is consumed with advance. */
+    const uint8_t *peek_data;
+    size_t peek_size;
+    /** @brief True if the last peek returned the end of the image. */
+    bool peek_end;
+    /** @brief True if the digest was compared, after the end of the image was read. */
+    bool checked;
+    bool matched;
+} hash_reader_t;
+
+/**
+ * @brief Formats a digest as hexadecimal string.
+ *
+ * @param digest Digest of SHA256_DIGEST_SIZE bytes.
+ * @param hex Buffer for 2 * SHA256_DIGEST_SIZE + 1 characters.
+ * @return const char* hex
+ */
+static const char *digest_to_hex(const uint8_t *digest, char *hex){
+    static const char digits[] = "0123456789abcdef";
+
+    for(int i = 0; i < SHA256_DIGEST_SIZE; i++){
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * SHA256_DIGEST_SIZE] = '\0';
+    return hex;
+}
+
+/**
+ * @brief Compares the digest of the image with the expected digest at the end of the image.
+ *
+ * @param hash Hash reader.
+ * @return int 0 if the digests match, -1 with errno set to EBADMSG otherwise.
+ */
+static int check_digest(hash_reader_t *hash){
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[2][2 * SHA256_DIGEST_SIZE + 1];
+
+    if(!hash->checked){
+        sha256_final(hash->sha, digest);
+        hash->checked = true;
+        hash->matched = 0 == memcmp(digest, hash->expected, SHA256_DIGEST_SIZE);
+        if(!hash->matched){
+            ERROR("Image SHA-256 %s does not match the expected %s",
+                digest_to_hex(digest, hex[0]), digest_to_hex(hash->expected, hex[1]));
+        } else {
+            DEBUG("Image SHA-256 matches the expected digest");
+        }
+    }
+    if(!hash->matched){
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens the image again and starts a new digest.
+ *
+ * @param reader Image reader.
+ * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
+ * @return int Returns 0 if the file is successfully opened, or -1 on error with `errno`
+ * set appropriately.
+ */
+static int reader_open(const image_reader_t *reader, const char *fpath){
+    hash_reader_t *hash = reader->ctx;
+
+    sha256_reset(hash->sha);
+    hash->peek_size = 0;
+    hash->peek_end = false;
+    hash->checked = false;
+    return hash->image_reader->open(hash->image_reader, fpath);
+}
+
+/**
+ * @brief Closes the image and releases the reader.
+ *
+ * @param reader Image reader.
+ * @return int Status of closing the image.
+ */
+static int reader_close(const image_reader_t *reader){
+    hash_reader_t *hash = reader->ctx;
+    int status = hash->image_reader->close(hash->image_reader);
+
+    sha256_destroy(hash->sha);
+    free(hash);
+    return status;
+}
+
+/**
+ * @brief Reads and hashes image data.
+ *
+ * The digest is compared when the end of the image is read, which is when
+ * less than size bytes are returned.
+ *
+ * @param reader Image reader.
+ * @param data A pointer to the buffer where the read bytes will be stored.
+ * @param size The number of bytes to read.
+ * @return On success, the number of bytes read is returned (zero indicates end of file).
+ *         On error, -1 is returned, and `errno` is set appropriately. EBADMSG
+ *         if the image does not have the expected digest.
+ */
+static ssize_t reader_read(const image_reader_t *reader, void *data, size_t size){
+    hash_reader_t *hash = reader->ctx;
+    ssize_t status = hash->image_reader->read(hash->image_reader, data, size);
+
+    if(status < 0){
+        return status;
+    }
+    sha256_update(hash->sha, (size_t) status, data);
+    if((size_t) status < size && check_digest(hash) < 0){
+        return -1;
+    }
+    return status;
+}
+
+/**
+ * @brief Borrows the next bytes of the image without copying them.
+ *
+ * @param reader Image reader.
+ * @param data Pointer where the address of the image data is stored.
+ * @param size The number of bytes requested.
+ * @return ssize_t Number of bytes available at data, or -1 on error with `errno`
+ *         set. EBADMSG if the end of the image was reached and the image does
+ *         not have the expected digest.
+ */
+static ssize_t reader_peek(const image_reader_t *reader, const void **data, size_t size){
+    hash_reader_t *hash = reader->ctx;
+    ssize_t status = hash->image_reader->peek(hash->image_reader, data, size);
+
+    if(status < 0){
+        return status;
+    }
+    if(0 == status && check_digest(hash) < 0){
+        return -1;
+    }
+    hash->peek_data = *data;
+    hash->peek_size = (size_t) status;
+    hash->peek_end = (size_t) status < size;
+    return status;
+}
+
+/**
+ * @brief Consumes and hashes bytes that were borrowed with peek.
+ *
+ * @param reader Image reader.
+ * @param size The number of bytes to consume.
+ * @return int 0 on success, -1 on error with errno set. EBADMSG if this
+ *         consumes the end of the image and the image does not have the
+ *         expected digest.
+ */
+static int reader_advance(const image_reader_t *reader, size_t size){
+    hash_reader_t *hash = reader->ctx;
+
+    if(size > hash->peek_size){
+        errno = EINVAL;
+        return -1;
+    }
+    if(hash->image_reader->advance(hash->image_reader, size) < 0){
+        return -1;
+    }
+    sha256_update(hash->sha, size, hash->peek_data);
+    hash->peek_data += size;
+    hash->peek_size -= size;
+    if(hash->peek_end && 0 == hash->peek_size){
+        return check_digest(hash);
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a reader that checks the SHA-256 digest of the image while it is read.
+ *
+ * The data is hashed as it is consumed from the given reader, so the image
+ * is not read twice. When the end of the image is read and the digest does
+ * not match, the read fails with EBADMSG, so the last chunk of the image is
+ * never sent and the update is not finished. The given reader must have the
+ * image opened already and is closed with the new reader.
+ *
+ * @param image_reader Reader that opened the image.
+ * @param expected Expected digest of SHA256_DIGEST_SIZE bytes.
+ * @param reader Pointer where the reader is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int fwimg_sha256_reader_create(const image_reader_t *image_reader, const uint8_t *expected, image_reader_t **reader){
+    hash_reader_t *hash;
+
+    if(NULL == image_reader || NULL == expected || NULL == reader){
+        errno = EINVAL;
+        return -1;
+    }
+    hash = calloc(1, sizeof(*hash));
+    if(NULL == hash){
+        errno = ENOMEM;
+        return -1;
+    }
+    if(sha256_create(&hash->sha) < 0){
+        free(hash);
+        return -1;
+    }
+    hash->reader.open = reader_open;
+    hash->reader.close = reader_close;
+    hash->reader.read = reader_read;
+    if(NULL != image_reader->peek && NULL != image_reader->advance){
+        hash->reader.peek = reader_peek;
+        hash->reader.advance = reader_advance;
+    }
+    hash->reader.ctx = hash;
+    hash->image_reader = image_reader;
+    memcpy(hash->expected, expected, SHA256_DIGEST_SIZE);
+    *reader = &hash->reader;
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mdfu/image_reader.h"
+
+/**
+ * @brief Start of the mapped image, NULL if no image is open.
+ */
+static const uint8_t *image = NULL;
+/**
+ * @brief Size of the mapped image in bytes.
+ */
+static size_t image_size = 0;
+/**
+ * @brief Offset of the next unread byte in the image.
+ */
+static size_t position = 0;
+
+/**
+ * @brief Maps an image file into memory.
+ *
+ * The whole file is mapped read only and shared, so that all processes that
+ * update from the same image use the same page cache pages. Files that cannot
+ * be mapped, e.g. pipes or empty files, cause an error so that the caller can
+ * fall back to a stream based reader.
+ *
+ * @param reader Image reader, unused.
+ * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
+ * @return int Returns 0 if the file is successfully mapped, or -1 on error with `errno`
+ * set appropriately.
+ */
+static int reader_open(const image_reader_t *reader, const char *fpath){
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    (void) reader;
+    if(NULL != image){
+        errno = EBUSY;
+        return -1;
+    }
+    // Check the path first so that opening a FIFO does not consume its writer
+    if(stat(fpath, &st) < 0){
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode)){
+        errno = ENOTSUP;
+        return -1;
+    }
+    fd = open(fpath, O_RDONLY);
+    if(fd < 0){
+        return -1;
+    }
+    if(fstat(fd, &st) < 0){
+        close(fd);
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode) || 0 == st.st_size){
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+    mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file descriptor is closed
+    close(fd);
+    if(MAP_FAILED == mapping){
+        return -1;
+    }
+    // The image is read once from start to end
+    madvise(mapping, (size_t) st.st_size, MADV_SEQUENTIAL);
+    image = mapping;
+    image_size = (size_t) st.st_size;
+    position = 0;
+    return 0;
+}
+
+/**
+ * @brief Unmaps the image.
+ *
+ * Pointers returned by peek are invalid after this call.
+ *
+ * @param reader Image reader, unused.
+ * @return int Returns 0 on success, -1 on error with 'errno' set appropriately.
+ */
+static int reader_close(const image_reader_t *reader){
+    int status;
+
+    (void) reader;
+    if(NULL == image){
+        errno = EBADF;
+        return -1;
+    }
+    status = munmap((void *) image, image_size);
+    image = NULL;
+    image_size = 0;
+    position = 0;
+    return status;
+}
+
+/**
+ * @brief Borrows the next bytes of the image without copying them.
+ *
+ * @param reader Image reader, unused.
+ * @param data Pointer where the address of the image data is stored.
+ * @param size The number of bytes requested.
+ * @return ssize_t Number of bytes available at data, which is less than size at
+ *         the end of the image and zero when all data was consumed, or -1 on
+ *         error with `errno` set.
+ */
+static ssize_t reader_peek(const image_reader_t *reader, const void **data, size_t size){
+    size_t available;
+
+    (void) reader;
+    if(NULL == image || NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    available = image_size - position;
+    *data = &image[position];
+    return (ssize_t) (size < available ? size : available);
+}
+
+/**
+ * @brief Consumes bytes that were borrowed with peek.
+ *
+ * @param reader Image reader, unused.
+ * @param size The number of bytes to consume.
+ * @return int 0 on success, -1 with errno set to EINVAL if size exceeds the
+ *         remaining image data.
+ */
+static int reader_advance(const image_reader_t *reader, size_t size){
+    (void) reader;
+    if(NULL == image || size > image_size - position){
+        errno = EINVAL;
+        return -1;
+    }
+    position += size;
+    return 0;
+}
+
+/**
+ * @brief Copies data from the image into a given buffer.
+ *
+ * @param reader Image reader.
+ * @param data A pointer to the buffer where the read bytes will be stored.
+ * @param size The number of bytes to read.
+ * @return On success, the number of bytes read is returned (zero indicates end of file).
+ *         On error, -1 is returned, and `errno` is set appropriately.
+ */
+static ssize_t reader_read(const image_reader_t *reader, void *data, size_t size){
+    const void *image_data;
+    ssize_t available;
+
+    if(NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    available = reader_peek(reader, &image_data, size);
+    if(available > 0){
+        memcpy(data, image_data, (size_t) available);
+        position += (size_t) available;
+    }
+    return available;
+}
+
+/**
+ * @var fwimg_mmap_reader
+ * @brief Global instance of image_reader_t that reads firmware images from a
+ * memory mapping of the image file.
+ */
+image_reader_t fwimg_mmap_reader = {
+    .open = reader_open,
+    .close = reader_close,
+    .read = reader_read,
+    .peek = reader_peek,
+    .advance = reader_advance
+};
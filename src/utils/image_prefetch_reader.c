@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mdfu/image_reader.h"
+#include "mdfu/image_codec.h"
+
+/**
+ * @brief Size in bytes of each read-ahead buffer.
+ */
+#define PREFETCH_BLOCK_SIZE 4096
+/**
+ * @brief Number of read-ahead buffers in the ring.
+ */
+#define PREFETCH_BLOCK_COUNT 16
+
+/**
+ * @brief Read-ahead buffer.
+ */
+typedef struct {
+    uint8_t data[PREFETCH_BLOCK_SIZE];
+    size_t size;
+} prefetch_block_t;
+
+/**
+ * @brief Prefetching reader state.
+ *
+ * The ring is filled by the prefetch thread and emptied by read. Blocks from
+ * tail up to head hold image data, all other blocks are free.
+ */
+static struct {
+    int fd;
+    /** @brief Decoder that decompresses compressed images. */
+    image_codec_t *codec;
+    bool opened;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    prefetch_block_t ring[PREFETCH_BLOCK_COUNT];
+    unsigned head;      // Number of blocks filled by the thread
+    unsigned tail;      // Number of blocks consumed by read
+    size_t offset;      // Bytes consumed from the block at tail
+    bool end_of_file;
+    int error;
+} prefetch = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .emptied = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * @brief Releases the ring lock when the prefetch thread is cancelled while waiting.
+ *
+ * @param arg Unused.
+ */
+static void unlock_ring(void *arg){
+    (void) arg;
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+/**
+ * @brief Waits until a ring block is free.
+ *
+ * Kept out of the prefetch thread loop, because the cleanup handler is
+ * registered with setjmp and would clobber the loop state.
+ *
+ * @return prefetch_block_t* Block at the ring head.
+ */
+static prefetch_block_t *wait_free_block(void){
+    prefetch_block_t *block;
+
+    pthread_mutex_lock(&prefetch.lock);
+    pthread_cleanup_push(unlock_ring, NULL);
+    while(prefetch.head - prefetch.tail == PREFETCH_BLOCK_COUNT){
+        pthread_cond_wait(&prefetch.emptied, &prefetch.lock);
+    }
+    block = &prefetch.ring[prefetch.head % PREFETCH_BLOCK_COUNT];
+    pthread_cleanup_pop(1);
+    return block;
+}
+
+/**
+ * @brief Prefetch thread that reads the image into free ring blocks.
+ *
+ * A block is filled completely unless the end of the image is reached, so that
+ * short reads from pipes do not result in short blocks. Compressed images are
+ * decompressed into the blocks, so that decompressing the image overlaps with
+ * sending it.
+ *
+ * @param arg Unused.
+ * @return void* Always NULL.
+ */
+static void *prefetch_thread(void *arg){
+    prefetch_block_t *block;
+    ssize_t status;
+    int error = 0;
+    bool done = false;
+
+    (void) arg;
+    while(!done){
+        block = wait_free_block();
+
+        // The block is not visible to read until head is incremented
+        block->size = 0;
+        while(block->size < PREFETCH_BLOCK_SIZE){
+            status = image_codec_read(prefetch.codec, &block->data[block->size], PREFETCH_BLOCK_SIZE - block->size);
+            if(status < 0 && errno == EINTR){
+                continue;
+            }
+            if(status <= 0){
+                error = (status < 0) ? errno : 0;
+                done = true;
+                break;
+            }
+            block->size += (size_t) status;
+        }
+
+        pthread_mutex_lock(&prefetch.lock);
+        if(block->size > 0){
+            prefetch.head += 1;
+        }
+        if(done){
+            prefetch.error = error;
+            prefetch.end_of_file = true;
+        }
+        pthread_cond_signal(&prefetch.filled);
+        pthread_mutex_unlock(&prefetch.lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens an image and starts reading it ahead in a background thread.
+ *
+ * The image can be any readable file including pipes and FIFOs. The path "-"
+ * selects the standard input. Images that are compressed with gzip, zstd or
+ * LZ4 are detected by their magic bytes and decompressed while reading ahead.
+ *
+ * @param reader Image reader, unused.
+ * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
+ * @return int Returns 0 if the file is successfully opened, or -1 on error with `errno`
+ * set appropriately.
+ */
+static int reader_open(const image_reader_t *reader, const char *fpath){
+    int status;
+
+    (void) reader;
+    if(prefetch.opened){
+        errno = EBUSY;
+        return -1;
+    }
+    if(0 == strcmp(fpath, "-")){
+        prefetch.fd = STDIN_FILENO;
+    } else {
+        prefetch.fd = open(fpath, O_RDONLY);
+        if(prefetch.fd < 0){
+            return -1;
+        }
+    }
+    if(image_codec_open(&prefetch.codec, prefetch.fd) < 0){
+        status = errno;
+        if(STDIN_FILENO != prefetch.fd){
+            close(prefetch.fd);
+        }
+        prefetch.fd = -1;
+        errno = status;
+        return -1;
+    }
+    prefetch.head = 0;
+    prefetch.tail = 0;
+    prefetch.offset = 0;
+    prefetch.end_of_file = false;
+    prefetch.error = 0;
+    status = pthread_create(&prefetch.thread, NULL, prefetch_thread, NULL);
+    if(0 != status){
+        image_codec_close(prefetch.codec);
+        prefetch.codec = NULL;
+        if(STDIN_FILENO != prefetch.fd){
+            close(prefetch.fd);
+        }
+        prefetch.fd = -1;
+        errno = status;
+        return -1;
+    }
+    prefetch.opened = true;
+    return 0;
+}
+
+/**
+ * @brief Stops the prefetch thread and closes the image.
+ *
+ * @param reader Image reader, unused.
+ * @return int Returns 0 on success, -1 on error with 'errno' set appropriately.
+ */
+static int reader_close(const image_reader_t *reader){
+    (void) reader;
+    if(!prefetch.opened){
+        errno = EBADF;
+        return -1;
+    }
+    // The thread can be blocked reading from a pipe that is never closed
+    pthread_cancel(prefetch.thread);
+    pthread_join(prefetch.thread, NULL);
+    image_codec_close(prefetch.codec);
+    prefetch.codec = NULL;
+    if(STDIN_FILENO != prefetch.fd){
+        close(prefetch.fd);
+    }
+    prefetch.fd = -1;
+    prefetch.opened = false;
+    return 0;
+}
+
+/**
+ * @brief Copies prefetched image data into a given buffer.
+ *
+ * Waits until size bytes were read ahead or the end of the image was reached.
+ *
+ * @param reader Image reader, unused.
+ * @param data A pointer to the buffer where the read bytes will be stored.
+ * @param size The number of bytes to read.
+ * @return On success, the number of bytes read is returned, which is less than size
+ *         only at the end of the image. On error, -1 is returned, and `errno` is set
+ *         appropriately.
+ */
+static ssize_t reader_read(const image_reader_t *reader, void *data, size_t size){
+    uint8_t *out = data;
+    prefetch_block_t *block;
+    size_t copied = 0;
+    size_t count;
+
+    (void) reader;
+    if(!prefetch.opened || NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&prefetch.lock);
+    while(copied < size){
+        while(prefetch.head == prefetch.tail && !prefetch.end_of_file){
+            pthread_cond_wait(&prefetch.filled, &prefetch.lock);
+        }
+        if(prefetch.head == prefetch.tail){
+            break;
+        }
+        block = &prefetch.ring[prefetch.tail % PREFETCH_BLOCK_COUNT];
+        count = block->size - prefetch.offset;
+        if(count > size - copied){
+            count = size - copied;
+        }
+        // The thread does not touch blocks that hold data, copy without the lock
+        pthread_mutex_unlock(&prefetch.lock);
+        memcpy(&out[copied], &block->data[prefetch.offset], count);
+        pthread_mutex_lock(&prefetch.lock);
+        copied += count;
+        prefetch.offset += count;
+        if(prefetch.offset == block->size){
+            prefetch.offset = 0;
+            prefetch.tail += 1;
+            pthread_cond_signal(&prefetch.emptied);
+        }
+    }
+    if(copied < size && 0 != prefetch.error){
+        errno = prefetch.error;
+        pthread_mutex_unlock(&prefetch.lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    return (ssize_t) copied;
+}
+
+/**
+ * @var fwimg_prefetch_reader
+ * @brief Global instance of image_reader_t that reads firmware images ahead
+ * in a background thread.
+ */
+image_reader_t fwimg_prefetch_reader = {
+    .open = reader_open,
+    .close = reader_close,
+    .read = reader_read,
+    .peek = NULL,
+    .advance = NULL
+};
@@ -12,11 +12,13 @@ static FILE *image = NULL;
  * caller. The file is opened in binary read mode. If the file cannot be opened,
  * the function returns an error code.
  *
+ * @param reader Image reader, unused.
  * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
  * @return int Returns 0 if the file is successfully opened, or -1 if the file cannot be opened
  * with `errno` set appropriately.
  */
-static int open(const char *fpath){
+static int open(const image_reader_t *reader, const char *fpath){
+    (void) reader;
     image = fopen(fpath, "rb");
     if(image == NULL){
         return -1;
@@ -33,9 +35,11 @@ static int open(const char *fpath){
  * other reason, 'image' is set to NULL and the function also returns -1.
  * On success, 'image' is set to NULL and the function returns 0.
  *
+ * @param reader Image reader, unused.
  * @return int Returns 0 on success, -1 on error with 'errno' set appropriately.
  */
-static int close(){
+static int close(const image_reader_t *reader){
+    (void) reader;
     if(NULL == image){
         errno = EBADF;
         return -1;
@@ -54,6 +58,7 @@ static int close(){
  * This function attempts to read up to `size` bytes from the file stream
  * pointed to by the global variable `image` into the buffer pointed to by `data`.
  *
+ * @param reader Image reader, unused.
  * @param data A pointer to the buffer where the read bytes will be stored.
  * @param size The number of bytes to read.
  * @return On success, the number of bytes read is returned (zero indicates end of file).
@@ -62,9 +67,10 @@ static int close(){
  * @note The global variable `image` should be a valid `FILE*` that is already open.
  *       The function sets `errno` to `EINVAL` if `image` or `data` is NULL.
  */
-static ssize_t read(void *data, size_t size){
+static ssize_t read(const image_reader_t *reader, void *data, size_t size){
     size_t bytes_read;
-    
+
+    (void) reader;
     if (image == NULL || data == NULL) {
         errno = EINVAL;
         return -1;
@@ -91,5 +97,7 @@ static ssize_t read(void *data, size_t size){
 image_reader_t fwimg_file_reader = {
     .open = open,
     .close = close,
-    .read = read
+    .read = read,
+    .peek = NULL,
+    .advance = NULL
 };
\ No newline at end of file
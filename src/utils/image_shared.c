@@ -0,0 +1,330 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mdfu/image_reader.h"
+#include "mdfu/image_codec.h"
+
+/**
+ * @brief Initial size of the buffer for images that are read from streams.
+ */
+#define STREAM_BUFFER_SIZE 65536
+
+/**
+ * @brief Shared image.
+ */
+struct fwimg_image {
+    /** @brief Number of references, the image is released when it drops to zero. */
+    atomic_int references;
+    /** @brief Image data, mapped or allocated. */
+    uint8_t *data;
+    /** @brief Size of the image in bytes. */
+    size_t size;
+    /** @brief True if data is a mapping of the image file. */
+    bool mapped;
+};
+
+/**
+ * @brief Reader of a shared image with its own position.
+ */
+typedef struct {
+    image_reader_t reader;
+    fwimg_image_t *image;
+    /** @brief Offset of the next unread byte in the image. */
+    size_t position;
+} shared_reader_t;
+
+/**
+ * @brief Reads a stream until its end into an allocated buffer.
+ *
+ * Compressed streams are decompressed while reading.
+ *
+ * @param fd File descriptor of the stream.
+ * @param image Image where the buffer and its size are stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+static int read_stream(int fd, fwimg_image_t *image){
+    size_t capacity = STREAM_BUFFER_SIZE;
+    uint8_t *buffer = malloc(capacity);
+    uint8_t *resized;
+    image_codec_t *codec;
+    size_t size = 0;
+    ssize_t status;
+
+    if(NULL == buffer){
+        errno = ENOMEM;
+        return -1;
+    }
+    if(image_codec_open(&codec, fd) < 0){
+        free(buffer);
+        return -1;
+    }
+    for(;;){
+        if(size == capacity){
+            capacity *= 2;
+            resized = realloc(buffer, capacity);
+            if(NULL == resized){
+                image_codec_close(codec);
+                free(buffer);
+                errno = ENOMEM;
+                return -1;
+            }
+            buffer = resized;
+        }
+        status = image_codec_read(codec, &buffer[size], capacity - size);
+        if(status < 0){
+            image_codec_close(codec);
+            free(buffer);
+            return -1;
+        }
+        if(0 == status){
+            image_codec_close(codec);
+            image->data = buffer;
+            image->size = size;
+            image->mapped = false;
+            return 0;
+        }
+        size += (size_t) status;
+    }
+}
+
+/**
+ * @brief Loads an image that can be shared by many readers.
+ *
+ * Regular files are mapped read only and shared like with fwimg_mmap_reader.
+ * Other files, e.g. pipes and the standard input with "-", are read until
+ * their end into memory, so that the image can be read more than once.
+ * Compressed images are decompressed into memory once when loading.
+ *
+ * @param image Pointer where the image is stored, with one reference that
+ *              is released with fwimg_image_unref.
+ * @param fpath A pointer to a null-terminated string that specifies the path to the image file.
+ * @return int Returns 0 on success, or -1 on error with `errno` set appropriately.
+ */
+int fwimg_image_open(fwimg_image_t **image, const char *fpath){
+    fwimg_image_t *new_image;
+    struct stat st;
+    void *mapping;
+    int fd = STDIN_FILENO;
+    int status;
+
+    if(NULL == image || NULL == fpath){
+        errno = EINVAL;
+        return -1;
+    }
+    new_image = calloc(1, sizeof(*new_image));
+    if(NULL == new_image){
+        errno = ENOMEM;
+        return -1;
+    }
+    atomic_init(&new_image->references, 1);
+    if(0 != strcmp(fpath, "-")){
+        fd = open(fpath, O_RDONLY);
+        if(fd < 0){
+            free(new_image);
+            return -1;
+        }
+    }
+    if(0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0){
+        mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(MAP_FAILED != mapping){
+            // Readers are at different positions, read the whole image ahead
+            madvise(mapping, (size_t) st.st_size, MADV_WILLNEED);
+            if(image_codec_is_compressed(mapping, (size_t) st.st_size)){
+                munmap(mapping, (size_t) st.st_size);
+            } else {
+                new_image->data = mapping;
+                new_image->size = (size_t) st.st_size;
+                new_image->mapped = true;
+            }
+        }
+    }
+    status = new_image->mapped ? 0 : read_stream(fd, new_image);
+    if(STDIN_FILENO != fd){
+        close(fd);
+    }
+    if(status < 0){
+        free(new_image);
+        return -1;
+    }
+    *image = new_image;
+    return 0;
+}
+
+/**
+ * @brief Adds a reference to a shared image.
+ *
+ * @param image Shared image.
+ * @return fwimg_image_t* The image.
+ */
+fwimg_image_t *fwimg_image_ref(fwimg_image_t *image){
+    atomic_fetch_add_explicit(&image->references, 1, memory_order_relaxed);
+    return image;
+}
+
+/**
+ * @brief Releases a reference to a shared image.
+ *
+ * The image is unmapped or freed when the last reference is released.
+ *
+ * @param image Shared image, can be NULL.
+ */
+void fwimg_image_unref(fwimg_image_t *image){
+    if(NULL == image || atomic_fetch_sub_explicit(&image->references, 1, memory_order_acq_rel) > 1){
+        return;
+    }
+    if(image->mapped){
+        munmap(image->data, image->size);
+    } else {
+        free(image->data);
+    }
+    free(image);
+}
+
+/**
+ * @brief Gets the size of a shared image.
+ *
+ * @param image Shared image.
+ * @return size_t Size of the image in bytes.
+ */
+size_t fwimg_image_size(const fwimg_image_t *image){
+    return image->size;
+}
+
+/**
+ * @brief Starts reading the image from the beginning again.
+ *
+ * @param reader Image reader.
+ * @param fpath Unused, the reader reads the image it was created for.
+ * @return int Always 0.
+ */
+static int reader_open(const image_reader_t *reader, const char *fpath){
+    shared_reader_t *shared = reader->ctx;
+
+    (void) fpath;
+    shared->position = 0;
+    return 0;
+}
+
+/**
+ * @brief Releases the reader and its image reference.
+ *
+ * The reader and pointers returned by peek are invalid after this call.
+ *
+ * @param reader Image reader.
+ * @return int Always 0.
+ */
+static int reader_close(const image_reader_t *reader){
+    shared_reader_t *shared = reader->ctx;
+
+    fwimg_image_unref(shared->image);
+    free(shared);
+    return 0;
+}
+
+/**
+ * @brief Borrows the next bytes of the image without copying them.
+ *
+ * @param reader Image reader.
+ * @param data Pointer where the address of the image data is stored.
+ * @param size The number of bytes requested.
+ * @return ssize_t Number of bytes available at data, which is less than size at
+ *         the end of the image and zero when all data was consumed, or -1 on
+ *         error with `errno` set.
+ */
+static ssize_t reader_peek(const image_reader_t *reader, const void **data, size_t size){
+    shared_reader_t *shared = reader->ctx;
+    size_t available = shared->image->size - shared->position;
+
+    if(NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    *data = &shared->image->data[shared->position];
+    return (ssize_t) (size < available ? size : available);
+}
+
+/**
+ * @brief Consumes bytes that were borrowed with peek.
+ *
+ * @param reader Image reader.
+ * @param size The number of bytes to consume.
+ * @return int 0 on success, -1 with errno set to EINVAL if size exceeds the
+ *         remaining image data.
+ */
+static int reader_advance(const image_reader_t *reader, size_t size){
+    shared_reader_t *shared = reader->ctx;
+
+    if(size > shared->image->size - shared->position){
+        errno = EINVAL;
+        return -1;
+    }
+    shared->position += size;
+    return 0;
+}
+
+/**
+ * @brief Copies data from the image into a given buffer.
+ *
+ * @param reader Image reader.
+ * @param data A pointer to the buffer where the read bytes will be stored.
+ * @param size The number of bytes to read.
+ * @return On success, the number of bytes read is returned (zero indicates end of file).
+ *         On error, -1 is returned, and `errno` is set appropriately.
+ */
+static ssize_t reader_read(const image_reader_t *reader, void *data, size_t size){
+    const void *image_data;
+    ssize_t available;
+
+    if(NULL == data){
+        errno = EINVAL;
+        return -1;
+    }
+    available = reader_peek(reader, &image_data, size);
+    if(available > 0){
+        memcpy(data, image_data, (size_t) available);
+        reader_advance(reader, (size_t) available);
+    }
+    return available;
+}
+
+/**
+ * @brief Creates a reader for a shared image.
+ *
+ * The reader starts at the beginning of the image and holds a reference to
+ * it. Readers of the same image do not share any state, each reader must
+ * only be used by one thread at a time. Closing the reader releases it.
+ *
+ * @param image Shared image.
+ * @param reader Pointer where the reader is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int fwimg_image_reader_create(fwimg_image_t *image, image_reader_t **reader){
+    shared_reader_t *shared;
+
+    if(NULL == image || NULL == reader){
+        errno = EINVAL;
+        return -1;
+    }
+    shared = calloc(1, sizeof(*shared));
+    if(NULL == shared){
+        errno = ENOMEM;
+        return -1;
+    }
+    shared->reader.open = reader_open;
+    shared->reader.close = reader_close;
+    shared->reader.read = reader_read;
+    shared->reader.peek = reader_peek;
+    shared->reader.advance = reader_advance;
+    shared->reader.ctx = shared;
+    shared->image = fwimg_image_ref(image);
+    shared->position = 0;
+    *reader = &shared->reader;
+    return 0;
+}
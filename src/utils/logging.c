@@ -1,23 +1,248 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "mdfu/logging.h"
 
+/**
+ * @def LOG_MESSAGE_SIZE
+ * @brief Maximum size of a formatted log message, longer messages are truncated.
+ */
+#ifndef LOG_MESSAGE_SIZE
+#define LOG_MESSAGE_SIZE 1024
+#endif
+
+/**
+ * @def LOG_SINK_SIZE
+ * @brief Size of the buffer for messages that are not yet written to the log stream.
+ */
+#ifndef LOG_SINK_SIZE
+#define LOG_SINK_SIZE (64 * 1024)
+#endif
+
 FILE *dbgstream;
 int  debug_level = ERRORLEVEL;
 const char* ERROR_LEVEL_NAMES[] = {"NONE", "ERROR", "WARNING", "INFO", "DEBUG"};
 
+#ifndef _WIN32
+/**
+ * @brief Asynchronous log sink.
+ *
+ * Log calls format the message on their own stack and append it to the ring
+ * buffer, a background thread writes the buffer to the log stream. This keeps
+ * the stream I/O out of the transfer loop so that debug logging does not delay
+ * the responses to the client.
+ *
+ * The head and tail are running byte counts, the buffer offset is the count
+ * modulo LOG_SINK_SIZE.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    size_t head;
+    size_t tail;
+    uint32_t dropped;
+    char ring[LOG_SINK_SIZE];
+} sink = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * @brief Log sink thread that writes the buffered messages to the log stream.
+ *
+ * @param arg Not used.
+ * @return void* Always NULL.
+ */
+static void *sink_thread(void *arg){
+    (void) arg;
+
+    pthread_mutex_lock(&sink.lock);
+    while(true){
+        size_t size;
+        uint32_t dropped;
+
+        while(sink.head == sink.tail && !sink.stopping){
+            pthread_cond_wait(&sink.ready, &sink.lock);
+        }
+        if(sink.head == sink.tail){
+            break;
+        }
+        // Only the part up to the end of the ring is written, the rest in
+        // the next iteration. Writers never touch the region between tail
+        // and head so it can be written without holding the lock.
+        size = sink.head - sink.tail;
+        if(size > LOG_SINK_SIZE - sink.tail % LOG_SINK_SIZE){
+            size = LOG_SINK_SIZE - sink.tail % LOG_SINK_SIZE;
+        }
+        dropped = sink.dropped;
+        sink.dropped = 0;
+        pthread_mutex_unlock(&sink.lock);
+
+        fwrite(&sink.ring[sink.tail % LOG_SINK_SIZE], 1, size, dbgstream);
+        if(dropped){
+            fprintf(dbgstream, "%s:%u log messages dropped\n", ERROR_LEVEL_NAMES[WARNLEVEL], dropped);
+        }
+        fflush(dbgstream);
+
+        pthread_mutex_lock(&sink.lock);
+        sink.tail += size;
+    }
+    pthread_mutex_unlock(&sink.lock);
+    return NULL;
+}
+
+/**
+ * @brief Append a formatted message to the log sink buffer.
+ *
+ * Messages that do not fit into the free space are dropped and counted so
+ * that a log call never waits for the log stream.
+ *
+ * @param message Formatted message.
+ * @param size Size of the message.
+ */
+static void sink_append(const char *message, size_t size){
+    size_t offset;
+    size_t first;
+
+    pthread_mutex_lock(&sink.lock);
+    if(size > LOG_SINK_SIZE - (sink.head - sink.tail)){
+        sink.dropped++;
+        pthread_mutex_unlock(&sink.lock);
+        return;
+    }
+    offset = sink.head % LOG_SINK_SIZE;
+    first = size < LOG_SINK_SIZE - offset ? size : LOG_SINK_SIZE - offset;
+    memcpy(&sink.ring[offset], message, first);
+    memcpy(sink.ring, message + first, size - first);
+    if(sink.head == sink.tail){
+        pthread_cond_signal(&sink.ready);
+    }
+    sink.head += size;
+    pthread_mutex_unlock(&sink.lock);
+}
+
+/**
+ * @brief Write all buffered messages and stop the log sink thread.
+ *
+ * Registered with atexit so that no messages are lost when the application
+ * exits.
+ */
+static void stop_logging(void){
+    if(!sink.running){
+        return;
+    }
+    pthread_mutex_lock(&sink.lock);
+    sink.stopping = true;
+    pthread_cond_signal(&sink.ready);
+    pthread_mutex_unlock(&sink.lock);
+    pthread_join(sink.thread, NULL);
+    sink.running = false;
+}
+
+/**
+ * @brief Hold the sink lock while the process forks.
+ */
+static void fork_prepare(void){
+    pthread_mutex_lock(&sink.lock);
+}
+
+/**
+ * @brief Release the sink lock in the parent after a fork.
+ */
+static void fork_parent(void){
+    pthread_mutex_unlock(&sink.lock);
+}
+
+/**
+ * @brief Switch the child of a fork to synchronous logging.
+ *
+ * The sink thread does not exist in the child. The buffered messages are
+ * dropped because the parent writes them.
+ */
+static void fork_child(void){
+    pthread_mutex_init(&sink.lock, NULL);
+    sink.tail = sink.head;
+    sink.dropped = 0;
+    sink.running = false;
+}
+#endif
+
+/**
+ * @brief Log a message.
+ *
+ * Used by the logging macros. When the log sink thread is running the message
+ * is written asynchronously, otherwise it is written directly to the log
+ * stream.
+ *
+ * @param format Printf format string.
+ * @param ... Format arguments.
+ */
+void log_message(const char *format, ...){
+    va_list args;
+
+    va_start(args, format);
+#ifndef _WIN32
+    if(sink.running){
+        char message[LOG_MESSAGE_SIZE];
+        int size = vsnprintf(message, sizeof(message), format, args);
+
+        if(size > 0){
+            if(size >= (int) sizeof(message)){
+                // Mark truncated messages but keep the line break
+                size = sizeof(message) - 1;
+                memcpy(&message[size - 4], "...\n", 4);
+            }
+            sink_append(message, (size_t) size);
+        }
+        va_end(args);
+        return;
+    }
+#endif
+    vfprintf(dbgstream, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Initialize logging.
+ *
+ * Starts the log sink thread on platforms that support it. If the thread
+ * cannot be started messages are written directly to the log stream.
+ *
+ * @param logstream Log stream, stdout if NULL.
+ */
 void init_logging(FILE *logstream){
     if(logstream){
         dbgstream = logstream;
     } else {
         dbgstream = stdout;
     }
+#ifndef _WIN32
+    if(!sink.running && 0 == pthread_create(&sink.thread, NULL, sink_thread, NULL)){
+        sink.running = true;
+        atexit(stop_logging);
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+    }
+#endif
 }
+
 void set_debug_level(int level){
     if(0 < level && level < 6)
     {
         debug_level = level;
+        if(level > LOG_COMPILE_LEVEL){
+            WARN("Log levels above %s are not included in this build", ERROR_LEVEL_NAMES[LOG_COMPILE_LEVEL]);
+        }
     }
     else {
         LOG(ERRORLEVEL, "Debug level must be between 1 and 5");
         ERROR("Bla bla %d ", 11);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mdfu/sha256.h"
+#ifdef MDFU_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#ifdef MDFU_HAVE_OPENSSL
+struct sha256 {
+    EVP_MD_CTX *evp;
+};
+#else
+/**
+ * @brief Size of the blocks that SHA-256 processes.
+ */
+#define SHA256_BLOCK_SIZE 64
+
+struct sha256 {
+    uint32_t state[8];
+    /** @brief Number of bytes added so far. */
+    uint64_t length;
+    /** @brief Bytes of the current block that is not complete yet. */
+    uint8_t block[SHA256_BLOCK_SIZE];
+    size_t block_size;
+};
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotate_right(uint32_t value, int count){
+    return (value >> count) | (value << (32 - count));
+}
+
+/**
+ * @brief Sets the initial digest state.
+ *
+ * @param sha Digest.
+ */
+static void reset_state(sha256_t *sha){
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial_state, sizeof(sha->state));
+    sha->length = 0;
+    sha->block_size = 0;
+}
+
+/**
+ * @brief Adds one block to the digest state.
+ *
+ * @param state Digest state.
+ * @param block Block of SHA256_BLOCK_SIZE bytes.
+ */
+static void process_block(uint32_t *state, const uint8_t *block){
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int i = 0; i < 16; i++){
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+               (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; i++){
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for(int i = 0; i < 64; i++){
+        uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+        uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+        uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+#endif
+
+/**
+ * @brief Creates a SHA-256 digest.
+ *
+ * @param sha Pointer where the digest is stored.
+ * @return int 0 on success, -1 on error with errno set.
+ */
+int sha256_create(sha256_t **sha){
+    sha256_t *new_sha = calloc(1, sizeof(*new_sha));
+
+    if(NULL == new_sha){
+        errno = ENOMEM;
+        return -1;
+    }
+#ifdef MDFU_HAVE_OPENSSL
+    new_sha->evp = EVP_MD_CTX_new();
+    if(NULL == new_sha->evp || 1 != EVP_DigestInit_ex(new_sha->evp, EVP_sha256(), NULL)){
+        EVP_MD_CTX_free(new_sha->evp);
+        free(new_sha);
+        errno = ENOMEM;
+        return -1;
+    }
+#else
+    reset_state(new_sha);
+#endif
+    *sha = new_sha;
+    return 0;
+}
+
+/**
+ * @brief Adds data to the digest.
+ *
+ * @param sha Digest.
+ * @param size Number of bytes in data.
+ * @param data Data to add.
+ */
+void sha256_update(sha256_t *sha, size_t size, const uint8_t *data){
+#ifdef MDFU_HAVE_OPENSSL
+    EVP_DigestUpdate(sha->evp, data, size);
+#else
+    size_t copy_size;
+
+    sha->length += size;
+    if(sha->block_size > 0){
+        copy_size = SHA256_BLOCK_SIZE - sha->block_size < size ? SHA256_BLOCK_SIZE - sha->block_size : size;
+        memcpy(&sha->block[sha->block_size], data, copy_size);
+        sha->block_size += copy_size;
+        data += copy_size;
+        size -= copy_size;
+        if(sha->block_size < SHA256_BLOCK_SIZE){
+            return;
+        }
+        process_block(sha->state, sha->block);
+        sha->block_size = 0;
+    }
+    for(; size >= SHA256_BLOCK_SIZE; size -= SHA256_BLOCK_SIZE, data += SHA256_BLOCK_SIZE){
+        process_block(sha->state, data);
+    }
+    memcpy(sha->block, data, size);
+    sha->block_size = size;
+#endif
+}
+
+/**
+ * @brief Finishes the digest and starts a new one.
+ *
+ * @param sha Digest.
+ * @param digest Buffer for the SHA256_DIGEST_SIZE bytes of the digest.
+ */
+void sha256_final(sha256_t *sha, uint8_t *digest){
+#ifdef MDFU_HAVE_OPENSSL
+    EVP_DigestFinal_ex(sha->evp, digest, NULL);
+    EVP_DigestInit_ex(sha->evp, EVP_sha256(), NULL);
+#else
+    uint64_t bits = sha->length * 8;
+
+    sha->block[sha->block_size++] = 0x80;
+    if(sha->block_size > SHA256_BLOCK_SIZE - 8){
+        memset(&sha->block[sha->block_size], 0, SHA256_BLOCK_SIZE - sha->block_size);
+        process_block(sha->state, sha->block);
+        sha->block_size = 0;
+    }
+    memset(&sha->block[sha->block_size], 0, SHA256_BLOCK_SIZE - 8 - sha->block_size);
+    for(int i = 0; i < 8; i++){
+        sha->block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bits >> (8 * i));
+    }
+    process_block(sha->state, sha->block);
+    for(int i = 0; i < 8; i++){
+        digest[4 * i] = (uint8_t) (sha->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (sha->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (sha->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) sha->state[i];
+    }
+    reset_state(sha);
+#endif
+}
+
+/**
+ * @brief Discards the data that was added and starts a new digest.
+ *
+ * @param sha Digest.
+ */
+void sha256_reset(sha256_t *sha){
+#ifdef MDFU_HAVE_OPENSSL
+    EVP_DigestInit_ex(sha->evp, EVP_sha256(), NULL);
+#else
+    reset_state(sha);
+#endif
+}
+
+/**
+ * @brief Releases a digest.
+ *
+ * @param sha Digest, can be NULL.
+ */
+void sha256_destroy(sha256_t *sha){
+    if(NULL == sha){
+        return;
+    }
+#ifdef MDFU_HAVE_OPENSSL
+    EVP_MD_CTX_free(sha->evp);
+#endif
+    free(sha);
+}
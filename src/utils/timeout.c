@@ -2,13 +2,107 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <limits.h>
 #include "mdfu/timeout.h"
 
+/**
+ * @brief Default time in seconds that timeout_wait spins before the deadline.
+ *
+ * Sleeping is done with a coarser resolution than busy waiting, so the last
+ * part of the wait is done by polling the clock. This can be overridden at
+ * build time.
+ */
+#ifndef TIMEOUT_SPIN_TIME
+#define TIMEOUT_SPIN_TIME 50e-6f
+#endif
+
+static long spin_time_ns = (long) (TIMEOUT_SPIN_TIME * 1e9);
+
+/**
+ * @brief Clock set with timeout_set_clock, NULL for the monotonic clock.
+ */
+static timeout_clock_t *timeout_clock = NULL;
+
+/**
+ * @brief Set the clock source of all timeouts.
+ *
+ * The clock must be set before timeouts are started and not be changed while
+ * timeouts that were started with the previous clock are in use.
+ *
+ * @param clock Clock source, NULL for the monotonic clock.
+ */
+void timeout_set_clock(timeout_clock_t *clock){
+    timeout_clock = clock;
+}
+
+/**
+ * @brief Get the current time of the timeout clock.
+ *
+ * @param now Pointer where the time is stored.
+ * @return int 0 on success, -1 on error.
+ */
+int timeout_now(timeout_t *now){
+    if(NULL != timeout_clock){
+        return timeout_clock->now(timeout_clock, now);
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, now) == -1) {
+        perror("clock_gettime");
+        return -1;
+    }
+    return 0;
+}
+
+static int virtual_clock_now(timeout_clock_t *clock, timeout_t *now){
+    *now = ((timeout_virtual_clock_t *) clock)->time;
+    return 0;
+}
+
+static int virtual_clock_wait(timeout_clock_t *clock, const timeout_t *deadline){
+    timeout_virtual_clock_t *virtual_clock = (timeout_virtual_clock_t *) clock;
+    timeout_t *time = &virtual_clock->time;
+
+    // Timeouts expire after their deadline, not at it
+    if(time->tv_sec < deadline->tv_sec || (time->tv_sec == deadline->tv_sec && time->tv_nsec <= deadline->tv_nsec)){
+        *time = *deadline;
+        timeout_virtual_clock_advance(virtual_clock, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Initialize a virtual clock at time zero.
+ *
+ * @param clock Virtual clock, set it with timeout_set_clock(&clock->clock).
+ */
+void timeout_virtual_clock_init(timeout_virtual_clock_t *clock){
+    clock->clock.now = virtual_clock_now;
+    clock->clock.wait = virtual_clock_wait;
+    clock->time.tv_sec = 0;
+    clock->time.tv_nsec = 0;
+}
+
+/**
+ * @brief Advance a virtual clock.
+ *
+ * @param clock Virtual clock.
+ * @param nanoseconds Time to add, negative values are ignored.
+ */
+void timeout_virtual_clock_advance(timeout_virtual_clock_t *clock, long long nanoseconds){
+    if(nanoseconds <= 0){
+        return;
+    }
+    clock->time.tv_sec += (time_t) (nanoseconds / 1000000000LL);
+    clock->time.tv_nsec += (long) (nanoseconds % 1000000000LL);
+    if(clock->time.tv_nsec >= 1000000000L){
+        clock->time.tv_sec += 1;
+        clock->time.tv_nsec -= 1000000000L;
+    }
+}
+
 int set_timeout(timeout_t *timer, float timeout){
     long nsec;
     time_t seconds;
-    if (clock_gettime(CLOCK_MONOTONIC, timer) == -1) {
-        perror("clock_gettime");
+    if (timeout_now(timer) == -1) {
         return -1;
     }
     seconds = (time_t) timeout;
@@ -27,8 +121,8 @@ bool timeout_expired(timeout_t *timer){
     timeout_t now;
     bool expired = false;
 
-    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
-        perror("clock_gettime");
+    if (timeout_now(&now) == -1) {
+        return false;
     }
     if(now.tv_sec > timer->tv_sec) {
         expired = true;
@@ -36,4 +130,141 @@ bool timeout_expired(timeout_t *timer){
         expired = true;
     }
     return expired;
+}
+
+/**
+ * @brief Check if a timeout expired using the coarse monotonic clock.
+ *
+ * The coarse clock is read without a system call or hardware counter access
+ * and lags the precise clock by at most one scheduler tick, so it never
+ * reports a timeout as expired too early, only up to one tick too late. It
+ * is meant for the timeout checks in polling loops where the cost of the
+ * check matters more than its resolution.
+ *
+ * @param timer Timeout to check.
+ * @return bool True if the timeout expired.
+ */
+bool timeout_expired_coarse(timeout_t *timer){
+#ifdef CLOCK_MONOTONIC_COARSE
+    timeout_t now;
+
+    if (NULL != timeout_clock || clock_gettime(CLOCK_MONOTONIC_COARSE, &now) == -1) {
+        return timeout_expired(timer);
+    }
+    return now.tv_sec > timer->tv_sec || (now.tv_sec == timer->tv_sec && now.tv_nsec > timer->tv_nsec);
+#else
+    return timeout_expired(timer);
+#endif
+}
+
+/**
+ * @brief Get the time left until a timeout expires in nanoseconds.
+ *
+ * @param timer Timeout to check.
+ * @return long long Remaining time in nanoseconds, 0 if the timeout has
+ *         expired and -1 on error.
+ */
+long long timeout_remaining_ns(timeout_t *timer){
+    timeout_t now;
+    long long remaining_ns;
+
+    if (timeout_now(&now) == -1) {
+        return -1;
+    }
+    remaining_ns = (long long) (timer->tv_sec - now.tv_sec) * 1000000000LL + (timer->tv_nsec - now.tv_nsec);
+    return remaining_ns > 0 ? remaining_ns : 0;
+}
+
+/**
+ * @brief Get the time left until a timeout expires.
+ *
+ * The remaining time is rounded up to whole milliseconds so that waiting for
+ * the returned time does not wake up before the timeout has expired.
+ *
+ * @param timer Timeout to check.
+ * @return int Remaining time in milliseconds, 0 if the timeout has expired
+ *         and -1 on error.
+ */
+int timeout_remaining_ms(timeout_t *timer){
+    long long remaining_ns = timeout_remaining_ns(timer);
+
+    if(remaining_ns <= 0){
+        return (int) remaining_ns;
+    }
+    if(remaining_ns > (long long) INT_MAX * 1000000LL){
+        return INT_MAX;
+    }
+    return (int) ((remaining_ns + 999999LL) / 1000000LL);
+}
+
+/**
+ * @brief Get the time that passed since a timeout.
+ *
+ * Together with set_timeout(timer, 0) this measures the time between two events.
+ *
+ * @param timer Timeout to measure from.
+ * @return float Seconds since the timeout, negative if it has not expired yet.
+ */
+float timeout_elapsed(timeout_t *timer){
+    timeout_t now;
+
+    if (timeout_now(&now) == -1) {
+        return 0;
+    }
+    return (float) (now.tv_sec - timer->tv_sec) + (float) (now.tv_nsec - timer->tv_nsec) * 1e-9f;
+}
+
+/**
+ * @brief Set the time that timeout_wait busy waits before a deadline.
+ *
+ * A longer spin time improves timing accuracy on systems with a high wake up
+ * latency at the cost of CPU time. A spin time of zero only sleeps.
+ *
+ * @param seconds Spin time in seconds.
+ * @return int 0 on success, -1 with errno set to EINVAL for an invalid time.
+ */
+int set_timeout_spin_time(float seconds){
+    if(seconds < 0 || seconds >= 1.0f){
+        errno = EINVAL;
+        return -1;
+    }
+    spin_time_ns = (long) (seconds * 1e9);
+    return 0;
+}
+
+/**
+ * @brief Wait until a timeout expires.
+ *
+ * The calling thread sleeps until shortly before the deadline and then busy
+ * waits for the remaining spin time, so that the deadline is met accurately
+ * without keeping the CPU busy for the whole wait.
+ *
+ * @param timer Timeout to wait for.
+ * @return int 0 on success, -1 on error.
+ */
+int timeout_wait(timeout_t *timer){
+    if(NULL != timeout_clock){
+        return timeout_clock->wait(timeout_clock, timer);
+    }
+#ifdef TIMER_ABSTIME
+    timeout_t wake = *timer;
+    int status;
+
+    wake.tv_nsec -= spin_time_ns;
+    if(wake.tv_nsec < 0){
+        wake.tv_sec -= 1;
+        wake.tv_nsec += 1000000000L;
+    }
+    // Returns immediately when the wake up time is in the past
+    do {
+        status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    } while(status == EINTR);
+    if(status != 0){
+        errno = status;
+        perror("clock_nanosleep");
+        return -1;
+    }
+#endif
+    while(!timeout_expired(timer)){/* spin for the rest of the wait */}
+    return 0;
 }
\ No newline at end of file
@@ -1,12 +1,17 @@
 #ifndef MAC_FUNCTIONS_H
 #define MAC_FUNCTIONS_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "mdfu/mac/mac.h"
 
-int mac_open(void);
-int mac_close(void);
-int mac_read(int size, uint8_t *data);
-int mac_write(int size, uint8_t *data);
-int mac_init(void *);
+int mac_open(mac_t *mac);
+int mac_close(mac_t *mac);
+int mac_read(mac_t *mac, int size, uint8_t *data);
+int mac_write(mac_t *mac, int size, uint8_t *data);
+int mac_init(mac_t *mac, void *);
+int mac_read_deadline(mac_t *mac, int size, uint8_t *data, int min_size, timeout_t *deadline);
+int mac_get_fd(mac_t *mac);
+bool mac_has_data(mac_t *mac);
 
 #endif // MAC_FUNCTIONS_H
\ No newline at end of file
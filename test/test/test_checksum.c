@@ -0,0 +1,77 @@
+#include <string.h>
+#include "unity.h"
+#include "mdfu/checksum.h"
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+/**
+ * @brief Reference checksum that sums little endian 16-bit words.
+ */
+static uint16_t checksum_reference(int size, const uint8_t *data){
+    uint16_t sum = 0;
+    for(int i = 0; i < size; i += 2){
+        uint16_t word = data[i];
+        if(i + 1 < size){
+            word |= (uint16_t) (data[i + 1] << 8);
+        }
+        sum += word;
+    }
+    return (uint16_t) ~sum;
+}
+
+void test_checksum_padding(void) {
+    uint8_t data[] = {0x01, 0x02, 0x03};
+
+    // 0x0201 + 0x0003 = 0x0204
+    TEST_ASSERT_EQUAL_HEX16(0xFDFB, calculate_crc16(sizeof(data), data));
+    TEST_ASSERT_EQUAL_HEX16(0xFFFF, calculate_crc16(0, data));
+}
+
+void test_checksum_matches_reference(void) {
+    uint8_t data[1024];
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (uint8_t) (0xFF - i * 3);
+    }
+    for(int size = 0; size < 40; size++){
+        TEST_ASSERT_EQUAL_HEX16(checksum_reference(size, data), calculate_crc16(size, data));
+    }
+    TEST_ASSERT_EQUAL_HEX16(checksum_reference(sizeof(data), data), calculate_crc16(sizeof(data), data));
+}
+
+void test_checksum_copy(void) {
+    uint8_t data[33];
+    uint8_t copy[sizeof(data)];
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (uint8_t) (i * 37);
+    }
+    for(int size = 0; size <= (int) sizeof(data); size++){
+        memset(copy, 0, sizeof(copy));
+        TEST_ASSERT_EQUAL_HEX16(calculate_crc16(size, data), calculate_crc16_copy(size, data, copy));
+        if(size > 0){
+            TEST_ASSERT_EQUAL_UINT8_ARRAY(data, copy, size);
+        }
+    }
+}
+
+void test_checksum_running(void) {
+    uint8_t data[45];
+    checksum_t checksum;
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (uint8_t) (0x5A + i * 11);
+    }
+    // Splits at odd offsets swap the byte lanes of the following part
+    for(int split = 0; split < (int) sizeof(data); split++){
+        checksum_init(&checksum);
+        checksum_update(&checksum, split, data);
+        checksum_update(&checksum, 1, &data[split]);
+        checksum_update(&checksum, sizeof(data) - split - 1, &data[split + 1]);
+        TEST_ASSERT_EQUAL_HEX16(checksum_reference(sizeof(data), data), checksum_final(&checksum));
+    }
+}
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "mdfu/image_codec.h"
+#include "mdfu/logging.h"
+#ifdef MDFU_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MDFU_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MDFU_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Larger than the decoder input buffer so that the input is read in parts
+#define IMAGE_SIZE 200000
+
+static uint8_t image[IMAGE_SIZE];
+static uint8_t *compressed;
+static size_t compressed_size;
+static FILE *file;
+static image_codec_t *codec;
+
+/**
+ * @brief Writes data to a temporary file.
+ *
+ * @return int File descriptor of the file, positioned at the start.
+ */
+static int image_file(const uint8_t *data, size_t size){
+    file = tmpfile();
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL(size, fwrite(data, 1, size, file));
+    TEST_ASSERT_EQUAL(0, fflush(file));
+    rewind(file);
+    return fileno(file);
+}
+
+/**
+ * @brief Reads the image with odd sized reads until the end or an error.
+ *
+ * @return ssize_t Size of the image, or -1 on error with errno set.
+ */
+static ssize_t read_image(uint8_t *data){
+    size_t size = 0;
+    ssize_t status;
+
+    do{
+        status = image_codec_read(codec, &data[size], size + 1000 < IMAGE_SIZE ? 1000 : IMAGE_SIZE - size);
+        if(status < 0){
+            return -1;
+        }
+        size += (size_t) status;
+    }while(status > 0 && size < IMAGE_SIZE);
+    // Nothing after the end of the image
+    status = image_codec_read(codec, data, 1);
+    return status < 0 ? -1 : (ssize_t) (size + (size_t) status);
+}
+
+static void assert_decoded(const char *name, const uint8_t *data, size_t size){
+    static uint8_t decoded[IMAGE_SIZE];
+
+    TEST_ASSERT_EQUAL(0, image_codec_open(&codec, image_file(data, size)));
+    TEST_ASSERT_EQUAL_STRING(name, image_codec_name(codec));
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, read_image(decoded));
+    TEST_ASSERT_EQUAL_MEMORY(image, decoded, IMAGE_SIZE);
+}
+
+static void assert_truncated(size_t size){
+    static uint8_t decoded[IMAGE_SIZE];
+
+    TEST_ASSERT_EQUAL(0, image_codec_open(&codec, image_file(compressed, size)));
+    errno = 0;
+    TEST_ASSERT_EQUAL(-1, read_image(decoded));
+    TEST_ASSERT_EQUAL(EBADMSG, errno);
+    image_codec_close(codec);
+    codec = NULL;
+    fclose(file);
+    file = NULL;
+}
+
+void setUp(void){
+    uint32_t state = 1;
+
+    init_logging(stderr);
+    set_debug_level(ERRORLEVEL);
+    // Runs of repeated bytes between random data compress to about half
+    for(size_t i = 0; i < IMAGE_SIZE; i++){
+        if(0 == (i / 64) % 2){
+            state = state * 1103515245 + 12345;
+        }
+        image[i] = (uint8_t) (state >> 16);
+    }
+    compressed = NULL;
+    file = NULL;
+    codec = NULL;
+}
+
+void tearDown(void){
+    image_codec_close(codec);
+    if(NULL != file){
+        fclose(file);
+    }
+    free(compressed);
+}
+
+void test_uncompressed_image_passed_through(void){
+    TEST_ASSERT_FALSE(image_codec_is_compressed(image, IMAGE_SIZE));
+    assert_decoded("none", image, IMAGE_SIZE);
+}
+
+void test_is_compressed(void){
+    const uint8_t gzip[] = {0x1f, 0x8b, 0x08, 0x00};
+    const uint8_t zstd[] = {0x28, 0xb5, 0x2f, 0xfd};
+    const uint8_t lz4[] = {0x04, 0x22, 0x4d, 0x18};
+
+    TEST_ASSERT_TRUE(image_codec_is_compressed(gzip, sizeof(gzip)));
+    TEST_ASSERT_TRUE(image_codec_is_compressed(zstd, sizeof(zstd)));
+    TEST_ASSERT_TRUE(image_codec_is_compressed(lz4, sizeof(lz4)));
+    // Too short for the magic
+    TEST_ASSERT_FALSE(image_codec_is_compressed(zstd, 3));
+}
+
+#ifdef MDFU_HAVE_ZLIB
+/**
+ * @brief Compresses data as a gzip member and appends it to the compressed data.
+ */
+static void gzip_compress(const uint8_t *data, size_t size){
+    z_stream stream;
+    size_t bound = size + size / 1000 + 64;
+
+    compressed = realloc(compressed, compressed_size + bound);
+    TEST_ASSERT_NOT_NULL(compressed);
+    memset(&stream, 0, sizeof(stream));
+    TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY));
+    stream.next_in = (uint8_t *) data;
+    stream.avail_in = (uInt) size;
+    stream.next_out = &compressed[compressed_size];
+    stream.avail_out = (uInt) bound;
+    TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&stream, Z_FINISH));
+    compressed_size += bound - stream.avail_out;
+    deflateEnd(&stream);
+}
+#endif
+
+void test_gzip(void){
+#ifdef MDFU_HAVE_ZLIB
+    compressed_size = 0;
+    gzip_compress(image, IMAGE_SIZE);
+    TEST_ASSERT_TRUE(image_codec_is_compressed(compressed, compressed_size));
+    assert_decoded("gzip", compressed, compressed_size);
+#else
+    TEST_IGNORE_MESSAGE("Built without zlib");
+#endif
+}
+
+void test_gzip_members(void){
+#ifdef MDFU_HAVE_ZLIB
+    compressed_size = 0;
+    gzip_compress(image, IMAGE_SIZE / 2);
+    gzip_compress(&image[IMAGE_SIZE / 2], IMAGE_SIZE / 2);
+    assert_decoded("gzip", compressed, compressed_size);
+#else
+    TEST_IGNORE_MESSAGE("Built without zlib");
+#endif
+}
+
+void test_gzip_truncated(void){
+#ifdef MDFU_HAVE_ZLIB
+    compressed_size = 0;
+    gzip_compress(image, IMAGE_SIZE);
+    // Without the trailer and in the middle of the data
+    assert_truncated(compressed_size - 4);
+    assert_truncated(compressed_size / 2);
+#else
+    TEST_IGNORE_MESSAGE("Built without zlib");
+#endif
+}
+
+void test_gzip_corrupted(void){
+#ifdef MDFU_HAVE_ZLIB
+    static uint8_t decoded[IMAGE_SIZE];
+
+    compressed_size = 0;
+    gzip_compress(image, IMAGE_SIZE);
+    // Breaks the CRC32 in the trailer
+    compressed[compressed_size - 8] ^= 0xff;
+    TEST_ASSERT_EQUAL(0, image_codec_open(&codec, image_file(compressed, compressed_size)));
+    errno = 0;
+    TEST_ASSERT_EQUAL(-1, read_image(decoded));
+    TEST_ASSERT_EQUAL(EBADMSG, errno);
+#else
+    TEST_IGNORE_MESSAGE("Built without zlib");
+#endif
+}
+
+#ifdef MDFU_HAVE_ZSTD
+static void zstd_compress(void){
+    size_t bound = ZSTD_compressBound(IMAGE_SIZE);
+
+    compressed = malloc(bound);
+    TEST_ASSERT_NOT_NULL(compressed);
+    compressed_size = ZSTD_compress(compressed, bound, image, IMAGE_SIZE, 3);
+    TEST_ASSERT_FALSE(ZSTD_isError(compressed_size));
+}
+#endif
+
+void test_zstd(void){
+#ifdef MDFU_HAVE_ZSTD
+    zstd_compress();
+    TEST_ASSERT_TRUE(image_codec_is_compressed(compressed, compressed_size));
+    assert_decoded("zstd", compressed, compressed_size);
+#else
+    TEST_IGNORE_MESSAGE("Built without zstd");
+#endif
+}
+
+void test_zstd_truncated(void){
+#ifdef MDFU_HAVE_ZSTD
+    zstd_compress();
+    assert_truncated(compressed_size - 1);
+    assert_truncated(compressed_size / 2);
+#else
+    TEST_IGNORE_MESSAGE("Built without zstd");
+#endif
+}
+
+#ifdef MDFU_HAVE_LZ4
+static void lz4_compress(void){
+    size_t bound = LZ4F_compressFrameBound(IMAGE_SIZE, NULL);
+
+    compressed = malloc(bound);
+    TEST_ASSERT_NOT_NULL(compressed);
+    compressed_size = LZ4F_compressFrame(compressed, bound, image, IMAGE_SIZE, NULL);
+    TEST_ASSERT_FALSE(LZ4F_isError(compressed_size));
+}
+#endif
+
+void test_lz4(void){
+#ifdef MDFU_HAVE_LZ4
+    lz4_compress();
+    TEST_ASSERT_TRUE(image_codec_is_compressed(compressed, compressed_size));
+    assert_decoded("lz4", compressed, compressed_size);
+#else
+    TEST_IGNORE_MESSAGE("Built without lz4");
+#endif
+}
+
+void test_lz4_truncated(void){
+#ifdef MDFU_HAVE_LZ4
+    lz4_compress();
+    assert_truncated(compressed_size - 1);
+    assert_truncated(compressed_size / 2);
+#else
+    TEST_IGNORE_MESSAGE("Built without lz4");
+#endif
+}
@@ -4,7 +4,7 @@
 #include "mdfu/mdfu.h"
 #include "mdfu/logging.h"
 
-extern int mdfu_get_packet_buffer(mdfu_packet_t *cmd_packet, mdfu_packet_t *status_packet);
+extern int mdfu_get_packet_buffer(mdfu_session_t *session, mdfu_packet_t *cmd_packet, mdfu_packet_t *status_packet);
 extern void mdfu_log_packet(mdfu_packet_t *cmd_packet, mdfu_packet_type_t type);
 extern ssize_t mdfu_encode_cmd_packet(mdfu_packet_t *mdfu_packet);
 extern int mdfu_decode_packet(mdfu_packet_t *mdfu_packet, mdfu_packet_type_t type, int packet_size);
@@ -0,0 +1,819 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "cmock.h"
+#include "mdfu/mdfu.c"
+#include "mdfu/transport/transport.h"
+#include "mdfu/transport/serial_transport.h"
+#include "mdfu/transport/serial_framing.h"
+#include "mdfu/transport/serial_frame_cache.h"
+#include "mdfu/transport/frame_trace.h"
+#include "mdfu/transport/spi_transport.h"
+#include "mdfu/transport/i2c_transport.h"
+#include "mdfu/transport/poll_policy.h"
+#include "mdfu/checksum.h"
+#include "mdfu/mac/mac.h"
+#include "mdfu/timeout.h"
+#include "mdfu/logging.h"
+#include "mock_mac_functions.h"
+
+TEST_FILE("serial_transport_buffered.c")
+
+#define CLIENT_BUFFER_SIZE 16
+#define CLIENT_TIMEOUT 10           // 1 s in 0.1 s units
+#define RESPONSE_DELAY_NS 1000000LL
+#define IMAGE_SIZE 200              // 12 full chunks and one with 8 bytes
+#define IMAGE_CHUNKS ((IMAGE_SIZE + CLIENT_BUFFER_SIZE - 1) / CLIENT_BUFFER_SIZE)
+#define MAX_RESPONSES 64
+#define MAX_LOG 256
+#define RESPONSE_MAX_SIZE SERIAL_FRAME_MAX_SIZE(MDFU_PACKET_DEFAULT_SIZE)
+
+typedef enum {
+    FAULT_NONE,
+    FAULT_DROP,     // Command is lost, the client does not respond
+    FAULT_RESEND,   // Client requests resending the command
+    FAULT_MUTE,     // Command is executed but the response is lost
+    FAULT_CORRUPT,  // Command is executed but the response fails the frame check
+    FAULT_RUNT,     // Command is executed but the response is too short
+    FAULT_ABORT     // Command is executed and fails
+} fault_t;
+
+/**
+ * @brief Simulated client behind the mock MAC.
+ *
+ * Decodes the command frames that the host writes, handles the sequence
+ * numbers like a client and queues the response frames that the host reads
+ * after RESPONSE_DELAY_NS of virtual time.
+ */
+static struct {
+    uint8_t buffer_count;
+    uint8_t sequence_number;
+    uint8_t last_response[MDFU_PACKET_DEFAULT_SIZE];
+    int last_response_size;
+    uint8_t image[IMAGE_SIZE];
+    int image_size;
+    int command_count[MAX_MDFU_CMD];
+    struct {
+        fault_t type;
+        uint8_t command;
+        int occurrence;
+        int count;
+    } fault;
+    // Commands received from the host
+    uint8_t rx[RESPONSE_MAX_SIZE];
+    int rx_size;
+    bool in_frame;
+    uint8_t log_command[MAX_LOG];
+    uint8_t log_sequence_number[MAX_LOG];
+    int log_count;
+    // Responses not yet read by the host
+    struct {
+        uint8_t frame[RESPONSE_MAX_SIZE];
+        int size;
+        long long ready;
+    } responses[MAX_RESPONSES];
+    int response_head;
+    int response_count;
+    int response_offset;
+    int max_queued;
+} client;
+
+static timeout_virtual_clock_t virtual_clock;
+static transport_t *transport;
+static mdfu_session_t *session;
+static int pipe_fds[2];  // Never written, the read end is the MAC file descriptor
+
+static const mac_t mock_mac_ops = {
+    .init = mac_init,
+    .open = mac_open,
+    .close = mac_close,
+    .read = mac_read,
+    .write = mac_write,
+    .get_fd = mac_get_fd,
+    .has_data = mac_has_data
+};
+
+static struct {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+} image;
+
+static int image_open(const image_reader_t *reader, const char *fpath){
+    return 0;
+}
+
+static int image_close(const image_reader_t *reader){
+    return 0;
+}
+
+static ssize_t image_read(const image_reader_t *reader, void *data, size_t size){
+    if(size > image.size - image.offset){
+        size = image.size - image.offset;
+    }
+    memcpy(data, &image.data[image.offset], size);
+    image.offset += size;
+    return (ssize_t) size;
+}
+
+static const image_reader_t image_reader = {
+    .open = image_open,
+    .close = image_close,
+    .read = image_read
+};
+
+static uint8_t image_data[IMAGE_SIZE];
+
+static long long clock_ns(void){
+    return (long long) virtual_clock.time.tv_sec * 1000000000LL + virtual_clock.time.tv_nsec;
+}
+
+static int client_info_encode(uint8_t *data){
+    int size = 0;
+
+    data[size++] = 1; // protocol version
+    data[size++] = 3;
+    data[size++] = MDFU_PROTOCOL_VERSION_MAJOR;
+    data[size++] = MDFU_PROTOCOL_VERSION_MINOR;
+    data[size++] = MDFU_PROTOCOL_VERSION_PATCH;
+    data[size++] = 2; // buffer info
+    data[size++] = 3;
+    data[size++] = CLIENT_BUFFER_SIZE;
+    data[size++] = 0;
+    data[size++] = client.buffer_count;
+    data[size++] = 3; // default command timeout
+    data[size++] = 3;
+    data[size++] = 0;
+    data[size++] = CLIENT_TIMEOUT;
+    data[size++] = 0;
+    return size;
+}
+
+static void client_queue_response(int size, const uint8_t *packet, fault_t fault){
+    uint8_t runt[1] = {packet[0]};
+    long long ready = clock_ns();
+    uint16_t frame_check_sequence;
+
+    if(FAULT_MUTE == fault){
+        return;
+    }
+    if(FAULT_RUNT == fault){
+        size = sizeof(runt);
+        packet = runt;
+    }
+    TEST_ASSERT(client.response_count < MAX_RESPONSES);
+    // Responses are sent in order
+    if(client.response_count > 0){
+        int last = (client.response_head + client.response_count - 1) % MAX_RESPONSES;
+        if(client.responses[last].ready > ready){
+            ready = client.responses[last].ready;
+        }
+    }
+    int index = (client.response_head + client.response_count) % MAX_RESPONSES;
+    client.responses[index].size = serial_frame_encode(size, packet, client.responses[index].frame, &frame_check_sequence);
+    client.responses[index].ready = ready + RESPONSE_DELAY_NS;
+    if(FAULT_CORRUPT == fault){
+        client.responses[index].frame[1] ^= 0x01;
+    }
+    client.response_count += 1;
+    if(client.response_count > client.max_queued){
+        client.max_queued = client.response_count;
+    }
+}
+
+static bool client_response_ready(void){
+    return client.response_count > 0 && client.responses[client.response_head].ready <= clock_ns();
+}
+
+static void client_handle_command(int size, const uint8_t *packet){
+    uint8_t response[MDFU_PACKET_DEFAULT_SIZE];
+    int response_size = 2;
+    uint8_t sequence_number = packet[0] & MDFU_HEADER_SEQUENCE_NUMBER;
+    uint8_t command = packet[1];
+    fault_t fault = FAULT_NONE;
+
+    TEST_ASSERT(client.log_count < MAX_LOG);
+    client.log_command[client.log_count] = command;
+    client.log_sequence_number[client.log_count] = sequence_number;
+    client.log_count += 1;
+    if(command < MAX_MDFU_CMD){
+        client.command_count[command] += 1;
+        if(command == client.fault.command && client.command_count[command] >= client.fault.occurrence &&
+            client.command_count[command] < client.fault.occurrence + client.fault.count){
+            fault = client.fault.type;
+        }
+    }
+    if(FAULT_DROP == fault){
+        return;
+    }
+    response[0] = sequence_number;
+    if(FAULT_RESEND == fault){
+        response[0] |= MDFU_HEADER_RESEND;
+        response[1] = COMMAND_NOT_EXECUTED;
+        response[2] = TRANSPORT_INTEGRITY_CHECK_ERROR;
+        client_queue_response(3, response, FAULT_NONE);
+        return;
+    }
+    if(packet[0] & MDFU_HEADER_SYNC){
+        client.sequence_number = sequence_number;
+    }
+    if(sequence_number == ((client.sequence_number - 1) & MDFU_HEADER_SEQUENCE_NUMBER) && client.last_response_size > 0){
+        client_queue_response(client.last_response_size, client.last_response, fault);
+        return;
+    }
+    if(sequence_number != client.sequence_number){
+        response[1] = COMMAND_NOT_EXECUTED;
+        response[2] = SEQUENCE_NUMBER_INVALID;
+        client_queue_response(3, response, fault);
+        return;
+    }
+    response[1] = SUCCESS;
+    if(FAULT_ABORT == fault){
+        response[1] = ABORT_FILE_TRANSFER;
+        response[response_size++] = GENERIC_CLIENT_ERROR;
+        command = MAX_MDFU_CMD;
+    }
+    switch(command){
+        case GET_CLIENT_INFO:
+            response_size += client_info_encode(&response[2]);
+            break;
+        case START_TRANSFER:
+            client.image_size = 0;
+            break;
+        case WRITE_CHUNK:
+            TEST_ASSERT(client.image_size + size - 2 <= IMAGE_SIZE);
+            memcpy(&client.image[client.image_size], &packet[2], (size_t) (size - 2));
+            client.image_size += size - 2;
+            break;
+        case GET_IMAGE_STATE:
+            response[response_size++] = VALID;
+            break;
+        default:
+            break;
+    }
+    client.sequence_number = (client.sequence_number + 1) & MDFU_HEADER_SEQUENCE_NUMBER;
+    memcpy(client.last_response, response, (size_t) response_size);
+    client.last_response_size = response_size;
+    client_queue_response(response_size, response, fault);
+}
+
+static int mac_write_callback(mac_t *mac, int size, uint8_t *data, int cmock_num_calls){
+    uint8_t packet[MDFU_PACKET_DEFAULT_SIZE + FRAME_CHECK_SEQUENCE_SIZE];
+    int packet_size;
+
+    for(int i = 0; i < size; i++){
+        if(FRAME_START_CODE == data[i]){
+            client.in_frame = true;
+            client.rx_size = 0;
+        }else if(FRAME_END_CODE == data[i] && client.in_frame){
+            client.in_frame = false;
+            packet_size = serial_frame_decode_payload(client.rx_size, client.rx, sizeof(packet), packet);
+            TEST_ASSERT(packet_size >= 2 + FRAME_CHECK_SEQUENCE_SIZE);
+            packet_size -= FRAME_CHECK_SEQUENCE_SIZE;
+            TEST_ASSERT_EQUAL_HEX16(calculate_crc16(packet_size, packet),
+                                    packet[packet_size] | (packet[packet_size + 1] << 8));
+            client_handle_command(packet_size, packet);
+        }else if(client.in_frame){
+            TEST_ASSERT(client.rx_size < (int) sizeof(client.rx));
+            client.rx[client.rx_size++] = data[i];
+        }
+    }
+    return size;
+}
+
+static int mac_read_callback(mac_t *mac, int size, uint8_t *data, int cmock_num_calls){
+    int count = 0;
+
+    while(count < size && client_response_ready()){
+        int index = client.response_head;
+        int chunk = client.responses[index].size - client.response_offset;
+
+        if(chunk > size - count){
+            chunk = size - count;
+        }
+        memcpy(&data[count], &client.responses[index].frame[client.response_offset], (size_t) chunk);
+        count += chunk;
+        client.response_offset += chunk;
+        if(client.response_offset == client.responses[index].size){
+            client.response_offset = 0;
+            client.response_head = (client.response_head + 1) % MAX_RESPONSES;
+            client.response_count -= 1;
+        }
+    }
+    if(0 == count){
+        // Wait for the next response like a MAC read that blocks for a while
+        if(client.response_count > 0){
+            timeout_virtual_clock_advance(&virtual_clock, client.responses[client.response_head].ready - clock_ns());
+        }else{
+            timeout_virtual_clock_advance(&virtual_clock, RESPONSE_DELAY_NS);
+        }
+    }
+    return count;
+}
+
+static bool mac_has_data_callback(mac_t *mac, int cmock_num_calls){
+    // Like a MAC that received the response into its buffer
+    return client_response_ready();
+}
+
+/**
+ * @brief Injects a fault for count commands, starting with the n-th one that is received.
+ */
+static void client_faults(fault_t type, uint8_t command, int occurrence, int count){
+    client.fault.type = type;
+    client.fault.command = command;
+    client.fault.occurrence = occurrence;
+    client.fault.count = count;
+}
+
+static void client_fault(fault_t type, uint8_t command, int occurrence){
+    client_faults(type, command, occurrence, 1);
+}
+
+/**
+ * @brief Index of the first WRITE_CHUNK command that was sent again.
+ */
+static int first_retransmission(void){
+    for(int i = 1; i < client.log_count; i++){
+        if(WRITE_CHUNK != client.log_command[i]){
+            continue;
+        }
+        for(int j = 0; j < i; j++){
+            if(WRITE_CHUNK == client.log_command[j] && client.log_sequence_number[j] == client.log_sequence_number[i]){
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Sequence number of the n-th WRITE_CHUNK command that was received.
+ */
+static uint8_t write_chunk_sequence_number(int occurrence){
+    for(int i = 0; i < client.log_count; i++){
+        if(WRITE_CHUNK == client.log_command[i] && 0 == --occurrence){
+            return client.log_sequence_number[i];
+        }
+    }
+    TEST_FAIL_MESSAGE("WRITE_CHUNK command was not received");
+    return 0;
+}
+
+/**
+ * @brief Number of WRITE_CHUNK commands received with a sequence number.
+ */
+static int write_chunk_count(uint8_t sequence_number){
+    int count = 0;
+
+    for(int i = 0; i < client.log_count; i++){
+        if(WRITE_CHUNK == client.log_command[i] && client.log_sequence_number[i] == sequence_number){
+            count += 1;
+        }
+    }
+    return count;
+}
+
+static void session_open(uint8_t buffer_count){
+    mac_t *mac;
+
+    client.buffer_count = buffer_count;
+    TEST_ASSERT_EQUAL(0, mac_alloc(&mock_mac_ops, 0, &mac));
+    TEST_ASSERT_EQUAL(0, get_serial_transport(&transport));
+    TEST_ASSERT_EQUAL(0, transport->init(transport, mac, 0));
+    TEST_ASSERT_EQUAL(0, mdfu_session_create(&session, transport, MDFU_RETRY_BUDGET_DEFAULT));
+    TEST_ASSERT_EQUAL(0, mdfu_open(session));
+}
+
+static void assert_image_written(void){
+    TEST_ASSERT_EQUAL(IMAGE_SIZE, client.image_size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(image_data, client.image, IMAGE_SIZE);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS, session->stats.cmd[WRITE_CHUNK].count);
+}
+
+void setUp(void){
+    init_logging(stderr);
+    set_debug_level(ERRORLEVEL);
+    memset(&client, 0, sizeof(client));
+    for(int i = 0; i < IMAGE_SIZE; i++){
+        image_data[i] = (uint8_t) (i * 7);
+    }
+    image.data = image_data;
+    image.size = IMAGE_SIZE;
+    image.offset = 0;
+    timeout_virtual_clock_init(&virtual_clock);
+    timeout_set_clock(&virtual_clock.clock);
+    mac_open_IgnoreAndReturn(0);
+    mac_close_IgnoreAndReturn(0);
+    mac_init_IgnoreAndReturn(0);
+    mac_write_StubWithCallback(mac_write_callback);
+    mac_read_StubWithCallback(mac_read_callback);
+    TEST_ASSERT_EQUAL(0, pipe(pipe_fds));
+    mac_get_fd_IgnoreAndReturn(pipe_fds[0]);
+    mac_has_data_StubWithCallback(mac_has_data_callback);
+    session = NULL;
+}
+
+void tearDown(void){
+    if(NULL != session){
+        mdfu_close(session);
+        mdfu_session_destroy(session);
+    }
+    timeout_set_clock(NULL);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+void test_window_fills_client_buffers(void){
+    session_open(4);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(4, client.max_queued);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS, session->stats.cmd[WRITE_CHUNK].attempts);
+    TEST_ASSERT_EQUAL(-1, first_retransmission());
+}
+
+void test_window_single_client_buffer(void){
+    session_open(1);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, client.max_queued);
+}
+
+void test_window_lost_response_acknowledged_by_later_response(void){
+    session_open(4);
+    client_fault(FAULT_MUTE, WRITE_CHUNK, 2);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS, session->stats.cmd[WRITE_CHUNK].attempts);
+    TEST_ASSERT_EQUAL(0, session->stats.retries_timeout);
+}
+
+void test_window_resend_from_oldest_slot(void){
+    int index;
+
+    session_open(4);
+    client_fault(FAULT_RESEND, WRITE_CHUNK, 3);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_not_executed[TRANSPORT_INTEGRITY_CHECK_ERROR]);
+    // The command that the client asked for is sent again first, followed by
+    // the commands after it that the client rejected
+    index = first_retransmission();
+    TEST_ASSERT_GREATER_THAN(0, index);
+    TEST_ASSERT_EQUAL(write_chunk_sequence_number(3), client.log_sequence_number[index]);
+    TEST_ASSERT_EQUAL((write_chunk_sequence_number(3) + 1) & MDFU_HEADER_SEQUENCE_NUMBER, client.log_sequence_number[index + 1]);
+}
+
+void test_window_sequence_number_invalid(void){
+    int index;
+
+    session_open(4);
+    client_fault(FAULT_DROP, WRITE_CHUNK, 3);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_GREATER_OR_EQUAL(1, session->stats.retries_not_executed[SEQUENCE_NUMBER_INVALID]);
+    TEST_ASSERT_EQUAL(0, session->stats.retries_timeout);
+    index = first_retransmission();
+    TEST_ASSERT_GREATER_THAN(0, index);
+    TEST_ASSERT_EQUAL(write_chunk_sequence_number(3), client.log_sequence_number[index]);
+}
+
+void test_window_corrupted_response_acknowledged_by_later_response(void){
+    session_open(4);
+    client_fault(FAULT_CORRUPT, WRITE_CHUNK, 2);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->transport->stats.integrity_errors);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS, session->stats.cmd[WRITE_CHUNK].attempts);
+    TEST_ASSERT_EQUAL(0, session->stats.retries_integrity);
+}
+
+void test_window_malformed_last_response(void){
+    session_open(4);
+    client_fault(FAULT_RUNT, WRITE_CHUNK, IMAGE_CHUNKS);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    // The client answers the retransmitted command with its last response
+    TEST_ASSERT_EQUAL(1, session->stats.retries_integrity);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS + 1, session->stats.cmd[WRITE_CHUNK].attempts);
+}
+
+void test_window_response_timeout(void){
+    session_open(4);
+    client_fault(FAULT_MUTE, WRITE_CHUNK, IMAGE_CHUNKS);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_timeout);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS + 1, session->stats.cmd[WRITE_CHUNK].attempts);
+}
+
+/**
+ * @brief Drives a step driven update like an event loop that polls the file descriptor.
+ */
+static int step_update(void){
+    int status;
+
+    TEST_ASSERT_EQUAL(0, mdfu_session_start_update(session, &image_reader));
+    TEST_ASSERT_EQUAL(pipe_fds[0], mdfu_session_get_fd(session));
+    for(int i = 0; i < 100000; i++){
+        status = mdfu_session_step(session);
+        if(MDFU_STEP_PENDING != status){
+            return status;
+        }
+        if(mdfu_session_next_deadline(session) > 0){
+            timeout_virtual_clock_advance(&virtual_clock, RESPONSE_DELAY_NS / 4);
+        }
+    }
+    TEST_FAIL_MESSAGE("Step driven update did not finish");
+    return MDFU_STEP_FAILED;
+}
+
+void test_step_update(void){
+    session_open(4);
+
+    TEST_ASSERT_EQUAL(MDFU_STEP_DONE, step_update());
+    assert_image_written();
+    TEST_ASSERT_EQUAL(GET_CLIENT_INFO, client.log_command[0]);
+    TEST_ASSERT_EQUAL(START_TRANSFER, client.log_command[1]);
+    for(int i = 0; i < IMAGE_CHUNKS; i++){
+        TEST_ASSERT_EQUAL(WRITE_CHUNK, client.log_command[2 + i]);
+    }
+    TEST_ASSERT_EQUAL(GET_IMAGE_STATE, client.log_command[2 + IMAGE_CHUNKS]);
+    TEST_ASSERT_EQUAL(END_TRANSFER, client.log_command[3 + IMAGE_CHUNKS]);
+    TEST_ASSERT_EQUAL(4 + IMAGE_CHUNKS, client.log_count);
+    // Only one command is in flight at a time
+    TEST_ASSERT_EQUAL(1, client.max_queued);
+    TEST_ASSERT_EQUAL(MDFU_STEP_DONE, mdfu_session_step(session));
+}
+
+void test_step_pending_until_response_arrives(void){
+    session_open(4);
+
+    TEST_ASSERT_EQUAL(0, mdfu_session_start_update(session, &image_reader));
+    TEST_ASSERT_EQUAL(1, client.log_count);
+    TEST_ASSERT_EQUAL(MDFU_STEP_PENDING, mdfu_session_step(session));
+    TEST_ASSERT_EQUAL(1, client.response_count);
+    TEST_ASSERT_GREATER_THAN(0, mdfu_session_next_deadline(session));
+
+    // The response is in the MAC buffer, which does not make the file descriptor readable
+    timeout_virtual_clock_advance(&virtual_clock, RESPONSE_DELAY_NS);
+    TEST_ASSERT_EQUAL(0, mdfu_session_next_deadline(session));
+    TEST_ASSERT_EQUAL(MDFU_STEP_PENDING, mdfu_session_step(session));
+    TEST_ASSERT_EQUAL(2, client.log_count);
+    TEST_ASSERT_EQUAL(START_TRANSFER, client.log_command[1]);
+}
+
+void test_step_response_timeout(void){
+    session_open(4);
+    client_fault(FAULT_MUTE, START_TRANSFER, 1);
+
+    TEST_ASSERT_EQUAL(MDFU_STEP_DONE, step_update());
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_timeout);
+    TEST_ASSERT_EQUAL(2, client.command_count[START_TRANSFER]);
+}
+
+void test_step_resend_request(void){
+    session_open(4);
+    client_fault(FAULT_RESEND, WRITE_CHUNK, 2);
+
+    TEST_ASSERT_EQUAL(MDFU_STEP_DONE, step_update());
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_not_executed[TRANSPORT_INTEGRITY_CHECK_ERROR]);
+    TEST_ASSERT_EQUAL(0, session->stats.retries_timeout);
+}
+
+void test_transport_has_data(void){
+    const uint8_t response[] = {0x00, SUCCESS};
+    uint8_t data[MDFU_PACKET_DEFAULT_SIZE];
+    bool has_data;
+    int size;
+
+    session_open(4);
+    TEST_ASSERT_EQUAL(0, transport->ioctl(transport, TRANSPORT_IOC_HAS_DATA, &has_data));
+    TEST_ASSERT_FALSE(has_data);
+
+    client_queue_response(sizeof(response), response, FAULT_NONE);
+    client_queue_response(sizeof(response), response, FAULT_NONE);
+    timeout_virtual_clock_advance(&virtual_clock, 2 * RESPONSE_DELAY_NS);
+    TEST_ASSERT_EQUAL(0, transport->ioctl(transport, TRANSPORT_IOC_HAS_DATA, &has_data));
+    TEST_ASSERT_TRUE(has_data);
+
+    // Both responses are read from the MAC and the second one stays in the transport buffer
+    TEST_ASSERT_EQUAL(0, transport->read(transport, &size, data, 1.0f));
+    TEST_ASSERT_EQUAL(0, client.response_count);
+    TEST_ASSERT_EQUAL(0, transport->ioctl(transport, TRANSPORT_IOC_HAS_DATA, &has_data));
+    TEST_ASSERT_TRUE(has_data);
+
+    TEST_ASSERT_EQUAL(0, transport->read(transport, &size, data, 1.0f));
+    TEST_ASSERT_EQUAL(0, transport->ioctl(transport, TRANSPORT_IOC_HAS_DATA, &has_data));
+    TEST_ASSERT_FALSE(has_data);
+}
+
+void test_rtt_estimator(void){
+    session_open(1);
+
+    rtt_sample(session, WRITE_CHUNK, 0.1f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1f, session->rtt[WRITE_CHUNK].srtt);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.05f, session->rtt[WRITE_CHUNK].rttvar);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.3f, session->rtt[WRITE_CHUNK].rto);
+
+    // rttvar = 0.75 * 0.05 + 0.25 * 0.1, srtt = 0.875 * 0.1 + 0.125 * 0.2
+    rtt_sample(session, WRITE_CHUNK, 0.2f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1125f, session->rtt[WRITE_CHUNK].srtt);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.0625f, session->rtt[WRITE_CHUNK].rttvar);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.3625f, session->rtt[WRITE_CHUNK].rto);
+
+    // Other commands keep their own estimate
+    TEST_ASSERT_EQUAL_FLOAT(0, session->rtt[GET_IMAGE_STATE].rto);
+}
+
+void test_rtt_estimator_limits(void){
+    session_open(1);
+
+    rtt_sample(session, WRITE_CHUNK, 0.001f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, MDFU_RTO_MIN, session->rtt[WRITE_CHUNK].rto);
+
+    // Constant round trip times leave the granularity as margin
+    for(int i = 0; i < 100; i++){
+        rtt_sample(session, GET_IMAGE_STATE, 0.1f);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 0.1f + MDFU_RTO_GRANULARITY, session->rtt[GET_IMAGE_STATE].rto);
+}
+
+void test_response_timeout(void){
+    session_open(1);
+
+    // The client command timeout is used until a round trip time was measured
+    TEST_ASSERT_EQUAL_FLOAT(MDFU_CLIENT_INFO_CMD_TIMEOUT, get_response_timeout(session, WRITE_CHUNK));
+    rtt_sample(session, WRITE_CHUNK, 0.1f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.3f, get_response_timeout(session, WRITE_CHUNK));
+
+    rtt_backoff(session, WRITE_CHUNK);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.6f, get_response_timeout(session, WRITE_CHUNK));
+    // Limited to the client command timeout
+    rtt_backoff(session, WRITE_CHUNK);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, MDFU_CLIENT_INFO_CMD_TIMEOUT, session->rtt[WRITE_CHUNK].rto);
+    TEST_ASSERT_EQUAL_FLOAT(MDFU_CLIENT_INFO_CMD_TIMEOUT, get_response_timeout(session, WRITE_CHUNK));
+
+    rtt_sample(session, WRITE_CHUNK, 0.8f);
+    TEST_ASSERT_EQUAL_FLOAT(MDFU_CLIENT_INFO_CMD_TIMEOUT, get_response_timeout(session, WRITE_CHUNK));
+}
+
+void test_retry_budget(void){
+    session_open(1);
+
+    for(int i = 0; i < MDFU_RETRY_BUDGET_DEFAULT; i++){
+        TEST_ASSERT_TRUE(retry_budget_withdraw(session));
+    }
+    TEST_ASSERT_FALSE(retry_budget_withdraw(session));
+
+    // Completed commands refill the budget in fractions of a retry
+    retry_budget_deposit(session, 9);
+    TEST_ASSERT_FALSE(retry_budget_withdraw(session));
+    retry_budget_deposit(session, 1);
+    TEST_ASSERT_TRUE(retry_budget_withdraw(session));
+
+    retry_budget_deposit(session, 1000);
+    TEST_ASSERT_EQUAL_FLOAT(MDFU_RETRY_BUDGET_DEFAULT, session->retry_budget);
+}
+
+void test_retry_budget_exhausted(void){
+    session_open(1);
+    client_faults(FAULT_DROP, WRITE_CHUNK, 2, 1000);
+
+    TEST_ASSERT_EQUAL(-1, mdfu_run_update(session, &image_reader));
+    // The first chunk and the second one with all retries of the budget
+    TEST_ASSERT_EQUAL(2 + MDFU_RETRY_BUDGET_DEFAULT, client.command_count[WRITE_CHUNK]);
+    TEST_ASSERT_EQUAL(1 + MDFU_RETRY_BUDGET_DEFAULT, session->transport->stats.timeouts);
+}
+
+void test_window_retry_budget_exhausted(void){
+    session_open(4);
+    client_faults(FAULT_DROP, WRITE_CHUNK, 2, 1000);
+
+    TEST_ASSERT_EQUAL(-1, mdfu_run_update(session, &image_reader));
+    TEST_ASSERT_EQUAL(1, session->stats.cmd[WRITE_CHUNK].count);
+    // The window is sent again once for each retry of the budget
+    TEST_ASSERT_EQUAL(1 + MDFU_RETRY_BUDGET_DEFAULT, write_chunk_count(write_chunk_sequence_number(2)));
+}
+
+void test_corrupted_response_resent_without_timeout(void){
+    session_open(1);
+    client_fault(FAULT_CORRUPT, WRITE_CHUNK, 2);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_integrity);
+    TEST_ASSERT_EQUAL(0, session->stats.retries_timeout);
+    TEST_ASSERT_EQUAL(IMAGE_CHUNKS + 1, client.command_count[WRITE_CHUNK]);
+}
+
+void test_lost_response_detected_before_client_timeout(void){
+    session_open(4);
+    client_fault(FAULT_MUTE, WRITE_CHUNK, IMAGE_CHUNKS);
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(1, session->stats.retries_timeout);
+    // The response timeout follows the round trip times of about RESPONSE_DELAY_NS
+    TEST_ASSERT_LESS_THAN(CLIENT_TIMEOUT * 100000000LL, clock_ns());
+}
+
+/**
+ * @brief Gets the client information that the simulated client reports.
+ */
+static void client_info_get(client_info_t *client_info){
+    uint8_t data[32];
+
+    TEST_ASSERT_EQUAL(0, mdfu_decode_client_info(data, client_info_encode(data), client_info));
+}
+
+static void assert_client_info_equal(const client_info_t *expected, const client_info_t *actual){
+    TEST_ASSERT_EQUAL(expected->version.major, actual->version.major);
+    TEST_ASSERT_EQUAL(expected->version.minor, actual->version.minor);
+    TEST_ASSERT_EQUAL(expected->version.patch, actual->version.patch);
+    TEST_ASSERT_EQUAL(expected->buffer_count, actual->buffer_count);
+    TEST_ASSERT_EQUAL(expected->buffer_size, actual->buffer_size);
+    TEST_ASSERT_EQUAL(expected->default_timeout, actual->default_timeout);
+    TEST_ASSERT_EQUAL(expected->inter_transaction_delay, actual->inter_transaction_delay);
+}
+
+void test_client_info_preloaded(void){
+    client_info_t client_info;
+    client_info_t confirmed;
+
+    session_open(4);
+    client_info_get(&client_info);
+    TEST_ASSERT_EQUAL(0, mdfu_session_set_client_info(session, &client_info));
+    TEST_ASSERT_FALSE(mdfu_session_get_confirmed_client_info(session, &confirmed));
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(0, client.command_count[GET_CLIENT_INFO]);
+    TEST_ASSERT_EQUAL(START_TRANSFER, client.log_command[0]);
+    TEST_ASSERT_EQUAL(4, client.max_queued);
+    TEST_ASSERT_TRUE(mdfu_session_get_confirmed_client_info(session, &confirmed));
+    assert_client_info_equal(&client_info, &confirmed);
+}
+
+void test_client_info_stale(void){
+    client_info_t client_info;
+    client_info_t reported;
+    client_info_t confirmed;
+
+    session_open(4);
+    client_info_get(&reported);
+    client_info = reported;
+    client_info.buffer_count = 2;
+    TEST_ASSERT_EQUAL(0, mdfu_session_set_client_info(session, &client_info));
+    client_fault(FAULT_ABORT, START_TRANSFER, 1);
+
+    // The failed command is sent again after requesting the client information
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(START_TRANSFER, client.log_command[0]);
+    TEST_ASSERT_EQUAL(GET_CLIENT_INFO, client.log_command[1]);
+    TEST_ASSERT_EQUAL(START_TRANSFER, client.log_command[2]);
+    TEST_ASSERT_EQUAL(WRITE_CHUNK, client.log_command[3]);
+    TEST_ASSERT_EQUAL(4, client.max_queued);
+    TEST_ASSERT_TRUE(mdfu_session_get_confirmed_client_info(session, &confirmed));
+    assert_client_info_equal(&reported, &confirmed);
+}
+
+void test_client_info_failure_without_preloaded_info(void){
+    session_open(4);
+    client_fault(FAULT_ABORT, START_TRANSFER, 1);
+
+    TEST_ASSERT_EQUAL(-1, mdfu_run_update(session, &image_reader));
+    TEST_ASSERT_EQUAL(1, client.command_count[GET_CLIENT_INFO]);
+    TEST_ASSERT_EQUAL(1, client.command_count[START_TRANSFER]);
+}
+
+void test_client_info_discarded_on_open(void){
+    client_info_t client_info;
+    client_info_t confirmed;
+
+    session_open(4);
+    client_info_get(&client_info);
+    TEST_ASSERT_EQUAL(0, mdfu_session_set_client_info(session, &client_info));
+    TEST_ASSERT_EQUAL(0, mdfu_close(session));
+    TEST_ASSERT_EQUAL(0, mdfu_open(session));
+
+    TEST_ASSERT_EQUAL(0, mdfu_run_update(session, &image_reader));
+    assert_image_written();
+    TEST_ASSERT_EQUAL(GET_CLIENT_INFO, client.log_command[0]);
+    TEST_ASSERT_TRUE(mdfu_session_get_confirmed_client_info(session, &confirmed));
+    assert_client_info_equal(&client_info, &confirmed);
+}
@@ -22,13 +22,14 @@ void test_socket_mac(void){
         .port = 5558
     };
     get_socket_mac(&mac);
-    mac->init((void *) &conf);
+    mac->init(mac, (void *) &conf);
 
-    mac->open();
+    mac->open(mac);
     //mac.write(sizeof(get_transfer_parameters_mdfu_packet), get_transfer_parameters_mdfu_packet);
     //mac.read(sizeof(message), buffer);
 
-    mac->close();
+    mac->close(mac);
+    mac_free(mac);
 
     //TEST_ASSERT_EQUAL_STRING(&message, buffer);
 }
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include <errno.h>
+#include "unity.h"
+#include "mdfu/mdfu.h"
+#include "mdfu/transport/poll_policy.h"
+#include "mdfu/timeout.h"
+#include "mdfu/logging.h"
+
+static timeout_virtual_clock_t virtual_clock;
+static poll_policy_t policy;
+static const uint8_t write_chunk_packet[] = {0x01, WRITE_CHUNK, 0x00};
+
+/**
+ * @brief Send a WRITE_CHUNK command and receive its response after response_time seconds.
+ */
+static void transaction(float response_time){
+    poll_policy_command_sent(&policy, write_chunk_packet, 0.001f);
+    timeout_virtual_clock_advance(&virtual_clock, (long long) (response_time * 1e9f));
+    poll_policy_response_received(&policy);
+}
+
+void setUp(void){
+    init_logging(stderr);
+    set_debug_level(ERRORLEVEL);
+    timeout_virtual_clock_init(&virtual_clock);
+    timeout_set_clock(&virtual_clock.clock);
+}
+
+void tearDown(void){
+    timeout_set_clock(NULL);
+}
+
+void test_fixed_polls_after_inter_transaction_delay(void){
+    poll_policy_init(&policy, POLL_POLICY_FIXED);
+    transaction(0.1f);
+
+    TEST_ASSERT_EQUAL_FLOAT(0.001f, poll_policy_command_sent(&policy, write_chunk_packet, 0.001f));
+    TEST_ASSERT_EQUAL_FLOAT(0.001f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_EQUAL_FLOAT(0.001f, poll_policy_busy(&policy, 0.001f));
+}
+
+void test_adaptive_first_poll_before_learned_response_time(void){
+    poll_policy_init(&policy, POLL_POLICY_ADAPTIVE);
+
+    // Nothing learned yet
+    TEST_ASSERT_EQUAL_FLOAT(0.001f, poll_policy_command_sent(&policy, write_chunk_packet, 0.001f));
+    timeout_virtual_clock_advance(&virtual_clock, 100000000LL);
+    poll_policy_response_received(&policy);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1f, policy.latency[WRITE_CHUNK]);
+
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.075f, poll_policy_command_sent(&policy, write_chunk_packet, 0.001f));
+    // The inter transaction delay is the lower limit
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.2f, poll_policy_command_sent(&policy, write_chunk_packet, 0.2f));
+}
+
+void test_adaptive_response_time_per_command(void){
+    const uint8_t get_image_state_packet[] = {0x02, GET_IMAGE_STATE};
+
+    poll_policy_init(&policy, POLL_POLICY_ADAPTIVE);
+    transaction(0.1f);
+
+    TEST_ASSERT_EQUAL_FLOAT(0.001f, poll_policy_command_sent(&policy, get_image_state_packet, 0.001f));
+    TEST_ASSERT_EQUAL(GET_IMAGE_STATE, policy.command);
+}
+
+void test_adaptive_response_time_average(void){
+    poll_policy_init(&policy, POLL_POLICY_ADAPTIVE);
+    transaction(0.1f);
+    transaction(0.2f);
+
+    // 0.1 + 0.125 * (0.2 - 0.1)
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1125f, policy.latency[WRITE_CHUNK]);
+    transaction(0.1125f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1125f, policy.latency[WRITE_CHUNK]);
+}
+
+void test_adaptive_busy_backoff(void){
+    poll_policy_init(&policy, POLL_POLICY_ADAPTIVE);
+    transaction(0.2f);
+
+    poll_policy_command_sent(&policy, write_chunk_packet, 0.001f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.001f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.002f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.004f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.008f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.016f, poll_policy_busy(&policy, 0.001f));
+    // Limited to 0.125 of the response time
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.025f, poll_policy_busy(&policy, 0.001f));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.025f, poll_policy_busy(&policy, 0.001f));
+
+    // A new command starts over at the inter transaction delay
+    poll_policy_command_sent(&policy, write_chunk_packet, 0.001f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.001f, poll_policy_busy(&policy, 0.001f));
+}
+
+void test_adaptive_busy_backoff_limit(void){
+    float delay = 0;
+
+    poll_policy_init(&policy, POLL_POLICY_ADAPTIVE);
+    transaction(2.0f);
+
+    poll_policy_command_sent(&policy, write_chunk_packet, 0.001f);
+    for(int i = 0; i < 16; i++){
+        delay = poll_policy_busy(&policy, 0.001f);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.05f, delay);
+}
+
+void test_get_poll_policy_by_name(void){
+    poll_policy_type_t type;
+
+    TEST_ASSERT_EQUAL(0, get_poll_policy_by_name("fixed", &type));
+    TEST_ASSERT_EQUAL(POLL_POLICY_FIXED, type);
+    TEST_ASSERT_EQUAL(0, get_poll_policy_by_name("adaptive", &type));
+    TEST_ASSERT_EQUAL(POLL_POLICY_ADAPTIVE, type);
+    errno = 0;
+    TEST_ASSERT_EQUAL(-1, get_poll_policy_by_name("eager", &type));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+}
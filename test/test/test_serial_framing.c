@@ -0,0 +1,177 @@
+#include <string.h>
+#include <errno.h>
+#include "unity.h"
+#include "mdfu/transport/serial_framing.h"
+#include "mdfu/checksum.h"
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+/**
+ * @brief Reference encoder that escapes one byte at a time.
+ */
+static int encode_reference(int size, const uint8_t *data, uint8_t *encoded){
+    int n = 0;
+    for(int i = 0; i < size; i++){
+        if(data[i] == FRAME_START_CODE){
+            encoded[n++] = ESCAPE_SEQ_CODE;
+            encoded[n++] = FRAME_START_ESC_SEQ;
+        }else if(data[i] == FRAME_END_CODE){
+            encoded[n++] = ESCAPE_SEQ_CODE;
+            encoded[n++] = FRAME_END_ESC_SEQ;
+        }else if(data[i] == ESCAPE_SEQ_CODE){
+            encoded[n++] = ESCAPE_SEQ_CODE;
+            encoded[n++] = ESCAPE_SEQ_ESC_SEQ;
+        }else{
+            encoded[n++] = data[i];
+        }
+    }
+    return n;
+}
+
+void test_encode_payload_without_reserved_codes(void) {
+    uint8_t data[37];
+    uint8_t encoded[sizeof(data) * 2];
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (uint8_t) i;
+    }
+    int size = serial_frame_encode_payload(sizeof(data), data, encoded);
+    TEST_ASSERT_EQUAL(sizeof(data), size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, encoded, sizeof(data));
+}
+
+void test_encode_payload_reserved_codes(void) {
+    uint8_t data[] = {FRAME_START_CODE, 0x01, FRAME_END_CODE, ESCAPE_SEQ_CODE};
+    uint8_t expected[] = {ESCAPE_SEQ_CODE, FRAME_START_ESC_SEQ, 0x01,
+                          ESCAPE_SEQ_CODE, FRAME_END_ESC_SEQ,
+                          ESCAPE_SEQ_CODE, ESCAPE_SEQ_ESC_SEQ};
+    uint8_t encoded[sizeof(data) * 2];
+
+    int size = serial_frame_encode_payload(sizeof(data), data, encoded);
+    TEST_ASSERT_EQUAL(sizeof(expected), size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, encoded, sizeof(expected));
+}
+
+void test_encode_payload_matches_reference(void) {
+    uint8_t data[300];
+    uint8_t encoded[sizeof(data) * 2];
+    uint8_t expected[sizeof(data) * 2];
+
+    // Place reserved codes at every offset within a word
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (i % 13 == 0) ? FRAME_START_CODE : (i % 17 == 0) ? ESCAPE_SEQ_CODE :
+                  (i % 19 == 0) ? FRAME_END_CODE : (uint8_t) (i * 7);
+    }
+    for(int offset = 0; offset < 9; offset++){
+        int expected_size = encode_reference(sizeof(data) - offset, &data[offset], expected);
+        int size = serial_frame_encode_payload(sizeof(data) - offset, &data[offset], encoded);
+        TEST_ASSERT_EQUAL(expected_size, size);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, encoded, expected_size);
+    }
+}
+
+void test_encode_frame(void) {
+    // Frame check sequence is ~0xa933 = 0x56cc, both bytes are reserved codes
+    uint8_t data[] = {0x33, 0xa9};
+    uint8_t expected[] = {FRAME_START_CODE, 0x33, 0xa9, ESCAPE_SEQ_CODE, ESCAPE_SEQ_ESC_SEQ,
+                          ESCAPE_SEQ_CODE, FRAME_START_ESC_SEQ, FRAME_END_CODE};
+    uint8_t frame[SERIAL_FRAME_MAX_SIZE(sizeof(data))];
+    uint16_t frame_check_sequence;
+
+    int size = serial_frame_encode(sizeof(data), data, frame, &frame_check_sequence);
+    TEST_ASSERT_EQUAL_HEX16(0x56CC, frame_check_sequence);
+    TEST_ASSERT_EQUAL(sizeof(expected), size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, frame, sizeof(expected));
+}
+
+void test_encode_frame_check_sequence_matches_checksum(void) {
+    uint8_t data[301];
+    uint8_t frame[SERIAL_FRAME_MAX_SIZE(sizeof(data))];
+    uint16_t frame_check_sequence;
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (i % 11 == 0) ? FRAME_END_CODE : (uint8_t) (i * 29);
+    }
+    // Odd offsets and sizes exercise both byte lanes and the zero padding
+    for(int offset = 0; offset < 9; offset++){
+        serial_frame_encode(sizeof(data) - offset, &data[offset], frame, &frame_check_sequence);
+        TEST_ASSERT_EQUAL_HEX16(calculate_crc16(sizeof(data) - offset, &data[offset]), frame_check_sequence);
+    }
+}
+
+void test_encode_frame_from_multiple_buffers(void) {
+    uint8_t data[53];
+    uint8_t frame[SERIAL_FRAME_MAX_SIZE(sizeof(data))];
+    uint8_t expected[SERIAL_FRAME_MAX_SIZE(sizeof(data))];
+    uint16_t frame_check_sequence;
+    uint16_t expected_frame_check_sequence;
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (i % 7 == 0) ? ESCAPE_SEQ_CODE : (uint8_t) (i * 13);
+    }
+    int expected_size = serial_frame_encode(sizeof(data), data, expected, &expected_frame_check_sequence);
+    // Splits at odd offsets change the byte lane of the following buffers
+    for(int split = 0; split < (int) sizeof(data) - 3; split++){
+        mac_iovec_t iov[] = {
+            {.data = data, .size = split},
+            {.data = &data[split], .size = 3},
+            {.data = &data[split + 3], .size = sizeof(data) - split - 3}
+        };
+        int size = serial_frame_encodev(3, iov, frame, &frame_check_sequence);
+        TEST_ASSERT_EQUAL_HEX16(expected_frame_check_sequence, frame_check_sequence);
+        TEST_ASSERT_EQUAL(expected_size, size);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, frame, expected_size);
+    }
+}
+
+void test_decode_payload_reverses_encode(void) {
+    uint8_t data[300];
+    uint8_t encoded[sizeof(data) * 2];
+    uint8_t decoded[sizeof(data)];
+
+    for(int i = 0; i < (int) sizeof(data); i++){
+        data[i] = (i % 13 == 0) ? FRAME_START_CODE : (i % 17 == 0) ? ESCAPE_SEQ_CODE :
+                  (i % 19 == 0) ? FRAME_END_CODE : (uint8_t) (i * 7);
+    }
+    int encoded_size = serial_frame_encode_payload(sizeof(data), data, encoded);
+    int size = serial_frame_decode_payload(encoded_size, encoded, sizeof(decoded), decoded);
+    TEST_ASSERT_EQUAL(sizeof(data), size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, decoded, sizeof(data));
+}
+
+void test_decode_payload_in_place(void) {
+    uint8_t data[] = {ESCAPE_SEQ_CODE, 0x01, 0x02, FRAME_START_CODE, FRAME_END_CODE, ESCAPE_SEQ_CODE, 0x03};
+    uint8_t buffer[sizeof(data) * 2];
+
+    int encoded_size = serial_frame_encode_payload(sizeof(data), data, buffer);
+    int size = serial_frame_decode_payload(encoded_size, buffer, sizeof(buffer), buffer);
+    TEST_ASSERT_EQUAL(sizeof(data), size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, buffer, sizeof(data));
+}
+
+void test_decode_payload_invalid_escape_sequence(void) {
+    uint8_t invalid_code[] = {0x01, ESCAPE_SEQ_CODE, 0x02, 0x03};
+    uint8_t truncated[] = {0x01, 0x02, ESCAPE_SEQ_CODE};
+    uint8_t decoded[sizeof(invalid_code)];
+
+    TEST_ASSERT_EQUAL(-1, serial_frame_decode_payload(sizeof(invalid_code), invalid_code, sizeof(decoded), decoded));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, serial_frame_decode_payload(sizeof(truncated), truncated, sizeof(decoded), decoded));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+}
+
+void test_decode_payload_exceeds_buffer(void) {
+    uint8_t plain[] = {0x01, 0x02, 0x03, 0x04};
+    uint8_t escaped[] = {0x01, 0x02, 0x03, ESCAPE_SEQ_CODE, ESCAPE_SEQ_ESC_SEQ};
+    uint8_t decoded[3];
+
+    TEST_ASSERT_EQUAL(-1, serial_frame_decode_payload(sizeof(plain), plain, sizeof(decoded), decoded));
+    TEST_ASSERT_EQUAL(ENOBUFS, errno);
+    TEST_ASSERT_EQUAL(-1, serial_frame_decode_payload(sizeof(escaped), escaped, sizeof(decoded), decoded));
+    TEST_ASSERT_EQUAL(ENOBUFS, errno);
+    TEST_ASSERT_EQUAL(3, serial_frame_decode_payload(sizeof(plain) - 1, plain, sizeof(decoded), decoded));
+}
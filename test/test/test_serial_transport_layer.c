@@ -1,13 +1,17 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include "unity.h"
 #include "cmock.h"
 #include "transport/serial_transport.c"
+#include "serial_framing.h"
 #include "mock_mac_functions.h"
 #include "mock_timeout.h"
-#include "mock_checksum.h"
 #include "logging.h"
 
 static mac_t mock_mac;
+static transport_t mock_transport;
+static struct serial_transport_ctx *mock_ctx;
 static timeout_t mock_timer;
 
 void setUp(void) {
@@ -17,28 +21,34 @@ void setUp(void) {
     mock_mac.read = mac_read;
     mock_mac.write = mac_write;
     mock_mac.init = mac_init;
+    mock_mac.read_deadline = NULL;
+    mock_transport.mac = &mock_mac;
+    mock_ctx = calloc(1, sizeof(*mock_ctx) + SERIAL_FRAME_MAX_SIZE(MDFU_PACKET_DEFAULT_SIZE));
+    TEST_ASSERT_NOT_NULL(mock_ctx);
+    mock_ctx->packet_size = MDFU_PACKET_DEFAULT_SIZE;
+    mock_transport.ctx = mock_ctx;
     init_logging(stdout);
     set_debug_level(DEBUGLEVEL);
 }
 
 void tearDown(void) {
-    // This is run after EACH test
+    free(mock_ctx);
 }
 
 void test_init(void) {
-    int result = init(&mock_mac, 1000);
+    int result = init(&mock_transport, &mock_mac, 1000);
     TEST_ASSERT_EQUAL(0, result);
 }
 
 void test_open(void) {
-    mac_open_ExpectAndReturn(0);
-    int result = open();
+    mac_open_ExpectAndReturn(&mock_mac, 0);
+    int result = open(&mock_transport);
     TEST_ASSERT_EQUAL(0, result);
 }
 
 void test_close(void) {
-    mac_close_ExpectAndReturn(0);
-    int result = close();
+    mac_close_ExpectAndReturn(&mock_mac, 0);
+    int result = close(&mock_transport);
     TEST_ASSERT_EQUAL(0, result);
 }
 
@@ -46,7 +56,7 @@ void test_discard_until(void) {
     uint8_t code = FRAME_START_CODE;
     mac_read_ExpectAnyArgsAndReturn(1);
     mac_read_ReturnThruPtr_data(&code);
-    int result = discard_until(code, mock_timer);
+    int result = discard_until(&mock_transport, code, mock_timer);
     TEST_ASSERT_EQUAL(0, result);
 }
 
@@ -64,26 +74,34 @@ void test_process_byte(void) {
 void test_read_and_decode_until(void) {
     uint8_t data[16];
     uint8_t code = FRAME_END_CODE;
+    uint16_t checksum;
     mac_read_ExpectAnyArgsAndReturn(1);
     mac_read_ReturnThruPtr_data(&code);
-    ssize_t result = read_and_decode_until(16, data, mock_timer);
+    ssize_t result = read_and_decode_until(&mock_transport, 16, data, mock_timer, &checksum);
     TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL_HEX16(0xFFFF, checksum);
 }
 
-void test_encode_and_send(void) {
-    uint8_t data[1] = {FRAME_START_CODE};
-    uint8_t encoded_data[2] = {ESCAPE_SEQ_CODE, FRAME_START_ESC_SEQ};
-    mac_write_ExpectAndReturn(2, encoded_data, 0);
-    int result = encode_and_send(1, data);
-    TEST_ASSERT_EQUAL(0, result);
+int mac_read_callback(mac_t *mac, int size, uint8_t* data, int cmock_num_calls){
+    uint8_t frame[] = {FRAME_START_CODE, 0x00, 0x01, 0xFF, 0xFE, FRAME_END_CODE};
+    TEST_ASSERT_EQUAL(RX_BUFFER_SIZE, size);
+    TEST_ASSERT_EQUAL(1, cmock_num_calls);
+    memcpy(data, frame, sizeof(frame));
+    return sizeof(frame);
 }
 
-int mac_read_callback(int size, uint8_t* data, int cmock_num_calls){
-    uint8_t frame[] = {FRAME_START_CODE, 0x00, 0x01, 0x02, 0x03, FRAME_END_CODE};
-    TEST_ASSERT_EQUAL(1, size);
-    TEST_ASSERT(cmock_num_calls <= sizeof(frame));
-    *data = frame[cmock_num_calls - 1]; 
-    return 1;
+int mac_read_split_callback(mac_t *mac, int size, uint8_t* data, int cmock_num_calls){
+    // Noise, a frame split over two MAC reads and the start of the next frame
+    uint8_t part1[] = {0x11, FRAME_START_CODE, 0x00, ESCAPE_SEQ_CODE};
+    uint8_t part2[] = {FRAME_END_ESC_SEQ, 0xFF, 0x61, FRAME_END_CODE, FRAME_START_CODE, 0x04};
+
+    TEST_ASSERT(cmock_num_calls <= 2);
+    if(1 == cmock_num_calls){
+        memcpy(data, part1, sizeof(part1));
+        return sizeof(part1);
+    }
+    memcpy(data, part2, sizeof(part2));
+    return sizeof(part2);
 }
 
 bool timeout_expired_callback(timeout_t* timer, int cmock_num_calls){
@@ -97,25 +115,75 @@ void test_read(void) {
     mac_read_StubWithCallback(mac_read_callback);
     timeout_expired_StubWithCallback(timeout_expired_callback);
 
-    calculate_crc16_IgnoreAndReturn(0x0302);
-    int result = read(&size, data, 1.0);
+    int result = read(&mock_transport, &size, data, 1.0);
     TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL(2, size);
+}
+
+void test_read_checksum_mismatch(void) {
+    uint8_t data[MDFU_CMD_PACKET_MAX_SIZE];
+    uint8_t frame[] = {FRAME_START_CODE, 0x00, 0x01, 0xFF, 0xFF, FRAME_END_CODE};
+    int size;
+    set_timeout_IgnoreAndReturn(0);
+    mac_read_ExpectAnyArgsAndReturn(sizeof(frame));
+    mac_read_ReturnArrayThruPtr_data(frame, sizeof(frame));
+    timeout_expired_StubWithCallback(timeout_expired_callback);
+
+    int result = read(&mock_transport, &size, data, 1.0);
+    TEST_ASSERT_EQUAL(-1, result);
 }
 
 void test_write(void) {
     uint8_t data[1] = {0x01};
-    uint16_t checksum = 0x1234;
-    uint8_t frame_start_code = FRAME_START_CODE;
-    uint8_t frame_end_code = FRAME_END_CODE;
-    uint8_t encoded_checksum[2] = {0x34, 0x12};
-
-    calculate_crc16_ExpectAndReturn(1, data, checksum);
-    mac_write_ExpectAndReturn(1, &frame_start_code, 0);
-    mac_write_ExpectAndReturn(1, data, 0);
-    mac_write_ExpectAndReturn(1, &encoded_checksum[0], 0);
-    mac_write_ExpectAndReturn(1, &encoded_checksum[1], 0);
-    mac_write_ExpectAndReturn(1, &frame_end_code, 0);
-
-    int result = write(1, data);
+    uint8_t frame[] = {FRAME_START_CODE, 0x01, 0xFE, 0xFF, FRAME_END_CODE};
+
+    mac_write_ExpectAndReturn(&mock_mac, sizeof(frame), frame, sizeof(frame));
+
+    int result = write(&mock_transport, 1, data);
     TEST_ASSERT_EQUAL(0, result);
-}
\ No newline at end of file
+}
+
+void test_read_split_frame(void) {
+    uint8_t data[MDFU_CMD_PACKET_MAX_SIZE];
+    uint8_t expected[] = {0x00, FRAME_END_CODE};
+    int size;
+    set_timeout_IgnoreAndReturn(0);
+    mac_read_StubWithCallback(mac_read_split_callback);
+    timeout_expired_StubWithCallback(timeout_expired_callback);
+
+    int result = read(&mock_transport, &size, data, 1.0);
+    TEST_ASSERT_EQUAL(0, result);
+    TEST_ASSERT_EQUAL(2, size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, data, sizeof(expected));
+    // Start of the next frame is kept in the receive buffer
+    TEST_ASSERT_EQUAL(2, mock_ctx->rx_count - mock_ctx->rx_head);
+}
+
+int mac_read_deadline_callback(mac_t *mac, int size, uint8_t* data, int min_size, timeout_t *deadline, int cmock_num_calls){
+    uint8_t frame[] = {FRAME_START_CODE, 0x00, 0x01, 0xFF, 0xFE, FRAME_END_CODE};
+
+    if(1 == cmock_num_calls){
+        // Waiting for the frame start code
+        TEST_ASSERT_EQUAL(1, min_size);
+        data[0] = frame[0];
+        return 1;
+    }
+    // Waiting for the shortest valid frame after the start code
+    TEST_ASSERT_EQUAL(2, cmock_num_calls);
+    TEST_ASSERT_EQUAL(FRAME_MIN_DECODED_SIZE + FRAME_END_CODE_SIZE, min_size);
+    memcpy(data, &frame[1], sizeof(frame) - 1);
+    return sizeof(frame) - 1;
+}
+
+void test_read_with_deadline(void) {
+    uint8_t data[MDFU_CMD_PACKET_MAX_SIZE];
+    uint16_t checksum;
+
+    mock_mac.read_deadline = mac_read_deadline;
+    mac_read_deadline_StubWithCallback(mac_read_deadline_callback);
+    timeout_expired_StubWithCallback(timeout_expired_callback);
+
+    TEST_ASSERT_EQUAL(0, discard_until(&mock_transport, FRAME_START_CODE, mock_timer));
+    TEST_ASSERT_EQUAL(4, read_and_decode_until(&mock_transport, sizeof(data), data, mock_timer, &checksum));
+    TEST_ASSERT_EQUAL_HEX16(0xFEFF, checksum);
+}
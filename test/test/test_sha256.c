@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "mdfu/sha256.h"
+
+static sha256_t *sha;
+static uint8_t message[1000];
+
+/**
+ * @brief Finishes the digest and compares it to a hex string.
+ */
+static void assert_digest(const char *expected){
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+
+    sha256_final(sha, digest);
+    for(int i = 0; i < SHA256_DIGEST_SIZE; i++){
+        sprintf(&hex[2 * i], "%02x", digest[i]);
+    }
+    TEST_ASSERT_EQUAL_STRING(expected, hex);
+}
+
+static void update_string(const char *data){
+    sha256_update(sha, strlen(data), (const uint8_t *) data);
+}
+
+void setUp(void) {
+    TEST_ASSERT_EQUAL(0, sha256_create(&sha));
+    memset(message, 'a', sizeof(message));
+}
+
+void tearDown(void) {
+    sha256_destroy(sha);
+}
+
+void test_sha256_empty(void) {
+    assert_digest("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}
+
+void test_sha256_one_block(void) {
+    update_string("abc");
+    assert_digest("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+void test_sha256_two_blocks(void) {
+    update_string("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq");
+    assert_digest("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+void test_sha256_padding(void) {
+    // The length still fits into the last block with 55 bytes but not with 56
+    sha256_update(sha, 55, message);
+    assert_digest("9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318");
+    sha256_update(sha, 56, message);
+    assert_digest("b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a");
+    sha256_update(sha, 64, message);
+    assert_digest("ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb");
+}
+
+void test_sha256_split_updates(void) {
+    // Updates that end inside a block, complete a block and span several blocks
+    sha256_update(sha, 1, message);
+    sha256_update(sha, 62, message);
+    sha256_update(sha, 1, message);
+    sha256_update(sha, 55, message);
+    assert_digest("31eba51c313a5c08226adf18d4a359cfdfd8d2e816b13f4af952f7ea6584dcfb");
+
+    for(int i = 0; i < 1000; i++){
+        sha256_update(sha, sizeof(message), message);
+    }
+    assert_digest("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+void test_sha256_reset(void) {
+    update_string("discarded");
+    sha256_reset(sha);
+    update_string("abc");
+    assert_digest("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    // sha256_final starts a new digest
+    assert_digest("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}